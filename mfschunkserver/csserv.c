@@ -169,6 +169,21 @@ void csserv_stats(uint64_t *bin,uint64_t *bout,uint32_t *hlopr,uint32_t *hlopw,u
 	stats_maxjobscnt = 0;
 }
 
+void csserv_load(uint32_t *queue,uint32_t *reads) {
+	csserventry *eptr;
+	*reads = 0;
+	for (eptr=csservhead ; eptr ; eptr=eptr->next) {
+		if (eptr->state==READ) {
+			(*reads)++;
+		}
+	}
+#ifdef BGJOBS
+	*queue = job_pool_jobs_count(jpool);
+#else
+	*queue = 0;
+#endif
+}
+
 void* csserv_create_detached_packet(uint32_t type,uint32_t size) {
 	packetstruct *outpacket;
 	uint8_t *ptr;
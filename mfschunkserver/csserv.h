@@ -22,6 +22,7 @@
 #include <inttypes.h>
 
 void csserv_stats(uint64_t *bin,uint64_t *bout,uint32_t *hlopr,uint32_t *hlopw,uint32_t *maxjobscnt);
+void csserv_load(uint32_t *queue,uint32_t *reads);
 // void csserv_cstocs_connected(void *e,void *cptr);
 // void csserv_cstocs_gotstatus(void *e,uint64_t chunkid,uint32_t writeid,uint8_t s);
 // void csserv_cstocs_disconnected(void *e);
@@ -88,6 +88,12 @@
 #define DHASHSIZE 64
 #define DHASHPOS(chunkid) ((chunkid)&0x3F)
 
+#define RHASHSIZE 65536
+#define RHASHPOS(chunkid) ((chunkid)&0xFFFF)
+
+// more changed chunks than that and registration can't be resumed
+#define REGCHANGESLIMIT 1000000
+
 #define CH_NEW_NONE 0
 #define CH_NEW_AUTO 1
 #define CH_NEW_EXCLUSIVE 2
@@ -117,6 +123,12 @@ typedef struct dopchunk {
 	struct dopchunk *next;
 } dopchunk;
 
+typedef struct regchunk {
+	uint64_t chunkid;
+	uint32_t gen;
+	struct regchunk *next;
+} regchunk;
+
 struct folder;
 
 typedef struct ioerror {
@@ -242,6 +254,12 @@ static newchunk *newchunks = NULL;
 static uint32_t errorcounter = 0;
 static int hddspacechanged = 0;
 
+// chunks changed since registration epoch (epoch==0 - changes are not tracked)
+static regchunk* reghashtab[RHASHSIZE];
+static uint32_t regchunks = 0;
+static uint32_t reggen = 0;
+static uint32_t regepoch = 0;
+
 static pthread_attr_t thattr;
 
 static pthread_t foldersthread,delayedthread,testerthread;
@@ -262,6 +280,9 @@ static pthread_mutex_t dclock = PTHREAD_MUTEX_INITIALIZER;
 
 // hashtab - only hash tab, chunks have their own separate locks
 static pthread_mutex_t hashlock = PTHREAD_MUTEX_INITIALIZER;
+
+// reghashtab + regepoch - always locked after hashlock
+static pthread_mutex_t reglock = PTHREAD_MUTEX_INITIALIZER;
 static cntcond *cclist = NULL;
 
 // folderhead + all data in structures
@@ -295,6 +316,10 @@ static uint32_t stats_dataopw = 0;
 static uint64_t stats_rtime = 0;
 static uint64_t stats_wtime = 0;
 
+// read latency reported to master (separate, because stats_X are cleared by charts)
+static uint64_t load_rtime = 0;
+static uint32_t load_opr = 0;
+
 static uint32_t stats_create = 0;
 static uint32_t stats_delete = 0;
 static uint32_t stats_test = 0;
@@ -504,6 +529,154 @@ void hdd_get_new_chunk_data(uint8_t *buff,uint32_t limit) {
 	zassert(pthread_mutex_unlock(&dclock));
 }
 
+/* registration epochs:
+   master remembers chunks of disconnected server together with last epoch received from it, so after
+   reconnection only chunks changed since that epoch have to be sent. Epoch is rotated periodically and
+   changes from two last epochs are kept (master may not know the newest one yet). */
+
+static void hdd_regchanges_clear(void) {
+	uint32_t i;
+	regchunk *rc,*nrc;
+	for (i=0 ; i<RHASHSIZE ; i++) {
+		for (rc=reghashtab[i] ; rc ; rc=nrc) {
+			nrc = rc->next;
+			free(rc);
+		}
+		reghashtab[i] = NULL;
+	}
+	regchunks = 0;
+}
+
+static void hdd_regchanged(uint64_t chunkid) {
+	uint32_t hashpos = RHASHPOS(chunkid);
+	regchunk *rc;
+	zassert(pthread_mutex_lock(&reglock));
+	if (regepoch==0) {
+		zassert(pthread_mutex_unlock(&reglock));
+		return;
+	}
+	for (rc=reghashtab[hashpos] ; rc ; rc=rc->next) {
+		if (rc->chunkid==chunkid) {
+			rc->gen = reggen;
+			zassert(pthread_mutex_unlock(&reglock));
+			return;
+		}
+	}
+	if (regchunks>=REGCHANGESLIMIT) {
+		hdd_regchanges_clear();
+		regepoch = 0;
+		zassert(pthread_mutex_unlock(&reglock));
+		return;
+	}
+	rc = malloc(sizeof(regchunk));
+	passert(rc);
+	rc->chunkid = chunkid;
+	rc->gen = reggen;
+	rc->next = reghashtab[hashpos];
+	reghashtab[hashpos] = rc;
+	regchunks++;
+	zassert(pthread_mutex_unlock(&reglock));
+}
+
+static uint32_t hdd_regepoch_new(void) {
+	uint32_t epoch;
+	do {
+		epoch = rndu32();
+	} while (epoch==0 || epoch==regepoch);
+	return epoch;
+}
+
+uint32_t hdd_regepoch_get(void) {
+	uint32_t epoch;
+	zassert(pthread_mutex_lock(&reglock));
+	epoch = regepoch;
+	zassert(pthread_mutex_unlock(&reglock));
+	return epoch;
+}
+
+// starts new epoch - changes older than previous epoch are forgotten
+uint32_t hdd_regepoch_rotate(void) {
+	uint32_t i,epoch;
+	regchunk *rc,**rcptr;
+	zassert(pthread_mutex_lock(&reglock));
+	if (regepoch!=0) {
+		for (i=0 ; i<RHASHSIZE ; i++) {
+			rcptr = &(reghashtab[i]);
+			while ((rc=*rcptr)) {
+				if (rc->gen!=reggen) {
+					*rcptr = rc->next;
+					free(rc);
+					regchunks--;
+				} else {
+					rcptr = &(rc->next);
+				}
+			}
+		}
+		reggen++;
+		regepoch = hdd_regepoch_new();
+	}
+	epoch = regepoch;
+	zassert(pthread_mutex_unlock(&reglock));
+	return epoch;
+}
+
+void hdd_get_regchanges_begin(void) {
+	zassert(pthread_mutex_lock(&hashlock));
+	zassert(pthread_mutex_lock(&reglock));
+}
+
+void hdd_get_regchanges_end(void) {
+	zassert(pthread_mutex_unlock(&reglock));
+	zassert(pthread_mutex_unlock(&hashlock));
+}
+
+// no locks - locked by hdd_get_regchanges_begin
+static inline chunk* hdd_regchanges_chunk(uint64_t chunkid) {
+	chunk *c;
+	for (c=hashtab[HASHPOS(chunkid)] ; c && c->chunkid!=chunkid ; c=c->next) {}
+	if (c!=NULL && (c->state==CH_DELETED || c->state==CH_TOBEDELETED)) {
+		return NULL;
+	}
+	return c;
+}
+
+void hdd_get_regchanges_count(uint32_t *changedcount,uint32_t *lostcount) {
+	uint32_t i;
+	regchunk *rc;
+	*changedcount = 0;
+	*lostcount = 0;
+	for (i=0 ; i<RHASHSIZE ; i++) {
+		for (rc=reghashtab[i] ; rc ; rc=rc->next) {
+			if (hdd_regchanges_chunk(rc->chunkid)) {
+				(*changedcount)++;
+			} else {
+				(*lostcount)++;
+			}
+		}
+	}
+}
+
+void hdd_get_regchanges_data(uint8_t *changedbuff,uint8_t *lostbuff) {
+	uint32_t i,v;
+	regchunk *rc;
+	chunk *c;
+	for (i=0 ; i<RHASHSIZE ; i++) {
+		for (rc=reghashtab[i] ; rc ; rc=rc->next) {
+			c = hdd_regchanges_chunk(rc->chunkid);
+			if (c) {
+				put64bit(&changedbuff,c->chunkid);
+				v = c->version;
+				if (c->todel) {
+					v |= 0x80000000;
+				}
+				put32bit(&changedbuff,v);
+			} else {
+				put64bit(&lostbuff,rc->chunkid);
+			}
+		}
+	}
+}
+
 uint32_t hdd_errorcounter(void) {
 	uint32_t result;
 	zassert(pthread_mutex_lock(&dclock));
@@ -547,6 +720,17 @@ void hdd_stats(uint64_t *br,uint64_t *bw,uint32_t *opr,uint32_t *opw,uint32_t *d
 	zassert(pthread_mutex_unlock(&statslock));
 }
 
+// average block read time (in microseconds) since last call
+uint32_t hdd_get_rlatency(void) {
+	uint32_t result;
+	zassert(pthread_mutex_lock(&statslock));
+	result = (load_opr>0)?load_rtime/load_opr:0;
+	load_rtime = 0;
+	load_opr = 0;
+	zassert(pthread_mutex_unlock(&statslock));
+	return result;
+}
+
 void hdd_op_stats(uint32_t *op_create,uint32_t *op_delete,uint32_t *op_version,uint32_t *op_duplicate,uint32_t *op_truncate,uint32_t *op_duptrunc,uint32_t *op_test) {
 	zassert(pthread_mutex_lock(&statslock));
 	*op_create = stats_create;
@@ -588,6 +772,8 @@ static inline void hdd_stats_dataread(folder *f,uint32_t size,int64_t rtime) {
 	stats_dataopr++;
 	stats_databytesr += size;
 	stats_rtime += rtime;
+	load_opr++;
+	load_rtime += rtime;
 	f->cstat.rops++;
 	f->cstat.rbytes += size;
 	f->cstat.usecreadsum += rtime;
@@ -763,6 +949,7 @@ void hdd_diskinfo_movestats(void) {
 static inline void hdd_chunk_remove(chunk *c) {
 	chunk **cptr,*cp;
 	uint32_t hashpos = HASHPOS(c->chunkid);
+	hdd_regchanged(c->chunkid);
 	cptr = &(hashtab[hashpos]);
 	while ((cp=*cptr)) {
 		if (c==cp) {
@@ -903,6 +1090,7 @@ static chunk* hdd_chunk_get(uint64_t chunkid,uint8_t cflag) {
 			c->testprev = NULL;
 			c->next = hashtab[hashpos];
 			hashtab[hashpos] = c;
+			hdd_regchanged(chunkid);
 		}
 //		syslog(LOG_WARNING,"hdd_chunk_get returns chunk: %016"PRIX64" (c->state:%u)",c->chunkid,c->state);
 		zassert(pthread_mutex_unlock(&hashlock));
@@ -981,6 +1169,7 @@ static chunk* hdd_chunk_get(uint64_t chunkid,uint8_t cflag) {
 				c->validattr = 0;
 				c->todel = 0;
 				c->state = CH_LOCKED;
+				hdd_regchanged(chunkid);
 //				syslog(LOG_WARNING,"hdd_chunk_get returns chunk: %016"PRIX64" (c->state:%u)",c->chunkid,c->state);
 				zassert(pthread_mutex_unlock(&hashlock));
 				return c;
@@ -1025,6 +1214,7 @@ static void hdd_chunk_delete(chunk *c) {
 	folder *f;
 	zassert(pthread_mutex_lock(&hashlock));
 	f = c->owner;
+	hdd_regchanged(c->chunkid);
 	if (c->ccond) {
 		c->state = CH_DELETED;
 //		printf("wake up one thread waiting for DELETED chunk: %"PRIu64" ccond:%p\n",c->chunkid,c->ccond);
@@ -1214,6 +1404,9 @@ void hdd_senddata(folder *f,int rmflag) {
 		cptr = &(hashtab[i]);
 		while ((c=*cptr)) {
 			if (c->owner==f) {
+				if (c->todel!=todel) {
+					hdd_regchanged(c->chunkid);
+				}
 				c->todel = todel;
 				if (rmflag) {
 					hdd_report_lost_chunk(c->chunkid);
@@ -1411,8 +1604,14 @@ static inline void hdd_error_occured(chunk *c) {
 #define CHUNKS_CUT_COUNT 10000
 static uint32_t hdd_get_chunks_pos;
 
+// all chunks are sent, so changes are tracked from now on (new epoch)
 void hdd_get_chunks_begin() {
 	zassert(pthread_mutex_lock(&hashlock));
+	zassert(pthread_mutex_lock(&reglock));
+	hdd_regchanges_clear();
+	reggen = 0;
+	regepoch = hdd_regepoch_new();
+	zassert(pthread_mutex_unlock(&reglock));
 	hdd_get_chunks_pos = 0;
 }
 
@@ -2739,6 +2938,7 @@ static int hdd_int_duplicate(uint64_t chunkid,uint32_t version,uint32_t newversi
 		}
 		hdd_stats_write(4);
 		oc->version = newversion;
+		hdd_regchanged(oc->chunkid);
 	} else {
 		status = hdd_io_begin(oc,0);
 		if (status!=STATUS_OK) {
@@ -2909,6 +3109,7 @@ static int hdd_int_version(uint64_t chunkid,uint32_t version,uint32_t newversion
 	}
 	hdd_stats_write(4);
 	c->version = newversion;
+	hdd_regchanged(c->chunkid);
 	status = hdd_io_end(c);
 	if (status!=STATUS_OK) {
 		hdd_error_occured(c);	// uses and preserves errno !!!
@@ -2988,6 +3189,7 @@ static int hdd_int_truncate(uint64_t chunkid,uint32_t version,uint32_t newversio
 	}
 	hdd_stats_write(4);
 	c->version = newversion;
+	hdd_regchanged(c->chunkid);
 	// step 2. truncate
 	blocks = ((length+MFSBLOCKMASK)>>MFSBLOCKBITS);
 	if (blocks>c->blocks) {
@@ -3179,6 +3381,7 @@ static int hdd_int_duptrunc(uint64_t chunkid,uint32_t version,uint32_t newversio
 		}
 		hdd_stats_write(4);
 		oc->version = newversion;
+		hdd_regchanged(oc->chunkid);
 	} else {
 		status = hdd_io_begin(oc,0);
 		if (status!=STATUS_OK) {
@@ -3820,6 +4023,7 @@ static inline void hdd_add_chunk(folder *f,const char *fullname,uint64_t chunkid
 			c->blocks = 0; // (sb.st_size - CHUNKHDRSIZE) / MFSBLOCKSIZE;
 			c->owner = f;
 			c->todel = todel;
+			hdd_regchanged(chunkid);
 //			c->testtime = (sb.st_atime>sb.st_mtime)?sb.st_atime:sb.st_mtime;
 			zassert(pthread_mutex_lock(&testlock));
 			// remove from previous chain
@@ -26,6 +26,7 @@
 void hdd_stats(uint64_t *br,uint64_t *bw,uint32_t *opr,uint32_t *opw,uint32_t *dbr,uint32_t *dbw,uint32_t *dopr,uint32_t *dopw,uint64_t *rtime,uint64_t *wtime);
 void hdd_op_stats(uint32_t *op_create,uint32_t *op_delete,uint32_t *op_version,uint32_t *op_duplicate,uint32_t *op_truncate,uint32_t *op_duptrunc,uint32_t *op_test);
 uint32_t hdd_errorcounter(void);
+uint32_t hdd_get_rlatency(void);
 
 /* lock/unlock pair */
 uint32_t hdd_get_damaged_chunk_count(void);
@@ -48,6 +49,14 @@ uint32_t hdd_get_chunks_next_list_count();
 void hdd_get_chunks_next_list_data(uint8_t *buff);
 //uint32_t hdd_get_chunks_count();
 //void hdd_get_chunks_data(uint8_t *buff);
+/* registration epochs */
+uint32_t hdd_regepoch_get(void);
+uint32_t hdd_regepoch_rotate(void);
+/* lock/unlock pair */
+void hdd_get_regchanges_begin(void);
+void hdd_get_regchanges_end(void);
+void hdd_get_regchanges_count(uint32_t *changedcount,uint32_t *lostcount);
+void hdd_get_regchanges_data(uint8_t *changedbuff,uint8_t *lostbuff);
 
 //uint32_t get_changedchunkscount();
 //void fill_changedchunksinfo(uint8_t *buff);
@@ -55,6 +55,13 @@
 // has to be less than MaxPacketSize on master side divided by 12
 #define NEWCHUNKLIMIT 25000
 
+// registration epoch is changed that often (in seconds)
+#define REGEPOCH_ROTATE 60
+// when master doesn't understand resume request then full registration is used for that long (in seconds)
+#define NORESUME_TIME 3600
+// load (used by master for ordering chunk locations) is sent that often (in seconds)
+#define LOAD_REPORT_PERIOD 1
+
 // mode
 enum {FREE,CONNECTING,HEADER,DATA,KILL};
 
@@ -77,6 +84,8 @@ typedef struct masterconn {
 	uint32_t masterip;
 	uint16_t masterport;
 	uint8_t masteraddrvalid;
+	uint8_t resuming;	// waiting for MATOCS_RESUME_STATUS
+	uint8_t resumeok;	// master knows registration epochs and load reports
 } masterconn;
 
 static masterconn *masterconnsingleton=NULL;
@@ -93,6 +102,7 @@ static char *MasterPort;
 static char *BindHost;
 static uint32_t Timeout;
 static void* reconnect_hook;
+static uint32_t noresumeuntil = 0;
 
 static uint64_t stats_bytesout=0;
 static uint64_t stats_bytesin=0;
@@ -166,14 +176,33 @@ uint8_t* masterconn_create_attached_packet(masterconn *eptr,uint32_t type,uint32
 	return ptr;
 }
 
-void masterconn_sendregister(masterconn *eptr) {
+void masterconn_sendregister_end(masterconn *eptr) {
 	uint8_t *buff;
-	uint32_t chunks,myip;
-	uint16_t myport;
 	uint64_t usedspace,totalspace;
 	uint64_t tdusedspace,tdtotalspace;
 	uint32_t chunkcount,tdchunkcount;
 
+	if (eptr->resumeok) {
+		buff = masterconn_create_attached_packet(eptr,CSTOMA_REGISTER,1+4);
+		put8bit(&buff,53);
+		put32bit(&buff,hdd_regepoch_get());
+	}
+	hdd_get_space(&usedspace,&totalspace,&chunkcount,&tdusedspace,&tdtotalspace,&tdchunkcount);
+	buff = masterconn_create_attached_packet(eptr,CSTOMA_REGISTER,1+8+8+4+8+8+4);
+	put8bit(&buff,52);
+	put64bit(&buff,usedspace);
+	put64bit(&buff,totalspace);
+	put32bit(&buff,chunkcount);
+	put64bit(&buff,tdusedspace);
+	put64bit(&buff,tdtotalspace);
+	put32bit(&buff,tdchunkcount);
+}
+
+void masterconn_sendregister_full(masterconn *eptr) {
+	uint8_t *buff;
+	uint32_t chunks,myip;
+	uint16_t myport;
+
 	myip = csserv_getlistenip();
 	myport = csserv_getlistenport();
 	buff = masterconn_create_attached_packet(eptr,CSTOMA_REGISTER,1+4+4+2+2);
@@ -191,15 +220,99 @@ void masterconn_sendregister(masterconn *eptr) {
 		hdd_get_chunks_next_list_data(buff);
 	}
 	hdd_get_chunks_end();
-	hdd_get_space(&usedspace,&totalspace,&chunkcount,&tdusedspace,&tdtotalspace,&tdchunkcount);
-	buff = masterconn_create_attached_packet(eptr,CSTOMA_REGISTER,1+8+8+4+8+8+4);
-	put8bit(&buff,52);
-	put64bit(&buff,usedspace);
-	put64bit(&buff,totalspace);
-	put32bit(&buff,chunkcount);
-	put64bit(&buff,tdusedspace);
-	put64bit(&buff,tdtotalspace);
-	put32bit(&buff,tdchunkcount);
+	masterconn_sendregister_end(eptr);
+}
+
+// only chunks changed since given epoch are sent (master still has the rest)
+void masterconn_sendregister_changes(masterconn *eptr) {
+	uint8_t *buff,*lbuff;
+	uint32_t changed,lost;
+
+	hdd_get_regchanges_begin();
+	hdd_get_regchanges_count(&changed,&lost);
+	buff = NULL;
+	lbuff = NULL;
+	if (changed>0) {
+		buff = masterconn_create_attached_packet(eptr,CSTOMA_REGISTER,1+changed*(8+4));
+		put8bit(&buff,61);
+	}
+	if (lost>0) {
+		lbuff = masterconn_create_attached_packet(eptr,CSTOMA_REGISTER,1+lost*8);
+		put8bit(&lbuff,62);
+	}
+	hdd_get_regchanges_data(buff,lbuff);
+	hdd_get_regchanges_end();
+	syslog(LOG_NOTICE,"registration resumed - changed chunks: %"PRIu32", lost chunks: %"PRIu32,changed,lost);
+	hdd_regepoch_rotate();
+	masterconn_sendregister_end(eptr);
+}
+
+void masterconn_sendregister(masterconn *eptr) {
+	uint8_t *buff;
+	uint32_t myip;
+	uint16_t myport;
+
+	if (main_time()<noresumeuntil) {
+		masterconn_sendregister_full(eptr);
+		return;
+	}
+	myip = csserv_getlistenip();
+	myport = csserv_getlistenport();
+	buff = masterconn_create_attached_packet(eptr,CSTOMA_REGISTER,1+4+4+2+2+4);
+	put8bit(&buff,60);
+	put16bit(&buff,VERSMAJ);
+	put8bit(&buff,VERSMID);
+	put8bit(&buff,VERSMIN);
+	put32bit(&buff,myip);
+	put16bit(&buff,myport);
+	put16bit(&buff,Timeout);
+	put32bit(&buff,hdd_regepoch_get());
+	eptr->resuming = 1;
+}
+
+void masterconn_resume_status(masterconn *eptr,const uint8_t *data,uint32_t length) {
+	uint8_t status;
+	if (length!=1) {
+		syslog(LOG_NOTICE,"MATOCS_RESUME_STATUS - wrong size (%"PRIu32"/1)",length);
+		eptr->mode = KILL;
+		return;
+	}
+	if (eptr->resuming==0) {
+		syslog(LOG_NOTICE,"MATOCS_RESUME_STATUS - unexpected packet");
+		eptr->mode = KILL;
+		return;
+	}
+	status = get8bit(&data);
+	eptr->resuming = 0;
+	eptr->resumeok = 1;
+	if (status==0) {
+		masterconn_sendregister_changes(eptr);
+	} else {
+		masterconn_sendregister_full(eptr);
+	}
+}
+
+void masterconn_sendload(void) {
+	masterconn *eptr = masterconnsingleton;
+	uint8_t *buff;
+	uint32_t queue,reads;
+	if ((eptr->mode==DATA || eptr->mode==HEADER) && eptr->resumeok && eptr->resuming==0) {
+		csserv_load(&queue,&reads);
+		buff = masterconn_create_attached_packet(eptr,CSTOMA_LOAD,4+4+4);
+		put32bit(&buff,queue);
+		put32bit(&buff,reads);
+		put32bit(&buff,hdd_get_rlatency());
+	}
+}
+
+void masterconn_regepoch_rotate(void) {
+	masterconn *eptr = masterconnsingleton;
+	uint8_t *buff;
+	if ((eptr->mode==DATA || eptr->mode==HEADER) && eptr->resumeok && eptr->resuming==0) {
+		buff = masterconn_create_attached_packet(eptr,CSTOMA_REGISTER,1+4);
+		put8bit(&buff,53);
+		put32bit(&buff,hdd_regepoch_rotate());
+	}
 }
 
 /*
@@ -291,7 +404,7 @@ void masterconn_check_hdd_reports() {
 	uint32_t errorcounter;
 	uint32_t chunkcounter;
 	uint8_t *buff;
-	if (eptr->mode==DATA || eptr->mode==HEADER) {
+	if ((eptr->mode==DATA || eptr->mode==HEADER) && eptr->resuming==0) {
 		if (hdd_spacechanged()) {
 			uint64_t usedspace,totalspace,tdusedspace,tdtotalspace;
 			uint32_t chunkcount,tdchunkcount;
@@ -849,6 +962,9 @@ void masterconn_gotpacket(masterconn *eptr,uint32_t type,const uint8_t *data,uin
 		case ANTOCS_CHUNK_CHECKSUM_TAB:
 			masterconn_chunk_checksum_tab(eptr,data,length);
 			break;
+		case MATOCS_RESUME_STATUS:
+			masterconn_resume_status(eptr,data,length);
+			break;
 		default:
 			syslog(LOG_NOTICE,"got unknown message (type:%"PRIu32")",type);
 			eptr->mode = KILL;
@@ -897,6 +1013,8 @@ void masterconn_connected(masterconn *eptr) {
 	eptr->inputpacket.packet = NULL;
 	eptr->outputhead = NULL;
 	eptr->outputtail = &(eptr->outputhead);
+	eptr->resuming = 0;
+	eptr->resumeok = 0;
 
 	masterconn_sendregister(eptr);
 	eptr->lastread = eptr->lastwrite = main_time();
@@ -1203,6 +1321,11 @@ void masterconn_serve(struct pollfd *pdesc) {
 			pptr = pptr->next;
 			free(paptr);
 		}
+		if (eptr->resuming) {	// probably old master - don't try again for some time
+			syslog(LOG_NOTICE,"connection lost while resuming registration - using full registration for next %u seconds",NORESUME_TIME);
+			noresumeuntil = main_time()+NORESUME_TIME;
+			eptr->resuming = 0;
+		}
 		eptr->mode = FREE;
 	}
 }
@@ -1290,6 +1413,8 @@ int masterconn_init(void) {
 	eptr->masteraddrvalid = 0;
 	eptr->mode = FREE;
 	eptr->pdescpos = -1;
+	eptr->resuming = 0;
+	eptr->resumeok = 0;
 //	logfd = NULL;
 
 	if (masterconn_initconnect(eptr)<0) {
@@ -1303,7 +1428,9 @@ int masterconn_init(void) {
 	}
 #endif
 
-	main_eachloopregister(masterconn_check_hdd_reports);
+	main_msectimeregister(TIMEMODE_SKIP_LATE,50,0,masterconn_check_hdd_reports);	// hdd threads don't wake up main loop
+	main_timeregister(TIMEMODE_RUN_LATE,REGEPOCH_ROTATE,0,masterconn_regepoch_rotate);
+	main_timeregister(TIMEMODE_SKIP_LATE,LOAD_REPORT_PERIOD,0,masterconn_sendload);
 	reconnect_hook = main_timeregister(TIMEMODE_RUN_LATE,ReconnectionDelay,rndu32_ranged(ReconnectionDelay),masterconn_reconnect);
 	main_destructregister(masterconn_term);
 	main_pollregister(masterconn_desc,masterconn_serve);
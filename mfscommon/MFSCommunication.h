@@ -115,7 +115,9 @@
 #define ERROR_ENOTSUP         39        // Operation not supported
 #define ERROR_ERANGE          40        // Result too large
 
-#define ERROR_MAX             41
+#define ERROR_NOTFRESH        41        // Shadow master is not up to date
+
+#define ERROR_MAX             42
 
 #define ERROR_STRINGS \
 	"OK", \
@@ -159,6 +161,7 @@
 	"Attribute not found", \
 	"Operation not supported", \
 	"Result too large", \
+	"Shadow master is not up to date", \
 	"Unknown MFS error"
 
 /* type for readdir command */
@@ -211,6 +214,7 @@
 #define SMODE_TMASK            3
 #define SMODE_RMASK            4
 #define SMODE_ISVALID(x)       (((x)&SMODE_TMASK)!=3 && ((uint32_t)(x))<=7)
+#define SMODE_BACKGROUND       8	// (only in requests) client accepts answer with id of background job instead of waiting for its end
 
 // gmode:
 #define GMODE_NORMAL           0
@@ -259,6 +263,7 @@
 // getdir:
 #define GETDIR_FLAG_WITHATTR   0x01
 #define GETDIR_FLAG_ADDTOCACHE 0x02
+#define GETDIR_FLAG_PAGED      0x04
 
 // register sesflags:
 #define SESFLAG_READONLY       0x01	// meaning is obvious
@@ -347,12 +352,31 @@
 // rver:8
 // 	rver==1:
 // 		version:32 timeout:16
+// 	rver==2:
+// 		version:32 timeout:16 minversion:64
+// 	rver==3: (metalogger accepts binary records)
+// 		version:32 timeout:16 minversion:64
+//		minversion==0 - no old changes needed
+// 	rver==4: (shadow master - as rver==3, additionally receives MATOML_CURRENT_VERSION)
+// 		version:32 timeout:16 minversion:64
+// 	rver==5: (as rver==3, metalogger also accepts LOG_BATCH)
+// 		version:32 timeout:16 minversion:64 flags:8
 
 // 0x0033
 #define MATOML_METACHANGES_LOG (PROTO_BASE+51)
 // 0xFF:8 version:64 logdata:string ( N*[ char:8 ] ) = LOG_DATA
+// 0xFE:8 record:( size:32 version:64 timestamp:32 opcode:8 data:(size-21)B crc:32 ) = LOG_RECORD (binary changelog record - see changelogbin.h)
+// 0xFD:8 records:32 rawsize:32 compressed:8 data:( rawsize B of LOG_RECORD's or zlib stream when compressed==1 ) = LOG_BATCH
 // 0x55:8 = LOG_ROTATE
 
+// MLTOMA_REGISTER (rver==5) flags
+#define MLFLAG_BATCH 0x01
+#define MLFLAG_ZLIB 0x02
+
+// 0x0034
+#define MATOML_CURRENT_VERSION (PROTO_BASE+52)
+// version:64 totalspace:64 availspace:64 (sent periodically to shadow masters - version is the next metadata version to be assigned)
+
 // 0x003C
 #define MLTOMA_DOWNLOAD_START (PROTO_BASE+60)
 // -
@@ -376,6 +400,29 @@
 
 
 
+// CLIENT <-> SHADOW MASTER
+
+// 0x0046
+#define CLTOSH_REGISTER (PROTO_BASE+70)
+// rcode==1 (REGISTER_GETRANDOM):
+//  msgid:32 rcode:8
+// rcode==2 (REGISTER_NEWSESSION):
+//  msgid:32 rcode:8 version:32 pleng:32 path:plengB [ passcode:16B ]
+// (client is checked against exports in the same way as in CLTOMA_FUSE_REGISTER)
+
+// 0x0047
+#define SHTOCL_REGISTER (PROTO_BASE+71)
+// rcode==1 (REGISTER_GETRANDOM):
+//  msgid:32 randomblob:32B
+// rcode==2 (REGISTER_NEWSESSION):
+//  msgid:32 status:8
+
+// after registration shadow master accepts CLTOMA_FUSE_STATFS, CLTOMA_FUSE_LOOKUP, CLTOMA_FUSE_GETATTR,
+// CLTOMA_FUSE_READLINK, CLTOMA_FUSE_GETDIR and CLTOMA_FUSE_GETXATTR and answers them with corresponding
+// MATOCL_* packets (status ERROR_NOTFRESH means that client should ask master instead)
+
+
+
 
 
 // CHUNKSERVER <-> MASTER
@@ -401,6 +448,15 @@
 //      	N*[chunkid:64 version:32]
 //      rver==52:	// version 5 / END
 //      	usedspace:64 totalspace:64 chunks:32 tdusedspace:64 tdtotalspace:64 tdchunks:32
+//      rver==53:	// version 5 / EPOCH (sent before END and then periodically - changes made before it are known to master)
+//      	epoch:32
+// - resume (after short disconnection - master answers with MATOCS_RESUME_STATUS, then CS sends CHANGED, LOST, EPOCH and END or full registration):
+//      rver==60:	// RESUME / BEGIN
+//      	version:32 myip:32 myport:16 tcptimeout:16 epoch:32
+//      rver==61:	// RESUME / CHANGED (chunks created or modified since epoch)
+//      	N*[chunkid:64 version:32]
+//      rver==62:	// RESUME / LOST (chunks removed since epoch)
+//      	N*[chunkid:64]
 
 // 0x0065
 #define CSTOMA_SPACE (PROTO_BASE+101)
@@ -433,6 +489,14 @@
 #define CSTOMA_CHUNK_NEW (PROTO_BASE+107)
 // N*[ chunkid:64 version:32 ]
 
+// 0x006C
+#define MATOCS_RESUME_STATUS (PROTO_BASE+108)
+// status:8 (0 - master has chunks from given epoch, so only changes have to be sent ; otherwise full registration is needed)
+
+// 0x006D
+#define CSTOMA_LOAD (PROTO_BASE+109)
+// queue:32 (I/O jobs waiting) reads:32 (client reads in progress) rlatency:32 (average block read time in microseconds)
+
 // 0x006E
 #define MATOCS_CREATE (PROTO_BASE+110)
 // chunkid:64 version:32
@@ -792,12 +856,15 @@
 #define CLTOMA_FUSE_GETDIR (PROTO_BASE+428)
 // msgid:32 inode:32 uid:32 gid:32 - old version (works like new version with flags==0)
 // msgid:32 inode:32 uid:32 gid:32 flags:8
+// msgid:32 inode:32 uid:32 gid:32 flags:8 cursor:64 - next page (GETDIR_FLAG_PAGED has to be set, first page is always requested by previous version with cursor 0)
 
 // 0x01AD
 #define MATOCL_FUSE_GETDIR (PROTO_BASE+429)
 // msgid:32 status:8
 // msgid:32 N*[ name:NAME inode:32 type:8 ]	- when GETDIR_FLAG_WITHATTR in flags is not set
 // msgid:32 N*[ name:NAME inode:32 attr:35B ]	- when GETDIR_FLAG_WITHATTR in flags is set
+// msgid:32 0:8 nextcursor:64 N*[ name:NAME inode:32 type:8 | attr:35B ] - when GETDIR_FLAG_PAGED in flags is set (nextcursor==0 - last page)
+//	(older masters ignore GETDIR_FLAG_PAGED and send whole directory - such answer always starts with '.' entry, so first byte is never 0)
 
 
 // 0x01AE
@@ -880,6 +947,7 @@
 #define MATOCL_FUSE_SETTRASHTIME (PROTO_BASE+445)
 // msgid:32 status:8
 // msgid:32 changed:32 notchanged:32 notpermitted:32
+// msgid:32 status:8 jobid:32 (status==ERROR_DELAYED - only when SMODE_BACKGROUND was set - see CLTOMA_FSJOBS_INFO)
 
 
 // 0x01BE
@@ -900,6 +968,7 @@
 #define MATOCL_FUSE_SETGOAL (PROTO_BASE+449)
 // msgid:32 status:8
 // msgid:32 changed:32 notchanged:32 notpermitted:32
+// msgid:32 status:8 jobid:32 (status==ERROR_DELAYED - only when SMODE_BACKGROUND was set - see CLTOMA_FSJOBS_INFO)
 
 
 // 0x01C2
@@ -1026,6 +1095,7 @@
 #define MATOCL_FUSE_SETEATTR (PROTO_BASE+475)
 // msgid:32 status:8
 // msgid:32 changed:32 notchanged:32 notpermitted:32
+// msgid:32 status:8 jobid:32 (status==ERROR_DELAYED - only when SMODE_BACKGROUND was set - see CLTOMA_FSJOBS_INFO)
 
 
 // 0x01DC
@@ -1172,6 +1242,12 @@
 // 	totalspace:64 availspace:64 trashspace:64 trashnodes:32 reservedspace:64 reservednodes:32 allnodes:32 dirnodes:32 filenodes:32 chunks:32 tdchunks:32
 // since version 1.5.13:
 // 	version:32 totalspace:64 availspace:64 trashspace:64 trashnodes:32 reservedspace:64 reservednodes:32 allnodes:32 dirnodes:32 filenodes:32 chunks:32 chunkcopies:32 tdcopies:32
+// since version 1.6.27:
+// 	version:32 totalspace:64 availspace:64 trashspace:64 trashnodes:32 reservedspace:64 reservednodes:32 allnodes:32 dirnodes:32 filenodes:32 chunks:32 chunkcopies:32 tdcopies:32 savemode:8 saveprogress:8 lastsavetime:32 lastsaveduration:32 lastsavestatus:8 nodehashsize:32 nodehashelements:32 nodehashmaxchain:32 edgehashsize:32 edgehashelements:32 edgehashmaxchain:32 rehashing:8
+//	savemode: 0 - not saving, 1 - saving in forked process (saveprogress==0xFF - unknown), 2 - saving in background mfsmetarestore (saveprogress in percent)
+//	lastsavestatus: 0 - ok, 1 - background save failed (metadata was saved using fork)
+//	nodehashmaxchain/edgehashmaxchain: longest chain found during last full scan of table (0 - no full scan yet)
+//	rehashing: bit 0 - node hash is being resized, bit 1 - edge hash is being resized
 
 
 // 0x00200
@@ -1238,6 +1314,18 @@
 #define MATOCL_CSSERV_REMOVESERV (PROTO_BASE+525)
 // N * [ version:32 ip:32 ]
 
+// 0x0020E
+#define CLTOMA_FSJOBS_INFO (PROTO_BASE+526)
+// -
+// jobid:32
+
+// 0x0020F
+#define MATOCL_FSJOBS_INFO (PROTO_BASE+527)
+// N * [ jobid:32 type:8 inode:32 starttime:32 visited:64 queueddirs:32 changed:32 notchanged:32 notpermitted:32 quotaexceeded:32 ] (all running jobs)
+// jobid:32 status:8 visited:64 queueddirs:32 changed:32 notchanged:32 notpermitted:32 quotaexceeded:32 (one job)
+// type: 0 - setgoal , 1 - settrashtime , 2 - seteattr
+// status: ERROR_DELAYED - still running , STATUS_OK - finished (results are kept for some time) , ERROR_ENOENT - unknown job
+
 
 // CHUNKSERVER STATS
 
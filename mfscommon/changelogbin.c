@@ -0,0 +1,483 @@
+/*
+   Copyright 2005-2010 Jakub Kruszona-Zawadzki, Gemius SA.
+
+   This file is part of MooseFS.
+
+   MooseFS is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, version 3.
+
+   MooseFS is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MooseFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <inttypes.h>
+
+#include "changelogbin.h"
+#include "datapack.h"
+#include "crc.h"
+#include "massert.h"
+
+#define MAXRECORDSIZE 0x1000000
+
+typedef struct _clopdesc {
+	const char *name;
+	const char *desc;
+} clopdesc;
+
+// argument lists have to match text entries parsed by mfsmetarestore
+static const clopdesc optab[CLOP_MAX] = {
+	[CLOP_INVALID] = {"INVALID",""},
+	[CLOP_ACCESS] = {"ACCESS","L"},
+	[CLOP_ACQUIRE] = {"ACQUIRE","LL"},
+	[CLOP_APPEND] = {"APPEND","LL"},
+	[CLOP_ATTR] = {"ATTR","LWLLLL"},
+	[CLOP_CREATE] = {"CREATE","LNCWLLL:L"},
+	[CLOP_EATTR] = {"EATTR","LW"},
+	[CLOP_EMPTYRESERVED] = {"EMPTYRESERVED",":L"},
+	[CLOP_EMPTYTRASH] = {"EMPTYTRASH",":LL"},
+	[CLOP_FREEINODES] = {"FREEINODES",":L"},
+	[CLOP_INCVERSION] = {"INCVERSION","Q"},
+	[CLOP_LENGTH] = {"LENGTH","LQ"},
+	[CLOP_LINK] = {"LINK","LLN"},
+	[CLOP_MOVE] = {"MOVE","LNLN:L"},
+	[CLOP_PURGE] = {"PURGE","L"},
+	[CLOP_QUOTA] = {"QUOTA","LBBLLLQQQQQQ"},
+	[CLOP_REINIT] = {"REINIT","LL:Q"},
+	[CLOP_RELEASE] = {"RELEASE","LL"},
+	[CLOP_REPAIR] = {"REPAIR","LL:L"},
+	[CLOP_SESSION] = {"SESSION",":L"},
+	[CLOP_SETEATTR] = {"SETEATTR","LLBB:LLL"},
+	[CLOP_SETGOAL] = {"SETGOAL","LLBB:LLL"},
+	[CLOP_SETGOALQ] = {"SETGOAL","LLBB:LLLL"},
+	[CLOP_SETPATH] = {"SETPATH","LP"},
+	[CLOP_SETTRASHTIME] = {"SETTRASHTIME","LLLB:LLL"},
+	[CLOP_SETXATTR] = {"SETXATTR","LNPB"},
+	[CLOP_SNAPSHOT] = {"SNAPSHOT","LLNB"},
+	[CLOP_SYMLINK] = {"SYMLINK","LNPLL:L"},
+	[CLOP_TRUNC] = {"TRUNC","LL:Q"},
+	[CLOP_UNDEL] = {"UNDEL","L"},
+	[CLOP_UNLINK] = {"UNLINK","LN:L"},
+	[CLOP_UNLOCK] = {"UNLOCK","Q"},
+	[CLOP_WRITE] = {"WRITE","LLB:Q"},
+	[CLOP_SETGOALPART] = {"SETGOALPART","LLBBLL:LLLL"},
+	[CLOP_SETTRASHTIMEPART] = {"SETTRASHTIMEPART","LLLBLL:LLL"},
+	[CLOP_SETEATTRPART] = {"SETEATTRPART","LLBBLL:LLL"},
+	[CLOP_LAZYSNAPSHOT] = {"LAZYSNAPSHOT","LLNB"},
+	[CLOP_MATERIALIZE] = {"MATERIALIZE","L:L"},
+};
+
+static inline void changelogbin_reserve(uint8_t **buff,uint32_t *buffsize,uint32_t size) {
+	if (size>*buffsize) {
+		*buffsize = ((size/65536)+1)*65536;
+		if (*buff) {
+			free(*buff);
+		}
+		*buff = malloc(*buffsize);
+		passert(*buff);
+	}
+}
+
+uint32_t changelogbin_vpack(uint8_t **buff,uint32_t *buffsize,uint64_t version,uint32_t ts,uint8_t opcode,va_list ap) {
+	const char *d;
+	va_list aq;
+	uint32_t size,leng;
+	const uint8_t *data;
+	uint8_t *ptr,*crcptr;
+
+	sassert(opcode>CLOP_INVALID && opcode<CLOP_MAX);
+	size = CHLOGBIN_RECORD_OVERHEAD;
+	va_copy(aq,ap);
+	for (d=optab[opcode].desc ; *d ; d++) {
+		switch (*d) {
+		case 'B':
+		case 'C':
+			(void)va_arg(aq,int);
+			size+=1;
+			break;
+		case 'W':
+			(void)va_arg(aq,int);
+			size+=2;
+			break;
+		case 'L':
+			(void)va_arg(aq,uint32_t);
+			size+=4;
+			break;
+		case 'Q':
+			(void)va_arg(aq,uint64_t);
+			size+=8;
+			break;
+		case 'N':
+			leng = va_arg(aq,uint32_t);
+			(void)va_arg(aq,const uint8_t*);
+			size+=1+(leng>255?255:leng);
+			break;
+		case 'P':
+			leng = va_arg(aq,uint32_t);
+			(void)va_arg(aq,const uint8_t*);
+			size+=4+leng;
+			break;
+		}
+	}
+	va_end(aq);
+
+	changelogbin_reserve(buff,buffsize,size);
+	ptr = *buff;
+	put32bit(&ptr,size);
+	crcptr = ptr;
+	put64bit(&ptr,version);
+	put32bit(&ptr,ts);
+	put8bit(&ptr,opcode);
+	for (d=optab[opcode].desc ; *d ; d++) {
+		switch (*d) {
+		case 'B':
+		case 'C':
+			put8bit(&ptr,va_arg(ap,int));
+			break;
+		case 'W':
+			put16bit(&ptr,va_arg(ap,int));
+			break;
+		case 'L':
+			put32bit(&ptr,va_arg(ap,uint32_t));
+			break;
+		case 'Q':
+			put64bit(&ptr,va_arg(ap,uint64_t));
+			break;
+		case 'N':
+			leng = va_arg(ap,uint32_t);
+			data = va_arg(ap,const uint8_t*);
+			if (leng>255) {
+				leng=255;
+			}
+			put8bit(&ptr,leng);
+			memcpy(ptr,data,leng);
+			ptr+=leng;
+			break;
+		case 'P':
+			leng = va_arg(ap,uint32_t);
+			data = va_arg(ap,const uint8_t*);
+			put32bit(&ptr,leng);
+			memcpy(ptr,data,leng);
+			ptr+=leng;
+			break;
+		}
+	}
+	put32bit(&ptr,mycrc32(0,crcptr,ptr-crcptr));
+	return size;
+}
+
+int changelogbin_check(const uint8_t *rec,uint32_t leng) {
+	const uint8_t *ptr;
+	uint32_t size,crc;
+	if (leng<CHLOGBIN_RECORD_OVERHEAD) {
+		return -1;
+	}
+	ptr = rec;
+	size = get32bit(&ptr);
+	if (size!=leng) {
+		return -1;
+	}
+	ptr = rec+size-4;
+	crc = get32bit(&ptr);
+	if (crc!=mycrc32(0,rec+4,size-8)) {
+		return -1;
+	}
+	if (rec[16]<=CLOP_INVALID || rec[16]>=CLOP_MAX) {
+		return -1;
+	}
+	return 0;
+}
+
+uint64_t changelogbin_version(const uint8_t *rec) {
+	const uint8_t *ptr = rec+4;
+	return get64bit(&ptr);
+}
+
+// decimal number (faster than sprintf - numbers are the main part of text entries)
+static inline char* changelogbin_putnum(char *wptr,uint64_t v) {
+	char digits[20];
+	uint32_t i;
+	i = 0;
+	do {
+		digits[i++] = '0'+(v%10);
+		v /= 10;
+	} while (v>0);
+	while (i>0) {
+		*wptr++ = digits[--i];
+	}
+	return wptr;
+}
+
+// entry header: "ts|NAME("
+static inline char* changelogbin_puthdr(char *wptr,uint32_t ts,uint8_t opcode) {
+	uint32_t l;
+	wptr = changelogbin_putnum(wptr,ts);
+	*wptr++ = '|';
+	l = strlen(optab[opcode].name);
+	memcpy(wptr,optab[opcode].name,l);
+	wptr += l;
+	*wptr++ = '(';
+	return wptr;
+}
+
+// the same escaping as used by master when writing text changelogs
+static inline char* changelogbin_escape(char *wptr,const uint8_t *name,uint32_t nleng) {
+	uint8_t c;
+	while (nleng>0) {
+		c = *name++;
+		if (c<32 || c>=127 || c==',' || c=='%' || c=='(' || c==')') {
+			*wptr++='%';
+			*wptr++="0123456789ABCDEF"[(c>>4)&0xF];
+			*wptr++="0123456789ABCDEF"[c&0xF];
+		} else {
+			*wptr++=c;
+		}
+		nleng--;
+	}
+	return wptr;
+}
+
+uint32_t changelogbin_totext(const uint8_t *rec,uint32_t leng,char **buff,uint32_t *buffsize) {
+	const char *d;
+	const uint8_t *ptr,*endptr;
+	uint32_t ts,nleng;
+	uint8_t opcode;
+	char *wptr;
+
+	if (leng<CHLOGBIN_RECORD_OVERHEAD) {
+		return (uint32_t)-1;
+	}
+	ptr = rec+12;
+	endptr = rec+leng-4;
+	ts = get32bit(&ptr);
+	opcode = get8bit(&ptr);
+	if (opcode<=CLOP_INVALID || opcode>=CLOP_MAX) {
+		return (uint32_t)-1;
+	}
+	// every data byte gives at most four characters (escaped name byte or one byte number with separator)
+	changelogbin_reserve((uint8_t**)buff,buffsize,4*leng+64);
+	wptr = *buff;
+	wptr = changelogbin_puthdr(wptr,ts,opcode);
+	for (d=optab[opcode].desc ; *d ; d++) {
+		if (*d==':') {
+			*wptr++=')';
+			*wptr++=':';
+			continue;
+		}
+		if (d>optab[opcode].desc && d[-1]!=':') {
+			*wptr++=',';
+		}
+		switch (*d) {
+		case 'B':
+			if (ptr+1>endptr) {
+				return (uint32_t)-1;
+			}
+			wptr = changelogbin_putnum(wptr,get8bit(&ptr));
+			break;
+		case 'C':
+			if (ptr+1>endptr) {
+				return (uint32_t)-1;
+			}
+			*wptr++ = get8bit(&ptr);
+			break;
+		case 'W':
+			if (ptr+2>endptr) {
+				return (uint32_t)-1;
+			}
+			wptr = changelogbin_putnum(wptr,get16bit(&ptr));
+			break;
+		case 'L':
+			if (ptr+4>endptr) {
+				return (uint32_t)-1;
+			}
+			wptr = changelogbin_putnum(wptr,get32bit(&ptr));
+			break;
+		case 'Q':
+			if (ptr+8>endptr) {
+				return (uint32_t)-1;
+			}
+			wptr = changelogbin_putnum(wptr,get64bit(&ptr));
+			break;
+		case 'N':
+		case 'P':
+			if (ptr+((*d=='N')?1:4)>endptr) {
+				return (uint32_t)-1;
+			}
+			nleng = (*d=='N')?get8bit(&ptr):get32bit(&ptr);
+			if (ptr+nleng>endptr) {
+				return (uint32_t)-1;
+			}
+			wptr = changelogbin_escape(wptr,ptr,nleng);
+			ptr+=nleng;
+			break;
+		}
+	}
+	if (strchr(optab[opcode].desc,':')==NULL) {
+		*wptr++=')';
+	}
+	*wptr = '\0';
+	if (ptr!=endptr) {
+		return (uint32_t)-1;
+	}
+	return wptr-*buff;
+}
+
+uint32_t changelogbin_vtext(char **buff,uint32_t *buffsize,uint32_t ts,uint8_t opcode,va_list ap) {
+	const char *d;
+	va_list aq;
+	uint32_t size,leng;
+	const uint8_t *data;
+	char *wptr;
+
+	sassert(opcode>CLOP_INVALID && opcode<CLOP_MAX);
+	// every number gives at most 20 digits and separator, every name byte at most three characters (escaped)
+	size = 64;
+	va_copy(aq,ap);
+	for (d=optab[opcode].desc ; *d ; d++) {
+		switch (*d) {
+		case 'B':
+		case 'C':
+		case 'W':
+			(void)va_arg(aq,int);
+			size+=21;
+			break;
+		case 'L':
+			(void)va_arg(aq,uint32_t);
+			size+=21;
+			break;
+		case 'Q':
+			(void)va_arg(aq,uint64_t);
+			size+=21;
+			break;
+		case 'N':
+		case 'P':
+			leng = va_arg(aq,uint32_t);
+			(void)va_arg(aq,const uint8_t*);
+			size+=1+3*leng;
+			break;
+		}
+	}
+	va_end(aq);
+
+	changelogbin_reserve((uint8_t**)buff,buffsize,size);
+	wptr = *buff;
+	wptr = changelogbin_puthdr(wptr,ts,opcode);
+	for (d=optab[opcode].desc ; *d ; d++) {
+		if (*d==':') {
+			*wptr++=')';
+			*wptr++=':';
+			continue;
+		}
+		if (d>optab[opcode].desc && d[-1]!=':') {
+			*wptr++=',';
+		}
+		switch (*d) {
+		case 'B':
+			wptr = changelogbin_putnum(wptr,(uint8_t)va_arg(ap,int));
+			break;
+		case 'C':
+			*wptr++ = (uint8_t)va_arg(ap,int);
+			break;
+		case 'W':
+			wptr = changelogbin_putnum(wptr,(uint16_t)va_arg(ap,int));
+			break;
+		case 'L':
+			wptr = changelogbin_putnum(wptr,va_arg(ap,uint32_t));
+			break;
+		case 'Q':
+			wptr = changelogbin_putnum(wptr,va_arg(ap,uint64_t));
+			break;
+		case 'N':
+		case 'P':
+			leng = va_arg(ap,uint32_t);
+			data = va_arg(ap,const uint8_t*);
+			if (*d=='N' && leng>255) {
+				leng=255;
+			}
+			wptr = changelogbin_escape(wptr,data,leng);
+			break;
+		}
+	}
+	if (strchr(optab[opcode].desc,':')==NULL) {
+		*wptr++=')';
+	}
+	*wptr = '\0';
+	return wptr-*buff;
+}
+
+int changelogbin_read(FILE *fd,uint8_t **buff,uint32_t *buffsize,uint32_t *leng) {
+	uint8_t hdr[4];
+	const uint8_t *ptr;
+	uint32_t size;
+	size_t s;
+
+	s = fread(hdr,1,4,fd);
+	if (s==0) {
+		return 0;
+	}
+	if (s!=4) {
+		return -1;
+	}
+	ptr = hdr;
+	size = get32bit(&ptr);
+	if (size<CHLOGBIN_RECORD_OVERHEAD || size>MAXRECORDSIZE) {
+		return -1;
+	}
+	changelogbin_reserve(buff,buffsize,size);
+	memcpy(*buff,hdr,4);
+	if (fread((*buff)+4,1,size-4,fd)!=(size_t)(size-4)) {
+		return -1;
+	}
+	if (changelogbin_check(*buff,size)<0) {
+		return -1;
+	}
+	*leng = size;
+	return 1;
+}
+
+int changelogbin_fileformat(FILE *fd) {
+	uint8_t hdr[CHLOGBIN_SIGNATURE_SIZE];
+	size_t s;
+
+	s = fread(hdr,1,CHLOGBIN_SIGNATURE_SIZE,fd);
+	if (s==CHLOGBIN_SIGNATURE_SIZE && memcmp(hdr,CHLOGBIN_SIGNATURE,CHLOGBIN_SIGNATURE_SIZE)==0) {
+		return CHLOGFMT_BINARY;
+	}
+	rewind(fd);
+	return (s==0)?CHLOGFMT_NONE:CHLOGFMT_TEXT;
+}
+
+int changelogbin_scan(FILE *fd,uint64_t *firstversion,uint64_t *lastversion,uint64_t *validsize) {
+	uint8_t *buff = NULL;
+	uint32_t buffsize = 0;
+	uint32_t leng;
+	uint64_t offset;
+	int status;
+
+	*firstversion = 0;
+	*lastversion = 0;
+	offset = CHLOGBIN_SIGNATURE_SIZE;
+	while ((status=changelogbin_read(fd,&buff,&buffsize,&leng))>0) {
+		if (*firstversion==0) {
+			*firstversion = changelogbin_version(buff);
+		}
+		*lastversion = changelogbin_version(buff);
+		offset += leng;
+	}
+	if (buff) {
+		free(buff);
+	}
+	*validsize = offset;
+	return (status<0)?-1:0;
+}
@@ -0,0 +1,105 @@
+/*
+   Copyright 2005-2010 Jakub Kruszona-Zawadzki, Gemius SA.
+
+   This file is part of MooseFS.
+
+   MooseFS is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, version 3.
+
+   MooseFS is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MooseFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CHANGELOGBIN_H_
+#define _CHANGELOGBIN_H_
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <inttypes.h>
+
+#include "MFSCommunication.h"
+
+/* binary changelog file:
+	signature:64 ( "MFSC 1.0" )
+	N * [ size:32 version:64 timestamp:32 opcode:8 data:(size-21)B crc:32 ]
+   size counts the whole record (size field and crc included), crc covers everything between size and crc.
+
+   field types used in record descriptions:
+	'B' - uint8, 'W' - uint16, 'L' - uint32, 'Q' - uint64, 'C' - single character (uint8)
+	'N' - name ( leng:8 data:lengB ), 'P' - path or value ( leng:32 data:lengB )
+	':' - separates operation arguments from operation results (only for text representation)
+   on the caller side 'N' and 'P' take two arguments: uint32_t leng,const uint8_t *data */
+
+#define CHLOGBIN_SIGNATURE MFSSIGNATURE "C 1.0"
+#define CHLOGBIN_SIGNATURE_SIZE 8
+#define CHLOGBIN_RECORD_OVERHEAD 21
+
+// changelog file formats
+enum {CHLOGFMT_NONE,CHLOGFMT_TEXT,CHLOGFMT_BINARY};
+
+// opcodes - never reuse or renumber
+enum {
+	CLOP_INVALID,
+	CLOP_ACCESS,
+	CLOP_ACQUIRE,
+	CLOP_APPEND,
+	CLOP_ATTR,
+	CLOP_CREATE,
+	CLOP_EATTR,
+	CLOP_EMPTYRESERVED,
+	CLOP_EMPTYTRASH,
+	CLOP_FREEINODES,
+	CLOP_INCVERSION,
+	CLOP_LENGTH,
+	CLOP_LINK,
+	CLOP_MOVE,
+	CLOP_PURGE,
+	CLOP_QUOTA,
+	CLOP_REINIT,
+	CLOP_RELEASE,
+	CLOP_REPAIR,
+	CLOP_SESSION,
+	CLOP_SETEATTR,
+	CLOP_SETGOAL,
+	CLOP_SETGOALQ,
+	CLOP_SETPATH,
+	CLOP_SETTRASHTIME,
+	CLOP_SETXATTR,
+	CLOP_SNAPSHOT,
+	CLOP_SYMLINK,
+	CLOP_TRUNC,
+	CLOP_UNDEL,
+	CLOP_UNLINK,
+	CLOP_UNLOCK,
+	CLOP_WRITE,
+	CLOP_SETGOALPART,
+	CLOP_SETTRASHTIMEPART,
+	CLOP_SETEATTRPART,
+	CLOP_LAZYSNAPSHOT,
+	CLOP_MATERIALIZE,
+	CLOP_MAX
+};
+
+// builds record in *buff (realloc'ed when necessary), returns record size
+uint32_t changelogbin_vpack(uint8_t **buff,uint32_t *buffsize,uint64_t version,uint32_t ts,uint8_t opcode,va_list ap);
+// returns 0 when record is complete and crc is correct
+int changelogbin_check(const uint8_t *rec,uint32_t leng);
+uint64_t changelogbin_version(const uint8_t *rec);
+// formats record as text changelog entry ("ts|OP(args):results") - returns length, (uint32_t)-1 on error ; buffer is realloc'ed when necessary
+uint32_t changelogbin_totext(const uint8_t *rec,uint32_t leng,char **buff,uint32_t *buffsize);
+// formats entry directly from arguments (the same text as changelogbin_totext gives for record packed from them) - returns length ; buffer is realloc'ed when necessary
+uint32_t changelogbin_vtext(char **buff,uint32_t *buffsize,uint32_t ts,uint8_t opcode,va_list ap);
+// reads next record from stream: 1 - ok, 0 - end of file, -1 - garbage (truncated or damaged record)
+int changelogbin_read(FILE *fd,uint8_t **buff,uint32_t *buffsize,uint32_t *leng);
+// checks file format of given (already opened) stream, leaves stream positioned at first entry
+int changelogbin_fileformat(FILE *fd);
+// scans binary file - returns 0 on success, -1 when garbage was found (*validsize is then offset of first invalid byte)
+int changelogbin_scan(FILE *fd,uint64_t *firstversion,uint64_t *lastversion,uint64_t *validsize);
+
+#endif
@@ -22,6 +22,15 @@
 #define MFSMAXFILES 5000
 #endif
 
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE)
+#  include <sys/epoll.h>
+#  define MFS_USE_EPOLL 1
+#endif
+
+#ifndef MFSMAXEVENTS
+#define MFSMAXEVENTS 1024
+#endif
+
 #if defined(HAVE_MLOCKALL)
 #  if defined(HAVE_SYS_MMAN_H)
 #    include <sys/mman.h>
@@ -120,6 +129,24 @@ typedef struct pollentry {
 static pollentry *pollhead=NULL;
 
 
+typedef struct fdentry {
+	int fd;
+	short events;
+	uint8_t removed;
+	int32_t pdescpos;
+	void (*serve)(short,void*);
+	void *data;
+	struct fdentry *next,**prev;
+	struct fdentry *nextremoved;
+} fdentry;
+
+static fdentry *fdhead=NULL;
+static fdentry *fdremovedhead=NULL;
+#ifdef MFS_USE_EPOLL
+static int epfd=-1;
+#endif
+
+
 typedef struct eloopentry {
 	void (*fun)(void);
 	struct eloopentry *next;
@@ -129,19 +156,41 @@ static eloopentry *eloophead=NULL;
 
 
 typedef struct timeentry {
-	uint32_t nextevent;
-	uint32_t seconds;
-	uint32_t offset;
+	uint64_t nextevent;	// in milliseconds
+	uint32_t period;	// in milliseconds
+	uint32_t offset;	// in milliseconds
+	uint32_t slack;		// how late (in milliseconds) event can be to still count as 'on time' (TIMEMODE_SKIP_LATE)
 	int mode;
-//	int offset;
 	void (*fun)(void);
-	struct timeentry *next;
+	struct timeentry *next,**prev;		// wheel slot list
+	struct timeentry *allnext,**allprev;	// list of all timers
 } timeentry;
 
+// hierarchical timer wheel - 1ms per slot on first level, each next level covers whole previous level in one slot
+#define TW_L0BITS 8
+#define TW_LNBITS 6
+#define TW_L0SIZE (1<<TW_L0BITS)
+#define TW_LNSIZE (1<<TW_LNBITS)
+#define TW_L0MASK (TW_L0SIZE-1)
+#define TW_LNMASK (TW_LNSIZE-1)
+#define TW_LEVELS 4
+#define TW_LEVELSHIFT(l) (TW_L0BITS+(l)*TW_LNBITS)
+#define TW_MAXDELTA ((UINT64_C(1)<<TW_LEVELSHIFT(TW_LEVELS))-1)
+
+// poll timeout follows next timer event (not more than MAINLOOP_MAXWAIT) - modules which need to be called more often have to register timers or use 'main_pollnowait'
+// MAINLOOP_TICK - maximum slack of millisecond timers and poll timeout while waiting for modules before exit
+#define MAINLOOP_TICK 50
+#define MAINLOOP_MAXWAIT 1000
+
+static timeentry *tw_level0[TW_L0SIZE];
+static timeentry *tw_levels[TW_LEVELS][TW_LNSIZE];
+static uint64_t tw_next;	// next millisecond to be processed
 static timeentry *timehead=NULL;
 
 static uint32_t now;
 static uint64_t usecnow;
+static uint64_t msecnow;
+static uint8_t pollnowait;
 //static int alcnt=0;
 
 static int signalpipe[2];
@@ -189,6 +238,86 @@ void main_pollregister (void (*desc)(struct pollfd *,uint32_t *),void (*serve)(s
 	pollhead = aux;
 }
 
+#ifdef MFS_USE_EPOLL
+static inline uint32_t main_epoll_events(short events) {
+	uint32_t ev = 0;
+	if (events&POLLIN) {
+		ev |= EPOLLIN;
+	}
+	if (events&POLLOUT) {
+		ev |= EPOLLOUT;
+	}
+	return ev;
+}
+#endif
+
+/* descriptors registered here are watched by the main loop until unregistered - 'serve' is called only for descriptors that are ready, so idle descriptors cost nothing per loop (epoll backend)
+   readiness is level-triggered - 'serve' should drop events it can't handle now (main_fdchange), otherwise descriptor is reported again in every loop */
+void* main_fdregister (int fd,short events,void (*serve)(short,void*),void *data) {
+	fdentry *aux=(fdentry*)malloc(sizeof(fdentry));
+	passert(aux);
+	aux->fd = fd;
+	aux->events = events;
+	aux->removed = 0;
+	aux->pdescpos = -1;
+	aux->serve = serve;
+	aux->data = data;
+#ifdef MFS_USE_EPOLL
+	if (epfd<0) {
+		epfd = epoll_create(MFSMAXFILES);
+		eassert(epfd>=0);
+	}
+	{
+		struct epoll_event ev;
+		memset(&ev,0,sizeof(ev));
+		ev.events = main_epoll_events(events);
+		ev.data.ptr = aux;
+		zassert(epoll_ctl(epfd,EPOLL_CTL_ADD,fd,&ev));
+	}
+#endif
+	aux->next = fdhead;
+	if (aux->next) {
+		aux->next->prev = &(aux->next);
+	}
+	aux->prev = &fdhead;
+	fdhead = aux;
+	return aux;
+}
+
+void main_fdchange (void *x,short events) {
+	fdentry *aux = (fdentry*)x;
+	if (aux->events==events) {
+		return;
+	}
+	aux->events = events;
+#ifdef MFS_USE_EPOLL
+	{
+		struct epoll_event ev;
+		memset(&ev,0,sizeof(ev));
+		ev.events = main_epoll_events(events);
+		ev.data.ptr = aux;
+		zassert(epoll_ctl(epfd,EPOLL_CTL_MOD,aux->fd,&ev));
+	}
+#endif
+}
+
+/* has to be called before descriptor is closed - entry itself is released at the end of current loop iteration, so it's safe to call it from inside 'serve' */
+void main_fdunregister (void *x) {
+	fdentry *aux = (fdentry*)x;
+#ifdef MFS_USE_EPOLL
+	struct epoll_event ev;
+	memset(&ev,0,sizeof(ev));
+	epoll_ctl(epfd,EPOLL_CTL_DEL,aux->fd,&ev);
+#endif
+	*(aux->prev) = aux->next;
+	if (aux->next) {
+		aux->next->prev = aux->prev;
+	}
+	aux->removed = 1;
+	aux->nextremoved = fdremovedhead;
+	fdremovedhead = aux;
+}
+
 void main_eachloopregister (void (*fun)(void)) {
 	eloopentry *aux=(eloopentry*)malloc(sizeof(eloopentry));
 	passert(aux);
@@ -197,41 +326,129 @@ void main_eachloopregister (void (*fun)(void)) {
 	eloophead = aux;
 }
 
-void* main_timeregister (int mode,uint32_t seconds,uint32_t offset,void (*fun)(void)) {
-	timeentry *aux;
-	if (seconds==0 || offset>=seconds) {
-		return NULL;
+// called by 'desc' function of module which has more work to do in its 'serve' function - next poll won't wait
+void main_pollnowait(void) {
+	pollnowait = 1;
+}
+
+static inline void timewheel_remove(timeentry *aux) {
+	if (aux->prev) {
+		*(aux->prev) = aux->next;
+		if (aux->next) {
+			aux->next->prev = aux->prev;
+		}
+		aux->next = NULL;
+		aux->prev = NULL;
 	}
+}
+
+static inline void timewheel_insert(timeentry *aux) {
+	timeentry **slot;
+	uint64_t expires,delta;
+	uint32_t l;
+
+	expires = aux->nextevent;
+	if (expires<tw_next) {
+		expires = tw_next;
+	}
+	delta = expires - tw_next;
+	if (delta>TW_MAXDELTA) {	// will be moved to proper slot during cascade
+		expires = tw_next + TW_MAXDELTA;
+		delta = TW_MAXDELTA;
+	}
+	if (delta<TW_L0SIZE) {
+		slot = tw_level0 + (expires & TW_L0MASK);
+	} else {
+		for (l=0 ; l<TW_LEVELS-1 && delta>=(UINT64_C(1)<<TW_LEVELSHIFT(l+1)) ; l++) {}
+		slot = tw_levels[l] + ((expires >> TW_LEVELSHIFT(l)) & TW_LNMASK);
+	}
+	aux->next = *slot;
+	if (aux->next) {
+		aux->next->prev = &(aux->next);
+	}
+	aux->prev = slot;
+	*slot = aux;
+}
+
+static inline void timewheel_setnextevent(timeentry *aux) {
+	aux->nextevent = ((msecnow / aux->period) * aux->period) + aux->offset;
+	while (aux->nextevent+aux->slack<=msecnow) {
+		aux->nextevent += aux->period;
+	}
+}
+
+static void* main_timeregister_common (int mode,uint32_t period,uint32_t offset,uint32_t slack,void (*fun)(void)) {
+	timeentry *aux;
 	aux = (timeentry*)malloc(sizeof(timeentry));
 	passert(aux);
-	aux->nextevent = ((now / seconds) * seconds) + offset;
-	while (aux->nextevent<now) {
-		aux->nextevent+=seconds;
-	}
-	aux->seconds = seconds;
+	aux->period = period;
 	aux->offset = offset;
+	aux->slack = slack;
 	aux->mode = mode;
 	aux->fun = fun;
-	aux->next = timehead;
+	aux->next = NULL;
+	aux->prev = NULL;
+	timewheel_setnextevent(aux);
+	timewheel_insert(aux);
+	aux->allnext = timehead;
+	if (aux->allnext) {
+		aux->allnext->allprev = &(aux->allnext);
+	}
+	aux->allprev = &timehead;
 	timehead = aux;
 	return aux;
 }
 
-int main_timechange(void* x,int mode,uint32_t seconds,uint32_t offset) {
-	timeentry *aux = (timeentry*)x;
+void* main_timeregister (int mode,uint32_t seconds,uint32_t offset,void (*fun)(void)) {
 	if (seconds==0 || offset>=seconds) {
-		return -1;
+		return NULL;
 	}
-	aux->nextevent = ((now / seconds) * seconds) + offset;
-	while (aux->nextevent<now) {
-		aux->nextevent+=seconds;
+	return main_timeregister_common(mode,seconds*1000,offset*1000,1000,fun);
+}
+
+void* main_msectimeregister (int mode,uint32_t mseconds,uint32_t offset,void (*fun)(void)) {
+	if (mseconds==0 || offset>=mseconds) {
+		return NULL;
 	}
-	aux->seconds = seconds;
+	return main_timeregister_common(mode,mseconds,offset,(mseconds<MAINLOOP_TICK)?mseconds:MAINLOOP_TICK,fun);
+}
+
+static int main_timechange_common(void* x,int mode,uint32_t period,uint32_t offset,uint32_t slack) {
+	timeentry *aux = (timeentry*)x;
+	timewheel_remove(aux);
+	aux->period = period;
 	aux->offset = offset;
+	aux->slack = slack;
 	aux->mode = mode;
+	timewheel_setnextevent(aux);
+	timewheel_insert(aux);
 	return 0;
 }
 
+int main_timechange(void* x,int mode,uint32_t seconds,uint32_t offset) {
+	if (seconds==0 || offset>=seconds) {
+		return -1;
+	}
+	return main_timechange_common(x,mode,seconds*1000,offset*1000,1000);
+}
+
+int main_msectimechange(void* x,int mode,uint32_t mseconds,uint32_t offset) {
+	if (mseconds==0 || offset>=mseconds) {
+		return -1;
+	}
+	return main_timechange_common(x,mode,mseconds,offset,(mseconds<MAINLOOP_TICK)?mseconds:MAINLOOP_TICK);
+}
+
+void main_timeunregister(void* x) {
+	timeentry *aux = (timeentry*)x;
+	timewheel_remove(aux);
+	*(aux->allprev) = aux->allnext;
+	if (aux->allnext) {
+		aux->allnext->allprev = aux->allprev;
+	}
+	free(aux);
+}
+
 /* internal */
 
 void free_all_registered_entries(void) {
@@ -240,6 +457,7 @@ void free_all_registered_entries(void) {
 	weentry *we,*wen;
 	rlentry *re,*ren;
 	pollentry *pe,*pen;
+	fdentry *fe,*fen;
 	eloopentry *ee,*een;
 	timeentry *te,*ten;
 
@@ -268,15 +486,33 @@ void free_all_registered_entries(void) {
 		free(pe);
 	}
 
+	for (fe = fdhead ; fe ; fe = fen) {
+		fen = fe->next;
+		free(fe);
+	}
+
+	for (fe = fdremovedhead ; fe ; fe = fen) {
+		fen = fe->nextremoved;
+		free(fe);
+	}
+
+#ifdef MFS_USE_EPOLL
+	if (epfd>=0) {
+		close(epfd);
+		epfd = -1;
+	}
+#endif
+
 	for (ee = eloophead ; ee ; ee = een) {
 		een = ee->next;
 		free(ee);
 	}
 
 	for (te = timehead ; te ; te = ten) {
-		ten = te->next;
+		ten = te->allnext;
 		free(te);
 	}
+	timehead = NULL;
 }
 
 int canexit() {
@@ -297,6 +533,157 @@ uint64_t main_utime() {
 	return usecnow;
 }
 
+static inline void main_settime(void) {
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	usecnow = tv.tv_sec;
+	usecnow *= 1000000;
+	usecnow += tv.tv_usec;
+	msecnow = usecnow / 1000;
+	now = tv.tv_sec;
+}
+
+// time jumped - put all timers again into the wheel
+static void timewheel_rebuild(uint64_t prevmsec) {
+	timeentry *timeit;
+	uint64_t previous_time_to_run;
+	uint32_t i,l;
+
+	for (i=0 ; i<TW_L0SIZE ; i++) {
+		tw_level0[i] = NULL;
+	}
+	for (l=0 ; l<TW_LEVELS ; l++) {
+		for (i=0 ; i<TW_LNSIZE ; i++) {
+			tw_levels[l][i] = NULL;
+		}
+	}
+	for (timeit = timehead ; timeit != NULL ; timeit = timeit->allnext) {
+		timeit->next = NULL;
+		timeit->prev = NULL;
+		if (msecnow<prevmsec) {
+			// time went backward !!! - adding previous_time_to_run prevents from running next event too soon.
+			previous_time_to_run = (timeit->nextevent>prevmsec)?(timeit->nextevent - prevmsec):0;
+			if (previous_time_to_run > timeit->period) {
+				previous_time_to_run = timeit->period;
+			}
+			timeit->nextevent = ((msecnow / timeit->period) * timeit->period) + timeit->offset;
+			while (timeit->nextevent <= msecnow+previous_time_to_run) {
+				timeit->nextevent += timeit->period;
+			}
+		} else {
+			// time went forward !!! - just recalculate "nextevent" time
+			timeit->nextevent = ((msecnow / timeit->period) * timeit->period) + timeit->offset;
+			while (msecnow >= timeit->nextevent) {
+				timeit->nextevent += timeit->period;
+			}
+		}
+	}
+	tw_next = msecnow;
+	for (timeit = timehead ; timeit != NULL ; timeit = timeit->allnext) {
+		timewheel_insert(timeit);
+	}
+}
+
+// move timers from higher level slot to lower levels
+static inline uint32_t timewheel_cascade(uint32_t l) {
+	timeentry *timeit,*timen;
+	uint32_t indx;
+
+	indx = (tw_next >> TW_LEVELSHIFT(l)) & TW_LNMASK;
+	timeit = tw_levels[l][indx];
+	tw_levels[l][indx] = NULL;
+	while (timeit) {
+		timen = timeit->next;
+		timeit->next = NULL;
+		timeit->prev = NULL;
+		timewheel_insert(timeit);
+		timeit = timen;
+	}
+	return indx;
+}
+
+static void timewheel_run(void) {
+	timeentry *timeit,*runlist;
+	uint32_t l;
+	uint8_t ontime;
+
+	while (tw_next<=msecnow) {
+		if ((tw_next & TW_L0MASK)==0) {
+			for (l=0 ; l<TW_LEVELS && timewheel_cascade(l)==0 ; l++) {}
+		}
+		runlist = tw_level0[tw_next & TW_L0MASK];
+		if (runlist) {
+			tw_level0[tw_next & TW_L0MASK] = NULL;
+			runlist->prev = &runlist;
+		}
+		tw_next++;	// timers (re)inserted by callbacks go to the next slot at least
+		while ((timeit = runlist)) {
+			timewheel_remove(timeit);
+			if (timeit->nextevent>msecnow) {	// clamped in the highest level - not due yet
+				timewheel_insert(timeit);
+				continue;
+			}
+			if (timeit->mode == TIMEMODE_RUN_LATE) {
+				while (msecnow >= timeit->nextevent) {
+					timeit->nextevent += timeit->period;
+				}
+				timewheel_insert(timeit);
+				timeit->fun();	// can change or unregister any timer (also this one)
+			} else { /* timeit->mode == TIMEMODE_SKIP_LATE */
+				ontime = (msecnow < timeit->nextevent+timeit->slack)?1:0;
+				while (msecnow >= timeit->nextevent) {
+					timeit->nextevent += timeit->period;
+				}
+				timewheel_insert(timeit);
+				if (ontime) {
+					timeit->fun();
+				}
+			}
+		}
+	}
+}
+
+// checks if any timer is moved from higher levels at given cascade point
+static inline int timewheel_cascadepending(uint64_t msec) {
+	uint32_t l,indx;
+	for (l=0 ; l<TW_LEVELS ; l++) {
+		indx = (msec >> TW_LEVELSHIFT(l)) & TW_LNMASK;
+		if (tw_levels[l][indx]) {
+			return 1;
+		}
+		if (indx!=0) {
+			return 0;
+		}
+	}
+	return 0;
+}
+
+// milliseconds to wait for next timer event (not more than 'maxwait')
+static uint32_t timewheel_wait(uint32_t maxwait) {
+	uint64_t next,limit;
+
+	limit = msecnow+maxwait;
+	if (tw_next>limit) {
+		return maxwait;
+	}
+	for (next=tw_next ; next<=limit ; next++) {
+		if ((next & TW_L0MASK)==0 && timewheel_cascadepending(next)) {
+			break;
+		}
+		if (next<tw_next+TW_L0SIZE) {
+			if (tw_level0[next & TW_L0MASK]) {
+				break;
+			}
+		} else {	// first level holds only events from current round - skip to next cascade point
+			next |= TW_L0MASK;
+		}
+	}
+	if (next<=msecnow) {
+		return 0;
+	}
+	return (next-msecnow<maxwait)?(next-msecnow):maxwait;
+}
+
 void destruct() {
 	deentry *deit;
 	for (deit = dehead ; deit!=NULL ; deit=deit->next ) {
@@ -305,16 +692,20 @@ void destruct() {
 }
 
 void mainloop() {
-	uint32_t prevtime = 0;
-	struct timeval tv;
+	uint64_t prevmsec = 0;
 	pollentry *pollit;
+	fdentry *fdit,*fdn;
 	eloopentry *eloopit;
-	timeentry *timeit;
 	ceentry *ceit;
 	weentry *weit;
 	rlentry *rlit;
 	struct pollfd pdesc[MFSMAXFILES];
 	uint32_t ndesc;
+#ifdef MFS_USE_EPOLL
+	struct epoll_event evtab[MFSMAXEVENTS];
+	int32_t epdescpos;
+	int j,n;
+#endif
 	int i;
 	int t,r;
 
@@ -325,15 +716,32 @@ void mainloop() {
 		pdesc[0].fd = signalpipe[0];
 		pdesc[0].events = POLLIN;
 		pdesc[0].revents = 0;
+#ifdef MFS_USE_EPOLL
+		if (epfd>=0) {
+			pdesc[1].fd = epfd;
+			pdesc[1].events = POLLIN;
+			pdesc[1].revents = 0;
+			epdescpos = 1;
+			ndesc++;
+		} else {
+			epdescpos = -1;
+		}
+#else
+		for (fdit = fdhead ; fdit != NULL ; fdit = fdit->next) {
+			pdesc[ndesc].fd = fdit->fd;
+			pdesc[ndesc].events = fdit->events;
+			pdesc[ndesc].revents = 0;
+			fdit->pdescpos = ndesc;
+			ndesc++;
+		}
+#endif
+		pollnowait = 0;
 		for (pollit = pollhead ; pollit != NULL ; pollit = pollit->next) {
 			pollit->desc(pdesc,&ndesc);
 		}
-		i = poll(pdesc,ndesc,50);
-		gettimeofday(&tv,NULL);
-		usecnow = tv.tv_sec;
-		usecnow *= 1000000;
-		usecnow += tv.tv_usec;
-		now = tv.tv_sec;
+		main_settime();
+		i = poll(pdesc,ndesc,pollnowait?0:timewheel_wait((t==2)?MAINLOOP_TICK:MAINLOOP_MAXWAIT));
+		main_settime();
 		if (i<0) {
 			if (errno==EAGAIN) {
 				syslog(LOG_WARNING,"poll returned EAGAIN");
@@ -357,53 +765,57 @@ void mainloop() {
 					}
 				}
 			}
+#ifdef MFS_USE_EPOLL
+			// one epoll_wait per loop - descriptors still ready (level-triggered) are returned again in next loop, and epfd being readable makes next poll return at once
+			if (epdescpos>=0 && (pdesc[epdescpos].revents & POLLIN)) {
+				n = epoll_wait(epfd,evtab,MFSMAXEVENTS,0);
+				for (j=0 ; j<n ; j++) {
+					short revents = 0;
+					fdit = (fdentry*)(evtab[j].data.ptr);
+					if (fdit->removed) {	// unregistered by one of previous callbacks
+						continue;
+					}
+					if (evtab[j].events & EPOLLIN) {
+						revents |= POLLIN;
+					}
+					if (evtab[j].events & EPOLLOUT) {
+						revents |= POLLOUT;
+					}
+					if (evtab[j].events & EPOLLERR) {
+						revents |= POLLERR;
+					}
+					if (evtab[j].events & EPOLLHUP) {
+						revents |= POLLHUP;
+					}
+					fdit->serve(revents,fdit->data);
+				}
+			}
+#else
+			for (fdit = fdhead ; fdit != NULL ; fdit = fdn) {
+				fdn = fdit->next;	// unregistered entries keep their 'next' pointers until end of this iteration
+				if (fdit->removed==0 && fdit->pdescpos>=0 && pdesc[fdit->pdescpos].revents) {
+					fdit->serve(pdesc[fdit->pdescpos].revents,fdit->data);
+				}
+			}
+#endif
 			for (pollit = pollhead ; pollit != NULL ; pollit = pollit->next) {
 				pollit->serve(pdesc);
 			}
 		}
-		for (eloopit = eloophead ; eloopit != NULL ; eloopit = eloopit->next) {
-			eloopit->fun();
+		for (fdit = fdremovedhead ; fdit != NULL ; fdit = fdn) {
+			fdn = fdit->nextremoved;
+			free(fdit);
 		}
-		if (now<prevtime) {
-			// time went backward !!! - recalculate "nextevent" time
-			// adding previous_time_to_run prevents from running next event too soon.
-			for (timeit = timehead ; timeit != NULL ; timeit = timeit->next) {
-				uint32_t previous_time_to_run = timeit->nextevent - prevtime;
-				if (previous_time_to_run > timeit->seconds) {
-					previous_time_to_run = timeit->seconds;
-				}
-				timeit->nextevent = ((now / timeit->seconds) * timeit->seconds) + timeit->offset;
-				while (timeit->nextevent <= now+previous_time_to_run) {
-					timeit->nextevent += timeit->seconds;
-				}
-			}
-		} else if (now>prevtime+3600) {
-			// time went forward !!! - just recalculate "nextevent" time
-			for (timeit = timehead ; timeit != NULL ; timeit = timeit->next) {
-				timeit->nextevent = ((now / timeit->seconds) * timeit->seconds) + timeit->offset;
-				while (now >= timeit->nextevent) {
-					timeit->nextevent += timeit->seconds;
-				}
-			}
+		fdremovedhead = NULL;
+		if (msecnow<prevmsec || msecnow>prevmsec+3600000) {
+			timewheel_rebuild(prevmsec);
 		}
-		for (timeit = timehead ; timeit != NULL ; timeit = timeit->next) {
-			if (now >= timeit->nextevent) {
-				if (timeit->mode == TIMEMODE_RUN_LATE) {
-					while (now >= timeit->nextevent) {
-						timeit->nextevent += timeit->seconds;
-					}
-					timeit->fun();
-				} else { /* timeit->mode == TIMEMODE_SKIP_LATE */
-					if (now == timeit->nextevent) {
-						timeit->fun();
-					}
-					while (now >= timeit->nextevent) {
-						timeit->nextevent += timeit->seconds;
-					}
-				}
-			}
+		timewheel_run();
+		prevmsec = msecnow;
+		// after timers - data queued by timer functions is also flushed before next poll
+		for (eloopit = eloophead ; eloopit != NULL ; eloopit = eloopit->next) {
+			eloopit->fun();
 		}
-		prevtime = now;
 		if (t==0 && r) {
 			cfg_reload();
 			for (rlit = rlhead ; rlit!=NULL ; rlit=rlit->next ) {
@@ -436,7 +848,7 @@ int initialize(void) {
 	int ok;
 	ok = 1;
 	for (i=0 ; (long int)(RunTab[i].fn)!=0 && ok ; i++) {
-		now = time(NULL);
+		main_settime();
 		if (RunTab[i].fn()<0) {
 			mfs_arg_syslog(LOG_ERR,"init: %s failed !!!",RunTab[i].name);
 			ok=0;
@@ -450,13 +862,13 @@ int initialize_late(void) {
 	int ok;
 	ok = 1;
 	for (i=0 ; (long int)(LateRunTab[i].fn)!=0 && ok ; i++) {
-		now = time(NULL);
+		main_settime();
 		if (LateRunTab[i].fn()<0) {
 			mfs_arg_syslog(LOG_ERR,"init: %s failed !!!",RunTab[i].name);
 			ok=0;
 		}
 	}
-	now = time(NULL);
+	main_settime();
 	return ok;
 }
 
@@ -30,9 +30,16 @@ void main_canexitregister (int (*fun)(void));
 void main_wantexitregister (void (*fun)(void));
 void main_reloadregister (void (*fun)(void));
 void main_pollregister (void (*desc)(struct pollfd *,uint32_t *),void (*serve)(struct pollfd *));
+void* main_fdregister (int fd,short events,void (*serve)(short,void*),void *data);
+void main_fdchange (void *x,short events);
+void main_fdunregister (void *x);
 void main_eachloopregister (void (*fun)(void));
+void main_pollnowait(void);
 void* main_timeregister (int mode,uint32_t seconds,uint32_t offset,void (*fun)(void));
 int main_timechange(void *x,int mode,uint32_t seconds,uint32_t offset);
+void* main_msectimeregister (int mode,uint32_t mseconds,uint32_t offset,void (*fun)(void));
+int main_msectimechange(void *x,int mode,uint32_t mseconds,uint32_t offset);
+void main_timeunregister(void *x);
 uint32_t main_time(void);
 uint64_t main_utime(void);
 
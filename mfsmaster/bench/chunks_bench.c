@@ -0,0 +1,360 @@
+/*
+   Copyright 2005-2010 Jakub Kruszona-Zawadzki, Gemius SA.
+
+   This file is part of MooseFS.
+
+   MooseFS is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, version 3.
+
+   MooseFS is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MooseFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* chunk table microbenchmark - chunk_find/chunk_server_has_chunk throughput for given numbers of chunks
+   (not built by make - build from source directory after ./configure):
+     cc -O2 -I. -Imfscommon -Imfsmaster -o chunks_bench mfsmaster/bench/chunks_bench.c mfsmaster/chunks.c mfscommon/random.c
+   usage: chunks_bench [chunks ...] (default: 10000000 100000000 500000000)
+   each size is tested in separate process - the whole chunk table is built in memory (about 100 bytes per chunk)
+   phases:
+     new      - first server reports all chunks (sequential ids) - chunks are created (table grows and is rehashed)
+     existing - second server reports all chunks in random order - chunks are found and second copy is added
+     find     - random chunk_find lookups (through chunk_get_validcopies, which only finds chunk and reads its copy counter)
+   rehashing timer is called every 10ms (as in master) */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "MFSCommunication.h"
+#include "main.h"
+#include "cfg.h"
+#include "random.h"
+#include "matocsserv.h"
+#include "matoclserv.h"
+#include "topology.h"
+#include "metaindex.h"
+#include "chunks.h"
+
+#define FINDS 10000000
+// any prime number bigger than number of chunks - gives permutation of chunk ids
+#define PERMPRIME 2654435761ULL
+
+/* stubs of master modules used by chunks.c */
+
+static void (*msectimerfn)(void) = NULL;
+
+void main_reloadregister (void (*fun)(void)) {
+	(void)fun;
+}
+
+void* main_timeregister (int mode,uint32_t seconds,uint32_t offset,void (*fun)(void)) {
+	(void)mode;
+	(void)seconds;
+	(void)offset;
+	(void)fun;
+	return NULL;
+}
+
+void* main_msectimeregister (int mode,uint32_t mseconds,uint32_t offset,void (*fun)(void)) {
+	(void)mode;
+	(void)mseconds;
+	(void)offset;
+	msectimerfn = fun;
+	return NULL;
+}
+
+int main_msectimechange(void *x,int mode,uint32_t mseconds,uint32_t offset) {
+	(void)x;
+	(void)mode;
+	(void)mseconds;
+	(void)offset;
+	return 0;
+}
+
+uint32_t main_time(void) {
+	return time(NULL);
+}
+
+int cfg_isdefined(const char *name) {
+	(void)name;
+	return 0;
+}
+
+uint32_t cfg_getuint32(const char *name,uint32_t def) {
+	(void)name;
+	return def;
+}
+
+double cfg_getdouble(const char *name,double def) {
+	(void)name;
+	return def;
+}
+
+void fs_cs_disconnected(void) {
+}
+
+uint8_t fs_incversion(uint64_t chunkid) {
+	(void)chunkid;
+	return 0;
+}
+
+void fs_test_markdirty(uint32_t inode) {
+	(void)inode;
+}
+
+void matoclserv_chunk_status(uint64_t chunkid,uint8_t status) {
+	(void)chunkid;
+	(void)status;
+}
+
+void metaindex_part_begin(FILE *fd) {
+	(void)fd;
+}
+
+void metaindex_add(FILE *fd,uint32_t records) {
+	(void)fd;
+	(void)records;
+}
+
+uint8_t topology_distance(uint32_t ip1,uint32_t ip2) {
+	(void)ip1;
+	(void)ip2;
+	return 0;
+}
+
+void matocsserv_usagedifference(double *minusage,double *maxusage,uint16_t *usablescount,uint16_t *totalscount) {
+	*minusage = 1.0;
+	*maxusage = 0.0;
+	*usablescount = 0;
+	*totalscount = 0;
+}
+
+uint16_t matocsserv_getservers_ordered(void* ptrs[65535],double maxusagediff,uint32_t *min,uint32_t *max) {
+	(void)ptrs;
+	(void)maxusagediff;
+	*min = 0;
+	*max = 0;
+	return 0;
+}
+
+uint16_t matocsserv_getservers_wrandom(void* ptrs[65535],uint16_t demand) {
+	(void)ptrs;
+	(void)demand;
+	return 0;
+}
+
+uint16_t matocsserv_getservers_lessrepl(void* ptrs[65535],uint16_t replimit) {
+	(void)ptrs;
+	(void)replimit;
+	return 0;
+}
+
+char* matocsserv_getstrip(void *e) {
+	(void)e;
+	return "bench";
+}
+
+int matocsserv_getlocation(void *e,uint32_t *servip,uint16_t *servport) {
+	(void)e;
+	*servip = 0;
+	*servport = 0;
+	return -1;
+}
+
+int matocsserv_getload(void *e,uint32_t *queue,uint32_t *reads,uint32_t *rlatency) {
+	(void)e;
+	*queue = 0;
+	*reads = 0;
+	*rlatency = 0;
+	return -1;
+}
+
+uint16_t matocsserv_replication_read_counter(void *e) {
+	(void)e;
+	return 0;
+}
+
+uint16_t matocsserv_replication_write_counter(void *e) {
+	(void)e;
+	return 0;
+}
+
+int matocsserv_replication_find(uint64_t chunkid,uint32_t version,void *dst) {
+	(void)chunkid;
+	(void)version;
+	(void)dst;
+	return 0;
+}
+
+uint32_t matocsserv_replication_count(uint64_t chunkid,uint32_t version) {
+	(void)chunkid;
+	(void)version;
+	return 0;
+}
+
+uint16_t matocsserv_deletion_counter(void *e) {
+	(void)e;
+	return 0;
+}
+
+int matocsserv_send_replicatechunk(void *e,uint64_t chunkid,uint32_t version,void *src) {
+	(void)e;
+	(void)chunkid;
+	(void)version;
+	(void)src;
+	return -1;
+}
+
+int matocsserv_send_deletechunk(void *e,uint64_t chunkid,uint32_t version) {
+	(void)e;
+	(void)chunkid;
+	(void)version;
+	return -1;
+}
+
+int matocsserv_send_createchunk(void *e,uint64_t chunkid,uint32_t version) {
+	(void)e;
+	(void)chunkid;
+	(void)version;
+	return -1;
+}
+
+int matocsserv_send_setchunkversion(void *e,uint64_t chunkid,uint32_t version,uint32_t oldversion) {
+	(void)e;
+	(void)chunkid;
+	(void)version;
+	(void)oldversion;
+	return -1;
+}
+
+int matocsserv_send_duplicatechunk(void *e,uint64_t chunkid,uint32_t version,uint64_t oldchunkid,uint32_t oldversion) {
+	(void)e;
+	(void)chunkid;
+	(void)version;
+	(void)oldchunkid;
+	(void)oldversion;
+	return -1;
+}
+
+int matocsserv_send_truncatechunk(void *e,uint64_t chunkid,uint32_t length,uint32_t version,uint32_t oldversion) {
+	(void)e;
+	(void)chunkid;
+	(void)length;
+	(void)version;
+	(void)oldversion;
+	return -1;
+}
+
+int matocsserv_send_duptruncchunk(void *e,uint64_t chunkid,uint32_t version,uint64_t oldchunkid,uint32_t oldversion,uint32_t length) {
+	(void)e;
+	(void)chunkid;
+	(void)version;
+	(void)oldchunkid;
+	(void)oldversion;
+	(void)length;
+	return -1;
+}
+
+/* benchmark */
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec+ts.tv_nsec/1000000000.0;
+}
+
+// calls rehashing timer when its period passed (checked every 1024 operations)
+static inline void bench_timer(uint64_t i,double *nexttimer) {
+	double now;
+	if ((i&1023)==0 && msectimerfn) {
+		now = bench_now();
+		if (now>=*nexttimer) {
+			msectimerfn();
+			*nexttimer = now+0.01;
+		}
+	}
+}
+
+static void bench_run(uint64_t chunks) {
+	static char cs1,cs2;	// only addresses are used as server pointers
+	uint64_t i,chunkid,x,found;
+	uint8_t vc;
+	double st,newtime,existingtime,findtime,nexttimer;
+
+	rnd_init();
+	chunk_strinit();
+	nexttimer = 0.0;
+	st = bench_now();
+	for (i=0 ; i<chunks ; i++) {
+		chunk_server_has_chunk(&cs1,i+1,1);
+		bench_timer(i,&nexttimer);
+	}
+	newtime = bench_now()-st;
+	st = bench_now();
+	for (i=0 ; i<chunks ; i++) {
+		chunkid = ((i*PERMPRIME)%chunks)+1;
+		chunk_server_has_chunk(&cs2,chunkid,1);
+		bench_timer(i,&nexttimer);
+	}
+	existingtime = bench_now()-st;
+	x = 88172645463325252ULL;
+	found = 0;
+	st = bench_now();
+	for (i=0 ; i<FINDS ; i++) {
+		x ^= x<<13;
+		x ^= x>>7;
+		x ^= x<<17;
+		if (chunk_get_validcopies((x%chunks)+1,&vc)==STATUS_OK) {
+			found++;
+		}
+	}
+	findtime = bench_now()-st;
+	printf("chunks: %"PRIu64" ; new: %.2f M/s ; existing: %.2f M/s ; find: %.2f M/s",chunks,chunks/newtime/1000000.0,chunks/existingtime/1000000.0,FINDS/findtime/1000000.0);
+	if (found!=FINDS) {
+		printf(" ; ERROR: %"PRIu64" chunks not found",FINDS-found);
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+int main(int argc,char **argv) {
+	static const uint64_t defsizes[] = {10000000,100000000,500000000};
+	uint64_t chunks;
+	uint32_t i,n;
+	pid_t pid;
+	int status;
+
+	n = (argc>1)?(uint32_t)(argc-1):3;
+	for (i=0 ; i<n ; i++) {
+		chunks = (argc>1)?strtoull(argv[i+1],NULL,10):defsizes[i];
+		if (chunks==0) {
+			continue;
+		}
+		pid = fork();
+		if (pid<0) {
+			perror("fork");
+			return 1;
+		}
+		if (pid==0) {
+			bench_run(chunks);
+			_exit(0);
+		}
+		if (waitpid(pid,&status,0)<0 || !WIFEXITED(status) || WEXITSTATUS(status)!=0) {
+			printf("chunks: %"PRIu64" ; benchmark process failed (not enough memory ?)\n",chunks);
+			fflush(stdout);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,248 @@
+/*
+   Copyright 2005-2010 Jakub Kruszona-Zawadzki, Gemius SA.
+
+   This file is part of MooseFS.
+
+   MooseFS is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, version 3.
+
+   MooseFS is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MooseFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* free inode allocator microbenchmark - create throughput on nearly full inode space
+   (not built by make - build from source directory after ./configure):
+     cc -O2 -I. -Imfscommon -o freeinodes_bench mfsmaster/bench/freeinodes_bench.c
+   usage: freeinodes_bench mfsmetarestore_path [inodes [batches [inodes_per_batch]]] (default: 33554432 2000 8)
+   metadata file with given number of inodes is generated - all of them are used or waiting in freelist
+   (inode bitmap is full), and change log with 'batches' FREEINODES entries, each one releases
+   'inodes_per_batch' inodes spread over the whole inode space and is followed by the same number of CREATEs
+   (which have to get exactly released inodes - mfsmetarestore checks that)
+   mfsmetarestore is run twice: with whole change log and with FREEINODES entries only - difference is time of creates */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "datapack.h"
+
+#define TS0 1700000000U
+#define FREETS0 1000U
+#define VERSION0 1000U
+
+static char tmpdir[] = "/tmp/freeinodes_benchXXXXXX";
+
+static void bench_write(FILE *fd,const uint8_t *buff,uint32_t leng) {
+	if (fwrite(buff,1,leng,fd)!=leng) {
+		perror("write error");
+		exit(1);
+	}
+}
+
+static uint32_t bench_node(uint8_t *buff,uint32_t inode,uint8_t type,uint16_t mode) {
+	uint8_t *ptr = buff;
+	put8bit(&ptr,type);
+	put32bit(&ptr,inode);
+	put8bit(&ptr,1);	// goal
+	put16bit(&ptr,mode);
+	put32bit(&ptr,0);	// uid
+	put32bit(&ptr,0);	// gid
+	put32bit(&ptr,TS0);	// atime
+	put32bit(&ptr,TS0);	// mtime
+	put32bit(&ptr,TS0);	// ctime
+	put32bit(&ptr,86400);	// trashtime
+	return ptr-buff;
+}
+
+// inode released by given batch - inodes of each batch are spread over the whole space
+static inline uint32_t bench_batchinode(uint32_t inodes,uint32_t perbatch,uint32_t b,uint32_t j) {
+	return 3+j*(inodes/perbatch)+b;
+}
+
+// metadata (format 1.5): root, one directory (inode 2) and 'inodes' free nodes (3 ... inodes+2)
+static void bench_genmeta(const char *fname,uint32_t inodes,uint32_t batches,uint32_t perbatch) {
+	FILE *fd;
+	uint8_t buff[64],*ptr;
+	uint8_t *fbuff,*fptr;
+	uint32_t b,j,i,inode;
+
+	fd = fopen(fname,"wb");
+	if (fd==NULL) {
+		perror("can't create metadata file");
+		exit(1);
+	}
+	bench_write(fd,(const uint8_t*)"MFSM 1.5",8);
+	ptr = buff;
+	put32bit(&ptr,inodes+3);	// maxnodeid
+	put64bit(&ptr,VERSION0);
+	put32bit(&ptr,50);	// nextsessionid
+	bench_write(fd,buff,ptr-buff);
+	bench_write(fd,buff,bench_node(buff,1,'d',0777));
+	bench_write(fd,buff,bench_node(buff,2,'d',0755));
+	bench_write(fd,(const uint8_t*)"",1);	// end of nodes
+	ptr = buff;
+	put32bit(&ptr,1);
+	put32bit(&ptr,2);
+	put16bit(&ptr,1);
+	put8bit(&ptr,'d');
+	memset(ptr,0,10);	// end of edges
+	ptr+=10;
+	bench_write(fd,buff,ptr-buff);
+	// free nodes - released ones first (in batch order), then all others (with current timestamp - never released)
+	fbuff = malloc(1<<20);
+	if (fbuff==NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	ptr = buff;
+	put32bit(&ptr,inodes);
+	bench_write(fd,buff,ptr-buff);
+	fptr = fbuff;
+	for (b=0 ; b<batches ; b++) {
+		for (j=0 ; j<perbatch ; j++) {
+			put32bit(&fptr,bench_batchinode(inodes,perbatch,b,j));
+			put32bit(&fptr,FREETS0+b);
+			if (fptr-fbuff>=(1<<20)-8) {
+				bench_write(fd,fbuff,fptr-fbuff);
+				fptr = fbuff;
+			}
+		}
+	}
+	for (i=0 ; i<inodes ; i++) {
+		inode = i+3;
+		j = i/(inodes/perbatch);
+		b = i%(inodes/perbatch);
+		if (j<perbatch && b<batches) {	// released by batch 'b'
+			continue;
+		}
+		put32bit(&fptr,inode);
+		put32bit(&fptr,TS0);
+		if (fptr-fbuff>=(1<<20)-8) {
+			bench_write(fd,fbuff,fptr-fbuff);
+			fptr = fbuff;
+		}
+	}
+	bench_write(fd,fbuff,fptr-fbuff);
+	free(fbuff);
+	ptr = buff;
+	put64bit(&ptr,1);	// nextchunkid
+	memset(ptr,0,16);	// end of chunks
+	ptr+=16;
+	bench_write(fd,buff,ptr-buff);
+	if (fclose(fd)!=0) {
+		perror("write error");
+		exit(1);
+	}
+}
+
+static void bench_genlog(const char *fname,uint32_t inodes,uint32_t batches,uint32_t perbatch,int creates) {
+	FILE *fd;
+	uint64_t version;
+	uint32_t b,j;
+
+	fd = fopen(fname,"w");
+	if (fd==NULL) {
+		perror("can't create change log file");
+		exit(1);
+	}
+	version = VERSION0;
+	for (b=0 ; b<batches ; b++) {
+		fprintf(fd,"%"PRIu64": %"PRIu32"|FREEINODES():%"PRIu32"\n",version++,FREETS0+b+86401,perbatch);
+		if (creates) {
+			for (j=0 ; j<perbatch ; j++) {
+				fprintf(fd,"%"PRIu64": %"PRIu32"|CREATE(2,f_%"PRIu32"_%"PRIu32",f,420,0,0,0):%"PRIu32"\n",version++,TS0,b,j,bench_batchinode(inodes,perbatch,b,j));
+			}
+		}
+	}
+	if (fclose(fd)!=0) {
+		perror("write error");
+		exit(1);
+	}
+}
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec+ts.tv_nsec/1000000000.0;
+}
+
+// runs mfsmetarestore - returns wall time or -1.0 on error
+static double bench_restore(const char *restore,const char *meta,const char *log,const char *out) {
+	pid_t pid;
+	int status,nfd;
+	double st;
+
+	st = bench_now();
+	pid = fork();
+	if (pid<0) {
+		perror("fork");
+		return -1.0;
+	}
+	if (pid==0) {
+		nfd = open("/dev/null",O_WRONLY);
+		if (nfd>=0) {
+			dup2(nfd,1);
+			dup2(nfd,2);
+		}
+		execl(restore,restore,"-m",meta,"-o",out,log,(char*)NULL);
+		_exit(127);
+	}
+	if (waitpid(pid,&status,0)<0 || !WIFEXITED(status) || WEXITSTATUS(status)!=0) {
+		return -1.0;
+	}
+	return bench_now()-st;
+}
+
+int main(int argc,char **argv) {
+	uint32_t inodes,batches,perbatch;
+	char meta[100],log[100],flog[100],out[100];
+	double full,freeonly;
+
+	if (argc<2) {
+		fprintf(stderr,"usage: %s mfsmetarestore_path [inodes [batches [inodes_per_batch]]]\n",argv[0]);
+		return 1;
+	}
+	inodes = (argc>2)?strtoul(argv[2],NULL,10):33554432;
+	batches = (argc>3)?strtoul(argv[3],NULL,10):2000;
+	perbatch = (argc>4)?strtoul(argv[4],NULL,10):8;
+	if (perbatch==0 || batches==0 || inodes/perbatch<batches || inodes>0xFFFFFFF0U) {
+		fprintf(stderr,"wrong parameters (there have to be at least batches*inodes_per_batch inodes)\n");
+		return 1;
+	}
+	if (mkdtemp(tmpdir)==NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(meta,100,"%s/metadata.mfs",tmpdir);
+	snprintf(log,100,"%s/changelog.mfs",tmpdir);
+	snprintf(flog,100,"%s/changelog_free.mfs",tmpdir);
+	snprintf(out,100,"%s/out.mfs",tmpdir);
+	bench_genmeta(meta,inodes,batches,perbatch);
+	bench_genlog(log,inodes,batches,perbatch,1);
+	bench_genlog(flog,inodes,batches,perbatch,0);
+	freeonly = bench_restore(argv[1],meta,flog,out);
+	full = bench_restore(argv[1],meta,log,out);
+	unlink(meta);
+	unlink(log);
+	unlink(flog);
+	unlink(out);
+	rmdir(tmpdir);
+	if (freeonly<0.0 || full<0.0) {
+		fprintf(stderr,"mfsmetarestore failed\n");
+		return 1;
+	}
+	printf("inodes: %"PRIu32" ; creates: %"PRIu32" ; restore without creates: %.3fs ; with creates: %.3fs ; creates: %.3fs (%.2f us per create)\n",inodes,batches*perbatch,freeonly,full,full-freeonly,(full-freeonly)*1000000.0/(batches*perbatch));
+	return 0;
+}
@@ -19,26 +19,111 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdarg.h>
 #include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #include "main.h"
 #include "changelog.h"
+#include "changelogbin.h"
 #include "matomlserv.h"
 #include "cfg.h"
+#include "slogger.h"
+#include "massert.h"
 
-#define MAXLOGLINESIZE 200000U
 #define MAXLOGNUMBER 1000U
+#define WBUFFSIZE 0x100000
 static uint32_t BackLogsNumber;
-static FILE *fd;
+static uint8_t BinaryFormat;
+static uint32_t FlushRecords;
+static uint32_t FlushMsec;
+
+static int fd;
+static uint8_t fileformat;
+static void *flushhook;
+
+// group commit buffer
+static uint8_t *wbuff;
+static uint32_t wbuffleng;
+static uint32_t wbuffrecords;
+
+void changelog_flush(void) {
+	uint32_t woff;
+	ssize_t ret;
+	if (wbuffleng==0) {
+		return;
+	}
+	woff = 0;
+	while (fd>=0 && woff<wbuffleng) {
+		ret = write(fd,wbuff+woff,wbuffleng-woff);
+		if (ret<0) {
+			if (errno==EINTR) {
+				continue;
+			}
+			mfs_errlog_silent(LOG_WARNING,"error writing change log");
+			break;
+		}
+		woff+=ret;
+	}
+	wbuffleng = 0;
+	wbuffrecords = 0;
+}
+
+static inline void changelog_append(const void *data,uint32_t leng) {
+	if (wbuffleng+leng>WBUFFSIZE) {
+		changelog_flush();
+	}
+	if (leng>WBUFFSIZE) {	// huge record - write it directly
+		uint8_t *sbuff = wbuff;
+		wbuff = (uint8_t*)data;
+		wbuffleng = leng;
+		changelog_flush();
+		wbuff = sbuff;
+		return;
+	}
+	memcpy(wbuff+wbuffleng,data,leng);
+	wbuffleng+=leng;
+}
+
+// new files are created in configured format, existing one is continued in its own format until next rotation
+static void changelog_open(void) {
+	FILE *f;
+	fileformat = CHLOGFMT_NONE;
+	f = fopen("changelog.0.mfs","r");
+	if (f) {
+		fileformat = changelogbin_fileformat(f);
+		fclose(f);
+	}
+	fd = open("changelog.0.mfs",O_WRONLY | O_CREAT | O_APPEND,0666);
+	if (fd<0) {
+		return;
+	}
+	if (fileformat==CHLOGFMT_NONE) {
+		fileformat = BinaryFormat?CHLOGFMT_BINARY:CHLOGFMT_TEXT;
+		if (fileformat==CHLOGFMT_BINARY) {
+			changelog_append(CHLOGBIN_SIGNATURE,CHLOGBIN_SIGNATURE_SIZE);
+		}
+	}
+}
+
+int changelog_isbinary(void) {
+	if (fd>=0) {
+		return (fileformat==CHLOGFMT_BINARY)?1:0;
+	}
+	return BinaryFormat;
+}
 
 void changelog_rotate() {
 	char logname1[100],logname2[100];
 	uint32_t i;
-	if (fd) {
-		fclose(fd);
-		fd=NULL;
+	changelog_flush();
+	if (fd>=0) {
+		close(fd);
+		fd=-1;
 	}
 	if (BackLogsNumber>0) {
 		for (i=BackLogsNumber ; i>0 ; i--) {
@@ -52,50 +137,108 @@ void changelog_rotate() {
 	matomlserv_broadcast_logrotate();
 }
 
-void changelog(uint64_t version,const char *format,...) {
-	static char printbuff[MAXLOGLINESIZE];
+// binary record is packed only when changelog is written in binary format, otherwise text entry is formatted directly from arguments
+void changelog(uint64_t version,uint32_t ts,uint8_t opcode,...) {
+	static uint8_t *rec = NULL;
+	static uint32_t recsize = 0;
+	static char *text = NULL;
+	static uint32_t textsize = 0;
+	char vstr[24];
 	va_list ap;
 	uint32_t leng;
 
-	va_start(ap,format);
-	leng = vsnprintf(printbuff,MAXLOGLINESIZE,format,ap);
-	va_end(ap);
-	if (leng>=MAXLOGLINESIZE) {
-		printbuff[MAXLOGLINESIZE-1]='\0';
-		leng=MAXLOGLINESIZE;
+	if (fd<0) {
+		changelog_open();
+	}
+
+	if (changelog_isbinary()) {
+		va_start(ap,opcode);
+		leng = changelogbin_vpack(&rec,&recsize,version,ts,opcode,ap);
+		va_end(ap);
+		if (fd<0) {
+			if (changelogbin_totext(rec,leng,&text,&textsize)!=(uint32_t)-1) {
+				syslog(LOG_NOTICE,"lost MFS change %"PRIu64": %s",version,text);
+			}
+		} else {
+			changelog_append(rec,leng);
+		}
+		matomlserv_broadcast_logrecord(version,rec,leng);
 	} else {
-		leng++;
+		va_start(ap,opcode);
+		leng = changelogbin_vtext(&text,&textsize,ts,opcode,ap);
+		va_end(ap);
+		if (fd<0) {
+			syslog(LOG_NOTICE,"lost MFS change %"PRIu64": %s",version,text);
+		} else {
+			changelog_append(vstr,snprintf(vstr,24,"%"PRIu64": ",version));
+			text[leng]='\n';
+			changelog_append(text,leng+1);
+			text[leng]='\0';
+		}
+		matomlserv_broadcast_logstring(version,text,leng+1);
 	}
 
-	if (fd==NULL) {
-		fd = fopen("changelog.0.mfs","a");
-		if (!fd) {
-			syslog(LOG_NOTICE,"lost MFS change %"PRIu64": %s",version,printbuff);
+	if (fd>=0) {
+		wbuffrecords++;
+		if (wbuffrecords>=FlushRecords) {
+			changelog_flush();
 		}
 	}
+}
 
-	if (fd) {
-		fprintf(fd,"%"PRIu64": %s\n",version,printbuff);
-		fflush(fd);
+static void changelog_term(void) {
+	changelog_flush();
+	if (fd>=0) {
+		close(fd);
+		fd=-1;
 	}
-	matomlserv_broadcast_logstring(version,(uint8_t*)printbuff,leng);
+	free(wbuff);
 }
 
-void changelog_reload(void) {
+static int changelog_loadconfig(void) {
 	BackLogsNumber = cfg_getuint32("BACK_LOGS",50);
+	BinaryFormat = cfg_getuint8("CHANGELOG_BINARY",0)?1:0;
+	FlushRecords = cfg_getuint32("CHANGELOG_FLUSH_RECORDS",1);
+	FlushMsec = cfg_getuint32("CHANGELOG_FLUSH_MSEC",100);
+	if (FlushRecords==0) {
+		FlushRecords=1;
+	}
+	if (FlushMsec==0) {
+		FlushMsec=1;
+	}
+	if (FlushMsec>60000) {
+		FlushMsec=60000;
+	}
 	if (BackLogsNumber>MAXLOGNUMBER) {
+		return -1;
+	}
+	return 0;
+}
+
+void changelog_reload(void) {
+	if (changelog_loadconfig()<0) {
 		syslog(LOG_WARNING,"BACK_LOGS value too big !!!");
-		BackLogsNumber = MAXLOGLINESIZE;
+		BackLogsNumber = MAXLOGNUMBER;
+	}
+	main_msectimechange(flushhook,TIMEMODE_SKIP_LATE,FlushMsec,0);
+	if (wbuffrecords>=FlushRecords) {
+		changelog_flush();
 	}
 }
 
 int changelog_init(void) {
-	BackLogsNumber = cfg_getuint32("BACK_LOGS",50);
-	if (BackLogsNumber>MAXLOGNUMBER) {
+	if (changelog_loadconfig()<0) {
 		fprintf(stderr,"BACK_LOGS value too big !!!");
 		return -1;
 	}
+	wbuff = malloc(WBUFFSIZE);
+	passert(wbuff);
+	wbuffleng = 0;
+	wbuffrecords = 0;
+	fd = -1;
+	fileformat = CHLOGFMT_NONE;
 	main_reloadregister(changelog_reload);
-	fd = NULL;
+	main_destructregister(changelog_term);
+	flushhook = main_msectimeregister(TIMEMODE_SKIP_LATE,FlushMsec,0,changelog_flush);
 	return 0;
 }
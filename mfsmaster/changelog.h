@@ -21,8 +21,13 @@
 
 #include <inttypes.h>
 
+#include "changelogbin.h"
+
 void changelog_rotate(void);
-void changelog(uint64_t version,const char *format,...);
+void changelog_flush(void);
+int changelog_isbinary(void);
+// arguments have to match record description of given opcode (see changelogbin.c)
+void changelog(uint64_t version,uint32_t ts,uint8_t opcode,...);
 int changelog_init(void);
 
 #endif
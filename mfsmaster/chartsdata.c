@@ -62,6 +62,7 @@
 #include "chunks.h"
 #include "filesystem.h"
 #include "matoclserv.h"
+#include "pktbuf.h"
 
 #define CHARTS_FILENAME "stats.mfs"
 
@@ -90,8 +91,16 @@
 #define CHARTS_PACKETSSENT 22
 #define CHARTS_BYTESRCVD 23
 #define CHARTS_BYTESSENT 24
+#define CHARTS_NETAVG 25
+#define CHARTS_NETMAX 26
+#define CHARTS_BUFHIT 27
+#define CHARTS_WRCALLS 28
+#define CHARTS_REPQ0 29
+#define CHARTS_REPQ1 30
+#define CHARTS_REPQ2 31
+#define CHARTS_REPQ3 32
 
-#define CHARTS 25
+#define CHARTS 33
 
 /* name , join mode , percent , scale , multiplier , divisor */
 #define STATDEFS { \
@@ -120,6 +129,14 @@
 	{"psent"        ,CHARTS_MODE_ADD,0,CHARTS_SCALE_MILI ,1000,60}, \
 	{"brcvd"        ,CHARTS_MODE_ADD,0,CHARTS_SCALE_MILI ,8000,60}, \
 	{"bsent"        ,CHARTS_MODE_ADD,0,CHARTS_SCALE_MILI ,8000,60}, \
+	{"netavg"       ,CHARTS_MODE_ADD,1,CHARTS_SCALE_MICRO, 100,60}, \
+	{"netmax"       ,CHARTS_MODE_ADD,1,CHARTS_SCALE_MICRO, 100,60}, \
+	{"bufhit"       ,CHARTS_MODE_ADD,1,CHARTS_SCALE_MICRO, 100, 1}, \
+	{"wrcalls"      ,CHARTS_MODE_ADD,0,CHARTS_SCALE_MILI ,   1, 1}, \
+	{"repq0"        ,CHARTS_MODE_MAX,0,CHARTS_SCALE_NONE ,   1, 1}, \
+	{"repq1"        ,CHARTS_MODE_MAX,0,CHARTS_SCALE_NONE ,   1, 1}, \
+	{"repq2"        ,CHARTS_MODE_MAX,0,CHARTS_SCALE_NONE ,   1, 1}, \
+	{"repq3"        ,CHARTS_MODE_MAX,0,CHARTS_SCALE_NONE ,   1, 1}, \
 	{NULL           ,0              ,0,0                 ,   0, 0}  \
 };
 
@@ -151,6 +168,7 @@ uint64_t chartsdata_memusage(void) {
 void chartsdata_refresh(void) {
 	uint64_t data[CHARTS];
 	uint32_t fsdata[16];
+	uint64_t allocs,hits,wrcalls,wrpackets;
 	uint32_t i,del,repl; //,bin,bout,opr,opw,dbr,dbw,dopr,dopw,repl;
 #ifdef CPU_USAGE
 	struct itimerval uc,pc;
@@ -227,11 +245,20 @@ void chartsdata_refresh(void) {
 	chunk_stats(&del,&repl);
 	data[CHARTS_DELCHUNK]=del;
 	data[CHARTS_REPLCHUNK]=repl;
+	chunk_repq_stats(data+CHARTS_REPQ0);
 	fs_stats(fsdata);
 	for (i=0 ; i<16 ; i++) {
 		data[CHARTS_STATFS+i]=fsdata[i];
 	}
 	matoclserv_stats(data+CHARTS_PACKETSRCVD);
+	matoclserv_netstats(data+CHARTS_NETAVG);
+	pktbuf_stats(&allocs,&hits,&wrcalls,&wrpackets);
+	if (allocs>0) {
+		data[CHARTS_BUFHIT] = hits*1000000/allocs;
+	}
+	if (wrpackets>0) {
+		data[CHARTS_WRCALLS] = wrcalls*1000/wrpackets;
+	}
 
 	charts_add(data,main_time()-60);
 }
@@ -44,6 +44,8 @@
 
 #include "chunks.h"
 #include "filesystem.h"
+#include "metaindex.h"
+#include "fshash.h"
 #include "datapack.h"
 #include "massert.h"
 
@@ -56,8 +58,6 @@
 #define MAXCPS 10000000
 #define MINCPS 10000
 
-#define HASHSIZE 0x100000
-#define HASHPOS(chunkid) (((uint32_t)chunkid)&0xFFFFF)
 
 #ifndef METARESTORE
 
@@ -136,6 +136,7 @@ typedef struct chunk {
 	unsigned needverincrease:1;
 	unsigned interrupted:1;
 	unsigned operation:4;
+	unsigned inrepq:1;
 #endif
 	uint32_t lockedto;
 	uint32_t fcount;
@@ -144,7 +145,10 @@ typedef struct chunk {
 	slist *slisthead;
 //	bcdata *bestchunk;
 #endif
-	uint32_t *ftab;
+	union {
+		uint32_t *ftab;		// fcount>1 - number of files for each goal (NULL when all files have the same goal)
+		uint32_t owner;		// fcount==1 - inode of this file (0 - unknown) - used only as a hint for fs_test_markdirty
+	} files;
 //	flist *flisthead;
 	struct chunk *next;
 } chunk;
@@ -161,7 +165,8 @@ static chunk_bucket *cbhead = NULL;
 static chunk *chfreehead = NULL;
 #endif /* USE_CHUNK_BUCKETS */
 
-static chunk *chunkhash[HASHSIZE];
+// chunk ids are given sequentially, so low 32 bits of chunkid are used as hash value
+static fshash chunkhash;
 static uint64_t nextchunkid=1;
 #define LOCKTIMEOUT 120
 
@@ -178,13 +183,16 @@ static uint32_t MaxDelSoftLimit;
 static uint32_t MaxDelHardLimit;
 static double TmpMaxDelFrac;
 static uint32_t TmpMaxDel;
-static uint32_t HashSteps;
+static uint32_t HashLoopTime;
 static uint32_t HashCPS;
 static double AcceptableDifference;
+static double LocationsLoadWeight;
+static double LocationsLatencyWeight;
 
 static uint32_t jobshpos;
 static uint32_t jobsrebalancecount;
 static uint32_t jobsnorepbefore;
+static uint16_t jobsuscount;
 
 static uint32_t starttime;
 
@@ -202,6 +210,7 @@ typedef struct _loop_info {
 } loop_info;
 
 static loop_info chunksinfo = {{0,0,0,0,0},{0,0,0,0,0},0};
+static loop_info inforec;
 static uint32_t chunksinfo_loopstart=0,chunksinfo_loopend=0;
 
 #endif
@@ -216,6 +225,9 @@ static uint32_t chunks;
 #ifndef METARESTORE
 uint32_t allchunkcounts[11][11];
 uint32_t regularchunkcounts[11][11];
+// number of file references to chunks with less valid copies than goal of the file (ug) and without valid copies (m)
+static uint32_t ugfilerefs;
+static uint32_t mfilerefs;
 #endif
 
 #ifndef METARESTORE
@@ -404,8 +416,38 @@ void chunk_cfg_check() {
 }
 #endif
 */
+static void chunk_hash_movebucket(fshash *h,void *first) {
+	chunk *c,*cn;
+	chunk **b;
+	for (c=(chunk*)first ; c ; c=cn) {
+		cn = c->next;
+		b = (chunk**)(h->tab+(((uint32_t)(c->chunkid))&(h->size-1)));
+		c->next = *b;
+		*b = c;
+	}
+}
+
+#ifndef METARESTORE
+static void *chunkhashhook;
+static uint8_t chunkhashactive;
+
+static void chunk_hash_rehash(void) {
+	uint8_t active;
+	fshash_step(&chunkhash,FSHASH_TIMERSTEP);
+	active = (chunkhash.oldtab)?1:0;
+	if (active!=chunkhashactive) {	// rehashing is started by inserts/removes - idle timer only notices it
+		chunkhashactive = active;
+		main_msectimechange(chunkhashhook,TIMEMODE_SKIP_LATE,active?FSHASH_REHASHMSEC:FSHASH_IDLEMSEC,0);
+	}
+}
+#endif
+
+static inline chunk** chunk_hash_bucket(uint64_t chunkid) {
+	return (chunk**)fshash_bucket(&chunkhash,(uint32_t)chunkid);
+}
+
 chunk* chunk_new(uint64_t chunkid) {
-	uint32_t chunkpos = HASHPOS(chunkid);
+	chunk **b;
 	chunk *newchunk;
 	newchunk = chunk_malloc();
 #ifdef METARESTORE
@@ -416,8 +458,10 @@ chunk* chunk_new(uint64_t chunkid) {
 	allchunkcounts[0][0]++;
 	regularchunkcounts[0][0]++;
 #endif
-	newchunk->next = chunkhash[chunkpos];
-	chunkhash[chunkpos] = newchunk;
+	b = chunk_hash_bucket(chunkid);
+	newchunk->next = *b;
+	*b = newchunk;
+	chunkhash.elements++;
 	newchunk->chunkid = chunkid;
 	newchunk->version = 0;
 	newchunk->goal = 0;
@@ -428,18 +472,19 @@ chunk* chunk_new(uint64_t chunkid) {
 	newchunk->needverincrease = 1;
 	newchunk->interrupted = 0;
 	newchunk->operation = NONE;
+	newchunk->inrepq = 0;
 	newchunk->slisthead = NULL;
 #endif
 	newchunk->fcount = 0;
 //	newchunk->flisthead = NULL;
-	newchunk->ftab = NULL;
+	newchunk->files.ftab = NULL;
 	lastchunkid = chunkid;
 	lastchunkptr = newchunk;
+	fshash_check(&chunkhash);
 	return newchunk;
 }
 
 chunk* chunk_find(uint64_t chunkid) {
-	uint32_t chunkpos = HASHPOS(chunkid);
 	chunk *chunkit;
 #ifdef METARESTORE
 	printf("F%"PRIu64"\n",chunkid);
@@ -447,7 +492,7 @@ chunk* chunk_find(uint64_t chunkid) {
 	if (lastchunkid==chunkid) {
 		return lastchunkptr;
 	}
-	for (chunkit = chunkhash[chunkpos] ; chunkit ; chunkit = chunkit->next ) {
+	for (chunkit = *chunk_hash_bucket(chunkid) ; chunkit ; chunkit = chunkit->next ) {
 		if (chunkit->chunkid == chunkid) {
 			lastchunkid = chunkid;
 			lastchunkptr = chunkit;
@@ -458,6 +503,7 @@ chunk* chunk_find(uint64_t chunkid) {
 }
 
 #ifndef METARESTORE
+// chunk has to be already unlinked from chunkhash (fshash_check is called by chunk loop)
 void chunk_delete(chunk* c) {
 //	slist *s;
 //	flist *f;
@@ -478,12 +524,136 @@ void chunk_delete(chunk* c) {
 	}
 */
 	chunks--;
+	chunkhash.elements--;
 	allchunkcounts[c->goal][0]--;
 	regularchunkcounts[c->goal][0]--;
 	chunk_free(c);
 }
 
-static inline void chunk_state_change(uint8_t oldgoal,uint8_t newgoal,uint8_t oldavc,uint8_t newavc,uint8_t oldrvc,uint8_t newrvc) {
+static inline uint32_t chunk_ugrefs(chunk *c,uint8_t avc) {
+	uint32_t g,r;
+	if (c->fcount==0 || avc==0 || avc>=c->goal) {
+		return 0;
+	}
+	if (c->fcount>1 && c->files.ftab) {
+		r = 0;
+		for (g=avc+1 ; g<10 ; g++) {
+			r += c->files.ftab[g];
+		}
+		return r;
+	}
+	return c->fcount;
+}
+
+static inline uint32_t chunk_mrefs(chunk *c,uint8_t avc) {
+	return (avc==0)?c->fcount:0;
+}
+
+void chunk_get_problemrefs(uint32_t *ugrefs,uint32_t *mrefs) {
+	*ugrefs = ugfilerefs;
+	*mrefs = mfilerefs;
+}
+
+void chunk_set_owner(uint64_t chunkid,uint32_t inode) {
+	chunk *c;
+	c = chunk_find(chunkid);
+	if (c && c->fcount==1) {
+		c->files.owner = inode;
+	}
+}
+
+/* replication queue - under-goal chunks ordered by number of regular valid copies and then by goal deficit,
+   so the most endangered chunks are replicated first instead of waiting for the chunk loop to reach them.
+   Entries are not removed on state change - priority is checked again when entry is taken from the queue */
+#define REPQ_PRIOS 100
+#define REPQ_NONE 0xFF
+#define REPQ_MAXENTRIES 0x400000
+#define REPQ_REFILLSTEPS 1000
+
+typedef struct _repq_entry {
+	uint64_t chunkid;
+	uint8_t prio;
+	struct _repq_entry *next;
+} repq_entry;
+
+static repq_entry *repqhead[REPQ_PRIOS],**repqtail[REPQ_PRIOS];
+static uint32_t repqentries[REPQ_PRIOS];	// entries in queue (some of them may be outdated)
+static uint32_t repqchunks[REPQ_PRIOS];	// under-goal chunks with given priority
+static uint32_t repqallentries;
+
+static inline uint8_t chunk_repq_prio(uint8_t goal,uint8_t avc,uint8_t rvc) {
+	if (goal>9) {
+		goal=10;
+	}
+	if (avc==0 || rvc>=goal) {
+		return REPQ_NONE;
+	}
+	return rvc*10+10-(goal-rvc);
+}
+
+static inline void chunk_repq_append(repq_entry *e) {
+	e->next = NULL;
+	*(repqtail[e->prio]) = e;
+	repqtail[e->prio] = &(e->next);
+	repqentries[e->prio]++;
+}
+
+static inline repq_entry* chunk_repq_pop(uint8_t prio) {
+	repq_entry *e;
+	e = repqhead[prio];
+	repqhead[prio] = e->next;
+	if (repqhead[prio]==NULL) {
+		repqtail[prio] = &(repqhead[prio]);
+	}
+	repqentries[prio]--;
+	return e;
+}
+
+// chunk loop queues it again (step 8)
+static inline void chunk_repq_drop(repq_entry *e,chunk *c) {
+	if (c) {
+		c->inrepq = 0;
+	}
+	free(e);
+	repqallentries--;
+}
+
+static inline int chunk_repq_add(chunk *c,uint8_t prio) {
+	repq_entry *e;
+	if (repqallentries>=REPQ_MAXENTRIES) {	// chunk loop will find it later
+		c->inrepq = 0;
+		return -1;
+	}
+	e = (repq_entry*)malloc(sizeof(repq_entry));
+	passert(e);
+	e->chunkid = c->chunkid;
+	e->prio = prio;
+	chunk_repq_append(e);
+	repqallentries++;
+	c->inrepq = 1;
+	return 0;
+}
+
+// number of chunks waiting for replication with 0, 1, 2 and more regular valid copies
+void chunk_repq_stats(uint64_t stats[4]) {
+	uint32_t i;
+	for (i=0 ; i<4 ; i++) {
+		stats[i] = 0;
+	}
+	for (i=0 ; i<REPQ_PRIOS ; i++) {
+		stats[(i<30)?i/10:3] += repqchunks[i];
+	}
+}
+
+static inline void chunk_state_change(chunk *c,uint8_t oldgoal,uint8_t newgoal,uint8_t oldavc,uint8_t newavc,uint8_t oldrvc,uint8_t newrvc) {
+	uint8_t oldprio,newprio;
+	if (oldavc!=newavc) {
+		ugfilerefs += chunk_ugrefs(c,newavc) - chunk_ugrefs(c,oldavc);
+		mfilerefs += chunk_mrefs(c,newavc) - chunk_mrefs(c,oldavc);
+		if (c->fcount==1 && c->files.owner!=0) {
+			fs_test_markdirty(c->files.owner);
+		}	// files of shared chunks are checked only by fs_test_files loop
+	}
 	if (oldgoal>9) {
 		oldgoal=10;
 	}
@@ -506,6 +676,20 @@ static inline void chunk_state_change(uint8_t oldgoal,uint8_t newgoal,uint8_t ol
 	allchunkcounts[newgoal][newavc]++;
 	regularchunkcounts[oldgoal][oldrvc]--;
 	regularchunkcounts[newgoal][newrvc]++;
+	oldprio = chunk_repq_prio(oldgoal,oldavc,oldrvc);
+	newprio = chunk_repq_prio(newgoal,newavc,newrvc);
+	if (oldprio!=newprio) {
+		if (oldprio!=REPQ_NONE) {
+			repqchunks[oldprio]--;
+		}
+		if (newprio!=REPQ_NONE) {
+			repqchunks[newprio]++;
+			// chunks under goal since start are queued by chunk loop
+			if ((c->inrepq==0 || newprio<oldprio) && starttime+ReplicationsDelayInit<=main_time()) {
+				chunk_repq_add(c,newprio);
+			}
+		}
+	}
 }
 
 uint32_t chunk_count(void) {
@@ -799,6 +983,7 @@ int chunk_change_file(uint64_t chunkid,uint8_t prevgoal,uint8_t newgoal) {
 	chunk *c;
 #ifndef METARESTORE
 	uint8_t oldgoal;
+	uint32_t ug,m;
 #endif
 	if (prevgoal==newgoal) {
 		return STATUS_OK;
@@ -822,31 +1007,35 @@ int chunk_change_file(uint64_t chunkid,uint8_t prevgoal,uint8_t newgoal) {
 	}
 #ifndef METARESTORE
 	oldgoal = c->goal;
+	ug = chunk_ugrefs(c,c->allvalidcopies);
+	m = chunk_mrefs(c,c->allvalidcopies);
 #endif
 	if (c->fcount==1) {
 		c->goal = newgoal;
 	} else {
-		if (c->ftab==NULL) {
-			c->ftab = malloc(sizeof(uint32_t)*10);
-			passert(c->ftab);
-			memset(c->ftab,0,sizeof(uint32_t)*10);
-			c->ftab[c->goal]=c->fcount-1;
-			c->ftab[newgoal]=1;
+		if (c->files.ftab==NULL) {
+			c->files.ftab = malloc(sizeof(uint32_t)*10);
+			passert(c->files.ftab);
+			memset(c->files.ftab,0,sizeof(uint32_t)*10);
+			c->files.ftab[c->goal]=c->fcount-1;
+			c->files.ftab[newgoal]=1;
 			if (newgoal > c->goal) {
 				c->goal = newgoal;
 			}
 		} else {
-			c->ftab[prevgoal]--;
-			c->ftab[newgoal]++;
+			c->files.ftab[prevgoal]--;
+			c->files.ftab[newgoal]++;
 			c->goal = 9;
-			while (c->ftab[c->goal]==0) {
+			while (c->files.ftab[c->goal]==0) {
 				c->goal--;
 			}
 		}
 	}
 #ifndef METARESTORE
+	ugfilerefs += chunk_ugrefs(c,c->allvalidcopies) - ug;
+	mfilerefs += chunk_mrefs(c,c->allvalidcopies) - m;
 	if (oldgoal!=c->goal) {
-		chunk_state_change(oldgoal,c->goal,c->allvalidcopies,c->allvalidcopies,c->regularvalidcopies,c->regularvalidcopies);
+		chunk_state_change(c,oldgoal,c->goal,c->allvalidcopies,c->allvalidcopies,c->regularvalidcopies,c->regularvalidcopies);
 	}
 #endif
 	return STATUS_OK;
@@ -855,6 +1044,7 @@ int chunk_change_file(uint64_t chunkid,uint8_t prevgoal,uint8_t newgoal) {
 static inline int chunk_delete_file_int(chunk *c,uint8_t goal) {
 #ifndef METARESTORE
 	uint8_t oldgoal;
+	uint32_t ug,m;
 #endif
 	if (c->fcount==0) {
 //#ifndef METARESTORE
@@ -871,30 +1061,35 @@ static inline int chunk_delete_file_int(chunk *c,uint8_t goal) {
 	}
 #ifndef METARESTORE
 	oldgoal = c->goal;
+	ug = chunk_ugrefs(c,c->allvalidcopies);
+	m = chunk_mrefs(c,c->allvalidcopies);
 #endif
 	if (c->fcount==1) {
 		c->goal = 0;
 		c->fcount = 0;
+		c->files.ftab = NULL;
 #ifdef METARESTORE
 		printf("D%"PRIu64"\n",c->chunkid);
 #endif
 	} else {
-		if (c->ftab) {
-			c->ftab[goal]--;
+		if (c->files.ftab) {
+			c->files.ftab[goal]--;
 			c->goal = 9;
-			while (c->ftab[c->goal]==0) {
+			while (c->files.ftab[c->goal]==0) {
 				c->goal--;
 			}
 		}
 		c->fcount--;
-		if (c->fcount==1 && c->ftab) {
-			free(c->ftab);
-			c->ftab = NULL;
+		if (c->fcount==1 && c->files.ftab) {
+			free(c->files.ftab);
+			c->files.ftab = NULL;
 		}
 	}
 #ifndef METARESTORE
+	ugfilerefs += chunk_ugrefs(c,c->allvalidcopies) - ug;
+	mfilerefs += chunk_mrefs(c,c->allvalidcopies) - m;
 	if (oldgoal!=c->goal) {
-		chunk_state_change(oldgoal,c->goal,c->allvalidcopies,c->allvalidcopies,c->regularvalidcopies,c->regularvalidcopies);
+		chunk_state_change(c,oldgoal,c->goal,c->allvalidcopies,c->allvalidcopies,c->regularvalidcopies,c->regularvalidcopies);
 	}
 #endif
 	return STATUS_OK;
@@ -903,41 +1098,49 @@ static inline int chunk_delete_file_int(chunk *c,uint8_t goal) {
 static inline int chunk_add_file_int(chunk *c,uint8_t goal) {
 #ifndef METARESTORE
 	uint8_t oldgoal;
+	uint32_t ug,m;
 #endif
 #ifndef METARESTORE
 	oldgoal = c->goal;
+	ug = chunk_ugrefs(c,c->allvalidcopies);
+	m = chunk_mrefs(c,c->allvalidcopies);
 #endif
+	if (c->fcount==1) {	// forget owner
+		c->files.ftab = NULL;
+	}
 	if (c->fcount==0) {
 		c->goal = goal;
 		c->fcount = 1;
 	} else if (goal==c->goal) {
 		c->fcount++;
-		if (c->ftab) {
-			c->ftab[goal]++;
+		if (c->files.ftab) {
+			c->files.ftab[goal]++;
 		}
 	} else {
-		if (c->ftab==NULL) {
-			c->ftab = malloc(sizeof(uint32_t)*10);
-			passert(c->ftab);
-			memset(c->ftab,0,sizeof(uint32_t)*10);
-			c->ftab[c->goal]=c->fcount;
-			c->ftab[goal]=1;
+		if (c->files.ftab==NULL) {
+			c->files.ftab = malloc(sizeof(uint32_t)*10);
+			passert(c->files.ftab);
+			memset(c->files.ftab,0,sizeof(uint32_t)*10);
+			c->files.ftab[c->goal]=c->fcount;
+			c->files.ftab[goal]=1;
 			c->fcount++;
 			if (goal > c->goal) {
 				c->goal = goal;
 			}
 		} else {
-			c->ftab[goal]++;
+			c->files.ftab[goal]++;
 			c->fcount++;
 			c->goal = 9;
-			while (c->ftab[c->goal]==0) {
+			while (c->files.ftab[c->goal]==0) {
 				c->goal--;
 			}
 		}
 	}
 #ifndef METARESTORE
+	ugfilerefs += chunk_ugrefs(c,c->allvalidcopies) - ug;
+	mfilerefs += chunk_mrefs(c,c->allvalidcopies) - m;
 	if (oldgoal!=c->goal) {
-		chunk_state_change(oldgoal,c->goal,c->allvalidcopies,c->allvalidcopies,c->regularvalidcopies,c->regularvalidcopies);
+		chunk_state_change(c,oldgoal,c->goal,c->allvalidcopies,c->allvalidcopies,c->regularvalidcopies,c->regularvalidcopies);
 	}
 #endif
 	return STATUS_OK;
@@ -1084,7 +1287,7 @@ int chunk_multi_modify(uint32_t ts,uint64_t *nchunkid,uint64_t ochunkid,uint8_t
 			c->slisthead = s;
 			matocsserv_send_createchunk(s->ptr,c->chunkid,c->version);
 		}
-		chunk_state_change(c->goal,c->goal,0,c->allvalidcopies,0,c->regularvalidcopies);
+		chunk_state_change(c,c->goal,c->goal,0,c->allvalidcopies,0,c->regularvalidcopies);
 		*opflag=1;
 #endif
 		*nchunkid = c->chunkid;
@@ -1180,7 +1383,7 @@ int chunk_multi_modify(uint32_t ts,uint64_t *nchunkid,uint64_t ochunkid,uint8_t
 				}
 			}
 			if (c!=NULL) {
-				chunk_state_change(c->goal,c->goal,0,c->allvalidcopies,0,c->regularvalidcopies);
+				chunk_state_change(c,c->goal,c->goal,0,c->allvalidcopies,0,c->regularvalidcopies);
 			}
 			if (i>0) {
 #endif
@@ -1294,7 +1497,7 @@ int chunk_multi_truncate(uint32_t ts,uint64_t *nchunkid,uint64_t ochunkid,uint8_
 			}
 		}
 		if (c!=NULL) {
-			chunk_state_change(c->goal,c->goal,0,c->allvalidcopies,0,c->regularvalidcopies);
+			chunk_state_change(c,c->goal,c->goal,0,c->allvalidcopies,0,c->regularvalidcopies);
 		}
 		if (i>0) {
 #endif
@@ -1413,7 +1616,7 @@ int chunk_repair(uint8_t goal,uint64_t ochunkid,uint32_t *nversion) {
 		if (c->regularvalidcopies>0) {
 			syslog(LOG_WARNING,"wrong regular valid copies counter - (counter value: %u, should be: 0) - fixed",c->regularvalidcopies);
 		}
-		chunk_state_change(c->goal,c->goal,c->allvalidcopies,0,c->regularvalidcopies,0);
+		chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,0,c->regularvalidcopies,0);
 		c->allvalidcopies = 0;
 		c->regularvalidcopies = 0;
 	}
@@ -1426,7 +1629,7 @@ int chunk_repair(uint8_t goal,uint64_t ochunkid,uint32_t *nversion) {
 		}
 	}
 	*nversion = bestversion;
-	chunk_state_change(c->goal,c->goal,0,c->allvalidcopies,0,c->regularvalidcopies);
+	chunk_state_change(c,c->goal,c->goal,0,c->allvalidcopies,0,c->regularvalidcopies);
 	c->needverincrease=1;
 	return 1;
 }
@@ -1484,9 +1687,15 @@ int chunk_increase_version(uint64_t chunkid) {
 
 #ifndef METARESTORE
 
+// load penalty is counted in quarters of topology distance step (servers with similar load are still ordered randomly)
+#define LOCATIONS_COST_QUANTA 4
+#define LOCATIONS_MAXPENALTY 0x10000
+
 typedef struct locsort {
 	uint32_t ip;
 	uint16_t port;
+	uint8_t loadknown;
+	double penalty;
 	uint32_t dist;
 	uint32_t rnd;
 } locsort;
@@ -1510,8 +1719,10 @@ int chunk_getversionandlocations(uint64_t chunkid,uint32_t cuip,uint32_t *versio
 	chunk *c;
 	slist *s;
 	uint8_t i;
-	uint8_t cnt;
+	uint8_t cnt,known;
 	uint8_t *wptr;
+	uint32_t queue,reads,rlatency;
+	double penalty,penaltysum;
 	locsort lstab[100];
 
 	c = chunk_find(chunkid);
@@ -1520,16 +1731,39 @@ int chunk_getversionandlocations(uint64_t chunkid,uint32_t cuip,uint32_t *versio
 	}
 	*version = c->version;
 	cnt=0;
+	known=0;
+	penaltysum=0.0;
 	for (s=c->slisthead ;s ; s=s->next) {
 		if (s->valid!=INVALID && s->valid!=DEL) {
 			if (cnt<100 && matocsserv_getlocation(s->ptr,&(lstab[cnt].ip),&(lstab[cnt].port))==0) {
-				lstab[cnt].dist = topology_distance(lstab[cnt].ip,cuip);	// in the future prepare more sofisticated distance function
+				// topology distance increased by server load - busy or slow server is treated as more distant one
+				if (matocsserv_getload(s->ptr,&queue,&reads,&rlatency)==0) {
+					penalty = LocationsLoadWeight*(queue+reads) + LocationsLatencyWeight*(rlatency/1000.0);
+					if (penalty>LOCATIONS_MAXPENALTY) {
+						penalty = LOCATIONS_MAXPENALTY;
+					}
+					lstab[cnt].loadknown = 1;
+					lstab[cnt].penalty = penalty;
+					penaltysum += penalty;
+					known++;
+				} else {
+					lstab[cnt].loadknown = 0;
+				}
+				lstab[cnt].dist = topology_distance(lstab[cnt].ip,cuip);
 				lstab[cnt].rnd = rndu32();
 				cnt++;
 			}
 //			sptr[cnt++]=s->ptr;
 		}
 	}
+	// servers which haven't reported their load yet get average load of other servers
+	penalty = (known>0)?penaltysum/known:0.0;
+	for (i=0 ; i<cnt ; i++) {
+		if (lstab[i].loadknown==0) {
+			lstab[i].penalty = penalty;
+		}
+		lstab[i].dist = lstab[i].dist*LOCATIONS_COST_QUANTA + (uint32_t)(lstab[i].penalty*LOCATIONS_COST_QUANTA);
+	}
 	qsort(lstab,cnt,sizeof(locsort),chunk_locsort_cmp);
 	wptr = loc;
 	for (i=0 ; i<cnt ; i++) {
@@ -1580,12 +1814,12 @@ void chunk_server_has_chunk(void *ptr,uint64_t chunkid,uint32_t version) {
 		if (version&0x80000000) {
 			s->valid=TDVALID;
 			s->version = c->version;
-			chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies+1,c->regularvalidcopies,c->regularvalidcopies);
+			chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies+1,c->regularvalidcopies,c->regularvalidcopies);
 			c->allvalidcopies++;
 		} else {
 			s->valid=VALID;
 			s->version = c->version;
-			chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies+1,c->regularvalidcopies,c->regularvalidcopies+1);
+			chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies+1,c->regularvalidcopies,c->regularvalidcopies+1);
 			c->allvalidcopies++;
 			c->regularvalidcopies++;
 		}
@@ -1609,11 +1843,11 @@ void chunk_damaged(void *ptr,uint64_t chunkid) {
 	for (s=c->slisthead ; s ; s=s->next) {
 		if (s->ptr==ptr) {
 			if (s->valid==TDBUSY || s->valid==TDVALID) {
-				chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
+				chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
 				c->allvalidcopies--;
 			}
 			if (s->valid==BUSY || s->valid==VALID) {
-				chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
+				chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
 				c->allvalidcopies--;
 				c->regularvalidcopies--;
 			}
@@ -1643,11 +1877,11 @@ void chunk_lost(void *ptr,uint64_t chunkid) {
 	while ((s=*sptr)) {
 		if (s->ptr==ptr) {
 			if (s->valid==TDBUSY || s->valid==TDVALID) {
-				chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
+				chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
 				c->allvalidcopies--;
 			}
 			if (s->valid==BUSY || s->valid==VALID) {
-				chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
+				chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
 				c->allvalidcopies--;
 				c->regularvalidcopies--;
 			}
@@ -1660,25 +1894,60 @@ void chunk_lost(void *ptr,uint64_t chunkid) {
 	}
 }
 
-void chunk_server_disconnected(void *ptr) {
+// when 'savedlist' is given then removed copies are stored there (as N*[chunkid:64 version:32] - like in register packet),
+// copies with unfinished operations are stored with version 0, so they will be deleted when server resumes registration
+void chunk_server_disconnected(void *ptr,uint8_t **savedlist,uint32_t *savedchunks) {
 	chunk *c;
 	slist *s,**st;
 	uint32_t i;
 	uint8_t valid,vs;
-	//jobsnorepbefore = main_time()+ReplicationsDelayDisconnect;
+	uint8_t *sbuff,*sptr;
+	uint32_t scount,smax,sversion;
+	jobsnorepbefore = main_time()+ReplicationsDelayDisconnect;	// at once - replication queue is also processed between jobs loops
 	//jobslastdisconnect = main_time();
-	for (i=0 ; i<HASHSIZE ; i++) {
-		for (c=chunkhash[i] ; c ; c=c->next ) {
+	sbuff = NULL;
+	sptr = NULL;
+	scount = 0;
+	smax = 0;
+	if (savedlist) {
+		smax = 0x10000;
+		sbuff = malloc(smax*12);
+		passert(sbuff);
+		sptr = sbuff;
+	}
+	fshash_finish(&chunkhash);
+	for (i=0 ; i<chunkhash.size ; i++) {
+		for (c=(chunk*)(chunkhash.tab[i]) ; c ; c=c->next ) {
 			st = &(c->slisthead);
 			while (*st) {
 				s = *st;
 				if (s->ptr == ptr) {
+					if (sbuff) {
+						if (scount>=smax) {
+							smax *= 2;
+							sbuff = realloc(sbuff,smax*12);
+							passert(sbuff);
+							sptr = sbuff+scount*12;
+						}
+						if (s->valid==VALID) {
+							sversion = c->version;
+						} else if (s->valid==TDVALID) {
+							sversion = c->version | 0x80000000;
+						} else if (s->valid==INVALID) {
+							sversion = s->version;
+						} else {
+							sversion = 0;
+						}
+						put64bit(&sptr,c->chunkid);
+						put32bit(&sptr,sversion);
+						scount++;
+					}
 					if (s->valid==TDBUSY || s->valid==TDVALID) {
-						chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
+						chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
 						c->allvalidcopies--;
 					}
 					if (s->valid==BUSY || s->valid==VALID) {
-						chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
+						chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
 						c->allvalidcopies--;
 						c->regularvalidcopies--;
 					}
@@ -1714,6 +1983,10 @@ void chunk_server_disconnected(void *ptr) {
 			}
 		}
 	}
+	if (savedlist) {
+		*savedlist = sbuff;
+		*savedchunks = scount;
+	}
 	fs_cs_disconnected();
 }
 
@@ -1730,11 +2003,11 @@ void chunk_got_delete_status(void *ptr,uint64_t chunkid,uint8_t status) {
 		if (s->ptr == ptr) {
 			if (s->valid!=DEL) {
 				if (s->valid==TDBUSY || s->valid==TDVALID) {
-					chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
+					chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
 					c->allvalidcopies--;
 				}
 				if (s->valid==BUSY || s->valid==VALID) {
-					chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
+					chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
 					c->allvalidcopies--;
 					c->regularvalidcopies--;
 				}
@@ -1765,7 +2038,7 @@ void chunk_got_replicate_status(void *ptr,uint64_t chunkid,uint32_t version,uint
 		if (s->ptr == ptr) {
 			syslog(LOG_WARNING,"got replication status from server which had had that chunk before (chunk:%016"PRIX64"_%08"PRIX32")",chunkid,version);
 			if (s->valid==VALID && version!=c->version) {
-				chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
+				chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
 				c->allvalidcopies--;
 				c->regularvalidcopies--;
 				s->valid = INVALID;
@@ -1779,7 +2052,7 @@ void chunk_got_replicate_status(void *ptr,uint64_t chunkid,uint32_t version,uint
 	if (c->lockedto>=(uint32_t)main_time() || version!=c->version) {
 		s->valid = INVALID;
 	} else {
-		chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies+1,c->regularvalidcopies,c->regularvalidcopies+1);
+		chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies+1,c->regularvalidcopies,c->regularvalidcopies+1);
 		c->allvalidcopies++;
 		c->regularvalidcopies++;
 		s->valid = VALID;
@@ -1815,11 +2088,11 @@ void chunk_operation_status(chunk *c,uint8_t status,void *ptr) {
 			if (status!=0) {
 				c->interrupted = 1;	// increase version after finish, just in case
 				if (s->valid==TDBUSY || s->valid==TDVALID) {
-					chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
+					chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
 					c->allvalidcopies--;
 				}
 				if (s->valid==BUSY || s->valid==VALID) {
-					chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
+					chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
 					c->allvalidcopies--;
 					c->regularvalidcopies--;
 				}
@@ -1932,19 +2205,79 @@ void chunk_store_info(uint8_t *buff) {
 
 //jobs state: jobshpos
 
+// makes another copy of under-goal chunk ; returns 1 when replication has been started, 0 when chunk is already being replicated, -2 when there is no source or destination for this chunk and -1 when no server can accept more replications
+static int chunk_undergoal_replicate(chunk *c,uint32_t vc) {
+	static void* rptrs[65536];
+	uint16_t rservcount;
+	void *srcptr;
+	slist *s;
+	uint16_t i;
+	uint32_t rgvc,rgtdc,r;
+
+	if (vc+matocsserv_replication_count(c->chunkid,c->version)>=c->goal) {	// already being replicated
+		return 0;
+	}
+	rgvc=0;
+	rgtdc=0;
+	for (s=c->slisthead ; s ; s=s->next) {
+		if (matocsserv_replication_read_counter(s->ptr)<MaxReadRepl) {
+			if (s->valid==VALID) {
+				rgvc++;
+			} else if (s->valid==TDVALID) {
+				rgtdc++;
+			}
+		}
+	}
+	if (rgvc+rgtdc==0) { // have at least one server to read from
+		return -2;
+	}
+	rservcount = matocsserv_getservers_lessrepl(rptrs,MaxWriteRepl);
+	if (rservcount==0) {
+		return -1;
+	}
+	for (i=0 ; i<rservcount ; i++) {
+		for (s=c->slisthead ; s && s->ptr!=rptrs[i] ; s=s->next) {}
+		if (!s && matocsserv_replication_find(c->chunkid,c->version,rptrs[i])==0) {
+			if (rgvc>0) {	// if there are VALID copies then make copy of one VALID chunk
+				r = 1+rndu32_ranged(rgvc);
+				srcptr = NULL;
+				for (s=c->slisthead ; s && r>0 ; s=s->next) {
+					if (matocsserv_replication_read_counter(s->ptr)<MaxReadRepl && s->valid==VALID) {
+						r--;
+						srcptr = s->ptr;
+					}
+				}
+			} else {	// if not then use TDVALID chunks.
+				r = 1+rndu32_ranged(rgtdc);
+				srcptr = NULL;
+				for (s=c->slisthead ; s && r>0 ; s=s->next) {
+					if (matocsserv_replication_read_counter(s->ptr)<MaxReadRepl && s->valid==TDVALID) {
+						r--;
+						srcptr = s->ptr;
+					}
+				}
+			}
+			if (srcptr) {
+				stats_replications++;
+				matocsserv_send_replicatechunk(rptrs[i],c->chunkid,c->version,srcptr);
+				c->needverincrease=1;
+				inforec.done.copy_undergoal++;
+				return 1;
+			}
+		}
+	}
+	return -2;
+}
+
 void chunk_do_jobs(chunk *c,uint16_t scount,double minusage,double maxusage) {
 	slist *s;
 	static void* ptrs[65535];
 	static uint16_t servcount;
 	static uint32_t min,max;
-	void* rptrs[65536];
-	uint16_t rservcount;
-	void *srcptr;
 //	uint32_t ip;
 //	uint16_t port;
 	uint16_t i;
 	uint32_t vc,tdc,ivc,bc,tdb,dc;
-	static loop_info inforec;
 	static uint32_t delnotdone;
 	static uint32_t deldone;
 	static uint32_t prevtodeletecount;
@@ -2019,17 +2352,21 @@ void chunk_do_jobs(chunk *c,uint16_t scount,double minusage,double maxusage) {
 	}
 	if (c->allvalidcopies!=vc+tdc+bc+tdb) {
 		syslog(LOG_WARNING,"wrong all valid copies counter - (counter value: %u, should be: %u) - fixed",c->allvalidcopies,vc+tdc+bc+tdb);
-		chunk_state_change(c->goal,c->goal,c->allvalidcopies,vc+tdc+bc+tdb,c->regularvalidcopies,c->regularvalidcopies);
+		chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,vc+tdc+bc+tdb,c->regularvalidcopies,c->regularvalidcopies);
 		c->allvalidcopies = vc+tdc+bc+tdb;
 	}
 	if (c->regularvalidcopies!=vc+bc) {
 		syslog(LOG_WARNING,"wrong regular valid copies counter - (counter value: %u, should be: %u) - fixed",c->regularvalidcopies,vc+bc);
-		chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies,c->regularvalidcopies,vc+bc);
+		chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies,c->regularvalidcopies,vc+bc);
 		c->regularvalidcopies = vc+bc;
 	}
 
 //	syslog(LOG_WARNING,"chunk %016"PRIX64": ivc=%"PRIu32" , tdc=%"PRIu32" , vc=%"PRIu32" , bc=%"PRIu32" , tdb=%"PRIu32" , dc=%"PRIu32" , goal=%"PRIu8" , scount=%"PRIu16,c->chunkid,ivc,tdc,vc,bc,tdb,dc,c->goal,scount);
 
+	if (c->allvalidcopies==0 && c->fcount==1 && c->files.owner!=0) {	// missing since start - there was no state change to report it
+		fs_test_markdirty(c->files.owner);
+	}
+
 // step 2. check number of copies
 	if (tdc+vc+tdb+bc==0 && ivc>0 && c->fcount>0/* c->flisthead */) {
 		syslog(LOG_WARNING,"chunk %016"PRIX64" has only invalid copies (%"PRIu32") - please repair it manually",c->chunkid,ivc);
@@ -2105,10 +2442,10 @@ void chunk_do_jobs(chunk *c,uint16_t scount,double minusage,double maxusage) {
 			if (matocsserv_deletion_counter(s->ptr)<TmpMaxDel) {
 				if (s->valid==VALID || s->valid==TDVALID) {
 					if (s->valid==TDVALID) {
-						chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
+						chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
 						c->allvalidcopies--;
 					} else {
-						chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
+						chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
 						c->allvalidcopies--;
 						c->regularvalidcopies--;
 					}
@@ -2135,7 +2472,7 @@ void chunk_do_jobs(chunk *c,uint16_t scount,double minusage,double maxusage) {
 		if (delcount<TmpMaxDel) {
 			for (s=c->slisthead ; s && vc+tdc>c->goal && tdc>0 ; s=s->next) {
 				if (s->valid==TDVALID) {
-					chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
+					chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
 					c->allvalidcopies--;
 					c->needverincrease=1;
 					s->valid = DEL;
@@ -2172,7 +2509,7 @@ void chunk_do_jobs(chunk *c,uint16_t scount,double minusage,double maxusage) {
 			for (s=c->slisthead ; s && s->ptr!=ptrs[servcount-1-i] ; s=s->next) {}
 			if (s && s->valid==VALID) {
 				if (matocsserv_deletion_counter(s->ptr)<TmpMaxDel) {
-					chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
+					chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
 					c->allvalidcopies--;
 					c->regularvalidcopies--;
 					c->needverincrease=1;
@@ -2201,7 +2538,7 @@ void chunk_do_jobs(chunk *c,uint16_t scount,double minusage,double maxusage) {
 		for (s=c->slisthead ; s && prevdone==0 ; s=s->next) {
 			if (s->valid==TDVALID) {
 				if (matocsserv_deletion_counter(s->ptr)<TmpMaxDel) {
-					chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
+					chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
 					c->allvalidcopies--;
 					c->needverincrease=1;
 					s->valid = DEL;
@@ -2219,56 +2556,11 @@ void chunk_do_jobs(chunk *c,uint16_t scount,double minusage,double maxusage) {
 		return;
 	}
 
-//step 8. if chunk has number of copies less than goal then make another copy of this chunk
+//step 8. if chunk has number of copies less than goal then make another copy of this chunk - it's done by replication queue (chunk_repq_process), here only when chunk can't be queued
 	if (c->goal > vc && vc+tdc > 0) {
-		if (jobsnorepbefore<(uint32_t)main_time()) {
-			uint32_t rgvc,rgtdc;
-			rservcount = matocsserv_getservers_lessrepl(rptrs,MaxWriteRepl);
-			rgvc=0;
-			rgtdc=0;
-			for (s=c->slisthead ; s ; s=s->next) {
-				if (matocsserv_replication_read_counter(s->ptr)<MaxReadRepl) {
-					if (s->valid==VALID) {
-						rgvc++;
-					} else if (s->valid==TDVALID) {
-						rgtdc++;
-					}
-				}
-			}
-			if (rgvc+rgtdc>0 && rservcount>0) { // have at least one server to read from and at least one to write to
-				for (i=0 ; i<rservcount ; i++) {
-					for (s=c->slisthead ; s && s->ptr!=rptrs[i] ; s=s->next) {}
-					if (!s) {
-						uint32_t r;
-						if (rgvc>0) {	// if there are VALID copies then make copy of one VALID chunk
-							r = 1+rndu32_ranged(rgvc);
-							srcptr = NULL;
-							for (s=c->slisthead ; s && r>0 ; s=s->next) {
-								if (matocsserv_replication_read_counter(s->ptr)<MaxReadRepl && s->valid==VALID) {
-									r--;
-									srcptr = s->ptr;
-								}
-							}
-						} else {	// if not then use TDVALID chunks.
-							r = 1+rndu32_ranged(rgtdc);
-							srcptr = NULL;
-							for (s=c->slisthead ; s && r>0 ; s=s->next) {
-								if (matocsserv_replication_read_counter(s->ptr)<MaxReadRepl && s->valid==TDVALID) {
-									r--;
-									srcptr = s->ptr;
-								}
-							}
-						}
-						if (srcptr) {
-							stats_replications++;
-	//						matocsserv_getlocation(srcptr,&ip,&port);
-							matocsserv_send_replicatechunk(rptrs[i],c->chunkid,c->version,srcptr);
-							c->needverincrease=1;
-							inforec.done.copy_undergoal++;
-							return;
-						}
-					}
-				}
+		if (c->inrepq==0 && chunk_repq_add(c,chunk_repq_prio(c->goal,c->allvalidcopies,c->regularvalidcopies))<0 && jobsnorepbefore<(uint32_t)main_time()) {
+			if (chunk_undergoal_replicate(c,vc)>0) {
+				return;
 			}
 		}
 		inforec.notdone.copy_undergoal++;
@@ -2414,8 +2706,81 @@ void chunk_do_jobs(chunk *c,uint16_t scount,double minusage,double maxusage) {
 */
 }
 
+// replicates chunks from replication queue - the most endangered first ; stops when no server can accept more replications
+static void chunk_repq_process(uint16_t scount,uint32_t maxsteps) {
+	repq_entry *e;
+	chunk *c;
+	slist *s;
+	uint32_t n,steps,vc,tdc,bc;
+	uint8_t prio,cprio;
+	int r;
+
+	if (jobsnorepbefore>=(uint32_t)main_time()) {
+		return;
+	}
+	steps = 0;
+	for (prio=0 ; prio<REPQ_PRIOS ; prio++) {
+		for (n=repqentries[prio] ; n>0 ; n--) {
+			if (steps>=maxsteps) {
+				return;
+			}
+			steps++;
+			e = chunk_repq_pop(prio);
+			c = chunk_find(e->chunkid);
+			cprio = (c==NULL)?REPQ_NONE:chunk_repq_prio(c->goal,c->allvalidcopies,c->regularvalidcopies);
+			if (cprio==REPQ_NONE || c->fcount==0) {	// chunk has been deleted, has enough copies or will be deleted
+				chunk_repq_drop(e,c);
+				continue;
+			}
+			if (cprio!=prio) {	// outdated priority
+				e->prio = cprio;
+				chunk_repq_append(e);
+				continue;
+			}
+			// chunks with pending operations stay in queue, chunks that can't be replicated now are left for chunk loop
+			if (c->operation!=NONE || c->lockedto>=(uint32_t)main_time()) {
+				chunk_repq_append(e);
+				continue;
+			}
+			vc=tdc=bc=0;
+			for (s=c->slisthead ; s ; s=s->next) {
+				if (s->valid==VALID) {
+					vc++;
+				} else if (s->valid==TDVALID) {
+					tdc++;
+				} else if (s->valid==BUSY || s->valid==TDBUSY) {
+					bc++;
+				}
+			}
+			if (bc>0) {
+				chunk_repq_append(e);
+				continue;
+			}
+			// chunks with one copy on each server (step 7c) are left for chunk loop
+			if (c->goal<=vc || vc+tdc==0 || (vc+tdc>=scount && tdc>0 && vc+tdc>1)) {
+				chunk_repq_drop(e,c);
+				continue;
+			}
+			r = chunk_undergoal_replicate(c,vc);
+			if (r==-2) {	// no source or destination (all sources are busy, goal is higher than number of servers etc.)
+				chunk_repq_drop(e,c);
+				continue;
+			}
+			chunk_repq_append(e);
+			if (r==-1) {
+				return;
+			}
+		}
+	}
+}
+
+// called when replication has finished - use released replication limits without waiting for next jobs loop
+void chunk_repq_refill(void) {
+	chunk_repq_process(jobsuscount,REPQ_REFILLSTEPS);
+}
+
 void chunk_jobs_main(void) {
-	uint32_t i,l,lc,r;
+	uint32_t i,l,lc,r,hashsteps;
 	uint16_t uscount,tscount;
 	static uint16_t lasttscount=0;
 	static uint16_t maxtscount=0;
@@ -2445,14 +2810,19 @@ void chunk_jobs_main(void) {
 	}
 
 	chunk_do_jobs(NULL,JOBS_EVERYSECOND,0.0,0.0);	// every second tasks
+	jobsuscount = uscount;
+	chunk_repq_process(uscount,HashCPS);
+	hashsteps = 1+(chunkhash.size/HashLoopTime);
+	jobshpos %= chunkhash.size;
 	lc = 0;
-	for (i=0 ; i<HashSteps && lc<HashCPS ; i++) {
+	for (i=0 ; i<hashsteps && lc<HashCPS ; i++) {
 		if (jobshpos==0) {
 			chunk_do_jobs(NULL,JOBS_EVERYLOOP,0.0,0.0);	// every loop tasks
 		}
+		fshash_prepare(&chunkhash,jobshpos);	// during rehashing - take all chunks of this bucket from old table
 		// delete unused chunks from structures
 		l=0;
-		cp = &(chunkhash[jobshpos]);
+		cp = (chunk**)(chunkhash.tab+jobshpos);
 		while ((c=*cp)!=NULL) {
 			if (c->fcount==0 && /*c->flisthead==NULL && */c->slisthead==NULL) {
 				*cp = (c->next);
@@ -2467,14 +2837,14 @@ void chunk_jobs_main(void) {
 			r = rndu32_ranged(l);
 			l=0;
 		// do jobs on rest of them
-			for (c=chunkhash[jobshpos] ; c ; c=c->next) {
+			for (c=(chunk*)(chunkhash.tab[jobshpos]) ; c ; c=c->next) {
 				if (l>=r) {
 					chunk_do_jobs(c,uscount,minusage,maxusage);
 				}
 				l++;
 			}
 			l=0;
-			for (c=chunkhash[jobshpos] ; l<r && c ; c=c->next) {
+			for (c=(chunk*)(chunkhash.tab[jobshpos]) ; l<r && c ; c=c->next) {
 				chunk_do_jobs(c,uscount,minusage,maxusage);
 				l++;
 			}
@@ -2482,9 +2852,10 @@ void chunk_jobs_main(void) {
 //		for (c=chunkhash[jobshpos] ; c ; c=c->next) {
 //			chunk_do_jobs(c,uscount,minusage,maxusage);
 //		}
-		jobshpos+=123;	// if HASHSIZE is any power of 2 then any odd number is good here
-		jobshpos%=HASHSIZE;
+		jobshpos+=123;	// hash size is always power of 2, so any odd number is good here
+		jobshpos%=chunkhash.size;
 	}
+	fshash_check(&chunkhash);	// after deleting unused chunks
 }
 
 #endif
@@ -2554,8 +2925,9 @@ void chunk_dump(void) {
 	uint32_t i,lockedto,now;
 	now = time(NULL);
 
-	for (i=0 ; i<HASHSIZE ; i++) {
-		for (c=chunkhash[i] ; c ; c=c->next) {
+	fshash_finish(&chunkhash);
+	for (i=0 ; i<chunkhash.size ; i++) {
+		for (c=(chunk*)(chunkhash.tab[i]) ; c ; c=c->next) {
 			lockedto = c->lockedto;
 			if (lockedto<now) {
 				lockedto = 0;
@@ -2567,6 +2939,8 @@ void chunk_dump(void) {
 
 #endif
 
+static uint32_t loadedchunks;
+
 int chunk_load(FILE *fd) {
 	uint8_t hdr[8];
 	uint8_t loadbuff[CHUNKFSIZE];
@@ -2580,6 +2954,7 @@ int chunk_load(FILE *fd) {
 #ifndef METARESTORE
 	chunks=0;
 #endif
+	loadedchunks=0;
 	if (fread(hdr,1,8,fd)!=8) {
 		return -1;
 	}
@@ -2598,6 +2973,7 @@ int chunk_load(FILE *fd) {
 			c->version = version;
 			lockedto = get32bit(&ptr);
 			c->lockedto = lockedto;
+			loadedchunks++;
 		} else {
 			version = get32bit(&ptr);
 			lockedto = get32bit(&ptr);
@@ -2611,6 +2987,183 @@ int chunk_load(FILE *fd) {
 	return 0;	// unreachable
 }
 
+uint32_t chunk_loaded_count(void) {
+	return loadedchunks;
+}
+
+/* parallel loading (indexed metadata) - all chunk records are placed in preallocated
+   table, then chunkhash (presized for all records) is filled in slices (records are linked
+   in file order, as in chunk_load) */
+
+static uint64_t loadrecords;
+static uint32_t *loadhpos;
+#ifdef USE_CHUNK_BUCKETS
+static chunk_bucket **loadbuckets;
+
+static inline chunk* chunk_load_slot(uint64_t indx) {
+	return loadbuckets[indx/CHUNK_BUCKET_SIZE]->bucket+(indx%CHUNK_BUCKET_SIZE);
+}
+#else
+static chunk **loadchunks;
+
+static inline chunk* chunk_load_slot(uint64_t indx) {
+	return loadchunks[indx];
+}
+#endif
+
+int chunk_load_begin(FILE *fd,uint64_t records) {
+	uint8_t hdr[8];
+	const uint8_t *ptr;
+	uint64_t i;
+#ifdef USE_CHUNK_BUCKETS
+	chunk_bucket *cb;
+	uint32_t buckets;
+#endif
+
+	if (fread(hdr,1,8,fd)!=8) {
+		return -1;
+	}
+	ptr = hdr;
+	nextchunkid = get64bit(&ptr);
+	loadrecords = records;
+	loadhpos = NULL;
+	if (records==0) {
+		return 0;
+	}
+	fshash_presize(&chunkhash,records);
+	loadhpos = malloc(sizeof(uint32_t)*records);
+	passert(loadhpos);
+#ifdef USE_CHUNK_BUCKETS
+	buckets = (records+CHUNK_BUCKET_SIZE-1)/CHUNK_BUCKET_SIZE;
+	loadbuckets = malloc(sizeof(chunk_bucket*)*buckets);
+	passert(loadbuckets);
+	for (i=0 ; i<buckets ; i++) {
+		cb = (chunk_bucket*)malloc(sizeof(chunk_bucket));
+		passert(cb);
+		cb->next = cbhead;
+		cb->firstfree = (i+1<buckets)?CHUNK_BUCKET_SIZE:(records-i*CHUNK_BUCKET_SIZE);
+		cbhead = cb;
+		loadbuckets[i] = cb;
+	}
+#else
+	loadchunks = malloc(sizeof(chunk*)*records);
+	passert(loadchunks);
+	for (i=0 ; i<records ; i++) {
+		loadchunks[i] = NULL;
+	}
+#endif
+	return 0;
+}
+
+// thread safe - parses records from 'first' to 'first+records-1' (file is opened separately in each call)
+int chunk_load_part(const char *fname,uint64_t offset,uint64_t endoffset,uint64_t first,uint32_t records) {
+	uint8_t loadbuff[CHUNKFSIZE*CHUNKCNT];
+	const uint8_t *ptr;
+	uint32_t i,n;
+	chunk *c;
+	FILE *fd;
+
+	if (first+records>loadrecords || endoffset-offset!=(uint64_t)records*CHUNKFSIZE) {
+		return -1;
+	}
+	fd = fopen(fname,"r");
+	if (fd==NULL) {
+		return -1;
+	}
+	if (fseeko(fd,offset,SEEK_SET)<0) {
+		fclose(fd);
+		return -1;
+	}
+	while (records>0) {
+		n = (records>CHUNKCNT)?CHUNKCNT:records;
+		if (fread(loadbuff,1,CHUNKFSIZE*n,fd)!=CHUNKFSIZE*n) {
+			fclose(fd);
+			return -1;
+		}
+		ptr = loadbuff;
+		for (i=0 ; i<n ; i++) {
+#ifdef USE_CHUNK_BUCKETS
+			c = chunk_load_slot(first);
+#else
+			c = (chunk*)malloc(sizeof(chunk));
+			passert(c);
+			loadchunks[first] = c;
+#endif
+			c->chunkid = get64bit(&ptr);
+			c->version = get32bit(&ptr);
+			c->lockedto = get32bit(&ptr);
+			if (c->chunkid==0) {
+				fclose(fd);
+				return -1;
+			}
+			c->goal = 0;
+#ifndef METARESTORE
+			c->allvalidcopies = 0;
+			c->regularvalidcopies = 0;
+			c->needverincrease = 1;
+			c->interrupted = 0;
+			c->operation = NONE;
+			c->inrepq = 0;
+			c->slisthead = NULL;
+#endif
+			c->fcount = 0;
+			c->files.ftab = NULL;
+			c->next = NULL;
+			loadhpos[first] = ((uint32_t)(c->chunkid))&(chunkhash.size-1);
+			first++;
+		}
+		records -= n;
+	}
+	fclose(fd);
+	return 0;
+}
+
+// thread safe for different 'slice' values - links loaded chunks into its part of chunkhash
+void chunk_load_link(uint32_t slice,uint32_t slices) {
+	uint32_t hfirst,hlast,hpos;
+	uint64_t i;
+	chunk *c;
+
+	hfirst = ((uint64_t)(chunkhash.size)*slice)/slices;
+	hlast = ((uint64_t)(chunkhash.size)*(slice+1))/slices;
+	for (i=0 ; i<loadrecords ; i++) {
+		hpos = loadhpos[i];
+		if (hpos>=hfirst && hpos<hlast) {
+			c = chunk_load_slot(i);
+			c->next = (chunk*)(chunkhash.tab[hpos]);
+			chunkhash.tab[hpos] = c;
+		}
+	}
+}
+
+void chunk_load_end(void) {
+#ifndef METARESTORE
+	chunks += loadrecords;
+	allchunkcounts[0][0] += loadrecords;
+	regularchunkcounts[0][0] += loadrecords;
+#endif
+	chunkhash.elements += loadrecords;
+	loadedchunks = loadrecords;
+	lastchunkid = 0;
+	lastchunkptr = NULL;
+	if (loadhpos) {
+		free(loadhpos);
+		loadhpos = NULL;
+	}
+#ifdef USE_CHUNK_BUCKETS
+	if (loadrecords>0) {
+		free(loadbuckets);
+	}
+	loadbuckets = NULL;
+#else
+	if (loadrecords>0) {
+		free(loadchunks);
+	}
+	loadchunks = NULL;
+#endif
+	loadrecords = 0;
+}
+
 void chunk_store(FILE *fd) {
 	uint8_t hdr[8];
 	uint8_t storebuff[CHUNKFSIZE*CHUNKCNT];
@@ -2631,10 +3184,12 @@ void chunk_store(FILE *fd) {
 	if (fwrite(hdr,1,8,fd)!=(size_t)8) {
 		return;
 	}
+	metaindex_part_begin(fd);
 	j=0;
 	ptr = storebuff;
-	for (i=0 ; i<HASHSIZE ; i++) {
-		for (c=chunkhash[i] ; c ; c=c->next) {
+	fshash_finish(&chunkhash);
+	for (i=0 ; i<chunkhash.size ; i++) {
+		for (c=(chunk*)(chunkhash.tab[i]) ; c ; c=c->next) {
 			chunkid = c->chunkid;
 			put64bit(&ptr,chunkid);
 			version = c->version;
@@ -2649,14 +3204,20 @@ void chunk_store(FILE *fd) {
 				if (fwrite(storebuff,1,CHUNKFSIZE*CHUNKCNT,fd)!=(size_t)(CHUNKFSIZE*CHUNKCNT)) {
 					return;
 				}
+				metaindex_add(fd,CHUNKCNT);
 				j=0;
 				ptr = storebuff;
 			}
 		}
 	}
-	memset(ptr,0,CHUNKFSIZE);
-	j++;
-	if (fwrite(storebuff,1,CHUNKFSIZE*j,fd)!=(size_t)(CHUNKFSIZE*j)) {
+	if (j>0) {
+		if (fwrite(storebuff,1,CHUNKFSIZE*j,fd)!=(size_t)(CHUNKFSIZE*j)) {
+			return;
+		}
+		metaindex_add(fd,j);
+	}
+	memset(storebuff,0,CHUNKFSIZE);
+	if (fwrite(storebuff,1,CHUNKFSIZE,fd)!=(size_t)CHUNKFSIZE) {
 		return;
 	}
 }
@@ -2698,8 +3259,8 @@ void chunk_term(void) {
 		free(sb);
 	}
 # else
-	for (i=0 ; i<HASHSIZE ; i++) {
-		for (ch = chunkhash[i] ; ch ; ch = ch->next) {
+	for (i=0 ; i<chunkhash.size ; i++) {
+		for (ch = (chunk*)(chunkhash.tab[i]) ; ch ; ch = ch->next) {
 			for (sl = ch->slisthead ; sl ; sl = sln) {
 				sln = sl->next;
 				free(sl);
@@ -2714,8 +3275,8 @@ void chunk_term(void) {
 		free(fb);
 	}
 # else
-	for (i=0 ; i<HASHSIZE ; i++) {
-		for (ch = chunkhash[i] ; ch ; ch = ch->next) {
+	for (i=0 ; i<chunkhash.size ; i++) {
+		for (ch = (chunk*)(chunkhash.tab[i]) ; ch ; ch = ch->next) {
 			for (fl = ch->flisthead ; fl ; fl = fln) {
 				fln = fl->next;
 				free(fl);
@@ -2731,8 +3292,8 @@ void chunk_term(void) {
 		free(cb);
 	}
 #else
-	for (i=0 ; i<HASHSIZE ; i++) {
-		for (ch = chunkhash[i] ; ch ; ch = chn) {
+	for (i=0 ; i<chunkhash.size ; i++) {
+		for (ch = (chunk*)(chunkhash.tab[i]) ; ch ; ch = chn) {
 			chn = ch->next;
 			free(ch);
 		}
@@ -2809,7 +3370,7 @@ void chunk_reload(void) {
 			syslog(LOG_NOTICE,"CHUNKS_LOOP_TIME value too high (%"PRIu32") decreased to %u",looptime,MAXLOOPTIME);
 			looptime = MAXLOOPTIME;
 		}
-		HashSteps = 1+((HASHSIZE)/looptime);
+		HashLoopTime = looptime;
 		HashCPS = 0xFFFFFFFF;
 	} else {
 		looptime = cfg_getuint32("CHUNKS_LOOP_MIN_TIME",300);
@@ -2821,7 +3382,7 @@ void chunk_reload(void) {
 			syslog(LOG_NOTICE,"CHUNKS_LOOP_MIN_TIME value too high (%"PRIu32") decreased to %u",looptime,MAXLOOPTIME);
 			looptime = MAXLOOPTIME;
 		}
-		HashSteps = 1+((HASHSIZE)/looptime);
+		HashLoopTime = looptime;
 		HashCPS = cfg_getuint32("CHUNKS_LOOP_MAX_CPS",100000);
 		if (HashCPS < MINCPS) {
 			syslog(LOG_NOTICE,"CHUNKS_LOOP_MAX_CPS value too low (%"PRIu32") increased to %u",HashCPS,MINCPS);
@@ -2840,13 +3401,20 @@ void chunk_reload(void) {
 	if (AcceptableDifference>10.0) {
 		AcceptableDifference = 10.0;
 	}
+	LocationsLoadWeight = cfg_getdouble("LOCATIONS_LOAD_WEIGHT",0.01);
+	if (LocationsLoadWeight<0.0) {
+		LocationsLoadWeight = 0.0;
+	}
+	LocationsLatencyWeight = cfg_getdouble("LOCATIONS_LATENCY_WEIGHT",0.02);
+	if (LocationsLatencyWeight<0.0) {
+		LocationsLatencyWeight = 0.0;
+	}
 }
 #endif
 
 int chunk_strinit(void) {
-	uint32_t i;
 #ifndef METARESTORE
-	uint32_t j;
+	uint32_t i,j;
 	uint32_t looptime;
 
 	ReplicationsDelayInit = cfg_getuint32("REPLICATIONS_DELAY_INIT",300);
@@ -2888,7 +3456,7 @@ int chunk_strinit(void) {
 			fprintf(stderr,"CHUNKS_LOOP_TIME value too high (%"PRIu32") decreased to %u\n",looptime,MAXLOOPTIME);
 			looptime = MAXLOOPTIME;
 		}
-		HashSteps = 1+((HASHSIZE)/looptime);
+		HashLoopTime = looptime;
 		HashCPS = 0xFFFFFFFF;
 	} else {
 		looptime = cfg_getuint32("CHUNKS_LOOP_MIN_TIME",300);
@@ -2900,7 +3468,7 @@ int chunk_strinit(void) {
 			fprintf(stderr,"CHUNKS_LOOP_MIN_TIME value too high (%"PRIu32") decreased to %u\n",looptime,MAXLOOPTIME);
 			looptime = MAXLOOPTIME;
 		}
-		HashSteps = 1+((HASHSIZE)/looptime);
+		HashLoopTime = looptime;
 		HashCPS = cfg_getuint32("CHUNKS_LOOP_MAX_CPS",100000);
 		if (HashCPS < MINCPS) {
 			fprintf(stderr,"CHUNKS_LOOP_MAX_CPS value too low (%"PRIu32") increased to %u\n",HashCPS,MINCPS);
@@ -2918,10 +3486,16 @@ int chunk_strinit(void) {
 	if (AcceptableDifference>10.0) {
 		AcceptableDifference = 10.0;
 	}
-#endif
-	for (i=0 ; i<HASHSIZE ; i++) {
-		chunkhash[i]=NULL;
+	LocationsLoadWeight = cfg_getdouble("LOCATIONS_LOAD_WEIGHT",0.01);
+	if (LocationsLoadWeight<0.0) {
+		LocationsLoadWeight = 0.0;
 	}
+	LocationsLatencyWeight = cfg_getdouble("LOCATIONS_LATENCY_WEIGHT",0.02);
+	if (LocationsLatencyWeight<0.0) {
+		LocationsLatencyWeight = 0.0;
+	}
+#endif
+	fshash_init(&chunkhash,1,chunk_hash_movebucket);	// at most one chunk per bucket - chunks are looked up much more often than nodes
 #ifndef METARESTORE
 	for (i=0 ; i<11 ; i++) {
 		for (j=0 ; j<11 ; j++) {
@@ -2929,6 +3503,13 @@ int chunk_strinit(void) {
 			regularchunkcounts[i][j]=0;
 		}
 	}
+	for (i=0 ; i<REPQ_PRIOS ; i++) {
+		repqhead[i] = NULL;
+		repqtail[i] = &(repqhead[i]);
+		repqentries[i] = 0;
+		repqchunks[i] = 0;
+	}
+	repqallentries = 0;
 	jobshpos = 0;
 	jobsrebalancecount = 0;
 	starttime = main_time();
@@ -2940,6 +3521,8 @@ int chunk_strinit(void) {
 	main_timeregister(TIMEMODE_RUN_LATE,30,0,chunk_cfg_check);
 */
 	main_reloadregister(chunk_reload);
+	chunkhashactive = 0;
+	chunkhashhook = main_msectimeregister(TIMEMODE_SKIP_LATE,FSHASH_IDLEMSEC,0,chunk_hash_rehash);
 	main_timeregister(TIMEMODE_RUN_LATE,1,0,chunk_jobs_main);
 #endif
 	return 1;
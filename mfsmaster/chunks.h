@@ -46,6 +46,7 @@ void chunk_dump(void);
 
 #else
 void chunk_stats(uint32_t *del,uint32_t *repl);
+void chunk_repq_stats(uint64_t stats[4]);
 void chunk_store_info(uint8_t *buff);
 uint32_t chunk_get_missing_count(void);
 void chunk_store_chunkcounters(uint8_t *buff,uint8_t matrixid);
@@ -53,6 +54,8 @@ uint32_t chunk_count(void);
 void chunk_info(uint32_t *allchunks,uint32_t *allcopies,uint32_t *regcopies);
 
 int chunk_get_validcopies(uint64_t chunkid,uint8_t *vcopies);
+void chunk_get_problemrefs(uint32_t *ugrefs,uint32_t *mrefs);
+void chunk_set_owner(uint64_t chunkid,uint32_t inode);
 
 int chunk_change_file(uint64_t chunkid,uint8_t prevgoal,uint8_t newgoal);
 int chunk_delete_file(uint64_t chunkid,uint8_t goal);
@@ -73,10 +76,11 @@ int chunk_getversionandlocations(uint64_t chunkid,uint32_t cuip,uint32_t *versio
 void chunk_server_has_chunk(void *ptr,uint64_t chunkid,uint32_t version);
 void chunk_damaged(void *ptr,uint64_t chunkid);
 void chunk_lost(void *ptr,uint64_t chunkid);
-void chunk_server_disconnected(void *ptr);
+void chunk_server_disconnected(void *ptr,uint8_t **savedlist,uint32_t *savedchunks);
 
 void chunk_got_delete_status(void *ptr,uint64_t chunkid,uint8_t status);
 void chunk_got_replicate_status(void *ptr,uint64_t chunkid,uint32_t version,uint8_t status);
+void chunk_repq_refill(void);
 
 void chunk_got_chunkop_status(void *ptr,uint64_t chunkid,uint8_t status);
 
@@ -91,6 +95,12 @@ void chunk_got_duptrunc_status(void *ptr,uint64_t chunkid,uint8_t status);
 
 // int chunk_load_1_1(FILE *fd);
 int chunk_load(FILE *fd);
+uint32_t chunk_loaded_count(void);
+// parallel loading: begin (reads section header) -> part (in threads) -> link (in threads) -> end
+int chunk_load_begin(FILE *fd,uint64_t records);
+int chunk_load_part(const char *fname,uint64_t offset,uint64_t endoffset,uint64_t first,uint32_t records);
+void chunk_load_link(uint32_t slice,uint32_t slices);
+void chunk_load_end(void);
 void chunk_store(FILE *fd);
 void chunk_term(void);
 void chunk_newfs(void);
@@ -30,6 +30,14 @@
 #include <sys/stat.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <sys/time.h>
+#include <pthread.h>
+#ifndef METARESTORE
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/resource.h>
+#endif
 
 #include "MFSCommunication.h"
 
@@ -42,6 +50,8 @@
 
 #include "chunks.h"
 #include "filesystem.h"
+#include "metaindex.h"
+#include "fshash.h"
 #include "datapack.h"
 #include "slogger.h"
 #include "massert.h"
@@ -57,14 +67,7 @@
 #define USE_CUIDREC_BUCKETS 1
 #define EDGEHASH 1
 
-#define NODEHASHBITS (22)
-#define NODEHASHSIZE (1<<NODEHASHBITS)
-#define NODEHASHPOS(nodeid) ((nodeid)&(NODEHASHSIZE-1))
-
 #ifdef EDGEHASH
-#define EDGEHASHBITS (22)
-#define EDGEHASHSIZE (1<<EDGEHASHBITS)
-#define EDGEHASHPOS(hash) ((hash)&(EDGEHASHSIZE-1))
 #define LOOKUPNOHASHLIMIT 10
 #endif
 
@@ -107,15 +110,21 @@ typedef struct _sessionidrec {
 
 struct _fsnode;
 
+// nodes and edges are linked by 32-bit handles (see fsslab) - 0 means no object
 typedef struct _fsedge {
-	struct _fsnode *child,*parent;
-	struct _fsedge *nextchild,*nextparent;
-	struct _fsedge **prevchild,**prevparent;
+	uint32_t child,parent;				// nodes
+	uint32_t nextchild,nextparent;
+	uint32_t prevchild,prevparent;		// 0 - first edge on list (list head is in parent/child node, trash or reserved)
 #ifdef EDGEHASH
-	struct _fsedge *next,**prev;
+	uint32_t next,prev;					// edgehash chain - 0 in prev means first edge in bucket
 #endif
 	uint16_t nleng;
 //	uint16_t nhash;
+	uint8_t nclass;		// slab class (see fsedge_malloc)
+#ifdef EDGEHASH
+	uint8_t inhash;
+	uint32_t hash;		// fsnodes_hash(parent->id,nleng,name) - valid when edge is in edgehash
+#endif
 	uint8_t *name;
 } fsedge;
 
@@ -181,7 +190,7 @@ typedef struct _fsnode {
 	uint32_t trashtime;
 	union _data {
 		struct _ddata {				// type==TYPE_DIRECTORY
-			fsedge *children;
+			uint32_t children;
 			uint32_t nlink;
 			uint32_t elements;
 //			uint8_t quotaexceeded:1;	// quota exceeded
@@ -211,6 +220,9 @@ typedef struct _fsnode {
 			uint64_t length;
 			uint64_t *chunktab;
 			uint32_t chunks;
+#ifndef METARESTORE
+			uint8_t testflags;		// fs_test: last known state (TEST_UNDERGOAL/TEST_MISSING) and TEST_DIRTY when waiting in dirty queue
+#endif
 /*
 #ifdef CACHENOTIFY
 			uint32_t lastattrchange;	// even - store attr in cache / odd - do not store attr in cache
@@ -226,8 +238,8 @@ typedef struct _fsnode {
 #endif
 */
 	} data;
-	fsedge *parents;
-	struct _fsnode *next;
+	uint32_t parents;
+	uint32_t next;			// nodehash chain
 } fsnode;
 
 typedef struct _freenode {
@@ -236,18 +248,21 @@ typedef struct _freenode {
 	struct _freenode *next;
 } freenode;
 
+/* inode bitmap - three levels:
+   freebitmask - bit per inode (set = used or waiting in freelist)
+   fullbitmask - bit per freebitmask word (set = all 32 inodes used)
+   fullsummary - bit per fullbitmask word (set = all 1024 inodes used)
+   finding first free inode after long runs of used ones costs at most one fullsummary scan step per 32768 inodes */
 static uint32_t *freebitmask;
+static uint32_t *fullbitmask;
+static uint32_t *fullsummary;
 static uint32_t bitmasksize;
 static uint32_t searchpos;
 static freenode *freelist,**freetail;
 
-static fsedge *trash;
-static fsedge *reserved;
+static uint32_t trash;
+static uint32_t reserved;
 static fsnode *root;
-static fsnode* nodehash[NODEHASHSIZE];
-#ifdef EDGEHASH
-static fsedge* edgehash[EDGEHASHSIZE];
-#endif
 
 static uint32_t maxnodeid;
 static uint32_t nextsessionid;
@@ -264,6 +279,8 @@ static uint32_t dirnodes;
 #ifndef METARESTORE
 
 static uint32_t BackMetaCopies;
+static uint8_t LazySnapshots;
+static uint32_t EmptyTrashLimit;
 
 #define MSGBUFFSIZE 1000000
 #define ERRORS_LOG_MAX 500
@@ -272,14 +289,30 @@ static uint32_t fsinfo_files=0;
 static uint32_t fsinfo_ugfiles=0;
 static uint32_t fsinfo_mfiles=0;
 static uint32_t fsinfo_chunks=0;
-static uint32_t fsinfo_ugchunks=0;
-static uint32_t fsinfo_mchunks=0;
 static char *fsinfo_msgbuff=NULL;
 static uint32_t fsinfo_msgbuffleng=0;
 static uint32_t fsinfo_loopstart=0;
 static uint32_t fsinfo_loopend=0;
 
 static uint32_t test_start_time;
+static uint32_t test_dirty_start_time;
+static uint32_t FileTestLoopTime;
+
+#define TEST_UNDERGOAL 0x01
+#define TEST_MISSING 0x02
+#define TEST_STATEMASK 0x03
+#define TEST_DIRTY 0x04
+
+// files reported by chunks module (chunk state changes) - rechecked by fs_test_dirty
+#define TEST_DIRTY_REFS 20000
+static uint32_t *testdirtyq=NULL;
+static uint32_t testdirtyqsize=0;
+static uint32_t testdirtyqelements=0;
+
+#endif
+
+/* shadow master (mfsshadow) is built with METARESTORE and SHADOW - it serves read-only client operations */
+#if !defined(METARESTORE) || defined(SHADOW)
 
 static uint32_t stats_statfs=0;
 static uint32_t stats_getattr=0;
@@ -437,13 +470,573 @@ static inline void sessionidrec_free(sessionidrec* p) {
 
 #endif /* USE_CUIDREC_BUCKETS */
 
-uint32_t fsnodes_get_next_id() {
-	uint32_t i,mask;
-	while (searchpos<bitmasksize && freebitmask[searchpos]==0xFFFFFFFF) {
-		searchpos++;
+/* fsnode/fsedge slabs - objects are cut from 64kB buckets (no per-object malloc overhead)
+   edge names up to FSEDGE_INLINE_MAX bytes are stored just after edge (edges are grouped by rounded name length)
+   nodes and edges refer to each other by 32-bit handles: bucket number (upper 19 bits) and offset of object
+   in bucket in 8-byte units (lower 13 bits). Buckets are aligned to their size, so handle of object can be
+   computed from its address and bucket header. Bucket header is never an object, so handle 0 means 'no object'.
+   Nodes and edges have separate handle spaces (up to 32GB of objects each) */
+#define FSSLAB_BUCKET_BYTES 0x10000
+#define FSSLAB_OFFBITS 13
+#define FSSLAB_OFFMASK ((1U<<FSSLAB_OFFBITS)-1)
+#define FSSLAB_MAXBUCKETS (1U<<(32-FSSLAB_OFFBITS))
+#define FSSLAB_GROUP 16
+#define FSEDGE_INLINE_CLASSES 9
+#define FSEDGE_INLINE_MAX ((FSEDGE_INLINE_CLASSES-1)*8)
+#define FSEDGE_EXTNAME FSEDGE_INLINE_CLASSES
+#define FSEDGE_CLASSES (FSEDGE_INLINE_CLASSES+1)
+#define FSEDGE_INLINE_NAME(e) ((uint8_t*)((e)+1))
+
+typedef struct _fsslab_bucket {
+	struct _fsslab_bucket *next;
+	uint32_t firstfree;
+	uint32_t bucketno;
+	uint8_t data[];
+} fsslab_bucket;
+
+typedef struct _fsslab_space {
+	fsslab_bucket **btab;	// bucket number -> bucket (allocated once for all possible buckets, so it never moves)
+	uint32_t bcnt;
+	uint32_t gleft;		// buckets are taken from 1MB groups
+	uint8_t *gptr;
+} fsslab_space;
+
+typedef struct _fsslab {
+	fsslab_space *space;
+	fsslab_bucket *bhead;
+	void *freehead;
+	uint32_t elemsize;
+	uint32_t perbucket;
+	uint32_t buckets;
+	uint32_t used;
+	uint64_t extbytes;	// edge names stored outside of slab
+} fsslab;
+
+static fsslab_space nodespace,edgespace;
+static pthread_mutex_t fsslab_space_lock = PTHREAD_MUTEX_INITIALIZER;	// slabs of loader threads share spaces
+static fsslab nodeslab;
+static fsslab edgeslab[FSEDGE_CLASSES];
+
+static void fsslab_space_init(fsslab_space *sp) {
+	sp->btab = calloc(FSSLAB_MAXBUCKETS,sizeof(fsslab_bucket*));
+	passert(sp->btab);
+	sp->bcnt = 0;
+	sp->gleft = 0;
+	sp->gptr = NULL;
+}
+
+static fsslab_bucket* fsslab_space_newbucket(fsslab_space *sp) {
+	fsslab_bucket *b;
+	void *g;
+	zassert(pthread_mutex_lock(&fsslab_space_lock));
+	if (sp->gleft==0) {
+		if (posix_memalign(&g,FSSLAB_BUCKET_BYTES,FSSLAB_BUCKET_BYTES*FSSLAB_GROUP)!=0) {
+			g = NULL;
+		}
+		passert(g);
+		sp->gptr = (uint8_t*)g;
+		sp->gleft = FSSLAB_GROUP;
+	}
+	massert(sp->bcnt<FSSLAB_MAXBUCKETS,"too many objects - handle space exhausted");
+	b = (fsslab_bucket*)(sp->gptr);
+	sp->gptr += FSSLAB_BUCKET_BYTES;
+	sp->gleft--;
+	b->bucketno = sp->bcnt;
+	sp->btab[sp->bcnt++] = b;
+	zassert(pthread_mutex_unlock(&fsslab_space_lock));
+	return b;
+}
+
+static inline void* fsslab_ptr(const fsslab_space *sp,uint32_t h) {
+	if (h==0) {
+		return NULL;
+	}
+	return ((uint8_t*)(sp->btab[h>>FSSLAB_OFFBITS]))+((h&FSSLAB_OFFMASK)<<3);
+}
+
+static inline uint32_t fsslab_handle(const void *p) {
+	const fsslab_bucket *b;
+	if (p==NULL) {
+		return 0;
+	}
+	b = (const fsslab_bucket*)((uintptr_t)p & ~(uintptr_t)(FSSLAB_BUCKET_BYTES-1));
+	return (b->bucketno<<FSSLAB_OFFBITS) | (uint32_t)(((uintptr_t)p & (FSSLAB_BUCKET_BYTES-1))>>3);
+}
+
+static inline fsnode* fsnode_ptr(uint32_t h) {
+	return (fsnode*)fsslab_ptr(&nodespace,h);
+}
+
+static inline uint32_t fsnode_handle(const fsnode *p) {
+	return fsslab_handle(p);
+}
+
+static inline fsedge* fsedge_ptr(uint32_t h) {
+	return (fsedge*)fsslab_ptr(&edgespace,h);
+}
+
+static inline uint32_t fsedge_handle(const fsedge *e) {
+	return fsslab_handle(e);
+}
+
+static void fsslab_init(fsslab *s,fsslab_space *sp,uint32_t elemsize) {
+	s->space = sp;
+	s->bhead = NULL;
+	s->freehead = NULL;
+	s->elemsize = elemsize;
+	s->perbucket = (FSSLAB_BUCKET_BYTES-sizeof(fsslab_bucket))/elemsize;
+	s->buckets = 0;
+	s->used = 0;
+	s->extbytes = 0;
+}
+
+static inline void* fsslab_alloc(fsslab *s) {
+	fsslab_bucket *b;
+	void *ret;
+	s->used++;
+	if (s->freehead) {
+		ret = s->freehead;
+		s->freehead = *((void**)ret);
+		return ret;
+	}
+	if (s->bhead==NULL || s->bhead->firstfree==s->perbucket) {
+		b = fsslab_space_newbucket(s->space);
+		b->next = s->bhead;
+		b->firstfree = 0;
+		s->bhead = b;
+		s->buckets++;
+	}
+	ret = s->bhead->data+(s->bhead->firstfree*s->elemsize);
+	s->bhead->firstfree++;
+	return ret;
+}
+
+static inline void fsslab_free(fsslab *s,void *p) {
+	*((void**)p) = s->freehead;
+	s->freehead = p;
+	s->used--;
+}
+
+// moves all objects from 'src' (used by loader thread) to 'dst'
+static void fsslab_merge(fsslab *dst,fsslab *src) {
+	fsslab_bucket *b;
+	void **fp;
+	while (src->bhead) {
+		b = src->bhead;
+		src->bhead = b->next;
+		while (b->firstfree<src->perbucket) {	// unused tail of partially filled bucket goes to free list
+			fp = (void**)(b->data+(b->firstfree*src->elemsize));
+			*fp = dst->freehead;
+			dst->freehead = fp;
+			b->firstfree++;
+		}
+		if (dst->bhead) {
+			b->next = dst->bhead->next;
+			dst->bhead->next = b;
+		} else {
+			b->next = NULL;
+			dst->bhead = b;
+		}
+	}
+	while (src->freehead) {
+		fp = (void**)(src->freehead);
+		src->freehead = *fp;
+		*fp = dst->freehead;
+		dst->freehead = fp;
+	}
+	dst->buckets += src->buckets;
+	dst->used += src->used;
+	dst->extbytes += src->extbytes;
+	src->buckets = 0;
+	src->used = 0;
+	src->extbytes = 0;
+}
+
+static void fsslab_edges_init(fsslab *es) {
+	uint32_t i;
+	for (i=0 ; i<FSEDGE_INLINE_CLASSES ; i++) {
+		fsslab_init(es+i,&edgespace,sizeof(fsedge)+i*8);
+	}
+	fsslab_init(es+FSEDGE_EXTNAME,&edgespace,sizeof(fsedge));
+}
+
+static inline fsnode* fsnode_malloc_slab(fsslab *ns) {
+	return (fsnode*)fsslab_alloc(ns);
+}
+
+static inline fsnode* fsnode_malloc(void) {
+	return fsnode_malloc_slab(&nodeslab);
+}
+
+static inline void fsnode_free_slab(fsslab *ns,fsnode *p) {
+	fsslab_free(ns,p);
+}
+
+static inline void fsnode_free(fsnode *p) {
+	fsslab_free(&nodeslab,p);
+}
+
+// allocates edge with space for name (e->nleng and e->name are set)
+static inline fsedge* fsedge_malloc_slab(fsslab *es,uint16_t nleng) {
+	fsedge *e;
+	uint8_t nclass;
+	if (nleng<=FSEDGE_INLINE_MAX) {
+		nclass = (nleng+7)/8;
+		e = (fsedge*)fsslab_alloc(es+nclass);
+		e->name = FSEDGE_INLINE_NAME(e);
+	} else {
+		nclass = FSEDGE_EXTNAME;
+		e = (fsedge*)fsslab_alloc(es+nclass);
+		e->name = malloc(nleng);
+		passert(e->name);
+		es[nclass].extbytes += nleng;
+	}
+	e->nclass = nclass;
+	e->nleng = nleng;
+#ifdef EDGEHASH
+	e->inhash = 0;
+#endif
+	return e;
+}
+
+static inline fsedge* fsedge_malloc(uint16_t nleng) {
+	return fsedge_malloc_slab(edgeslab,nleng);
+}
+
+// as above, but takes over already malloc'ed name
+static inline fsedge* fsedge_malloc_withname(uint16_t nleng,uint8_t *name) {
+	fsedge *e;
+	if (nleng<=FSEDGE_INLINE_MAX) {
+		e = fsedge_malloc(nleng);
+		memcpy(e->name,name,nleng);
+		if (name) {
+			free(name);
+		}
+	} else {
+		e = (fsedge*)fsslab_alloc(edgeslab+FSEDGE_EXTNAME);
+		e->nclass = FSEDGE_EXTNAME;
+		e->nleng = nleng;
+#ifdef EDGEHASH
+		e->inhash = 0;
+#endif
+		e->name = name;
+		edgeslab[FSEDGE_EXTNAME].extbytes += nleng;
+	}
+	return e;
+}
+
+static inline void fsedge_free_slab(fsslab *es,fsedge *e) {
+	if (e->name!=FSEDGE_INLINE_NAME(e)) {
+		free(e->name);
+		es[e->nclass].extbytes -= e->nleng;
+	}
+	fsslab_free(es+e->nclass,e);
+}
+
+static inline void fsedge_free(fsedge *e) {
+	fsedge_free_slab(edgeslab,e);
+}
+
+// changes name of existing edge (name is stored outside the edge when it doesn't fit in inline space)
+static inline void fsedge_setname(fsedge *e,uint16_t nleng,const uint8_t *name) {
+	if (e->name!=FSEDGE_INLINE_NAME(e)) {
+		free(e->name);
+		edgeslab[e->nclass].extbytes -= e->nleng;
+	}
+	if (e->nclass<FSEDGE_INLINE_CLASSES && nleng<=e->nclass*8) {
+		e->name = FSEDGE_INLINE_NAME(e);
+	} else {
+		e->name = malloc(nleng);
+		passert(e->name);
+		edgeslab[e->nclass].extbytes += nleng;
+	}
+	memcpy(e->name,name,nleng);
+	e->nleng = nleng;
+}
+
+static void fsslab_memory_info(void) {
+	uint64_t nodebytes,edgebytes;
+	uint32_t edges,i;
+	nodebytes = (uint64_t)nodeslab.buckets*FSSLAB_BUCKET_BYTES;
+	edgebytes = 0;
+	edges = 0;
+	for (i=0 ; i<FSEDGE_CLASSES ; i++) {
+		edgebytes += (uint64_t)edgeslab[i].buckets*FSSLAB_BUCKET_BYTES+edgeslab[i].extbytes;
+		edges += edgeslab[i].used;
+	}
+	fprintf(stderr,"objects memory: %"PRIu32" nodes in %"PRIu64" bytes (%.1lf bytes/node), %"PRIu32" edges in %"PRIu64" bytes (%.1lf bytes/edge, names included)\n",nodeslab.used,nodebytes,(nodeslab.used>0)?(double)nodebytes/nodeslab.used:0.0,edges,edgebytes,(edges>0)?(double)edgebytes/edges:0.0);
+#ifndef METARESTORE
+	syslog(LOG_NOTICE,"objects memory: %"PRIu32" nodes in %"PRIu64" bytes (%.1lf bytes/node), %"PRIu32" edges in %"PRIu64" bytes (%.1lf bytes/edge, names included)",nodeslab.used,nodebytes,(nodeslab.used>0)?(double)nodebytes/nodeslab.used:0.0,edges,edgebytes,(edges>0)?(double)edgebytes/edges:0.0);
+#endif
+}
+
+static fshash nodehash;
+#ifdef EDGEHASH
+static fshash edgehash;
+#endif
+
+static void fsnodes_nodehash_movebucket(fshash *h,void *first) {
+	fsnode *p,*pn;
+	fsnode **b;
+	for (p=(fsnode*)first ; p ; p=pn) {
+		pn = fsnode_ptr(p->next);
+		b = (fsnode**)(h->tab+(p->id&(h->size-1)));
+		p->next = fsnode_handle(*b);
+		*b = p;
+	}
+}
+
+static inline fsnode** fsnodes_nodehash_bucket(uint32_t id) {
+	return (fsnode**)fshash_bucket(&nodehash,id);
+}
+
+static inline void fsnodes_nodehash_add(fsnode *p) {
+	fsnode **b = fsnodes_nodehash_bucket(p->id);
+	p->next = fsnode_handle(*b);
+	*b = p;
+	nodehash.elements++;
+	fshash_check(&nodehash);
+}
+
+static inline void fsnodes_nodehash_remove(fsnode *p) {
+	fsnode **b = fsnodes_nodehash_bucket(p->id);
+	fsnode *pp;
+	if (*b==p) {
+		*b = fsnode_ptr(p->next);
+		nodehash.elements--;
+	} else if (*b) {
+		for (pp=*b ; pp->next ; pp=fsnode_ptr(pp->next)) {
+			if (fsnode_ptr(pp->next)==p) {
+				pp->next = p->next;
+				nodehash.elements--;
+				break;
+			}
+		}
+	}
+	fshash_check(&nodehash);
+}
+
+#ifdef EDGEHASH
+static void fsnodes_edgehash_movebucket(fshash *h,void *first) {
+	fsedge *e,*en;
+	fsedge **b;
+	for (e=(fsedge*)first ; e ; e=en) {
+		en = fsedge_ptr(e->next);
+		b = (fsedge**)(h->tab+(e->hash&(h->size-1)));
+		e->next = fsedge_handle(*b);
+		if (e->next) {
+			fsedge_ptr(e->next)->prev = fsedge_handle(e);
+		}
+		*b = e;
+		e->prev = 0;
+	}
+}
+
+static inline fsedge* fsnodes_edgehash_first(uint32_t hash) {
+	return *((fsedge**)fshash_bucket(&edgehash,hash));
+}
+
+// e->hash has to be set
+static inline void fsnodes_edgehash_add(fsedge *e) {
+	fsedge **b = (fsedge**)fshash_bucket(&edgehash,e->hash);
+	e->next = fsedge_handle(*b);
+	if (e->next) {
+		fsedge_ptr(e->next)->prev = fsedge_handle(e);
+	}
+	*b = e;
+	e->prev = 0;
+	e->inhash = 1;
+	edgehash.elements++;
+	fshash_check(&edgehash);
+}
+
+static inline void fsnodes_edgehash_remove(fsedge *e) {
+	if (e->inhash) {
+		if (e->prev) {
+			fsedge_ptr(e->prev)->next = e->next;
+		} else {
+			*((fsedge**)fshash_bucket(&edgehash,e->hash)) = fsedge_ptr(e->next);
+		}
+		if (e->next) {
+			fsedge_ptr(e->next)->prev = e->prev;
+		}
+		e->prev = 0;
+		e->next = 0;
+		e->inhash = 0;
+		edgehash.elements--;
+		fshash_check(&edgehash);
 	}
-	if (searchpos==bitmasksize) {	// no more freeinodes
+}
+#endif
+
+#ifndef METARESTORE
+static void* fsnodes_nodehash_next(void *p) {
+	return fsnode_ptr(((fsnode*)p)->next);
+}
+
+#ifdef EDGEHASH
+static void* fsnodes_edgehash_next(void *e) {
+	return fsedge_ptr(((fsedge*)e)->next);
+}
+#endif
+
+static void *fshashhook;
+static uint8_t fshashactive;
+
+static void fs_hash_rehash(void) {
+	uint8_t active;
+	fshash_step(&nodehash,FSHASH_TIMERSTEP);
+	active = (nodehash.oldtab)?1:0;
+#ifdef EDGEHASH
+	fshash_step(&edgehash,FSHASH_TIMERSTEP);
+	active |= (edgehash.oldtab)?1:0;
+#endif
+	if (active!=fshashactive) {	// rehashing is started by inserts/removes - idle timer only notices it
+		fshashactive = active;
+		main_msectimechange(fshashhook,TIMEMODE_SKIP_LATE,active?FSHASH_REHASHMSEC:FSHASH_IDLEMSEC,0);
+	}
+}
+
+static void fs_hash_scan(void) {
+	fshash_scan(&nodehash,FSHASH_SCANSTEP,fsnodes_nodehash_next);
+#ifdef EDGEHASH
+	fshash_scan(&edgehash,FSHASH_SCANSTEP,fsnodes_edgehash_next);
+#endif
+}
+
+void fs_hash_info(uint32_t *nhsize,uint32_t *nhelements,uint32_t *nhmaxchain,uint32_t *ehsize,uint32_t *ehelements,uint32_t *ehmaxchain,uint8_t *rehashing) {
+	*nhsize = nodehash.size;
+	*nhelements = nodehash.elements;
+	*nhmaxchain = nodehash.maxchain;
+#ifdef EDGEHASH
+	*ehsize = edgehash.size;
+	*ehelements = edgehash.elements;
+	*ehmaxchain = edgehash.maxchain;
+	*rehashing = (nodehash.oldtab?1:0) | (edgehash.oldtab?2:0);
+#else
+	*ehsize = 0;
+	*ehelements = 0;
+	*ehmaxchain = 0;
+	*rehashing = (nodehash.oldtab?1:0);
+#endif
+}
+#endif
+
+// index of the lowest zero bit (mask has to have at least one zero bit)
+static inline uint32_t fsnodes_fbm_firstzero(uint32_t mask) {
+	uint32_t i = 0;
+	if ((mask&0xFFFF)==0xFFFF) {
+		i += 16;
+		mask >>= 16;
+	}
+	if ((mask&0xFF)==0xFF) {
+		i += 8;
+		mask >>= 8;
+	}
+	if ((mask&0xF)==0xF) {
+		i += 4;
+		mask >>= 4;
+	}
+	if ((mask&0x3)==0x3) {
+		i += 2;
+		mask >>= 2;
+	}
+	if ((mask&0x1)==0x1) {
+		i += 1;
+	}
+	return i;
+}
+
+static inline void fsnodes_fbm_setused(uint32_t id) {
+	uint32_t pos;
+	pos = id>>5;
+	freebitmask[pos] |= 1U<<(id&0x1F);
+	if (freebitmask[pos]==0xFFFFFFFF) {
+		fullbitmask[pos>>5] |= 1U<<(pos&0x1F);
+		if (fullbitmask[pos>>5]==0xFFFFFFFF) {
+			fullsummary[pos>>10] |= 1U<<((pos>>5)&0x1F);
+		}
+	}
+}
+
+static inline void fsnodes_fbm_setfree(uint32_t id) {
+	uint32_t pos;
+	pos = id>>5;
+	freebitmask[pos] &= ~(1U<<(id&0x1F));
+	fullbitmask[pos>>5] &= ~(1U<<(pos&0x1F));
+	fullsummary[pos>>10] &= ~(1U<<((pos>>5)&0x1F));
+}
+
+// (re)allocates upper levels after freebitmask has been resized (bitmasksize is always multiple of 0x80) - new words are set to zero
+static void fsnodes_fbm_resize(uint32_t oldsize) {
+	uint32_t l1old,l1new,l2old,l2new;
+	l1old = oldsize>>5;
+	l1new = bitmasksize>>5;
+	l2old = (l1old+0x1F)>>5;
+	l2new = (l1new+0x1F)>>5;
+	fullbitmask = (uint32_t*)realloc(fullbitmask,l1new*sizeof(uint32_t));
+	passert(fullbitmask);
+	memset(fullbitmask+l1old,0,(l1new-l1old)*sizeof(uint32_t));
+	if (l2new>l2old) {
+		fullsummary = (uint32_t*)realloc(fullsummary,l2new*sizeof(uint32_t));
+		passert(fullsummary);
+		memset(fullsummary+l2old,0,(l2new-l2old)*sizeof(uint32_t));
+	}
+}
+
+// rebuilds upper levels from freebitmask (used after freebitmask has been filled directly)
+static void fsnodes_fbm_summarize(void) {
+	uint32_t pos,l1size;
+	l1size = bitmasksize>>5;
+	memset(fullbitmask,0,l1size*sizeof(uint32_t));
+	memset(fullsummary,0,((l1size+0x1F)>>5)*sizeof(uint32_t));
+	for (pos=0 ; pos<bitmasksize ; pos++) {
+		if (freebitmask[pos]==0xFFFFFFFF) {
+			fullbitmask[pos>>5] |= 1U<<(pos&0x1F);
+		}
+	}
+	for (pos=0 ; pos<l1size ; pos++) {
+		if (fullbitmask[pos]==0xFFFFFFFF) {
+			fullsummary[pos>>5] |= 1U<<(pos&0x1F);
+		}
+	}
+}
+
+// first freebitmask word not fully used starting from pos (returns bitmasksize when there are no such words)
+static inline uint32_t fsnodes_fbm_nextfree(uint32_t pos) {
+	uint32_t l1,l2,l1size,l2size,mask;
+	if (pos>=bitmasksize || freebitmask[pos]!=0xFFFFFFFF) {
+		return pos;
+	}
+	l1 = pos>>5;
+	mask = fullbitmask[l1] | ((2U<<(pos&0x1F))-1);
+	if (mask!=0xFFFFFFFF) {
+		return (l1<<5)+fsnodes_fbm_firstzero(mask);
+	}
+	l1size = bitmasksize>>5;
+	l2size = (l1size+0x1F)>>5;
+	l2 = l1>>5;
+	mask = fullsummary[l2] | ((2U<<(l1&0x1F))-1);
+	while (mask==0xFFFFFFFF) {
+		l2++;
+		if (l2>=l2size) {
+			return bitmasksize;
+		}
+		mask = fullsummary[l2];
+	}
+	l1 = (l2<<5)+fsnodes_fbm_firstzero(mask);
+	if (l1>=l1size) {
+		return bitmasksize;
+	}
+	return (l1<<5)+fsnodes_fbm_firstzero(fullbitmask[l1]);
+}
+
+uint32_t fsnodes_get_next_id() {
+	uint32_t i;
+	searchpos = fsnodes_fbm_nextfree(searchpos);
+	if (searchpos>=bitmasksize) {	// no more freeinodes
 		uint32_t *tmpfbm;
+		searchpos = bitmasksize;
 		bitmasksize+=0x80;
 		tmpfbm = freebitmask;
 		freebitmask = (uint32_t*)realloc(freebitmask,bitmasksize*sizeof(uint32_t));
@@ -452,16 +1045,10 @@ uint32_t fsnodes_get_next_id() {
 		}
 		passert(freebitmask);
 		memset(freebitmask+searchpos,0,0x80*sizeof(uint32_t));
+		fsnodes_fbm_resize(searchpos);
 	}
-	mask = freebitmask[searchpos];
-	i=0;
-	while (mask&1) {
-		i++;
-		mask>>=1;
-	}
-	mask = 1<<i;
-	freebitmask[searchpos] |= mask;
-	i+=(searchpos<<5);
+	i = (searchpos<<5)+fsnodes_fbm_firstzero(freebitmask[searchpos]);
+	fsnodes_fbm_setused(i);
 	if (i>maxnodeid) {
 		maxnodeid=i;
 	}
@@ -483,7 +1070,7 @@ void fsnodes_freeinodes(void) {
 #else
 uint8_t fs_freeinodes(uint32_t ts,uint32_t freeinodes) {
 #endif
-	uint32_t fi,now,pos,mask;
+	uint32_t fi,now,pos;
 	freenode *n,*an;
 #ifndef METARESTORE
 	now = main_time();
@@ -495,8 +1082,7 @@ uint8_t fs_freeinodes(uint32_t ts,uint32_t freeinodes) {
 	while (n && n->ftime+86400<now) {
 		fi++;
 		pos = (n->id >> 5);
-		mask = 1<<(n->id&0x1F);
-		freebitmask[pos] &= ~mask;
+		fsnodes_fbm_setfree(n->id);
 		if (pos<searchpos) {
 			searchpos = pos;
 		}
@@ -512,7 +1098,7 @@ uint8_t fs_freeinodes(uint32_t ts,uint32_t freeinodes) {
 	}
 #ifndef METARESTORE
 	if (fi>0) {
-		changelog(metaversion++,"%" PRIu32 "|FREEINODES():%" PRIu32,(uint32_t)main_time(),fi);
+		changelog(metaversion++,(uint32_t)main_time(),CLOP_FREEINODES,fi);
 	}
 #else
 	metaversion++;
@@ -528,15 +1114,15 @@ void fsnodes_init_freebitmask (void) {
 	freebitmask = (uint32_t*)malloc(bitmasksize*sizeof(uint32_t));
 	passert(freebitmask);
 	memset(freebitmask,0,bitmasksize*sizeof(uint32_t));
+	fsnodes_fbm_resize(0);
 	freebitmask[0]=1;	// reserve inode 0
 	searchpos = 0;
+	freelist = NULL;
+	freetail = &(freelist);
 }
 
 void fsnodes_used_inode (uint32_t id) {
-	uint32_t pos,mask;
-	pos = id>>5;
-	mask = 1<<(id&0x1F);
-	freebitmask[pos]|=mask;
+	fsnodes_fbm_setused(id);
 }
 
 
@@ -828,91 +1414,582 @@ static inline uint32_t fsnodes_hash(uint32_t parentid,uint16_t nleng,const uint8
 	}
 	return hash;
 }
-#endif
 
-static inline int fsnodes_nameisused(fsnode *node,uint16_t nleng,const uint8_t *name) {
-	fsedge *ei;
-#ifdef EDGEHASH
-	if (node->data.ddata.elements>LOOKUPNOHASHLIMIT) {
-		ei = edgehash[EDGEHASHPOS(fsnodes_hash(node->id,nleng,name))];
-		while (ei) {
-			if (ei->parent==node && nleng==ei->nleng && memcmp((char*)(ei->name),(char*)name,nleng)==0) {
-				return 1;
-			}
-			ei = ei->next;
-		}
-	} else {
-		ei = node->data.ddata.children;
-		while (ei) {
-			if (nleng==ei->nleng && memcmp((char*)(ei->name),(char*)name,nleng)==0) {
-				return 1;
-			}
-			ei = ei->nextchild;
-		}
+// bijective mix of name hash - used by directory index slots and for splitting directories into parts (background jobs)
+static inline uint32_t fsnodes_hashmix(uint32_t hash) {
+	return hash*0x9E3779B1;
+}
+
+/* per-directory index - built for directories with more than DirIndexThreshold entries (edges of such directory are not kept in edgehash)
+	slots - open addressing table of children (home slot - highest bits of mixed name hash) - lookup, insert and remove in O(1)
+	blocks - children in order of positions given at insert (positions never change) - used for cursor based directory reading
+   index is removed when directory becomes four times smaller than threshold */
+#define DIRINDEX_MINSLOTS 1024
+#define DIRINDEX_BLOCKBITS 10
+#define DIRINDEX_BLOCKSIZE (1<<DIRINDEX_BLOCKBITS)
+#define DIRINDEX_MAPSIZE 4096
+#define DIRINDEX_DEFAULT_THRESHOLD 4096
+
+typedef struct _dirindex_slot {
+	fsedge *e;
+	uint32_t hash;
+	uint32_t pos;
+} dirindex_slot;
+
+typedef struct _dirindex_block {
+	uint32_t live;
+	fsedge *e[DIRINDEX_BLOCKSIZE];
+} dirindex_block;
+
+typedef struct _dirindex {
+	fsnode *dir;
+	dirindex_slot *slots;
+	uint32_t slotssize,elements;
+	uint8_t shift;		// 32 - log2(slotssize)
+	dirindex_block **blocks;	// blocks[i] keeps positions from (firstblock+i)<<DIRINDEX_BLOCKBITS (NULL - all removed)
+	uint32_t firstblock,blockscnt,blockssize;
+	uint32_t nextpos;
+	uint32_t gen;	// changed every time index is built - used in directory reading cursors
+	struct _dirindex *next;
+} dirindex;
+
+static dirindex *dirindexmap[DIRINDEX_MAPSIZE];
+static uint32_t DirIndexThreshold = DIRINDEX_DEFAULT_THRESHOLD;
+static uint32_t dirindexcount;
+static uint32_t dirindexgen;
+
+static inline dirindex* fsnodes_dirindex_get(fsnode *dir) {
+	dirindex *di;
+	if (dirindexcount==0 || dir->data.ddata.elements<DirIndexThreshold/4) {
+		return NULL;
 	}
-#else
-	ei = node->data.ddata.children;
-	while (ei) {
-		if (nleng==ei->nleng && memcmp((char*)(ei->name),(char*)name,nleng)==0) {
-			return 1;
+	for (di=dirindexmap[dir->id%DIRINDEX_MAPSIZE] ; di ; di=di->next) {
+		if (di->dir==dir) {
+			return di;
 		}
-		ei = ei->nextchild;
 	}
-#endif
-	return 0;
+	return NULL;
 }
 
-static inline fsedge* fsnodes_lookup(fsnode *node,uint16_t nleng,const uint8_t *name) {
-	fsedge *ei;
+static inline void fsnodes_dirindex_slotput(dirindex_slot *slots,uint8_t shift,fsedge *e,uint32_t hash,uint32_t pos) {
+	uint32_t i,mask;
+	mask = (UINT32_C(0xFFFFFFFF)>>shift);
+	i = fsnodes_hashmix(hash)>>shift;
+	while (slots[i].e) {
+		i = (i+1)&mask;
+	}
+	slots[i].e = e;
+	slots[i].hash = hash;
+	slots[i].pos = pos;
+}
 
-	if (node->type!=TYPE_DIRECTORY) {
-		return NULL;
+static void fsnodes_dirindex_resize(dirindex *di,uint32_t newsize) {
+	dirindex_slot *oldslots;
+	uint32_t i,oldsize;
+	oldslots = di->slots;
+	oldsize = di->slotssize;
+	di->slots = malloc(sizeof(dirindex_slot)*newsize);
+	passert(di->slots);
+	memset(di->slots,0,sizeof(dirindex_slot)*newsize);
+	di->slotssize = newsize;
+	for (di->shift=32 ; newsize>1 ; newsize>>=1) {
+		di->shift--;
 	}
-#ifdef EDGEHASH
-	if (node->data.ddata.elements>LOOKUPNOHASHLIMIT) {
-		ei = edgehash[EDGEHASHPOS(fsnodes_hash(node->id,nleng,name))];
-		while (ei) {
-			if (ei->parent==node && nleng==ei->nleng && memcmp((char*)(ei->name),(char*)name,nleng)==0) {
-				return ei;
-			}
-			ei = ei->next;
-		}
-	} else {
-		ei = node->data.ddata.children;
-		while (ei) {
-			if (nleng==ei->nleng && memcmp((char*)(ei->name),(char*)name,nleng)==0) {
-				return ei;
-			}
-			ei = ei->nextchild;
+	for (i=0 ; i<oldsize ; i++) {
+		if (oldslots[i].e) {
+			fsnodes_dirindex_slotput(di->slots,di->shift,oldslots[i].e,oldslots[i].hash,oldslots[i].pos);
 		}
 	}
-#else
-	ei = node->data.ddata.children;
-	while (ei) {
-		if (nleng==ei->nleng && memcmp((char*)(ei->name),(char*)name,nleng)==0) {
-			return ei;
-		}
-		ei = ei->nextchild;
+	if (oldslots) {
+		free(oldslots);
 	}
-#endif
-	return NULL;
 }
 
-static inline fsnode* fsnodes_id_to_node(uint32_t id) {
-	fsnode *p;
-	uint32_t nodepos = NODEHASHPOS(id);
-	for (p=nodehash[nodepos]; p ; p=p->next ) {
-		if (p->id == id) {
-			return p;
+static inline fsedge* fsnodes_dirindex_lookup(dirindex *di,uint32_t hash,uint16_t nleng,const uint8_t *name) {
+	uint32_t i,mask;
+	fsedge *e;
+	mask = di->slotssize-1;
+	for (i=fsnodes_hashmix(hash)>>di->shift ; (e=di->slots[i].e)!=NULL ; i=(i+1)&mask) {
+		if (di->slots[i].hash==hash && e->nleng==nleng && memcmp(e->name,name,nleng)==0) {
+			return e;
 		}
 	}
 	return NULL;
 }
 
-/*
-static inline uint8_t fsnodes_geteattr(fsnode *p) {
-	fsedge *e;
-	uint8_t eattr;
+static inline void fsnodes_dirindex_add(dirindex *di,fsedge *e) {
+	dirindex_block *b;
+	uint32_t bno,pos;
+	if ((uint64_t)(di->elements+1)*4>(uint64_t)(di->slotssize)*3) {
+		fsnodes_dirindex_resize(di,di->slotssize*2);
+	}
+	pos = di->nextpos++;
+	bno = (pos>>DIRINDEX_BLOCKBITS)-di->firstblock;
+	if (bno>=di->blockscnt) {
+		if (bno>=di->blockssize) {
+			di->blockssize = (di->blockssize==0)?16:di->blockssize*2;
+			di->blocks = realloc(di->blocks,sizeof(dirindex_block*)*di->blockssize);
+			passert(di->blocks);
+		}
+		while (di->blockscnt<=bno) {
+			di->blocks[di->blockscnt++] = NULL;
+		}
+	}
+	b = di->blocks[bno];
+	if (b==NULL) {
+		b = malloc(sizeof(dirindex_block));
+		passert(b);
+		memset(b,0,sizeof(dirindex_block));
+		di->blocks[bno] = b;
+	}
+	b->e[pos&(DIRINDEX_BLOCKSIZE-1)] = e;
+	b->live++;
+	fsnodes_dirindex_slotput(di->slots,di->shift,e,e->hash,pos);
+	di->elements++;
+}
+
+static inline void fsnodes_dirindex_remove(dirindex *di,fsedge *e) {
+	dirindex_block *b;
+	uint32_t i,j,k,mask,bno,pos;
+	mask = di->slotssize-1;
+	for (i=fsnodes_hashmix(e->hash)>>di->shift ; di->slots[i].e!=e ; i=(i+1)&mask) {
+		if (di->slots[i].e==NULL) {
+			return;
+		}
+	}
+	pos = di->slots[i].pos;
+// backward shift deletion
+	for (;;) {
+		di->slots[i].e = NULL;
+		j = i;
+		for (;;) {
+			j = (j+1)&mask;
+			if (di->slots[j].e==NULL) {
+				goto removed;
+			}
+			k = fsnodes_hashmix(di->slots[j].hash)>>di->shift;
+			if ((j>i && (k<=i || k>j)) || (j<i && (k<=i && k>j))) {
+				break;
+			}
+		}
+		di->slots[i] = di->slots[j];
+		i = j;
+	}
+removed:
+	di->elements--;
+	bno = (pos>>DIRINDEX_BLOCKBITS)-di->firstblock;
+	b = di->blocks[bno];
+	b->e[pos&(DIRINDEX_BLOCKSIZE-1)] = NULL;
+	b->live--;
+	if (b->live==0 && (pos>>DIRINDEX_BLOCKBITS)<(di->nextpos>>DIRINDEX_BLOCKBITS)) {	// block is empty and will never be used again
+		free(b);
+		di->blocks[bno] = NULL;
+		if (bno==0) {
+			for (i=0 ; i<di->blockscnt && di->blocks[i]==NULL ; i++) {}
+			memmove(di->blocks,di->blocks+i,sizeof(dirindex_block*)*(di->blockscnt-i));
+			di->blockscnt -= i;
+			di->firstblock += i;
+		}
+	}
+	if (di->elements<di->slotssize/8 && di->slotssize>DIRINDEX_MINSLOTS) {
+		fsnodes_dirindex_resize(di,di->slotssize/2);
+	}
+}
+
+// returns first child with position not lower than *pos (and sets *pos to its position) - NULL at the end
+static inline fsedge* fsnodes_dirindex_iterate(dirindex *di,uint32_t *pos) {
+	dirindex_block *b;
+	uint32_t bno,i;
+	if (*pos<(di->firstblock<<DIRINDEX_BLOCKBITS)) {
+		*pos = di->firstblock<<DIRINDEX_BLOCKBITS;
+	}
+	for (bno=(*pos>>DIRINDEX_BLOCKBITS)-di->firstblock ; bno<di->blockscnt ; bno++) {
+		b = di->blocks[bno];
+		if (b!=NULL) {
+			for (i=((*pos>>DIRINDEX_BLOCKBITS)-di->firstblock==bno)?(*pos&(DIRINDEX_BLOCKSIZE-1)):0 ; i<DIRINDEX_BLOCKSIZE ; i++) {
+				if (b->e[i]) {
+					*pos = ((di->firstblock+bno)<<DIRINDEX_BLOCKBITS)+i;
+					return b->e[i];
+				}
+			}
+		}
+	}
+	*pos = di->nextpos;
+	return NULL;
+}
+
+static void fsnodes_dirindex_build(fsnode *dir) {
+	dirindex *di;
+	fsedge *e;
+	uint32_t size;
+	di = malloc(sizeof(dirindex));
+	passert(di);
+	di->dir = dir;
+	di->slots = NULL;
+	di->slotssize = 0;
+	di->elements = 0;
+	di->blocks = NULL;
+	di->firstblock = 0;
+	di->blockscnt = 0;
+	di->blockssize = 0;
+	di->nextpos = 0;
+	dirindexgen++;
+	if (dirindexgen==0) {
+		dirindexgen++;
+	}
+	di->gen = dirindexgen;
+	size = DIRINDEX_MINSLOTS;
+	while ((uint64_t)size*3<(uint64_t)(dir->data.ddata.elements)*8) {	// load factor about 0.375 .. 0.75
+		size*=2;
+	}
+	fsnodes_dirindex_resize(di,size);
+	for (e=fsedge_ptr(dir->data.ddata.children) ; e ; e=fsedge_ptr(e->nextchild)) {
+		fsnodes_edgehash_remove(e);
+		fsnodes_dirindex_add(di,e);
+	}
+	di->next = dirindexmap[dir->id%DIRINDEX_MAPSIZE];
+	dirindexmap[dir->id%DIRINDEX_MAPSIZE] = di;
+	dirindexcount++;
+}
+
+static void fsnodes_dirindex_destroy(dirindex *di) {
+	dirindex **dip;
+	fsedge *e;
+	uint32_t i;
+	for (dip=dirindexmap+(di->dir->id%DIRINDEX_MAPSIZE) ; *dip!=di ; dip=&((*dip)->next)) {}
+	*dip = di->next;
+	dirindexcount--;
+	for (e=fsedge_ptr(di->dir->data.ddata.children) ; e ; e=fsedge_ptr(e->nextchild)) {
+		fsnodes_edgehash_add(e);
+	}
+	for (i=0 ; i<di->blockscnt ; i++) {
+		if (di->blocks[i]) {
+			free(di->blocks[i]);
+		}
+	}
+	if (di->blocks) {
+		free(di->blocks);
+	}
+	free(di->slots);
+	free(di);
+}
+
+static void fsnodes_dirindex_free(fsnode *dir) {
+	dirindex *di;
+	for (di=dirindexmap[dir->id%DIRINDEX_MAPSIZE] ; di ; di=di->next) {
+		if (di->dir==dir) {
+			fsnodes_dirindex_destroy(di);
+			return;
+		}
+	}
+}
+
+#ifndef METARESTORE
+// all indexes are removed - they will be built again (using new threshold) after next change in each directory
+static void fs_dirindex_setthreshold(uint32_t threshold) {
+	uint32_t i;
+	if (threshold==DirIndexThreshold) {
+		return;
+	}
+	for (i=0 ; i<DIRINDEX_MAPSIZE ; i++) {
+		while (dirindexmap[i]) {
+			fsnodes_dirindex_destroy(dirindexmap[i]);
+		}
+	}
+	DirIndexThreshold = threshold;
+}
+#endif
+
+// builds or removes index after change of number of entries
+static inline void fsnodes_dirindex_check(fsnode *dir,dirindex *di) {
+	if (di==NULL) {
+		if (DirIndexThreshold>0 && dir->data.ddata.elements>DirIndexThreshold) {
+			fsnodes_dirindex_build(dir);
+		}
+	} else if (DirIndexThreshold==0 || dir->data.ddata.elements<DirIndexThreshold/4) {
+		fsnodes_dirindex_destroy(di);
+	}
+}
+#endif
+
+/* lazy snapshots - snapshot of directory creates only its root ("placeholder" - directory without own children, which shows
+   contents of its source directory). Placeholders are materialized one level at a time (children of source are copied and
+   their subdirectories become new placeholders):
+	- before first access to children of placeholder ("open")
+	- before any modification of source directory or any node below it ("cover")
+   every materialization is stored in changelog (MATERIALIZE), so mfsmetarestore doesn't need these hooks */
+typedef struct _lazysnap {
+	uint32_t dstid;
+	uint32_t srcid;
+	uint32_t ts;		// snapshot time - used as ctime of materialized nodes
+	uint32_t pending;	// used only during metadata loading
+	struct _lazysnap *dstnext;
+	struct _lazysnap *srcnext;
+} lazysnap;
+
+#define LAZYSNAP_HASHSIZE 65536
+#define LAZYSNAP_HASHPOS(id) ((id)&(LAZYSNAP_HASHSIZE-1))
+
+static lazysnap* lazydsthash[LAZYSNAP_HASHSIZE];
+static lazysnap* lazysrchash[LAZYSNAP_HASHSIZE];
+static uint32_t lazysnapcount = 0;
+static uint32_t lazysuppress = 0;	// >0 during materialization
+
+static inline lazysnap* fsnodes_lazy_find(uint32_t dstid) {
+	lazysnap *ls;
+	for (ls=lazydsthash[LAZYSNAP_HASHPOS(dstid)] ; ls ; ls=ls->dstnext) {
+		if (ls->dstid==dstid) {
+			return ls;
+		}
+	}
+	return NULL;
+}
+
+static inline lazysnap* fsnodes_lazy_findsrc(uint32_t srcid) {
+	lazysnap *ls;
+	for (ls=lazysrchash[LAZYSNAP_HASHPOS(srcid)] ; ls ; ls=ls->srcnext) {
+		if (ls->srcid==srcid) {
+			return ls;
+		}
+	}
+	return NULL;
+}
+
+static void fsnodes_lazy_forget(fsnode *dir);
+
+static inline int fsnodes_lazy_isplaceholder(fsnode *p) {
+	return (lazysnapcount>0 && p->type==TYPE_DIRECTORY && fsnodes_lazy_find(p->id)!=NULL)?1:0;
+}
+
+// directory is empty when it has no children and is not a placeholder (placeholders are created only for non empty sources)
+static inline int fsnodes_isempty(fsnode *p) {
+	return (p->data.ddata.children==0 && fsnodes_lazy_isplaceholder(p)==0)?1:0;
+}
+
+#ifndef METARESTORE
+static void fsnodes_lazy_opendir(fsnode *dir);
+static void fsnodes_lazy_releasedir(fsnode *dir);
+static void fsnodes_lazy_coverdir(fsnode *dir);
+
+static inline void fsnodes_lazy_open(fsnode *dir) {
+	if (lazysnapcount>0 && lazysuppress==0) {
+		fsnodes_lazy_opendir(dir);
+	}
+}
+
+static inline void fsnodes_lazy_cover(fsnode *dir) {
+	if (lazysnapcount>0 && lazysuppress==0) {
+		fsnodes_lazy_coverdir(dir);
+	}
+}
+
+// has to be called before modification of node attributes
+static inline void fsnodes_lazy_touch(fsnode *node) {
+	fsedge *e;
+	if (lazysnapcount>0 && lazysuppress==0) {
+		if (node->type==TYPE_DIRECTORY) {
+			fsnodes_lazy_coverdir(node);
+		} else {
+			for (e=fsedge_ptr(node->parents) ; e ; e=fsedge_ptr(e->nextparent)) {
+				if (e->parent) {	// trash and reserved files have edges without parent
+					fsnodes_lazy_coverdir(fsnode_ptr(e->parent));
+				}
+			}
+		}
+	}
+}
+
+// used by recursive operations (top node has to be touched before) - has to be called before node is changed
+static inline void fsnodes_lazy_visit(fsnode *node,uint8_t smode) {
+	if (lazysnapcount>0 && lazysuppress==0) {
+		if (node->type==TYPE_DIRECTORY) {
+			if (smode&SMODE_RMASK) {
+				fsnodes_lazy_opendir(node);
+				fsnodes_lazy_releasedir(node);
+			}
+		} else if (node->parents && fsedge_ptr(node->parents)->nextparent) {
+			fsnodes_lazy_touch(node);
+		}
+	}
+}
+#endif
+
+static inline int fsnodes_nameisused(fsnode *node,uint16_t nleng,const uint8_t *name) {
+	fsedge *ei;
+#ifdef EDGEHASH
+	uint32_t hash,nodeh;
+	dirindex *di;
+#endif
+#ifndef METARESTORE
+	fsnodes_lazy_open(node);
+#endif
+#ifdef EDGEHASH
+	if (node->data.ddata.elements>LOOKUPNOHASHLIMIT) {
+		hash = fsnodes_hash(node->id,nleng,name);
+		if ((di=fsnodes_dirindex_get(node))!=NULL) {
+			ei = fsnodes_dirindex_lookup(di,hash,nleng,name);
+			return (ei!=NULL)?1:0;
+		}
+		nodeh = fsnode_handle(node);
+		ei = fsnodes_edgehash_first(hash);
+		while (ei) {
+			if (ei->hash==hash && ei->parent==nodeh && nleng==ei->nleng && memcmp((char*)(ei->name),(char*)name,nleng)==0) {
+				return 1;
+			}
+			ei = fsedge_ptr(ei->next);
+		}
+	} else {
+		ei = fsedge_ptr(node->data.ddata.children);
+		while (ei) {
+			if (nleng==ei->nleng && memcmp((char*)(ei->name),(char*)name,nleng)==0) {
+				return 1;
+			}
+			ei = fsedge_ptr(ei->nextchild);
+		}
+	}
+#else
+	ei = fsedge_ptr(node->data.ddata.children);
+	while (ei) {
+		if (nleng==ei->nleng && memcmp((char*)(ei->name),(char*)name,nleng)==0) {
+			return 1;
+		}
+		ei = fsedge_ptr(ei->nextchild);
+	}
+#endif
+	return 0;
+}
+
+static inline fsedge* fsnodes_lookup(fsnode *node,uint16_t nleng,const uint8_t *name) {
+	fsedge *ei;
+#ifdef EDGEHASH
+	uint32_t hash,nodeh;
+	dirindex *di;
+#endif
+
+	if (node->type!=TYPE_DIRECTORY) {
+		return NULL;
+	}
+#ifndef METARESTORE
+	fsnodes_lazy_open(node);
+#endif
+#ifdef EDGEHASH
+	if (node->data.ddata.elements>LOOKUPNOHASHLIMIT) {
+		hash = fsnodes_hash(node->id,nleng,name);
+		if ((di=fsnodes_dirindex_get(node))!=NULL) {
+			ei = fsnodes_dirindex_lookup(di,hash,nleng,name);
+			return ei;
+		}
+		nodeh = fsnode_handle(node);
+		ei = fsnodes_edgehash_first(hash);
+		while (ei) {
+			if (ei->hash==hash && ei->parent==nodeh && nleng==ei->nleng && memcmp((char*)(ei->name),(char*)name,nleng)==0) {
+				return ei;
+			}
+			ei = fsedge_ptr(ei->next);
+		}
+	} else {
+		ei = fsedge_ptr(node->data.ddata.children);
+		while (ei) {
+			if (nleng==ei->nleng && memcmp((char*)(ei->name),(char*)name,nleng)==0) {
+				return ei;
+			}
+			ei = fsedge_ptr(ei->nextchild);
+		}
+	}
+#else
+	ei = fsedge_ptr(node->data.ddata.children);
+	while (ei) {
+		if (nleng==ei->nleng && memcmp((char*)(ei->name),(char*)name,nleng)==0) {
+			return ei;
+		}
+		ei = fsedge_ptr(ei->nextchild);
+	}
+#endif
+	return NULL;
+}
+
+static inline fsnode* fsnodes_id_to_node(uint32_t id) {
+	fsnode *p;
+	for (p=*fsnodes_nodehash_bucket(id); p ; p=fsnode_ptr(p->next) ) {
+		if (p->id == id) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+#ifndef METARESTORE
+/* fs_test - state of files (undergoal/missing) is kept in each node and counted in fsinfo_ugfiles/fsinfo_mfiles,
+   files changed here or reported by chunks module are queued in dirty queue and rechecked by fs_test_dirty,
+   fs_test_files still walks all nodes (slowly) to catch files that share chunks with others (snapshots) */
+static inline uint8_t fsnodes_test_getstate(fsnode *f) {
+	uint32_t j;
+	uint64_t chunkid;
+	uint8_t vc,state;
+	state = 0;
+	for (j=0 ; j<f->data.fdata.chunks ; j++) {
+		chunkid = f->data.fdata.chunktab[j];
+		if (chunkid>0) {
+			if (chunk_get_validcopies(chunkid,&vc)!=STATUS_OK || vc==0) {
+				return TEST_MISSING;
+			} else if (vc<f->goal) {
+				state = TEST_UNDERGOAL;
+			}
+		}
+	}
+	return state;
+}
+
+static inline void fsnodes_test_setstate(fsnode *f,uint8_t state) {
+	uint8_t ostate;
+	ostate = f->data.fdata.testflags & TEST_STATEMASK;
+	if (ostate==state) {
+		return;
+	}
+	if (ostate==TEST_UNDERGOAL) {
+		fsinfo_ugfiles--;
+	} else if (ostate==TEST_MISSING) {
+		fsinfo_mfiles--;
+	}
+	if (state==TEST_UNDERGOAL) {
+		fsinfo_ugfiles++;
+	} else if (state==TEST_MISSING) {
+		fsinfo_mfiles++;
+	}
+	f->data.fdata.testflags = (f->data.fdata.testflags & ~TEST_STATEMASK) | state;
+}
+
+static inline void fsnodes_test_markdirty(fsnode *f) {
+	if (f->data.fdata.testflags & TEST_DIRTY) {
+		return;
+	}
+	if (testdirtyqelements>=testdirtyqsize) {
+		testdirtyqsize = (testdirtyqsize==0)?1024:testdirtyqsize*2;
+		testdirtyq = realloc(testdirtyq,sizeof(uint32_t)*testdirtyqsize);
+		passert(testdirtyq);
+	}
+	testdirtyq[testdirtyqelements++] = f->id;
+	f->data.fdata.testflags |= TEST_DIRTY;
+}
+#endif
+
+// returns directory which contents are shown in given directory (source of placeholder)
+static inline fsnode* fsnodes_lazy_resolve(fsnode *dir) {
+	lazysnap *ls;
+	fsnode *p;
+	if (lazysnapcount>0 && dir->type==TYPE_DIRECTORY && (ls=fsnodes_lazy_find(dir->id))!=NULL) {
+		p = fsnodes_id_to_node(ls->srcid);
+		if (p) {
+			return p;
+		}
+	}
+	return dir;
+}
+
+/*
+static inline uint8_t fsnodes_geteattr(fsnode *p) {
+	fsedge *e;
+	uint8_t eattr;
 	eattr = (p->mode>>12) & (EATTR_NOOWNER | EATTR_NOACACHE);
 	for (e=p->parents ; e ; e=e->nextparent) { // check all parents of 'p' because 'p' can be any object, so it can be hardlinked
 		p=e->parent; // warning !!! since this point 'p' is used as temporary variable
@@ -942,23 +2019,24 @@ static inline uint8_t fsnodes_changeids(fsnode *p) {
 }
 */
 
+// first parent of node (directories have only one) - NULL for root, trash and reserved nodes
+static inline fsnode* fsnodes_getparent(fsnode *p) {
+	return (p->parents)?fsnode_ptr(fsedge_ptr(p->parents)->parent):NULL;
+}
+
 // returns 1 only if f is ancestor of p
 static inline int fsnodes_isancestor(fsnode *f,fsnode *p) {
 	fsedge *e;
 //	if (f==root) {	// root is ancestor of every node
 //		return 1;
 //	}
-	for (e=p->parents ; e ; e=e->nextparent) {	// check all parents of 'p' because 'p' can be any object, so it can be hardlinked
-		p=e->parent;	// warning !!! since this point 'p' is used as temporary variable
+	for (e=fsedge_ptr(p->parents) ; e ; e=fsedge_ptr(e->nextparent)) {	// check all parents of 'p' because 'p' can be any object, so it can be hardlinked
+		p=fsnode_ptr(e->parent);	// warning !!! since this point 'p' is used as temporary variable
 		while (p) {
 			if (f==p) {
 				return 1;
 			}
-			if (p->parents) {
-				p = p->parents->parent;	// here 'p' is always a directory so it should have only one parent
-			} else {
-				p = NULL;
-			}
+			p = fsnodes_getparent(p);	// here 'p' is always a directory so it should have only one parent
 		}
 	}
 	return 0;
@@ -1055,7 +2133,7 @@ static inline void fsnodes_check_quotanode(quotanode *qn,uint32_t ts) {
 		chg = 1;
 	}
 	if (chg) {
-		changelog(metaversion++,"%"PRIu32"|QUOTA(%"PRIu32",%"PRIu8",%"PRIu8",%"PRIu32",%"PRIu32",%"PRIu32",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64")",ts,qn->node->id,qn->exceeded,qn->flags,qn->stimestamp,qn->sinodes,qn->hinodes,qn->slength,qn->hlength,qn->ssize,qn->hsize,qn->srealsize,qn->hrealsize);
+		changelog(metaversion++,ts,CLOP_QUOTA,qn->node->id,qn->exceeded,qn->flags,qn->stimestamp,qn->sinodes,qn->hinodes,qn->slength,qn->hlength,qn->ssize,qn->hsize,qn->srealsize,qn->hrealsize);
 	}
 }
 
@@ -1075,8 +2153,8 @@ static inline uint8_t fsnodes_test_quota(fsnode *node) {
 			return 1;
 		}
 		if (node!=root) {
-			for (e=node->parents ; e ; e=e->nextparent) {
-				if (fsnodes_test_quota(e->parent)) {
+			for (e=fsedge_ptr(node->parents) ; e ; e=fsedge_ptr(e->nextparent)) {
+				if (fsnodes_test_quota(fsnode_ptr(e->parent))) {
 					return 1;
 				}
 			}
@@ -1159,8 +2237,8 @@ static inline void fsnodes_sub_stats(fsnode *parent,statsrecord *sr) {
 //			if (parent->data.ddata.hasquota) {
 //				fsnodes_check_quota_state(parent);
 //			}
-			for (e=parent->parents ; e ; e=e->nextparent) {
-				fsnodes_sub_stats(e->parent,sr);
+			for (e=fsedge_ptr(parent->parents) ; e ; e=fsedge_ptr(e->nextparent)) {
+				fsnodes_sub_stats(fsnode_ptr(e->parent),sr);
 			}
 		}
 	}
@@ -1182,8 +2260,8 @@ static inline void fsnodes_add_stats(fsnode *parent,statsrecord *sr) {
 //			if (parent->data.ddata.hasquota) {
 //				fsnodes_check_quota_state(parent);
 //			}
-			for (e=parent->parents ; e ; e=e->nextparent) {
-				fsnodes_add_stats(e->parent,sr);
+			for (e=fsedge_ptr(parent->parents) ; e ; e=fsedge_ptr(e->nextparent)) {
+				fsnodes_add_stats(fsnode_ptr(e->parent),sr);
 			}
 		}
 	}
@@ -1203,7 +2281,7 @@ static inline void fsnodes_add_sub_stats(fsnode *parent,statsrecord *newsr,stats
 
 #endif
 
-#ifndef METARESTORE
+#if !defined(METARESTORE) || defined(SHADOW)
 
 static inline void fsnodes_fill_attr(fsnode *node,fsnode *parent,uint32_t uid,uint32_t gid,uint32_t auid,uint32_t agid,uint8_t sesflags,uint8_t attr[35]) {
 	uint8_t *ptr;
@@ -1290,7 +2368,7 @@ static inline void fsnodes_fill_attr(fsnode *node,fsnode *parent,uint32_t uid,ui
 	put32bit(&ptr,node->mtime);
 	put32bit(&ptr,node->ctime);
 	nlink = 0;
-	for (e=node->parents ; e ; e=e->nextparent) {
+	for (e=fsedge_ptr(node->parents) ; e ; e=fsedge_ptr(e->nextparent)) {
 		nlink++;
 	}
 	switch (node->type) {
@@ -1302,7 +2380,11 @@ static inline void fsnodes_fill_attr(fsnode *node,fsnode *parent,uint32_t uid,ui
 		break;
 	case TYPE_DIRECTORY:
 		put32bit(&ptr,node->data.ddata.nlink);
+#ifdef METARESTORE
+		put64bit(&ptr,0);	// shadow master doesn't keep directory stats
+#else
 		put64bit(&ptr,node->data.ddata.stats->length>>30);	// Rescale length to GB (reduces size to 32-bit length)
+#endif
 		break;
 	case TYPE_SYMLINK:
 		put32bit(&ptr,nlink);
@@ -1408,10 +2490,10 @@ static inline void fsnodes_attr_changed_other_parents(fsnode *node,uint32_t pare
 	fsedge *e;
 	uint8_t attr[35];
 	if (fsnodes_attr_disable_test(node,ts)) {
-		for (e=node->parents ; e ; e=e->nextparent) {
-			if (e->parent && e->parent->id!=parent_to_ignore) {
-				fsnodes_fill_attr(node,e->parent,0,0,0,0,0,attr);
-				matoclserv_notify_attr(e->parent->id,node->id,attr);
+		for (e=fsedge_ptr(node->parents) ; e ; e=fsedge_ptr(e->nextparent)) {
+			if (e->parent && fsnode_ptr(e->parent)->id!=parent_to_ignore) {
+				fsnodes_fill_attr(node,fsnode_ptr(e->parent),0,0,0,0,0,attr);
+				matoclserv_notify_attr(fsnode_ptr(e->parent)->id,node->id,attr);
 			}
 		}
 	}
@@ -1421,10 +2503,10 @@ static inline void fsnodes_attr_changed(fsnode *node,uint32_t ts) {
 	fsedge *e;
 	uint8_t attr[35];
 	if (fsnodes_attr_disable_test(node,ts)) {
-		for (e=node->parents ; e ; e=e->nextparent) {
+		for (e=fsedge_ptr(node->parents) ; e ; e=fsedge_ptr(e->nextparent)) {
 			if (e->parent) {
-				fsnodes_fill_attr(node,e->parent,0,0,0,0,0,attr);
-				matoclserv_notify_attr(e->parent->id,node->id,attr);
+				fsnodes_fill_attr(node,fsnode_ptr(e->parent),0,0,0,0,0,attr);
+				matoclserv_notify_attr(fsnode_ptr(e->parent)->id,node->id,attr);
 			}
 		}
 		if (node->type==TYPE_DIRECTORY) {	// change '.' attributes
@@ -1438,10 +2520,10 @@ static inline void fsnodes_attr_access(fsnode *node,uint32_t ts) {
 	fsedge *e;
 	uint8_t attr[35];
 	if (fsnodes_attr_enable_test(node,ts)) {
-		for (e=node->parents ; e ; e=e->nextparent) {
+		for (e=fsedge_ptr(node->parents) ; e ; e=fsedge_ptr(e->nextparent)) {
 			if (e->parent) {
-				fsnodes_fill_attr(node,e->parent,0,0,0,0,0,attr);
-				matoclserv_notify_attr(e->parent->id,node->id,attr);
+				fsnodes_fill_attr(node,fsnode_ptr(e->parent),0,0,0,0,0,attr);
+				matoclserv_notify_attr(fsnode_ptr(e->parent)->id,node->id,attr);
 			}
 		}
 	}
@@ -1452,38 +2534,97 @@ static inline void fsnodes_attr_access(fsnode *node,uint32_t ts) {
 
 #endif /* METARESTORE */
 
+// edges are on two lists: children of parent directory (trash or reserved for edges without parent) and parents of child node
+static inline void fsnodes_childlist_add(uint32_t *head,fsedge *e) {
+	uint32_t eh = fsedge_handle(e);
+	e->nextchild = *head;
+	e->prevchild = 0;
+	if (e->nextchild) {
+		fsedge_ptr(e->nextchild)->prevchild = eh;
+	}
+	*head = eh;
+}
+
+static inline void fsnodes_childlist_remove(fsedge *e) {
+	fsnode *parent;
+	if (e->prevchild) {
+		fsedge_ptr(e->prevchild)->nextchild = e->nextchild;
+	} else {
+		parent = fsnode_ptr(e->parent);
+		if (parent) {
+			parent->data.ddata.children = e->nextchild;
+		} else if (trash==fsedge_handle(e)) {
+			trash = e->nextchild;
+		} else {
+			reserved = e->nextchild;
+		}
+	}
+	if (e->nextchild) {
+		fsedge_ptr(e->nextchild)->prevchild = e->prevchild;
+	}
+}
+
+static inline void fsnodes_parentlist_add(fsnode *child,fsedge *e) {
+	uint32_t eh = fsedge_handle(e);
+	e->nextparent = child->parents;
+	e->prevparent = 0;
+	if (e->nextparent) {
+		fsedge_ptr(e->nextparent)->prevparent = eh;
+	}
+	child->parents = eh;
+}
+
+static inline void fsnodes_parentlist_remove(fsedge *e) {
+	if (e->prevparent) {
+		fsedge_ptr(e->prevparent)->nextparent = e->nextparent;
+	} else {
+		fsnode_ptr(e->child)->parents = e->nextparent;
+	}
+	if (e->nextparent) {
+		fsedge_ptr(e->nextparent)->prevparent = e->prevparent;
+	}
+}
+
 static inline void fsnodes_remove_edge(uint32_t ts,fsedge *e) {
+	fsnode *parent,*child;
 #ifndef METARESTORE
 	statsrecord sr;
 #endif
-	if (e->parent) {
+#ifdef EDGEHASH
+	dirindex *di;
+#endif
+	parent = fsnode_ptr(e->parent);
+	child = fsnode_ptr(e->child);
+#ifdef EDGEHASH
+	di = (parent)?fsnodes_dirindex_get(parent):NULL;
+#endif
 #ifndef METARESTORE
-		fsnodes_get_stats(e->child,&sr);
-		fsnodes_sub_stats(e->parent,&sr);
+	if (parent) {
+		fsnodes_lazy_cover(parent);
+	}
 #endif
-		e->parent->mtime = e->parent->ctime = ts;
-		e->parent->data.ddata.elements--;
-		if (e->child->type==TYPE_DIRECTORY) {
-			e->parent->data.ddata.nlink--;
+	if (parent) {
+#ifndef METARESTORE
+		fsnodes_get_stats(child,&sr);
+		fsnodes_sub_stats(parent,&sr);
+#endif
+		parent->mtime = parent->ctime = ts;
+		parent->data.ddata.elements--;
+		if (child->type==TYPE_DIRECTORY) {
+			parent->data.ddata.nlink--;
 		}
 	}
-	if (e->child) {
-		e->child->ctime = ts;
-	}
-	*(e->prevchild) = e->nextchild;
-	if (e->nextchild) {
-		e->nextchild->prevchild = e->prevchild;
-	}
-	*(e->prevparent) = e->nextparent;
-	if (e->nextparent) {
-		e->nextparent->prevparent = e->prevparent;
+	if (child) {
+		child->ctime = ts;
 	}
+	fsnodes_childlist_remove(e);
+	fsnodes_parentlist_remove(e);
 #ifdef EDGEHASH
-	if (e->prev) {
-		*(e->prev) = e->next;
-		if (e->next) {
-			e->next->prev = e->prev;
-		}
+	if (di) {
+		fsnodes_dirindex_remove(di,e);
+		fsnodes_dirindex_check(parent,di);
+	} else {
+		fsnodes_edgehash_remove(e);
 	}
 #endif
 #ifndef METARESTORE
@@ -1500,12 +2641,14 @@ static inline void fsnodes_remove_edge(uint32_t ts,fsedge *e) {
 #endif
 */
 #endif
-	free(e->name);
-	free(e);
+	fsedge_free(e);
 }
 
 static inline void fsnodes_link(uint32_t ts,fsnode *parent,fsnode *child,uint16_t nleng,const uint8_t *name) {
 	fsedge *e;
+#ifdef EDGEHASH
+	dirindex *di;
+#endif
 #ifndef METARESTORE
 	statsrecord sr;
 /*
@@ -1513,45 +2656,33 @@ static inline void fsnodes_link(uint32_t ts,fsnode *parent,fsnode *child,uint16_
 	uint8_t attr[35];
 #endif
 */
+	fsnodes_lazy_open(parent);
+	fsnodes_lazy_cover(parent);
 #endif
+
+	e = fsedge_malloc(nleng);
+	memcpy(e->name,name,nleng);
+	e->child = fsnode_handle(child);
+	e->parent = fsnode_handle(parent);
+	fsnodes_childlist_add(&(parent->data.ddata.children),e);
+	fsnodes_parentlist_add(child,e);
 #ifdef EDGEHASH
-	uint32_t hpos;
-#endif
-
-	e = malloc(sizeof(fsedge));
-	passert(e);
-	e->nleng = nleng;
-	e->name = malloc(nleng);
-	passert(e->name);
-	memcpy(e->name,name,nleng);
-	e->child = child;
-	e->parent = parent;
-	e->nextchild = parent->data.ddata.children;
-	if (e->nextchild) {
-		e->nextchild->prevchild = &(e->nextchild);
-	}
-	parent->data.ddata.children = e;
-	e->prevchild = &(parent->data.ddata.children);
-	e->nextparent = child->parents;
-	if (e->nextparent) {
-		e->nextparent->prevparent = &(e->nextparent);
-	}
-	child->parents = e;
-	e->prevparent = &(child->parents);
-#ifdef EDGEHASH
-	hpos = EDGEHASHPOS(fsnodes_hash(parent->id,nleng,name));
-	e->next = edgehash[hpos];
-	if (e->next) {
-		e->next->prev = &(e->next);
-	}
-	edgehash[hpos] = e;
-	e->prev = &(edgehash[hpos]);
+	e->hash = fsnodes_hash(parent->id,nleng,name);
+	di = fsnodes_dirindex_get(parent);
+	if (di) {
+		fsnodes_dirindex_add(di,e);
+	} else {
+		fsnodes_edgehash_add(e);
+	}
 #endif
 
 	parent->data.ddata.elements++;
 	if (child->type==TYPE_DIRECTORY) {
 		parent->data.ddata.nlink++;
 	}
+#ifdef EDGEHASH
+	fsnodes_dirindex_check(parent,di);
+#endif
 #ifndef METARESTORE
 	fsnodes_get_stats(child,&sr);
 	fsnodes_add_stats(parent,&sr);
@@ -1581,10 +2712,10 @@ static inline fsnode* fsnodes_create_node(uint32_t ts,fsnode* node,uint16_t nlen
 	fsnode *p;
 #ifndef METARESTORE
 	statsrecord *sr;
+	fsnodes_lazy_open(node);
+	fsnodes_lazy_cover(node);
 #endif
-	uint32_t nodepos;
-	p = malloc(sizeof(fsnode));
-	passert(p);
+	p = fsnode_malloc();
 	nodes++;
 	if (type==TYPE_DIRECTORY) {
 		dirnodes++;
@@ -1634,7 +2765,7 @@ static inline fsnode* fsnodes_create_node(uint32_t ts,fsnode* node,uint16_t nlen
 		p->data.ddata.stats = sr;
 #endif
 		p->data.ddata.quota = NULL;
-		p->data.ddata.children = NULL;
+		p->data.ddata.children = 0;
 		p->data.ddata.nlink = 2;
 		p->data.ddata.elements = 0;
 		break;
@@ -1643,6 +2774,9 @@ static inline fsnode* fsnodes_create_node(uint32_t ts,fsnode* node,uint16_t nlen
 		p->data.fdata.chunks = 0;
 		p->data.fdata.chunktab = NULL;
 		p->data.fdata.sessionids = NULL;
+#ifndef METARESTORE
+		p->data.fdata.testflags = 0;
+#endif
 /*
 #ifdef CACHENOTIFY
 		p->data.fdata.lastattrchange = 0;
@@ -1672,7 +2806,7 @@ static inline fsnode* fsnodes_create_node(uint32_t ts,fsnode* node,uint16_t nlen
 #endif
 */
 	}
-	p->parents = NULL;
+	p->parents = 0;
 //	p->parents = malloc(sizeof(parent));
 //	passert(p->parents);
 //	p->parents->node = node;
@@ -1682,9 +2816,7 @@ static inline fsnode* fsnodes_create_node(uint32_t ts,fsnode* node,uint16_t nlen
 //		node->data.ddata.nlink++;
 //	}
 //	node->mtime = node->ctime = ts;
-	nodepos = NODEHASHPOS(p->id);
-	p->next = nodehash[nodepos];
-	nodehash[nodepos] = p;
+	fsnodes_nodehash_add(p);
 	fsnodes_link(ts,node,p,nleng,name);
 	return p;
 }
@@ -1692,20 +2824,22 @@ static inline fsnode* fsnodes_create_node(uint32_t ts,fsnode* node,uint16_t nlen
 static inline uint32_t fsnodes_getpath_size(fsedge *e) {
 	uint32_t size;
 	fsnode *p;
+	fsedge *pe;
 	if (e==NULL) {
 		return 0;
 	}
-	p = e->parent;
+	p = fsnode_ptr(e->parent);
 	size = e->nleng;
-	while (p!=root && p->parents) {
-		size += p->parents->nleng+1;
-		p = p->parents->parent;
+	while (p!=root && (pe=fsedge_ptr(p->parents))!=NULL) {
+		size += pe->nleng+1;
+		p = fsnode_ptr(pe->parent);
 	}
 	return size;
 }
 
 static inline void fsnodes_getpath_data(fsedge *e,uint8_t *path,uint32_t size) {
 	fsnode *p;
+	fsedge *pe;
 	if (e==NULL) {
 		return;
 	}
@@ -1719,19 +2853,19 @@ static inline void fsnodes_getpath_data(fsedge *e,uint8_t *path,uint32_t size) {
 	if (size>0) {
 		path[--size]='/';
 	}
-	p = e->parent;
-	while (p!=root && p->parents) {
-		if (size>=p->parents->nleng) {
-			size-=p->parents->nleng;
-			memcpy(path+size,p->parents->name,p->parents->nleng);
+	p = fsnode_ptr(e->parent);
+	while (p!=root && (pe=fsedge_ptr(p->parents))!=NULL) {
+		if (size>=pe->nleng) {
+			size-=pe->nleng;
+			memcpy(path+size,pe->name,pe->nleng);
 		} else if (size>0) {
-			memcpy(path,p->parents->name+(p->parents->nleng-size),size);
+			memcpy(path,pe->name+(pe->nleng-size),size);
 			size=0;
 		}
 		if (size>0) {
 			path[--size]='/';
 		}
-		p = p->parents->parent;
+		p = fsnode_ptr(pe->parent);
 	}
 }
 
@@ -1739,12 +2873,13 @@ static inline void fsnodes_getpath(fsedge *e,uint16_t *pleng,uint8_t **path) {
 	uint32_t size;
 	uint8_t *ret;
 	fsnode *p;
+	fsedge *pe;
 
-	p = e->parent;
+	p = fsnode_ptr(e->parent);
 	size = e->nleng;
-	while (p!=root && p->parents) {
-		size += p->parents->nleng+1;	// get first parent !!!
-		p = p->parents->parent;		// when folders can be hardlinked it's the only way to obtain path (one of them)
+	while (p!=root && (pe=fsedge_ptr(p->parents))!=NULL) {
+		size += pe->nleng+1;	// get first parent !!!
+		p = fsnode_ptr(pe->parent);		// when folders can be hardlinked it's the only way to obtain path (one of them)
 	}
 	if (size>65535) {
 		syslog(LOG_WARNING,"path too long !!! - truncate");
@@ -1758,27 +2893,27 @@ static inline void fsnodes_getpath(fsedge *e,uint16_t *pleng,uint8_t **path) {
 	if (size>0) {
 		ret[--size]='/';
 	}
-	p = e->parent;
-	while (p!=root && p->parents) {
-		if (size>=p->parents->nleng) {
-			size-=p->parents->nleng;
-			memcpy(ret+size,p->parents->name,p->parents->nleng);
+	p = fsnode_ptr(e->parent);
+	while (p!=root && (pe=fsedge_ptr(p->parents))!=NULL) {
+		if (size>=pe->nleng) {
+			size-=pe->nleng;
+			memcpy(ret+size,pe->name,pe->nleng);
 		} else {
 			if (size>0) {
-				memcpy(ret,p->parents->name+(p->parents->nleng-size),size);
+				memcpy(ret,pe->name+(pe->nleng-size),size);
 				size=0;
 			}
 		}
 		if (size>0) {
 			ret[--size]='/';
 		}
-		p = p->parents->parent;
+		p = fsnode_ptr(pe->parent);
 	}
 	*path = ret;
 }
 
 
-#ifndef METARESTORE
+#if !defined(METARESTORE) || defined(SHADOW)
 
 /*
 static inline void fsnodes_fill_attr(fsnode *node,fsnode *parent,uint32_t uid,uint32_t gid,uint8_t sesflags,uint8_t attr[35]) {
@@ -1862,7 +2997,7 @@ static inline void fsnodes_fill_attr(fsnode *node,fsnode *parent,uint32_t uid,ui
 static inline uint32_t fsnodes_getdetachedsize(fsedge *start) {
 	fsedge *e;
 	uint32_t result=0;
-	for (e = start ; e ; e=e->nextchild) {
+	for (e = start ; e ; e=fsedge_ptr(e->nextchild)) {
 		if (e->nleng>240) {
 			result+=245;
 		} else {
@@ -1876,7 +3011,7 @@ static inline void fsnodes_getdetacheddata(fsedge *start,uint8_t *dbuff) {
 	fsedge *e;
 	uint8_t *sptr;
 	uint8_t c;
-	for (e = start ; e ; e=e->nextchild) {
+	for (e = start ; e ; e=fsedge_ptr(e->nextchild)) {
 		if (e->nleng>240) {
 			*dbuff=240;
 			dbuff++;
@@ -1906,7 +3041,7 @@ static inline void fsnodes_getdetacheddata(fsedge *start,uint8_t *dbuff) {
 				dbuff++;
 			}
 		}
-		put32bit(&dbuff,e->child->id);
+		put32bit(&dbuff,fsnode_ptr(e->child)->id);
 	}
 }
 
@@ -1914,14 +3049,13 @@ static inline void fsnodes_getdetacheddata(fsedge *start,uint8_t *dbuff) {
 static inline uint32_t fsnodes_getdirsize(fsnode *p,uint8_t withattr) {
 	uint32_t result = ((withattr)?40:6)*2+3;	// for '.' and '..'
 	fsedge *e;
-	for (e = p->data.ddata.children ; e ; e=e->nextchild) {
+	for (e = fsedge_ptr(p->data.ddata.children) ; e ; e=fsedge_ptr(e->nextchild)) {
 		result+=((withattr)?40:6)+e->nleng;
 	}
 	return result;
 }
 
-static inline void fsnodes_getdirdata(uint32_t rootinode,uint32_t uid,uint32_t gid,uint32_t auid,uint32_t agid,uint8_t sesflags,fsnode *p,uint8_t *dbuff,uint8_t withattr) {
-	fsedge *e;
+static inline uint8_t* fsnodes_getdirdots(uint32_t rootinode,uint32_t uid,uint32_t gid,uint32_t auid,uint32_t agid,uint8_t sesflags,fsnode *p,uint8_t *dbuff,uint8_t withattr) {
 // '.' - self
 	dbuff[0]=1;
 	dbuff[1]='.';
@@ -1951,14 +3085,14 @@ static inline void fsnodes_getdirdata(uint32_t rootinode,uint32_t uid,uint32_t g
 			put8bit(&dbuff,TYPE_DIRECTORY);
 		}
 	} else {
-		if (p->parents && p->parents->parent->id!=rootinode) {
-			put32bit(&dbuff,p->parents->parent->id);
+		if (p->parents && fsnodes_getparent(p)->id!=rootinode) {
+			put32bit(&dbuff,fsnodes_getparent(p)->id);
 		} else {
 			put32bit(&dbuff,MFS_ROOT_ID);
 		}
 		if (withattr) {
 			if (p->parents) {
-				fsnodes_fill_attr(p->parents->parent,p,uid,gid,auid,agid,sesflags,dbuff);
+				fsnodes_fill_attr(fsnodes_getparent(p),p,uid,gid,auid,agid,sesflags,dbuff);
 			} else {
 				if (rootinode==MFS_ROOT_ID) {
 					fsnodes_fill_attr(root,p,uid,gid,auid,agid,sesflags,dbuff);
@@ -1976,22 +3110,123 @@ static inline void fsnodes_getdirdata(uint32_t rootinode,uint32_t uid,uint32_t g
 			put8bit(&dbuff,TYPE_DIRECTORY);
 		}
 	}
-// entries
-	for (e = p->data.ddata.children ; e ; e=e->nextchild) {
-		dbuff[0]=e->nleng;
-		dbuff++;
-		memcpy(dbuff,e->name,e->nleng);
-		dbuff+=e->nleng;
-		put32bit(&dbuff,e->child->id);
-		if (withattr) {
-			fsnodes_fill_attr(e->child,p,uid,gid,auid,agid,sesflags,dbuff);
-			dbuff+=35;
+	return dbuff;
+}
+
+static inline uint8_t* fsnodes_getdirentry(uint32_t uid,uint32_t gid,uint32_t auid,uint32_t agid,uint8_t sesflags,fsnode *p,fsedge *e,uint8_t *dbuff,uint8_t withattr) {
+	dbuff[0]=e->nleng;
+	dbuff++;
+	memcpy(dbuff,e->name,e->nleng);
+	dbuff+=e->nleng;
+	put32bit(&dbuff,fsnode_ptr(e->child)->id);
+	if (withattr) {
+		fsnodes_fill_attr(fsnode_ptr(e->child),p,uid,gid,auid,agid,sesflags,dbuff);
+		dbuff+=35;
+	} else {
+		put8bit(&dbuff,fsnode_ptr(e->child)->type);
+	}
+	return dbuff;
+}
+
+static inline void fsnodes_getdirdata(uint32_t rootinode,uint32_t uid,uint32_t gid,uint32_t auid,uint32_t agid,uint8_t sesflags,fsnode *p,uint8_t *dbuff,uint8_t withattr) {
+	fsedge *e;
+	dbuff = fsnodes_getdirdots(rootinode,uid,gid,auid,agid,sesflags,p,dbuff,withattr);
+	for (e = fsedge_ptr(p->data.ddata.children) ; e ; e=fsedge_ptr(e->nextchild)) {
+		dbuff = fsnodes_getdirentry(uid,gid,auid,agid,sesflags,p,e,dbuff,withattr);
+	}
+}
+
+/* paged directory reading (GETDIR_FLAG_PAGED):
+   cursor - (index generation << 32) + position of next entry in directory index, 0 - beginning of directory
+   only indexed directories are split into pages - smaller ones are always sent in one page
+   when index has been rebuilt between pages (generation mismatch) reading starts again from the beginning of index,
+   when index has been removed (directory shrank) rest of directory is sent in one page - in both cases without '.' and '..' */
+#define GETDIR_PAGE_ENTRIES 8192
+
+static struct {
+#ifdef EDGEHASH
+	dirindex *di;
+#endif
+	uint32_t startpos,endpos;
+	uint8_t dots;
+	uint64_t nextcursor;
+} getdirpage;
+
+static inline uint32_t fsnodes_getdirpagesize(fsnode *p,uint8_t withattr,uint64_t cursor) {
+	uint32_t result = 9;	// 0:8 nextcursor:64
+#ifdef EDGEHASH
+	dirindex *di;
+	fsedge *e;
+	uint32_t pos,cnt;
+
+	di = fsnodes_dirindex_get(p);
+	if (di==NULL) {
+		fsnodes_dirindex_check(p,NULL);	// huge directory not modified since metadata has been loaded
+		di = fsnodes_dirindex_get(p);
+	}
+	getdirpage.di = di;
+	if (di!=NULL) {
+		if ((cursor>>32)==di->gen) {
+			pos = cursor&0xFFFFFFFF;
+			getdirpage.dots = 0;
+		} else {
+			pos = 0;
+			getdirpage.dots = (cursor==0)?1:0;
+		}
+		if (getdirpage.dots) {
+			result += ((withattr)?40:6)*2+3;
+		}
+		getdirpage.startpos = pos;
+		for (cnt=0 ; cnt<GETDIR_PAGE_ENTRIES && (e=fsnodes_dirindex_iterate(di,&pos))!=NULL ; cnt++) {
+			result+=((withattr)?40:6)+e->nleng;
+			pos++;
+		}
+		getdirpage.endpos = pos;
+		if (cnt==GETDIR_PAGE_ENTRIES && fsnodes_dirindex_iterate(di,&pos)!=NULL) {
+			getdirpage.nextcursor = (((uint64_t)(di->gen))<<32) + getdirpage.endpos;
 		} else {
-			put8bit(&dbuff,e->child->type);
+			getdirpage.nextcursor = 0;
+		}
+		return result;
+	}
+#endif
+	getdirpage.dots = (cursor==0)?1:0;
+	getdirpage.nextcursor = 0;
+	return result + fsnodes_getdirsize(p,withattr) - ((getdirpage.dots)?0:((withattr)?40:6)*2+3);
+}
+
+// has to be called just after fsnodes_getdirpagesize
+static inline void fsnodes_getdirpagedata(uint32_t rootinode,uint32_t uid,uint32_t gid,uint32_t auid,uint32_t agid,uint8_t sesflags,fsnode *p,uint8_t *dbuff,uint8_t withattr) {
+	fsedge *e;
+#ifdef EDGEHASH
+	uint32_t pos;
+#endif
+	put8bit(&dbuff,0);
+	put64bit(&dbuff,getdirpage.nextcursor);
+#ifdef EDGEHASH
+	if (getdirpage.di!=NULL) {
+		if (getdirpage.dots) {
+			dbuff = fsnodes_getdirdots(rootinode,uid,gid,auid,agid,sesflags,p,dbuff,withattr);
+		}
+		pos = getdirpage.startpos;
+		while (pos<getdirpage.endpos && (e=fsnodes_dirindex_iterate(getdirpage.di,&pos))!=NULL && pos<getdirpage.endpos) {
+			dbuff = fsnodes_getdirentry(uid,gid,auid,agid,sesflags,p,e,dbuff,withattr);
+			pos++;
+		}
+		return;
+	}
+#endif
+	if (getdirpage.dots) {
+		fsnodes_getdirdata(rootinode,uid,gid,auid,agid,sesflags,p,dbuff,withattr);
+	} else {
+		for (e = fsedge_ptr(p->data.ddata.children) ; e ; e=fsedge_ptr(e->nextchild)) {
+			dbuff = fsnodes_getdirentry(uid,gid,auid,agid,sesflags,p,e,dbuff,withattr);
 		}
 	}
 }
+#endif
 
+#ifndef METARESTORE
 static inline void fsnodes_checkfile(fsnode *p,uint32_t chunkcount[11]) {
 	uint32_t i;
 	uint64_t chunkid;
@@ -2084,9 +3319,10 @@ static inline uint8_t fsnodes_appendchunks(uint32_t ts,fsnode *dstobj,fsnode *sr
 	}
 	dstobj->data.fdata.length = length;
 #ifndef METARESTORE
+	fsnodes_test_markdirty(dstobj);
 	fsnodes_get_stats(dstobj,&nsr);
-	for (e=dstobj->parents ; e ; e=e->nextparent) {
-		fsnodes_add_sub_stats(e->parent,&nsr,&psr);
+	for (e=fsedge_ptr(dstobj->parents) ; e ; e=fsedge_ptr(e->nextparent)) {
+		fsnodes_add_sub_stats(fsnode_ptr(e->parent),&nsr,&psr);
 	}
 #endif
 #ifdef METARESTORE
@@ -2122,8 +3358,8 @@ static inline void fsnodes_changefilegoal(fsnode *obj,uint8_t goal) {
 	fsnodes_get_stats(obj,&psr);
 	nsr = psr;
 	nsr.realsize = goal * nsr.size;
-	for (e=obj->parents ; e ; e=e->nextparent) {
-		fsnodes_add_sub_stats(e->parent,&nsr,&psr);
+	for (e=fsedge_ptr(obj->parents) ; e ; e=fsedge_ptr(e->nextparent)) {
+		fsnodes_add_sub_stats(fsnode_ptr(e->parent),&nsr,&psr);
 	}
 #endif
 	for (i=0 ; i<obj->data.fdata.chunks ; i++) {
@@ -2132,6 +3368,9 @@ static inline void fsnodes_changefilegoal(fsnode *obj,uint8_t goal) {
 		}
 	}
 	obj->goal = goal;
+#ifndef METARESTORE
+	fsnodes_test_markdirty(obj);
+#endif
 }
 
 static inline void fsnodes_setlength(fsnode *obj,uint64_t length) {
@@ -2178,35 +3417,32 @@ static inline void fsnodes_setlength(fsnode *obj,uint64_t length) {
 		}
 	}
 #ifndef METARESTORE
+	fsnodes_test_markdirty(obj);
 	fsnodes_get_stats(obj,&nsr);
-	for (e=obj->parents ; e ; e=e->nextparent) {
-		fsnodes_add_sub_stats(e->parent,&nsr,&psr);
+	for (e=fsedge_ptr(obj->parents) ; e ; e=fsedge_ptr(e->nextparent)) {
+		fsnodes_add_sub_stats(fsnode_ptr(e->parent),&nsr,&psr);
 	}
 #endif
 }
 
 
 static inline void fsnodes_remove_node(uint32_t ts,fsnode *toremove) {
-	uint32_t nodepos;
-	fsnode **ptr;
-	if (toremove->parents!=NULL) {
+	if (toremove->parents!=0) {
 		return;
 	}
 // remove from idhash
-	nodepos = NODEHASHPOS(toremove->id);
-	ptr = &(nodehash[nodepos]);
-	while (*ptr) {
-		if (*ptr==toremove) {
-			*ptr=toremove->next;
-			break;
-		}
-		ptr = &((*ptr)->next);
-	}
+	fsnodes_nodehash_remove(toremove);
 // and free
 	nodes--;
 	if (toremove->type==TYPE_DIRECTORY) {
 		dirnodes--;
+		if (lazysnapcount>0) {
+			fsnodes_lazy_forget(toremove);
+		}
 		fsnodes_delete_quotanode(toremove);
+#ifdef EDGEHASH
+		fsnodes_dirindex_free(toremove);
+#endif
 #ifndef METARESTORE
 		free(toremove->data.ddata.stats);
 /*
@@ -2220,6 +3456,9 @@ static inline void fsnodes_remove_node(uint32_t ts,fsnode *toremove) {
 		uint32_t i;
 		uint64_t chunkid;
 		filenodes--;
+#ifndef METARESTORE
+		fsnodes_test_setstate(toremove,0);
+#endif
 		for (i=0 ; i<toremove->data.fdata.chunks ; i++) {
 			chunkid = toremove->data.fdata.chunktab[i];
 			if (chunkid>0) {
@@ -2240,69 +3479,175 @@ static inline void fsnodes_remove_node(uint32_t ts,fsnode *toremove) {
 #ifndef METARESTORE
 	dcm_modify(toremove->id,0);
 #endif
-	free(toremove);
+	fsnode_free(toremove);
+}
+
+
+/* purge index - trash files ordered by expiration time and reserved files without sessions ordered by inode
+   entries are 64-bit keys in binary min-heaps: trash: (deadline<<32)|inode ; reserved: inode
+   deadline = max(atime,mtime,ctime)+trashtime (saturated to 32 bits - such files never expire anyway)
+   entries are validated lazily: entries of nodes which left trash (or got sessions again) are dropped when popped
+   and entries with too low deadline are moved forward, so every trash node needs at least one entry with
+   deadline not greater than its real one (fsnodes_trash_queue has to be called when deadline can decrease).
+   in effect files are always purged in (deadline,inode) order, which doesn't depend on history, so
+   mfsmetarestore (which uses the same index) purges exactly the same files as the master did */
+
+typedef struct _purgeheap {
+	uint64_t *keys;
+	uint32_t elements;
+	uint32_t size;
+} purgeheap;
+
+#define PURGEHEAP_SLACK 4096
+
+static purgeheap trashheap,reservedheap;
+
+static inline void fsnodes_purgeheap_siftdown(purgeheap *h,uint32_t pos) {
+	uint32_t l,m;
+	uint64_t key = h->keys[pos];
+	for (;;) {
+		l = pos*2+1;
+		if (l>=h->elements) {
+			break;
+		}
+		m = (l+1<h->elements && h->keys[l+1]<h->keys[l])?l+1:l;
+		if (h->keys[m]>=key) {
+			break;
+		}
+		h->keys[pos] = h->keys[m];
+		pos = m;
+	}
+	h->keys[pos] = key;
+}
+
+// adds key at the end - heap order has to be restored by fsnodes_purgeheap_heapify
+static inline void fsnodes_purgeheap_append(purgeheap *h,uint64_t key) {
+	if (h->elements>=h->size) {
+		h->size = (h->size==0)?1024:h->size*2;
+		h->keys = realloc(h->keys,sizeof(uint64_t)*h->size);
+		passert(h->keys);
+	}
+	h->keys[h->elements++] = key;
+}
+
+static inline void fsnodes_purgeheap_push(purgeheap *h,uint64_t key) {
+	uint32_t pos,p;
+	fsnodes_purgeheap_append(h,key);
+	pos = h->elements-1;
+	while (pos>0) {
+		p = (pos-1)/2;
+		if (h->keys[p]<=key) {
+			break;
+		}
+		h->keys[pos] = h->keys[p];
+		pos = p;
+	}
+	h->keys[pos] = key;
+}
+
+static inline void fsnodes_purgeheap_pop(purgeheap *h) {
+	h->elements--;
+	if (h->elements>0) {
+		h->keys[0] = h->keys[h->elements];
+		fsnodes_purgeheap_siftdown(h,0);
+	}
+}
+
+static inline void fsnodes_purgeheap_replacetop(purgeheap *h,uint64_t key) {
+	h->keys[0] = key;
+	fsnodes_purgeheap_siftdown(h,0);
+}
+
+static inline void fsnodes_purgeheap_heapify(purgeheap *h) {
+	uint32_t i;
+	for (i=h->elements/2 ; i>0 ; i--) {
+		fsnodes_purgeheap_siftdown(h,i-1);
+	}
+}
+
+static inline uint64_t fsnodes_trash_key(fsnode *p) {
+	uint64_t dl;
+	dl = p->atime;
+	if (p->mtime>dl) {
+		dl = p->mtime;
+	}
+	if (p->ctime>dl) {
+		dl = p->ctime;
+	}
+	dl += p->trashtime;
+	if (dl>UINT64_C(0xFFFFFFFF)) {
+		dl = UINT64_C(0xFFFFFFFF);
+	}
+	return (dl<<32) | p->id;
+}
+
+static inline void fsnodes_trash_queue(fsnode *p) {
+	fsnodes_purgeheap_push(&trashheap,fsnodes_trash_key(p));
 }
 
+static inline void fsnodes_reserved_queue(fsnode *p) {
+	fsnodes_purgeheap_push(&reservedheap,p->id);
+}
+
+static void fsnodes_purgeindex_rebuild(uint8_t trashonly) {
+	fsedge *e;
+	trashheap.elements = 0;
+	for (e=fsedge_ptr(trash) ; e ; e=fsedge_ptr(e->nextchild)) {
+		fsnodes_purgeheap_append(&trashheap,fsnodes_trash_key(fsnode_ptr(e->child)));
+	}
+	fsnodes_purgeheap_heapify(&trashheap);
+	if (trashonly) {
+		return;
+	}
+	reservedheap.elements = 0;
+	for (e=fsedge_ptr(reserved) ; e ; e=fsedge_ptr(e->nextchild)) {
+		if (fsnode_ptr(e->child)->data.fdata.sessionids==NULL) {
+			fsnodes_purgeheap_append(&reservedheap,fsnode_ptr(e->child)->id);
+		}
+	}
+	fsnodes_purgeheap_heapify(&reservedheap);
+}
 
 static inline void fsnodes_unlink(uint32_t ts,fsedge *e) {
 	fsnode *child;
 	uint16_t pleng=0;
 	uint8_t *path=NULL;
 
-	child = e->child;
-	if (child->parents->nextparent==NULL) { // last link
+	child = fsnode_ptr(e->child);
+	if (fsedge_ptr(child->parents)->nextparent==0) { // last link
 		if (child->type==TYPE_FILE && (child->trashtime>0 || child->data.fdata.sessionids!=NULL)) {	// go to trash or reserved ? - get path
 			fsnodes_getpath(e,&pleng,&path);
 		}
 	}
 	fsnodes_remove_edge(ts,e);
-	if (child->parents==NULL) {	// last link
+	if (child->parents==0) {	// last link
 		if (child->type == TYPE_FILE) {
 			if (child->trashtime>0) {
 				child->type = TYPE_TRASH;
 				child->ctime = ts;
-				e = malloc(sizeof(fsedge));
-				passert(e);
-				e->nleng = pleng;
-				e->name = path;
-				e->child = child;
-				e->parent = NULL;
-				e->nextchild = trash;
-				e->nextparent = NULL;
-				e->prevchild = &trash;
-				e->prevparent = &(child->parents);
-				if (e->nextchild) {
-					e->nextchild->prevchild = &(e->nextchild);
-				}
+				e = fsedge_malloc_withname(pleng,path);
+				e->child = fsnode_handle(child);
+				e->parent = 0;
+				fsnodes_childlist_add(&trash,e);
+				fsnodes_parentlist_add(child,e);
 #ifdef EDGEHASH
-				e->next = NULL;
-				e->prev = NULL;
+				e->next = 0;
+				e->prev = 0;
 #endif
-				trash = e;
-				child->parents = e;
 				trashspace += child->data.fdata.length;
 				trashnodes++;
+				fsnodes_trash_queue(child);
 			} else if (child->data.fdata.sessionids!=NULL) {
 				child->type = TYPE_RESERVED;
-				e = malloc(sizeof(fsedge));
-				passert(e);
-				e->nleng = pleng;
-				e->name = path;
-				e->child = child;
-				e->parent = NULL;
-				e->nextchild = reserved;
-				e->nextparent = NULL;
-				e->prevchild = &reserved;
-				e->prevparent = &(child->parents);
-				if (e->nextchild) {
-					e->nextchild->prevchild = &(e->nextchild);
-				}
+				e = fsedge_malloc_withname(pleng,path);
+				e->child = fsnode_handle(child);
+				e->parent = 0;
+				fsnodes_childlist_add(&reserved,e);
+				fsnodes_parentlist_add(child,e);
 #ifdef EDGEHASH
-				e->next = NULL;
-				e->prev = NULL;
+				e->next = 0;
+				e->prev = 0;
 #endif
-				reserved = e;
-				child->parents = e;
 				reservedspace += child->data.fdata.length;
 				reservednodes++;
 			} else {
@@ -2324,7 +3669,7 @@ static inline void fsnodes_unlink(uint32_t ts,fsedge *e) {
 
 static inline int fsnodes_purge(uint32_t ts,fsnode *p) {
 	fsedge *e;
-	e = p->parents;
+	e = fsedge_ptr(p->parents);
 
 	if (p->type==TYPE_TRASH) {
 		trashspace -= p->data.fdata.length;
@@ -2333,16 +3678,8 @@ static inline int fsnodes_purge(uint32_t ts,fsnode *p) {
 			p->type = TYPE_RESERVED;
 			reservedspace += p->data.fdata.length;
 			reservednodes++;
-			*(e->prevchild) = e->nextchild;
-			if (e->nextchild) {
-				e->nextchild->prevchild = e->prevchild;
-			}
-			e->nextchild = reserved;
-			e->prevchild = &(reserved);
-			if (e->nextchild) {
-				e->nextchild->prevchild = &(e->nextchild);
-			}
-			reserved = e;
+			fsnodes_childlist_remove(e);
+			fsnodes_childlist_add(&reserved,e);
 			return 0;
 		} else {
 			fsnodes_remove_edge(ts,e);
@@ -2368,7 +3705,7 @@ static inline uint8_t fsnodes_undel(uint32_t ts,fsnode *node) {
 	fsnode *p,*n;
 
 /* check path */
-	e = node->parents;
+	e = fsedge_ptr(node->parents);
 	pleng = e->nleng;
 	path = e->name;
 
@@ -2445,7 +3782,7 @@ static inline uint8_t fsnodes_undel(uint32_t ts,fsnode *node) {
 				if (pe==NULL) {
 					new=1;
 				} else {
-					n = pe->child;
+					n = fsnode_ptr(pe->child);
 					if (n->type!=TYPE_DIRECTORY) {
 						return ERROR_CANTCREATEPATH;
 					}
@@ -2583,8 +3920,8 @@ static inline void fsnodes_getgoal_recursive(fsnode *node,uint8_t gmode,uint32_t
 		}
 		dgtab[node->goal]++;
 		if (gmode==GMODE_RECURSIVE) {
-			for (e = node->data.ddata.children ; e ; e=e->nextchild) {
-				fsnodes_getgoal_recursive(e->child,gmode,fgtab,dgtab);
+			for (e = fsedge_ptr(fsnodes_lazy_resolve(node)->data.ddata.children) ; e ; e=fsedge_ptr(e->nextchild)) {
+				fsnodes_getgoal_recursive(fsnode_ptr(e->child),gmode,fgtab,dgtab);
 			}
 		}
 	}
@@ -2642,8 +3979,8 @@ static inline void fsnodes_gettrashtime_recursive(fsnode *node,uint8_t gmode,bst
 	} else if (node->type==TYPE_DIRECTORY) {
 		fsnodes_bst_add(bstrootdirs,node->trashtime);
 		if (gmode==GMODE_RECURSIVE) {
-			for (e = node->data.ddata.children ; e ; e=e->nextchild) {
-				fsnodes_gettrashtime_recursive(e->child,gmode,bstrootfiles,bstrootdirs);
+			for (e = fsedge_ptr(fsnodes_lazy_resolve(node)->data.ddata.children) ; e ; e=fsedge_ptr(e->nextchild)) {
+				fsnodes_gettrashtime_recursive(fsnode_ptr(e->child),gmode,bstrootfiles,bstrootdirs);
 			}
 		}
 	}
@@ -2657,8 +3994,8 @@ static inline void fsnodes_geteattr_recursive(fsnode *node,uint8_t gmode,uint32_
 	} else {
 		deattrtab[(node->mode>>12)]++;
 		if (gmode==GMODE_RECURSIVE) {
-			for (e = node->data.ddata.children ; e ; e=e->nextchild) {
-				fsnodes_geteattr_recursive(e->child,gmode,feattrtab,deattrtab);
+			for (e = fsedge_ptr(fsnodes_lazy_resolve(node)->data.ddata.children) ; e ; e=fsedge_ptr(e->nextchild)) {
+				fsnodes_geteattr_recursive(fsnode_ptr(e->child),gmode,feattrtab,deattrtab);
 			}
 		}
 	}
@@ -2674,6 +4011,9 @@ static inline void fsnodes_setgoal_recursive(fsnode *node,uint32_t ts,uint32_t u
 	fsedge *e;
 	uint8_t set;
 
+#ifndef METARESTORE
+	fsnodes_lazy_visit(node,smode);
+#endif
 	if (node->type==TYPE_FILE || node->type==TYPE_DIRECTORY || node->type==TYPE_TRASH || node->type==TYPE_RESERVED) {
 		if ((node->mode&(EATTR_NOOWNER<<12))==0 && uid!=0 && node->uid!=uid) {
 			(*nsinodes)++;
@@ -2730,11 +4070,11 @@ static inline void fsnodes_setgoal_recursive(fsnode *node,uint32_t ts,uint32_t u
 				quota=1;
 			}
 #endif
-			for (e = node->data.ddata.children ; e ; e=e->nextchild) {
+			for (e = fsedge_ptr(node->data.ddata.children) ; e ; e=fsedge_ptr(e->nextchild)) {
 #if VERSHEX>=0x010700
-				fsnodes_setgoal_recursive(e->child,ts,uid,quota,goal,smode,sinodes,ncinodes,nsinodes,qeinodes);
+				fsnodes_setgoal_recursive(fsnode_ptr(e->child),ts,uid,quota,goal,smode,sinodes,ncinodes,nsinodes,qeinodes);
 #else
-				fsnodes_setgoal_recursive(e->child,ts,uid,goal,smode,sinodes,ncinodes,nsinodes);
+				fsnodes_setgoal_recursive(fsnode_ptr(e->child),ts,uid,goal,smode,sinodes,ncinodes,nsinodes);
 #endif
 			}
 		}
@@ -2745,6 +4085,9 @@ static inline void fsnodes_settrashtime_recursive(fsnode *node,uint32_t ts,uint3
 	fsedge *e;
 	uint8_t set;
 
+#ifndef METARESTORE
+	fsnodes_lazy_visit(node,smode);
+#endif
 	if (node->type==TYPE_FILE || node->type==TYPE_DIRECTORY || node->type==TYPE_TRASH || node->type==TYPE_RESERVED) {
 		if ((node->mode&(EATTR_NOOWNER<<12))==0 && uid!=0 && node->uid!=uid) {
 			(*nsinodes)++;
@@ -2773,6 +4116,9 @@ static inline void fsnodes_settrashtime_recursive(fsnode *node,uint32_t ts,uint3
 			if (set) {
 				(*sinodes)++;
 				node->ctime = ts;
+				if (node->type==TYPE_TRASH) {	// deadline could be decreased
+					fsnodes_trash_queue(node);
+				}
 /*
 #ifndef METARESTORE
 #ifdef CACHENOTIFY
@@ -2785,8 +4131,8 @@ static inline void fsnodes_settrashtime_recursive(fsnode *node,uint32_t ts,uint3
 			}
 		}
 		if (node->type==TYPE_DIRECTORY && (smode&SMODE_RMASK)) {
-			for (e = node->data.ddata.children ; e ; e=e->nextchild) {
-				fsnodes_settrashtime_recursive(e->child,ts,uid,trashtime,smode,sinodes,ncinodes,nsinodes);
+			for (e = fsedge_ptr(node->data.ddata.children) ; e ; e=fsedge_ptr(e->nextchild)) {
+				fsnodes_settrashtime_recursive(fsnode_ptr(e->child),ts,uid,trashtime,smode,sinodes,ncinodes,nsinodes);
 			}
 		}
 	}
@@ -2796,6 +4142,9 @@ static inline void fsnodes_seteattr_recursive(fsnode *node,uint32_t ts,uint32_t
 	fsedge *e;
 	uint8_t neweattr,seattr;
 
+#ifndef METARESTORE
+	fsnodes_lazy_visit(node,smode);
+#endif
 	if ((node->mode&(EATTR_NOOWNER<<12))==0 && uid!=0 && node->uid!=uid) {
 		(*nsinodes)++;
 	} else {
@@ -2832,22 +4181,271 @@ static inline void fsnodes_seteattr_recursive(fsnode *node,uint32_t ts,uint32_t
 		}
 	}
 	if (node->type==TYPE_DIRECTORY && (smode&SMODE_RMASK)) {
-		for (e = node->data.ddata.children ; e ; e=e->nextchild) {
-			fsnodes_seteattr_recursive(e->child,ts,uid,eattr,smode,sinodes,ncinodes,nsinodes);
+		for (e = fsedge_ptr(node->data.ddata.children) ; e ; e=fsedge_ptr(e->nextchild)) {
+			fsnodes_seteattr_recursive(fsnode_ptr(e->child),ts,uid,eattr,smode,sinodes,ncinodes,nsinodes);
 		}
 	}
 }
 
-static inline void fsnodes_snapshot(uint32_t ts,fsnode *srcnode,fsnode *parentnode,uint32_t nleng,const uint8_t *name) {
+/* recursive setgoal/settrashtime/seteattr on big trees is done by background jobs in parts:
+   part - directory itself (only in part starting at 0) and its non directory children with mixed name hash in [hfrom,hto]
+   (subdirectories are queued by job and processed later as separate directories) ; every part is logged as separate
+   changelog entry (SETGOALPART,SETTRASHTIMEPART,SETEATTRPART) - result depends only on current tree, so replaying
+   changelog gives the same result regardless of operations done between parts */
+enum {FSJOB_SETGOAL,FSJOB_SETTRASHTIME,FSJOB_SETEATTR};
+
+static inline void fsnodes_setattr_node(uint8_t type,fsnode *node,uint32_t ts,uint32_t uid,uint8_t quota,uint32_t value,uint8_t smode,uint32_t cnt[4]) {
+	smode &= SMODE_TMASK;
+	switch (type) {
+	case FSJOB_SETGOAL:
+#if VERSHEX>=0x010700
+		fsnodes_setgoal_recursive(node,ts,uid,quota,value,smode,cnt,cnt+1,cnt+2,cnt+3);
+#else
+		(void)quota;
+		fsnodes_setgoal_recursive(node,ts,uid,value,smode,cnt,cnt+1,cnt+2);
+#endif
+		break;
+	case FSJOB_SETTRASHTIME:
+		fsnodes_settrashtime_recursive(node,ts,uid,value,smode,cnt,cnt+1,cnt+2);
+		break;
+	case FSJOB_SETEATTR:
+		fsnodes_seteattr_recursive(node,ts,uid,value,smode,cnt,cnt+1,cnt+2);
+		break;
+	}
+}
+
+static inline uint32_t fsnodes_edge_parthash(fsedge *e) {
+#ifdef EDGEHASH
+	return fsnodes_hashmix(e->hash);
+#else
+	uint32_t hash,i;
+	hash = ((fsnode_ptr(e->parent)->id * 0x5F2318BD) + e->nleng);
+	for (i=0 ; i<e->nleng ; i++) {
+		hash = hash*33+e->name[i];
+	}
+	return hash*0x9E3779B1;
+#endif
+}
+
+static inline uint32_t fsnodes_setattr_edge(uint8_t type,fsedge *e,uint32_t ts,uint32_t uid,uint8_t quota,uint32_t value,uint8_t smode,uint32_t hfrom,uint32_t hto,uint32_t cnt[4],void (*adddir)(void*,fsnode*),void *arg) {
+	uint32_t h;
+	h = fsnodes_edge_parthash(e);
+	if (h<hfrom || h>hto) {
+		return 0;
+	}
+	if (fsnode_ptr(e->child)->type==TYPE_DIRECTORY) {
+		if (adddir) {
+			adddir(arg,fsnode_ptr(e->child));
+		}
+	} else {
+		fsnodes_setattr_node(type,fsnode_ptr(e->child),ts,uid,quota,value,smode,cnt);
+	}
+	return 1;
+}
+
+// returns number of visited entries
+static uint32_t fsnodes_setattr_part(uint8_t type,fsnode *dir,uint32_t ts,uint32_t uid,uint32_t value,uint8_t smode,uint32_t hfrom,uint32_t hto,uint32_t cnt[4],void (*adddir)(void*,fsnode*),void *arg) {
 	fsedge *e;
-	fsnode *dstnode;
+	uint32_t visited;
+	uint8_t quota;
+#ifdef EDGEHASH
+	dirindex *di;
+	uint32_t i,first,last,mask;
+	uint8_t after;
+#endif
+
+#ifndef METARESTORE
+	fsnodes_lazy_cover(dir);
+	fsnodes_lazy_open(dir);
+#endif
+	visited = 1;
+#if VERSHEX>=0x010700
+	quota = (type==FSJOB_SETGOAL)?fsnodes_test_quota(dir):0;
+#else
+	quota = 0;
+#endif
+	if (hfrom==0) {
+		fsnodes_setattr_node(type,dir,ts,uid,quota,value,smode,cnt);
+	}
+#ifdef EDGEHASH
+	di = fsnodes_dirindex_get(dir);
+	if (di!=NULL) {
+		// entries with home slot in range (linear probing moves entries only forward, so cluster after last slot has to be checked too)
+		mask = di->slotssize-1;
+		first = hfrom>>di->shift;
+		last = hto>>di->shift;
+		after = 0;
+		i = first;
+		for (;;) {
+			e = di->slots[i].e;
+			if (e!=NULL) {
+				visited += fsnodes_setattr_edge(type,e,ts,uid,quota,value,smode,hfrom,hto,cnt,adddir,arg);
+			} else if (after) {
+				break;
+			}
+			if (i==last) {
+				after = 1;
+			}
+			i = (i+1)&mask;
+			if (i==first) {
+				break;
+			}
+		}
+		return visited;
+	}
+#endif
+	for (e=fsedge_ptr(dir->data.ddata.children) ; e ; e=fsedge_ptr(e->nextchild)) {
+		visited += fsnodes_setattr_edge(type,e,ts,uid,quota,value,smode,hfrom,hto,cnt,adddir,arg);
+	}
+	return visited;
+}
+
+static void fsnodes_snapshot(uint32_t ts,fsnode *srcnode,fsnode *parentnode,uint32_t nleng,const uint8_t *name,uint8_t lazy);
+
+static inline void fsnodes_lazy_register(uint32_t dstid,uint32_t srcid,uint32_t ts) {
+	lazysnap *ls;
+	uint32_t hpos;
+	ls = malloc(sizeof(lazysnap));
+	passert(ls);
+	ls->dstid = dstid;
+	ls->srcid = srcid;
+	ls->ts = ts;
+	ls->pending = 0;
+	hpos = LAZYSNAP_HASHPOS(dstid);
+	ls->dstnext = lazydsthash[hpos];
+	lazydsthash[hpos] = ls;
+	hpos = LAZYSNAP_HASHPOS(srcid);
+	ls->srcnext = lazysrchash[hpos];
+	lazysrchash[hpos] = ls;
+	lazysnapcount++;
+}
+
+static inline void fsnodes_lazy_unregister(lazysnap *ls) {
+	lazysnap **lsp;
+	lsp = lazydsthash + LAZYSNAP_HASHPOS(ls->dstid);
+	while (*lsp!=ls) {
+		lsp = &((*lsp)->dstnext);
+	}
+	*lsp = ls->dstnext;
+	lsp = lazysrchash + LAZYSNAP_HASHPOS(ls->srcid);
+	while (*lsp!=ls) {
+		lsp = &((*lsp)->srcnext);
+	}
+	*lsp = ls->srcnext;
+	free(ls);
+	lazysnapcount--;
+}
+
+// makes new (empty) directory 'dst' a placeholder of non empty directory 'src'
+static inline void fsnodes_lazy_add(fsnode *dst,fsnode *src,uint32_t ts) {
+#ifndef METARESTORE
+	statsrecord sr;
+#endif
+	fsnodes_lazy_register(dst->id,src->id,ts);
+	dst->data.ddata.nlink = src->data.ddata.nlink;
+#ifndef METARESTORE
+	sr = *(src->data.ddata.stats);
+	fsnodes_add_stats(dst,&sr);
+#endif
+}
+
+// copies children of source directory into placeholder - returns number of copied objects
+static uint32_t fsnodes_lazy_materialize(fsnode *dir,lazysnap *ls) {
+	fsnode *src;
+	fsedge *e;
+	uint32_t ts,mtime,ctime,cnt;
+#ifndef METARESTORE
+	statsrecord sr;
+#endif
+	src = fsnodes_id_to_node(ls->srcid);
+	ts = ls->ts;
+	fsnodes_lazy_unregister(ls);
+#ifndef METARESTORE
+	sr = *(dir->data.ddata.stats);
+	fsnodes_sub_stats(dir,&sr);
+#endif
+	dir->data.ddata.nlink = 2;
+	cnt = 0;
+	if (src==NULL) {
+		return 0;
+	}
+	mtime = dir->mtime;
+	ctime = dir->ctime;
+	lazysuppress++;
+	for (e=fsedge_ptr(src->data.ddata.children) ; e ; e=fsedge_ptr(e->nextchild)) {
+		fsnodes_snapshot(ts,fsnode_ptr(e->child),dir,e->nleng,e->name,1);
+		cnt++;
+	}
+	lazysuppress--;
+	dir->mtime = mtime;
+	dir->ctime = ctime;
+	return cnt;
+}
+
+// called before directory is removed
+static void fsnodes_lazy_forget(fsnode *dir) {
+	lazysnap *ls;
+	if ((ls=fsnodes_lazy_find(dir->id))!=NULL) {
+		fsnodes_lazy_unregister(ls);
+	}
+	while ((ls=fsnodes_lazy_findsrc(dir->id))!=NULL) {	// shouldn't happen - source is covered before any change
+		syslog(LOG_WARNING,"lazy snapshot structure error - source directory %"PRIu32" removed before placeholder %"PRIu32,ls->srcid,ls->dstid);
+		fsnodes_lazy_unregister(ls);
+	}
+}
+
+#ifndef METARESTORE
+static void fsnodes_lazy_domaterialize(fsnode *dir,lazysnap *ls) {
+	uint32_t cnt;
+	cnt = fsnodes_lazy_materialize(dir,ls);
+	changelog(metaversion++,(uint32_t)main_time(),CLOP_MATERIALIZE,dir->id,cnt);
+}
+
+static void fsnodes_lazy_opendir(fsnode *dir) {
+	lazysnap *ls;
+	if (dir->type==TYPE_DIRECTORY && (ls=fsnodes_lazy_find(dir->id))!=NULL) {
+		fsnodes_lazy_domaterialize(dir,ls);
+	}
+}
+
+// materializes placeholders of given directory
+static void fsnodes_lazy_releasedir(fsnode *dir) {
+	fsnode *p;
+	lazysnap *ls;
+	while ((ls=fsnodes_lazy_findsrc(dir->id))!=NULL) {
+		p = fsnodes_id_to_node(ls->dstid);
+		if (p==NULL) {
+			fsnodes_lazy_unregister(ls);
+		} else {
+			fsnodes_lazy_domaterialize(p,ls);
+		}
+	}
+}
+
+// materializes (top-down) all placeholders which show given directory
+static void fsnodes_lazy_coverdir(fsnode *dir) {
+	fsedge *e;
+	if (dir==NULL) {
+		return;
+	}
+	for (e=fsedge_ptr(dir->parents) ; e ; e=fsedge_ptr(e->nextparent)) {
+		fsnodes_lazy_coverdir(fsnode_ptr(e->parent));
+	}
+	fsnodes_lazy_releasedir(dir);
+}
+#endif
+
+static void fsnodes_snapshot(uint32_t ts,fsnode *srcnode,fsnode *parentnode,uint32_t nleng,const uint8_t *name,uint8_t lazy) {
+	fsedge *e;
+	fsnode *dstnode,*contents;
 	uint32_t i;
 	uint64_t chunkid;
 	if ((e=fsnodes_lookup(parentnode,nleng,name))) {
-		dstnode = e->child;
+		dstnode = fsnode_ptr(e->child);
 		if (srcnode->type==TYPE_DIRECTORY) {
-			for (e = srcnode->data.ddata.children ; e ; e=e->nextchild) {
-				fsnodes_snapshot(ts,e->child,dstnode,e->nleng,e->name);
+			contents = fsnodes_lazy_resolve(srcnode);
+			for (e = fsedge_ptr(contents->data.ddata.children) ; e ; e=fsedge_ptr(e->nextchild)) {
+				fsnodes_snapshot(ts,fsnode_ptr(e->child),dstnode,e->nleng,e->name,lazy);
 			}
 		} else if (srcnode->type==TYPE_FILE) {
 			uint8_t same;
@@ -2894,6 +4492,7 @@ static inline void fsnodes_snapshot(uint32_t ts,fsnode *srcnode,fsnode *parentno
 				}
 				dstnode->data.fdata.length = srcnode->data.fdata.length;
 #ifndef METARESTORE
+				fsnodes_test_markdirty(dstnode);
 				fsnodes_get_stats(dstnode,&nsr);
 				fsnodes_add_sub_stats(parentnode,&nsr,&psr);
 /*
@@ -2957,8 +4556,13 @@ static inline void fsnodes_snapshot(uint32_t ts,fsnode *srcnode,fsnode *parentno
 			dstnode->atime = srcnode->atime;
 			dstnode->mtime = srcnode->mtime;
 			if (srcnode->type==TYPE_DIRECTORY) {
-				for (e = srcnode->data.ddata.children ; e ; e=e->nextchild) {
-					fsnodes_snapshot(ts,e->child,dstnode,e->nleng,e->name);
+				contents = fsnodes_lazy_resolve(srcnode);
+				if (lazy && contents->data.ddata.children!=0) {
+					fsnodes_lazy_add(dstnode,contents,ts);
+				} else {
+					for (e = fsedge_ptr(contents->data.ddata.children) ; e ; e=fsedge_ptr(e->nextchild)) {
+						fsnodes_snapshot(ts,fsnode_ptr(e->child),dstnode,e->nleng,e->name,lazy);
+					}
 				}
 			} else if (srcnode->type==TYPE_FILE) {
 				if (srcnode->data.fdata.chunks>0) {
@@ -2980,6 +4584,7 @@ static inline void fsnodes_snapshot(uint32_t ts,fsnode *srcnode,fsnode *parentno
 				}
 				dstnode->data.fdata.length = srcnode->data.fdata.length;
 #ifndef METARESTORE
+				fsnodes_test_markdirty(dstnode);
 				fsnodes_get_stats(dstnode,&nsr);
 				fsnodes_add_sub_stats(parentnode,&nsr,&psr);
 #endif
@@ -3013,7 +4618,7 @@ static inline uint8_t fsnodes_snapshot_test(fsnode *origsrcnode,fsnode *srcnode,
 	fsnode *dstnode;
 	uint8_t status;
 	if ((e=fsnodes_lookup(parentnode,nleng,name))) {
-		dstnode = e->child;
+		dstnode = fsnode_ptr(e->child);
 		if (dstnode==origsrcnode) {
 			return ERROR_EINVAL;
 		}
@@ -3024,8 +4629,11 @@ static inline uint8_t fsnodes_snapshot_test(fsnode *origsrcnode,fsnode *srcnode,
 			return ERROR_EPERM;
 		}
 		if (srcnode->type==TYPE_DIRECTORY) {
-			for (e = srcnode->data.ddata.children ; e ; e=e->nextchild) {
-				status = fsnodes_snapshot_test(origsrcnode,e->child,dstnode,e->nleng,e->name,canoverwrite);
+#ifndef METARESTORE
+			fsnodes_lazy_cover(dstnode);
+#endif
+			for (e = fsedge_ptr(fsnodes_lazy_resolve(srcnode)->data.ddata.children) ; e ; e=fsedge_ptr(e->nextchild)) {
+				status = fsnodes_snapshot_test(origsrcnode,fsnode_ptr(e->child),dstnode,e->nleng,e->name,canoverwrite);
 				if (status!=STATUS_OK) {
 					return status;
 				}
@@ -3058,7 +4666,7 @@ static inline int fsnodes_namecheck(uint32_t nleng,const uint8_t *name) {
 	return 0;
 }
 
-#ifndef METARESTORE
+#if !defined(METARESTORE) || defined(SHADOW)
 static inline int fsnodes_access(fsnode *node,uint32_t uid,uint32_t gid,uint8_t modemask,uint8_t sesflags) {
 	uint8_t nodemode;
 	if (uid==0) {
@@ -3078,7 +4686,9 @@ static inline int fsnodes_access(fsnode *node,uint32_t uid,uint32_t gid,uint8_t
 	}
 	return 0;
 }
+#endif
 
+#ifndef METARESTORE
 static inline int fsnodes_sticky_access(fsnode *parent,fsnode *node,uint32_t uid) {
 	if (uid==0 || (parent->mode&01000)==0) {	// super user or sticky bit is not set
 		return 1;
@@ -3111,14 +4721,14 @@ uint8_t fs_readreserved_size(uint32_t rootinode,uint8_t sesflags,uint32_t *dbuff
 		return ERROR_EPERM;
 	}
 	(void)sesflags;
-	*dbuffsize = fsnodes_getdetachedsize(reserved);
+	*dbuffsize = fsnodes_getdetachedsize(fsedge_ptr(reserved));
 	return STATUS_OK;
 }
 
 void fs_readreserved_data(uint32_t rootinode,uint8_t sesflags,uint8_t *dbuff) {
 	(void)rootinode;
 	(void)sesflags;
-	fsnodes_getdetacheddata(reserved,dbuff);
+	fsnodes_getdetacheddata(fsedge_ptr(reserved),dbuff);
 }
 
 
@@ -3127,14 +4737,14 @@ uint8_t fs_readtrash_size(uint32_t rootinode,uint8_t sesflags,uint32_t *dbuffsiz
 		return ERROR_EPERM;
 	}
 	(void)sesflags;
-	*dbuffsize = fsnodes_getdetachedsize(trash);
+	*dbuffsize = fsnodes_getdetachedsize(fsedge_ptr(trash));
 	return STATUS_OK;
 }
 
 void fs_readtrash_data(uint32_t rootinode,uint8_t sesflags,uint8_t *dbuff) {
 	(void)rootinode;
 	(void)sesflags;
-	fsnodes_getdetacheddata(trash,dbuff);
+	fsnodes_getdetacheddata(fsedge_ptr(trash),dbuff);
 }
 
 /* common procedure for trash and reserved files */
@@ -3180,8 +4790,8 @@ uint8_t fs_gettrashpath(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint3
 	if (p->type!=TYPE_TRASH) {
 		return ERROR_ENOENT;
 	}
-	*pleng = p->parents->nleng;
-	*path = p->parents->name;
+	*pleng = fsedge_ptr(p->parents)->nleng;
+	*path = fsedge_ptr(p->parents)->name;
 	return STATUS_OK;
 }
 #endif
@@ -3193,7 +4803,6 @@ uint8_t fs_setpath(uint32_t inode,const uint8_t *path) {
 	uint32_t pleng;
 #endif
 	fsnode *p;
-	uint8_t *newpath;
 #ifdef METARESTORE
 	pleng = strlen((char*)path);
 #else
@@ -3220,14 +4829,9 @@ uint8_t fs_setpath(uint32_t inode,const uint8_t *path) {
 	if (p->type!=TYPE_TRASH) {
 		return ERROR_ENOENT;
 	}
-	newpath = malloc(pleng);
-	passert(newpath);
-	free(p->parents->name);
-	memcpy(newpath,path,pleng);
-	p->parents->name = newpath;
-	p->parents->nleng = pleng;
+	fsedge_setname(fsedge_ptr(p->parents),pleng,path);
 #ifndef METARESTORE
-	changelog(metaversion++,"%"PRIu32"|SETPATH(%"PRIu32",%s)",(uint32_t)main_time(),inode,fsnodes_escape_name(pleng,newpath));
+	changelog(metaversion++,(uint32_t)main_time(),CLOP_SETPATH,inode,pleng,path);
 #else
 	metaversion++;
 #endif
@@ -3261,7 +4865,7 @@ uint8_t fs_undel(uint32_t ts,uint32_t inode) {
 	status = fsnodes_undel(ts,p);
 #ifndef METARESTORE
 	if (status==STATUS_OK) {
-		changelog(metaversion++,"%"PRIu32"|UNDEL(%"PRIu32")",ts,inode);
+		changelog(metaversion++,ts,CLOP_UNDEL,inode);
 	}
 #else
 	metaversion++;
@@ -3294,7 +4898,7 @@ uint8_t fs_purge(uint32_t ts,uint32_t inode) {
 	}
 	fsnodes_purge(ts,p);
 #ifndef METARESTORE
-	changelog(metaversion++,"%"PRIu32"|PURGE(%"PRIu32")",ts,inode);
+	changelog(metaversion++,ts,CLOP_PURGE,inode);
 #else
 	metaversion++;
 #endif
@@ -3312,7 +4916,9 @@ void fs_info(uint64_t *totalspace,uint64_t *availspace,uint64_t *trspace,uint32_
 	*dnodes = dirnodes;
 	*fnodes = filenodes;
 }
+#endif
 
+#if !defined(METARESTORE) || defined(SHADOW)
 uint8_t fs_getrootinode(uint32_t *rootinode,const uint8_t *path) {
 	uint32_t nleng;
 	const uint8_t *name;
@@ -3336,18 +4942,25 @@ uint8_t fs_getrootinode(uint32_t *rootinode,const uint8_t *path) {
 		if (fsnodes_namecheck(nleng,name)<0) {
 			return ERROR_EINVAL;
 		}
+#ifdef SHADOW
+		if (fsnodes_lazy_isplaceholder(p)) {
+			return ERROR_NOTFRESH;
+		}
+#endif
 		e = fsnodes_lookup(p,nleng,name);
 		if (!e) {
 			return ERROR_ENOENT;
 		}
-		p = e->child;
+		p = fsnode_ptr(e->child);
 		if (p->type!=TYPE_DIRECTORY) {
 			return ERROR_ENOTDIR;
 		}
 		name += nleng;
 	}
 }
+#endif
 
+#ifndef METARESTORE
 void fs_statfs(uint32_t rootinode,uint8_t sesflags,uint64_t *totalspace,uint64_t *availspace,uint64_t *trspace,uint64_t *respace,uint32_t *inodes) {
 	fsnode *rn;
 	quotanode *qn;
@@ -3422,7 +5035,22 @@ uint8_t fs_access(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t ui
 	}
 	return fsnodes_access(p,uid,gid,modemask,sesflags)?STATUS_OK:ERROR_EACCES;
 }
+#elif defined(SHADOW)
+// directory stats are not kept here, so only whole filesystem without quota can be described (total and available space come from master)
+uint8_t fs_statfs(uint32_t rootinode,uint8_t sesflags,uint64_t *trspace,uint64_t *respace,uint32_t *inodes) {
+	(void)sesflags;
+	if (rootinode!=MFS_ROOT_ID || root->data.ddata.quota!=NULL) {
+		return ERROR_NOTFRESH;
+	}
+	*trspace = trashspace;
+	*respace = reservedspace;
+	*inodes = nodes - trashnodes - reservednodes;
+	stats_statfs++;
+	return STATUS_OK;
+}
+#endif
 
+#if !defined(METARESTORE) || defined(SHADOW)
 uint8_t fs_lookup(uint32_t rootinode,uint8_t sesflags,uint32_t parent,uint16_t nleng,const uint8_t *name,uint32_t uid,uint32_t gid,uint32_t auid,uint32_t agid,uint32_t *inode,uint8_t attr[35]) {
 	fsnode *wd,*rn;
 	fsedge *e;
@@ -3481,12 +5109,12 @@ uint8_t fs_lookup(uint32_t rootinode,uint8_t sesflags,uint32_t parent,uint16_t n
 				fsnodes_fill_attr(wd,wd,uid,gid,auid,agid,sesflags,attr);
 			} else {
 				if (wd->parents) {
-					if (wd->parents->parent->id==rootinode) {
+					if (fsnodes_getparent(wd)->id==rootinode) {
 						*inode = MFS_ROOT_ID;
 					} else {
-						*inode = wd->parents->parent->id;
+						*inode = fsnodes_getparent(wd)->id;
 					}
-					fsnodes_fill_attr(wd->parents->parent,wd,uid,gid,auid,agid,sesflags,attr);
+					fsnodes_fill_attr(fsnodes_getparent(wd),wd,uid,gid,auid,agid,sesflags,attr);
 				} else {
 					*inode=MFS_ROOT_ID; // rn->id;
 					fsnodes_fill_attr(rn,wd,uid,gid,auid,agid,sesflags,attr);
@@ -3499,6 +5127,11 @@ uint8_t fs_lookup(uint32_t rootinode,uint8_t sesflags,uint32_t parent,uint16_t n
 	if (fsnodes_namecheck(nleng,name)<0) {
 		return ERROR_EINVAL;
 	}
+#ifdef SHADOW
+	if (fsnodes_lazy_isplaceholder(wd)) {
+		return ERROR_NOTFRESH;	// only master materializes lazy snapshots
+	}
+#endif
 	e = fsnodes_lookup(wd,nleng,name);
 	if (!e) {
 		return ERROR_ENOENT;
@@ -3508,8 +5141,8 @@ uint8_t fs_lookup(uint32_t rootinode,uint8_t sesflags,uint32_t parent,uint16_t n
 	fsnodes_attr_access(e->child,ts);
 #endif
 */
-	*inode = e->child->id;
-	fsnodes_fill_attr(e->child,wd,uid,gid,auid,agid,sesflags,attr);
+	*inode = fsnode_ptr(e->child)->id;
+	fsnodes_fill_attr(fsnode_ptr(e->child),wd,uid,gid,auid,agid,sesflags,attr);
 	stats_lookup++;
 	return STATUS_OK;
 }
@@ -3556,6 +5189,9 @@ uint8_t fs_getattr(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t u
 	stats_getattr++;
 	return STATUS_OK;
 }
+#endif
+
+#ifndef METARESTORE
 
 uint8_t fs_try_setlength(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint8_t opened,uint32_t uid,uint32_t gid,uint32_t auid,uint32_t agid,uint64_t length,uint8_t attr[35],uint64_t *chunkid) {
 	fsnode *p,*rn;
@@ -3599,6 +5235,7 @@ uint8_t fs_try_setlength(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint
 			return ERROR_QUOTA;
 		}
 	}
+	fsnodes_lazy_touch(p);
 	if (length&MFSCHUNKMASK) {
 		uint32_t indx = (length>>MFSCHUNKBITS);
 		if (indx<p->data.fdata.chunks) {
@@ -3611,8 +5248,10 @@ uint8_t fs_try_setlength(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint
 					return status;
 				}
 				p->data.fdata.chunktab[indx] = nchunkid;
+				chunk_set_owner(nchunkid,inode);
+				fsnodes_test_markdirty(p);
 				*chunkid = nchunkid;
-				changelog(metaversion++,"%"PRIu32"|TRUNC(%"PRIu32",%"PRIu32"):%"PRIu64,(uint32_t)main_time(),inode,indx,nchunkid);
+				changelog(metaversion++,(uint32_t)main_time(),CLOP_TRUNC,inode,indx,nchunkid);
 				return ERROR_DELAYED;
 			}
 		}
@@ -3657,7 +5296,7 @@ uint8_t fs_trunc(uint32_t ts,uint32_t inode,uint32_t indx,uint64_t chunkid) {
 
 #ifndef METARESTORE
 uint8_t fs_end_setlength(uint64_t chunkid) {
-	changelog(metaversion++,"%"PRIu32"|UNLOCK(%"PRIu64")",(uint32_t)main_time(),chunkid);
+	changelog(metaversion++,(uint32_t)main_time(),CLOP_UNLOCK,chunkid);
 	return chunk_unlock(chunkid);
 }
 #else
@@ -3699,8 +5338,9 @@ uint8_t fs_do_setlength(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint3
 			}
 		}
 	}
+	fsnodes_lazy_touch(p);
 	fsnodes_setlength(p,length);
-	changelog(metaversion++,"%"PRIu32"|LENGTH(%"PRIu32",%"PRIu64")",ts,inode,p->data.fdata.length);
+	changelog(metaversion++,ts,CLOP_LENGTH,inode,p->data.fdata.length);
 	p->ctime = p->mtime = ts;
 	fsnodes_fill_attr(p,NULL,uid,gid,auid,agid,sesflags,attr);
 /*
@@ -3769,6 +5409,7 @@ uint8_t fs_setattr(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t u
 			return ERROR_EPERM;
 		}
 	}
+	fsnodes_lazy_touch(p);
 	// first ignore sugid clears done by kernel
 	if ((setmask&(SET_UID_FLAG|SET_GID_FLAG)) && (setmask&SET_MODE_FLAG)) {	// chown+chmod = chown with sugid clears
 		attrmode |= (p->mode & 06000);
@@ -3835,8 +5476,11 @@ uint8_t fs_setattr(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t u
 	if (setmask&SET_MTIME_FLAG) {
 		p->mtime = attrmtime;
 	}
-	changelog(metaversion++,"%"PRIu32"|ATTR(%"PRIu32",%"PRIu16",%"PRIu32",%"PRIu32",%"PRIu32",%"PRIu32")",ts,inode,p->mode & 07777,p->uid,p->gid,p->atime,p->mtime);
+	changelog(metaversion++,ts,CLOP_ATTR,inode,p->mode & 07777,p->uid,p->gid,p->atime,p->mtime);
 	p->ctime = ts;
+	if (p->type==TYPE_TRASH && (setmask&(SET_ATIME_FLAG|SET_MTIME_FLAG))) {
+		fsnodes_trash_queue(p);
+	}
 	fsnodes_fill_attr(p,NULL,uid,gid,auid,agid,sesflags,attr);
 /*
 #ifdef CACHENOTIFY
@@ -3865,6 +5509,9 @@ uint8_t fs_attr(uint32_t ts,uint32_t inode,uint32_t mode,uint32_t uid,uint32_t g
 	p->atime = atime;
 	p->mtime = mtime;
 	p->ctime = ts;
+	if (p->type==TYPE_TRASH) {
+		fsnodes_trash_queue(p);
+	}
 	metaversion++;
 	return STATUS_OK;
 }
@@ -3921,7 +5568,7 @@ uint8_t fs_settrashtime(uint32_t ts,uint32_t inode,uint32_t trashto) {
 	p->trashtime = trashto;
 	p->ctime = ts;
 #ifndef METARESTORE
-	changelog(metaversion++,"%"PRIu32"|SETTRASHTIME(%"PRIu32",%"PRIu32")",ts,inode,p->trashtime);
+	changelog(metaversion++,ts,CLOP_SETTRASHTIME,inode,p->trashtime);
 #else
 	metaversion++;
 #endif
@@ -3929,10 +5576,12 @@ uint8_t fs_settrashtime(uint32_t ts,uint32_t inode,uint32_t trashto) {
 }
 */
 
-#ifndef METARESTORE
+#if !defined(METARESTORE) || defined(SHADOW)
 uint8_t fs_readlink(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t *pleng,uint8_t **path) {
 	fsnode *p,*rn;
+#ifndef METARESTORE
 	uint32_t ts = main_time();
+#endif
 
 	(void)sesflags;
 	*pleng = 0;
@@ -3965,6 +5614,7 @@ uint8_t fs_readlink(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t
 	}
 	*pleng = p->data.sdata.pleng;
 	*path = p->data.sdata.path;
+#ifndef METARESTORE
 	if (p->atime!=ts) {
 		p->atime = ts;
 /*
@@ -3972,8 +5622,9 @@ uint8_t fs_readlink(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t
 		fsnodes_attr_changed(p,ts);
 #endif
 */
-		changelog(metaversion++,"%"PRIu32"|ACCESS(%"PRIu32")",ts,inode);
+		changelog(metaversion++,ts,CLOP_ACCESS,inode);
 	}
+#endif
 	stats_readlink++;
 	return STATUS_OK;
 }
@@ -4069,7 +5720,7 @@ uint8_t fs_symlink(uint32_t ts,uint32_t parent,uint32_t nleng,const uint8_t *nam
 
 	*inode = p->id;
 	fsnodes_fill_attr(p,wd,uid,gid,auid,agid,sesflags,attr);
-	changelog(metaversion++,"%"PRIu32"|SYMLINK(%"PRIu32",%s,%s,%"PRIu32",%"PRIu32"):%"PRIu32,(uint32_t)main_time(),parent,fsnodes_escape_name(nleng,name),fsnodes_escape_name(pleng,newpath),uid,gid,p->id);
+	changelog(metaversion++,(uint32_t)main_time(),CLOP_SYMLINK,parent,nleng,name,pleng,newpath,uid,gid,p->id);
 	stats_symlink++;
 #else
 	if (inode!=p->id) {
@@ -4135,7 +5786,7 @@ uint8_t fs_mknod(uint32_t rootinode,uint8_t sesflags,uint32_t parent,uint16_t nl
 	}
 	*inode = p->id;
 	fsnodes_fill_attr(p,wd,uid,gid,auid,agid,sesflags,attr);
-	changelog(metaversion++,"%"PRIu32"|CREATE(%"PRIu32",%s,%c,%"PRIu16",%"PRIu32",%"PRIu32",%"PRIu32"):%"PRIu32,(uint32_t)main_time(),parent,fsnodes_escape_name(nleng,name),type,mode,uid,gid,rdev,p->id);
+	changelog(metaversion++,(uint32_t)main_time(),CLOP_CREATE,parent,nleng,name,type,mode,uid,gid,rdev,p->id);
 	stats_mknod++;
 	return STATUS_OK;
 }
@@ -4188,7 +5839,7 @@ uint8_t fs_mkdir(uint32_t rootinode,uint8_t sesflags,uint32_t parent,uint16_t nl
 	p = fsnodes_create_node(main_time(),wd,nleng,name,TYPE_DIRECTORY,mode,uid,gid,copysgid);
 	*inode = p->id;
 	fsnodes_fill_attr(p,wd,uid,gid,auid,agid,sesflags,attr);
-	changelog(metaversion++,"%"PRIu32"|CREATE(%"PRIu32",%s,%c,%"PRIu16",%"PRIu32",%"PRIu32",%"PRIu32"):%"PRIu32,(uint32_t)main_time(),parent,fsnodes_escape_name(nleng,name),TYPE_DIRECTORY,mode,uid,gid,0,p->id);
+	changelog(metaversion++,(uint32_t)main_time(),CLOP_CREATE,parent,nleng,name,TYPE_DIRECTORY,mode,uid,gid,(uint32_t)0,p->id);
 	stats_mkdir++;
 	return STATUS_OK;
 }
@@ -4268,13 +5919,14 @@ uint8_t fs_unlink(uint32_t rootinode,uint8_t sesflags,uint32_t parent,uint16_t n
 	if (!e) {
 		return ERROR_ENOENT;
 	}
-	if (!fsnodes_sticky_access(wd,e->child,uid)) {
+	if (!fsnodes_sticky_access(wd,fsnode_ptr(e->child),uid)) {
 		return ERROR_EPERM;
 	}
-	if (e->child->type==TYPE_DIRECTORY) {
+	if (fsnode_ptr(e->child)->type==TYPE_DIRECTORY) {
 		return ERROR_EPERM;
 	}
-	changelog(metaversion++,"%"PRIu32"|UNLINK(%"PRIu32",%s):%"PRIu32,ts,parent,fsnodes_escape_name(nleng,name),e->child->id);
+	fsnodes_lazy_cover(wd);
+	changelog(metaversion++,ts,CLOP_UNLINK,parent,nleng,name,fsnode_ptr(e->child)->id);
 	fsnodes_unlink(ts,e);
 	stats_unlink++;
 	return STATUS_OK;
@@ -4325,16 +5977,17 @@ uint8_t fs_rmdir(uint32_t rootinode,uint8_t sesflags,uint32_t parent,uint16_t nl
 	if (!e) {
 		return ERROR_ENOENT;
 	}
-	if (!fsnodes_sticky_access(wd,e->child,uid)) {
+	if (!fsnodes_sticky_access(wd,fsnode_ptr(e->child),uid)) {
 		return ERROR_EPERM;
 	}
-	if (e->child->type!=TYPE_DIRECTORY) {
+	if (fsnode_ptr(e->child)->type!=TYPE_DIRECTORY) {
 		return ERROR_ENOTDIR;
 	}
-	if (e->child->data.ddata.children!=NULL) {
+	if (fsnodes_isempty(fsnode_ptr(e->child))==0) {
 		return ERROR_ENOTEMPTY;
 	}
-	changelog(metaversion++,"%"PRIu32"|UNLINK(%"PRIu32",%s):%"PRIu32,ts,parent,fsnodes_escape_name(nleng,name),e->child->id);
+	fsnodes_lazy_cover(wd);
+	changelog(metaversion++,ts,CLOP_UNLINK,parent,nleng,name,fsnode_ptr(e->child)->id);
 	fsnodes_unlink(ts,e);
 	stats_rmdir++;
 	return STATUS_OK;
@@ -4354,10 +6007,10 @@ uint8_t fs_unlink(uint32_t ts,uint32_t parent,uint32_t nleng,const uint8_t *name
 	if (!e) {
 		return ERROR_ENOENT;
 	}
-	if (e->child->id!=inode) {
+	if (fsnode_ptr(e->child)->id!=inode) {
 		return ERROR_MISMATCH;
 	}
-	if (e->child->type==TYPE_DIRECTORY && e->child->data.ddata.children!=NULL) {
+	if (fsnode_ptr(e->child)->type==TYPE_DIRECTORY && fsnodes_isempty(fsnode_ptr(e->child))==0) {
 		return ERROR_ENOTEMPTY;
 	}
 	fsnodes_unlink(ts,e);
@@ -4447,7 +6100,7 @@ uint8_t fs_move(uint32_t ts,uint32_t parent_src,uint32_t nleng_src,const uint8_t
 	if (!se) {
 		return ERROR_ENOENT;
 	}
-	node = se->child;
+	node = fsnode_ptr(se->child);
 #ifndef METARESTORE
 	if (!fsnodes_sticky_access(swd,node,uid)) {
 		return ERROR_EPERM;
@@ -4466,8 +6119,8 @@ uint8_t fs_move(uint32_t ts,uint32_t parent_src,uint32_t nleng_src,const uint8_t
 		return ERROR_EACCES;
 	}
 #endif
-	if (se->child->type==TYPE_DIRECTORY) {
-		if (fsnodes_isancestor(se->child,dwd)) {
+	if (fsnode_ptr(se->child)->type==TYPE_DIRECTORY) {
+		if (fsnodes_isancestor(fsnode_ptr(se->child),dwd)) {
 			return ERROR_EINVAL;
 		}
 	}
@@ -4478,13 +6131,17 @@ uint8_t fs_move(uint32_t ts,uint32_t parent_src,uint32_t nleng_src,const uint8_t
 	if (fsnodes_test_quota(dwd)) {
 		return ERROR_QUOTA;
 	}
+#ifndef METARESTORE
+	fsnodes_lazy_cover(swd);
+	fsnodes_lazy_cover(dwd);
+#endif
 	de = fsnodes_lookup(dwd,nleng_dst,name_dst);
 	if (de) {
-		if (de->child->type==TYPE_DIRECTORY && de->child->data.ddata.children!=NULL) {
+		if (fsnode_ptr(de->child)->type==TYPE_DIRECTORY && fsnodes_isempty(fsnode_ptr(de->child))==0) {
 			return ERROR_ENOTEMPTY;
 		}
 #ifndef METARESTORE
-		if (!fsnodes_sticky_access(dwd,de->child,uid)) {
+		if (!fsnodes_sticky_access(dwd,fsnode_ptr(de->child),uid)) {
 			return ERROR_EPERM;
 		}
 #endif
@@ -4495,7 +6152,7 @@ uint8_t fs_move(uint32_t ts,uint32_t parent_src,uint32_t nleng_src,const uint8_t
 #ifndef METARESTORE
 	*inode = node->id;
 	fsnodes_fill_attr(node,dwd,uid,gid,auid,agid,sesflags,attr);
-	changelog(metaversion++,"%"PRIu32"|MOVE(%"PRIu32",%s,%"PRIu32",%s):%"PRIu32,(uint32_t)main_time(),parent_src,fsnodes_escape_name(nleng_src,name_src),parent_dst,fsnodes_escape_name(nleng_dst,name_dst),node->id);
+	changelog(metaversion++,(uint32_t)main_time(),CLOP_MOVE,parent_src,nleng_src,name_src,parent_dst,nleng_dst,name_dst,node->id);
 	stats_rename++;
 #else
 	metaversion++;
@@ -4591,11 +6248,14 @@ uint8_t fs_link(uint32_t ts,uint32_t inode_src,uint32_t parent_dst,uint32_t nlen
 	if (fsnodes_test_quota(dwd)) {
 		return ERROR_QUOTA;
 	}
+#ifndef METARESTORE
+	fsnodes_lazy_touch(sp);
+#endif
 	fsnodes_link(ts,dwd,sp,nleng_dst,name_dst);
 #ifndef METARESTORE
 	*inode = inode_src;
 	fsnodes_fill_attr(sp,dwd,uid,gid,auid,agid,sesflags,attr);
-	changelog(metaversion++,"%"PRIu32"|LINK(%"PRIu32",%"PRIu32",%s)",(uint32_t)main_time(),inode_src,parent_dst,fsnodes_escape_name(nleng_dst,name_dst));
+	changelog(metaversion++,(uint32_t)main_time(),CLOP_LINK,inode_src,parent_dst,nleng_dst,name_dst);
 	stats_link++;
 #else
 	metaversion++;
@@ -4606,9 +6266,10 @@ uint8_t fs_link(uint32_t ts,uint32_t inode_src,uint32_t parent_dst,uint32_t nlen
 #ifndef METARESTORE
 uint8_t fs_snapshot(uint32_t rootinode,uint8_t sesflags,uint32_t inode_src,uint32_t parent_dst,uint16_t nleng_dst,const uint8_t *name_dst,uint32_t uid,uint32_t gid,uint8_t canoverwrite) {
 	uint32_t ts;
+	uint8_t lazy;
 	fsnode *rn;
 #else
-uint8_t fs_snapshot(uint32_t ts,uint32_t inode_src,uint32_t parent_dst,uint16_t nleng_dst,uint8_t *name_dst,uint8_t canoverwrite) {
+uint8_t fs_snapshot(uint32_t ts,uint32_t inode_src,uint32_t parent_dst,uint16_t nleng_dst,uint8_t *name_dst,uint8_t canoverwrite,uint8_t lazy) {
 #endif
 	fsnode *sp;
 	fsnode *dwd;
@@ -4687,22 +6348,49 @@ uint8_t fs_snapshot(uint32_t ts,uint32_t inode_src,uint32_t parent_dst,uint16_t
 	if (fsnodes_test_quota(dwd)) {
 		return ERROR_QUOTA;
 	}
+#ifndef METARESTORE
+	fsnodes_lazy_cover(dwd);
+#endif
 	status = fsnodes_snapshot_test(sp,sp,dwd,nleng_dst,name_dst,canoverwrite);
 	if (status!=STATUS_OK) {
 		return status;
 	}
 #ifndef METARESTORE
 	ts = main_time();
+	lazy = (sp->type==TYPE_DIRECTORY)?LazySnapshots:0;
 #endif
-	fsnodes_snapshot(ts,sp,dwd,nleng_dst,name_dst);
+	fsnodes_snapshot(ts,sp,dwd,nleng_dst,name_dst,lazy);
 #ifndef METARESTORE
-	changelog(metaversion++,"%"PRIu32"|SNAPSHOT(%"PRIu32",%"PRIu32",%s,%"PRIu8")",ts,inode_src,parent_dst,fsnodes_escape_name(nleng_dst,name_dst),canoverwrite);
+	if (lazy) {
+		changelog(metaversion++,ts,CLOP_LAZYSNAPSHOT,inode_src,parent_dst,nleng_dst,name_dst,canoverwrite);
+	} else {
+		changelog(metaversion++,ts,CLOP_SNAPSHOT,inode_src,parent_dst,nleng_dst,name_dst,canoverwrite);
+	}
 #else
 	metaversion++;
 #endif
 	return STATUS_OK;
 }
 
+#ifdef METARESTORE
+uint8_t fs_materialize(uint32_t inode,uint32_t count) {
+	fsnode *p;
+	lazysnap *ls;
+	p = fsnodes_id_to_node(inode);
+	if (!p) {
+		return ERROR_ENOENT;
+	}
+	if (p->type!=TYPE_DIRECTORY || (ls=fsnodes_lazy_find(inode))==NULL) {
+		return ERROR_MISMATCH;
+	}
+	if (fsnodes_lazy_materialize(p,ls)!=count) {
+		return ERROR_MISMATCH;
+	}
+	metaversion++;
+	return STATUS_OK;
+}
+#endif
+
 #ifndef METARESTORE
 uint8_t fs_append(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t inode_src,uint32_t uid,uint32_t gid) {
 	uint32_t ts;
@@ -4789,21 +6477,22 @@ uint8_t fs_append(uint32_t ts,uint32_t inode,uint32_t inode_src) {
 	}
 #ifndef METARESTORE
 	ts = main_time();
+	fsnodes_lazy_touch(p);
 #endif
 	status = fsnodes_appendchunks(ts,p,sp);
 	if (status!=STATUS_OK) {
 		return status;
 	}
 #ifndef METARESTORE
-	changelog(metaversion++,"%"PRIu32"|APPEND(%"PRIu32",%"PRIu32")",ts,inode,inode_src);
+	changelog(metaversion++,ts,CLOP_APPEND,inode,inode_src);
 #else
 	metaversion++;
 #endif
 	return STATUS_OK;
 }
 
-#ifndef METARESTORE
-uint8_t fs_readdir_size(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t uid,uint32_t gid,uint8_t flags,void **dnode,uint32_t *dbuffsize) {
+#if !defined(METARESTORE) || defined(SHADOW)
+uint8_t fs_readdir_size(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t uid,uint32_t gid,uint8_t flags,uint64_t cursor,void **dnode,uint32_t *dbuffsize) {
 	fsnode *p,*rn;
 	*dnode = NULL;
 	*dbuffsize = 0;
@@ -4836,31 +6525,47 @@ uint8_t fs_readdir_size(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint3
 	if (!fsnodes_access(p,uid,gid,MODE_MASK_R,sesflags)) {
 		return ERROR_EACCES;
 	}
+#ifdef SHADOW
+	if (fsnodes_lazy_isplaceholder(p)) {
+		return ERROR_NOTFRESH;
+	}
+#else
+	fsnodes_lazy_open(p);
+#endif
 	*dnode = p;
-	*dbuffsize = fsnodes_getdirsize(p,flags&GETDIR_FLAG_WITHATTR);
+	if (flags&GETDIR_FLAG_PAGED) {
+		*dbuffsize = fsnodes_getdirpagesize(p,flags&GETDIR_FLAG_WITHATTR,cursor);
+	} else {
+		*dbuffsize = fsnodes_getdirsize(p,flags&GETDIR_FLAG_WITHATTR);
+	}
 	return STATUS_OK;
 }
 
 void fs_readdir_data(uint32_t rootinode,uint8_t sesflags,uint32_t uid,uint32_t gid,uint32_t auid,uint32_t agid,uint8_t flags,void *dnode,uint8_t *dbuff) {
 	fsnode *p = (fsnode*)dnode;
+#ifndef METARESTORE
 	uint32_t ts = main_time();
 
 	if (p->atime!=ts) {
 		p->atime = ts;
-		changelog(metaversion++,"%"PRIu32"|ACCESS(%"PRIu32")",ts,p->id);
-		fsnodes_getdirdata(rootinode,uid,gid,auid,agid,sesflags,p,dbuff,flags&GETDIR_FLAG_WITHATTR);
+		changelog(metaversion++,ts,CLOP_ACCESS,p->id);
 /*
 #ifdef CACHENOTIFY
 		fsnodes_attr_changed(p,ts);
 #endif
 */
+	}
+#endif
+	if (flags&GETDIR_FLAG_PAGED) {
+		fsnodes_getdirpagedata(rootinode,uid,gid,auid,agid,sesflags,p,dbuff,flags&GETDIR_FLAG_WITHATTR);
 	} else {
 		fsnodes_getdirdata(rootinode,uid,gid,auid,agid,sesflags,p,dbuff,flags&GETDIR_FLAG_WITHATTR);
 	}
 	stats_readdir++;
 }
+#endif
 
-
+#ifndef METARESTORE
 uint8_t fs_checkfile(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t chunkcount[11]) {
 	fsnode *p,*rn;
 	(void)sesflags;
@@ -4967,7 +6672,7 @@ uint8_t fs_acquire(uint32_t inode,uint32_t sessionid) {
 	cr->next = p->data.fdata.sessionids;
 	p->data.fdata.sessionids = cr;
 #ifndef METARESTORE
-	changelog(metaversion++,"%"PRIu32"|ACQUIRE(%"PRIu32",%"PRIu32")",(uint32_t)main_time(),inode,sessionid);
+	changelog(metaversion++,(uint32_t)main_time(),CLOP_ACQUIRE,inode,sessionid);
 #else
 	metaversion++;
 #endif
@@ -4989,8 +6694,11 @@ uint8_t fs_release(uint32_t inode,uint32_t sessionid) {
 		if (cr->sessionid==sessionid) {
 			*crp = cr->next;
 			sessionidrec_free(cr);
+			if (p->type==TYPE_RESERVED && p->data.fdata.sessionids==NULL) {
+				fsnodes_reserved_queue(p);
+			}
 #ifndef METARESTORE
-			changelog(metaversion++,"%"PRIu32"|RELEASE(%"PRIu32",%"PRIu32")",(uint32_t)main_time(),inode,sessionid);
+			changelog(metaversion++,(uint32_t)main_time(),CLOP_RELEASE,inode,sessionid);
 #else
 			metaversion++;
 #endif
@@ -5007,7 +6715,7 @@ uint8_t fs_release(uint32_t inode,uint32_t sessionid) {
 
 #ifndef METARESTORE
 uint32_t fs_newsessionid(void) {
-	changelog(metaversion++,"%"PRIu32"|SESSION():%"PRIu32,(uint32_t)main_time(),nextsessionid);
+	changelog(metaversion++,(uint32_t)main_time(),CLOP_SESSION,nextsessionid);
 	return nextsessionid++;
 }
 #else
@@ -5044,7 +6752,7 @@ uint8_t fs_readchunk(uint32_t inode,uint32_t indx,uint64_t *chunkid,uint64_t *le
 	*length = p->data.fdata.length;
 	if (p->atime!=ts) {
 		p->atime = ts;
-		changelog(metaversion++,"%"PRIu32"|ACCESS(%"PRIu32")",ts,inode);
+		changelog(metaversion++,ts,CLOP_ACCESS,inode);
 /*
 #ifdef CACHENOTIFY
 		fsnodes_attr_changed(p,ts);
@@ -5081,6 +6789,7 @@ uint8_t fs_writechunk(uint32_t inode,uint32_t indx,uint64_t *chunkid,uint64_t *l
 	if (indx>MAX_INDEX) {
 		return ERROR_INDEXTOOBIG;
 	}
+	fsnodes_lazy_touch(p);
 	fsnodes_get_stats(p,&psr);
 	/* resize chunks structure */
 	if (indx>=p->data.fdata.chunks) {
@@ -5117,13 +6826,15 @@ uint8_t fs_writechunk(uint32_t inode,uint32_t indx,uint64_t *chunkid,uint64_t *l
 		return status;
 	}
 	p->data.fdata.chunktab[indx] = nchunkid;
+	chunk_set_owner(nchunkid,inode);
+	fsnodes_test_markdirty(p);
 	fsnodes_get_stats(p,&nsr);
-	for (e=p->parents ; e ; e=e->nextparent) {
-		fsnodes_add_sub_stats(e->parent,&nsr,&psr);
+	for (e=fsedge_ptr(p->parents) ; e ; e=fsedge_ptr(e->nextparent)) {
+		fsnodes_add_sub_stats(fsnode_ptr(e->parent),&nsr,&psr);
 	}
 	*chunkid = nchunkid;
 	*length = p->data.fdata.length;
-	changelog(metaversion++,"%"PRIu32"|WRITE(%"PRIu32",%"PRIu32",%"PRIu8"):%"PRIu64,ts,inode,indx,*opflag,nchunkid);
+	changelog(metaversion++,ts,CLOP_WRITE,inode,indx,*opflag,nchunkid);
 	if (p->mtime!=ts || p->ctime!=ts) {
 		p->mtime = p->ctime = ts;
 /*
@@ -5218,7 +6929,7 @@ uint8_t fs_reinitchunk(uint32_t inode,uint32_t indx,uint64_t *chunkid) {
 	if (status!=STATUS_OK) {
 		return status;
 	}
-	changelog(metaversion++,"%"PRIu32"|REINIT(%"PRIu32",%"PRIu32"):%"PRIu64,(uint32_t)main_time(),inode,indx,nchunkid);
+	changelog(metaversion++,(uint32_t)main_time(),CLOP_REINIT,inode,indx,nchunkid);
 	*chunkid = nchunkid;
 	p->mtime = p->ctime = main_time();
 	return STATUS_OK;
@@ -5272,9 +6983,10 @@ uint8_t fs_writeend(uint32_t inode,uint64_t length,uint64_t chunkid) {
 			return ERROR_EPERM;
 		}
 		if (length>p->data.fdata.length) {
+			fsnodes_lazy_touch(p);
 			fsnodes_setlength(p,length);
 			p->mtime = p->ctime = ts;
-			changelog(metaversion++,"%"PRIu32"|LENGTH(%"PRIu32",%"PRIu64")",ts,inode,length);
+			changelog(metaversion++,ts,CLOP_LENGTH,inode,length);
 /*
 #ifdef CACHENOTIFY
 			fsnodes_attr_changed(p,ts);
@@ -5282,14 +6994,14 @@ uint8_t fs_writeend(uint32_t inode,uint64_t length,uint64_t chunkid) {
 */
 		}
 	}
-	changelog(metaversion++,"%"PRIu32"|UNLOCK(%"PRIu64")",ts,chunkid);
+	changelog(metaversion++,ts,CLOP_UNLOCK,chunkid);
 	return chunk_unlock(chunkid);
 }
 #endif
 
 #ifndef METARESTORE
 void fs_incversion(uint64_t chunkid) {
-	changelog(metaversion++,"%"PRIu32"|INCVERSION(%"PRIu64")",(uint32_t)main_time(),chunkid);
+	changelog(metaversion++,(uint32_t)main_time(),CLOP_INCVERSION,chunkid);
 }
 #else
 uint8_t fs_incversion(uint64_t chunkid) {
@@ -5345,10 +7057,11 @@ uint8_t fs_repair(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t ui
 	if (!fsnodes_access(p,uid,gid,MODE_MASK_W,sesflags)) {
 		return ERROR_EACCES;
 	}
+	fsnodes_lazy_touch(p);
 	fsnodes_get_stats(p,&psr);
 	for (indx=0 ; indx<p->data.fdata.chunks ; indx++) {
 		if (chunk_repair(p->goal,p->data.fdata.chunktab[indx],&nversion)) {
-			changelog(metaversion++,"%"PRIu32"|REPAIR(%"PRIu32",%"PRIu32"):%"PRIu32,ts,inode,indx,nversion);
+			changelog(metaversion++,ts,CLOP_REPAIR,inode,indx,nversion);
 			if (nversion>0) {
 				(*repaired)++;
 			} else {
@@ -5359,9 +7072,10 @@ uint8_t fs_repair(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t ui
 			(*notchanged)++;
 		}
 	}
+	fsnodes_test_markdirty(p);
 	fsnodes_get_stats(p,&nsr);
-	for (e=p->parents ; e ; e=e->nextparent) {
-		fsnodes_add_sub_stats(e->parent,&nsr,&psr);
+	for (e=fsedge_ptr(p->parents) ; e ; e=fsedge_ptr(e->nextparent)) {
+		fsnodes_add_sub_stats(fsnode_ptr(e->parent),&nsr,&psr);
 	}
 	if (p->mtime!=ts || p->ctime!=ts) {
 		p->mtime = p->ctime = ts;
@@ -5547,11 +7261,355 @@ uint8_t fs_geteattr(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint8_t g
 
 #endif
 
+#ifndef METARESTORE
+/* background jobs - recursive setgoal/settrashtime/seteattr of trees bigger than FSJOB_SYNC_NODES
+   jobs are processed every FSJOB_STEP_MSEC ms (timer exists only while there are jobs) - each step visits about FSJOB_STEP_NODES entries (divided between all jobs) */
+#define FSJOB_SYNC_NODES 10000
+#define FSJOB_PART_NODES 4096
+#define FSJOB_STEP_NODES 20000
+#define FSJOB_STEP_MSEC 10
+#define FSJOB_RESULT_KEEP 600	// results of finished jobs are kept for clients polling them (CLTOMA_FSJOBS_INFO)
+
+typedef struct _fsjob {
+	uint32_t jobid;
+	uint8_t type;
+	uint8_t smode;
+	uint32_t inode;
+	uint32_t rootinode;	// session root - directories moved out of it (or out of 'inode') are skipped
+	uint32_t uid;
+	uint32_t value;
+	uint32_t starttime;
+	uint32_t *dirs;		// directories waiting for processing (stack)
+	uint32_t dirscnt,dirssize;
+	uint32_t curdir;	// directory being processed (0 - none)
+	uint32_t curpart,curparts;
+	uint32_t cnt[4];	// changed,notchanged,notpermitted,quotaexceeded
+	uint64_t visited;
+	struct _fsjob *next;
+} fsjob;
+
+typedef struct _fsjobresult {
+	uint32_t jobid;
+	uint32_t endtime;
+	uint64_t visited;
+	uint32_t cnt[4];
+	struct _fsjobresult *next;
+} fsjobresult;
+
+static fsjob *fsjobshead = NULL;
+static uint32_t fsjobscnt = 0;
+static fsjobresult *fsjobresultshead = NULL;	// newest first
+static uint32_t fsjobsnextid = 1;
+static void *fsjobshook = NULL;
+
+static void fs_jobs_step(void);
+
+static void fs_job_adddir(void *arg,fsnode *p) {
+	fsjob *j = (fsjob*)arg;
+	if (j->dirscnt>=j->dirssize) {
+		j->dirssize = (j->dirssize==0)?256:j->dirssize*2;
+		j->dirs = realloc(j->dirs,sizeof(uint32_t)*j->dirssize);
+		passert(j->dirs);
+	}
+	j->dirs[j->dirscnt++] = p->id;
+}
+
+// counts nodes in subtree - stops when limit is reached
+static uint32_t fsnodes_subtree_nodes(fsnode *p,uint32_t limit) {
+	fsedge *e;
+	uint32_t r = 1;
+	if (p->type==TYPE_DIRECTORY) {
+		for (e=fsedge_ptr(fsnodes_lazy_resolve(p)->data.ddata.children) ; e && r<limit ; e=fsedge_ptr(e->nextchild)) {
+			if (fsnode_ptr(e->child)->type==TYPE_DIRECTORY) {
+				r += fsnodes_subtree_nodes(fsnode_ptr(e->child),limit-r);
+			} else {
+				r++;
+			}
+		}
+	}
+	return r;
+}
+
+static uint32_t fs_job_start(uint8_t type,uint32_t rootinode,fsnode *p,uint32_t uid,uint32_t value,uint8_t smode) {
+	fsjob *j;
+	j = malloc(sizeof(fsjob));
+	passert(j);
+	j->jobid = fsjobsnextid++;
+	if (fsjobsnextid==0) {
+		fsjobsnextid = 1;
+	}
+	j->type = type;
+	j->smode = smode;
+	j->inode = p->id;
+	j->rootinode = rootinode;
+	j->uid = uid;
+	j->value = value;
+	j->starttime = main_time();
+	j->dirs = NULL;
+	j->dirscnt = 0;
+	j->dirssize = 0;
+	j->curdir = 0;
+	j->curpart = 0;
+	j->curparts = 0;
+	memset(j->cnt,0,sizeof(j->cnt));
+	j->visited = 0;
+	fs_job_adddir(j,p);
+	j->next = fsjobshead;
+	fsjobshead = j;
+	fsjobscnt++;
+	if (fsjobshook==NULL) {
+		fsjobshook = main_msectimeregister(TIMEMODE_SKIP_LATE,FSJOB_STEP_MSEC,0,fs_jobs_step);
+	}
+	return j->jobid;
+}
+
+// checks (for each part, because directories can be moved between steps) that directory is still inside job tree and session root
+static inline int fs_job_inside(fsjob *j,fsnode *p) {
+	fsnode *jn,*rn;
+	jn = fsnodes_id_to_node(j->inode);
+	if (jn==NULL) {
+		return 0;
+	}
+	if (p!=jn && !fsnodes_isancestor(jn,p)) {
+		return 0;
+	}
+	if (j->rootinode!=MFS_ROOT_ID && j->rootinode!=0) {
+		rn = fsnodes_id_to_node(j->rootinode);
+		if (rn==NULL || (jn!=rn && !fsnodes_isancestor(rn,jn))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void fs_job_addresult(fsjob *j,uint32_t now) {
+	fsjobresult *r,**rp;
+	r = malloc(sizeof(fsjobresult));
+	passert(r);
+	r->jobid = j->jobid;
+	r->endtime = now;
+	r->visited = j->visited;
+	memcpy(r->cnt,j->cnt,sizeof(r->cnt));
+	r->next = fsjobresultshead;
+	fsjobresultshead = r;
+	for (rp=&(r->next) ; *rp && (*rp)->endtime+FSJOB_RESULT_KEEP>=now ; rp=&((*rp)->next)) {}
+	while ((r=*rp)!=NULL) {
+		*rp = r->next;
+		free(r);
+	}
+}
+
+// returns 1 when job is finished
+static uint8_t fs_job_step(fsjob *j,uint32_t ts,uint32_t budget) {
+	fsnode *p;
+	uint32_t cnt[4];
+	uint32_t hfrom,hto,visited;
+	uint64_t partsize;
+
+	while (budget>0) {
+		if (j->curdir==0) {
+			if (j->dirscnt==0) {
+				return 1;
+			}
+			j->curdir = j->dirs[--j->dirscnt];
+			j->curpart = 0;
+			j->curparts = 0;
+		}
+		p = fsnodes_id_to_node(j->curdir);
+		if (p==NULL || p->type!=TYPE_DIRECTORY || fs_job_inside(j,p)==0) {	// removed or moved out of job tree in the meantime
+			j->curdir = 0;
+			continue;
+		}
+		if (j->curparts==0) {
+			j->curparts = 1;
+			while ((uint64_t)(p->data.ddata.elements)>(uint64_t)(j->curparts)*FSJOB_PART_NODES && j->curparts<0x10000) {
+				j->curparts *= 2;
+			}
+		}
+		partsize = UINT64_C(0x100000000)/j->curparts;
+		hfrom = j->curpart*partsize;
+		hto = hfrom+(partsize-1);
+		memset(cnt,0,sizeof(cnt));
+		visited = fsnodes_setattr_part(j->type,p,ts,j->uid,j->value,j->smode,hfrom,hto,cnt,fs_job_adddir,j);
+		// parts without changes are not logged (seteattr also silently clears EATTR_NOECACHE in files, so its parts are always logged)
+		if (cnt[0]>0 || j->type==FSJOB_SETEATTR) {
+			switch (j->type) {
+			case FSJOB_SETGOAL:
+				changelog(metaversion++,ts,CLOP_SETGOALPART,p->id,j->uid,j->value,j->smode,hfrom,hto,cnt[0],cnt[1],cnt[2],cnt[3]);
+				break;
+			case FSJOB_SETTRASHTIME:
+				changelog(metaversion++,ts,CLOP_SETTRASHTIMEPART,p->id,j->uid,j->value,j->smode,hfrom,hto,cnt[0],cnt[1],cnt[2]);
+				break;
+			case FSJOB_SETEATTR:
+				changelog(metaversion++,ts,CLOP_SETEATTRPART,p->id,j->uid,j->value,j->smode,hfrom,hto,cnt[0],cnt[1],cnt[2]);
+				break;
+			}
+		}
+		j->cnt[0] += cnt[0];
+		j->cnt[1] += cnt[1];
+		j->cnt[2] += cnt[2];
+		j->cnt[3] += cnt[3];
+		j->visited += visited;
+		budget = (visited<budget)?budget-visited:0;
+		j->curpart++;
+		if (j->curpart>=j->curparts) {
+			j->curdir = 0;
+		}
+	}
+	return 0;
+}
+
+static void fs_jobs_step(void) {
+	fsjob *j,**jp;
+	uint32_t ts,budget;
+
+	if (fsjobshead==NULL) {
+		return;
+	}
+	ts = main_time();
+	budget = FSJOB_STEP_NODES/fsjobscnt+1;
+	jp = &fsjobshead;
+	while ((j=*jp)!=NULL) {
+		if (fs_job_step(j,ts,budget)) {
+			*jp = j->next;
+			fsjobscnt--;
+			fs_job_addresult(j,ts);
+			matoclserv_fsjob_finished(j->jobid,STATUS_OK,j->cnt[0],j->cnt[1],j->cnt[2],j->cnt[3]);
+			if (j->dirs) {
+				free(j->dirs);
+			}
+			free(j);
+		} else {
+			jp = &(j->next);
+		}
+	}
+	if (fsjobshead==NULL) {
+		main_timeunregister(fsjobshook);
+		fsjobshook = NULL;
+	}
+}
+
+uint32_t fs_jobs_info_size(void) {
+	return fsjobscnt*41;
+}
+
+void fs_jobs_info_data(uint8_t *buff) {
+	fsjob *j;
+	for (j=fsjobshead ; j ; j=j->next) {
+		put32bit(&buff,j->jobid);
+		put8bit(&buff,j->type);
+		put32bit(&buff,j->inode);
+		put32bit(&buff,j->starttime);
+		put64bit(&buff,j->visited);
+		put32bit(&buff,j->dirscnt+((j->curdir)?1:0));
+		put32bit(&buff,j->cnt[0]);
+		put32bit(&buff,j->cnt[1]);
+		put32bit(&buff,j->cnt[2]);
+		put32bit(&buff,j->cnt[3]);
+	}
+}
+
+uint32_t fs_job_info_size(void) {
+	return 33;
+}
+
+void fs_job_info_data(uint32_t jobid,uint8_t *buff) {
+	fsjob *j;
+	fsjobresult *r;
+	uint32_t i;
+	put32bit(&buff,jobid);
+	for (j=fsjobshead ; j ; j=j->next) {
+		if (j->jobid==jobid) {
+			put8bit(&buff,ERROR_DELAYED);
+			put64bit(&buff,j->visited);
+			put32bit(&buff,j->dirscnt+((j->curdir)?1:0));
+			for (i=0 ; i<4 ; i++) {
+				put32bit(&buff,j->cnt[i]);
+			}
+			return;
+		}
+	}
+	for (r=fsjobresultshead ; r ; r=r->next) {
+		if (r->jobid==jobid) {
+			put8bit(&buff,STATUS_OK);
+			put64bit(&buff,r->visited);
+			put32bit(&buff,0);
+			for (i=0 ; i<4 ; i++) {
+				put32bit(&buff,r->cnt[i]);
+			}
+			return;
+		}
+	}
+	put8bit(&buff,ERROR_ENOENT);
+	memset(buff,0,28);
+}
+
+static void fs_jobs_term(void) {
+	fsjob *j,*jn;
+	fsjobresult *r,*rn;
+	for (j=fsjobshead ; j ; j=jn) {
+		jn = j->next;
+		syslog(LOG_NOTICE,"background job %"PRIu32" (inode: %"PRIu32") has been interrupted (%"PRIu64" entries done, %"PRIu32" directories left)",j->jobid,j->inode,j->visited,j->dirscnt+((j->curdir)?1:0));
+		if (j->dirs) {
+			free(j->dirs);
+		}
+		free(j);
+	}
+	fsjobshead = NULL;
+	fsjobscnt = 0;
+	for (r=fsjobresultshead ; r ; r=rn) {
+		rn = r->next;
+		free(r);
+	}
+	fsjobresultshead = NULL;
+}
+#else
+static uint8_t fs_setattrpart(uint8_t type,uint32_t ts,uint32_t inode,uint32_t uid,uint32_t value,uint8_t smode,uint32_t hfrom,uint32_t hto,uint32_t sinodes,uint32_t ncinodes,uint32_t nsinodes,uint32_t qeinodes) {
+	fsnode *p;
+	uint32_t cnt[4];
+	p = fsnodes_id_to_node(inode);
+	if (!p) {
+		return ERROR_ENOENT;
+	}
+	if (p->type!=TYPE_DIRECTORY) {
+		return ERROR_ENOTDIR;
+	}
+	memset(cnt,0,sizeof(cnt));
+	fsnodes_setattr_part(type,p,ts,uid,value,smode,hfrom,hto,cnt,NULL,NULL);
+	metaversion++;
+	if (cnt[0]!=sinodes || cnt[1]!=ncinodes || cnt[2]!=nsinodes || (qeinodes!=UINT32_C(0xFFFFFFFF) && cnt[3]!=qeinodes)) {
+		return ERROR_MISMATCH;
+	}
+	return STATUS_OK;
+}
+
+uint8_t fs_setgoalpart(uint32_t ts,uint32_t inode,uint32_t uid,uint8_t goal,uint8_t smode,uint32_t hfrom,uint32_t hto,uint32_t sinodes,uint32_t ncinodes,uint32_t nsinodes,uint32_t qeinodes) {
+	if (!SMODE_ISVALID(smode) || goal>9 || goal<1) {
+		return ERROR_EINVAL;
+	}
+	return fs_setattrpart(FSJOB_SETGOAL,ts,inode,uid,goal,smode,hfrom,hto,sinodes,ncinodes,nsinodes,qeinodes);
+}
+
+uint8_t fs_settrashtimepart(uint32_t ts,uint32_t inode,uint32_t uid,uint32_t trashtime,uint8_t smode,uint32_t hfrom,uint32_t hto,uint32_t sinodes,uint32_t ncinodes,uint32_t nsinodes) {
+	if (!SMODE_ISVALID(smode)) {
+		return ERROR_EINVAL;
+	}
+	return fs_setattrpart(FSJOB_SETTRASHTIME,ts,inode,uid,trashtime,smode,hfrom,hto,sinodes,ncinodes,nsinodes,0);
+}
+
+uint8_t fs_seteattrpart(uint32_t ts,uint32_t inode,uint32_t uid,uint8_t eattr,uint8_t smode,uint32_t hfrom,uint32_t hto,uint32_t sinodes,uint32_t ncinodes,uint32_t nsinodes) {
+	if (!SMODE_ISVALID(smode) || (eattr&(~(EATTR_NOOWNER|EATTR_NOACACHE|EATTR_NOECACHE|EATTR_NODATACACHE)))) {
+		return ERROR_EINVAL;
+	}
+	return fs_setattrpart(FSJOB_SETEATTR,ts,inode,uid,eattr,smode,hfrom,hto,sinodes,ncinodes,nsinodes,0);
+}
+#endif
+
 #ifndef METARESTORE
 #if VERSHEX>=0x010700
-uint8_t fs_setgoal(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t uid,uint8_t goal,uint8_t smode,uint32_t *sinodes,uint32_t *ncinodes,uint32_t *nsinodes,uint32_t *qeinodes) {
+uint8_t fs_setgoal(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t uid,uint8_t goal,uint8_t smode,uint32_t *sinodes,uint32_t *ncinodes,uint32_t *nsinodes,uint32_t *qeinodes,uint32_t *jobid) {
 #else
-uint8_t fs_setgoal(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t uid,uint8_t goal,uint8_t smode,uint32_t *sinodes,uint32_t *ncinodes,uint32_t *nsinodes) {
+uint8_t fs_setgoal(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t uid,uint8_t goal,uint8_t smode,uint32_t *sinodes,uint32_t *ncinodes,uint32_t *nsinodes,uint32_t *jobid) {
 #endif
 	uint32_t ts;
 	fsnode *rn;
@@ -5629,6 +7687,13 @@ uint8_t fs_setgoal(uint32_t ts,uint32_t inode,uint32_t uid,uint8_t goal,uint8_t
 		return ERROR_EPERM;
 	}
 
+#ifndef METARESTORE
+	fsnodes_lazy_touch(p);
+	if ((smode&SMODE_RMASK) && p->type==TYPE_DIRECTORY && fsnodes_subtree_nodes(p,FSJOB_SYNC_NODES)>=FSJOB_SYNC_NODES) {
+		*jobid = fs_job_start(FSJOB_SETGOAL,rootinode,p,uid,goal,smode);
+		return ERROR_DELAYED;
+	}
+#endif
 #if VERSHEX>=0x010700
 	quota = fsnodes_test_quota(p);
 #endif
@@ -5651,9 +7716,9 @@ uint8_t fs_setgoal(uint32_t ts,uint32_t inode,uint32_t uid,uint8_t goal,uint8_t
 
 #ifndef METARESTORE
 #if VERSHEX>=0x010700
-	changelog(metaversion++,"%"PRIu32"|SETGOAL(%"PRIu32",%"PRIu32",%"PRIu8",%"PRIu8"):%"PRIu32",%"PRIu32",%"PRIu32",%"PRIu32,ts,inode,uid,goal,smode,*sinodes,*ncinodes,*nsinodes,*qeinodes);
+	changelog(metaversion++,ts,CLOP_SETGOALQ,inode,uid,goal,smode,*sinodes,*ncinodes,*nsinodes,*qeinodes);
 #else
-	changelog(metaversion++,"%"PRIu32"|SETGOAL(%"PRIu32",%"PRIu32",%"PRIu8",%"PRIu8"):%"PRIu32",%"PRIu32",%"PRIu32,ts,inode,uid,goal,smode,*sinodes,*ncinodes,*nsinodes);
+	changelog(metaversion++,ts,CLOP_SETGOAL,inode,uid,goal,smode,*sinodes,*ncinodes,*nsinodes);
 #endif
 	return STATUS_OK;
 #else
@@ -5670,7 +7735,7 @@ uint8_t fs_setgoal(uint32_t ts,uint32_t inode,uint32_t uid,uint8_t goal,uint8_t
 }
 
 #ifndef METARESTORE
-uint8_t fs_settrashtime(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t uid,uint32_t trashtime,uint8_t smode,uint32_t *sinodes,uint32_t *ncinodes,uint32_t *nsinodes) {
+uint8_t fs_settrashtime(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t uid,uint32_t trashtime,uint8_t smode,uint32_t *sinodes,uint32_t *ncinodes,uint32_t *nsinodes,uint32_t *jobid) {
 	uint32_t ts;
 	fsnode *rn;
 #else
@@ -5734,6 +7799,11 @@ uint8_t fs_settrashtime(uint32_t ts,uint32_t inode,uint32_t uid,uint32_t trashti
 	}
 
 #ifndef METARESTORE
+	fsnodes_lazy_touch(p);
+	if ((smode&SMODE_RMASK) && p->type==TYPE_DIRECTORY && fsnodes_subtree_nodes(p,FSJOB_SYNC_NODES)>=FSJOB_SYNC_NODES) {
+		*jobid = fs_job_start(FSJOB_SETTRASHTIME,rootinode,p,uid,trashtime,smode);
+		return ERROR_DELAYED;
+	}
 	fsnodes_settrashtime_recursive(p,ts,uid,trashtime,smode,sinodes,ncinodes,nsinodes);
 	if ((smode&SMODE_RMASK)==0 && *nsinodes>0 && *sinodes==0 && *ncinodes==0) {
 		return ERROR_EPERM;
@@ -5743,7 +7813,7 @@ uint8_t fs_settrashtime(uint32_t ts,uint32_t inode,uint32_t uid,uint32_t trashti
 #endif
 
 #ifndef METARESTORE
-	changelog(metaversion++,"%"PRIu32"|SETTRASHTIME(%"PRIu32",%"PRIu32",%"PRIu32",%"PRIu8"):%"PRIu32",%"PRIu32",%"PRIu32,ts,inode,uid,trashtime,smode,*sinodes,*ncinodes,*nsinodes);
+	changelog(metaversion++,ts,CLOP_SETTRASHTIME,inode,uid,trashtime,smode,*sinodes,*ncinodes,*nsinodes);
 	return STATUS_OK;
 #else
 	metaversion++;
@@ -5755,7 +7825,7 @@ uint8_t fs_settrashtime(uint32_t ts,uint32_t inode,uint32_t uid,uint32_t trashti
 }
 
 #ifndef METARESTORE
-uint8_t fs_seteattr(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t uid,uint8_t eattr,uint8_t smode,uint32_t *sinodes,uint32_t *ncinodes,uint32_t *nsinodes) {
+uint8_t fs_seteattr(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t uid,uint8_t eattr,uint8_t smode,uint32_t *sinodes,uint32_t *ncinodes,uint32_t *nsinodes,uint32_t *jobid) {
 	uint32_t ts;
 	fsnode *rn;
 #else
@@ -5816,6 +7886,11 @@ uint8_t fs_seteattr(uint32_t ts,uint32_t inode,uint32_t uid,uint8_t eattr,uint8_
 #endif
 
 #ifndef METARESTORE
+	fsnodes_lazy_touch(p);
+	if ((smode&SMODE_RMASK) && p->type==TYPE_DIRECTORY && fsnodes_subtree_nodes(p,FSJOB_SYNC_NODES)>=FSJOB_SYNC_NODES) {
+		*jobid = fs_job_start(FSJOB_SETEATTR,rootinode,p,uid,eattr,smode);
+		return ERROR_DELAYED;
+	}
 	fsnodes_seteattr_recursive(p,ts,uid,eattr,smode,sinodes,ncinodes,nsinodes);
 	if ((smode&SMODE_RMASK)==0 && *nsinodes>0 && *sinodes==0 && *ncinodes==0) {
 		return ERROR_EPERM;
@@ -5825,7 +7900,7 @@ uint8_t fs_seteattr(uint32_t ts,uint32_t inode,uint32_t uid,uint8_t eattr,uint8_
 #endif
 
 #ifndef METARESTORE
-	changelog(metaversion++,"%"PRIu32"|SETEATTR(%"PRIu32",%"PRIu32",%"PRIu8",%"PRIu8"):%"PRIu32",%"PRIu32",%"PRIu32/*",%"PRIu32*/,ts,inode,uid,eattr,smode,*sinodes,*ncinodes,*nsinodes/*,*qeinodes*/);
+	changelog(metaversion++,ts,CLOP_SETEATTR,inode,uid,eattr,smode,*sinodes,*ncinodes,*nsinodes);
 	return STATUS_OK;
 #else
 	metaversion++;
@@ -5839,7 +7914,7 @@ uint8_t fs_seteattr(uint32_t ts,uint32_t inode,uint32_t uid,uint8_t eattr,uint8_
 
 
 
-#ifndef METARESTORE
+#if !defined(METARESTORE) || defined(SHADOW)
 
 uint8_t fs_listxattr_leng(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint8_t opened,uint32_t uid,uint32_t gid,void **xanode,uint32_t *xasize) {
 	fsnode *p,*rn;
@@ -5879,7 +7954,9 @@ uint8_t fs_listxattr_leng(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uin
 void fs_listxattr_data(void *xanode,uint8_t *xabuff) {
 	xattr_listattr_data(xanode,xabuff);
 }
+#endif
 
+#ifndef METARESTORE
 uint8_t fs_setxattr(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint8_t opened,uint32_t uid,uint32_t gid,uint8_t anleng,const uint8_t *attrname,uint32_t avleng,const uint8_t *attrvalue,uint8_t mode) {
 	uint32_t ts;
 	fsnode *p,*rn;
@@ -5928,10 +8005,12 @@ uint8_t fs_setxattr(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint8_t o
 		return status;
 	}
 	p->ctime = ts;
-	changelog(metaversion++,"%"PRIu32"|SETXATTR(%"PRIu32",%s,%s,%"PRIu8")",ts,inode,fsnodes_escape_name(anleng,attrname),fsnodes_escape_name(avleng,attrvalue),mode);
+	changelog(metaversion++,ts,CLOP_SETXATTR,inode,anleng,attrname,avleng,attrvalue,mode);
 	return STATUS_OK;
 }
+#endif
 
+#if !defined(METARESTORE) || defined(SHADOW)
 uint8_t fs_getxattr(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint8_t opened,uint32_t uid,uint32_t gid,uint8_t anleng,const uint8_t *attrname,uint32_t *avleng,uint8_t **attrvalue) {
 	fsnode *p,*rn;
 
@@ -5968,9 +8047,9 @@ uint8_t fs_getxattr(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint8_t o
 	}
 	return xattr_getattr(inode,anleng,attrname,avleng,attrvalue);
 }
+#endif
 
-#else /* METARESTORE */
-
+#ifdef METARESTORE
 uint8_t fs_setxattr(uint32_t ts,uint32_t inode,uint32_t anleng,const uint8_t *attrname,uint32_t avleng,const uint8_t *attrvalue,uint32_t mode) {
 	fsnode *p;
 	uint8_t status;
@@ -6040,7 +8119,7 @@ uint8_t fs_eattr(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t uid
 		} else {
 			p->mode = p->mode | ((*nodeeattr)<<12);
 		}
-		changelog(metaversion++,"%"PRIu32"|EATTR(%"PRIu32",%"PRIu16")",main_time(),inode,p->mode>>12);
+		changelog(metaversion++,main_time(),CLOP_EATTR,inode,p->mode>>12);
 		p->ctime = main_time();
 	}
 	*nodeeattr = p->mode>>12;
@@ -6205,9 +8284,9 @@ uint8_t fs_quotacontrol(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint8
 #if VERSHEX>=0x010700
 	if (chg) {
 		if (qn) {
-			changelog(metaversion++,"%"PRIu32"|QUOTA(%"PRIu32",%"PRIu8",%"PRIu8",%"PRIu32",%"PRIu32",%"PRIu32",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64")",main_time(),inode,qn->exceeded,qn->flags,qn->stimestamp,qn->sinodes,qn->hinodes,qn->slength,qn->hlength,qn->ssize,qn->hsize,qn->srealsize,qn->hrealsize);
+			changelog(metaversion++,main_time(),CLOP_QUOTA,inode,qn->exceeded,qn->flags,qn->stimestamp,qn->sinodes,qn->hinodes,qn->slength,qn->hlength,qn->ssize,qn->hsize,qn->srealsize,qn->hrealsize);
 		} else {
-			changelog(metaversion++,"%"PRIu32"|QUOTA(%"PRIu32",0,0,0,0,0,0,0,0,0,0,0)",main_time(),inode);
+			changelog(metaversion++,main_time(),CLOP_QUOTA,inode,0,0,(uint32_t)0,(uint32_t)0,(uint32_t)0,(uint64_t)0,(uint64_t)0,(uint64_t)0,(uint64_t)0,(uint64_t)0,(uint64_t)0);
 		}
 	}
 #else
@@ -6276,7 +8355,7 @@ uint32_t fs_getquotainfo_size() {
 	uint32_t s=0,size;
 //	s=4;	// QuotaTimeLimit
 	for (qn=quotahead ; qn ; qn=qn->next) {
-		size=fsnodes_getpath_size(qn->node->parents);
+		size=fsnodes_getpath_size(fsedge_ptr(qn->node->parents));
 		s+=4+4+1+1+4+3*(4+8+8+8)+1+size;
 	}
 	return s;
@@ -6291,10 +8370,10 @@ void fs_getquotainfo_data(uint8_t * buff) {
 	for (qn=quotahead ; qn ; qn=qn->next) {
 		psr = qn->node->data.ddata.stats;
 		put32bit(&buff,qn->node->id);
-		size=fsnodes_getpath_size(qn->node->parents);
+		size=fsnodes_getpath_size(fsedge_ptr(qn->node->parents));
 		put32bit(&buff,size+1);
 		put8bit(&buff,'/');
-		fsnodes_getpath_data(qn->node->parents,buff,size);
+		fsnodes_getpath_data(fsedge_ptr(qn->node->parents),buff,size);
 		buff+=size;
 		put8bit(&buff,qn->exceeded);
 		put8bit(&buff,qn->flags);
@@ -6359,7 +8438,7 @@ uint32_t fs_getdirpath_size(uint32_t inode) {
 		if (node->type!=TYPE_DIRECTORY) {
 			return 15; // "(not directory)"
 		} else {
-			return 1+fsnodes_getpath_size(node->parents);
+			return 1+fsnodes_getpath_size(fsedge_ptr(node->parents));
 		}
 	} else {
 		return 11; // "(not found)"
@@ -6379,7 +8458,7 @@ void fs_getdirpath_data(uint32_t inode,uint8_t *buff,uint32_t size) {
 		} else {
 			if (size>0) {
 				buff[0]='/';
-				fsnodes_getpath_data(node->parents,buff+1,size-1);
+				fsnodes_getpath_data(fsedge_ptr(node->parents),buff+1,size-1);
 				return;
 			}
 		}
@@ -6441,13 +8520,17 @@ void fs_add_files_to_chunks() {
 	uint32_t i,j;
 	uint64_t chunkid;
 	fsnode *f;
-	for (i=0 ; i<NODEHASHSIZE ; i++) {
-		for (f=nodehash[i] ; f ; f=f->next) {
+	fshash_finish(&nodehash);
+	for (i=0 ; i<nodehash.size ; i++) {
+		for (f=(fsnode*)(nodehash.tab[i]) ; f ; f=fsnode_ptr(f->next)) {
 			if (f->type==TYPE_FILE || f->type==TYPE_TRASH || f->type==TYPE_RESERVED) {
 				for (j=0 ; j<f->data.fdata.chunks ; j++) {
 					chunkid = f->data.fdata.chunktab[j];
 					if (chunkid>0) {
 						chunk_add_file(chunkid,f->goal);
+#ifndef METARESTORE
+						chunk_set_owner(chunkid,f->id);
+#endif
 					}
 				}
 			}
@@ -6464,8 +8547,7 @@ void fs_test_getdata(uint32_t *loopstart,uint32_t *loopend,uint32_t *files,uint3
 	*ugfiles = fsinfo_ugfiles;
 	*mfiles = fsinfo_mfiles;
 	*chunks = fsinfo_chunks;
-	*ugchunks = fsinfo_ugchunks;
-	*mchunks = fsinfo_mchunks;
+	chunk_get_problemrefs(ugchunks,mchunks);
 	*msgbuff = fsinfo_msgbuff;
 	*msgbuffleng = fsinfo_msgbuffleng;
 }
@@ -6474,43 +8556,73 @@ uint32_t fs_test_log_inconsistency(fsedge *e,const char *iname,char *buff,uint32
 	uint32_t leng;
 	leng=0;
 	if (e->parent) {
-		syslog(LOG_ERR,"structure error - %s inconsistency (edge: %"PRIu32",%s -> %"PRIu32")",iname,e->parent->id,fsnodes_escape_name(e->nleng,e->name),e->child->id);
+		syslog(LOG_ERR,"structure error - %s inconsistency (edge: %"PRIu32",%s -> %"PRIu32")",iname,fsnode_ptr(e->parent)->id,fsnodes_escape_name(e->nleng,e->name),fsnode_ptr(e->child)->id);
 		if (leng<size) {
-			leng += snprintf(buff+leng,size-leng,"structure error - %s inconsistency (edge: %"PRIu32",%s -> %"PRIu32")\n",iname,e->parent->id,fsnodes_escape_name(e->nleng,e->name),e->child->id);
+			leng += snprintf(buff+leng,size-leng,"structure error - %s inconsistency (edge: %"PRIu32",%s -> %"PRIu32")\n",iname,fsnode_ptr(e->parent)->id,fsnodes_escape_name(e->nleng,e->name),fsnode_ptr(e->child)->id);
 		}
 	} else {
-		if (e->child->type==TYPE_TRASH) {
-			syslog(LOG_ERR,"structure error - %s inconsistency (edge: TRASH,%s -> %"PRIu32")",iname,fsnodes_escape_name(e->nleng,e->name),e->child->id);
+		if (fsnode_ptr(e->child)->type==TYPE_TRASH) {
+			syslog(LOG_ERR,"structure error - %s inconsistency (edge: TRASH,%s -> %"PRIu32")",iname,fsnodes_escape_name(e->nleng,e->name),fsnode_ptr(e->child)->id);
 			if (leng<size) {
-				leng += snprintf(buff+leng,size-leng,"structure error - %s inconsistency (edge: TRASH,%s -> %"PRIu32")\n",iname,fsnodes_escape_name(e->nleng,e->name),e->child->id);
+				leng += snprintf(buff+leng,size-leng,"structure error - %s inconsistency (edge: TRASH,%s -> %"PRIu32")\n",iname,fsnodes_escape_name(e->nleng,e->name),fsnode_ptr(e->child)->id);
 			}
-		} else if (e->child->type==TYPE_RESERVED) {
-			syslog(LOG_ERR,"structure error - %s inconsistency (edge: RESERVED,%s -> %"PRIu32")",iname,fsnodes_escape_name(e->nleng,e->name),e->child->id);
+		} else if (fsnode_ptr(e->child)->type==TYPE_RESERVED) {
+			syslog(LOG_ERR,"structure error - %s inconsistency (edge: RESERVED,%s -> %"PRIu32")",iname,fsnodes_escape_name(e->nleng,e->name),fsnode_ptr(e->child)->id);
 			if (leng<size) {
-				leng += snprintf(buff+leng,size-leng,"structure error - %s inconsistency (edge: RESERVED,%s -> %"PRIu32")\n",iname,fsnodes_escape_name(e->nleng,e->name),e->child->id);
+				leng += snprintf(buff+leng,size-leng,"structure error - %s inconsistency (edge: RESERVED,%s -> %"PRIu32")\n",iname,fsnodes_escape_name(e->nleng,e->name),fsnode_ptr(e->child)->id);
 			}
 		} else {
-			syslog(LOG_ERR,"structure error - %s inconsistency (edge: NULL,%s -> %"PRIu32")",iname,fsnodes_escape_name(e->nleng,e->name),e->child->id);
+			syslog(LOG_ERR,"structure error - %s inconsistency (edge: NULL,%s -> %"PRIu32")",iname,fsnodes_escape_name(e->nleng,e->name),fsnode_ptr(e->child)->id);
 			if (leng<size) {
-				leng += snprintf(buff+leng,size-leng,"structure error - %s inconsistency (edge: NULL,%s -> %"PRIu32")\n",iname,fsnodes_escape_name(e->nleng,e->name),e->child->id);
+				leng += snprintf(buff+leng,size-leng,"structure error - %s inconsistency (edge: NULL,%s -> %"PRIu32")\n",iname,fsnodes_escape_name(e->nleng,e->name),fsnode_ptr(e->child)->id);
 			}
 		}
 	}
 	return leng;
 }
 
+void fs_test_markdirty(uint32_t inode) {
+	fsnode *f;
+	f = fsnodes_id_to_node(inode);
+	if (f && (f->type==TYPE_FILE || f->type==TYPE_TRASH || f->type==TYPE_RESERVED)) {
+		fsnodes_test_markdirty(f);
+	}
+}
+
+void fs_test_dirty(void) {
+	uint32_t refs;
+	fsnode *f;
+
+	if ((uint32_t)(main_time())<=test_dirty_start_time) {
+		return;
+	}
+	refs = 0;
+	while (testdirtyqelements>0 && refs<TEST_DIRTY_REFS) {
+		f = fsnodes_id_to_node(testdirtyq[--testdirtyqelements]);
+		if (f && (f->type==TYPE_FILE || f->type==TYPE_TRASH || f->type==TYPE_RESERVED) && (f->data.fdata.testflags & TEST_DIRTY)) {
+			f->data.fdata.testflags &= ~TEST_DIRTY;
+			fsnodes_test_setstate(f,fsnodes_test_getstate(f));
+			refs += f->data.fdata.chunks;
+		}
+		refs++;
+	}
+	if (testdirtyqsize>1024 && testdirtyqelements<testdirtyqsize/4) {
+		testdirtyqsize /= 2;
+		testdirtyq = realloc(testdirtyq,sizeof(uint32_t)*testdirtyqsize);
+		passert(testdirtyq);
+	}
+}
+
 void fs_test_files() {
 	static uint32_t i=0;
+	static uint32_t tsize=0;
 	uint32_t j;
 	uint32_t k;
+	uint8_t restarted;
 	uint64_t chunkid;
 	uint8_t vc,valid,ugflag;
 	static uint32_t files=0;
-	static uint32_t ugfiles=0;
-	static uint32_t mfiles=0;
 	static uint32_t chunks=0;
-	static uint32_t ugchunks=0;
-	static uint32_t mchunks=0;
 	static uint32_t errors=0;
 	static uint32_t notfoundchunks=0;
 	static uint32_t unavailchunks=0;
@@ -6525,12 +8637,32 @@ void fs_test_files() {
 	if ((uint32_t)(main_time())<=test_start_time) {
 		return;
 	}
-	if (i>=NODEHASHSIZE) {
+	if (nodehash.oldtab) {	// wait for end of rehashing
+		return;
+	}
+	restarted = 0;
+	if (nodehash.size!=tsize) {	// table has been resized - already tested buckets don't match tested nodes anymore, so loop is started again (without publishing partial results)
+		if (i>0) {
+			i=0;
+			errors=0;
+			files=0;
+			chunks=0;
+			notfoundchunks=0;
+			unavailchunks=0;
+			unavailfiles=0;
+			unavailtrashfiles=0;
+			unavailreservedfiles=0;
+			leng=0;
+			restarted = 1;
+		}
+		tsize = nodehash.size;
+	}
+	if (i>=nodehash.size) {
 		syslog(LOG_NOTICE,"structure check loop");
 		i=0;
 		errors=0;
 	}
-	if (i==0) {
+	if (i==0 && restarted==0) {
 		if (errors==ERRORS_LOG_MAX) {
 			syslog(LOG_ERR,"only first %u errors (unavailable chunks/files) were logged",ERRORS_LOG_MAX);
 			if (leng<MSGBUFFSIZE) {
@@ -6573,17 +8705,9 @@ void fs_test_files() {
 			unavailfiles=0;
 		}
 		fsinfo_files=files;
-		fsinfo_ugfiles=ugfiles;
-		fsinfo_mfiles=mfiles;
 		fsinfo_chunks=chunks;
-		fsinfo_ugchunks=ugchunks;
-		fsinfo_mchunks=mchunks;
 		files=0;
-		ugfiles=0;
-		mfiles=0;
 		chunks=0;
-		ugchunks=0;
-		mchunks=0;
 
 		if (fsinfo_msgbuff==NULL) {
 			fsinfo_msgbuff=malloc(MSGBUFFSIZE);
@@ -6602,14 +8726,15 @@ void fs_test_files() {
 		fsinfo_loopstart = fsinfo_loopend;
 		fsinfo_loopend = main_time();
 	}
-	for (k=0 ; k<(NODEHASHSIZE/14400) && i<NODEHASHSIZE ; k++,i++) {
-		for (f=nodehash[i] ; f ; f=f->next) {
+	for (k=0 ; k<(nodehash.size/FileTestLoopTime)+1 && i<nodehash.size ; k++,i++) {
+		for (f=(fsnode*)(nodehash.tab[i]) ; f ; f=fsnode_ptr(f->next)) {
 			if (f->type==TYPE_FILE || f->type==TYPE_TRASH || f->type==TYPE_RESERVED) {
 				valid = 1;
 				ugflag = 0;
 				for (j=0 ; j<f->data.fdata.chunks ; j++) {
 					chunkid = f->data.fdata.chunktab[j];
 					if (chunkid>0) {
+						chunk_set_owner(chunkid,f->id);
 						if (chunk_get_validcopies(chunkid,&vc)!=STATUS_OK) {
 							if (errors<ERRORS_LOG_MAX) {
 								syslog(LOG_ERR,"structure error - chunk %016"PRIX64" not found (inode: %"PRIu32" ; index: %"PRIu32")",chunkid,f->id,j);
@@ -6623,7 +8748,6 @@ void fs_test_files() {
 								syslog(LOG_ERR,"unknown chunks: %"PRIu32" ...",notfoundchunks);
 							}
 							valid =0;
-							mchunks++;
 						} else if (vc==0) {
 							if (errors<ERRORS_LOG_MAX) {
 								syslog(LOG_ERR,"currently unavailable chunk %016"PRIX64" (inode: %"PRIu32" ; index: %"PRIu32")",chunkid,f->id,j);
@@ -6637,21 +8761,19 @@ void fs_test_files() {
 								syslog(LOG_ERR,"unavailable chunks: %"PRIu32" ...",unavailchunks);
 							}
 							valid = 0;
-							mchunks++;
 						} else if (vc<f->goal) {
 							ugflag = 1;
-							ugchunks++;
 						}
 						chunks++;
 					}
 				}
+				fsnodes_test_setstate(f,(valid==0)?TEST_MISSING:(ugflag)?TEST_UNDERGOAL:0);
 				if (valid==0) {
-					mfiles++;
 					if (f->type==TYPE_TRASH) {
 						if (errors<ERRORS_LOG_MAX) {
-							syslog(LOG_ERR,"- currently unavailable file in trash %"PRIu32": %s",f->id,fsnodes_escape_name(f->parents->nleng,f->parents->name));
+							syslog(LOG_ERR,"- currently unavailable file in trash %"PRIu32": %s",f->id,fsnodes_escape_name(fsedge_ptr(f->parents)->nleng,fsedge_ptr(f->parents)->name));
 							if (leng<MSGBUFFSIZE) {
-								leng += snprintf(msgbuff+leng,MSGBUFFSIZE-leng,"- currently unavailable file in trash %"PRIu32": %s\n",f->id,fsnodes_escape_name(f->parents->nleng,f->parents->name));
+								leng += snprintf(msgbuff+leng,MSGBUFFSIZE-leng,"- currently unavailable file in trash %"PRIu32": %s\n",f->id,fsnodes_escape_name(fsedge_ptr(f->parents)->nleng,fsedge_ptr(f->parents)->name));
 							}
 							errors++;
 							unavailtrashfiles++;
@@ -6661,9 +8783,9 @@ void fs_test_files() {
 						}
 					} else if (f->type==TYPE_RESERVED) {
 						if (errors<ERRORS_LOG_MAX) {
-							syslog(LOG_ERR,"+ currently unavailable reserved file %"PRIu32": %s",f->id,fsnodes_escape_name(f->parents->nleng,f->parents->name));
+							syslog(LOG_ERR,"+ currently unavailable reserved file %"PRIu32": %s",f->id,fsnodes_escape_name(fsedge_ptr(f->parents)->nleng,fsedge_ptr(f->parents)->name));
 							if (leng<MSGBUFFSIZE) {
-								leng += snprintf(msgbuff+leng,MSGBUFFSIZE-leng,"+ currently unavailable reserved file %"PRIu32": %s\n",f->id,fsnodes_escape_name(f->parents->nleng,f->parents->name));
+								leng += snprintf(msgbuff+leng,MSGBUFFSIZE-leng,"+ currently unavailable reserved file %"PRIu32": %s\n",f->id,fsnodes_escape_name(fsedge_ptr(f->parents)->nleng,fsedge_ptr(f->parents)->name));
 							}
 							errors++;
 							unavailreservedfiles++;
@@ -6674,7 +8796,7 @@ void fs_test_files() {
 					} else {
 						uint8_t *path;
 						uint16_t pleng;
-						for (e=f->parents ; e ; e=e->nextparent) {
+						for (e=fsedge_ptr(f->parents) ; e ; e=fsedge_ptr(e->nextparent)) {
 							if (errors<ERRORS_LOG_MAX) {
 								fsnodes_getpath(e,&pleng,&path);
 								syslog(LOG_ERR,"* currently unavailable file %"PRIu32": %s",f->id,fsnodes_escape_name(pleng,path));
@@ -6690,26 +8812,24 @@ void fs_test_files() {
 							}
 						}
 					}
-				} else if (ugflag) {
-					ugfiles++;
 				}
 				files++;
 			}
-			for (e=f->parents ; e ; e=e->nextparent) {
-				if (e->child != f) {
+			for (e=fsedge_ptr(f->parents) ; e ; e=fsedge_ptr(e->nextparent)) {
+				if (fsnode_ptr(e->child) != f) {
 					if (e->parent) {
-						syslog(LOG_ERR,"structure error - edge->child/child->edges (node: %"PRIu32" ; edge: %"PRIu32",%s -> %"PRIu32")",f->id,e->parent->id,fsnodes_escape_name(e->nleng,e->name),e->child->id);
+						syslog(LOG_ERR,"structure error - edge->child/child->edges (node: %"PRIu32" ; edge: %"PRIu32",%s -> %"PRIu32")",f->id,fsnode_ptr(e->parent)->id,fsnodes_escape_name(e->nleng,e->name),fsnode_ptr(e->child)->id);
 						if (leng<MSGBUFFSIZE) {
-							leng += snprintf(msgbuff+leng,MSGBUFFSIZE-leng,"structure error - edge->child/child->edges (node: %"PRIu32" ; edge: %"PRIu32",%s -> %"PRIu32")\n",f->id,e->parent->id,fsnodes_escape_name(e->nleng,e->name),e->child->id);
+							leng += snprintf(msgbuff+leng,MSGBUFFSIZE-leng,"structure error - edge->child/child->edges (node: %"PRIu32" ; edge: %"PRIu32",%s -> %"PRIu32")\n",f->id,fsnode_ptr(e->parent)->id,fsnodes_escape_name(e->nleng,e->name),fsnode_ptr(e->child)->id);
 						}
 					} else {
-						syslog(LOG_ERR,"structure error - edge->child/child->edges (node: %"PRIu32" ; edge: NULL,%s -> %"PRIu32")",f->id,fsnodes_escape_name(e->nleng,e->name),e->child->id);
+						syslog(LOG_ERR,"structure error - edge->child/child->edges (node: %"PRIu32" ; edge: NULL,%s -> %"PRIu32")",f->id,fsnodes_escape_name(e->nleng,e->name),fsnode_ptr(e->child)->id);
 						if (leng<MSGBUFFSIZE) {
-							leng += snprintf(msgbuff+leng,MSGBUFFSIZE-leng,"structure error - edge->child/child->edges (node: %"PRIu32" ; edge: NULL,%s -> %"PRIu32")\n",f->id,fsnodes_escape_name(e->nleng,e->name),e->child->id);
+							leng += snprintf(msgbuff+leng,MSGBUFFSIZE-leng,"structure error - edge->child/child->edges (node: %"PRIu32" ; edge: NULL,%s -> %"PRIu32")\n",f->id,fsnodes_escape_name(e->nleng,e->name),fsnode_ptr(e->child)->id);
 						}
 					}
 				} else if (e->nextchild) {
-					if (e->nextchild->prevchild != &(e->nextchild)) {
+					if (fsedge_ptr(e->nextchild)->prevchild != fsedge_handle(e)) {
 						if (leng<MSGBUFFSIZE) {
 							leng += fs_test_log_inconsistency(e,"nextchild/prevchild",msgbuff+leng,MSGBUFFSIZE-leng);
 						} else {
@@ -6717,7 +8837,7 @@ void fs_test_files() {
 						}
 					}
 				} else if (e->nextparent) {
-					if (e->nextparent->prevparent != &(e->nextparent)) {
+					if (fsedge_ptr(e->nextparent)->prevparent != fsedge_handle(e)) {
 						if (leng<MSGBUFFSIZE) {
 							leng += fs_test_log_inconsistency(e,"nextparent/prevparent",msgbuff+leng,MSGBUFFSIZE-leng);
 						} else {
@@ -6726,7 +8846,7 @@ void fs_test_files() {
 					}
 #ifdef EDGEHASH
 				} else if (e->next) {
-					if (e->next->prev != &(e->next)) {
+					if (fsedge_ptr(e->next)->prev != fsedge_handle(e)) {
 						if (leng<MSGBUFFSIZE) {
 							leng += fs_test_log_inconsistency(e,"nexthash/prevhash",msgbuff+leng,MSGBUFFSIZE-leng);
 						} else {
@@ -6737,21 +8857,21 @@ void fs_test_files() {
 				}
 			}
 			if (f->type == TYPE_DIRECTORY) {
-				for (e=f->data.ddata.children ; e ; e=e->nextchild) {
-					if (e->parent != f) {
+				for (e=fsedge_ptr(f->data.ddata.children) ; e ; e=fsedge_ptr(e->nextchild)) {
+					if (fsnode_ptr(e->parent) != f) {
 						if (e->parent) {
-							syslog(LOG_ERR,"structure error - edge->parent/parent->edges (node: %"PRIu32" ; edge: %"PRIu32",%s -> %"PRIu32")",f->id,e->parent->id,fsnodes_escape_name(e->nleng,e->name),e->child->id);
+							syslog(LOG_ERR,"structure error - edge->parent/parent->edges (node: %"PRIu32" ; edge: %"PRIu32",%s -> %"PRIu32")",f->id,fsnode_ptr(e->parent)->id,fsnodes_escape_name(e->nleng,e->name),fsnode_ptr(e->child)->id);
 							if (leng<MSGBUFFSIZE) {
-								leng += snprintf(msgbuff+leng,MSGBUFFSIZE-leng,"structure error - edge->parent/parent->edges (node: %"PRIu32" ; edge: %"PRIu32",%s -> %"PRIu32")\n",f->id,e->parent->id,fsnodes_escape_name(e->nleng,e->name),e->child->id);
+								leng += snprintf(msgbuff+leng,MSGBUFFSIZE-leng,"structure error - edge->parent/parent->edges (node: %"PRIu32" ; edge: %"PRIu32",%s -> %"PRIu32")\n",f->id,fsnode_ptr(e->parent)->id,fsnodes_escape_name(e->nleng,e->name),fsnode_ptr(e->child)->id);
 							}
 						} else {
-							syslog(LOG_ERR,"structure error - edge->parent/parent->edges (node: %"PRIu32" ; edge: NULL,%s -> %"PRIu32")",f->id,fsnodes_escape_name(e->nleng,e->name),e->child->id);
+							syslog(LOG_ERR,"structure error - edge->parent/parent->edges (node: %"PRIu32" ; edge: NULL,%s -> %"PRIu32")",f->id,fsnodes_escape_name(e->nleng,e->name),fsnode_ptr(e->child)->id);
 							if (leng<MSGBUFFSIZE) {
-								leng += snprintf(msgbuff+leng,MSGBUFFSIZE-leng,"structure error - edge->parent/parent->edges (node: %"PRIu32" ; edge: NULL,%s -> %"PRIu32")\n",f->id,fsnodes_escape_name(e->nleng,e->name),e->child->id);
+								leng += snprintf(msgbuff+leng,MSGBUFFSIZE-leng,"structure error - edge->parent/parent->edges (node: %"PRIu32" ; edge: NULL,%s -> %"PRIu32")\n",f->id,fsnodes_escape_name(e->nleng,e->name),fsnode_ptr(e->child)->id);
 							}
 						}
 					} else if (e->nextchild) {
-						if (e->nextchild->prevchild != &(e->nextchild)) {
+						if (fsedge_ptr(e->nextchild)->prevchild != fsedge_handle(e)) {
 							if (leng<MSGBUFFSIZE) {
 								leng += fs_test_log_inconsistency(e,"nextchild/prevchild",msgbuff+leng,MSGBUFFSIZE-leng);
 							} else {
@@ -6759,7 +8879,7 @@ void fs_test_files() {
 							}
 						}
 					} else if (e->nextparent) {
-						if (e->nextparent->prevparent != &(e->nextparent)) {
+						if (fsedge_ptr(e->nextparent)->prevparent != fsedge_handle(e)) {
 							if (leng<MSGBUFFSIZE) {
 								leng += fs_test_log_inconsistency(e,"nextparent/prevparent",msgbuff+leng,MSGBUFFSIZE-leng);
 							} else {
@@ -6768,7 +8888,7 @@ void fs_test_files() {
 						}
 #ifdef EDGEHASH
 					} else if (e->next) {
-						if (e->next->prev != &(e->next)) {
+						if (fsedge_ptr(e->next)->prev != fsedge_handle(e)) {
 							if (leng<MSGBUFFSIZE) {
 								leng += fs_test_log_inconsistency(e,"nexthash/prevhash",msgbuff+leng,MSGBUFFSIZE-leng);
 							} else {
@@ -6785,35 +8905,53 @@ void fs_test_files() {
 #endif
 
 
+// master purges at most EMPTY_TRASH_LIMIT files per call, metarestore purges exactly as many as master did
 #ifndef METARESTORE
 void fs_emptytrash(void) {
-	uint32_t ts;
+	uint32_t ts,limit;
 #else
 uint8_t fs_emptytrash(uint32_t ts,uint32_t freeinodes,uint32_t reservedinodes) {
+	uint32_t limit;
 #endif
 	uint32_t fi,ri;
-	fsedge *e;
+	uint64_t key,nkey;
 	fsnode *p;
 #ifndef METARESTORE
 	ts = main_time();
+	limit = (EmptyTrashLimit>0)?EmptyTrashLimit:0xFFFFFFFF;
+#else
+	limit = freeinodes+reservedinodes;
 #endif
+	if (trashheap.elements>2*trashnodes+PURGEHEAP_SLACK) {
+		fsnodes_purgeindex_rebuild(1);
+	}
 	fi=0;
 	ri=0;
-	e = trash;
-	while (e) {
-		p = e->child;
-		e = e->nextchild;
-		if (((uint64_t)(p->atime) + (uint64_t)(p->trashtime) < (uint64_t)ts) && ((uint64_t)(p->mtime) + (uint64_t)(p->trashtime) < (uint64_t)ts) && ((uint64_t)(p->ctime) + (uint64_t)(p->trashtime) < (uint64_t)ts)) {
-			if (fsnodes_purge(ts,p)) {
-				fi++;
-			} else {
-				ri++;
-			}
+	while (trashheap.elements>0 && fi+ri<limit) {
+		key = trashheap.keys[0];
+		if ((key>>32)>=ts) {
+			break;
+		}
+		p = fsnodes_id_to_node(key&0xFFFFFFFF);
+		if (p==NULL || p->type!=TYPE_TRASH) {
+			fsnodes_purgeheap_pop(&trashheap);
+			continue;
+		}
+		nkey = fsnodes_trash_key(p);
+		if (nkey>key) {	// accessed or modified after being queued
+			fsnodes_purgeheap_replacetop(&trashheap,nkey);
+			continue;
+		}
+		fsnodes_purgeheap_pop(&trashheap);
+		if (fsnodes_purge(ts,p)) {
+			fi++;
+		} else {
+			ri++;
 		}
 	}
 #ifndef METARESTORE
 	if ((fi|ri)>0) {
-		changelog(metaversion++,"%"PRIu32"|EMPTYTRASH():%"PRIu32",%"PRIu32,ts,fi,ri);
+		changelog(metaversion++,ts,CLOP_EMPTYTRASH,fi,ri);
 	}
 #else
 	metaversion++;
@@ -6826,29 +8964,31 @@ uint8_t fs_emptytrash(uint32_t ts,uint32_t freeinodes,uint32_t reservedinodes) {
 
 #ifndef METARESTORE
 void fs_emptyreserved(void) {
-	uint32_t ts;
+	uint32_t ts,limit;
 #else
 uint8_t fs_emptyreserved(uint32_t ts,uint32_t freeinodes) {
+	uint32_t limit;
 #endif
-	fsedge *e;
 	fsnode *p;
 	uint32_t fi;
 #ifndef METARESTORE
 	ts = main_time();
+	limit = (EmptyTrashLimit>0)?EmptyTrashLimit:0xFFFFFFFF;
+#else
+	limit = freeinodes;
 #endif
 	fi=0;
-	e = reserved;
-	while (e) {
-		p = e->child;
-		e = e->nextchild;
-		if (p->data.fdata.sessionids==NULL) {
+	while (reservedheap.elements>0 && fi<limit) {
+		p = fsnodes_id_to_node(reservedheap.keys[0]);
+		fsnodes_purgeheap_pop(&reservedheap);
+		if (p!=NULL && p->type==TYPE_RESERVED && p->data.fdata.sessionids==NULL) {
 			fsnodes_purge(ts,p);
 			fi++;
 		}
 	}
 #ifndef METARESTORE
 	if (fi>0) {
-		changelog(metaversion++,"%"PRIu32"|EMPTYRESERVED():%"PRIu32,ts,fi);
+		changelog(metaversion++,ts,CLOP_EMPTYRESERVED,fi);
 	}
 #else
 	metaversion++;
@@ -6860,30 +9000,26 @@ uint8_t fs_emptyreserved(uint32_t ts,uint32_t freeinodes) {
 }
 
 
-#ifdef METARESTORE
-
 uint64_t fs_getversion() {
 	return metaversion;
 }
 
-#endif
-
 enum {FLAG_TREE,FLAG_TRASH,FLAG_RESERVED};
 
 #ifdef METARESTORE
 /* DUMP */
 
 void fs_dumpedge(fsedge *e) {
-	if (e->parent==NULL) {
-		if (e->child->type==TYPE_TRASH) {
-			printf("E|p:     TRASH|c:%10"PRIu32"|n:%s\n",e->child->id,fsnodes_escape_name(e->nleng,e->name));
-		} else if (e->child->type==TYPE_RESERVED) {
-			printf("E|p:  RESERVED|c:%10"PRIu32"|n:%s\n",e->child->id,fsnodes_escape_name(e->nleng,e->name));
+	if (e->parent==0) {
+		if (fsnode_ptr(e->child)->type==TYPE_TRASH) {
+			printf("E|p:     TRASH|c:%10"PRIu32"|n:%s\n",fsnode_ptr(e->child)->id,fsnodes_escape_name(e->nleng,e->name));
+		} else if (fsnode_ptr(e->child)->type==TYPE_RESERVED) {
+			printf("E|p:  RESERVED|c:%10"PRIu32"|n:%s\n",fsnode_ptr(e->child)->id,fsnodes_escape_name(e->nleng,e->name));
 		} else {
-			printf("E|p:      NULL|c:%10"PRIu32"|n:%s\n",e->child->id,fsnodes_escape_name(e->nleng,e->name));
+			printf("E|p:      NULL|c:%10"PRIu32"|n:%s\n",fsnode_ptr(e->child)->id,fsnodes_escape_name(e->nleng,e->name));
 		}
 	} else {
-		printf("E|p:%10"PRIu32"|c:%10"PRIu32"|n:%s\n",e->parent->id,e->child->id,fsnodes_escape_name(e->nleng,e->name));
+		printf("E|p:%10"PRIu32"|c:%10"PRIu32"|n:%s\n",fsnode_ptr(e->parent)->id,fsnode_ptr(e->child)->id,fsnodes_escape_name(e->nleng,e->name));
 	}
 }
 
@@ -6968,8 +9104,9 @@ void fs_dumpnode(fsnode *f) {
 void fs_dumpnodes() {
 	uint32_t i;
 	fsnode *p;
-	for (i=0 ; i<NODEHASHSIZE ; i++) {
-		for (p=nodehash[i] ; p ; p=p->next) {
+	fshash_finish(&nodehash);
+	for (i=0 ; i<nodehash.size ; i++) {
+		for (p=(fsnode*)(nodehash.tab[i]) ; p ; p=fsnode_ptr(p->next)) {
 			fs_dumpnode(p);
 		}
 	}
@@ -6978,16 +9115,16 @@ void fs_dumpnodes() {
 void fs_dumpedgelist(fsedge *e) {
 	while (e) {
 		fs_dumpedge(e);
-		e=e->nextchild;
+		e=fsedge_ptr(e->nextchild);
 	}
 }
 
 void fs_dumpedges(fsnode *f) {
 	fsedge *e;
-	fs_dumpedgelist(f->data.ddata.children);
-	for (e=f->data.ddata.children ; e ; e=e->nextchild) {
-		if (e->child->type==TYPE_DIRECTORY) {
-			fs_dumpedges(e->child);
+	fs_dumpedgelist(fsedge_ptr(f->data.ddata.children));
+	for (e=fsedge_ptr(f->data.ddata.children) ; e ; e=fsedge_ptr(e->nextchild)) {
+		if (fsnode_ptr(e->child)->type==TYPE_DIRECTORY) {
+			fs_dumpedges(fsnode_ptr(e->child));
 		}
 	}
 }
@@ -7014,8 +9151,8 @@ void xattr_dump() {
 void fs_dump(void) {
 	fs_dumpnodes();
 	fs_dumpedges(root);
-	fs_dumpedgelist(trash);
-	fs_dumpedgelist(reserved);
+	fs_dumpedgelist(fsedge_ptr(trash));
+	fs_dumpedgelist(fsedge_ptr(reserved));
 	fs_dumpfree();
 	xattr_dump();
 }
@@ -7228,12 +9365,12 @@ void fs_storeedge(fsedge *e,FILE *fd) {
 		return;
 	}
 	ptr = uedgebuff;
-	if (e->parent==NULL) {
+	if (e->parent==0) {
 		put32bit(&ptr,0);
 	} else {
-		put32bit(&ptr,e->parent->id);
+		put32bit(&ptr,fsnode_ptr(e->parent)->id);
 	}
-	put32bit(&ptr,e->child->id);
+	put32bit(&ptr,fsnode_ptr(e->child)->id);
 	put16bit(&ptr,e->nleng);
 	memcpy(ptr,e->name,e->nleng);
 	if (fwrite(uedgebuff,1,4+4+2+e->nleng,fd)!=(size_t)(4+4+2+e->nleng)) {
@@ -7242,149 +9379,166 @@ void fs_storeedge(fsedge *e,FILE *fd) {
 	}
 }
 
-int fs_loadedge(FILE *fd,int ignoreflag) {
+// part of NODE/EDGE section parsed by one thread of indexed loader
+typedef struct _loadpart {
+	uint64_t offset,endoffset;
+	uint32_t records;
+	void *entries;		// nodeentry or edgeentry table
+	uint32_t *sessions;	// (inode,sessionid) pairs - attached after parsing
+	uint32_t sessionscnt,sessionssize;
+	uint32_t dirnodes,filenodes;
+	fsslab nodeslab;	// objects are allocated in private slabs and merged after parsing
+	fsslab edgeslab[FSEDGE_CLASSES];
+} loadpart;
+
+typedef struct _nodeentry {
+	fsnode *node;
+	uint32_t id;
+} nodeentry;
+
+typedef struct _edgeentry {
+	fsedge *edge;
+	uint32_t parent_id,child_id;
+} edgeentry;
+
+static inline void fs_loadpart_addsession(loadpart *lp,uint32_t inode,uint32_t sessionid) {
+	if (lp->sessionscnt>=lp->sessionssize) {
+		lp->sessionssize = (lp->sessionssize==0)?256:lp->sessionssize*2;
+		lp->sessions = realloc(lp->sessions,sizeof(uint32_t)*2*lp->sessionssize);
+		passert(lp->sessions);
+	}
+	lp->sessions[lp->sessionscnt*2] = inode;
+	lp->sessions[lp->sessionscnt*2+1] = sessionid;
+	lp->sessionscnt++;
+}
+
+static uint32_t *edge_root_tail;	// link to be set by next edge (children of parent or nextchild of last edge)
+static uint32_t *edge_current_tail;
+static uint32_t edge_root_last,edge_current_last;
+static uint32_t edge_current_parent_id;
+static uint8_t edge_nl;
+static uint64_t edge_count;
+
+// reads one edge record (edge is allocated in given slab) - returns 1 when end marker has been read
+static int fs_readedge(FILE *fd,fsslab *es,fsedge **ep,uint32_t *parent_id,uint32_t *child_id,uint8_t *nl) {
 	uint8_t uedgebuff[4+4+2];
 	const uint8_t *ptr;
-	uint32_t parent_id;
-	uint32_t child_id;
-#ifdef EDGEHASH
-	uint32_t hpos;
-#endif
+	uint16_t nleng;
 	fsedge *e;
-#ifndef METARESTORE
-	statsrecord sr;
-#endif
-	static fsedge **root_tail;
-	static fsedge **current_tail;
-	static uint32_t current_parent_id;
-	static uint8_t nl;
-
-	if (fd==NULL) {
-		current_parent_id = 0;
-		current_tail = NULL;
-		root_tail = NULL;
-		nl = 1;
-		return 0;
-	}
 
 	if (fread(uedgebuff,1,4+4+2,fd)!=4+4+2) {
 		int err = errno;
-		if (nl) {
+		if (*nl) {
 			fputc('\n',stderr);
-			nl=0;
+			*nl=0;
 		}
 		errno = err;
 		mfs_errlog(LOG_ERR,"loading edge: read error");
 		return -1;
 	}
 	ptr = uedgebuff;
-	parent_id = get32bit(&ptr);
-	child_id = get32bit(&ptr);
-	if (parent_id==0 && child_id==0) {	// last edge
+	*parent_id = get32bit(&ptr);
+	*child_id = get32bit(&ptr);
+	if (*parent_id==0 && *child_id==0) {	// last edge
 		return 1;
 	}
-	e = malloc(sizeof(fsedge));
-	passert(e);
-	e->nleng = get16bit(&ptr);
-	if (e->nleng==0) {
-		if (nl) {
+	nleng = get16bit(&ptr);
+	if (nleng==0) {
+		if (*nl) {
 			fputc('\n',stderr);
-			nl=0;
+			*nl=0;
 		}
-		mfs_arg_syslog(LOG_ERR,"loading edge: %"PRIu32"->%"PRIu32" error: empty name",parent_id,child_id);
-		free(e);
+		mfs_arg_syslog(LOG_ERR,"loading edge: %"PRIu32"->%"PRIu32" error: empty name",*parent_id,*child_id);
 		return -1;
 	}
-	e->name = malloc(e->nleng);
-	passert(e->name);
+	e = fsedge_malloc_slab(es,nleng);
 	if (fread(e->name,1,e->nleng,fd)!=e->nleng) {
 		int err = errno;
-		if (nl) {
+		if (*nl) {
 			fputc('\n',stderr);
-			nl=0;
+			*nl=0;
 		}
 		errno = err;
 		mfs_errlog(LOG_ERR,"loading edge: read error");
-		free(e->name);
-		free(e);
+		fsedge_free_slab(es,e);
 		return -1;
 	}
-	e->child = fsnodes_id_to_node(child_id);
-	if (e->child==NULL) {
-		if (nl) {
+	*ep = e;
+	return 0;
+}
+
+// connects loaded edge - e->child and e->parent have to be already found (NULL when not found)
+static int fs_linkedge(fsedge *e,uint32_t parent_id,uint32_t child_id,int ignoreflag) {
+	fsnode *child,*parent;
+	uint32_t eh;
+#ifndef METARESTORE
+	statsrecord sr;
+#endif
+
+	if (e->child==0) {
+		if (edge_nl) {
 			fputc('\n',stderr);
-			nl=0;
+			edge_nl=0;
 		}
 		mfs_arg_syslog(LOG_ERR,"loading edge: %"PRIu32",%s->%"PRIu32" error: child not found",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id);
-		free(e->name);
-		free(e);
+		fsedge_free(e);
 		if (ignoreflag) {
 			return 0;
 		}
 		return -1;
 	}
+	child = fsnode_ptr(e->child);
+	parent = fsnode_ptr(e->parent);
 	if (parent_id==0) {
-		if (e->child->type==TYPE_TRASH) {
-			e->parent = NULL;
-			e->nextchild = trash;
-			if (e->nextchild) {
-				e->nextchild->prevchild = &(e->nextchild);
-			}
-			trash = e;
-			e->prevchild = &trash;
+		if (child->type==TYPE_TRASH) {
+			e->parent = 0;
+			fsnodes_childlist_add(&trash,e);
 #ifdef EDGEHASH
-			e->next = NULL;
-			e->prev = NULL;
+			e->next = 0;
+			e->prev = 0;
 #endif
-			trashspace += e->child->data.fdata.length;
+			trashspace += child->data.fdata.length;
 			trashnodes++;
-		} else if (e->child->type==TYPE_RESERVED) {
-			e->parent = NULL;
-			e->nextchild = reserved;
-			if (e->nextchild) {
-				e->nextchild->prevchild = &(e->nextchild);
-			}
-			reserved = e;
-			e->prevchild = &reserved;
+		} else if (child->type==TYPE_RESERVED) {
+			e->parent = 0;
+			fsnodes_childlist_add(&reserved,e);
 #ifdef EDGEHASH
-			e->next = NULL;
-			e->prev = NULL;
+			e->next = 0;
+			e->prev = 0;
 #endif
-			reservedspace += e->child->data.fdata.length;
+			reservedspace += child->data.fdata.length;
 			reservednodes++;
 		} else {
-			if (nl) {
+			if (edge_nl) {
 				fputc('\n',stderr);
-				nl=0;
+				edge_nl=0;
 			}
-			fprintf(stderr,"loading edge: %"PRIu32",%s->%"PRIu32" error: bad child type (%c)\n",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id,e->child->type);
+			fprintf(stderr,"loading edge: %"PRIu32",%s->%"PRIu32" error: bad child type (%c)\n",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id,child->type);
 #ifndef METARESTORE
-			syslog(LOG_ERR,"loading edge: %"PRIu32",%s->%"PRIu32" error: bad child type (%c)",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id,e->child->type);
+			syslog(LOG_ERR,"loading edge: %"PRIu32",%s->%"PRIu32" error: bad child type (%c)",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id,child->type);
 #endif
-			free(e->name);
-			free(e);
+			fsedge_free(e);
 			return -1;
 		}
 	} else {
-		e->parent = fsnodes_id_to_node(parent_id);
-		if (e->parent==NULL) {
-			if (nl) {
+		if (parent==NULL) {
+			if (edge_nl) {
 				fputc('\n',stderr);
-				nl=0;
+				edge_nl=0;
 			}
 			fprintf(stderr,"loading edge: %"PRIu32",%s->%"PRIu32" error: parent not found\n",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id);
 #ifndef METARESTORE
 			syslog(LOG_ERR,"loading edge: %"PRIu32",%s->%"PRIu32" error: parent not found",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id);
 #endif
 			if (ignoreflag) {
-				e->parent = fsnodes_id_to_node(MFS_ROOT_ID);
-				if (e->parent==NULL || e->parent->type!=TYPE_DIRECTORY) {
+				parent = fsnodes_id_to_node(MFS_ROOT_ID);
+				e->parent = fsnode_handle(parent);
+				if (parent==NULL || parent->type!=TYPE_DIRECTORY) {
 					fprintf(stderr,"loading edge: %"PRIu32",%s->%"PRIu32" root dir not found !!!\n",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id);
 #ifndef METARESTORE
 					syslog(LOG_ERR,"loading edge: %"PRIu32",%s->%"PRIu32" root dir not found !!!",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id);
 #endif
-					free(e->name);
-					free(e);
+					fsedge_free(e);
 					return -1;
 				}
 				fprintf(stderr,"loading edge: %"PRIu32",%s->%"PRIu32" attaching node to root dir\n",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id);
@@ -7394,29 +9548,28 @@ int fs_loadedge(FILE *fd,int ignoreflag) {
 				parent_id = MFS_ROOT_ID;
 			} else {
 				fprintf(stderr,"use mfsmetarestore (option -i) to attach this node to root dir\n");
-				free(e->name);
-				free(e);
+				fsedge_free(e);
 				return -1;
 			}
 		}
-		if (e->parent->type!=TYPE_DIRECTORY) {
-			if (nl) {
+		if (parent->type!=TYPE_DIRECTORY) {
+			if (edge_nl) {
 				fputc('\n',stderr);
-				nl=0;
+				edge_nl=0;
 			}
-			fprintf(stderr,"loading edge: %"PRIu32",%s->%"PRIu32" error: bad parent type (%c)\n",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id,e->parent->type);
+			fprintf(stderr,"loading edge: %"PRIu32",%s->%"PRIu32" error: bad parent type (%c)\n",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id,parent->type);
 #ifndef METARESTORE
-			syslog(LOG_ERR,"loading edge: %"PRIu32",%s->%"PRIu32" error: bad parent type (%c)",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id,e->parent->type);
+			syslog(LOG_ERR,"loading edge: %"PRIu32",%s->%"PRIu32" error: bad parent type (%c)",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id,parent->type);
 #endif
 			if (ignoreflag) {
-				e->parent = fsnodes_id_to_node(MFS_ROOT_ID);
-				if (e->parent==NULL || e->parent->type!=TYPE_DIRECTORY) {
+				parent = fsnodes_id_to_node(MFS_ROOT_ID);
+				e->parent = fsnode_handle(parent);
+				if (parent==NULL || parent->type!=TYPE_DIRECTORY) {
 					fprintf(stderr,"loading edge: %"PRIu32",%s->%"PRIu32" root dir not found !!!\n",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id);
 #ifndef METARESTORE
 					syslog(LOG_ERR,"loading edge: %"PRIu32",%s->%"PRIu32" root dir not found !!!",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id);
 #endif
-					free(e->name);
-					free(e);
+					fsedge_free(e);
 					return -1;
 				}
 				fprintf(stderr,"loading edge: %"PRIu32",%s->%"PRIu32" attaching node to root dir\n",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id);
@@ -7426,49 +9579,54 @@ int fs_loadedge(FILE *fd,int ignoreflag) {
 				parent_id = MFS_ROOT_ID;
 			} else {
 				fprintf(stderr,"use mfsmetarestore (option -i) to attach this node to root dir\n");
-				free(e->name);
-				free(e);
+				fsedge_free(e);
 				return -1;
 			}
 		}
 		if (parent_id==MFS_ROOT_ID) {	// special case - because of 'ignoreflag' and possibility of attaching orphans into root node
-			if (root_tail==NULL) {
-				root_tail = &(e->parent->data.ddata.children);
+			if (edge_root_tail==NULL) {
+				edge_root_tail = &(parent->data.ddata.children);
+				edge_root_last = 0;
 			}
-		} else if (current_parent_id!=parent_id) {
-			if (e->parent->data.ddata.children) {
-				if (nl) {
+		} else if (edge_current_parent_id!=parent_id) {
+			if (parent->data.ddata.children) {
+				if (edge_nl) {
 					fputc('\n',stderr);
-					nl=0;
+					edge_nl=0;
 				}
 				fprintf(stderr,"loading edge: %"PRIu32",%s->%"PRIu32" error: parent node sequence error\n",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id);
 #ifndef METARESTORE
 				syslog(LOG_ERR,"loading edge: %"PRIu32",%s->%"PRIu32" error: parent node sequence error",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id);
 #endif
 				if (ignoreflag) {
-					current_tail = &(e->parent->data.ddata.children);
-					while (*current_tail) {
-						current_tail = &((*current_tail)->nextchild);
+					edge_current_tail = &(parent->data.ddata.children);
+					edge_current_last = 0;
+					while (*edge_current_tail) {
+						edge_current_last = *edge_current_tail;
+						edge_current_tail = &(fsedge_ptr(edge_current_last)->nextchild);
 					}
 				} else {
-					free(e->name);
-					free(e);
+					fsedge_free(e);
 					return -1;
 				}
 			} else {
-				current_tail = &(e->parent->data.ddata.children);
+				edge_current_tail = &(parent->data.ddata.children);
+				edge_current_last = 0;
 			}
-			current_parent_id = parent_id;
+			edge_current_parent_id = parent_id;
 		}
-		e->nextchild = NULL;
+		eh = fsedge_handle(e);
+		e->nextchild = 0;
 		if (parent_id==MFS_ROOT_ID) {
-			*(root_tail) = e;
-			e->prevchild = root_tail;
-			root_tail = &(e->nextchild);
+			*(edge_root_tail) = eh;
+			e->prevchild = edge_root_last;
+			edge_root_last = eh;
+			edge_root_tail = &(e->nextchild);
 		} else {
-			*(current_tail) = e;
-			e->prevchild = current_tail;
-			current_tail = &(e->nextchild);
+			*(edge_current_tail) = eh;
+			e->prevchild = edge_current_last;
+			edge_current_last = eh;
+			edge_current_tail = &(e->nextchild);
 		}
 //		e->nextchild = e->parent->data.ddata.children;
 //		if (e->nextchild) {
@@ -7476,44 +9634,58 @@ int fs_loadedge(FILE *fd,int ignoreflag) {
 //		}
 //		e->parent->data.ddata.children = e;
 //		e->prevchild = &(e->parent->data.ddata.children);
-		e->parent->data.ddata.elements++;
-		if (e->child->type==TYPE_DIRECTORY) {
-			e->parent->data.ddata.nlink++;
+		parent->data.ddata.elements++;
+		if (child->type==TYPE_DIRECTORY) {
+			parent->data.ddata.nlink++;
 		}
 #ifdef EDGEHASH
-		hpos = EDGEHASHPOS(fsnodes_hash(e->parent->id,e->nleng,e->name));
-		e->next = edgehash[hpos];
-		if (e->next) {
-			e->next->prev = &(e->next);
-		}
-		edgehash[hpos] = e;
-		e->prev = &(edgehash[hpos]);
+		e->hash = fsnodes_hash(parent->id,e->nleng,e->name);
+		fsnodes_edgehash_add(e);
 #endif
 	}
-	e->nextparent = e->child->parents;
-	if (e->nextparent) {
-		e->nextparent->prevparent = &(e->nextparent);
-	}
-	e->child->parents = e;
-	e->prevparent = &(e->child->parents);
+	fsnodes_parentlist_add(child,e);
 #ifndef METARESTORE
-	if (e->parent) {
-		fsnodes_get_stats(e->child,&sr);
-		fsnodes_add_stats(e->parent,&sr);
+	if (parent) {
+		fsnodes_get_stats(child,&sr);
+		fsnodes_add_stats(parent,&sr);
 	}
 #endif
+	edge_count++;
 	return 0;
 }
 
-void fs_storenode(fsnode *f,FILE *fd) {
-	uint8_t unodebuff[1+4+1+2+4+4+4+4+4+4+8+4+2+8*65536+4*65536+4];
-	uint8_t *ptr,*chptr;
-	uint32_t i,indx,ch,sessionids;
-	sessionidrec *sessionidptr;
-
-	if (f==NULL) {	// last node
-		fputc(0,fd);
-		return;
+int fs_loadedge(FILE *fd,int ignoreflag) {
+	uint32_t parent_id;
+	uint32_t child_id;
+	fsedge *e;
+	int s;
+
+	if (fd==NULL) {
+		edge_current_parent_id = 0;
+		edge_current_tail = NULL;
+		edge_root_tail = NULL;
+		edge_nl = 1;
+		edge_count = 0;
+		return 0;
+	}
+	s = fs_readedge(fd,edgeslab,&e,&parent_id,&child_id,&edge_nl);
+	if (s!=0) {
+		return s;
+	}
+	e->child = fsnode_handle(fsnodes_id_to_node(child_id));
+	e->parent = fsnode_handle((parent_id==0)?NULL:fsnodes_id_to_node(parent_id));
+	return fs_linkedge(e,parent_id,child_id,ignoreflag);
+}
+
+void fs_storenode(fsnode *f,FILE *fd) {
+	uint8_t unodebuff[1+4+1+2+4+4+4+4+4+4+8+4+2+8*65536+4*65536+4];
+	uint8_t *ptr,*chptr;
+	uint32_t i,indx,ch,sessionids;
+	sessionidrec *sessionidptr;
+
+	if (f==NULL) {	// last node
+		fputc(0,fd);
+		return;
 	}
 	ptr = unodebuff;
 	put8bit(&ptr,f->type);
@@ -7609,30 +9781,21 @@ void fs_storenode(fsnode *f,FILE *fd) {
 	}
 }
 
-int fs_loadnode(FILE *fd) {
-	uint8_t unodebuff[4+1+2+4+4+4+4+4+4+8+4+2+8*65536+4*65536+4];
+#define NODEBUFFSIZE (4+1+2+4+4+4+4+4+4+8+4+2+8*65536+4*65536+4)
+
+// reads node record (without type) - session ids are attached immediately or stored in 'lp' (parallel loader)
+static fsnode* fs_readnode(FILE *fd,uint8_t type,uint8_t *unodebuff,uint8_t *nl,loadpart *lp) {
 	const uint8_t *ptr,*chptr;
-	uint8_t type;
 	uint32_t i,indx,pleng,ch,sessionids,sessionid;
 	fsnode *p;
+	fsslab *ns;
 	sessionidrec *sessionidptr;
-	uint32_t nodepos;
 #ifndef METARESTORE
 	statsrecord *sr;
 #endif
-	static uint8_t nl;
-
-	if (fd==NULL) {
-		nl=1;
-		return 0;
-	}
 
-	type = fgetc(fd);
-	if (type==0) {	// last node
-		return 1;
-	}
-	p = malloc(sizeof(fsnode));
-	passert(p);
+	ns = (lp)?&(lp->nodeslab):&nodeslab;
+	p = fsnode_malloc_slab(ns);
 	p->type = type;
 	switch (type) {
 	case TYPE_DIRECTORY:
@@ -7640,14 +9803,14 @@ int fs_loadnode(FILE *fd) {
 	case TYPE_SOCKET:
 		if (fread(unodebuff,1,4+1+2+4+4+4+4+4+4,fd)!=4+1+2+4+4+4+4+4+4) {
 			int err = errno;
-			if (nl) {
+			if (*nl) {
 				fputc('\n',stderr);
-				nl=0;
+				*nl=0;
 			}
 			errno = err;
 			mfs_errlog(LOG_ERR,"loading node: read error");
-			free(p);
-			return -1;
+			fsnode_free_slab(ns,p);
+			return NULL;
 		}
 		break;
 	case TYPE_BLOCKDEV:
@@ -7655,14 +9818,14 @@ int fs_loadnode(FILE *fd) {
 	case TYPE_SYMLINK:
 		if (fread(unodebuff,1,4+1+2+4+4+4+4+4+4+4,fd)!=4+1+2+4+4+4+4+4+4+4) {
 			int err = errno;
-			if (nl) {
+			if (*nl) {
 				fputc('\n',stderr);
-				nl=0;
+				*nl=0;
 			}
 			errno = err;
 			mfs_errlog(LOG_ERR,"loading node: read error");
-			free(p);
-			return -1;
+			fsnode_free_slab(ns,p);
+			return NULL;
 		}
 		break;
 	case TYPE_FILE:
@@ -7670,24 +9833,24 @@ int fs_loadnode(FILE *fd) {
 	case TYPE_RESERVED:
 		if (fread(unodebuff,1,4+1+2+4+4+4+4+4+4+8+4+2,fd)!=4+1+2+4+4+4+4+4+4+8+4+2) {
 			int err = errno;
-			if (nl) {
+			if (*nl) {
 				fputc('\n',stderr);
-				nl=0;
+				*nl=0;
 			}
 			errno = err;
 			mfs_errlog(LOG_ERR,"loading node: read error");
-			free(p);
-			return -1;
+			fsnode_free_slab(ns,p);
+			return NULL;
 		}
 		break;
 	default:
-		if (nl) {
+		if (*nl) {
 			fputc('\n',stderr);
-			nl=0;
+			*nl=0;
 		}
 		mfs_arg_syslog(LOG_ERR,"loading node: unrecognized node type: %c",type);
-		free(p);
-		return -1;
+		fsnode_free_slab(ns,p);
+		return NULL;
 	}
 	ptr = unodebuff;
 	p->id = get32bit(&ptr);
@@ -7708,7 +9871,7 @@ int fs_loadnode(FILE *fd) {
 		p->data.ddata.stats = sr;
 #endif
 		p->data.ddata.quota = NULL;
-		p->data.ddata.children = NULL;
+		p->data.ddata.children = 0;
 		p->data.ddata.nlink = 2;
 		p->data.ddata.elements = 0;
 	case TYPE_SOCKET:
@@ -7736,15 +9899,15 @@ int fs_loadnode(FILE *fd) {
 			passert(p->data.sdata.path);
 			if (fread(p->data.sdata.path,1,pleng,fd)!=pleng) {
 				int err = errno;
-				if (nl) {
+				if (*nl) {
 					fputc('\n',stderr);
-					nl=0;
+					*nl=0;
 				}
 				errno = err;
 				mfs_errlog(LOG_ERR,"loading node: read error");
 				free(p->data.sdata.path);
-				free(p);
-				return -1;
+				fsnode_free_slab(ns,p);
+				return NULL;
 			}
 		} else {
 			p->data.sdata.path = NULL;
@@ -7761,6 +9924,9 @@ int fs_loadnode(FILE *fd) {
 		p->data.fdata.length = get64bit(&ptr);
 		ch = get32bit(&ptr);
 		p->data.fdata.chunks = ch;
+#ifndef METARESTORE
+		p->data.fdata.testflags = 0;
+#endif
 		sessionids = get16bit(&ptr);
 		if (ch>0) {
 			p->data.fdata.chunktab = malloc(sizeof(uint64_t)*ch);
@@ -7773,17 +9939,17 @@ int fs_loadnode(FILE *fd) {
 			chptr = ptr;
 			if (fread((uint8_t*)ptr,1,8*65536,fd)!=8*65536) {
 				int err = errno;
-				if (nl) {
+				if (*nl) {
 					fputc('\n',stderr);
-					nl=0;
+					*nl=0;
 				}
 				errno = err;
 				mfs_errlog(LOG_ERR,"loading node: read error");
 				if (p->data.fdata.chunktab) {
 					free(p->data.fdata.chunktab);
 				}
-				free(p);
-				return -1;
+				fsnode_free_slab(ns,p);
+				return NULL;
 			}
 			for (i=0 ; i<65536 ; i++) {
 				p->data.fdata.chunktab[indx] = get64bit(&chptr);
@@ -7793,17 +9959,17 @@ int fs_loadnode(FILE *fd) {
 		}
 		if (fread((uint8_t*)ptr,1,8*ch+4*sessionids,fd)!=8*ch+4*sessionids) {
 			int err = errno;
-			if (nl) {
+			if (*nl) {
 				fputc('\n',stderr);
-				nl=0;
+				*nl=0;
 			}
 			errno = err;
 			mfs_errlog(LOG_ERR,"loading node: read error");
 			if (p->data.fdata.chunktab) {
 				free(p->data.fdata.chunktab);
 			}
-			free(p);
-			return -1;
+			fsnode_free_slab(ns,p);
+			return NULL;
 		}
 		for (i=0 ; i<ch ; i++) {
 			p->data.fdata.chunktab[indx] = get64bit(&ptr);
@@ -7812,13 +9978,17 @@ int fs_loadnode(FILE *fd) {
 		p->data.fdata.sessionids=NULL;
 		while (sessionids) {
 			sessionid = get32bit(&ptr);
-			sessionidptr = sessionidrec_malloc();
-			sessionidptr->sessionid = sessionid;
-			sessionidptr->next = p->data.fdata.sessionids;
-			p->data.fdata.sessionids = sessionidptr;
+			if (lp) {
+				fs_loadpart_addsession(lp,p->id,sessionid);
+			} else {
+				sessionidptr = sessionidrec_malloc();
+				sessionidptr->sessionid = sessionid;
+				sessionidptr->next = p->data.fdata.sessionids;
+				p->data.fdata.sessionids = sessionidptr;
 #ifndef METARESTORE
-			matoclserv_init_sessions(sessionid,p->id);
+				matoclserv_init_sessions(sessionid,p->id);
 #endif
+			}
 			sessionids--;
 		}
 /*
@@ -7827,10 +9997,30 @@ int fs_loadnode(FILE *fd) {
 #endif
 */
 	}
-	p->parents = NULL;
-	nodepos = NODEHASHPOS(p->id);
-	p->next = nodehash[nodepos];
-	nodehash[nodepos] = p;
+	p->parents = 0;
+	return p;
+}
+
+int fs_loadnode(FILE *fd) {
+	uint8_t unodebuff[NODEBUFFSIZE];
+	uint8_t type;
+	fsnode *p;
+	static uint8_t nl;
+
+	if (fd==NULL) {
+		nl=1;
+		return 0;
+	}
+
+	type = fgetc(fd);
+	if (type==0) {	// last node
+		return 1;
+	}
+	p = fs_readnode(fd,type,unodebuff,&nl,NULL);
+	if (p==NULL) {
+		return -1;
+	}
+	fsnodes_nodehash_add(p);
 	fsnodes_used_inode(p->id);
 	nodes++;
 	if (type==TYPE_DIRECTORY) {
@@ -7845,9 +10035,11 @@ int fs_loadnode(FILE *fd) {
 void fs_storenodes(FILE *fd) {
 	uint32_t i;
 	fsnode *p;
-	for (i=0 ; i<NODEHASHSIZE ; i++) {
-		for (p=nodehash[i] ; p ; p=p->next) {
+	fshash_finish(&nodehash);
+	for (i=0 ; i<nodehash.size ; i++) {
+		for (p=(fsnode*)(nodehash.tab[i]) ; p ; p=fsnode_ptr(p->next)) {
 			fs_storenode(p,fd);
+			metaindex_add(fd,1);
 		}
 	}
 	fs_storenode(NULL,fd);	// end marker
@@ -7856,24 +10048,25 @@ void fs_storenodes(FILE *fd) {
 void fs_storeedgelist(fsedge *e,FILE *fd) {
 	while (e) {
 		fs_storeedge(e,fd);
-		e=e->nextchild;
+		metaindex_add(fd,1);
+		e=fsedge_ptr(e->nextchild);
 	}
 }
 
 void fs_storeedges_rec(fsnode *f,FILE *fd) {
 	fsedge *e;
-	fs_storeedgelist(f->data.ddata.children,fd);
-	for (e=f->data.ddata.children ; e ; e=e->nextchild) {
-		if (e->child->type==TYPE_DIRECTORY) {
-			fs_storeedges_rec(e->child,fd);
+	fs_storeedgelist(fsedge_ptr(f->data.ddata.children),fd);
+	for (e=fsedge_ptr(f->data.ddata.children) ; e ; e=fsedge_ptr(e->nextchild)) {
+		if (fsnode_ptr(e->child)->type==TYPE_DIRECTORY) {
+			fs_storeedges_rec(fsnode_ptr(e->child),fd);
 		}
 	}
 }
 
 void fs_storeedges(FILE *fd) {
 	fs_storeedges_rec(root,fd);
-	fs_storeedgelist(trash,fd);
-	fs_storeedgelist(reserved,fd);
+	fs_storeedgelist(fsedge_ptr(trash),fd);
+	fs_storeedgelist(fsedge_ptr(reserved),fd);
 	fs_storeedge(NULL,fd);	// end marker
 }
 
@@ -7901,9 +10094,10 @@ int fs_checknodes(int ignoreflag) {
 	uint8_t nl;
 	fsnode *p;
 	nl=1;
-	for (i=0 ; i<NODEHASHSIZE ; i++) {
-		for (p=nodehash[i] ; p ; p=p->next) {
-			if (p->parents==NULL && p!=root) {
+	fshash_finish(&nodehash);
+	for (i=0 ; i<nodehash.size ; i++) {
+		for (p=(fsnode*)(nodehash.tab[i]) ; p ; p=fsnode_ptr(p->next)) {
+			if (p->parents==0 && p!=root) {
 				if (nl) {
 					fputc('\n',stderr);
 					nl=0;
@@ -8190,10 +10384,185 @@ int fs_loadquota(FILE *fd,int ignoreflag) {
 	return 0;
 }
 
+// lazy snapshot entry:
+// dst:4 src:4 ts:4 = 12B
+
+void fs_storelazy(FILE *fd) {
+	uint8_t wbuff[12*100],*ptr;
+	lazysnap *ls;
+	uint32_t i,l;
+	ptr = wbuff;
+	put32bit(&ptr,lazysnapcount);
+	if (fwrite(wbuff,1,4,fd)!=(size_t)4) {
+		syslog(LOG_NOTICE,"fwrite error");
+		return;
+	}
+	l=0;
+	ptr=wbuff;
+	for (i=0 ; i<LAZYSNAP_HASHSIZE ; i++) {
+		for (ls=lazydsthash[i] ; ls ; ls=ls->dstnext) {
+			if (l==100) {
+				if (fwrite(wbuff,1,12*100,fd)!=(size_t)(12*100)) {
+					syslog(LOG_NOTICE,"fwrite error");
+					return;
+				}
+				l=0;
+				ptr=wbuff;
+			}
+			put32bit(&ptr,ls->dstid);
+			put32bit(&ptr,ls->srcid);
+			put32bit(&ptr,ls->ts);
+			l++;
+		}
+	}
+	if (l>0) {
+		if (fwrite(wbuff,1,12*l,fd)!=(size_t)(12*l)) {
+			syslog(LOG_NOTICE,"fwrite error");
+			return;
+		}
+	}
+}
+
+int fs_loadlazy(FILE *fd,int ignoreflag) {
+	uint8_t rbuff[12];
+	const uint8_t *ptr;
+	uint32_t t,dstid,srcid,ts;
+	fsnode *dst,*src;
+	uint8_t nl=1;
+
+	if (fread(rbuff,1,4,fd)!=4) {
+		int err = errno;
+		if (nl) {
+			fputc('\n',stderr);
+			// nl=0;
+		}
+		errno = err;
+		mfs_errlog(LOG_ERR,"loading lazy snapshots: read error");
+		return -1;
+	}
+	ptr=rbuff;
+	t = get32bit(&ptr);
+	while (t>0) {
+		if (fread(rbuff,1,12,fd)!=12) {
+			int err = errno;
+			if (nl) {
+				fputc('\n',stderr);
+				// nl=0;
+			}
+			errno = err;
+			mfs_errlog(LOG_ERR,"loading lazy snapshots: read error");
+			return -1;
+		}
+		ptr = rbuff;
+		dstid = get32bit(&ptr);
+		srcid = get32bit(&ptr);
+		ts = get32bit(&ptr);
+		dst = fsnodes_id_to_node(dstid);
+		src = fsnodes_id_to_node(srcid);
+		if (dst==NULL || src==NULL || dst->type!=TYPE_DIRECTORY || src->type!=TYPE_DIRECTORY || dst->data.ddata.children!=0 || fsnodes_lazy_find(dstid)!=NULL) {
+			if (nl) {
+				fputc('\n',stderr);
+				nl=0;
+			}
+			fprintf(stderr,"lazy snapshot data for non existing or wrong inodes (%"PRIu32" -> %"PRIu32")\n",srcid,dstid);
+#ifndef METARESTORE
+			syslog(LOG_ERR,"lazy snapshot data for non existing or wrong inodes (%"PRIu32" -> %"PRIu32")",srcid,dstid);
+#endif
+			if (ignoreflag==0) {
+				fprintf(stderr,"use mfsmetarestore (option -i) to remove this entry\n");
+				return -1;
+			}
+		} else {
+			fsnodes_lazy_register(dstid,srcid,ts);
+		}
+		t--;
+	}
+	return 0;
+}
+
+#ifndef METARESTORE
+// placeholder stats are equal to stats of its source, which may contain other placeholders, so placeholders are initialized
+// only after all placeholders located under their sources
+static void fs_lazy_initstats(void) {
+	lazysnap *ls,*als,**queue;
+	fsnode *p,*a;
+	statsrecord sr;
+	uint32_t i,qhead,qtail;
+
+	if (lazysnapcount==0) {
+		return;
+	}
+	queue = malloc(sizeof(lazysnap*)*lazysnapcount);
+	passert(queue);
+	for (i=0 ; i<LAZYSNAP_HASHSIZE ; i++) {
+		for (ls=lazydsthash[i] ; ls ; ls=ls->dstnext) {
+			p = fsnodes_id_to_node(ls->dstid);
+			for (a=fsnodes_getparent(p) ; a ; a=fsnodes_getparent(a)) {
+				for (als=lazysrchash[LAZYSNAP_HASHPOS(a->id)] ; als ; als=als->srcnext) {
+					if (als->srcid==a->id) {
+						als->pending++;
+					}
+				}
+			}
+		}
+	}
+	qhead = qtail = 0;
+	for (i=0 ; i<LAZYSNAP_HASHSIZE ; i++) {
+		for (ls=lazydsthash[i] ; ls ; ls=ls->dstnext) {
+			if (ls->pending==0) {
+				queue[qtail++] = ls;
+			}
+		}
+	}
+	while (qhead<qtail) {
+		ls = queue[qhead++];
+		p = fsnodes_id_to_node(ls->dstid);
+		a = fsnodes_id_to_node(ls->srcid);
+		p->data.ddata.nlink = a->data.ddata.nlink;
+		sr = *(a->data.ddata.stats);
+		fsnodes_add_stats(p,&sr);
+		for (a=fsnodes_getparent(p) ; a ; a=fsnodes_getparent(a)) {
+			for (als=lazysrchash[LAZYSNAP_HASHPOS(a->id)] ; als ; als=als->srcnext) {
+				if (als->srcid==a->id) {
+					als->pending--;
+					if (als->pending==0) {
+						queue[qtail++] = als;
+					}
+				}
+			}
+		}
+	}
+	if (qtail<lazysnapcount) {
+		syslog(LOG_WARNING,"lazy snapshots: %"PRIu32" placeholders with cyclic dependencies - their stats are not valid",lazysnapcount-qtail);
+	}
+	free(queue);
+}
+#endif
+
+static int fs_store_section_end(FILE *fd,off_t *offbegin,const char *name) {
+	uint8_t hdr[16];
+	uint8_t *ptr;
+	off_t offend;
+
+	metaindex_section_end(fd);
+	offend = ftello(fd);
+	memcpy(hdr,name,8);
+	ptr = hdr+8;
+	put64bit(&ptr,offend-(*offbegin)-16);
+	fseeko(fd,*offbegin,SEEK_SET);
+	if (fwrite(hdr,1,16,fd)!=(size_t)16) {
+		syslog(LOG_NOTICE,"fwrite error");
+		return -1;
+	}
+	*offbegin = offend;
+	fseeko(fd,offend+16,SEEK_SET);
+	return 0;
+}
+
 void fs_store(FILE *fd,uint8_t fver) {
 	uint8_t hdr[16];
 	uint8_t *ptr;
-	off_t offbegin,offend;
+	off_t offbegin;
 
 	ptr = hdr;
 	put32bit(&ptr,maxnodeid);
@@ -8203,123 +10572,551 @@ void fs_store(FILE *fd,uint8_t fver) {
 		syslog(LOG_NOTICE,"fwrite error");
 		return;
 	}
+	if (fver>=0x20) {
+		metaindex_store_begin();
+	}
 	if (fver>=0x16) {
 		offbegin = ftello(fd);
 		fseeko(fd,offbegin+16,SEEK_SET);
 	} else {
 		offbegin = 0;	// makes some old compilers happy
 	}
+	metaindex_section_begin(fd,"NODE 1.0");
 	fs_storenodes(fd);
 	if (fver>=0x16) {
-		offend = ftello(fd);
-		memcpy(hdr,"NODE 1.0",8);
-		ptr = hdr+8;
-		put64bit(&ptr,offend-offbegin-16);
-		fseeko(fd,offbegin,SEEK_SET);
-		if (fwrite(hdr,1,16,fd)!=(size_t)16) {
-			syslog(LOG_NOTICE,"fwrite error");
+		if (fs_store_section_end(fd,&offbegin,"NODE 1.0")<0) {
 			return;
 		}
-		offbegin = offend;
-		fseeko(fd,offbegin+16,SEEK_SET);
 	}
+	metaindex_section_begin(fd,"EDGE 1.0");
 	fs_storeedges(fd);
 	if (fver>=0x16) {
-		offend = ftello(fd);
-		memcpy(hdr,"EDGE 1.0",8);
-		ptr = hdr+8;
-		put64bit(&ptr,offend-offbegin-16);
-		fseeko(fd,offbegin,SEEK_SET);
-		if (fwrite(hdr,1,16,fd)!=(size_t)16) {
-			syslog(LOG_NOTICE,"fwrite error");
+		if (fs_store_section_end(fd,&offbegin,"EDGE 1.0")<0) {
 			return;
 		}
-		offbegin = offend;
-		fseeko(fd,offbegin+16,SEEK_SET);
 	}
+	metaindex_section_begin(fd,"FREE 1.0");
 	fs_storefree(fd);
 	if (fver>=0x16) {
-		offend = ftello(fd);
-		memcpy(hdr,"FREE 1.0",8);
-		ptr = hdr+8;
-		put64bit(&ptr,offend-offbegin-16);
+		if (fs_store_section_end(fd,&offbegin,"FREE 1.0")<0) {
+			return;
+		}
+		metaindex_section_begin(fd,"QUOT 1.0");
+		fs_storequota(fd);
+		if (fs_store_section_end(fd,&offbegin,"QUOT 1.0")<0) {
+			return;
+		}
+		metaindex_section_begin(fd,"XATR 1.0");
+		xattr_store(fd);
+		if (fs_store_section_end(fd,&offbegin,"XATR 1.0")<0) {
+			return;
+		}
+		if (lazysnapcount>0) {
+			metaindex_section_begin(fd,"LAZY 1.0");
+			fs_storelazy(fd);
+			if (fs_store_section_end(fd,&offbegin,"LAZY 1.0")<0) {
+				return;
+			}
+		}
+	}
+	metaindex_section_begin(fd,"CHNK 1.0");
+	chunk_store(fd);
+	if (fver>=0x16) {
+		if (fs_store_section_end(fd,&offbegin,"CHNK 1.0")<0) {
+			return;
+		}
 		fseeko(fd,offbegin,SEEK_SET);
+		if (fver>=0x20) {
+			metaindex_store(fd);
+		}
+		memcpy(hdr,"[MFS EOF MARKER]",16);
 		if (fwrite(hdr,1,16,fd)!=(size_t)16) {
 			syslog(LOG_NOTICE,"fwrite error");
 			return;
 		}
-		offbegin = offend;
-		fseeko(fd,offbegin+16,SEEK_SET);
+	}
+}
+
+uint64_t fs_loadversion(FILE *fd) {
+	uint8_t hdr[12];
+	const uint8_t *ptr;
+	uint64_t fversion;
+
+	if (fread(hdr,1,12,fd)!=12) {
+		return 0;
+	}
+	ptr = hdr+4;
+//	maxnodeid = get32bit(&ptr);
+	fversion = get64bit(&ptr);
+//	nextsessionid = get32bit(&ptr);
+	return fversion;
+}
+
+static uint32_t MetaLoadThreads = 1;
+static uint32_t MetaLoadThreadsUsed;
+
+// 0 - number of online cpus (but not more than 16)
+static void fs_setloadthreads(uint32_t threads) {
+	if (threads==0) {
+#ifdef _SC_NPROCESSORS_ONLN
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = (cpus>0)?cpus:1;
+#else
+		threads = 1;
+#endif
+		if (threads>16) {
+			threads = 16;
+		}
+	}
+	if (threads>256) {
+		threads = 256;
+	}
+	MetaLoadThreads = threads;
+}
+
+static int fs_loadsection(FILE *fd,uint8_t hdr[16],int ignoreflag) {
+	const uint8_t *ptr;
+	off_t offbegin;
+	uint64_t sleng;
+
+	ptr = hdr+8;
+	sleng = get64bit(&ptr);
+	offbegin = ftello(fd);
+	if (memcmp(hdr,"NODE 1.0",8)==0) {
+		fprintf(stderr,"loading objects (files,directories,etc.) ... ");
+		fflush(stderr);
+		if (fs_loadnodes(fd)<0) {
+#ifndef METARESTORE
+			syslog(LOG_ERR,"error reading metadata (node)");
+#endif
+			return -1;
+		}
+	} else if (memcmp(hdr,"EDGE 1.0",8)==0) {
+		fprintf(stderr,"loading names ... ");
+		fflush(stderr);
+		if (fs_loadedges(fd,ignoreflag)<0) {
+#ifndef METARESTORE
+			syslog(LOG_ERR,"error reading metadata (edge)");
+#endif
+			return -1;
+		}
+	} else if (memcmp(hdr,"FREE 1.0",8)==0) {
+		fprintf(stderr,"loading deletion timestamps ... ");
+		fflush(stderr);
+		if (fs_loadfree(fd)<0) {
+#ifndef METARESTORE
+			syslog(LOG_ERR,"error reading metadata (free)");
+#endif
+			return -1;
+		}
+	} else if (memcmp(hdr,"QUOT 1.0",8)==0) {
+		fprintf(stderr,"loading quota definitions ... ");
+		fflush(stderr);
+		if (fs_loadquota(fd,ignoreflag)<0) {
+#ifndef METARESTORE
+			syslog(LOG_ERR,"error reading metadata (quota)");
+#endif
+			return -1;
+		}
+	} else if (memcmp(hdr,"XATR 1.0",8)==0) {
+		fprintf(stderr,"loading extra attributes (xattr) ... ");
+		fflush(stderr);
+		if (xattr_load(fd,ignoreflag)<0) {
+#ifndef METARESTORE
+			syslog(LOG_ERR,"error reading metadata (xattr)");
+#endif
+			return -1;
+		}
+	} else if (memcmp(hdr,"LAZY 1.0",8)==0) {
+		fprintf(stderr,"loading lazy snapshots ... ");
+		fflush(stderr);
+		if (fs_loadlazy(fd,ignoreflag)<0) {
+#ifndef METARESTORE
+			syslog(LOG_ERR,"error reading metadata (lazy snapshots)");
+#endif
+			return -1;
+		}
+	} else if (memcmp(hdr,"LOCK 1.0",8)==0) {
+		fprintf(stderr,"ignoring locks\n");
+		fseeko(fd,sleng,SEEK_CUR);
+	} else if (memcmp(hdr,"INDX 1.0",8)==0) {	// index is used only by parallel loader
+		fseeko(fd,sleng,SEEK_CUR);
+		return 0;
+	} else if (memcmp(hdr,"CHNK 1.0",8)==0) {
+		fprintf(stderr,"loading chunks data ... ");
+		fflush(stderr);
+		if (chunk_load(fd)<0) {
+			fprintf(stderr,"error\n");
+#ifndef METARESTORE
+			syslog(LOG_ERR,"error reading metadata (chunks)");
+#endif
+			return -1;
+		}
+	} else {
+		hdr[8]=0;
+		if (ignoreflag) {
+			fprintf(stderr,"unknown section found (leng:%"PRIu64",name:%s) - all data from this section will be lost !!!\n",sleng,hdr);
+			fseeko(fd,sleng,SEEK_CUR);
+		} else {
+			fprintf(stderr,"error: unknown section found (leng:%"PRIu64",name:%s)\n",sleng,hdr);
+			return -1;
+		}
+	}
+	if ((off_t)(offbegin+sleng)!=ftello(fd)) {
+		fprintf(stderr,"not all section has been read - file corrupted\n");
+		if (ignoreflag==0) {
+			return -1;
+		}
+	}
+	fprintf(stderr,"ok\n");
+	return 0;
+}
+
+/* parallel loader - uses index ("INDX 1.0" section) of "MFSM 2.0" files:
+	1. node and chunk parts are parsed in threads (each thread uses its own stream)
+	2. nodehash, freebitmask and chunkhash are filled in threads (each thread owns slice of hash table)
+	3. edge parts are parsed in threads (parent and child are found there), then edges are connected in file order
+	4. remaining sections are loaded as usual
+   objects are linked in the same order as by sequential loader */
+
+typedef struct _indexedload {
+	const char *fname;
+	uint32_t nodeparts,chunkparts,edgeparts;
+	loadpart *nodes;
+	loadpart *edges;
+	const metaindex_section *chunksection;
+	uint32_t slices;
+} indexedload;
+
+static int fs_loadnodepart(loadpart *lp,const char *fname) {
+	uint8_t *unodebuff;
+	nodeentry *ne;
+	uint8_t type,nl;
+	uint32_t i;
+	FILE *fd;
+	int status;
+
+	fd = fopen(fname,"r");
+	if (fd==NULL) {
+		return -1;
+	}
+	unodebuff = malloc(NODEBUFFSIZE);
+	passert(unodebuff);
+	ne = (nodeentry*)(lp->entries);
+	nl = 1;
+	status = 0;
+	if (fseeko(fd,lp->offset,SEEK_SET)<0) {
+		status = -1;
+	}
+	for (i=0 ; i<lp->records && status==0 ; i++) {
+		type = fgetc(fd);
+		ne[i].node = (type==0)?NULL:fs_readnode(fd,type,unodebuff,&nl,lp);
+		if (ne[i].node==NULL) {
+			status = -1;
+		} else {
+			ne[i].id = ne[i].node->id;
+			if (type==TYPE_DIRECTORY) {
+				lp->dirnodes++;
+			} else if (type==TYPE_FILE || type==TYPE_TRASH || type==TYPE_RESERVED) {
+				lp->filenodes++;
+			}
+		}
+	}
+	if (status==0 && (uint64_t)ftello(fd)!=lp->endoffset) {
+		status = -1;
+	}
+	lp->records = i;	// in case of error only parsed nodes are valid
+	if (status<0) {
+		lp->records--;
+	}
+	free(unodebuff);
+	fclose(fd);
+	return status;
+}
+
+static int fs_loadedgepart(loadpart *lp,const char *fname) {
+	edgeentry *ee;
+	uint32_t i;
+	uint8_t nl;
+	FILE *fd;
+	int status;
+
+	fd = fopen(fname,"r");
+	if (fd==NULL) {
+		return -1;
+	}
+	ee = (edgeentry*)(lp->entries);
+	nl = 1;
+	status = 0;
+	if (fseeko(fd,lp->offset,SEEK_SET)<0) {
+		status = -1;
+	}
+	for (i=0 ; i<lp->records && status==0 ; i++) {
+		if (fs_readedge(fd,lp->edgeslab,&(ee[i].edge),&(ee[i].parent_id),&(ee[i].child_id),&nl)!=0) {
+			status = -1;
+		} else {	// nodehash is read only at this stage
+			ee[i].edge->child = fsnode_handle(fsnodes_id_to_node(ee[i].child_id));
+			ee[i].edge->parent = fsnode_handle((ee[i].parent_id==0)?NULL:fsnodes_id_to_node(ee[i].parent_id));
+		}
+	}
+	if (status==0 && (uint64_t)ftello(fd)!=lp->endoffset) {
+		status = -1;
+	}
+	lp->records = i;
+	if (status<0) {
+		lp->records--;
+	}
+	fclose(fd);
+	return status;
+}
+
+static int fs_loadparse_job(uint32_t jobno,void *arg) {
+	indexedload *il = (indexedload*)arg;
+	const metaindex_part *mp;
+	uint64_t endoffset;
+	if (jobno<il->nodeparts) {
+		return fs_loadnodepart(il->nodes+jobno,il->fname);
+	}
+	jobno -= il->nodeparts;
+	mp = il->chunksection->parts+jobno;
+	if (jobno+1<il->chunkparts) {
+		endoffset = mp[1].offset;
+	} else {
+		endoffset = il->chunksection->offset+il->chunksection->length-16;
+	}
+	return chunk_load_part(il->fname,mp->offset,endoffset,mp->first,mp->records);
+}
+
+static int fs_loadlink_job(uint32_t jobno,void *arg) {
+	indexedload *il = (indexedload*)arg;
+	uint32_t hfirst,hlast,bfirst,blast,hpos,bpos;
+	uint32_t i,j;
+	nodeentry *ne;
+	fsnode *p;
+
+	hfirst = ((uint64_t)(nodehash.size)*jobno)/il->slices;
+	hlast = ((uint64_t)(nodehash.size)*(jobno+1))/il->slices;
+	bfirst = ((uint64_t)bitmasksize*jobno)/il->slices;
+	blast = ((uint64_t)bitmasksize*(jobno+1))/il->slices;
+	for (i=0 ; i<il->nodeparts ; i++) {
+		ne = (nodeentry*)(il->nodes[i].entries);
+		for (j=0 ; j<il->nodes[i].records ; j++) {
+			hpos = ne[j].id&(nodehash.size-1);
+			if (hpos>=hfirst && hpos<hlast) {
+				p = ne[j].node;
+				p->next = fsnode_handle((fsnode*)(nodehash.tab[hpos]));
+				nodehash.tab[hpos] = p;
+			}
+			bpos = ne[j].id>>5;
+			if (bpos>=bfirst && bpos<blast) {
+				freebitmask[bpos] |= 1<<(ne[j].id&0x1F);
+			}
+		}
+	}
+	chunk_load_link(jobno,il->slices);
+	return 0;
+}
+
+static int fs_loadedge_job(uint32_t jobno,void *arg) {
+	indexedload *il = (indexedload*)arg;
+	return fs_loadedgepart(il->edges+jobno,il->fname);
+}
+
+static loadpart* fs_loadparts_prepare(const metaindex_section *ms,uint32_t markersize,size_t entrysize) {
+	loadpart *lp;
+	uint32_t i;
+	if (ms->partscnt==0) {
+		return NULL;
+	}
+	lp = malloc(sizeof(loadpart)*ms->partscnt);
+	passert(lp);
+	for (i=0 ; i<ms->partscnt ; i++) {
+		lp[i].offset = ms->parts[i].offset;
+		lp[i].endoffset = (i+1<ms->partscnt)?ms->parts[i+1].offset:(ms->offset+ms->length-markersize);
+		lp[i].records = ms->parts[i].records;
+		lp[i].entries = malloc(entrysize*lp[i].records);
+		passert(lp[i].entries);
+		lp[i].sessions = NULL;
+		lp[i].sessionscnt = 0;
+		lp[i].sessionssize = 0;
+		lp[i].dirnodes = 0;
+		lp[i].filenodes = 0;
+		fsslab_init(&(lp[i].nodeslab),&nodespace,sizeof(fsnode));
+		fsslab_edges_init(lp[i].edgeslab);
+	}
+	return lp;
+}
+
+static void fs_loadparts_merge(loadpart *lp,uint32_t parts) {
+	uint32_t i,j;
+	for (i=0 ; i<parts ; i++) {
+		fsslab_merge(&nodeslab,&(lp[i].nodeslab));
+		for (j=0 ; j<FSEDGE_CLASSES ; j++) {
+			fsslab_merge(edgeslab+j,lp[i].edgeslab+j);
+		}
+	}
+}
+
+static void fs_loadparts_free(loadpart *lp,uint32_t parts) {
+	uint32_t i;
+	for (i=0 ; i<parts ; i++) {
+		free(lp[i].entries);
+		if (lp[i].sessions) {
+			free(lp[i].sessions);
+		}
+	}
+	if (lp) {
+		free(lp);
+	}
+}
+
+// checks section end marker (marker has to be zeroed)
+static int fs_checkmarker(FILE *fd,const metaindex_section *ms,uint32_t markersize) {
+	uint8_t marker[16];
+	uint32_t i;
+	if (ms->length<markersize || (ms->partscnt>0 && ms->parts[0].offset>ms->offset+ms->length-markersize)) {
+		return -1;
+	}
+	if (fseeko(fd,ms->offset+ms->length-markersize,SEEK_SET)<0 || fread(marker,1,markersize,fd)!=markersize) {
+		return -1;
+	}
+	for (i=0 ; i<markersize ; i++) {
+		if (marker[i]!=0) {
+			return -1;
+		}
+	}
+	return 0;
+}
 
-		fs_storequota(fd);
+// returns 1 when file can't be loaded in parallel (no index)
+static int fs_load_indexed(const char *fname,FILE *fd,int ignoreflag) {
+	const metaindex_section *nodesection,*edgesection,*chunksection,*ms;
+	indexedload il;
+	edgeentry *ee;
+	sessionidrec *sessionidptr;
+	fsnode *p;
+	uint8_t hdr[16];
+	uint32_t i,j;
+	int status;
 
-		offend = ftello(fd);
-		memcpy(hdr,"QUOT 1.0",8);
-		ptr = hdr+8;
-		put64bit(&ptr,offend-offbegin-16);
-		fseeko(fd,offbegin,SEEK_SET);
-		if (fwrite(hdr,1,16,fd)!=(size_t)16) {
-			syslog(LOG_NOTICE,"fwrite error");
-			return;
-		}
-		offbegin = offend;
-		fseeko(fd,offbegin+16,SEEK_SET);
+	if (metaindex_load(fd)<0) {
+		return 1;
+	}
+	nodesection = metaindex_find("NODE 1.0");
+	edgesection = metaindex_find("EDGE 1.0");
+	chunksection = metaindex_find("CHNK 1.0");
+	if (nodesection==NULL || edgesection==NULL || chunksection==NULL || nodesection->partscnt==0) {
+		metaindex_free();
+		return 1;
+	}
+	if (fs_checkmarker(fd,nodesection,1)<0 || fs_checkmarker(fd,edgesection,4+4+2)<0 || fs_checkmarker(fd,chunksection,16)<0 || nodesection->parts[0].offset!=nodesection->offset || (edgesection->partscnt>0 && edgesection->parts[0].offset!=edgesection->offset) || (chunksection->partscnt>0 && chunksection->parts[0].offset!=chunksection->offset+8)) {
+		fprintf(stderr,"metadata index is corrupted\n");
+#ifndef METARESTORE
+		syslog(LOG_ERR,"metadata index is corrupted");
+#endif
+		metaindex_free();
+		return -1;
+	}
 
-		xattr_store(fd);
+	il.fname = fname;
+	il.slices = MetaLoadThreads;
+	il.chunksection = chunksection;
+	il.nodeparts = nodesection->partscnt;
+	il.chunkparts = chunksection->partscnt;
+	il.edgeparts = edgesection->partscnt;
+	il.nodes = fs_loadparts_prepare(nodesection,1,sizeof(nodeentry));
+	il.edges = NULL;
 
-		offend = ftello(fd);
-		memcpy(hdr,"XATR 1.0",8);
-		ptr = hdr+8;
-		put64bit(&ptr,offend-offbegin-16);
-		fseeko(fd,offbegin,SEEK_SET);
-		if (fwrite(hdr,1,16,fd)!=(size_t)16) {
-			syslog(LOG_NOTICE,"fwrite error");
-			return;
-		}
-		offbegin = offend;
-		fseeko(fd,offbegin+16,SEEK_SET);
+	fprintf(stderr,"loading objects (files,directories,etc.) and chunks data using %"PRIu32" threads ... ",MetaLoadThreads);
+	fflush(stderr);
+	if (fseeko(fd,chunksection->offset,SEEK_SET)<0 || chunk_load_begin(fd,chunksection->records)<0) {
+		status = -1;
+	} else {
+		status = metaindex_run(MetaLoadThreads,il.nodeparts+il.chunkparts,fs_loadparse_job,&il);
 	}
-	chunk_store(fd);
-	if (fver>=0x16) {
-		offend = ftello(fd);
-		memcpy(hdr,"CHNK 1.0",8);
-		ptr = hdr+8;
-		put64bit(&ptr,offend-offbegin-16);
-		fseeko(fd,offbegin,SEEK_SET);
-		if (fwrite(hdr,1,16,fd)!=(size_t)16) {
-			syslog(LOG_NOTICE,"fwrite error");
-			return;
+	if (status<0) {
+		fprintf(stderr,"error\n");
+#ifndef METARESTORE
+		syslog(LOG_ERR,"error reading metadata (node/chunks)");
+#endif
+		metaindex_free();
+		return -1;
+	}
+	fshash_presize(&nodehash,nodesection->records);
+#ifdef EDGEHASH
+	fshash_presize(&edgehash,edgesection->records);
+#endif
+	metaindex_run(MetaLoadThreads,MetaLoadThreads,fs_loadlink_job,&il);
+	chunk_load_end();
+	fs_loadparts_merge(il.nodes,il.nodeparts);
+	for (i=0 ; i<il.nodeparts ; i++) {
+		nodes += il.nodes[i].records;
+		nodehash.elements += il.nodes[i].records;
+		dirnodes += il.nodes[i].dirnodes;
+		filenodes += il.nodes[i].filenodes;
+		for (j=0 ; j<il.nodes[i].sessionscnt ; j++) {
+			p = fsnodes_id_to_node(il.nodes[i].sessions[j*2]);
+			sessionidptr = sessionidrec_malloc();
+			sessionidptr->sessionid = il.nodes[i].sessions[j*2+1];
+			sessionidptr->next = p->data.fdata.sessionids;
+			p->data.fdata.sessionids = sessionidptr;
+#ifndef METARESTORE
+			matoclserv_init_sessions(sessionidptr->sessionid,p->id);
+#endif
 		}
+	}
+	fs_loadparts_free(il.nodes,il.nodeparts);
+	fprintf(stderr,"ok\n");
 
-		fseeko(fd,offend,SEEK_SET);
-		memcpy(hdr,"[MFS EOF MARKER]",16);
-		if (fwrite(hdr,1,16,fd)!=(size_t)16) {
-			syslog(LOG_NOTICE,"fwrite error");
-			return;
+	fprintf(stderr,"loading names using %"PRIu32" threads ... ",MetaLoadThreads);
+	fflush(stderr);
+	fs_loadedge(NULL,ignoreflag);	// init
+	il.edges = fs_loadparts_prepare(edgesection,4+4+2,sizeof(edgeentry));
+	status = metaindex_run(MetaLoadThreads,il.edgeparts,fs_loadedge_job,&il);
+	fs_loadparts_merge(il.edges,il.edgeparts);
+	for (i=0 ; i<il.edgeparts ; i++) {
+		ee = (edgeentry*)(il.edges[i].entries);
+		for (j=0 ; j<il.edges[i].records ; j++,ee++) {
+			if (status==0 && fs_linkedge(ee->edge,ee->parent_id,ee->child_id,ignoreflag)<0) {
+				status = -1;
+			} else if (status<0) {
+				fsedge_free(ee->edge);
+			}
 		}
 	}
-}
-
-uint64_t fs_loadversion(FILE *fd) {
-	uint8_t hdr[12];
-	const uint8_t *ptr;
-	uint64_t fversion;
+	fs_loadparts_free(il.edges,il.edgeparts);
+	if (status<0) {
+#ifndef METARESTORE
+		syslog(LOG_ERR,"error reading metadata (edge)");
+#endif
+		metaindex_free();
+		return -1;
+	}
+	fprintf(stderr,"ok\n");
+	MetaLoadThreadsUsed = MetaLoadThreads;
 
-	if (fread(hdr,1,12,fd)!=12) {
-		return 0;
+	for (i=0 ; (ms=metaindex_get(i))!=NULL ; i++) {
+		if (ms==nodesection || ms==edgesection || ms==chunksection) {
+			continue;
+		}
+		if (fseeko(fd,ms->offset-16,SEEK_SET)<0 || fread(hdr,1,16,fd)!=16) {
+			fprintf(stderr,"error section header\n");
+			metaindex_free();
+			return -1;
+		}
+		if (fs_loadsection(fd,hdr,ignoreflag)<0) {
+			metaindex_free();
+			return -1;
+		}
 	}
-	ptr = hdr+4;
-//	maxnodeid = get32bit(&ptr);
-	fversion = get64bit(&ptr);
-//	nextsessionid = get32bit(&ptr);
-	return fversion;
+	metaindex_free();
+	return 0;
 }
 
-int fs_load(FILE *fd,int ignoreflag,uint8_t fver) {
+int fs_load(const char *fname,FILE *fd,int ignoreflag,uint8_t fver) {
 	uint8_t hdr[16];
 	const uint8_t *ptr;
-	off_t offbegin;
-	uint64_t sleng;
+	int status;
 
 	if (fread(hdr,1,16,fd)!=16) {
 		fprintf(stderr,"error loading header\n");
@@ -8330,6 +11127,7 @@ int fs_load(FILE *fd,int ignoreflag,uint8_t fver) {
 	metaversion = get64bit(&ptr);
 	nextsessionid = get32bit(&ptr);
 	fsnodes_init_freebitmask();
+	MetaLoadThreadsUsed = 1;
 
 	if (fver<0x16) {
 		fprintf(stderr,"loading objects (files,directories,etc.) ... ");
@@ -8366,12 +11164,22 @@ int fs_load(FILE *fd,int ignoreflag,uint8_t fver) {
 #ifndef METARESTORE
 			syslog(LOG_ERR,"error reading metadata (chunks)");
 #endif
-			fclose(fd);
 			return -1;
 		}
 		fprintf(stderr,"ok\n");
 	} else { // fver>=0x16
-		while (1) {
+		status = 1;
+		if (fver>=0x20 && MetaLoadThreads>1) {
+			status = fs_load_indexed(fname,fd,ignoreflag);
+			if (status<0) {
+				return -1;
+			}
+			if (status>0) {
+				fprintf(stderr,"metadata index not found - loading sequentially\n");
+				fseeko(fd,8+16,SEEK_SET);
+			}
+		}
+		while (status>0) {
 			if (fread(hdr,1,16,fd)!=16) {
 				fprintf(stderr,"error section header\n");
 				return -1;
@@ -8379,85 +11187,9 @@ int fs_load(FILE *fd,int ignoreflag,uint8_t fver) {
 			if (memcmp(hdr,"[MFS EOF MARKER]",16)==0) {
 				break;
 			}
-			ptr = hdr+8;
-			sleng = get64bit(&ptr);
-			offbegin = ftello(fd);
-			if (memcmp(hdr,"NODE 1.0",8)==0) {
-				fprintf(stderr,"loading objects (files,directories,etc.) ... ");
-				fflush(stderr);
-				if (fs_loadnodes(fd)<0) {
-#ifndef METARESTORE
-					syslog(LOG_ERR,"error reading metadata (node)");
-#endif
-					return -1;
-				}
-			} else if (memcmp(hdr,"EDGE 1.0",8)==0) {
-				fprintf(stderr,"loading names ... ");
-				fflush(stderr);
-				if (fs_loadedges(fd,ignoreflag)<0) {
-#ifndef METARESTORE
-					syslog(LOG_ERR,"error reading metadata (edge)");
-#endif
-					return -1;
-				}
-			} else if (memcmp(hdr,"FREE 1.0",8)==0) {
-				fprintf(stderr,"loading deletion timestamps ... ");
-				fflush(stderr);
-				if (fs_loadfree(fd)<0) {
-#ifndef METARESTORE
-					syslog(LOG_ERR,"error reading metadata (free)");
-#endif
-					return -1;
-				}
-			} else if (memcmp(hdr,"QUOT 1.0",8)==0) {
-				fprintf(stderr,"loading quota definitions ... ");
-				fflush(stderr);
-				if (fs_loadquota(fd,ignoreflag)<0) {
-#ifndef METARESTORE
-					syslog(LOG_ERR,"error reading metadata (quota)");
-#endif
-					return -1;
-				}
-			} else if (memcmp(hdr,"XATR 1.0",8)==0) {
-				fprintf(stderr,"loading extra attributes (xattr) ... ");
-				fflush(stderr);
-				if (xattr_load(fd,ignoreflag)<0) {
-#ifndef METARESTORE
-					syslog(LOG_ERR,"error reading metadata (xattr)");
-#endif
-					return -1;
-				}
-			} else if (memcmp(hdr,"LOCK 1.0",8)==0) {
-				fprintf(stderr,"ignoring locks\n");
-				fseeko(fd,sleng,SEEK_CUR);
-			} else if (memcmp(hdr,"CHNK 1.0",8)==0) {
-				fprintf(stderr,"loading chunks data ... ");
-				fflush(stderr);
-				if (chunk_load(fd)<0) {
-					fprintf(stderr,"error\n");
-#ifndef METARESTORE
-					syslog(LOG_ERR,"error reading metadata (chunks)");
-#endif
-					fclose(fd);
-					return -1;
-				}
-			} else {
-				hdr[8]=0;
-				if (ignoreflag) {
-					fprintf(stderr,"unknown section found (leng:%"PRIu64",name:%s) - all data from this section will be lost !!!\n",sleng,hdr);
-					fseeko(fd,sleng,SEEK_CUR);
-				} else {
-					fprintf(stderr,"error: unknown section found (leng:%"PRIu64",name:%s)\n",sleng,hdr);
-					return -1;
-				}
-			}
-			if ((off_t)(offbegin+sleng)!=ftello(fd)) {
-				fprintf(stderr,"not all section has been read - file corrupted\n");
-				if (ignoreflag==0) {
-					return -1;
-				}
+			if (fs_loadsection(fd,hdr,ignoreflag)<0) {
+				return -1;
 			}
-			fprintf(stderr,"ok\n");
 		}
 	}
 
@@ -8474,6 +11206,11 @@ int fs_load(FILE *fd,int ignoreflag,uint8_t fver) {
 	if (fs_checknodes(ignoreflag)<0) {
 		return -1;
 	}
+	fsnodes_fbm_summarize();
+	fsnodes_purgeindex_rebuild(0);
+#ifndef METARESTORE
+	fs_lazy_initstats();
+#endif
 	fprintf(stderr,"ok\n");
 	return 0;
 }
@@ -8548,16 +11285,14 @@ int fs_load_1_4(FILE *fd) {
 
 #ifndef METARESTORE
 void fs_new(void) {
-	uint32_t nodepos;
 //#ifndef METARESTORE
 	statsrecord *sr;
 //#endif
 	maxnodeid = MFS_ROOT_ID;
-	metaversion = 0;
+	metaversion = 1;	// change id 0 means 'nothing' for metaloggers, merger and shadow masters
 	nextsessionid = 1;
 	fsnodes_init_freebitmask();
-	root = malloc(sizeof(fsnode));
-	passert(root);
+	root = fsnode_malloc();
 	root->id = MFS_ROOT_ID;
 	root->type = TYPE_DIRECTORY;
 	root->ctime = root->mtime = root->atime = main_time();
@@ -8573,13 +11308,11 @@ void fs_new(void) {
 	root->data.ddata.stats = sr;
 // #endif
 	root->data.ddata.quota = NULL;
-	root->data.ddata.children = NULL;
+	root->data.ddata.children = 0;
 	root->data.ddata.elements = 0;
 	root->data.ddata.nlink = 2;
-	root->parents = NULL;
-	nodepos = NODEHASHPOS(root->id);
-	root->next = nodehash[nodepos];
-	nodehash[nodepos] = root;
+	root->parents = 0;
+	fsnodes_nodehash_add(root);
 	fsnodes_used_inode(root->id);
 	chunk_newfs();
 	nodes=1;
@@ -8594,19 +11327,11 @@ int fs_emergency_storeall(const char *fname) {
 	if (fd==NULL) {
 		return -1;
 	}
-#if VERSHEX>=0x010700
-	if (fwrite(MFSSIGNATURE "M 1.7",1,8,fd)!=(size_t)8) {
-		syslog(LOG_NOTICE,"fwrite error");
-	} else {
-		fs_store(fd,0x17);
-	}
-#else
-	if (fwrite(MFSSIGNATURE "M 1.5",1,8,fd)!=(size_t)8) {
+	if (fwrite(MFSSIGNATURE "M 2.0",1,8,fd)!=(size_t)8) {
 		syslog(LOG_NOTICE,"fwrite error");
 	} else {
-		fs_store(fd,0x15);
+		fs_store(fd,0x20);
 	}
-#endif
 	if (ferror(fd)!=0) {
 		fclose(fd);
 		return -1;
@@ -8671,15 +11396,238 @@ int fs_emergency_saves() {
 }
 
 #ifndef METARESTORE
-int fs_storeall(int bg) {
+static void fs_storeall_finish(void) {
+	if (BackMetaCopies>0) {
+		char metaname1[100],metaname2[100];
+		int n;
+		for (n=BackMetaCopies-1 ; n>0 ; n--) {
+			snprintf(metaname1,100,"metadata.mfs.back.%"PRIu32,n+1);
+			snprintf(metaname2,100,"metadata.mfs.back.%"PRIu32,n);
+			rename(metaname2,metaname1);
+		}
+		rename("metadata.mfs.back","metadata.mfs.back.1");
+	}
+	rename("metadata.mfs.back.tmp","metadata.mfs.back");
+	unlink("metadata.mfs");
+}
+
+// returns version stored in metadata file header (0 on error)
+static uint64_t fs_getfileversion(const char *fname) {
+	uint8_t hdr[20];
+	const uint8_t *ptr;
 	FILE *fd;
-	int i;
+	fd = fopen(fname,"r");
+	if (fd==NULL) {
+		return 0;
+	}
+	if (fread(hdr,1,20,fd)!=20 || memcmp(hdr,MFSSIGNATURE "M ",5)!=0) {
+		fclose(fd);
+		return 0;
+	}
+	fclose(fd);
+	ptr = hdr+12;
+	return get64bit(&ptr);
+}
+
+/* fork-free metadata save:
+   new metadata.mfs.back is rebuilt by mfsmetarestore from previous metadata.mfs.back and
+   already rotated changelogs, so master doesn't have to fork and its memory is never shared
+   copy-on-write. Child reports its progress through a pipe (mfsmetarestore -p). */
+
+enum {BGSAVE_IDLE,BGSAVE_LOADING,BGSAVE_APPLYING,BGSAVE_STORING};
+
+static uint8_t bgsave_state = BGSAVE_IDLE;
+static uint8_t bgsave_stored;
+static pid_t bgsave_pid;
+static int bgsave_fd = -1;
+static void *bgsave_hook;
+static uint64_t bgsave_startversion;
+static uint64_t bgsave_targetversion;
+static uint64_t bgsave_currentversion;
+static char bgsave_line[256];
+static char bgsave_lastmsg[256];
+static uint32_t bgsave_linepos;
+
+static uint32_t lastsavetime;
+static uint32_t lastsaveduration;
+static uint8_t lastsavestatus;
+
+static uint8_t MetaSaveMode;
+static char *MetaRestorePath;
+
+static int fs_storeall_write(int bg);
+
+void fs_metasave_info(uint8_t *mode,uint8_t *progress,uint32_t *lsavetime,uint32_t *lsaveduration,uint8_t *lsavestatus) {
 	struct stat sb;
-	if (stat("metadata.mfs.back.tmp",&sb)==0) {
-		syslog(LOG_ERR,"previous metadata save process hasn't finished yet - do not start another one");
+	if (bgsave_state!=BGSAVE_IDLE) {
+		*mode = 2;
+		if (bgsave_state==BGSAVE_LOADING) {
+			*progress = 0;
+		} else if (bgsave_state==BGSAVE_STORING || bgsave_targetversion<=bgsave_startversion) {
+			*progress = 99;
+		} else {
+			*progress = ((bgsave_currentversion-bgsave_startversion)*98)/(bgsave_targetversion-bgsave_startversion)+1;
+		}
+	} else if (stat("metadata.mfs.back.tmp",&sb)==0) {
+		*mode = 1;
+		*progress = 0xFF;
+	} else {
+		*mode = 0;
+		*progress = 0;
+	}
+	*lsavetime = lastsavetime;
+	*lsaveduration = lastsaveduration;
+	*lsavestatus = lastsavestatus;
+}
+
+static void fs_bgsave_line(void) {
+	if (strncmp(bgsave_line,"progress: ",10)==0) {
+		if (strcmp(bgsave_line+10,"loaded")==0) {
+			bgsave_state = BGSAVE_APPLYING;
+		} else if (strncmp(bgsave_line+10,"version ",8)==0) {
+			bgsave_currentversion = strtoull(bgsave_line+18,NULL,10);
+		} else if (strcmp(bgsave_line+10,"storing")==0) {
+			bgsave_state = BGSAVE_STORING;
+		} else if (strcmp(bgsave_line+10,"stored")==0) {
+			bgsave_stored = 1;
+		}
+	} else if (bgsave_line[0]) {
+		memcpy(bgsave_lastmsg,bgsave_line,bgsave_linepos+1);
+	}
+}
+
+static void fs_bgsave_end(void) {
+	main_fdunregister(bgsave_hook);
+	close(bgsave_fd);
+	bgsave_fd = -1;
+	bgsave_hook = NULL;
+	bgsave_state = BGSAVE_IDLE;
+	lastsaveduration = main_time()-lastsavetime;
+	if (bgsave_stored && fs_getfileversion("metadata.mfs.back.tmp")==bgsave_targetversion) {
+		fs_storeall_finish();
+		lastsavestatus = 0;
+		syslog(LOG_NOTICE,"metadata (version: %"PRIu64") has been saved in background in %"PRIu32" seconds",bgsave_targetversion,lastsaveduration);
+		return;
+	}
+	lastsavestatus = 1;
+	syslog(LOG_WARNING,"background metadata save failed (%s) - saving metadata using fork",bgsave_lastmsg[0]?bgsave_lastmsg:"no message");
+	unlink("metadata.mfs.back.tmp");
+	fs_storeall_write(1);	// change log has been already rotated
+}
+
+static void fs_bgsave_serve(short revents,void *data) {
+	char buff[4096];
+	ssize_t i,r;
+	(void)data;
+	(void)revents;
+	for (;;) {
+		r = read(bgsave_fd,buff,4096);
+		if (r<0 && (errno==EAGAIN || errno==EINTR)) {
+			return;
+		}
+		if (r<=0) {	// child has finished (or pipe error)
+			fs_bgsave_end();
+			return;
+		}
+		for (i=0 ; i<r ; i++) {
+			if (buff[i]=='\n') {
+				bgsave_line[bgsave_linepos]='\0';
+				fs_bgsave_line();
+				bgsave_linepos = 0;
+			} else if (bgsave_linepos+1<sizeof(bgsave_line)) {
+				bgsave_line[bgsave_linepos++] = buff[i];
+			}
+		}
+	}
+}
+
+static int fs_bgsave_start(void) {
+	struct stat sb;
+	struct rlimit rls;
+	char **argv;
+	char fname[100];
+	uint32_t files,i;
+	int pfd[2],fd,maxfd;
+	pid_t pid;
+
+	bgsave_startversion = fs_getfileversion("metadata.mfs.back");
+	if (bgsave_startversion==0 || bgsave_startversion>metaversion) {
+		syslog(LOG_WARNING,"background metadata save: no usable metadata.mfs.back - saving metadata using fork");
 		return -1;
 	}
-	changelog_rotate();
+	for (files=0 ; files<1000 ; files++) {
+		snprintf(fname,100,"changelog.%"PRIu32".mfs",files+1);
+		if (stat(fname,&sb)<0) {
+			break;
+		}
+	}
+	if (files==0 && bgsave_startversion<metaversion) {	// BACK_LOGS = 0 - rotated change logs are removed
+		syslog(LOG_WARNING,"background metadata save needs rotated change logs (BACK_LOGS > 0) - saving metadata using fork");
+		return -1;
+	}
+	argv = malloc(sizeof(char*)*(files+8));
+	passert(argv);
+	argv[0] = MetaRestorePath;
+	argv[1] = "-p";
+	argv[2] = "-m";
+	argv[3] = "metadata.mfs.back";
+	argv[4] = "-o";
+	argv[5] = "metadata.mfs.back.tmp";
+	for (i=0 ; i<files ; i++) {
+		snprintf(fname,100,"changelog.%"PRIu32".mfs",i+1);
+		argv[6+i] = strdup(fname);
+		passert(argv[6+i]);
+	}
+	argv[6+files] = NULL;
+	if (getrlimit(RLIMIT_NOFILE,&rls)<0 || rls.rlim_cur==RLIM_INFINITY || rls.rlim_cur>1048576) {
+		maxfd = 1048576;
+	} else {
+		maxfd = rls.rlim_cur;
+	}
+	if (pipe(pfd)<0) {
+		pid = -1;
+	} else {
+		// vfork doesn't copy page tables - child only closes inherited descriptors and exec's mfsmetarestore
+		pid = vfork();
+		if (pid==0) {
+			dup2(pfd[1],1);
+			dup2(pfd[1],2);
+			for (fd=3 ; fd<maxfd ; fd++) {
+				close(fd);
+			}
+			execv(argv[0],argv);
+			_exit(1);
+		}
+		close(pfd[1]);
+		if (pid<0) {
+			close(pfd[0]);
+		}
+	}
+	for (i=0 ; i<files ; i++) {
+		free(argv[6+i]);
+	}
+	free(argv);
+	if (pid<0) {
+		mfs_errlog(LOG_WARNING,"can't start background metadata save - saving metadata using fork");
+		return -1;
+	}
+	fcntl(pfd[0],F_SETFL,fcntl(pfd[0],F_GETFL)|O_NONBLOCK);
+	bgsave_pid = pid;
+	bgsave_fd = pfd[0];
+	bgsave_hook = main_fdregister(bgsave_fd,POLLIN,fs_bgsave_serve,NULL);
+	bgsave_state = BGSAVE_LOADING;
+	bgsave_stored = 0;
+	bgsave_targetversion = metaversion;
+	bgsave_currentversion = bgsave_startversion;
+	bgsave_linepos = 0;
+	bgsave_lastmsg[0] = '\0';
+	return 0;
+}
+
+// stores metadata in forked process (bg) or in foreground - without rotating change log
+static int fs_storeall_write(int bg) {
+	FILE *fd;
+	int i;
 	if (bg) {
 		i = fork();
 	} else {
@@ -8697,19 +11645,11 @@ int fs_storeall(int bg) {
 			}
 			return 0;
 		}
-#if VERSHEX>=0x010700
-		if (fwrite(MFSSIGNATURE "M 1.7",1,8,fd)!=(size_t)8) {
-			syslog(LOG_NOTICE,"fwrite error");
-		} else {
-			fs_store(fd,0x17);
-		}
-#else
-		if (fwrite(MFSSIGNATURE "M 1.5",1,8,fd)!=(size_t)8) {
+		if (fwrite(MFSSIGNATURE "M 2.0",1,8,fd)!=(size_t)8) {
 			syslog(LOG_NOTICE,"fwrite error");
 		} else {
-			fs_store(fd,0x15);
+			fs_store(fd,0x20);
 		}
-#endif
 		if (ferror(fd)!=0) {
 			syslog(LOG_ERR,"can't write metadata");
 			fclose(fd);
@@ -8722,31 +11662,43 @@ int fs_storeall(int bg) {
 			return 0;
 		} else {
 			fclose(fd);
-			if (BackMetaCopies>0) {
-				char metaname1[100],metaname2[100];
-				int n;
-				for (n=BackMetaCopies-1 ; n>0 ; n--) {
-					snprintf(metaname1,100,"metadata.mfs.back.%"PRIu32,n+1);
-					snprintf(metaname2,100,"metadata.mfs.back.%"PRIu32,n);
-					rename(metaname2,metaname1);
-				}
-				rename("metadata.mfs.back","metadata.mfs.back.1");
-			}
-			rename("metadata.mfs.back.tmp","metadata.mfs.back");
-			unlink("metadata.mfs");
+			fs_storeall_finish();
 		}
 		if (i==0) {
 			exit(0);
 		}
+		lastsaveduration = main_time()-lastsavetime;
 	}
 	return 1;
 }
 
+int fs_storeall(int bg) {
+	struct stat sb;
+	if (bgsave_state!=BGSAVE_IDLE || stat("metadata.mfs.back.tmp",&sb)==0) {
+		syslog(LOG_ERR,"previous metadata save process hasn't finished yet - do not start another one");
+		return -1;
+	}
+	changelog_rotate();
+	lastsavetime = main_time();
+	if (bg && MetaSaveMode==1 && fs_bgsave_start()==0) {
+		return 1;
+	}
+	return fs_storeall_write(bg);
+}
+
 void fs_dostoreall(void) {
 	fs_storeall(1);	// ignore error
 }
 
 void fs_term(void) {
+	fs_jobs_term();
+	if (bgsave_state!=BGSAVE_IDLE) {
+		kill(bgsave_pid,SIGTERM);
+		main_fdunregister(bgsave_hook);
+		close(bgsave_fd);
+		bgsave_state = BGSAVE_IDLE;
+		unlink("metadata.mfs.back.tmp");
+	}
 	for (;;) {
 		if (fs_storeall(0)==1) {
 			if (rename("metadata.mfs.back","metadata.mfs")<0) {
@@ -8761,34 +11713,32 @@ void fs_term(void) {
 }
 
 #else
-void fs_storeall(const char *fname) {
+int fs_storeall(const char *fname) {
 	FILE *fd;
 	fd = fopen(fname,"w");
 	if (fd==NULL) {
 		printf("can't open metadata file\n");
-		return;
-	}
-#if VERSHEX>=0x010700
-	if (fwrite(MFSSIGNATURE "M 1.7",1,8,fd)!=(size_t)8) {
-		syslog(LOG_NOTICE,"fwrite error");
-	} else {
-		fs_store(fd,0x17);
+		return -1;
 	}
-#else
-	if (fwrite(MFSSIGNATURE "M 1.5",1,8,fd)!=(size_t)8) {
+	if (fwrite(MFSSIGNATURE "M 2.0",1,8,fd)!=(size_t)8) {
 		syslog(LOG_NOTICE,"fwrite error");
 	} else {
-		fs_store(fd,0x15);
+		fs_store(fd,0x20);
 	}
-#endif
 	if (ferror(fd)!=0) {
 		printf("can't write metadata\n");
+		fclose(fd);
+		return -1;
 	}
-	fclose(fd);
+	if (fclose(fd)!=0) {
+		printf("can't write metadata\n");
+		return -1;
+	}
+	return 0;
 }
 
-void fs_term(const char *fname) {
-	fs_storeall(fname);
+int fs_term(const char *fname) {
+	return fs_storeall(fname);
 }
 #endif
 
@@ -8799,15 +11749,19 @@ int fs_loadall(const char *fname,int ignoreflag) {
 #endif
 	FILE *fd;
 	uint8_t hdr[8];
+	uint8_t fver;
+	uint64_t fileleng;
+	struct timeval start,end;
+	double seconds;
 #ifndef METARESTORE
+	const char *fname = "metadata.mfs";
 	uint8_t bhdr[8];
 	uint64_t backversion;
 	int converted=0;
 #endif
 
-#ifdef METARESTORE
-	fd = fopen(fname,"r");
-#else
+	gettimeofday(&start,NULL);
+#ifndef METARESTORE
 	backversion = 0;
 	fd = fopen("metadata.mfs.back","r");
 	if (fd!=NULL) {
@@ -8815,15 +11769,15 @@ int fs_loadall(const char *fname,int ignoreflag) {
 //			if (memcmp(bhdr,MFSSIGNATURE "M 1.4",8)==0) {
 //				backversion = fs_loadversion_1_4(fd);
 //			} else
-			if (memcmp(bhdr,MFSSIGNATURE "M 1.",7)==0 && (bhdr[7]=='5' || bhdr[7]=='7')) {
+			if ((memcmp(bhdr,MFSSIGNATURE "M 1.",7)==0 && (bhdr[7]=='5' || bhdr[7]=='7')) || memcmp(bhdr,MFSSIGNATURE "M 2.0",8)==0) {
 				backversion = fs_loadversion(fd);
 			}
 		}
 		fclose(fd);
 	}
-
-	fd = fopen("metadata.mfs","r");
 #endif
+
+	fd = fopen(fname,"r");
 	if (fd==NULL) {
 		fprintf(stderr,"can't open metadata file\n");
 #ifndef METARESTORE
@@ -8906,22 +11860,19 @@ int fs_loadall(const char *fname,int ignoreflag) {
 */
 #endif
 	if (memcmp(hdr,MFSSIGNATURE "M 1.5",8)==0) {
-#ifndef METARESTORE
-		if (fs_load(fd,0,0x15)<0) {
-#else
-		if (fs_load(fd,ignoreflag,0x15)<0) {
-#endif
-#ifndef METARESTORE
-			syslog(LOG_ERR,"error reading metadata (structure)");
-#endif
-			fclose(fd);
-			return -1;
-		}
+		fver = 0x15;
 	} else if (memcmp(hdr,MFSSIGNATURE "M 1.7",8)==0) {
+		fver = 0x17;
+	} else if (memcmp(hdr,MFSSIGNATURE "M 2.0",8)==0) {
+		fver = 0x20;
+	} else {
+		fver = 0;
+	}
+	if (fver>0) {
 #ifndef METARESTORE
-		if (fs_load(fd,0,0x17)<0) {
+		if (fs_load(fname,fd,0,fver)<0) {
 #else
-		if (fs_load(fd,ignoreflag,0x17)<0) {
+		if (fs_load(fname,fd,ignoreflag,fver)<0) {
 #endif
 #ifndef METARESTORE
 			syslog(LOG_ERR,"error reading metadata (structure)");
@@ -8945,6 +11896,8 @@ int fs_loadall(const char *fname,int ignoreflag) {
 		fclose(fd);
 		return -1;
 	}
+	fseeko(fd,0,SEEK_END);
+	fileleng = ftello(fd);
 	fclose(fd);
 #ifndef METARESTORE
 	if (backversion>metaversion) {
@@ -8977,6 +11930,16 @@ int fs_loadall(const char *fname,int ignoreflag) {
 	printf("C\n");
 #endif
 	fprintf(stderr,"ok\n");
+	gettimeofday(&end,NULL);
+	seconds = (end.tv_sec-start.tv_sec)+(end.tv_usec-start.tv_usec)/1000000.0;
+	if (seconds<0.000001) {
+		seconds = 0.000001;
+	}
+	fsslab_memory_info();
+	fprintf(stderr,"metadata loaded in %.3lf s (%.1lf MB/s, %.0lf objects/s, threads: %"PRIu32")\n",seconds,fileleng/(1024.0*1024.0*seconds),(nodes+edge_count+chunk_loaded_count())/seconds,MetaLoadThreadsUsed);
+#ifndef METARESTORE
+	syslog(LOG_NOTICE,"metadata loaded in %.3lf s (%.1lf MB/s, %.0lf objects/s, threads: %"PRIu32")",seconds,fileleng/(1024.0*1024.0*seconds),(nodes+edge_count+chunk_loaded_count())/seconds,MetaLoadThreadsUsed);
+#endif
 #ifndef METARESTORE
 	fprintf(stderr,"all inodes: %"PRIu32"\n",nodes);
 	fprintf(stderr,"directory inodes: %"PRIu32"\n",dirnodes);
@@ -8988,10 +11951,9 @@ int fs_loadall(const char *fname,int ignoreflag) {
 }
 
 void fs_strinit(void) {
-	uint32_t i;
 	root = NULL;
-	trash = NULL;
-	reserved = NULL;
+	trash = 0;
+	reserved = 0;
 	trashspace = 0;
 	reservedspace = 0;
 	trashnodes = 0;
@@ -9000,13 +11962,13 @@ void fs_strinit(void) {
 	quotahead = NULL;
 #endif
 	xattr_init();
-	for (i=0 ; i<NODEHASHSIZE ; i++) {
-		nodehash[i]=NULL;
-	}
+	fsslab_space_init(&nodespace);
+	fsslab_space_init(&edgespace);
+	fsslab_init(&nodeslab,&nodespace,sizeof(fsnode));
+	fsslab_edges_init(edgeslab);
+	fshash_init(&nodehash,2,fsnodes_nodehash_movebucket);
 #ifdef EDGEHASH
-	for (i=0 ; i<EDGEHASHSIZE ; i++) {
-		edgehash[i]=NULL;
-	}
+	fshash_init(&edgehash,2,fsnodes_edgehash_movebucket);
 #endif
 }
 
@@ -9024,6 +11986,18 @@ void fs_reload(void) {
 	if (BackMetaCopies>99) {
 		BackMetaCopies=99;
 	}
+	MetaSaveMode = cfg_getuint8("METADATA_SAVE_MODE",0);
+	if (MetaRestorePath) {
+		free(MetaRestorePath);
+	}
+	MetaRestorePath = cfg_getstr("METARESTORE_PATH",SBIN_PATH "/mfsmetarestore");
+	fs_dirindex_setthreshold(cfg_getuint32("DIR_INDEX_THRESHOLD",DIRINDEX_DEFAULT_THRESHOLD));
+	LazySnapshots = cfg_getuint8("LAZY_SNAPSHOTS",0);
+	EmptyTrashLimit = cfg_getuint32("EMPTY_TRASH_LIMIT",10000);
+	FileTestLoopTime = cfg_getuint32("FILE_TEST_LOOP_TIME",14400);
+	if (FileTestLoopTime==0) {
+		FileTestLoopTime=1;
+	}
 }
 
 int fs_init(void) {
@@ -9031,6 +12005,8 @@ int fs_init(void) {
 	fs_strinit();
 	chunk_strinit();
 	test_start_time = main_time()+900;
+	test_dirty_start_time = test_start_time;
+	fs_setloadthreads(cfg_getuint32("METADATA_LOAD_THREADS",0));
 	if (fs_loadall()<0) {
 		return -1;
 	}
@@ -9044,13 +12020,29 @@ int fs_init(void) {
 	if (BackMetaCopies>99) {
 		BackMetaCopies=99;
 	}
+	MetaSaveMode = cfg_getuint8("METADATA_SAVE_MODE",0);
+	if (MetaRestorePath) {
+		free(MetaRestorePath);
+	}
+	MetaRestorePath = cfg_getstr("METARESTORE_PATH",SBIN_PATH "/mfsmetarestore");
+	fs_dirindex_setthreshold(cfg_getuint32("DIR_INDEX_THRESHOLD",DIRINDEX_DEFAULT_THRESHOLD));
+	LazySnapshots = cfg_getuint8("LAZY_SNAPSHOTS",0);
+	EmptyTrashLimit = cfg_getuint32("EMPTY_TRASH_LIMIT",10000);
+	FileTestLoopTime = cfg_getuint32("FILE_TEST_LOOP_TIME",14400);
+	if (FileTestLoopTime==0) {
+		FileTestLoopTime=1;
+	}
 
 	main_reloadregister(fs_reload);
+	fshashactive = 0;
+	fshashhook = main_msectimeregister(TIMEMODE_SKIP_LATE,FSHASH_IDLEMSEC,0,fs_hash_rehash);
+	main_timeregister(TIMEMODE_SKIP_LATE,1,0,fs_hash_scan);
 	main_timeregister(TIMEMODE_RUN_LATE,1,0,fs_test_files);
+	main_msectimeregister(TIMEMODE_SKIP_LATE,100,0,fs_test_dirty);
 	main_timeregister(TIMEMODE_RUN_LATE,1,0,fsnodes_check_all_quotas);
 	main_timeregister(TIMEMODE_RUN_LATE,3600,0,fs_dostoreall);
-	main_timeregister(TIMEMODE_RUN_LATE,300,0,fs_emptytrash);
-	main_timeregister(TIMEMODE_RUN_LATE,60,0,fs_emptyreserved);
+	main_timeregister(TIMEMODE_RUN_LATE,1,0,fs_emptytrash);
+	main_timeregister(TIMEMODE_RUN_LATE,1,0,fs_emptyreserved);
 	main_timeregister(TIMEMODE_RUN_LATE,60,0,fsnodes_freeinodes);
 	main_destructregister(fs_term);
 	return 0;
@@ -9059,6 +12051,7 @@ int fs_init(void) {
 int fs_init(const char *fname,int ignoreflag) {
 	fs_strinit();
 	chunk_strinit();
+	fs_setloadthreads(0);
 	if (fs_loadall(fname,ignoreflag)<0) {
 		return -1;
 	}
@@ -0,0 +1,192 @@
+/*
+   Copyright 2005-2010 Jakub Kruszona-Zawadzki, Gemius SA.
+
+   This file is part of MooseFS.
+
+   MooseFS is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, version 3.
+
+   MooseFS is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MooseFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FSHASH_H_
+#define _FSHASH_H_
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "massert.h"
+
+/* chained hash tables resized automatically (load factor kept between 1/8 and 'maxload') - used for nodes, edges and chunks
+   rehashing is incremental: buckets are moved from old table to new one in small steps (on every insert/remove
+   and by timer), object is in old table when its bucket there is not empty (moved buckets are emptied and objects
+   inserted to empty old bucket go to new table), so buckets can be also moved out of order */
+#define FSHASH_MINSIZE 0x10000
+#define FSHASH_MAXSIZE 0x80000000U
+#define FSHASH_OPSTEP 8
+#define FSHASH_TIMERSTEP 16384
+#define FSHASH_SCANSTEP 65536
+// rehash timer period - short only while table is being rehashed
+#define FSHASH_REHASHMSEC 10
+#define FSHASH_IDLEMSEC 1000
+
+typedef struct _fshash {
+	void **tab;
+	void **oldtab;		// table being rehashed - NULL when not rehashing
+	uint32_t size,oldsize;
+	uint32_t rehashpos;	// buckets of old table below this position have been already moved (timer/operation steps)
+	uint32_t elements;
+	uint32_t maxload;	// table is grown when there are more elements than maxload*size
+	uint32_t maxchain;	// longest chain found during last full scan
+	uint32_t scanpos,scanmaxchain;
+	void (*movebucket)(struct _fshash *h,void *first);
+} fshash;
+
+static inline void** fshash_bucket(fshash *h,uint32_t hval) {
+	void **b;
+	if (h->oldtab) {
+		b = h->oldtab+(hval&(h->oldsize-1));
+		if (*b) {
+			return b;
+		}
+	}
+	return h->tab+(hval&(h->size-1));
+}
+
+// calloc - big tables are mmaped and their zeroed pages are mapped on first use, so growing doesn't touch whole new table at once
+static inline void** fshash_alloctab(uint32_t size) {
+	void **tab;
+	tab = (void**)calloc(size,sizeof(void*));
+	passert(tab);
+	return tab;
+}
+
+static inline void fshash_init(fshash *h,uint32_t maxload,void (*movebucket)(fshash *h,void *first)) {
+	h->tab = fshash_alloctab(FSHASH_MINSIZE);
+	h->oldtab = NULL;
+	h->size = FSHASH_MINSIZE;
+	h->oldsize = 0;
+	h->rehashpos = 0;
+	h->elements = 0;
+	h->maxload = maxload;
+	h->maxchain = 0;
+	h->scanpos = 0;
+	h->scanmaxchain = 0;
+	h->movebucket = movebucket;
+}
+
+static inline void fshash_step(fshash *h,uint32_t buckets) {
+	void *first;
+	while (buckets>0 && h->rehashpos<h->oldsize) {
+		first = h->oldtab[h->rehashpos];
+		h->oldtab[h->rehashpos] = NULL;	// has to be emptied before moving - objects from this bucket belong to new table now
+		h->rehashpos++;
+		if (first) {
+			h->movebucket(h,first);
+		}
+		buckets--;
+	}
+	if (h->oldtab && h->rehashpos>=h->oldsize) {
+		free(h->oldtab);
+		h->oldtab = NULL;
+		h->oldsize = 0;
+		h->rehashpos = 0;
+		h->scanpos = 0;
+		h->scanmaxchain = 0;
+	}
+}
+
+// moves all old table buckets with objects belonging to given position of new table (used by loops which scan table during rehashing)
+static inline void fshash_prepare(fshash *h,uint32_t pos) {
+	uint32_t opos;
+	void *first;
+	if (h->oldtab==NULL) {
+		return;
+	}
+	for (opos=pos&(h->oldsize-1) ; opos<h->oldsize ; opos+=h->size) {
+		first = h->oldtab[opos];
+		if (first) {
+			h->oldtab[opos] = NULL;
+			h->movebucket(h,first);
+		}
+	}
+}
+
+static inline void fshash_finish(fshash *h) {
+	if (h->oldtab) {
+		fshash_step(h,h->oldsize);
+	}
+}
+
+// called after insert/remove
+static inline void fshash_check(fshash *h) {
+	uint32_t newsize;
+	if (h->oldtab) {
+		fshash_step(h,FSHASH_OPSTEP);
+		return;
+	}
+	if (h->elements>(uint64_t)(h->size)*h->maxload && h->size<FSHASH_MAXSIZE) {
+		newsize = h->size*2;
+	} else if (h->elements<h->size/8 && h->size>FSHASH_MINSIZE) {
+		newsize = h->size/2;
+	} else {
+		return;
+	}
+	h->oldtab = h->tab;
+	h->oldsize = h->size;
+	h->rehashpos = 0;
+	h->tab = fshash_alloctab(newsize);
+	h->size = newsize;
+}
+
+// sets size for expected number of elements (only when table is empty - used before loading)
+static inline void fshash_presize(fshash *h,uint64_t expected) {
+	uint32_t size;
+	if (h->elements>0 || h->oldtab) {
+		return;
+	}
+	size = FSHASH_MINSIZE;
+	while (size<expected && size<FSHASH_MAXSIZE) {
+		size*=2;
+	}
+	if (size!=h->size) {
+		free(h->tab);
+		h->tab = fshash_alloctab(size);
+		h->size = size;
+	}
+}
+
+// incremental scan of chain lengths (only when table is not being rehashed)
+static inline void fshash_scan(fshash *h,uint32_t buckets,void* (*next)(void *obj)) {
+	uint32_t chain;
+	void *p;
+	if (h->oldtab) {
+		return;
+	}
+	while (buckets>0) {
+		if (h->scanpos>=h->size) {
+			h->maxchain = h->scanmaxchain;
+			h->scanmaxchain = 0;
+			h->scanpos = 0;
+		}
+		chain = 0;
+		for (p=h->tab[h->scanpos] ; p ; p=next(p)) {
+			chain++;
+		}
+		if (chain>h->scanmaxchain) {
+			h->scanmaxchain = chain;
+		}
+		h->scanpos++;
+		buckets--;
+	}
+}
+
+#endif
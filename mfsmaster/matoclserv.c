@@ -50,6 +50,8 @@
 #include "sockets.h"
 #include "slogger.h"
 #include "massert.h"
+#include "pktbuf.h"
+#include "netio.h"
 
 #define MaxPacketSize 1000000
 
@@ -96,6 +98,14 @@ typedef struct chunklist {
 	struct chunklist *next;
 } chunklist;
 
+// recursive setgoal/settrashtime/seteattr done in background
+typedef struct fsjoblist {
+	uint32_t jobid;
+	uint32_t qid;		// queryid for answer
+	uint32_t type;		// answer type (MATOCL_FUSE_SETGOAL,MATOCL_FUSE_SETTRASHTIME,MATOCL_FUSE_SETEATTR)
+	struct fsjoblist *next;
+} fsjoblist;
+
 // opened files
 typedef struct filelist {
 	uint32_t inode;
@@ -125,13 +135,6 @@ typedef struct session {
 	struct session *next;
 } session;
 
-typedef struct packetstruct {
-	struct packetstruct *next;
-	uint8_t *startptr;
-	uint32_t bytesleft;
-	uint8_t *packet;
-} packetstruct;
-
 typedef struct matoclserventry {
 	uint8_t registered;
 	uint8_t mode;				//0 - not active, 1 - read header, 2 - read packet
@@ -139,7 +142,10 @@ typedef struct matoclserventry {
 	uint8_t notifications;
 */
 	int sock;				//socket number
-	int32_t pdescpos;
+	void *pollhook;
+	netio_conn *nc;				//used instead of pollhook when network threads are enabled
+	uint8_t netstate;			//0 - open, 1 - close requested, 2 - closed by network thread
+	uint8_t pending;			//1 - already in 'pending' list
 	uint32_t lastread,lastwrite;		//time of last activity
 	uint32_t version;
 	uint32_t peerip;
@@ -150,18 +156,21 @@ typedef struct matoclserventry {
 	uint8_t passwordrnd[32];
 	session *sesdata;
 	chunklist *chunkdelayedops;
+	fsjoblist *fsjobdelayedops;
 /* CACHENOTIFY
 	dirincache *cacheddirs;
 */
 //	filelist *openedfiles;
 
-	struct matoclserventry *next;
+	struct matoclserventry *next,**prev;
+	struct matoclserventry *nextpending;
 } matoclserventry;
 
 static session *sessionshead=NULL;
 static matoclserventry *matoclservhead=NULL;
+static matoclserventry *matoclservpending=NULL;	// connections touched in current loop (new output, killed etc.)
 static int lsock;
-static int32_t lsockpdescpos;
+static void *lsockhook;
 static int exiting,starting;
 
 // from config
@@ -169,6 +178,7 @@ static char *ListenHost;
 static char *ListenPort;
 static uint32_t RejectOld;
 static uint32_t SessionSustainTime;
+static uint32_t NetThreads;
 //static uint32_t Timeout;
 
 static uint32_t stats_prcvd = 0;
@@ -187,6 +197,12 @@ void matoclserv_stats(uint64_t stats[5]) {
 	stats_bsent = 0;
 }
 
+void matoclserv_netstats(uint64_t stats[2]) {
+	if (NetThreads>0) {
+		netio_stats(stats,stats+1);
+	}
+}
+
 /* CACHENOTIFY
 // cache notification routines
 
@@ -662,24 +678,27 @@ void matoclserv_init_sessions(uint32_t sessionid,uint32_t inode) {
 	*ofpptr = ofptr;
 }
 
+static inline void matoclserv_mark_pending(matoclserventry *eptr) {
+	if (eptr->pending==0) {
+		eptr->pending = 1;
+		eptr->nextpending = matoclservpending;
+		matoclservpending = eptr;
+	}
+}
+
 uint8_t* matoclserv_createpacket(matoclserventry *eptr,uint32_t type,uint32_t size) {
 	packetstruct *outpacket;
 	uint8_t *ptr;
 	uint32_t psize;
 
-	outpacket=(packetstruct*)malloc(sizeof(packetstruct));
-	passert(outpacket);
 	psize = size+8;
-	outpacket->packet=malloc(psize);
-	passert(outpacket->packet);
-	outpacket->bytesleft = psize;
+	outpacket = pktbuf_packet(psize);
 	ptr = outpacket->packet;
 	put32bit(&ptr,type);
 	put32bit(&ptr,size);
-	outpacket->startptr = (uint8_t*)(outpacket->packet);
-	outpacket->next = NULL;
 	*(eptr->outputtail) = outpacket;
 	eptr->outputtail = &(outpacket->next);
+	matoclserv_mark_pending(eptr);
 	return ptr;
 }
 
@@ -948,6 +967,10 @@ void matoclserv_info(matoclserventry *eptr,const uint8_t *data,uint32_t length)
 	uint64_t memusage;
 	uint32_t trnodes,renodes,inodes,dnodes,fnodes;
 	uint32_t chunks,chunkcopies,tdcopies;
+	uint32_t lsavetime,lsaveduration;
+	uint8_t savemode,saveprogress,lsavestatus;
+	uint32_t nhsize,nhelements,nhmaxchain,ehsize,ehelements,ehmaxchain;
+	uint8_t rehashing;
 	uint8_t *ptr;
 //#ifdef RUSAGE_SELF
 //	struct rusage r;
@@ -964,8 +987,10 @@ void matoclserv_info(matoclserventry *eptr,const uint8_t *data,uint32_t length)
 //#endif
 	fs_info(&totalspace,&availspace,&trspace,&trnodes,&respace,&renodes,&inodes,&dnodes,&fnodes);
 	chunk_info(&chunks,&chunkcopies,&tdcopies);
+	fs_metasave_info(&savemode,&saveprogress,&lsavetime,&lsaveduration,&lsavestatus);
+	fs_hash_info(&nhsize,&nhelements,&nhmaxchain,&ehsize,&ehelements,&ehmaxchain,&rehashing);
 	memusage = chartsdata_memusage();
-	ptr = matoclserv_createpacket(eptr,MATOCL_INFO,76);
+	ptr = matoclserv_createpacket(eptr,MATOCL_INFO,112);
 	/* put32bit(&buff,VERSION): */
 	put16bit(&ptr,VERSMAJ);
 	put8bit(&ptr,VERSMID);
@@ -985,6 +1010,18 @@ void matoclserv_info(matoclserventry *eptr,const uint8_t *data,uint32_t length)
 	put32bit(&ptr,chunks);
 	put32bit(&ptr,chunkcopies);
 	put32bit(&ptr,tdcopies);
+	put8bit(&ptr,savemode);
+	put8bit(&ptr,saveprogress);
+	put32bit(&ptr,lsavetime);
+	put32bit(&ptr,lsaveduration);
+	put8bit(&ptr,lsavestatus);
+	put32bit(&ptr,nhsize);
+	put32bit(&ptr,nhelements);
+	put32bit(&ptr,nhmaxchain);
+	put32bit(&ptr,ehsize);
+	put32bit(&ptr,ehelements);
+	put32bit(&ptr,ehmaxchain);
+	put8bit(&ptr,rehashing);
 }
 
 void matoclserv_fstest_info(matoclserventry *eptr,const uint8_t *data,uint32_t length) {
@@ -1084,6 +1121,22 @@ void matoclserv_mlog_list(matoclserventry *eptr,const uint8_t *data,uint32_t len
 	matomlserv_mloglist_data(ptr);
 }
 
+void matoclserv_fsjobs_info(matoclserventry *eptr,const uint8_t *data,uint32_t length) {
+	uint8_t *ptr;
+	if (length!=0 && length!=4) {
+		syslog(LOG_NOTICE,"CLTOMA_FSJOBS_INFO - wrong size (%"PRIu32"/0|4)",length);
+		eptr->mode = KILL;
+		return;
+	}
+	if (length==4) {
+		ptr = matoclserv_createpacket(eptr,MATOCL_FSJOBS_INFO,fs_job_info_size());
+		fs_job_info_data(get32bit(&data),ptr);
+	} else {
+		ptr = matoclserv_createpacket(eptr,MATOCL_FSJOBS_INFO,fs_jobs_info_size());
+		fs_jobs_info_data(ptr);
+	}
+}
+
 /* CACHENOTIFY
 void matoclserv_notify_attr(uint32_t dirinode,uint32_t inode,const uint8_t attr[35]) {
 	uint32_t hash = (dirinode*0x5F2318BD)%DIRINODE_HASH_SIZE;
@@ -2278,13 +2331,14 @@ void matoclserv_fuse_link(matoclserventry *eptr,const uint8_t *data,uint32_t len
 void matoclserv_fuse_getdir(matoclserventry *eptr,const uint8_t *data,uint32_t length) {
 	uint32_t inode,uid,gid,auid,agid;
 	uint8_t flags;
+	uint64_t cursor;
 	uint32_t msgid;
 	uint8_t *ptr;
 	uint8_t status;
 	uint32_t dleng;
 	void *custom;
-	if (length!=16 && length!=17) {
-		syslog(LOG_NOTICE,"CLTOMA_FUSE_GETDIR - wrong size (%"PRIu32"/16|17)",length);
+	if (length!=16 && length!=17 && length!=25) {
+		syslog(LOG_NOTICE,"CLTOMA_FUSE_GETDIR - wrong size (%"PRIu32"/16|17|25)",length);
 		eptr->mode = KILL;
 		return;
 	}
@@ -2293,12 +2347,22 @@ void matoclserv_fuse_getdir(matoclserventry *eptr,const uint8_t *data,uint32_t l
 	auid = uid = get32bit(&data);
 	agid = gid = get32bit(&data);
 	matoclserv_ugid_remap(eptr,&uid,&gid);
-	if (length==17) {
+	if (length>=17) {
 		flags = get8bit(&data);
 	} else {
 		flags = 0;
 	}
-	status = fs_readdir_size(eptr->sesdata->rootinode,eptr->sesdata->sesflags,inode,uid,gid,flags,&custom,&dleng);
+	if (length==25) {
+		cursor = get64bit(&data);
+		if ((flags&GETDIR_FLAG_PAGED)==0) {
+			syslog(LOG_NOTICE,"CLTOMA_FUSE_GETDIR - cursor without paged flag");
+			eptr->mode = KILL;
+			return;
+		}
+	} else {
+		cursor = 0;
+	}
+	status = fs_readdir_size(eptr->sesdata->rootinode,eptr->sesdata->sesflags,inode,uid,gid,flags,cursor,&custom,&dleng);
 	ptr = matoclserv_createpacket(eptr,MATOCL_FUSE_GETDIR,(status!=STATUS_OK)?5:4+dleng);
 	put32bit(&ptr,msgid);
 	if (status!=STATUS_OK) {
@@ -2640,11 +2704,67 @@ void matoclserv_fuse_gettrashtime(matoclserventry *eptr,const uint8_t *data,uint
 	}
 }
 
+// clients which set SMODE_BACKGROUND get job id at once (and poll CLTOMA_FSJOBS_INFO), other ones get answer when job is finished
+void matoclserv_fsjob_delay(matoclserventry *eptr,uint32_t jobid,uint32_t msgid,uint32_t type,uint8_t background) {
+	fsjoblist *jl;
+	uint8_t *ptr;
+	if (background) {
+		ptr = matoclserv_createpacket(eptr,type,9);
+		put32bit(&ptr,msgid);
+		put8bit(&ptr,ERROR_DELAYED);
+		put32bit(&ptr,jobid);
+		return;
+	}
+	jl = (fsjoblist*)malloc(sizeof(fsjoblist));
+	passert(jl);
+	jl->jobid = jobid;
+	jl->qid = msgid;
+	jl->type = type;
+	jl->next = eptr->fsjobdelayedops;
+	eptr->fsjobdelayedops = jl;
+}
+
+void matoclserv_fsjob_finished(uint32_t jobid,uint8_t status,uint32_t changed,uint32_t notchanged,uint32_t notpermitted,uint32_t quotaexceeded) {
+	matoclserventry *eptr;
+	fsjoblist *jl,**ajl;
+	uint8_t *ptr;
+
+	for (eptr = matoclservhead ; eptr ; eptr=eptr->next) {
+		if (eptr->mode==KILL) {
+			continue;
+		}
+		ajl = &(eptr->fsjobdelayedops);
+		while ((jl=*ajl)!=NULL) {
+			if (jl->jobid==jobid) {
+				*ajl = jl->next;
+				if (status!=STATUS_OK) {
+					ptr = matoclserv_createpacket(eptr,jl->type,5);
+					put32bit(&ptr,jl->qid);
+					put8bit(&ptr,status);
+				} else {
+					ptr = matoclserv_createpacket(eptr,jl->type,(jl->type==MATOCL_FUSE_SETGOAL && eptr->version>=0x010700)?20:16);
+					put32bit(&ptr,jl->qid);
+					put32bit(&ptr,changed);
+					put32bit(&ptr,notchanged);
+					put32bit(&ptr,notpermitted);
+					if (jl->type==MATOCL_FUSE_SETGOAL && eptr->version>=0x010700) {
+						put32bit(&ptr,quotaexceeded);
+					}
+				}
+				free(jl);
+				return;
+			}
+			ajl = &(jl->next);
+		}
+	}
+	// client has gone - job is finished anyway
+}
+
 void matoclserv_fuse_settrashtime(matoclserventry *eptr,const uint8_t *data,uint32_t length) {
 	uint32_t inode,uid,trashtime;
 	uint32_t msgid;
-	uint8_t smode;
-	uint32_t changed,notchanged,notpermitted;
+	uint8_t smode,background;
+	uint32_t changed,notchanged,notpermitted,jobid;
 	uint8_t *ptr;
 	uint8_t status;
 	if (length!=17) {
@@ -2658,6 +2778,8 @@ void matoclserv_fuse_settrashtime(matoclserventry *eptr,const uint8_t *data,uint
 	matoclserv_ugid_remap(eptr,&uid,NULL);
 	trashtime = get32bit(&data);
 	smode = get8bit(&data);
+	background = smode&SMODE_BACKGROUND;
+	smode &= ~SMODE_BACKGROUND;
 // limits check
 	status = STATUS_OK;
 	switch (smode&SMODE_TMASK) {
@@ -2679,7 +2801,11 @@ void matoclserv_fuse_settrashtime(matoclserventry *eptr,const uint8_t *data,uint
 	}
 //
 	if (status==STATUS_OK) {
-		status = fs_settrashtime(eptr->sesdata->rootinode,eptr->sesdata->sesflags,inode,uid,trashtime,smode,&changed,&notchanged,&notpermitted);
+		status = fs_settrashtime(eptr->sesdata->rootinode,eptr->sesdata->sesflags,inode,uid,trashtime,smode,&changed,&notchanged,&notpermitted,&jobid);
+	}
+	if (status==ERROR_DELAYED) {
+		matoclserv_fsjob_delay(eptr,jobid,msgid,MATOCL_FUSE_SETTRASHTIME,background);
+		return;
 	}
 	ptr = matoclserv_createpacket(eptr,MATOCL_FUSE_SETTRASHTIME,(status!=STATUS_OK)?5:16);
 	put32bit(&ptr,msgid);
@@ -2745,12 +2871,13 @@ void matoclserv_fuse_getgoal(matoclserventry *eptr,const uint8_t *data,uint32_t
 void matoclserv_fuse_setgoal(matoclserventry *eptr,const uint8_t *data,uint32_t length) {
 	uint32_t inode,uid;
 	uint32_t msgid;
-	uint8_t goal,smode;
+	uint8_t goal,smode,background;
 #if VERSHEX>=0x010700
 	uint32_t changed,notchanged,notpermitted,quotaexceeded;
 #else
 	uint32_t changed,notchanged,notpermitted;
 #endif
+	uint32_t jobid;
 	uint8_t *ptr;
 	uint8_t status;
 	if (length!=14) {
@@ -2764,6 +2891,8 @@ void matoclserv_fuse_setgoal(matoclserventry *eptr,const uint8_t *data,uint32_t
 	matoclserv_ugid_remap(eptr,&uid,NULL);
 	goal = get8bit(&data);
 	smode = get8bit(&data);
+	background = smode&SMODE_BACKGROUND;
+	smode &= ~SMODE_BACKGROUND;
 // limits check
 	status = STATUS_OK;
 	switch (smode&SMODE_TMASK) {
@@ -2789,11 +2918,15 @@ void matoclserv_fuse_setgoal(matoclserventry *eptr,const uint8_t *data,uint32_t
 	}
 	if (status==STATUS_OK) {
 #if VERSHEX>=0x010700
-		status = fs_setgoal(eptr->sesdata->rootinode,eptr->sesdata->sesflags,inode,uid,goal,smode,&changed,&notchanged,&notpermitted,&quotaexceeded);
+		status = fs_setgoal(eptr->sesdata->rootinode,eptr->sesdata->sesflags,inode,uid,goal,smode,&changed,&notchanged,&notpermitted,&quotaexceeded,&jobid);
 #else
-		status = fs_setgoal(eptr->sesdata->rootinode,eptr->sesdata->sesflags,inode,uid,goal,smode,&changed,&notchanged,&notpermitted);
+		status = fs_setgoal(eptr->sesdata->rootinode,eptr->sesdata->sesflags,inode,uid,goal,smode,&changed,&notchanged,&notpermitted,&jobid);
 #endif
 	}
+	if (status==ERROR_DELAYED) {
+		matoclserv_fsjob_delay(eptr,jobid,msgid,MATOCL_FUSE_SETGOAL,background);
+		return;
+	}
 	if (eptr->version>=0x010700) {
 		ptr = matoclserv_createpacket(eptr,MATOCL_FUSE_SETGOAL,(status!=STATUS_OK)?5:20);
 	} else {
@@ -2869,8 +3002,8 @@ void matoclserv_fuse_geteattr(matoclserventry *eptr,const uint8_t *data,uint32_t
 void matoclserv_fuse_seteattr(matoclserventry *eptr,const uint8_t *data,uint32_t length) {
 	uint32_t inode,uid;
 	uint32_t msgid;
-	uint8_t eattr,smode;
-	uint32_t changed,notchanged,notpermitted;
+	uint8_t eattr,smode,background;
+	uint32_t changed,notchanged,notpermitted,jobid;
 	uint8_t *ptr;
 	uint8_t status;
 	if (length!=14) {
@@ -2884,7 +3017,13 @@ void matoclserv_fuse_seteattr(matoclserventry *eptr,const uint8_t *data,uint32_t
 	matoclserv_ugid_remap(eptr,&uid,NULL);
 	eattr = get8bit(&data);
 	smode = get8bit(&data);
-	status = fs_seteattr(eptr->sesdata->rootinode,eptr->sesdata->sesflags,inode,uid,eattr,smode,&changed,&notchanged,&notpermitted);
+	background = smode&SMODE_BACKGROUND;
+	smode &= ~SMODE_BACKGROUND;
+	status = fs_seteattr(eptr->sesdata->rootinode,eptr->sesdata->sesflags,inode,uid,eattr,smode,&changed,&notchanged,&notpermitted,&jobid);
+	if (status==ERROR_DELAYED) {
+		matoclserv_fsjob_delay(eptr,jobid,msgid,MATOCL_FUSE_SETEATTR,background);
+		return;
+	}
 	ptr = matoclserv_createpacket(eptr,MATOCL_FUSE_SETEATTR,(status!=STATUS_OK)?5:16);
 	put32bit(&ptr,msgid);
 	if (status!=STATUS_OK) {
@@ -3420,6 +3559,7 @@ void matocl_session_statsmove(void) {
 
 void matocl_beforedisconnect(matoclserventry *eptr) {
 	chunklist *cl,*acl;
+	fsjoblist *jl,*ajl;
 // unlock locked chunks
 	cl=eptr->chunkdelayedops;
 	while (cl) {
@@ -3431,6 +3571,14 @@ void matocl_beforedisconnect(matoclserventry *eptr) {
 		free(acl);
 	}
 	eptr->chunkdelayedops=NULL;
+// background jobs are not stopped - only answers are forgotten
+	jl=eptr->fsjobdelayedops;
+	while (jl) {
+		ajl = jl;
+		jl=jl->next;
+		free(ajl);
+	}
+	eptr->fsjobdelayedops=NULL;
 	if (eptr->sesdata) {
 		if (eptr->sesdata->nsocks>0) {
 			eptr->sesdata->nsocks--;
@@ -3495,6 +3643,9 @@ void matoclserv_gotpacket(matoclserventry *eptr,uint32_t type,const uint8_t *dat
 			case CLTOMA_CSSERV_REMOVESERV:
 				matoclserv_cserv_removeserv(eptr,data,length);
 				break;
+			case CLTOMA_FSJOBS_INFO:
+				matoclserv_fsjobs_info(eptr,data,length);
+				break;
 			default:
 				syslog(LOG_NOTICE,"main master server module: got unknown message from unregistered (type:%"PRIu32")",type);
 				eptr->mode=KILL;
@@ -3676,6 +3827,9 @@ void matoclserv_gotpacket(matoclserventry *eptr,uint32_t type,const uint8_t *dat
 			case CLTOMA_CSSERV_REMOVESERV:
 				matoclserv_cserv_removeserv(eptr,data,length);
 				break;
+			case CLTOMA_FSJOBS_INFO:
+				matoclserv_fsjobs_info(eptr,data,length);
+				break;
 			default:
 				syslog(LOG_NOTICE,"main master server module: got unknown message from mfsmount (type:%"PRIu32")",type);
 				eptr->mode=KILL;
@@ -3746,28 +3900,33 @@ void matoclserv_term(void) {
 	matoclserventry *eptr,*eptrn;
 	packetstruct *pptr,*pptrn;
 	chunklist *cl,*cln;
+	fsjoblist *jl,*jln;
 	session *ss,*ssn;
 	filelist *of,*ofn;
 
 	syslog(LOG_NOTICE,"main master server module: closing %s:%s",ListenHost,ListenPort);
 	tcpclose(lsock);
+	if (NetThreads>0) {
+		netio_term();	// closes client sockets
+	}
 
 	for (eptr = matoclservhead ; eptr ; eptr = eptrn) {
 		eptrn = eptr->next;
 		if (eptr->inputpacket.packet) {
-			free(eptr->inputpacket.packet);
+			pktbuf_free(eptr->inputpacket.packet);
 		}
 		for (pptr = eptr->outputhead ; pptr ; pptr = pptrn) {
 			pptrn = pptr->next;
-			if (pptr->packet) {
-				free(pptr->packet);
-			}
-			free(pptr);
+			pktbuf_free(pptr);
 		}
 		for (cl = eptr->chunkdelayedops ; cl ; cl = cln) {
 			cln = cl->next;
 			free(cl);
 		}
+		for (jl = eptr->fsjobdelayedops ; jl ; jl = jln) {
+			jln = jl->next;
+			free(jl);
+		}
 		free(eptr);
 	}
 	for (ss = sessionshead ; ss ; ss = ssn) {
@@ -3830,8 +3989,7 @@ void matoclserv_read(matoclserventry *eptr) {
 					eptr->mode = KILL;
 					return;
 				}
-				eptr->inputpacket.packet = malloc(size);
-				passert(eptr->inputpacket.packet);
+				eptr->inputpacket.packet = pktbuf_alloc(size);
 				eptr->inputpacket.bytesleft = size;
 				eptr->inputpacket.startptr = eptr->inputpacket.packet;
 				eptr->mode = DATA;
@@ -3853,212 +4011,279 @@ void matoclserv_read(matoclserventry *eptr) {
 			stats_prcvd++;
 
 			if (eptr->inputpacket.packet) {
-				free(eptr->inputpacket.packet);
+				pktbuf_free(eptr->inputpacket.packet);
 			}
 			eptr->inputpacket.packet=NULL;
+
+			if (eptr->mode==KILL) {
+				return;
+			}
 		}
 	}
 }
 
 void matoclserv_write(matoclserventry *eptr) {
-	packetstruct *pack;
-	int32_t i;
-	for (;;) {
-		pack = eptr->outputhead;
-		if (pack==NULL) {
-			return;
-		}
-		i=write(eptr->sock,pack->startptr,pack->bytesleft);
-		if (i<0) {
-			if (errno!=EAGAIN) {
-				mfs_arg_errlog_silent(LOG_NOTICE,"main master server module: (ip:%u.%u.%u.%u) write error",(eptr->peerip>>24)&0xFF,(eptr->peerip>>16)&0xFF,(eptr->peerip>>8)&0xFF,eptr->peerip&0xFF);
-				eptr->mode = KILL;
-			}
-			return;
-		}
-		pack->startptr+=i;
-		pack->bytesleft-=i;
-		stats_bsent+=i;
-		if (pack->bytesleft>0) {
-			return;
-		}
-		free(pack->packet);
-		stats_psent++;
-		eptr->outputhead = pack->next;
-		if (eptr->outputhead==NULL) {
-			eptr->outputtail = &(eptr->outputhead);
-		}
-		free(pack);
+	uint32_t bytes,packets;
+	if (pktbuf_write(eptr->sock,&(eptr->outputhead),&(eptr->outputtail),&bytes,&packets)<0) {
+		mfs_arg_errlog_silent(LOG_NOTICE,"main master server module: (ip:%u.%u.%u.%u) write error",(eptr->peerip>>24)&0xFF,(eptr->peerip>>16)&0xFF,(eptr->peerip>>8)&0xFF,eptr->peerip&0xFF);
+		eptr->mode = KILL;
 	}
+	stats_bsent+=bytes;
+	stats_psent+=packets;
 }
 
-void matoclserv_wantexit(void) {
-	exiting=1;
+void matoclserv_close(matoclserventry *eptr) {
+	packetstruct *pptr,*paptr;
+
+	matocl_beforedisconnect(eptr);
+	if (eptr->nc) {
+		netio_release(eptr->nc);
+	} else {
+		main_fdunregister(eptr->pollhook);
+		tcpclose(eptr->sock);
+	}
+	if (eptr->inputpacket.packet) {
+		pktbuf_free(eptr->inputpacket.packet);
+	}
+	pptr = eptr->outputhead;
+	while (pptr) {
+		paptr = pptr;
+		pptr = pptr->next;
+		pktbuf_free(paptr);
+	}
+	*(eptr->prev) = eptr->next;
+	if (eptr->next) {
+		eptr->next->prev = eptr->prev;
+	}
+	free(eptr);
 }
 
-int matoclserv_canexit(void) {
-	matoclserventry *eptr;
-	for (eptr=matoclservhead ; eptr ; eptr=eptr->next) {
-		if (eptr->outputhead!=NULL) {
-			return 0;
+// network threads - whole output list is passed to the thread and the connection is freed only after its thread closed the socket
+static inline void matoclserv_net_flush(matoclserventry *eptr,uint32_t now) {
+	packetstruct *pptr;
+
+	if (eptr->mode!=KILL && eptr->outputhead) {
+		eptr->lastwrite = now;
+		for (pptr=eptr->outputhead ; pptr ; pptr=pptr->next) {
+			stats_psent++;
+			stats_bsent+=pptr->bytesleft;
 		}
-		if (eptr->chunkdelayedops!=NULL) {
-			return 0;
+		netio_send(eptr->nc,eptr->outputhead);
+		eptr->outputhead = NULL;
+		eptr->outputtail = &(eptr->outputhead);
+	}
+	if (eptr->mode==KILL) {
+		if (eptr->netstate==2) {
+			matoclserv_close(eptr);
+		} else if (eptr->netstate==0) {
+			netio_close(eptr->nc);
+			eptr->netstate = 1;
 		}
 	}
-	return 1;
 }
 
-void matoclserv_desc(struct pollfd *pdesc,uint32_t *ndesc) {
-	uint32_t pos = *ndesc;
+// called once per loop - sends queued packets and closes killed connections, but only for connections touched in this loop
+void matoclserv_flush(void) {
+	uint32_t now=main_time();
 	matoclserventry *eptr;
 
-	if (exiting==0) {
-		pdesc[pos].fd = lsock;
-		pdesc[pos].events = POLLIN;
-		lsockpdescpos = pos;
-		pos++;
-//		FD_SET(lsock,rset);
-//		max = lsock;
-	} else {
-		lsockpdescpos = -1;
-//		max = -1;
-	}
-	for (eptr=matoclservhead ; eptr ; eptr=eptr->next) {
-		pdesc[pos].fd = eptr->sock;
-		pdesc[pos].events = 0;
-		eptr->pdescpos = pos;
-//		i=eptr->sock;
-		if (exiting==0) {
-			pdesc[pos].events |= POLLIN;
-//			FD_SET(i,rset);
-//			if (i>max) {
-//				max=i;
-//			}
+	while ((eptr=matoclservpending)) {
+		matoclservpending = eptr->nextpending;
+		eptr->pending = 0;
+		if (eptr->nc) {
+			matoclserv_net_flush(eptr,now);
+			continue;
 		}
-		if (eptr->outputhead!=NULL) {
-			pdesc[pos].events |= POLLOUT;
-//			FD_SET(i,wset);
-//			if (i>max) {
-//				max=i;
-//			}
+		if (eptr->mode!=KILL && eptr->outputhead) {
+			eptr->lastwrite = now;
+			matoclserv_write(eptr);
 		}
-		pos++;
+		if (eptr->mode==KILL) {
+			matoclserv_close(eptr);
+		} else {
+			main_fdchange(eptr->pollhook,(exiting?0:POLLIN)|(eptr->outputhead?POLLOUT:0));
+		}
+	}
+	if (NetThreads>0) {
+		netio_flush();
+	}
+}
+
+// network threads callbacks
+void matoclserv_net_gotpacket(void *owner,uint32_t type,const uint8_t *data,uint32_t length) {
+	matoclserventry *eptr = (matoclserventry*)owner;
+
+	if (eptr->mode==KILL || exiting) {
+		return;
+	}
+	eptr->lastread = main_time();
+	stats_prcvd++;
+	stats_brcvd+=length+8;
+	matoclserv_gotpacket(eptr,type,data,length);
+	if (eptr->mode==KILL) {
+		matoclserv_mark_pending(eptr);
 	}
-	*ndesc = pos;
-//	return max;
 }
 
+void matoclserv_net_closed(void *owner,uint8_t reason,uint32_t arg) {
+	matoclserventry *eptr = (matoclserventry*)owner;
 
-void matoclserv_serve(struct pollfd *pdesc) {
+	if (eptr->mode!=KILL) {
+		switch (reason) {
+			case NETIO_EOF:
+				if (eptr->registered>0 && eptr->registered<100) {	// show this message only for standard, registered clients
+					syslog(LOG_NOTICE,"connection with client(ip:%u.%u.%u.%u) has been closed by peer",(eptr->peerip>>24)&0xFF,(eptr->peerip>>16)&0xFF,(eptr->peerip>>8)&0xFF,eptr->peerip&0xFF);
+				}
+				break;
+			case NETIO_READERR:
+			case NETIO_WRITEERR:
+				errno = arg;
+#ifdef ECONNRESET
+				if (reason==NETIO_WRITEERR || errno!=ECONNRESET || eptr->registered<100) {
+#endif
+					mfs_arg_errlog_silent(LOG_NOTICE,"main master server module: (ip:%u.%u.%u.%u) %s error",(eptr->peerip>>24)&0xFF,(eptr->peerip>>16)&0xFF,(eptr->peerip>>8)&0xFF,eptr->peerip&0xFF,(reason==NETIO_READERR)?"read":"write");
+#ifdef ECONNRESET
+				}
+#endif
+				break;
+			case NETIO_TOOLONG:
+				syslog(LOG_WARNING,"main master server module: packet too long (%"PRIu32"/%u)",arg,MaxPacketSize);
+				break;
+		}
+		eptr->mode = KILL;
+	}
+	eptr->netstate = 2;
+	matoclserv_mark_pending(eptr);
+}
+
+void matoclserv_serve_connection(short revents,void *data) {
+	matoclserventry *eptr = (matoclserventry*)data;
 	uint32_t now=main_time();
-	matoclserventry *eptr,**kptr;
-	packetstruct *pptr,*paptr;
+
+	if (revents & (POLLERR|POLLHUP)) {
+		eptr->mode = KILL;
+	}
+	if ((revents & POLLIN) && eptr->mode!=KILL) {
+		eptr->lastread = now;
+		matoclserv_read(eptr);
+	}
+	if ((revents & POLLOUT) && eptr->mode!=KILL) {
+		eptr->lastwrite = now;
+		matoclserv_write(eptr);
+	}
+	// update mask at once - otherwise ready (level-triggered) descriptor would be returned again before flush
+	main_fdchange(eptr->pollhook,(eptr->mode==KILL)?0:((exiting?0:POLLIN)|(eptr->outputhead?POLLOUT:0)));
+	matoclserv_mark_pending(eptr);
+}
+
+void matoclserv_serve_listen(short revents,void *data) {
+	uint32_t now=main_time();
+	matoclserventry *eptr;
 	int ns;
 
-	if (lsockpdescpos>=0 && (pdesc[lsockpdescpos].revents & POLLIN)) {
-//	if (FD_ISSET(lsock,rset)) {
-		ns=tcpaccept(lsock);
-		if (ns<0) {
-			mfs_errlog_silent(LOG_NOTICE,"main master server module: accept error");
-		} else {
-			tcpnonblock(ns);
-			tcpnodelay(ns);
-			eptr = malloc(sizeof(matoclserventry));
-			passert(eptr);
-			eptr->next = matoclservhead;
-			matoclservhead = eptr;
-			eptr->sock = ns;
-			eptr->pdescpos = -1;
-			tcpgetpeer(ns,&(eptr->peerip),NULL);
-			eptr->registered = 0;
+	(void)data;
+	if ((revents & POLLIN)==0) {
+		return;
+	}
+	ns=tcpaccept(lsock);
+	if (ns<0) {
+		mfs_errlog_silent(LOG_NOTICE,"main master server module: accept error");
+	} else {
+		tcpnonblock(ns);
+		tcpnodelay(ns);
+		eptr = malloc(sizeof(matoclserventry));
+		passert(eptr);
+		eptr->next = matoclservhead;
+		if (eptr->next) {
+			eptr->next->prev = &(eptr->next);
+		}
+		eptr->prev = &matoclservhead;
+		matoclservhead = eptr;
+		eptr->sock = ns;
+		eptr->pollhook = NULL;
+		eptr->nc = NULL;
+		eptr->netstate = 0;
+		eptr->pending = 0;
+		eptr->nextpending = NULL;
+		tcpgetpeer(ns,&(eptr->peerip),NULL);
+		eptr->registered = 0;
 /* CACHENOTIFY
-			eptr->notifications = 0;
+		eptr->notifications = 0;
 */
-			eptr->version = 0;
-			eptr->mode = HEADER;
-			eptr->lastread = now;
-			eptr->lastwrite = now;
-			eptr->inputpacket.next = NULL;
-			eptr->inputpacket.bytesleft = 8;
-			eptr->inputpacket.startptr = eptr->hdrbuff;
-			eptr->inputpacket.packet = NULL;
-			eptr->outputhead = NULL;
-			eptr->outputtail = &(eptr->outputhead);
-
-			eptr->chunkdelayedops = NULL;
-			eptr->sesdata = NULL;
+		eptr->version = 0;
+		eptr->mode = HEADER;
+		eptr->lastread = now;
+		eptr->lastwrite = now;
+		eptr->inputpacket.next = NULL;
+		eptr->inputpacket.bytesleft = 8;
+		eptr->inputpacket.startptr = eptr->hdrbuff;
+		eptr->inputpacket.packet = NULL;
+		eptr->outputhead = NULL;
+		eptr->outputtail = &(eptr->outputhead);
+
+		eptr->chunkdelayedops = NULL;
+		eptr->fsjobdelayedops = NULL;
+		eptr->sesdata = NULL;
 /* CACHENOTIFY
-			eptr->cacheddirs = NULL;
+		eptr->cacheddirs = NULL;
 */
-			memset(eptr->passwordrnd,0,32);
-//			eptr->openedfiles = NULL;
+		memset(eptr->passwordrnd,0,32);
+//		eptr->openedfiles = NULL;
+		if (NetThreads>0) {
+			eptr->nc = netio_conn_new(ns,eptr);
+		} else {
+			eptr->pollhook = main_fdregister(ns,POLLIN,matoclserv_serve_connection,eptr);
 		}
 	}
+}
 
-// read
-	for (eptr=matoclservhead ; eptr ; eptr=eptr->next) {
-		if (eptr->pdescpos>=0) {
-			if (pdesc[eptr->pdescpos].revents & (POLLERR|POLLHUP)) {
-				eptr->mode = KILL;
-			}
-			if ((pdesc[eptr->pdescpos].revents & POLLIN) && eptr->mode!=KILL) {
-				eptr->lastread = now;
-				matoclserv_read(eptr);
-			}
-		}
-	}
+// timeouts and keep-alive - done once per second instead of every loop
+void matoclserv_check_connections(void) {
+	uint32_t now=main_time();
+	matoclserventry *eptr;
 
-// write
 	for (eptr=matoclservhead ; eptr ; eptr=eptr->next) {
+		if (eptr->mode==KILL) {
+			continue;
+		}
 		if (eptr->lastwrite+2<now && eptr->registered<100 && eptr->outputhead==NULL) {
 			uint8_t *ptr = matoclserv_createpacket(eptr,ANTOAN_NOP,4);	// 4 byte length because of 'msgid'
 			*((uint32_t*)ptr) = 0;
 		}
-		if (eptr->pdescpos>=0) {
-/* CACHENOTIFY
-			if (eptr->notifications) {
-				if (eptr->version>=0x010616) {
-					uint8_t *ptr = matoclserv_createpacket(eptr,MATOCL_FUSE_NOTIFY_END,4);	// transaction end
-					*((uint32_t*)ptr) = 0;
-				}
-				eptr->notifications = 0;
-			}
-*/
-			if ((((pdesc[eptr->pdescpos].events & POLLOUT)==0 && (eptr->outputhead)) || (pdesc[eptr->pdescpos].revents & POLLOUT)) && eptr->mode!=KILL) {
-				eptr->lastwrite = now;
-				matoclserv_write(eptr);
-			}
-		}
 		if (eptr->lastread+10<now && exiting==0) {
 			eptr->mode = KILL;
+			matoclserv_mark_pending(eptr);
 		}
 	}
+	matoclserv_flush();
+}
 
-// close
-	kptr = &matoclservhead;
-	while ((eptr=*kptr)) {
-		if (eptr->mode == KILL) {
-			matocl_beforedisconnect(eptr);
-			tcpclose(eptr->sock);
-			if (eptr->inputpacket.packet) {
-				free(eptr->inputpacket.packet);
-			}
-			pptr = eptr->outputhead;
-			while (pptr) {
-				if (pptr->packet) {
-					free(pptr->packet);
-				}
-				paptr = pptr;
-				pptr = pptr->next;
-				free(paptr);
-			}
-			*kptr = eptr->next;
-			free(eptr);
-		} else {
-			kptr = &(eptr->next);
+void matoclserv_wantexit(void) {
+	matoclserventry *eptr;
+	exiting=1;
+	if (lsockhook) {
+		main_fdunregister(lsockhook);
+		lsockhook = NULL;
+	}
+	for (eptr=matoclservhead ; eptr ; eptr=eptr->next) {
+		matoclserv_mark_pending(eptr);
+	}
+}
+
+int matoclserv_canexit(void) {
+	matoclserventry *eptr;
+	for (eptr=matoclservhead ; eptr ; eptr=eptr->next) {
+		if (eptr->outputhead!=NULL) {
+			return 0;
+		}
+		if (eptr->chunkdelayedops!=NULL) {
+			return 0;
 		}
 	}
+	if (NetThreads>0 && netio_busy()) {
+		return 0;
+	}
+	return 1;
 }
 
 void matoclserv_start_cond_check(void) {
@@ -4162,11 +4387,17 @@ void matoclserv_reload(void) {
 	mfs_arg_syslog(LOG_NOTICE,"main master server module: socket address has changed, now listen on %s:%s",ListenHost,ListenPort);
 	free(oldListenHost);
 	free(oldListenPort);
+	if (lsockhook) {
+		main_fdunregister(lsockhook);
+		lsockhook = main_fdregister(newlsock,POLLIN,matoclserv_serve_listen,NULL);
+	}
 	tcpclose(lsock);
 	lsock = newlsock;
 }
 
 int matoclserv_networkinit(void) {
+	int i;
+
 	if (cfg_isdefined("MATOCL_LISTEN_HOST") || cfg_isdefined("MATOCL_LISTEN_PORT") || !(cfg_isdefined("MATOCU_LISTEN_HOST") || cfg_isdefined("MATOCU_LISTEN_HOST"))) {
 		ListenHost = cfg_getstr("MATOCL_LISTEN_HOST","*");
 		ListenPort = cfg_getstr("MATOCL_LISTEN_PORT","9421");
@@ -4176,6 +4407,11 @@ int matoclserv_networkinit(void) {
 		ListenPort = cfg_getstr("MATOCU_LISTEN_PORT","9421");
 	}
 	RejectOld = cfg_getuint32("REJECT_OLD_CLIENTS",0);
+	NetThreads = cfg_getuint32("MATOCL_NET_THREADS",0);
+	if (NetThreads>64) {
+		NetThreads=64;
+		mfs_syslog(LOG_WARNING,"MATOCL_NET_THREADS too big (more than 64) - setting this value to 64");
+	}
 
 	exiting = 0;
 	starting = 12;
@@ -4195,8 +4431,22 @@ int matoclserv_networkinit(void) {
 		return -1;
 	}
 	mfs_arg_syslog(LOG_NOTICE,"main master server module: listen on %s:%s",ListenHost,ListenPort);
+	if (NetThreads>0) {
+		i = netio_init(NetThreads,MaxPacketSize,matoclserv_net_gotpacket,matoclserv_net_closed);
+		if (i<0) {
+			mfs_syslog(LOG_WARNING,"main master server module: can't start network threads - using main thread for client connections");
+			NetThreads = 0;
+		} else {
+			if ((uint32_t)i<NetThreads) {
+				mfs_arg_syslog(LOG_WARNING,"main master server module: only %d network threads (of %"PRIu32") have been started",i,NetThreads);
+				NetThreads = i;
+			}
+			mfs_arg_syslog(LOG_NOTICE,"main master server module: using %"PRIu32" network threads",NetThreads);
+		}
+	}
 
 	matoclservhead = NULL;
+	matoclservpending = NULL;
 /* CACHENOTIFY
 	matoclserv_dircache_init();
 */
@@ -4204,9 +4454,11 @@ int matoclserv_networkinit(void) {
 	main_timeregister(TIMEMODE_RUN_LATE,10,0,matoclserv_start_cond_check);
 	main_timeregister(TIMEMODE_RUN_LATE,10,0,matocl_session_check);
 	main_timeregister(TIMEMODE_RUN_LATE,3600,0,matocl_session_statsmove);
+	main_timeregister(TIMEMODE_RUN_LATE,1,0,matoclserv_check_connections);
 	main_reloadregister(matoclserv_reload);
 	main_destructregister(matoclserv_term);
-	main_pollregister(matoclserv_desc,matoclserv_serve);
+	lsockhook = main_fdregister(lsock,POLLIN,matoclserv_serve_listen,NULL);
+	main_eachloopregister(matoclserv_flush);
 	main_wantexitregister(matoclserv_wantexit);
 	main_canexitregister(matoclserv_canexit);
 	return 0;
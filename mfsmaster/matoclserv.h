@@ -22,6 +22,7 @@
 #include <inttypes.h>
 
 void matoclserv_stats(uint64_t stats[5]);
+void matoclserv_netstats(uint64_t stats[2]);
 /*
 void matoclserv_notify_attr(uint32_t dirinode,uint32_t inode,const uint8_t attr[35]);
 void matoclserv_notify_link(uint32_t dirinode,uint8_t nleng,const uint8_t *name,uint32_t inode,const uint8_t attr[35],uint32_t ts);
@@ -30,6 +31,7 @@ void matoclserv_notify_remove(uint32_t dirinode);
 void matoclserv_notify_parent(uint32_t dirinode,uint32_t parent);
 */
 void matoclserv_chunk_status(uint64_t chunkid,uint8_t status);
+void matoclserv_fsjob_finished(uint32_t jobid,uint8_t status,uint32_t changed,uint32_t notchanged,uint32_t notpermitted,uint32_t quotaexceeded);
 void matoclserv_init_sessions(uint32_t sessionid,uint32_t inode);
 int matoclserv_sessionsinit(void);
 int matoclserv_networkinit(void);
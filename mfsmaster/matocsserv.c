@@ -42,6 +42,7 @@
 #include "random.h"
 #include "slogger.h"
 #include "massert.h"
+#include "pktbuf.h"
 #include "mfsstrerr.h"
 #include "hashfn.h"
 
@@ -50,12 +51,11 @@
 // matocsserventry.mode
 enum{KILL,HEADER,DATA};
 
-typedef struct packetstruct {
-	struct packetstruct *next;
-	uint8_t *startptr;
-	uint32_t bytesleft;
-	uint8_t *packet;
-} packetstruct;
+// matocsserventry.registering
+enum{REG_NONE,REG_V5,REG_OLD};	// REG_V5 - until END packet, REG_OLD - until chunks from register packet are processed
+
+// matocsserventry.regmode - kind of chunk list in regbuff
+enum{REGLIST_CHUNKS,REGLIST_SAVED,REGLIST_CHANGED,REGLIST_LOST};
 
 typedef struct matocsserventry {
 	uint8_t mode;
@@ -77,6 +77,11 @@ typedef struct matocsserventry {
 	uint64_t todelusedspace;
 	uint64_t todeltotalspace;
 	uint32_t todelchunkscount;
+
+	uint32_t loadqueue;		// last load reported by server (CSTOMA_LOAD)
+	uint32_t loadreads;
+	uint32_t loadrlatency;
+	uint8_t loadknown;		// 0 - server hasn't reported its load yet (or it's older server)
 	uint32_t errorcounter;
 	uint16_t rrepcounter;
 	uint16_t wrepcounter;
@@ -85,6 +90,14 @@ typedef struct matocsserventry {
 	uint8_t incsdb;
 	double carry;
 
+	uint8_t registering;		// register process not finished - chunks from this server are not known yet
+	uint8_t *regbuff;		// register packet with chunks to be processed (next packets are not read until it is done)
+	const uint8_t *regptr;
+	uint32_t regleft;		// chunks left in regbuff
+	uint64_t regchunks;		// chunks processed during registration
+	uint8_t regmode;
+	uint32_t regepoch;		// last epoch received from server (0 - server can't resume registration)
+
 	struct matocsserventry *next;
 } matocsserventry;
 
@@ -96,6 +109,8 @@ static int32_t lsockpdescpos;
 // from config
 static char *ListenHost;
 static char *ListenPort;
+static uint32_t RegisterChunksPerLoop;
+static uint32_t ResumeTime;
 
 #define CSDBHASHSIZE 256
 //#define CSDBHASHFN(ip,port) ((((ip)*0x4F30FD53)+(port))%(CSDBHASHSIZE))
@@ -112,6 +127,10 @@ typedef struct csdbentry {
 //	uint64_t lasttodeltotalspace;
 //	uint32_t lasttodelchunkscount;
 	matocsserventry *eptr;
+	uint8_t *savedlist;		// chunks of disconnected server - kept for ResumeTime seconds for resuming registration
+	uint32_t savedchunks;
+	uint32_t savedepoch;
+	uint32_t savedtime;
 	struct csdbentry *next;
 } csdbentry;
 
@@ -128,6 +147,10 @@ int matocsserv_csdb_new_connection(uint32_t ip,uint16_t port,matocsserventry *ep
 				return -1;
 			}
 			csptr->eptr = eptr;
+			if (csptr->savedlist) {	// not resumed - chunks are sent again
+				free(csptr->savedlist);
+				csptr->savedlist = NULL;
+			}
 			return 0;
 		}
 	}
@@ -136,12 +159,16 @@ int matocsserv_csdb_new_connection(uint32_t ip,uint16_t port,matocsserventry *ep
 	csptr->ip = ip;
 	csptr->port = port;
 	csptr->eptr = eptr;
+	csptr->savedlist = NULL;
+	csptr->savedchunks = 0;
+	csptr->savedepoch = 0;
+	csptr->savedtime = 0;
 	csptr->next = csdbhash[hash];
 	csdbhash[hash] = csptr;
 	return 1;
 }
 
-void matocsserv_csdb_lost_connection(uint32_t ip,uint16_t port) {
+void matocsserv_csdb_lost_connection(uint32_t ip,uint16_t port,uint8_t *savedlist,uint32_t savedchunks,uint32_t savedepoch) {
 	uint32_t hash;
 	csdbentry *csptr;
 
@@ -149,9 +176,55 @@ void matocsserv_csdb_lost_connection(uint32_t ip,uint16_t port) {
 	for (csptr = csdbhash[hash] ; csptr ; csptr = csptr->next) {
 		if (csptr->ip == ip && csptr->port == port) {
 			csptr->eptr = NULL;
+			if (csptr->savedlist) {
+				free(csptr->savedlist);
+			}
+			csptr->savedlist = savedlist;
+			csptr->savedchunks = savedchunks;
+			csptr->savedepoch = savedepoch;
+			csptr->savedtime = main_time();
 			return;
 		}
 	}
+	if (savedlist) {
+		free(savedlist);
+	}
+}
+
+// returns chunks saved for given server and epoch (NULL when server can't resume registration) - list is removed from csdb
+uint8_t* matocsserv_csdb_take_saved(uint32_t ip,uint16_t port,uint32_t epoch,uint32_t *savedchunks) {
+	uint32_t hash;
+	csdbentry *csptr;
+	uint8_t *savedlist;
+
+	hash = CSDBHASHFN(ip,port);
+	for (csptr = csdbhash[hash] ; csptr ; csptr = csptr->next) {
+		if (csptr->ip == ip && csptr->port == port) {
+			if (csptr->eptr!=NULL || csptr->savedlist==NULL || csptr->savedepoch!=epoch) {
+				return NULL;
+			}
+			savedlist = csptr->savedlist;
+			*savedchunks = csptr->savedchunks;
+			csptr->savedlist = NULL;
+			return savedlist;
+		}
+	}
+	return NULL;
+}
+
+void matocsserv_csdb_check_saved(void) {
+	uint32_t hash;
+	csdbentry *csptr;
+	uint32_t now = main_time();
+
+	for (hash=0 ; hash<CSDBHASHSIZE ; hash++) {
+		for (csptr = csdbhash[hash] ; csptr ; csptr = csptr->next) {
+			if (csptr->savedlist && csptr->savedtime+ResumeTime<=now) {
+				free(csptr->savedlist);
+				csptr->savedlist = NULL;
+			}
+		}
+	}
 }
 
 uint32_t matocsserv_cservlist_size(void) {
@@ -174,7 +247,18 @@ void matocsserv_cservlist_data(uint8_t *ptr) {
 	for (hash=0 ; hash<CSDBHASHSIZE ; hash++) {
 		for (csptr = csdbhash[hash] ; csptr ; csptr = csptr->next) {
 			eptr = csptr->eptr;
-			if (eptr) {
+			if (eptr && eptr->registering) {	// chunks count during registration means progress
+				put32bit(&ptr,((eptr->version)&0xFFFFFF)|0x02000000);
+				put32bit(&ptr,eptr->servip);
+				put16bit(&ptr,eptr->servport);
+				put64bit(&ptr,eptr->usedspace);
+				put64bit(&ptr,eptr->totalspace);
+				put32bit(&ptr,eptr->regchunks);
+				put64bit(&ptr,eptr->todelusedspace);
+				put64bit(&ptr,eptr->todeltotalspace);
+				put32bit(&ptr,eptr->todelchunkscount);
+				put32bit(&ptr,eptr->errorcounter);
+			} else if (eptr) {
 				put32bit(&ptr,(eptr->version)&0xFFFFFF);
 				put32bit(&ptr,eptr->servip);
 				put16bit(&ptr,eptr->servport);
@@ -213,6 +297,9 @@ int matocsserv_csdb_remove_server(uint32_t ip,uint16_t port) {
 				return -1;
 			}
 			*cspptr = csptr->next;
+			if (csptr->savedlist) {
+				free(csptr->savedlist);
+			}
 			free(csptr);
 			return 1;
 		} else {
@@ -305,6 +392,19 @@ int matocsserv_replication_find(uint64_t chunkid,uint32_t version,void *dst) {
 	return 0;
 }
 
+// number of replications of given chunk in progress (to any server)
+uint32_t matocsserv_replication_count(uint64_t chunkid,uint32_t version) {
+	uint32_t hash = REPHASHFN(chunkid,version);
+	uint32_t cnt = 0;
+	repdst *r;
+	for (r=rephash[hash] ; r ; r=r->next) {
+		if (r->chunkid==chunkid && r->version==version) {
+			cnt++;
+		}
+	}
+	return cnt;
+}
+
 void matocsserv_replication_begin(uint64_t chunkid,uint32_t version,void *dst,uint8_t srccnt,void **src) {
 	uint32_t hash = REPHASHFN(chunkid,version);
 	uint8_t i;
@@ -417,7 +517,7 @@ void matocsserv_usagedifference(double *minusage,double *maxusage,uint16_t *usab
 	j = 0;
 	k = 0;
 	for (eptr = matocsservhead ; eptr && j<65535 && k<65535; eptr=eptr->next) {
-		if (eptr->mode!=KILL) {
+		if (eptr->mode!=KILL && eptr->registering==REG_NONE) {	// registering servers are counted when all their chunks are known
 			if (eptr->totalspace>0 && eptr->usedspace<=eptr->totalspace) {
 				space = (double)(eptr->usedspace) / (double)(eptr->totalspace);
 				if (j==0) {
@@ -750,7 +850,7 @@ uint16_t matocsserv_getservers_lessrepl(void* ptrs[65535],uint16_t replimit) {
 	void *x;
 	j=0;
 	for (eptr = matocsservhead ; eptr && j<65535; eptr=eptr->next) {
-		if (eptr->mode!=KILL && eptr->totalspace>0 && eptr->usedspace<=eptr->totalspace && (eptr->totalspace - eptr->usedspace)>(eptr->totalspace/100) && eptr->wrepcounter<replimit) {
+		if (eptr->mode!=KILL && eptr->registering==REG_NONE && eptr->totalspace>0 && eptr->usedspace<=eptr->totalspace && (eptr->totalspace - eptr->usedspace)>(eptr->totalspace/100) && eptr->wrepcounter<replimit) {
 			ptrs[j] = (void*)eptr;
 			j++;
 		}
@@ -898,6 +998,16 @@ int matocsserv_getlocation(void *e,uint32_t *servip,uint16_t *servport) {
 	return -1;
 }
 
+int matocsserv_getload(void *e,uint32_t *queue,uint32_t *reads,uint32_t *rlatency) {
+	matocsserventry *eptr = (matocsserventry *)e;
+	if (eptr->loadknown==0) {
+		return -1;
+	}
+	*queue = eptr->loadqueue;
+	*reads = eptr->loadreads;
+	*rlatency = eptr->loadrlatency;
+	return 0;
+}
 
 uint16_t matocsserv_replication_write_counter(void *e) {
 	matocsserventry *eptr = (matocsserventry *)e;
@@ -943,21 +1053,11 @@ uint8_t* matocsserv_createpacket(matocsserventry *eptr,uint32_t type,uint32_t si
 	uint8_t *ptr;
 	uint32_t psize;
 
-	outpacket=(packetstruct*)malloc(sizeof(packetstruct));
-	passert(outpacket);
 	psize = size+8;
-	outpacket->packet=malloc(psize);
-	passert(outpacket->packet);
-	outpacket->bytesleft = psize;
-//	if (outpacket->packet==NULL) {
-//		free(outpacket);
-//		return NULL;
-//	}
+	outpacket = pktbuf_packet(psize);
 	ptr = outpacket->packet;
 	put32bit(&ptr,type);
 	put32bit(&ptr,size);
-	outpacket->startptr = (uint8_t*)(outpacket->packet);
-	outpacket->next = NULL;
 	*(eptr->outputtail) = outpacket;
 	eptr->outputtail = &(outpacket->next);
 	return ptr;
@@ -1160,7 +1260,9 @@ void matocsserv_got_replicatechunk_status(matocsserventry *eptr,const uint8_t *d
 	matocsserv_replication_end(chunkid,version,eptr);
 	status = get8bit(&data);
 	chunk_got_replicate_status(eptr,chunkid,version,status);
-	if (status!=0) {
+	if (status==0) {	// failed replications are retried in next jobs loop
+		chunk_repq_refill();
+	} else {
 		syslog(LOG_NOTICE,"(%s:%"PRIu16") chunk: %016"PRIX64" replication status: %s",eptr->servstrip,eptr->servport,chunkid,mfsstrerr(status));
 	}
 }
@@ -1336,14 +1438,67 @@ void matocsserv_got_chunkop_status(matocsserventry *eptr,const uint8_t *data,uin
 	}
 }
 
-void matocsserv_register(matocsserventry *eptr,const uint8_t *data,uint32_t length) {
+static inline void matocsserv_register_freebuff(matocsserventry *eptr) {
+	if (eptr->regmode==REGLIST_SAVED) {
+		free(eptr->regbuff);
+	} else {
+		pktbuf_free(eptr->regbuff);
+	}
+	eptr->regbuff = NULL;
+}
+
+// takes over current input packet - its chunks are registered in parts by matocsserv_register_step
+void matocsserv_register_queue(matocsserventry *eptr,const uint8_t *data,uint32_t chunkcount,uint8_t regmode) {
+	eptr->regbuff = eptr->inputpacket.packet;
+	eptr->inputpacket.packet = NULL;
+	eptr->regptr = data;
+	eptr->regleft = chunkcount;
+	eptr->regmode = regmode;
+}
+
+// chunks saved when server has been disconnected - registered the same way as chunks from register packets
+void matocsserv_register_queue_saved(matocsserventry *eptr,uint8_t *savedlist,uint32_t savedchunks) {
+	eptr->regbuff = savedlist;
+	eptr->regptr = savedlist;
+	eptr->regleft = savedchunks;
+	eptr->regmode = REGLIST_SAVED;
+}
+
+void matocsserv_register_step(matocsserventry *eptr,uint32_t maxchunks) {
 	uint64_t chunkid;
 	uint32_t chunkversion;
-	uint32_t i,chunkcount;
+	while (eptr->regleft>0 && maxchunks>0 && eptr->mode!=KILL) {
+		chunkid = get64bit(&(eptr->regptr));
+		if (eptr->regmode==REGLIST_LOST) {
+			chunk_lost(eptr,chunkid);
+		} else {
+			chunkversion = get32bit(&(eptr->regptr));
+			if (eptr->regmode==REGLIST_CHANGED) {	// forget saved copy - current one is sent
+				chunk_lost(eptr,chunkid);
+			}
+			chunk_server_has_chunk(eptr,chunkid,chunkversion);
+		}
+		eptr->regleft--;
+		eptr->regchunks++;
+		maxchunks--;
+	}
+	if (eptr->regleft==0) {
+		matocsserv_register_freebuff(eptr);
+		if (eptr->registering==REG_OLD) {
+			eptr->registering = REG_NONE;
+			syslog(LOG_NOTICE,"chunkserver register - ip: %s, port: %"PRIu16", chunks: %"PRIu64" - all chunks have been registered",eptr->servstrip,eptr->servport,eptr->regchunks);
+		}
+	}
+}
+
+void matocsserv_register(matocsserventry *eptr,const uint8_t *data,uint32_t length) {
+	uint32_t chunkcount;
 	uint8_t rversion;
+	uint32_t epoch,savedchunks;
+	uint8_t *savedlist,*ptr;
 	double us,ts;
 
-	if (eptr->totalspace>0) {
+	if (eptr->totalspace>0 && (length!=5 || data[0]!=53)) {	// only new epochs are sent after registration
 		syslog(LOG_WARNING,"got register message from registered chunk-server !!!");
 		eptr->mode=KILL;
 		return;
@@ -1462,20 +1617,102 @@ void matocsserv_register(matocsserventry *eptr,const uint8_t *data,uint32_t leng
 				return;
 			}
 			eptr->incsdb = 1;
+			eptr->registering = REG_V5;
+			eptr->regchunks = 0;
 			syslog(LOG_NOTICE,"chunkserver register begin (packet version: 5) - ip: %s, port: %"PRIu16,eptr->servstrip,eptr->servport);
 			return;
+		} else if (rversion==60) {
+			if (length!=17) {
+				syslog(LOG_NOTICE,"CSTOMA_REGISTER (ver 6:RESUME/BEGIN) - wrong size (%"PRIu32"/17)",length);
+				eptr->mode=KILL;
+				return;
+			}
+			eptr->version = get32bit(&data);
+			eptr->servip = get32bit(&data);
+			eptr->servport = get16bit(&data);
+			eptr->timeout = get16bit(&data);
+			epoch = get32bit(&data);
+			if (eptr->timeout<10) {
+				syslog(LOG_NOTICE,"CSTOMA_REGISTER communication timeout too small (%"PRIu16" seconds - should be at least 10 seconds)",eptr->timeout);
+				eptr->mode=KILL;
+				return;
+			}
+			if (eptr->servip==0) {
+				tcpgetpeer(eptr->sock,&(eptr->servip),NULL);
+			}
+			if (eptr->servstrip) {
+				free(eptr->servstrip);
+			}
+			eptr->servstrip = matocsserv_makestrip(eptr->servip);
+			if (((eptr->servip)&0xFF000000) == 0x7F000000) {
+				syslog(LOG_NOTICE,"chunkserver connected using localhost (IP: %s) - you cannot use localhost for communication between chunkserver and master", eptr->servstrip);
+				eptr->mode=KILL;
+				return;
+			}
+			savedlist = NULL;
+			savedchunks = 0;
+			if (epoch!=0 && ResumeTime>0) {
+				savedlist = matocsserv_csdb_take_saved(eptr->servip,eptr->servport,epoch,&savedchunks);
+			}
+			ptr = matocsserv_createpacket(eptr,MATOCS_RESUME_STATUS,1);
+			if (savedlist==NULL) {	// server has to send all its chunks - BEGIN packet is expected
+				put8bit(&ptr,1);
+				if (epoch!=0) {
+					syslog(LOG_NOTICE,"chunkserver register resume rejected - ip: %s, port: %"PRIu16" - full registration needed",eptr->servstrip,eptr->servport);
+				}
+				return;
+			}
+			put8bit(&ptr,0);
+			if (matocsserv_csdb_new_connection(eptr->servip,eptr->servport,eptr)<0) {
+				free(savedlist);
+				syslog(LOG_WARNING,"chunk-server already connected !!!");
+				eptr->mode=KILL;
+				return;
+			}
+			eptr->incsdb = 1;
+			eptr->registering = REG_V5;
+			eptr->regchunks = 0;
+			matocsserv_register_queue_saved(eptr,savedlist,savedchunks);
+			syslog(LOG_NOTICE,"chunkserver register resume (packet version: 6) - ip: %s, port: %"PRIu16", saved chunks: %"PRIu32,eptr->servstrip,eptr->servport,savedchunks);
+			return;
+		} else if (rversion==61 || rversion==62) {
+			if (((length-1)%(rversion==61?12:8))!=0) {
+				syslog(LOG_NOTICE,"CSTOMA_REGISTER (ver 6:%s) - wrong size (%"PRIu32"/1+N*%u)",(rversion==61)?"CHANGED":"LOST",length,(rversion==61)?12:8);
+				eptr->mode=KILL;
+				return;
+			}
+			if (eptr->registering!=REG_V5) {
+				syslog(LOG_NOTICE,"CSTOMA_REGISTER (ver 6:%s) - got chunks without BEGIN packet",(rversion==61)?"CHANGED":"LOST");
+				eptr->mode=KILL;
+				return;
+			}
+			if (rversion==61) {
+				matocsserv_register_queue(eptr,data,(length-1)/12,REGLIST_CHANGED);
+			} else {
+				matocsserv_register_queue(eptr,data,(length-1)/8,REGLIST_LOST);
+			}
+			return;
+		} else if (rversion==53) {
+			if (length!=5) {
+				syslog(LOG_NOTICE,"CSTOMA_REGISTER (ver 5:EPOCH) - wrong size (%"PRIu32"/5)",length);
+				eptr->mode=KILL;
+				return;
+			}
+			eptr->regepoch = get32bit(&data);
+			return;
 		} else if (rversion==51) {
 			if (((length-1)%12)!=0) {
 				syslog(LOG_NOTICE,"CSTOMA_REGISTER (ver 5:CHUNKS) - wrong size (%"PRIu32"/1+N*12)",length);
 				eptr->mode=KILL;
 				return;
 			}
-			chunkcount = (length-1)/12;
-			for (i=0 ; i<chunkcount ; i++) {
-				chunkid = get64bit(&data);
-				chunkversion = get32bit(&data);
-				chunk_server_has_chunk(eptr,chunkid,chunkversion);
+			if (eptr->registering!=REG_V5) {
+				syslog(LOG_NOTICE,"CSTOMA_REGISTER (ver 5:CHUNKS) - got chunks without BEGIN packet");
+				eptr->mode=KILL;
+				return;
 			}
+			chunkcount = (length-1)/12;
+			matocsserv_register_queue(eptr,data,chunkcount,REGLIST_CHUNKS);
 			return;
 		} else if (rversion==52) {
 			if (length!=41) {
@@ -1489,6 +1726,7 @@ void matocsserv_register(matocsserventry *eptr,const uint8_t *data,uint32_t leng
 			eptr->todelusedspace = get64bit(&data);
 			eptr->todeltotalspace = get64bit(&data);
 			eptr->todelchunkscount = get32bit(&data);
+			eptr->registering = REG_NONE;
 			us = (double)(eptr->usedspace)/(double)(1024*1024*1024);
 			ts = (double)(eptr->totalspace)/(double)(1024*1024*1024);
 			syslog(LOG_NOTICE,"chunkserver register end (packet version: 5) - ip: %s, port: %"PRIu16", usedspace: %"PRIu64" (%.2lf GiB), totalspace: %"PRIu64" (%.2lf GiB)",eptr->servstrip,eptr->servport,eptr->usedspace,us,eptr->totalspace,ts);
@@ -1535,11 +1773,9 @@ void matocsserv_register(matocsserventry *eptr,const uint8_t *data,uint32_t leng
 //		eptr->setversion = NULL;
 //		eptr->duplication = NULL;
 		chunkcount = length/(8+4);
-		for (i=0 ; i<chunkcount ; i++) {
-			chunkid = get64bit(&data);
-			chunkversion = get32bit(&data);
-			chunk_server_has_chunk(eptr,chunkid,chunkversion);
-		}
+		eptr->registering = REG_OLD;
+		eptr->regchunks = 0;
+		matocsserv_register_queue(eptr,data,chunkcount,REGLIST_CHUNKS);
 	}
 }
 
@@ -1567,6 +1803,18 @@ void matocsserv_space(matocsserventry *eptr,const uint8_t *data,uint32_t length)
 	}
 }
 
+void matocsserv_load(matocsserventry *eptr,const uint8_t *data,uint32_t length) {
+	if (length!=12) {
+		syslog(LOG_NOTICE,"CSTOMA_LOAD - wrong size (%"PRIu32"/12)",length);
+		eptr->mode=KILL;
+		return;
+	}
+	eptr->loadqueue = get32bit(&data);
+	eptr->loadreads = get32bit(&data);
+	eptr->loadrlatency = get32bit(&data);
+	eptr->loadknown = 1;
+}
+
 void matocsserv_chunk_damaged(matocsserventry *eptr,const uint8_t *data,uint32_t length) {
 	uint64_t chunkid;
 	uint32_t i;
@@ -1681,6 +1929,9 @@ void matocsserv_gotpacket(matocsserventry *eptr,uint32_t type,const uint8_t *dat
 		case CSTOMA_CHUNK_NEW:
 			matocsserv_chunks_new(eptr,data,length);
 			break;
+		case CSTOMA_LOAD:
+			matocsserv_load(eptr,data,length);
+			break;
 		case CSTOMA_ERROR_OCCURRED:
 			matocsserv_error_occurred(eptr,data,length);
 			break;
@@ -1723,16 +1974,16 @@ void matocsserv_term(void) {
 	eptr = matocsservhead;
 	while (eptr) {
 		if (eptr->inputpacket.packet) {
-			free(eptr->inputpacket.packet);
+			pktbuf_free(eptr->inputpacket.packet);
+		}
+		if (eptr->regbuff) {
+			matocsserv_register_freebuff(eptr);
 		}
 		pptr = eptr->outputhead;
 		while (pptr) {
-			if (pptr->packet) {
-				free(pptr->packet);
-			}
 			paptr = pptr;
 			pptr = pptr->next;
-			free(paptr);
+			pktbuf_free(paptr);
 		}
 		if (eptr->servstrip) {
 			free(eptr->servstrip);
@@ -1782,8 +2033,7 @@ void matocsserv_read(matocsserventry *eptr) {
 					eptr->mode = KILL;
 					return;
 				}
-				eptr->inputpacket.packet = malloc(size);
-				passert(eptr->inputpacket.packet);
+				eptr->inputpacket.packet = pktbuf_alloc(size);
 				eptr->inputpacket.bytesleft = size;
 				eptr->inputpacket.startptr = eptr->inputpacket.packet;
 				eptr->mode = DATA;
@@ -1804,40 +2054,22 @@ void matocsserv_read(matocsserventry *eptr) {
 			matocsserv_gotpacket(eptr,type,eptr->inputpacket.packet,size);
 
 			if (eptr->inputpacket.packet) {
-				free(eptr->inputpacket.packet);
+				pktbuf_free(eptr->inputpacket.packet);
 			}
 			eptr->inputpacket.packet=NULL;
+
+			if (eptr->regbuff) {	// registration in progress - next packets can be read after processing all chunks
+				return;
+			}
 		}
 	}
 }
 
 void matocsserv_write(matocsserventry *eptr) {
-	packetstruct *pack;
-	int32_t i;
-	for (;;) {
-		pack = eptr->outputhead;
-		if (pack==NULL) {
-			return;
-		}
-		i=write(eptr->sock,pack->startptr,pack->bytesleft);
-		if (i<0) {
-			if (errno!=EAGAIN) {
-				mfs_arg_errlog_silent(LOG_NOTICE,"write to CS(%s) error",eptr->servstrip);
-				eptr->mode = KILL;
-			}
-			return;
-		}
-		pack->startptr+=i;
-		pack->bytesleft-=i;
-		if (pack->bytesleft>0) {
-			return;
-		}
-		free(pack->packet);
-		eptr->outputhead = pack->next;
-		if (eptr->outputhead==NULL) {
-			eptr->outputtail = &(eptr->outputhead);
-		}
-		free(pack);
+	uint32_t bytes,packets;
+	if (pktbuf_write(eptr->sock,&(eptr->outputhead),&(eptr->outputtail),&bytes,&packets)<0) {
+		mfs_arg_errlog_silent(LOG_NOTICE,"write to CS(%s) error",eptr->servstrip);
+		eptr->mode = KILL;
 	}
 }
 
@@ -1853,7 +2085,12 @@ void matocsserv_desc(struct pollfd *pdesc,uint32_t *ndesc) {
 //	FD_SET(lsock,rset);
 	for (eptr=matocsservhead ; eptr ; eptr=eptr->next) {
 		pdesc[pos].fd = eptr->sock;
-		pdesc[pos].events = POLLIN;
+		if (eptr->regbuff) {	// don't read until registration part is done - next part is processed in next loop
+			pdesc[pos].events = 0;
+			main_pollnowait();
+		} else {
+			pdesc[pos].events = POLLIN;
+		}
 		eptr->pdescpos = pos;
 //		i=eptr->sock;
 //		FD_SET(i,rset);
@@ -1873,6 +2110,9 @@ void matocsserv_serve(struct pollfd *pdesc) {
 	uint32_t peerip;
 	matocsserventry *eptr,**kptr;
 	packetstruct *pptr,*paptr;
+	uint32_t regservers,regshare;
+	uint8_t *savedlist;
+	uint32_t savedchunks;
 	int ns;
 
 	if (lsockpdescpos>=0 && (pdesc[lsockpdescpos].revents & POLLIN)) {
@@ -1911,11 +2151,22 @@ void matocsserv_serve(struct pollfd *pdesc) {
 			eptr->todelusedspace = 0;
 			eptr->todeltotalspace = 0;
 			eptr->todelchunkscount = 0;
+			eptr->loadqueue = 0;
+			eptr->loadreads = 0;
+			eptr->loadrlatency = 0;
+			eptr->loadknown = 0;
 			eptr->errorcounter = 0;
 			eptr->rrepcounter = 0;
 			eptr->wrepcounter = 0;
 			eptr->delcounter = 0;
 			eptr->incsdb = 0;
+			eptr->registering = REG_NONE;
+			eptr->regbuff = NULL;
+			eptr->regptr = NULL;
+			eptr->regleft = 0;
+			eptr->regchunks = 0;
+			eptr->regmode = REGLIST_CHUNKS;
+			eptr->regepoch = 0;
 
 			eptr->carry=(double)(rndu32())/(double)(0xFFFFFFFFU);
 //				eptr->creation=NULL;
@@ -1935,7 +2186,7 @@ void matocsserv_serve(struct pollfd *pdesc) {
 				eptr->lastread = now;
 				matocsserv_read(eptr);
 			}
-			if ((pdesc[eptr->pdescpos].revents & POLLOUT) && eptr->mode!=KILL) {
+			if ((pdesc[eptr->pdescpos].revents & POLLOUT) && eptr->outputhead!=NULL && eptr->mode!=KILL) {
 //			if (FD_ISSET(eptr->sock,wset) && eptr->mode!=KILL) {
 				eptr->lastwrite = now;
 				matocsserv_write(eptr);
@@ -1948,6 +2199,22 @@ void matocsserv_serve(struct pollfd *pdesc) {
 			matocsserv_createpacket(eptr,ANTOAN_NOP,0);
 		}
 	}
+	// chunks from register packets - limited number per loop (shared by all registering servers)
+	regservers = 0;
+	for (eptr=matocsservhead ; eptr ; eptr=eptr->next) {
+		if (eptr->regbuff && eptr->mode!=KILL) {
+			regservers++;
+		}
+	}
+	if (regservers>0) {
+		regshare = RegisterChunksPerLoop/regservers+1;
+		for (eptr=matocsservhead ; eptr ; eptr=eptr->next) {
+			if (eptr->regbuff && eptr->mode!=KILL) {
+				matocsserv_register_step(eptr,regshare);
+				eptr->lastread = now;
+			}
+		}
+	}
 	kptr = &matocsservhead;
 	while ((eptr=*kptr)) {
 		if (eptr->mode == KILL) {
@@ -1956,22 +2223,27 @@ void matocsserv_serve(struct pollfd *pdesc) {
 			ts = (double)(eptr->totalspace)/(double)(1024*1024*1024);
 			syslog(LOG_NOTICE,"chunkserver disconnected - ip: %s, port: %"PRIu16", usedspace: %"PRIu64" (%.2lf GiB), totalspace: %"PRIu64" (%.2lf GiB)",eptr->servstrip,eptr->servport,eptr->usedspace,us,eptr->totalspace,ts);
 			matocsserv_replication_disconnected(eptr);
-			chunk_server_disconnected(eptr);
-			if (eptr->incsdb) {
-				matocsserv_csdb_lost_connection(eptr->servip,eptr->servport);
+			if (eptr->incsdb && eptr->registering==REG_NONE && eptr->regepoch!=0 && ResumeTime>0) {	// keep chunks - server may resume registration
+				chunk_server_disconnected(eptr,&savedlist,&savedchunks);
+				matocsserv_csdb_lost_connection(eptr->servip,eptr->servport,savedlist,savedchunks,eptr->regepoch);
+			} else {
+				chunk_server_disconnected(eptr,NULL,NULL);
+				if (eptr->incsdb) {
+					matocsserv_csdb_lost_connection(eptr->servip,eptr->servport,NULL,0,0);
+				}
 			}
 			tcpclose(eptr->sock);
 			if (eptr->inputpacket.packet) {
-				free(eptr->inputpacket.packet);
+				pktbuf_free(eptr->inputpacket.packet);
+			}
+			if (eptr->regbuff) {
+				matocsserv_register_freebuff(eptr);
 			}
 			pptr = eptr->outputhead;
 			while (pptr) {
-				if (pptr->packet) {
-					free(pptr->packet);
-				}
 				paptr = pptr;
 				pptr = pptr->next;
-				free(paptr);
+				pktbuf_free(paptr);
 			}
 			if (eptr->servstrip) {
 				free(eptr->servstrip);
@@ -1984,10 +2256,19 @@ void matocsserv_serve(struct pollfd *pdesc) {
 	}
 }
 
+void matocsserv_register_reload(void) {
+	RegisterChunksPerLoop = cfg_getuint32("MATOCS_REGISTER_CHUNKS_PER_LOOP",20000);
+	if (RegisterChunksPerLoop==0) {
+		RegisterChunksPerLoop=1;
+	}
+	ResumeTime = cfg_getuint32("MATOCS_RESUME_TIME",300);
+}
+
 void matocsserv_reload(void) {
 	char *oldListenHost,*oldListenPort;
 	int newlsock;
 
+	matocsserv_register_reload();
 	oldListenHost = ListenHost;
 	oldListenPort = ListenPort;
 	ListenHost = cfg_getstr("MATOCS_LISTEN_HOST","*");
@@ -2033,6 +2314,7 @@ void matocsserv_reload(void) {
 int matocsserv_init(void) {
 	ListenHost = cfg_getstr("MATOCS_LISTEN_HOST","*");
 	ListenPort = cfg_getstr("MATOCS_LISTEN_PORT","9420");
+	matocsserv_register_reload();
 
 	lsock = tcpsocket();
 	if (lsock<0) {
@@ -2057,6 +2339,7 @@ int matocsserv_init(void) {
 	main_reloadregister(matocsserv_reload);
 	main_destructregister(matocsserv_term);
 	main_pollregister(matocsserv_desc,matocsserv_serve);
+	main_timeregister(TIMEMODE_RUN_LATE,10,0,matocsserv_csdb_check_saved);
 //	main_timeregister(TIMEMODE_SKIP_LATE,60,0,matocsserv_status);
 	return 0;
 }
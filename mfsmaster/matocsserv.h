@@ -29,8 +29,11 @@ uint16_t matocsserv_getservers_lessrepl(void* ptrs[65535],uint16_t replimit);
 void matocsserv_getspace(uint64_t *totalspace,uint64_t *availspace);
 char* matocsserv_getstrip(void *e);
 int matocsserv_getlocation(void *e,uint32_t *servip,uint16_t *servport);
+int matocsserv_getload(void *e,uint32_t *queue,uint32_t *reads,uint32_t *rlatency);
 uint16_t matocsserv_replication_read_counter(void *e);
 uint16_t matocsserv_replication_write_counter(void *e);
+int matocsserv_replication_find(uint64_t chunkid,uint32_t version,void *dst);
+uint32_t matocsserv_replication_count(uint64_t chunkid,uint32_t version);
 uint16_t matocsserv_deletion_counter(void *e);
 uint32_t matocsserv_cservlist_size(void);
 void matocsserv_cservlist_data(uint8_t *ptr);
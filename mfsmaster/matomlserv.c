@@ -30,31 +30,32 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <netinet/in.h>
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
 
 #include "MFSCommunication.h"
 
 #include "datapack.h"
 #include "matomlserv.h"
+#include "changelog.h"
+#include "filesystem.h"
+#include "matocsserv.h"
 #include "crc.h"
 #include "cfg.h"
 #include "main.h"
 #include "sockets.h"
 #include "slogger.h"
 #include "massert.h"
+#include "pktbuf.h"
 
 #define MaxPacketSize 1500000
 #define OLD_CHANGES_BLOCK_SIZE 5000
+#define LOG_BATCH_MAXBYTES 0x40000
 
 // matomlserventry.mode
 enum{KILL,HEADER,DATA};
 
-typedef struct packetstruct {
-	struct packetstruct *next;
-	uint8_t *startptr;
-	uint32_t bytesleft;
-	uint8_t *packet;
-} packetstruct;
-
 typedef struct matomlserventry {
 	uint8_t mode;
 	int sock;
@@ -69,6 +70,11 @@ typedef struct matomlserventry {
 	char *servstrip;		// human readable version of servip
 	uint32_t version;
 	uint32_t servip;
+	uint8_t binlog;			// metalogger accepts binary changelog records
+	uint8_t shadow;			// shadow master - wants periodic MATOML_CURRENT_VERSION
+	uint8_t logbatch;		// metalogger accepts LOG_BATCH (MLTOMA_REGISTER_BATCH* flags)
+	uint8_t *batchbuff;		// binary records not sent yet
+	uint32_t batchsize,batchrecords;
 
 	int metafd,chain1fd,chain2fd;
 
@@ -82,12 +88,15 @@ static int32_t lsockpdescpos;
 typedef struct old_changes_entry {
 	uint64_t version;
 	uint32_t length;
+	uint8_t binary;		// 1 - binary record, 0 - text entry (with terminating zero)
 	uint8_t *data;
 } old_changes_entry;
 
 typedef struct old_changes_block {
 	old_changes_entry old_changes_block [OLD_CHANGES_BLOCK_SIZE];
 	uint32_t entries;
+	uint8_t *zdata;		// whole (full) block compressed - entries data are freed then
+	uint32_t zsize,rawsize;
 	uint32_t mintimestamp;
 	uint64_t minversion;
 	struct old_changes_block *next;
@@ -100,16 +109,95 @@ static old_changes_block *old_changes_current=NULL;
 static char *ListenHost;
 static char *ListenPort;
 static uint16_t ChangelogSecondsToRemember;
+static uint32_t LogBatchRecords;
+static uint32_t LogBatchTime;
+static uint32_t LogCompressLevel;
+
+static uint8_t *zbuff = NULL;
+static uint32_t zbuffsize = 0;
 
 void matomlserv_old_changes_free_block(old_changes_block *oc) {
 	uint32_t i;
 	for (i=0 ; i<oc->entries ; i++) {
 		free(oc->old_changes_block[i].data);
 	}
+	if (oc->zdata) {
+		free(oc->zdata);
+	}
 	free(oc);
 }
 
-void matomlserv_store_logstring(uint64_t version,uint8_t *logstr,uint32_t logstrsize) {\
+#ifdef HAVE_ZLIB_H
+// compresses data into zbuff - returns compressed size or 0 when compression doesn't help
+static uint32_t matomlserv_compress(const uint8_t *data,uint32_t size) {
+	uLongf zsize;
+	zsize = compressBound(size);
+	if (zsize>zbuffsize) {
+		if (zbuff) {
+			free(zbuff);
+		}
+		zbuffsize = zsize;
+		zbuff = malloc(zbuffsize);
+		passert(zbuff);
+	}
+	if (compress2(zbuff,&zsize,data,size,LogCompressLevel)!=Z_OK || zsize>=size) {
+		return 0;
+	}
+	return zsize;
+}
+
+// full blocks are kept compressed - they are needed only when metalogger reconnects
+void matomlserv_old_changes_pack_block(old_changes_block *oc) {
+	uint8_t *raw,*ptr;
+	uint32_t i,size,zsize;
+
+	if (LogCompressLevel==0 || oc->zdata!=NULL || oc->entries==0) {
+		return;
+	}
+	size = 0;
+	for (i=0 ; i<oc->entries ; i++) {
+		size += oc->old_changes_block[i].length;
+	}
+	raw = malloc(size);
+	passert(raw);
+	ptr = raw;
+	for (i=0 ; i<oc->entries ; i++) {
+		memcpy(ptr,oc->old_changes_block[i].data,oc->old_changes_block[i].length);
+		ptr += oc->old_changes_block[i].length;
+	}
+	zsize = matomlserv_compress(raw,size);
+	free(raw);
+	if (zsize==0) {
+		return;
+	}
+	oc->zdata = malloc(zsize);
+	passert(oc->zdata);
+	memcpy(oc->zdata,zbuff,zsize);
+	oc->zsize = zsize;
+	oc->rawsize = size;
+	for (i=0 ; i<oc->entries ; i++) {
+		free(oc->old_changes_block[i].data);
+		oc->old_changes_block[i].data = NULL;
+	}
+}
+
+// returns records of packed block (in one buffer - has to be freed) or NULL on error
+uint8_t* matomlserv_old_changes_unpack_block(old_changes_block *oc) {
+	uint8_t *raw;
+	uLongf size;
+
+	raw = malloc(oc->rawsize);
+	passert(raw);
+	size = oc->rawsize;
+	if (uncompress(raw,&size,oc->zdata,oc->zsize)!=Z_OK || size!=oc->rawsize) {
+		free(raw);
+		return NULL;
+	}
+	return raw;
+}
+#endif
+
+void matomlserv_store_logrecord(uint64_t version,const uint8_t *logrec,uint32_t logrecsize,uint8_t binary) {
 	old_changes_block *oc;
 	old_changes_entry *oce;
 	uint32_t ts;
@@ -126,12 +214,18 @@ void matomlserv_store_logstring(uint64_t version,uint8_t *logstr,uint32_t logstr
 		passert(oc);
 		ts = main_time();
 		oc->entries = 0;
+		oc->zdata = NULL;
+		oc->zsize = 0;
+		oc->rawsize = 0;
 		oc->minversion = version;
 		oc->mintimestamp = ts;
 		oc->next = NULL;
 		if (old_changes_current==NULL || old_changes_head==NULL) {
 			old_changes_head = old_changes_current = oc;
 		} else {
+#ifdef HAVE_ZLIB_H
+			matomlserv_old_changes_pack_block(old_changes_current);
+#endif
 			old_changes_current->next = oc;
 			old_changes_current = oc;
 		}
@@ -144,10 +238,11 @@ void matomlserv_store_logstring(uint64_t version,uint8_t *logstr,uint32_t logstr
 	oc = old_changes_current;
 	oce = oc->old_changes_block + oc->entries;
 	oce->version = version;
-	oce->length = logstrsize;
-	oce->data = malloc(logstrsize);
+	oce->length = logrecsize;
+	oce->binary = binary;
+	oce->data = malloc(logrecsize);
 	passert(oce->data);
-	memcpy(oce->data,logstr,logstrsize);
+	memcpy(oce->data,logrec,logrecsize);
 	oc->entries++;
 }
 
@@ -212,28 +307,104 @@ uint8_t* matomlserv_createpacket(matomlserventry *eptr,uint32_t type,uint32_t si
 	uint8_t *ptr;
 	uint32_t psize;
 
-	outpacket=(packetstruct*)malloc(sizeof(packetstruct));
-	passert(outpacket);
 	psize = size+8;
-	outpacket->packet=malloc(psize);
-	passert(outpacket->packet);
-	outpacket->bytesleft = psize;
+	outpacket = pktbuf_packet(psize);
 	ptr = outpacket->packet;
 	put32bit(&ptr,type);
 	put32bit(&ptr,size);
-	outpacket->startptr = (uint8_t*)(outpacket->packet);
-	outpacket->next = NULL;
 	*(eptr->outputtail) = outpacket;
 	eptr->outputtail = &(outpacket->next);
 	return ptr;
 }
 
+// binary records go to metaloggers that asked for them while master writes binary changelog, others get legacy text entries
+void matomlserv_send_batch(matomlserventry *eptr) {
+	uint8_t *data;
+	uint32_t zsize;
+
+	if (eptr->batchrecords==0) {
+		return;
+	}
+	zsize = 0;
+#ifdef HAVE_ZLIB_H
+	if ((eptr->logbatch & MLFLAG_ZLIB) && LogCompressLevel>0) {
+		zsize = matomlserv_compress(eptr->batchbuff,eptr->batchsize);
+	}
+#endif
+	if (zsize>0) {
+		data = matomlserv_createpacket(eptr,MATOML_METACHANGES_LOG,1+4+4+1+zsize);
+		put8bit(&data,0xFD);
+		put32bit(&data,eptr->batchrecords);
+		put32bit(&data,eptr->batchsize);
+		put8bit(&data,1);
+		memcpy(data,zbuff,zsize);
+	} else {
+		data = matomlserv_createpacket(eptr,MATOML_METACHANGES_LOG,1+4+4+1+eptr->batchsize);
+		put8bit(&data,0xFD);
+		put32bit(&data,eptr->batchrecords);
+		put32bit(&data,eptr->batchsize);
+		put8bit(&data,0);
+		memcpy(data,eptr->batchbuff,eptr->batchsize);
+	}
+	eptr->batchsize = 0;
+	eptr->batchrecords = 0;
+}
+
+void matomlserv_send_logrecord(matomlserventry *eptr,uint64_t version,const uint8_t *logrec,uint32_t logrecsize,uint8_t binary) {
+	static char *logstr = NULL;
+	static uint32_t logstrsize = 0;
+	uint32_t leng;
+	uint8_t *data;
+
+	if (eptr->logbatch && binary) {
+		if (eptr->batchsize+logrecsize>LOG_BATCH_MAXBYTES) {
+			matomlserv_send_batch(eptr);
+		}
+		if (logrecsize<=LOG_BATCH_MAXBYTES) {
+			if (eptr->batchbuff==NULL) {
+				eptr->batchbuff = malloc(LOG_BATCH_MAXBYTES);
+				passert(eptr->batchbuff);
+			}
+			memcpy(eptr->batchbuff+eptr->batchsize,logrec,logrecsize);
+			eptr->batchsize += logrecsize;
+			eptr->batchrecords++;
+			if (eptr->batchrecords>=LogBatchRecords) {
+				matomlserv_send_batch(eptr);
+			}
+			return;
+		}
+	}
+	matomlserv_send_batch(eptr);	// keep order
+	if (binary==0) {
+		data = matomlserv_createpacket(eptr,MATOML_METACHANGES_LOG,9+logrecsize);
+		put8bit(&data,0xFF);
+		put64bit(&data,version);
+		memcpy(data,logrec,logrecsize);
+	} else if (eptr->binlog) {
+		data = matomlserv_createpacket(eptr,MATOML_METACHANGES_LOG,1+logrecsize);
+		put8bit(&data,0xFE);
+		memcpy(data,logrec,logrecsize);
+	} else {
+		leng = changelogbin_totext(logrec,logrecsize,&logstr,&logstrsize);
+		if (leng==(uint32_t)-1) {
+			return;
+		}
+		data = matomlserv_createpacket(eptr,MATOML_METACHANGES_LOG,9+leng+1);
+		put8bit(&data,0xFF);
+		put64bit(&data,version);
+		memcpy(data,logstr,leng+1);
+	}
+}
+
 void matomlserv_send_old_changes(matomlserventry *eptr,uint64_t version) {
 	old_changes_block *oc;
 	old_changes_entry *oce;
-	uint8_t *data;
 	uint8_t start=0;
 	uint32_t i;
+#ifdef HAVE_ZLIB_H
+	uint8_t *raw;
+	const uint8_t *rptr;
+#endif
 	if (old_changes_head==NULL) {
 		// syslog(LOG_WARNING,"meta logger wants old changes, but storage is disabled");
 		return;
@@ -247,17 +418,34 @@ void matomlserv_send_old_changes(matomlserventry *eptr,uint64_t version) {
 			start=1;
 		}
 		if (start) {
+#ifdef HAVE_ZLIB_H
+			if (oc->zdata) {
+				raw = matomlserv_old_changes_unpack_block(oc);
+				if (raw==NULL) {
+					syslog(LOG_WARNING,"can't decompress old changes block (versions from %"PRIu64")",oc->minversion);
+					return;
+				}
+				rptr = raw;
+				for (i=0 ; i<oc->entries ; i++) {
+					oce = oc->old_changes_block + i;
+					if (oce->version>version) {
+						matomlserv_send_logrecord(eptr,oce->version,rptr,oce->length,oce->binary);
+					}
+					rptr += oce->length;
+				}
+				free(raw);
+				continue;
+			}
+#endif
 			for (i=0 ; i<oc->entries ; i++) {
 				oce = oc->old_changes_block + i;
-				if (version>=oce->version) {
-					data = matomlserv_createpacket(eptr,MATOML_METACHANGES_LOG,9+oce->length);
-					put8bit(&data,0xFF);
-					put64bit(&data,oce->version);
-					memcpy(data,oce->data,oce->length);
+				if (oce->version>version) {
+					matomlserv_send_logrecord(eptr,oce->version,oce->data,oce->length,oce->binary);
 				}
 			}
 		}
 	}
+	matomlserv_send_batch(eptr);
 }
 
 void matomlserv_register(matomlserventry *eptr,const uint8_t *data,uint32_t length) {
@@ -293,6 +481,29 @@ void matomlserv_register(matomlserventry *eptr,const uint8_t *data,uint32_t leng
 			eptr->timeout = get16bit(&data);
 			minversion = get64bit(&data);
 			matomlserv_send_old_changes(eptr,minversion);
+		} else if (rversion==3 || rversion==4 || rversion==5) {
+			if (length!=((rversion==5)?7+8+1:7+8)) {
+				syslog(LOG_NOTICE,"MLTOMA_REGISTER (ver %"PRIu8") - wrong size (%"PRIu32"/%u)",rversion,length,(rversion==5)?16:15);
+				eptr->mode=KILL;
+				return;
+			}
+			eptr->version = get32bit(&data);
+			eptr->timeout = get16bit(&data);
+			minversion = get64bit(&data);
+			eptr->binlog = 1;
+			eptr->shadow = (rversion==4)?1:0;
+			if (rversion==5) {
+				eptr->logbatch = get8bit(&data);
+#ifndef HAVE_ZLIB_H
+				eptr->logbatch &= ~MLFLAG_ZLIB;
+#endif
+				if ((eptr->logbatch & MLFLAG_BATCH)==0) {
+					eptr->logbatch = 0;
+				}
+			}
+			if (minversion>0) {
+				matomlserv_send_old_changes(eptr,minversion);
+			}
 		} else {
 			syslog(LOG_NOTICE,"MLTOMA_REGISTER - wrong version (%"PRIu8"/1)",rversion);
 			eptr->mode=KILL;
@@ -334,6 +545,7 @@ void matomlserv_download_start(matomlserventry *eptr,const uint8_t *data,uint32_
 		}
 	}
 	if (filenum==1) {
+		changelog_flush();
 		eptr->metafd = open("metadata.mfs.back",O_RDONLY);
 		eptr->chain1fd = open("changelog.0.mfs",O_RDONLY);
 		eptr->chain2fd = open("changelog.1.mfs",O_RDONLY);
@@ -421,18 +633,53 @@ void matomlserv_download_end(matomlserventry *eptr,const uint8_t *data,uint32_t
 	}
 }
 
-void matomlserv_broadcast_logstring(uint64_t version,uint8_t *logstr,uint32_t logstrsize) {
+void matomlserv_broadcast_logrecord(uint64_t version,const uint8_t *logrec,uint32_t logrecsize) {
+	matomlserventry *eptr;
+
+	matomlserv_store_logrecord(version,logrec,logrecsize,1);
+
+	for (eptr = matomlservhead ; eptr ; eptr=eptr->next) {
+		if (eptr->version>0) {
+			matomlserv_send_logrecord(eptr,version,logrec,logrecsize,1);
+		}
+	}
+}
+
+void matomlserv_broadcast_logstring(uint64_t version,const char *logstr,uint32_t logstrsize) {
 	matomlserventry *eptr;
-	uint8_t *data;
 
-	matomlserv_store_logstring(version,logstr,logstrsize);
+	matomlserv_store_logrecord(version,(const uint8_t*)logstr,logstrsize,0);
 
 	for (eptr = matomlservhead ; eptr ; eptr=eptr->next) {
 		if (eptr->version>0) {
-			data = matomlserv_createpacket(eptr,MATOML_METACHANGES_LOG,9+logstrsize);
-			put8bit(&data,0xFF);
-			put64bit(&data,version);
-			memcpy(data,logstr,logstrsize);
+			matomlserv_send_logrecord(eptr,version,(const uint8_t*)logstr,logstrsize,0);
+		}
+	}
+}
+
+void matomlserv_broadcast_currentversion(void) {
+	matomlserventry *eptr;
+	uint64_t totalspace,availspace;
+	uint8_t *data;
+	totalspace = 0;
+	availspace = 0;
+	matocsserv_getspace(&totalspace,&availspace);
+	for (eptr = matomlservhead ; eptr ; eptr=eptr->next) {
+		if (eptr->version>0 && eptr->shadow && eptr->mode!=KILL) {
+			data = matomlserv_createpacket(eptr,MATOML_CURRENT_VERSION,8+8+8);
+			put64bit(&data,fs_getversion());
+			put64bit(&data,totalspace);
+			put64bit(&data,availspace);
+		}
+	}
+}
+
+void matomlserv_flush_batches(void) {
+	matomlserventry *eptr;
+
+	for (eptr = matomlservhead ; eptr ; eptr=eptr->next) {
+		if (eptr->version>0 && eptr->mode!=KILL) {
+			matomlserv_send_batch(eptr);
 		}
 	}
 }
@@ -443,6 +690,7 @@ void matomlserv_broadcast_logrotate() {
 
 	for (eptr = matomlservhead ; eptr ; eptr=eptr->next) {
 		if (eptr->version>0) {
+			matomlserv_send_batch(eptr);
 			data = matomlserv_createpacket(eptr,MATOML_METACHANGES_LOG,1);
 			put8bit(&data,0x55);
 		}
@@ -499,22 +747,25 @@ void matomlserv_term(void) {
 	eptr = matomlservhead;
 	while (eptr) {
 		if (eptr->inputpacket.packet) {
-			free(eptr->inputpacket.packet);
+			pktbuf_free(eptr->inputpacket.packet);
 		}
 		pptr = eptr->outputhead;
 		while (pptr) {
-			if (pptr->packet) {
-				free(pptr->packet);
-			}
 			paptr = pptr;
 			pptr = pptr->next;
-			free(paptr);
+			pktbuf_free(paptr);
+		}
+		if (eptr->batchbuff) {
+			free(eptr->batchbuff);
 		}
 		eaptr = eptr;
 		eptr = eptr->next;
 		free(eaptr);
 	}
 	matomlservhead=NULL;
+	if (zbuff) {
+		free(zbuff);
+	}
 
 	free(ListenHost);
 	free(ListenPort);
@@ -555,8 +806,7 @@ void matomlserv_read(matomlserventry *eptr) {
 					eptr->mode = KILL;
 					return;
 				}
-				eptr->inputpacket.packet = malloc(size);
-				passert(eptr->inputpacket.packet);
+				eptr->inputpacket.packet = pktbuf_alloc(size);
 				eptr->inputpacket.bytesleft = size;
 				eptr->inputpacket.startptr = eptr->inputpacket.packet;
 				eptr->mode = DATA;
@@ -577,7 +827,7 @@ void matomlserv_read(matomlserventry *eptr) {
 			matomlserv_gotpacket(eptr,type,eptr->inputpacket.packet,size);
 
 			if (eptr->inputpacket.packet) {
-				free(eptr->inputpacket.packet);
+				pktbuf_free(eptr->inputpacket.packet);
 			}
 			eptr->inputpacket.packet=NULL;
 		}
@@ -585,32 +835,10 @@ void matomlserv_read(matomlserventry *eptr) {
 }
 
 void matomlserv_write(matomlserventry *eptr) {
-	packetstruct *pack;
-	int32_t i;
-	for (;;) {
-		pack = eptr->outputhead;
-		if (pack==NULL) {
-			return;
-		}
-		i=write(eptr->sock,pack->startptr,pack->bytesleft);
-		if (i<0) {
-			if (errno!=EAGAIN) {
-				mfs_arg_errlog_silent(LOG_NOTICE,"write to ML(%s) error",eptr->servstrip);
-				eptr->mode = KILL;
-			}
-			return;
-		}
-		pack->startptr+=i;
-		pack->bytesleft-=i;
-		if (pack->bytesleft>0) {
-			return;
-		}
-		free(pack->packet);
-		eptr->outputhead = pack->next;
-		if (eptr->outputhead==NULL) {
-			eptr->outputtail = &(eptr->outputhead);
-		}
-		free(pack);
+	uint32_t bytes,packets;
+	if (pktbuf_write(eptr->sock,&(eptr->outputhead),&(eptr->outputtail),&bytes,&packets)<0) {
+		mfs_arg_errlog_silent(LOG_NOTICE,"write to ML(%s) error",eptr->servstrip);
+		eptr->mode = KILL;
 	}
 }
 
@@ -666,6 +894,12 @@ void matomlserv_serve(struct pollfd *pdesc) {
 			tcpgetpeer(eptr->sock,&(eptr->servip),NULL);
 			eptr->servstrip = matomlserv_makestrip(eptr->servip);
 			eptr->version=0;
+			eptr->binlog=0;
+			eptr->shadow=0;
+			eptr->logbatch=0;
+			eptr->batchbuff=NULL;
+			eptr->batchsize=0;
+			eptr->batchrecords=0;
 			eptr->metafd=-1;
 			eptr->chain1fd=-1;
 			eptr->chain2fd=-1;
@@ -698,20 +932,20 @@ void matomlserv_serve(struct pollfd *pdesc) {
 			matomlserv_beforeclose(eptr);
 			tcpclose(eptr->sock);
 			if (eptr->inputpacket.packet) {
-				free(eptr->inputpacket.packet);
+				pktbuf_free(eptr->inputpacket.packet);
 			}
 			pptr = eptr->outputhead;
 			while (pptr) {
-				if (pptr->packet) {
-					free(pptr->packet);
-				}
 				paptr = pptr;
 				pptr = pptr->next;
-				free(paptr);
+				pktbuf_free(paptr);
 			}
 			if (eptr->servstrip) {
 				free(eptr->servstrip);
 			}
+			if (eptr->batchbuff) {
+				free(eptr->batchbuff);
+			}
 			*kptr = eptr->next;
 			free(eptr);
 		} else {
@@ -720,10 +954,22 @@ void matomlserv_serve(struct pollfd *pdesc) {
 	}
 }
 
+void matomlserv_batch_reload(void) {
+	LogBatchRecords = cfg_getuint32("MATOML_LOG_BATCH_RECORDS",100);
+	if (LogBatchRecords==0) {
+		LogBatchRecords=1;
+	}
+	LogCompressLevel = cfg_getuint32("MATOML_LOG_COMPRESSION",1);
+	if (LogCompressLevel>9) {
+		LogCompressLevel=9;
+	}
+}
+
 void matomlserv_reload(void) {
 	char *oldListenHost,*oldListenPort;
 	int newlsock;
 
+	matomlserv_batch_reload();
 	oldListenHost = ListenHost;
 	oldListenPort = ListenPort;
 	ListenHost = cfg_getstr("MATOML_LISTEN_HOST","*");
@@ -803,5 +1049,14 @@ int matomlserv_init(void) {
 	main_destructregister(matomlserv_term);
 	main_pollregister(matomlserv_desc,matomlserv_serve);
 	main_timeregister(TIMEMODE_SKIP_LATE,3600,0,matomlserv_status);
+	main_msectimeregister(TIMEMODE_SKIP_LATE,500,0,matomlserv_broadcast_currentversion);
+	matomlserv_batch_reload();
+	LogBatchTime = cfg_getuint32("MATOML_LOG_BATCH_TIME",100);
+	if (LogBatchTime<10) {
+		LogBatchTime=10;
+	} else if (LogBatchTime>1000) {
+		LogBatchTime=1000;
+	}
+	main_msectimeregister(TIMEMODE_SKIP_LATE,LogBatchTime,0,matomlserv_flush_batches);
 	return 0;
 }
@@ -24,7 +24,9 @@
 uint32_t matomlserv_mloglist_size(void);
 void matomlserv_mloglist_data(uint8_t *ptr);
 
-void matomlserv_broadcast_logstring(uint64_t version,uint8_t *logstr,uint32_t logstrsize);
+void matomlserv_broadcast_logrecord(uint64_t version,const uint8_t *logrec,uint32_t logrecsize);
+// text changelog entry - logstrsize includes terminating zero
+void matomlserv_broadcast_logstring(uint64_t version,const char *logstr,uint32_t logstrsize);
 void matomlserv_broadcast_logrotate();
 int matomlserv_init(void);
 
@@ -0,0 +1,330 @@
+/*
+   Copyright 2005-2010 Jakub Kruszona-Zawadzki, Gemius SA.
+
+   This file is part of MooseFS.
+
+   MooseFS is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, version 3.
+
+   MooseFS is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MooseFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "metaindex.h"
+#include "datapack.h"
+#include "massert.h"
+
+#define MAXSECTIONS 64
+#define MAXPARTS 0x1000000
+
+static metaindex_section sections[MAXSECTIONS];
+static uint32_t sectionscnt;
+static uint32_t partssize;
+static uint8_t storing;
+
+static void metaindex_addpart(metaindex_section *s,uint64_t offset,uint32_t records) {
+	if (s->partscnt>=partssize) {
+		partssize = (partssize==0)?64:partssize*2;
+		s->parts = realloc(s->parts,sizeof(metaindex_part)*partssize);
+		passert(s->parts);
+	}
+	s->parts[s->partscnt].offset = offset;
+	s->parts[s->partscnt].records = records;
+	s->parts[s->partscnt].first = s->records;
+	s->partscnt++;
+	s->records += records;
+}
+
+void metaindex_free(void) {
+	uint32_t i;
+	for (i=0 ; i<sectionscnt ; i++) {
+		if (sections[i].parts) {
+			free(sections[i].parts);
+		}
+	}
+	memset(sections,0,sizeof(sections));
+	sectionscnt = 0;
+	storing = 0;
+}
+
+/* storing */
+
+static uint64_t curpartoffset;
+static uint32_t curpartrecords;
+
+void metaindex_store_begin(void) {
+	metaindex_free();
+	storing = 1;
+}
+
+void metaindex_section_begin(FILE *fd,const char *name) {
+	metaindex_section *s;
+	if (storing==0 || sectionscnt>=MAXSECTIONS) {
+		return;
+	}
+	s = sections+sectionscnt;
+	memcpy(s->name,name,8);
+	s->offset = ftello(fd);
+	s->length = 0;
+	s->partscnt = 0;
+	s->records = 0;
+	s->parts = NULL;
+	partssize = 0;
+	curpartoffset = s->offset;
+	curpartrecords = 0;
+	sectionscnt++;
+}
+
+void metaindex_part_begin(FILE *fd) {
+	if (storing==0 || sectionscnt==0 || curpartrecords>0) {
+		return;
+	}
+	curpartoffset = ftello(fd);
+}
+
+void metaindex_add(FILE *fd,uint32_t records) {
+	if (storing==0 || sectionscnt==0) {
+		return;
+	}
+	curpartrecords += records;
+	if (curpartrecords>=METAINDEX_PART_RECORDS) {
+		metaindex_addpart(sections+sectionscnt-1,curpartoffset,curpartrecords);
+		curpartoffset = ftello(fd);
+		curpartrecords = 0;
+	}
+}
+
+void metaindex_section_end(FILE *fd) {
+	metaindex_section *s;
+	if (storing==0 || sectionscnt==0) {
+		return;
+	}
+	s = sections+sectionscnt-1;
+	if (curpartrecords>0) {
+		metaindex_addpart(s,curpartoffset,curpartrecords);
+		curpartrecords = 0;
+	}
+	s->length = ftello(fd) - s->offset;
+}
+
+void metaindex_store(FILE *fd) {
+	uint8_t hdr[8+8+8+4],*ptr;
+	uint64_t indexoffset,leng;
+	uint32_t i,j;
+
+	indexoffset = ftello(fd);
+	leng = 4+8;
+	for (i=0 ; i<sectionscnt ; i++) {
+		leng += 8+8+8+4+(8+4)*(uint64_t)(sections[i].partscnt);
+	}
+	ptr = hdr;
+	memcpy(ptr,"INDX 1.0",8);
+	ptr+=8;
+	put64bit(&ptr,leng);
+	put32bit(&ptr,sectionscnt);
+	if (fwrite(hdr,1,8+8+4,fd)!=(size_t)(8+8+4)) {
+		syslog(LOG_NOTICE,"fwrite error");
+		return;
+	}
+	for (i=0 ; i<sectionscnt ; i++) {
+		ptr = hdr;
+		memcpy(ptr,sections[i].name,8);
+		ptr+=8;
+		put64bit(&ptr,sections[i].offset);
+		put64bit(&ptr,sections[i].length);
+		put32bit(&ptr,sections[i].partscnt);
+		if (fwrite(hdr,1,8+8+8+4,fd)!=(size_t)(8+8+8+4)) {
+			syslog(LOG_NOTICE,"fwrite error");
+			return;
+		}
+		for (j=0 ; j<sections[i].partscnt ; j++) {
+			ptr = hdr;
+			put64bit(&ptr,sections[i].parts[j].offset);
+			put32bit(&ptr,sections[i].parts[j].records);
+			if (fwrite(hdr,1,8+4,fd)!=(size_t)(8+4)) {
+				syslog(LOG_NOTICE,"fwrite error");
+				return;
+			}
+		}
+	}
+	ptr = hdr;
+	put64bit(&ptr,indexoffset);
+	if (fwrite(hdr,1,8,fd)!=(size_t)8) {
+		syslog(LOG_NOTICE,"fwrite error");
+		return;
+	}
+	metaindex_free();
+}
+
+/* loading */
+
+int metaindex_load(FILE *fd) {
+	uint8_t hdr[8+8+8+4];
+	const uint8_t *ptr;
+	uint64_t fileleng,indexoffset,leng,offset;
+	uint32_t i,j,scnt,pcnt,records;
+	metaindex_section *s;
+
+	metaindex_free();
+	if (fseeko(fd,0,SEEK_END)<0) {
+		return -1;
+	}
+	fileleng = ftello(fd);
+	if (fileleng<16+16+4+8+16) {
+		return -1;
+	}
+	if (fseeko(fd,fileleng-16-8,SEEK_SET)<0 || fread(hdr,1,8+16,fd)!=8+16 || memcmp(hdr+8,"[MFS EOF MARKER]",16)!=0) {
+		return -1;
+	}
+	ptr = hdr;
+	indexoffset = get64bit(&ptr);
+	if (indexoffset+16+4+8>fileleng-16 || fseeko(fd,indexoffset,SEEK_SET)<0 || fread(hdr,1,8+8+4,fd)!=8+8+4 || memcmp(hdr,"INDX 1.0",8)!=0) {
+		return -1;
+	}
+	ptr = hdr+8;
+	leng = get64bit(&ptr);
+	scnt = get32bit(&ptr);
+	if (indexoffset+16+leng!=fileleng-16 || scnt>MAXSECTIONS) {
+		return -1;
+	}
+	for (i=0 ; i<scnt ; i++) {
+		if (fread(hdr,1,8+8+8+4,fd)!=8+8+8+4) {
+			metaindex_free();
+			return -1;
+		}
+		s = sections+sectionscnt;
+		sectionscnt++;
+		memcpy(s->name,hdr,8);
+		ptr = hdr+8;
+		s->offset = get64bit(&ptr);
+		s->length = get64bit(&ptr);
+		pcnt = get32bit(&ptr);
+		if (s->offset+s->length>indexoffset || pcnt>MAXPARTS) {
+			metaindex_free();
+			return -1;
+		}
+		s->partscnt = 0;
+		s->records = 0;
+		s->parts = NULL;
+		partssize = 0;
+		for (j=0 ; j<pcnt ; j++) {
+			if (fread(hdr,1,8+4,fd)!=8+4) {
+				metaindex_free();
+				return -1;
+			}
+			ptr = hdr;
+			offset = get64bit(&ptr);
+			records = get32bit(&ptr);
+			if (offset<s->offset || offset>=s->offset+s->length || (j>0 && offset<=s->parts[j-1].offset)) {
+				metaindex_free();
+				return -1;
+			}
+			metaindex_addpart(s,offset,records);
+		}
+	}
+	return 0;
+}
+
+const metaindex_section* metaindex_find(const char *name) {
+	uint32_t i;
+	for (i=0 ; i<sectionscnt ; i++) {
+		if (memcmp(sections[i].name,name,8)==0) {
+			return sections+i;
+		}
+	}
+	return NULL;
+}
+
+uint32_t metaindex_count(void) {
+	return sectionscnt;
+}
+
+const metaindex_section* metaindex_get(uint32_t indx) {
+	if (indx>=sectionscnt) {
+		return NULL;
+	}
+	return sections+indx;
+}
+
+/* thread pool used by parallel loader */
+
+typedef struct _runstate {
+	pthread_mutex_t lock;
+	uint32_t nextjob;
+	uint32_t jobs;
+	int status;
+	int (*job)(uint32_t jobno,void *arg);
+	void *arg;
+} runstate;
+
+static void* metaindex_worker(void *arg) {
+	runstate *rs = (runstate*)arg;
+	uint32_t jobno;
+	for (;;) {
+		zassert(pthread_mutex_lock(&(rs->lock)));
+		if (rs->nextjob>=rs->jobs || rs->status<0) {
+			zassert(pthread_mutex_unlock(&(rs->lock)));
+			return NULL;
+		}
+		jobno = rs->nextjob++;
+		zassert(pthread_mutex_unlock(&(rs->lock)));
+		if (rs->job(jobno,rs->arg)<0) {
+			zassert(pthread_mutex_lock(&(rs->lock)));
+			rs->status = -1;
+			zassert(pthread_mutex_unlock(&(rs->lock)));
+		}
+	}
+	return NULL;	// unreachable
+}
+
+int metaindex_run(uint32_t threads,uint32_t jobs,int (*job)(uint32_t jobno,void *arg),void *arg) {
+	runstate rs;
+	pthread_t *th;
+	uint32_t i,started;
+
+	if (threads>jobs) {
+		threads = jobs;
+	}
+	zassert(pthread_mutex_init(&(rs.lock),NULL));
+	rs.nextjob = 0;
+	rs.jobs = jobs;
+	rs.status = 0;
+	rs.job = job;
+	rs.arg = arg;
+	started = 0;
+	if (threads>1) {
+		th = malloc(sizeof(pthread_t)*(threads-1));
+		passert(th);
+		for (i=1 ; i<threads ; i++) {
+			if (pthread_create(th+started,NULL,metaindex_worker,&rs)==0) {
+				started++;
+			}
+		}
+		metaindex_worker(&rs);	// current thread is also a worker (if threads couldn't be created then all jobs are done here)
+		for (i=0 ; i<started ; i++) {
+			zassert(pthread_join(th[i],NULL));
+		}
+		free(th);
+	} else {
+		metaindex_worker(&rs);
+	}
+	zassert(pthread_mutex_destroy(&(rs.lock)));
+	return rs.status;
+}
@@ -0,0 +1,70 @@
+/*
+   Copyright 2005-2010 Jakub Kruszona-Zawadzki, Gemius SA.
+
+   This file is part of MooseFS.
+
+   MooseFS is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, version 3.
+
+   MooseFS is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MooseFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _METAINDEX_H_
+#define _METAINDEX_H_
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <sys/types.h>
+
+/* metadata index ("INDX 1.0" section - last section in "MFSM 2.0" files):
+	entries:32 entries * [ name:64 offset:64 length:64 parts:32 parts * [ offset:64 records:32 ] ] indexoffset:64
+   offset - file offset of section data (just after section header)
+   parts - runs of whole records (section end marker is not included) that can be parsed independently
+   indexoffset - file offset of "INDX 1.0" section header (always last 8 bytes before "[MFS EOF MARKER]") */
+
+#define METAINDEX_PART_RECORDS 0x10000
+
+typedef struct _metaindex_part {
+	uint64_t offset;
+	uint32_t records;
+	uint64_t first;	// number of records in all previous parts of this section
+} metaindex_part;
+
+typedef struct _metaindex_section {
+	uint8_t name[8];
+	uint64_t offset;
+	uint64_t length;
+	uint32_t partscnt;
+	uint64_t records;
+	metaindex_part *parts;
+} metaindex_section;
+
+// storing
+void metaindex_store_begin(void);
+void metaindex_section_begin(FILE *fd,const char *name);
+// for sections with own header - marks beginning of the first record
+void metaindex_part_begin(FILE *fd);
+// has to be called after writing records - closes current part when it is big enough
+void metaindex_add(FILE *fd,uint32_t records);
+void metaindex_section_end(FILE *fd);
+// writes whole "INDX 1.0" section (with its header) at current position
+void metaindex_store(FILE *fd);
+
+// loading - returns 0 when index has been found (stream position is undefined afterwards)
+int metaindex_load(FILE *fd);
+const metaindex_section* metaindex_find(const char *name);
+uint32_t metaindex_count(void);
+const metaindex_section* metaindex_get(uint32_t indx);
+void metaindex_free(void);
+
+// runs job(0) ... job(jobs-1) in 'threads' threads - returns -1 when any job failed
+int metaindex_run(uint32_t threads,uint32_t jobs,int (*job)(uint32_t jobno,void *arg),void *arg);
+
+#endif
@@ -0,0 +1,729 @@
+/*
+   Copyright 2005-2010 Jakub Kruszona-Zawadzki, Gemius SA.
+
+   This file is part of MooseFS.
+
+   MooseFS is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, version 3.
+
+   MooseFS is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MooseFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#ifndef HAVE_CLOCK_GETTIME
+#include <sys/time.h>
+#endif
+
+#include "netio.h"
+#include "datapack.h"
+#include "main.h"
+#include "sockets.h"
+#include "slogger.h"
+#include "massert.h"
+
+// backpressure - connection is not read when too much of its data is queued (input packets not processed by main thread yet plus output not written yet), and no connection of thread is read when thread has too much queued data
+#define NETIO_CONN_QUEUE_LIMIT 0x400000
+#define NETIO_THREAD_QUEUE_LIMIT 0x8000000
+
+// netio_conn.mode
+enum {HEADER,DATA};
+// netio_cmd.cmd
+enum {CMD_NEWCONN,CMD_SEND,CMD_CLOSE,CMD_RELEASE};
+
+typedef struct netio_event {
+	struct netio_event *next;
+	netio_conn *conn;
+	uint8_t closed;		// 0 - packet, 1 - connection has been closed (last event of this connection)
+	uint8_t reason;
+	uint32_t type;		// packet type or closing argument
+	uint32_t size;
+	uint8_t *data;		// packet data follows this structure
+} netio_event;
+
+typedef struct netio_cmd {
+	struct netio_cmd *next;
+	uint8_t cmd;
+	netio_conn *conn;
+	packetstruct *head,**tail;
+} netio_cmd;
+
+struct netio_conn {
+	int sock;
+	void *owner;
+	uint32_t thno;
+// protected by thread lock
+	uint32_t inqueued;	// input bytes passed to main thread and not processed yet
+// network thread only
+	uint8_t closed;
+	uint8_t mode;
+	uint32_t inqsnap;	// inqueued copied at the beginning of loop
+	uint32_t inread;	// input bytes read and not passed to main thread yet (including buffer of current packet)
+	uint32_t outbytes;	// output bytes not written yet
+	uint8_t hdrbuff[8];
+	uint8_t *startptr;
+	uint32_t bytesleft;
+	netio_event *inputev;
+	packetstruct *outputhead,**outputtail;
+};
+
+typedef struct netio_thread {
+	pthread_t thid;
+	int wakepipe[2];
+	pthread_mutex_t lock;
+// protected by lock
+	netio_cmd *cmdhead,**cmdtail;
+	netio_event *evhead,**evtail;
+	uint8_t notified;	// main thread has been woken up and hasn't taken events yet
+	uint8_t term;
+	uint32_t outpackets;	// packets passed to this thread and not written yet
+	uint64_t busyusec;
+	uint64_t inqueued;	// sum of inqueued of all connections
+	uint8_t throttled;	// some connections are not read - main thread wakes up network thread after processing packets
+// main thread only
+	netio_cmd *mcmdhead,**mcmdtail;
+	uint32_t mpackets;
+// network thread only
+	netio_conn **conns;
+	uint32_t connscnt,connssize;
+	struct pollfd *pdesc;
+	uint32_t pdescsize;
+	netio_event *tevhead,**tevtail;
+	uint32_t twritten;
+	uint64_t inqsnap,inread,outbytes;
+} netio_thread;
+
+static netio_thread *threads;
+static uint32_t threadscnt;
+static uint32_t nextthread;
+static uint32_t maxpacket;
+static int mainpipe[2];
+static void *mainpipehook;
+static void (*gotpacket_cb)(void *owner,uint32_t type,const uint8_t *data,uint32_t length);
+static void (*closed_cb)(void *owner,uint8_t reason,uint32_t arg);
+
+/* network threads */
+
+static inline int netio_can_read(netio_thread *th,netio_conn *c) {
+	return (c->inqsnap+c->inread+c->outbytes<NETIO_CONN_QUEUE_LIMIT && th->inqsnap+th->inread+th->outbytes<NETIO_THREAD_QUEUE_LIMIT)?1:0;
+}
+
+static void packetstructs_free(netio_thread *th,packetstruct *p) {
+	packetstruct *pn;
+	while (p) {
+		pn = p->next;
+		pktbuf_free(p);
+		th->twritten++;
+		p = pn;
+	}
+}
+
+static void netio_conn_close(netio_thread *th,netio_conn *c,uint8_t reason,uint32_t arg) {
+	netio_event *ev;
+
+	tcpclose(c->sock);
+	if (c->inputev) {
+		c->inread -= c->inputev->size+8;
+		th->inread -= c->inputev->size+8;
+		pktbuf_free(c->inputev);
+		c->inputev = NULL;
+	}
+	packetstructs_free(th,c->outputhead);
+	c->outputhead = NULL;
+	c->outputtail = &(c->outputhead);
+	th->outbytes -= c->outbytes;
+	c->outbytes = 0;
+	c->closed = 1;
+	ev = pktbuf_alloc(sizeof(netio_event));
+	ev->next = NULL;
+	ev->conn = c;
+	ev->closed = 1;
+	ev->reason = reason;
+	ev->type = arg;
+	ev->size = 0;
+	ev->data = NULL;
+	*(th->tevtail) = ev;
+	th->tevtail = &(ev->next);
+}
+
+static void netio_read(netio_thread *th,netio_conn *c) {
+	int32_t i;
+	uint32_t size;
+	const uint8_t *ptr;
+	netio_event *ev;
+
+	for (;;) {
+		i = read(c->sock,c->startptr,c->bytesleft);
+		if (i==0) {
+			netio_conn_close(th,c,NETIO_EOF,0);
+			return;
+		}
+		if (i<0) {
+			if (errno!=EAGAIN) {
+				netio_conn_close(th,c,NETIO_READERR,errno);
+			}
+			return;
+		}
+		c->startptr+=i;
+		c->bytesleft-=i;
+		if (c->bytesleft>0) {
+			return;
+		}
+		if (c->mode==HEADER) {
+			ptr = c->hdrbuff+4;
+			size = get32bit(&ptr);
+			if (size>maxpacket) {
+				netio_conn_close(th,c,NETIO_TOOLONG,size);
+				return;
+			}
+			ev = pktbuf_alloc(sizeof(netio_event)+size);
+			c->inread += size+8;
+			th->inread += size+8;
+			ptr = c->hdrbuff;
+			ev->next = NULL;
+			ev->conn = c;
+			ev->closed = 0;
+			ev->reason = 0;
+			ev->type = get32bit(&ptr);
+			ev->size = size;
+			ev->data = (size>0)?(uint8_t*)(ev+1):NULL;
+			c->inputev = ev;
+			if (size>0) {
+				c->startptr = ev->data;
+				c->bytesleft = size;
+				c->mode = DATA;
+				continue;
+			}
+		}
+		// whole packet - pass it to main thread
+		*(th->tevtail) = c->inputev;
+		th->tevtail = &(c->inputev->next);
+		c->inputev = NULL;
+		c->mode = HEADER;
+		c->startptr = c->hdrbuff;
+		c->bytesleft = 8;
+		if (netio_can_read(th,c)==0) {
+			return;
+		}
+	}
+}
+
+static void netio_write(netio_thread *th,netio_conn *c) {
+	uint32_t bytes,packets;
+	if (pktbuf_write(c->sock,&(c->outputhead),&(c->outputtail),&bytes,&packets)<0) {
+		netio_conn_close(th,c,NETIO_WRITEERR,errno);
+	} else {
+		c->outbytes -= bytes;
+		th->outbytes -= bytes;
+	}
+	th->twritten += packets;
+}
+
+static void netio_commands(netio_thread *th,netio_cmd *cmd) {
+	netio_cmd *cmdn;
+	netio_conn *c;
+	packetstruct *p;
+
+	while (cmd) {
+		cmdn = cmd->next;
+		c = cmd->conn;
+		switch (cmd->cmd) {
+			case CMD_NEWCONN:
+				if (th->connscnt>=th->connssize) {
+					th->connssize = (th->connssize==0)?256:th->connssize*2;
+					th->conns = realloc(th->conns,sizeof(netio_conn*)*th->connssize);
+					passert(th->conns);
+				}
+				th->conns[th->connscnt++] = c;
+				break;
+			case CMD_SEND:
+				if (c->closed) {
+					packetstructs_free(th,cmd->head);
+				} else {
+					for (p=cmd->head ; p ; p=p->next) {
+						c->outbytes += p->bytesleft;
+						th->outbytes += p->bytesleft;
+					}
+					*(c->outputtail) = cmd->head;
+					c->outputtail = cmd->tail;
+					netio_write(th,c);	// try to send immediately - most replies fit into socket buffer
+				}
+				break;
+			case CMD_CLOSE:
+				if (c->closed==0) {
+					netio_conn_close(th,c,NETIO_CLOSED,0);
+				}
+				break;
+			case CMD_RELEASE:
+				free(c);
+				break;
+		}
+		free(cmd);
+		cmd = cmdn;
+	}
+}
+
+// own clock - main_utime() is main thread's cached time and can't be read here
+static inline uint64_t netio_thread_utime(void) {
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ((uint64_t)(ts.tv_sec))*1000000+ts.tv_nsec/1000;
+#else
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return ((uint64_t)(tv.tv_sec))*1000000+tv.tv_usec;
+#endif
+}
+
+static void* netio_thread_main(void *arg) {
+	netio_thread *th = (netio_thread*)arg;
+	netio_cmd *cmd;
+	netio_conn *c;
+	netio_event *ev;
+	uint8_t pipebuff[64];
+	uint32_t i,j,n;
+	uint64_t busystart;
+	uint8_t term,wakemain,throttled;
+
+	term = 0;
+	while (term==0) {
+		n = th->connscnt;
+		if (n+1>th->pdescsize) {
+			th->pdescsize = th->connssize+1;
+			th->pdesc = realloc(th->pdesc,sizeof(struct pollfd)*th->pdescsize);
+			passert(th->pdesc);
+		}
+		th->pdesc[0].fd = th->wakepipe[0];
+		th->pdesc[0].events = POLLIN;
+		th->pdesc[0].revents = 0;
+		zassert(pthread_mutex_lock(&(th->lock)));
+		th->inqsnap = th->inqueued;
+		throttled = 0;
+		for (i=0 ; i<n ; i++) {
+			c = th->conns[i];
+			c->inqsnap = c->inqueued;
+			th->pdesc[i+1].fd = c->sock;
+			th->pdesc[i+1].events = c->outputhead?POLLOUT:0;
+			th->pdesc[i+1].revents = 0;
+			// started packet is always read to the end (its buffer is already allocated)
+			if (c->mode==DATA || netio_can_read(th,c)) {
+				th->pdesc[i+1].events |= POLLIN;
+			} else {
+				throttled = 1;
+			}
+		}
+		th->throttled = throttled;
+		zassert(pthread_mutex_unlock(&(th->lock)));
+		if (poll(th->pdesc,n+1,-1)<0) {
+			if (errno!=EINTR) {
+				mfs_errlog_silent(LOG_WARNING,"network thread: poll error");
+			}
+			continue;
+		}
+		busystart = netio_thread_utime();
+		for (i=0 ; i<n ; i++) {
+			c = th->conns[i];
+			if (c->closed) {
+				continue;
+			}
+			if (th->pdesc[i+1].revents & (POLLERR|POLLHUP)) {
+				netio_conn_close(th,c,NETIO_HUP,0);
+				continue;
+			}
+			if (th->pdesc[i+1].revents & POLLIN) {
+				netio_read(th,c);
+			}
+			if ((th->pdesc[i+1].revents & POLLOUT) && c->closed==0) {
+				netio_write(th,c);
+			}
+		}
+		if (th->pdesc[0].revents & POLLIN) {
+			while (read(th->wakepipe[0],pipebuff,64)>0) {}
+			zassert(pthread_mutex_lock(&(th->lock)));
+			cmd = th->cmdhead;
+			th->cmdhead = NULL;
+			th->cmdtail = &(th->cmdhead);
+			term = th->term;
+			zassert(pthread_mutex_unlock(&(th->lock)));
+			netio_commands(th,cmd);
+		}
+		// closed connections stay allocated until main thread releases them
+		for (i=0,j=0 ; i<th->connscnt ; i++) {
+			if (th->conns[i]->closed==0) {
+				th->conns[j++] = th->conns[i];
+			}
+		}
+		th->connscnt = j;
+
+		ev = th->tevhead;
+		wakemain = 0;
+		zassert(pthread_mutex_lock(&(th->lock)));
+		if (ev) {
+			for ( ; ev ; ev=ev->next) {
+				if (ev->closed==0) {
+					ev->conn->inread -= ev->size+8;
+					ev->conn->inqueued += ev->size+8;
+					th->inread -= ev->size+8;
+					th->inqueued += ev->size+8;
+				}
+			}
+			ev = th->tevhead;
+			*(th->evtail) = ev;
+			th->evtail = th->tevtail;
+			if (th->notified==0) {
+				th->notified = 1;
+				wakemain = 1;
+			}
+		}
+		th->outpackets -= th->twritten;
+		th->busyusec += netio_thread_utime()-busystart;
+		zassert(pthread_mutex_unlock(&(th->lock)));
+		th->tevhead = NULL;
+		th->tevtail = &(th->tevhead);
+		th->twritten = 0;
+		if (wakemain) {
+			if (write(mainpipe[1],"\001",1)!=1) {
+				syslog(LOG_WARNING,"network thread: pipe write error");
+			}
+		}
+	}
+	return NULL;
+}
+
+/* main thread */
+
+static void netio_serve(short revents,void *data) {
+	uint8_t pipebuff[64];
+	netio_event *evhead,*ev,*evn;
+	uint32_t i;
+	uint8_t wake;
+
+	(void)data;
+	if ((revents & POLLIN)==0) {
+		return;
+	}
+	while (read(mainpipe[0],pipebuff,64)>0) {}
+	for (i=0 ; i<threadscnt ; i++) {
+		zassert(pthread_mutex_lock(&(threads[i].lock)));
+		evhead = threads[i].evhead;
+		threads[i].evhead = NULL;
+		threads[i].evtail = &(threads[i].evhead);
+		threads[i].notified = 0;
+		zassert(pthread_mutex_unlock(&(threads[i].lock)));
+		if (evhead==NULL) {
+			continue;
+		}
+		for (ev=evhead ; ev ; ev=ev->next) {
+			if (ev->closed) {
+				closed_cb(ev->conn->owner,ev->reason,ev->type);
+			} else {
+				gotpacket_cb(ev->conn->owner,ev->type,ev->data,ev->size);
+			}
+		}
+		// connections are released only in netio_flush, so they are still valid here
+		zassert(pthread_mutex_lock(&(threads[i].lock)));
+		for (ev=evhead ; ev ; ev=ev->next) {
+			if (ev->closed==0) {
+				ev->conn->inqueued -= ev->size+8;
+				threads[i].inqueued -= ev->size+8;
+			}
+		}
+		wake = threads[i].throttled;
+		threads[i].throttled = 0;
+		zassert(pthread_mutex_unlock(&(threads[i].lock)));
+		for (ev=evhead ; ev ; ev=evn) {
+			evn = ev->next;
+			pktbuf_free(ev);
+		}
+		if (wake) {
+			if (write(threads[i].wakepipe[1],"\001",1)!=1) {
+				syslog(LOG_WARNING,"network threads: pipe write error");
+			}
+		}
+	}
+}
+
+static void netio_addcmd(netio_conn *c,uint8_t cmdtype,packetstruct *head,packetstruct **tail) {
+	netio_thread *th = threads+c->thno;
+	netio_cmd *cmd;
+
+	cmd = malloc(sizeof(netio_cmd));
+	passert(cmd);
+	cmd->next = NULL;
+	cmd->cmd = cmdtype;
+	cmd->conn = c;
+	cmd->head = head;
+	cmd->tail = tail;
+	*(th->mcmdtail) = cmd;
+	th->mcmdtail = &(cmd->next);
+}
+
+netio_conn* netio_conn_new(int sock,void *owner) {
+	netio_conn *c;
+
+	c = malloc(sizeof(netio_conn));
+	passert(c);
+	c->sock = sock;
+	c->owner = owner;
+	c->thno = nextthread;
+	nextthread = (nextthread+1)%threadscnt;
+	c->inqueued = 0;
+	c->closed = 0;
+	c->inqsnap = 0;
+	c->inread = 0;
+	c->outbytes = 0;
+	c->mode = HEADER;
+	c->startptr = c->hdrbuff;
+	c->bytesleft = 8;
+	c->inputev = NULL;
+	c->outputhead = NULL;
+	c->outputtail = &(c->outputhead);
+	netio_addcmd(c,CMD_NEWCONN,NULL,NULL);
+	return c;
+}
+
+void netio_send(netio_conn *c,packetstruct *head) {
+	packetstruct *p;
+	uint32_t cnt;
+
+	if (head==NULL) {
+		return;
+	}
+	cnt = 1;
+	for (p=head ; p->next ; p=p->next) {
+		cnt++;
+	}
+	threads[c->thno].mpackets += cnt;
+	netio_addcmd(c,CMD_SEND,head,&(p->next));
+}
+
+void netio_close(netio_conn *c) {
+	netio_addcmd(c,CMD_CLOSE,NULL,NULL);
+}
+
+void netio_release(netio_conn *c) {
+	netio_addcmd(c,CMD_RELEASE,NULL,NULL);
+}
+
+// one lock and at most one wake up per thread per loop
+void netio_flush(void) {
+	netio_thread *th;
+	uint32_t i;
+	uint8_t wasempty;
+
+	for (i=0 ; i<threadscnt ; i++) {
+		th = threads+i;
+		if (th->mcmdhead==NULL) {
+			continue;
+		}
+		zassert(pthread_mutex_lock(&(th->lock)));
+		wasempty = (th->cmdhead==NULL)?1:0;
+		*(th->cmdtail) = th->mcmdhead;
+		th->cmdtail = th->mcmdtail;
+		th->outpackets += th->mpackets;
+		zassert(pthread_mutex_unlock(&(th->lock)));
+		th->mcmdhead = NULL;
+		th->mcmdtail = &(th->mcmdhead);
+		th->mpackets = 0;
+		if (wasempty) {
+			if (write(th->wakepipe[1],"\001",1)!=1) {
+				syslog(LOG_WARNING,"network threads: pipe write error");
+			}
+		}
+	}
+}
+
+int netio_busy(void) {
+	uint32_t i;
+	int busy;
+
+	busy = 0;
+	for (i=0 ; i<threadscnt && busy==0 ; i++) {
+		if (threads[i].mpackets>0) {
+			busy = 1;
+		}
+		zassert(pthread_mutex_lock(&(threads[i].lock)));
+		if (threads[i].outpackets>0) {
+			busy = 1;
+		}
+		zassert(pthread_mutex_unlock(&(threads[i].lock)));
+	}
+	return busy;
+}
+
+void netio_stats(uint64_t *avgbusy,uint64_t *maxbusy) {
+	uint64_t sum,b;
+	uint32_t i;
+
+	sum = 0;
+	*maxbusy = 0;
+	for (i=0 ; i<threadscnt ; i++) {
+		zassert(pthread_mutex_lock(&(threads[i].lock)));
+		b = threads[i].busyusec;
+		threads[i].busyusec = 0;
+		zassert(pthread_mutex_unlock(&(threads[i].lock)));
+		sum += b;
+		if (b>*maxbusy) {
+			*maxbusy = b;
+		}
+	}
+	*avgbusy = (threadscnt>0)?sum/threadscnt:0;
+}
+
+static void netio_cmds_free(netio_cmd *cmd) {
+	netio_cmd *cmdn;
+	packetstruct *p,*pn;
+
+	while (cmd) {
+		cmdn = cmd->next;
+		if (cmd->cmd==CMD_NEWCONN) {
+			tcpclose(cmd->conn->sock);
+			free(cmd->conn);
+		} else if (cmd->cmd==CMD_RELEASE) {
+			free(cmd->conn);
+		}
+		for (p=cmd->head ; p ; p=pn) {
+			pn = p->next;
+			pktbuf_free(p);
+		}
+		free(cmd);
+		cmd = cmdn;
+	}
+}
+
+void netio_term(void) {
+	netio_thread *th;
+	netio_event *ev,*evn;
+	netio_conn *c;
+	packetstruct *p,*pn;
+	uint32_t i,j;
+
+	for (i=0 ; i<threadscnt ; i++) {
+		th = threads+i;
+		zassert(pthread_mutex_lock(&(th->lock)));
+		th->term = 1;
+		zassert(pthread_mutex_unlock(&(th->lock)));
+		if (write(th->wakepipe[1],"\001",1)!=1) {
+			syslog(LOG_WARNING,"network threads: pipe write error");
+		}
+	}
+	for (i=0 ; i<threadscnt ; i++) {
+		th = threads+i;
+		zassert(pthread_join(th->thid,NULL));
+		netio_cmds_free(th->cmdhead);
+		netio_cmds_free(th->mcmdhead);
+		for (j=0 ; j<th->connscnt ; j++) {
+			c = th->conns[j];
+			tcpclose(c->sock);
+			if (c->inputev) {
+				pktbuf_free(c->inputev);
+			}
+			for (p=c->outputhead ; p ; p=pn) {
+				pn = p->next;
+				pktbuf_free(p);
+			}
+			free(c);
+		}
+		for (ev=th->evhead ; ev ; ev=evn) {
+			evn = ev->next;
+			if (ev->closed) {	// closed connection not passed to main thread - nobody will release it
+				free(ev->conn);
+			}
+			pktbuf_free(ev);
+		}
+		if (th->conns) {
+			free(th->conns);
+		}
+		if (th->pdesc) {
+			free(th->pdesc);
+		}
+		close(th->wakepipe[0]);
+		close(th->wakepipe[1]);
+		zassert(pthread_mutex_destroy(&(th->lock)));
+	}
+	if (mainpipehook) {
+		main_fdunregister(mainpipehook);
+		mainpipehook = NULL;
+	}
+	close(mainpipe[0]);
+	close(mainpipe[1]);
+	free(threads);
+	threads = NULL;
+	threadscnt = 0;
+}
+
+int netio_init(uint32_t thcnt,uint32_t maxpacketsize,void (*gotpacket)(void *owner,uint32_t type,const uint8_t *data,uint32_t length),void (*closed)(void *owner,uint8_t reason,uint32_t arg)) {
+	netio_thread *th;
+	sigset_t newset,oldset;
+	uint32_t i;
+
+	maxpacket = maxpacketsize;
+	gotpacket_cb = gotpacket;
+	closed_cb = closed;
+	nextthread = 0;
+	if (pipe(mainpipe)<0) {
+		mfs_errlog(LOG_ERR,"network threads: can't create pipe");
+		return -1;
+	}
+	tcpnonblock(mainpipe[0]);
+	tcpnonblock(mainpipe[1]);
+	threads = malloc(sizeof(netio_thread)*thcnt);
+	passert(threads);
+	memset(threads,0,sizeof(netio_thread)*thcnt);
+	pktbuf_threads();
+	// signals are handled only by main thread
+	sigfillset(&newset);
+	zassert(pthread_sigmask(SIG_BLOCK,&newset,&oldset));
+	for (i=0 ; i<thcnt ; i++) {
+		th = threads+i;
+		if (pipe(th->wakepipe)<0) {
+			mfs_errlog(LOG_ERR,"network threads: can't create pipe");
+			break;
+		}
+		tcpnonblock(th->wakepipe[0]);
+		tcpnonblock(th->wakepipe[1]);
+		zassert(pthread_mutex_init(&(th->lock),NULL));
+		th->cmdtail = &(th->cmdhead);
+		th->evtail = &(th->evhead);
+		th->mcmdtail = &(th->mcmdhead);
+		th->tevtail = &(th->tevhead);
+		if (pthread_create(&(th->thid),NULL,netio_thread_main,th)!=0) {
+			mfs_errlog(LOG_ERR,"network threads: can't create thread");
+			zassert(pthread_mutex_destroy(&(th->lock)));
+			close(th->wakepipe[0]);
+			close(th->wakepipe[1]);
+			break;
+		}
+	}
+	zassert(pthread_sigmask(SIG_SETMASK,&oldset,NULL));
+	threadscnt = i;
+	if (threadscnt==0) {
+		free(threads);
+		threads = NULL;
+		close(mainpipe[0]);
+		close(mainpipe[1]);
+		return -1;
+	}
+	mainpipehook = main_fdregister(mainpipe[0],POLLIN,netio_serve,NULL);
+	return threadscnt;
+}
@@ -0,0 +1,60 @@
+/*
+   Copyright 2005-2010 Jakub Kruszona-Zawadzki, Gemius SA.
+
+   This file is part of MooseFS.
+
+   MooseFS is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, version 3.
+
+   MooseFS is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MooseFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NETIO_H_
+#define _NETIO_H_
+
+#include <inttypes.h>
+
+#include "pktbuf.h"
+
+/* network threads - socket I/O and packet framing are done outside of main thread.
+   Complete packets are passed to main thread (gotpacket callback) and output packets are passed back
+   to network threads, so everything except reading/writing sockets is still done in main thread only.
+   Connection life cycle: netio_conn_new -> ... -> [netio_close] -> closed callback -> netio_release
+   Connections with too much queued data (unprocessed input and unwritten output) are not read until main thread catches up. */
+
+// reasons passed to closed callback
+#define NETIO_EOF 0		// closed by peer
+#define NETIO_HUP 1		// POLLHUP/POLLERR
+#define NETIO_READERR 2		// arg - errno
+#define NETIO_WRITEERR 3	// arg - errno
+#define NETIO_TOOLONG 4		// arg - packet size
+#define NETIO_CLOSED 5		// closed by netio_close
+
+typedef struct netio_conn netio_conn;
+
+// callbacks are called only from main thread (inside main loop)
+// returns number of started threads (can be less than requested) or -1 on error
+int netio_init(uint32_t threads,uint32_t maxpacketsize,void (*gotpacket)(void *owner,uint32_t type,const uint8_t *data,uint32_t length),void (*closed)(void *owner,uint8_t reason,uint32_t arg));
+// socket has to be in nonblocking mode
+netio_conn* netio_conn_new(int sock,void *owner);
+// takes ownership of whole list
+void netio_send(netio_conn *c,packetstruct *head);
+void netio_close(netio_conn *c);
+// connection can be released only after closed callback
+void netio_release(netio_conn *c);
+// passes commands queued in current loop to network threads
+void netio_flush(void);
+// returns 1 when there are still packets not written to sockets
+int netio_busy(void);
+// busy time (in microseconds) since last call - average per thread and the busiest thread
+void netio_stats(uint64_t *avgbusy,uint64_t *maxbusy);
+void netio_term(void);
+
+#endif
@@ -0,0 +1,240 @@
+/*
+   Copyright 2005-2010 Jakub Kruszona-Zawadzki, Gemius SA.
+
+   This file is part of MooseFS.
+
+   MooseFS is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, version 3.
+
+   MooseFS is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MooseFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "pktbuf.h"
+#include "massert.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define HDRSIZE 16		// keeps data aligned - first byte is size class
+#define MINSHIFT 6
+#define MAXSHIFT 16
+#define CLASSES (MAXSHIFT-MINSHIFT+1)
+#define CLASSBYTES 0x100000U	// max bytes kept in one free list
+#define BIGCLASS 0xFF
+
+typedef struct freebuf {
+	struct freebuf *next;
+} freebuf;
+
+typedef struct sizeclass {
+	pthread_mutex_t lock;
+	freebuf *head;
+	uint32_t cnt;
+	uint64_t allocs,hits;
+} sizeclass;
+
+static sizeclass classes[CLASSES];
+static uint64_t bigallocs;	// protected by lock of the last class
+static uint8_t locking = 0;
+static pthread_mutex_t wrlock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t wrcalls,wrpackets;
+
+static inline void pktbuf_lock(pthread_mutex_t *lock) {
+	if (locking) {
+		zassert(pthread_mutex_lock(lock));
+	}
+}
+
+static inline void pktbuf_unlock(pthread_mutex_t *lock) {
+	if (locking) {
+		zassert(pthread_mutex_unlock(lock));
+	}
+}
+
+void pktbuf_threads(void) {
+	uint32_t c;
+	if (locking==0) {
+		for (c=0 ; c<CLASSES ; c++) {
+			zassert(pthread_mutex_init(&(classes[c].lock),NULL));
+		}
+		locking = 1;
+	}
+}
+
+void* pktbuf_alloc(uint32_t size) {
+	uint8_t *buf;
+	uint32_t c;
+	sizeclass *sc;
+
+	if (size>(1U<<MAXSHIFT)) {
+		buf = malloc(size+HDRSIZE);
+		passert(buf);
+		buf[0] = BIGCLASS;
+		pktbuf_lock(&(classes[CLASSES-1].lock));
+		bigallocs++;
+		pktbuf_unlock(&(classes[CLASSES-1].lock));
+		return buf+HDRSIZE;
+	}
+	for (c=0 ; (1U<<(c+MINSHIFT))<size ; c++) {}
+	sc = classes+c;
+	pktbuf_lock(&(sc->lock));
+	sc->allocs++;
+	if (sc->head) {
+		buf = (uint8_t*)(sc->head);
+		sc->head = sc->head->next;
+		sc->cnt--;
+		sc->hits++;
+	} else {
+		buf = NULL;
+	}
+	pktbuf_unlock(&(sc->lock));
+	if (buf) {
+		return buf;
+	}
+	buf = malloc((1U<<(c+MINSHIFT))+HDRSIZE);
+	passert(buf);
+	buf[0] = c;
+	return buf+HDRSIZE;
+}
+
+void pktbuf_free(void *ptr) {
+	uint8_t *buf = (uint8_t*)ptr-HDRSIZE;
+	freebuf *fb = (freebuf*)ptr;
+	sizeclass *sc;
+
+	if (buf[0]==BIGCLASS) {
+		free(buf);
+		return;
+	}
+	sc = classes+buf[0];
+	pktbuf_lock(&(sc->lock));
+	if (sc->cnt < (CLASSBYTES>>(buf[0]+MINSHIFT))) {
+		fb->next = sc->head;
+		sc->head = fb;
+		sc->cnt++;
+		buf = NULL;
+	}
+	pktbuf_unlock(&(sc->lock));
+	if (buf) {
+		free(buf);
+	}
+}
+
+packetstruct* pktbuf_packet(uint32_t size) {
+	packetstruct *p;
+
+	p = pktbuf_alloc(sizeof(packetstruct)+size);
+	p->next = NULL;
+	p->packet = (uint8_t*)(p+1);
+	p->startptr = p->packet;
+	p->bytesleft = size;
+	return p;
+}
+
+int pktbuf_write(int sock,packetstruct **head,packetstruct ***tail,uint32_t *bytes,uint32_t *packets) {
+	struct iovec iov[IOV_MAX];
+	packetstruct *p;
+	uint32_t n,calls;
+	ssize_t i;
+	size_t total,written;
+	int status,err;
+
+	*bytes = 0;
+	*packets = 0;
+	calls = 0;
+	status = 0;
+	err = 0;
+	for (;;) {
+		n = 0;
+		total = 0;
+		for (p=*head ; p && n<IOV_MAX ; p=p->next) {
+			iov[n].iov_base = p->startptr;
+			iov[n].iov_len = p->bytesleft;
+			total += p->bytesleft;
+			n++;
+		}
+		if (n==0) {
+			break;
+		}
+		i = writev(sock,iov,n);
+		calls++;
+		if (i<0) {
+			if (errno!=EAGAIN) {
+				err = errno;
+				status = -1;
+			}
+			break;
+		}
+		*bytes += i;
+		written = i;
+		while (i>0) {
+			p = *head;
+			if ((size_t)i>=p->bytesleft) {
+				i -= p->bytesleft;
+				*head = p->next;
+				pktbuf_free(p);
+				(*packets)++;
+			} else {
+				p->startptr += i;
+				p->bytesleft -= i;
+				i = 0;
+			}
+		}
+		if (*head==NULL) {
+			*tail = head;
+		}
+		if (written<total) {	// socket is full
+			break;
+		}
+	}
+	pktbuf_lock(&wrlock);
+	wrcalls += calls;
+	wrpackets += *packets;
+	pktbuf_unlock(&wrlock);
+	errno = err;
+	return status;
+}
+
+void pktbuf_stats(uint64_t *allocs,uint64_t *hits,uint64_t *wcalls,uint64_t *wpackets) {
+	uint32_t c;
+
+	*allocs = 0;
+	*hits = 0;
+	for (c=0 ; c<CLASSES ; c++) {
+		pktbuf_lock(&(classes[c].lock));
+		*allocs += classes[c].allocs;
+		*hits += classes[c].hits;
+		classes[c].allocs = 0;
+		classes[c].hits = 0;
+		if (c==CLASSES-1) {
+			*allocs += bigallocs;
+			bigallocs = 0;
+		}
+		pktbuf_unlock(&(classes[c].lock));
+	}
+	pktbuf_lock(&wrlock);
+	*wcalls = wrcalls;
+	*wpackets = wrpackets;
+	wrcalls = 0;
+	wrpackets = 0;
+	pktbuf_unlock(&wrlock);
+}
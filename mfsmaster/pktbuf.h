@@ -0,0 +1,45 @@
+/*
+   Copyright 2005-2010 Jakub Kruszona-Zawadzki, Gemius SA.
+
+   This file is part of MooseFS.
+
+   MooseFS is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, version 3.
+
+   MooseFS is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MooseFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PKTBUF_H_
+#define _PKTBUF_H_
+
+#include <inttypes.h>
+
+/* packet buffers shared by master network modules - buffers up to 64kB are kept in size-classed free lists */
+
+typedef struct packetstruct {
+	struct packetstruct *next;
+	uint8_t *startptr;
+	uint32_t bytesleft;
+	uint8_t *packet;
+} packetstruct;
+
+void* pktbuf_alloc(uint32_t size);
+void pktbuf_free(void *ptr);
+// output packet and its data in one buffer (freed by pktbuf_free) - packet points just after the structure
+packetstruct* pktbuf_packet(uint32_t size);
+// writes queued packets (up to IOV_MAX packets per writev), frees written ones and updates tail when queue becomes empty
+// returns 0 when all was written or socket is full, -1 on error (errno is set)
+int pktbuf_write(int sock,packetstruct **head,packetstruct ***tail,uint32_t *bytes,uint32_t *packets);
+// has to be called before any other thread uses buffers
+void pktbuf_threads(void);
+// counters since last call
+void pktbuf_stats(uint64_t *allocs,uint64_t *hits,uint64_t *wrcalls,uint64_t *wrpackets);
+
+#endif
@@ -316,6 +316,69 @@ int fs_loadfree(FILE *fd) {
 	return 0;
 }
 
+int fs_loadlazy(FILE *fd) {
+	uint8_t rbuff[12];
+	const uint8_t *ptr;
+	uint32_t t,dstid,srcid,ts;
+	if (fread(rbuff,1,4,fd)!=4) {
+		return -1;
+	}
+	ptr=rbuff;
+	t = get32bit(&ptr);
+	printf("# lazy snapshots: %"PRIu32"\n",t);
+	while (t>0) {
+		if (fread(rbuff,1,12,fd)!=12) {
+			return -1;
+		}
+		ptr = rbuff;
+		dstid = get32bit(&ptr);
+		srcid = get32bit(&ptr);
+		ts = get32bit(&ptr);
+		printf("L|d:%10"PRIu32"|s:%10"PRIu32"|t:%10"PRIu32"\n",dstid,srcid,ts);
+		t--;
+	}
+	return 0;
+}
+
+int fs_loadindex(FILE *fd) {
+	uint8_t rbuff[8+8+8+4];
+	const uint8_t *ptr;
+	uint32_t t,p;
+	uint64_t offset,length;
+	if (fread(rbuff,1,4,fd)!=4) {
+		return -1;
+	}
+	ptr=rbuff;
+	t = get32bit(&ptr);
+	printf("# indexed sections: %"PRIu32"\n",t);
+	while (t>0) {
+		if (fread(rbuff,1,8+8+8+4,fd)!=8+8+8+4) {
+			return -1;
+		}
+		ptr = rbuff+8;
+		offset = get64bit(&ptr);
+		length = get64bit(&ptr);
+		p = get32bit(&ptr);
+		printf("X|s:%c%c%c%c%c%c%c%c|o:%20"PRIu64"|l:%20"PRIu64"|p:%10"PRIu32"\n",dispchar(rbuff[0]),dispchar(rbuff[1]),dispchar(rbuff[2]),dispchar(rbuff[3]),dispchar(rbuff[4]),dispchar(rbuff[5]),dispchar(rbuff[6]),dispchar(rbuff[7]),offset,length,p);
+		while (p>0) {
+			if (fread(rbuff,1,8+4,fd)!=8+4) {
+				return -1;
+			}
+			ptr = rbuff;
+			offset = get64bit(&ptr);
+			printf("P|o:%20"PRIu64"|r:%10"PRIu32"\n",offset,get32bit(&ptr));
+			p--;
+		}
+		t--;
+	}
+	if (fread(rbuff,1,8,fd)!=8) {
+		return -1;
+	}
+	ptr = rbuff;
+	printf("# index offset: %"PRIu64"\n",get64bit(&ptr));
+	return 0;
+}
+
 int fs_loadquota(FILE *fd) {
 	uint8_t rbuff[66];
 	const uint8_t *ptr;
@@ -520,11 +583,21 @@ int fs_load_17(FILE *fd) {
 				printf("error reading metadata (QUOT 1.0)\n");
 				return -1;
 			}
+		} else if (memcmp(hdr,"LAZY 1.0",8)==0) {
+			if (fs_loadlazy(fd)<0) {
+				printf("error reading metadata (LAZY 1.0)\n");
+				return -1;
+			}
 		} else if (memcmp(hdr,"CHNK 1.0",8)==0) {
 			if (chunk_load(fd)<0) {
 				printf("error reading metadata (CHNK 1.0)\n");
 				return -1;
 			}
+		} else if (memcmp(hdr,"INDX 1.0",8)==0) {
+			if (fs_loadindex(fd)<0) {
+				printf("error reading metadata (INDX 1.0)\n");
+				return -1;
+			}
 		} else {
 			printf("unknown file part\n");
 			if (hexdump(fd,sleng)<0) {
@@ -566,7 +639,7 @@ int fs_loadall(const char *fname) {
 			fclose(fd);
 			return -1;
 		}
-	} else if (memcmp(hdr,MFSSIGNATURE "M 1.7",8)==0) {
+	} else if (memcmp(hdr,MFSSIGNATURE "M 1.7",8)==0 || memcmp(hdr,MFSSIGNATURE "M 2.0",8)==0) {
 		if (fs_load_17(fd)<0) {
 			fclose(fd);
 			return -1;
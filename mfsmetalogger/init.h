@@ -21,6 +21,7 @@
 #include <stdio.h>
 
 #include "masterconn.h"
+#include "metacompact.h"
 
 #define STR_AUX(x) #x
 #define STR(x) STR_AUX(x)
@@ -33,6 +34,7 @@ struct {
 	char *name;
 } RunTab[]={
 	{masterconn_init,"connection with master"},
+	{metacompact_init,"metadata compaction"},
 	{(runfn)0,"****"}
 },LateRunTab[]={
 	{(runfn)0,"****"}
@@ -31,11 +31,15 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <netinet/in.h>
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
 
 #include "MFSCommunication.h"
 #include "datapack.h"
 #include "masterconn.h"
 #include "crc.h"
+#include "changelogbin.h"
 #include "cfg.h"
 #include "main.h"
 #include "slogger.h"
@@ -72,7 +76,10 @@ typedef struct masterconn {
 	uint8_t downloadretrycnt;
 	uint8_t downloading;
 	uint8_t oldmode;
-	FILE *logfd;	// using stdio because this is text file
+	uint8_t oldregister;	// master rejected newer registration: 1 - use version 3 (no batching), 2 - use versions 1/2 (text change logs)
+	uint8_t registering;	// registration version 5 or 3 sent and nothing received from master yet
+	FILE *logfd;	// using stdio because this is (mostly) text file
+	uint8_t logformat;
 	int metafd;	// using standard unix I/O because this is binary file
 	uint64_t filesize;
 	uint64_t dloffset;
@@ -88,6 +95,7 @@ static char *MasterHost;
 static char *MasterPort;
 static char *BindHost;
 static uint32_t Timeout;
+static uint32_t LogBatch;
 static void* reconnect_hook;
 static void* download_hook;
 static uint64_t lastlogversion=0;
@@ -102,6 +110,26 @@ void masterconn_stats(uint32_t *bin,uint32_t *bout) {
 	stats_bytesout = 0;
 }
 
+uint64_t masterconn_lastlogversion(void) {
+	return lastlogversion;
+}
+
+void masterconn_findlastlogversion_bin(void) {
+	FILE *fd;
+	uint64_t firstversion,validsize;
+
+	fd = fopen("changelog_ml.0.back","r+");
+	if (fd==NULL) {
+		return;
+	}
+	if (changelogbin_fileformat(fd)==CHLOGFMT_BINARY && changelogbin_scan(fd,&firstversion,&lastlogversion,&validsize)<0) {
+		if (ftruncate(fileno(fd),validsize)<0) {	// garbage at the end of file - truncate
+			lastlogversion = 0;
+		}
+	}
+	fclose(fd);
+}
+
 void masterconn_findlastlogversion(void) {
 	struct stat st;
 	uint8_t buff[32800];	// 32800 = 32768 + 32
@@ -120,6 +148,11 @@ void masterconn_findlastlogversion(void) {
 	if (fd<0) {
 		return;
 	}
+	if (read(fd,buff,CHLOGBIN_SIGNATURE_SIZE)==CHLOGBIN_SIGNATURE_SIZE && memcmp(buff,CHLOGBIN_SIGNATURE,CHLOGBIN_SIGNATURE_SIZE)==0) {
+		close(fd);
+		masterconn_findlastlogversion_bin();
+		return;
+	}
 	fstat(fd,&st);
 	size = st.st_size;
 	memset(buff,0,32);
@@ -208,7 +241,30 @@ void masterconn_sendregister(masterconn *eptr) {
 	eptr->metafd=-1;
 	eptr->logfd=NULL;
 
-	if (lastlogversion>0) {
+	if (LogBatch && eptr->oldregister==0) {
+		buff = masterconn_createpacket(eptr,MLTOMA_REGISTER,1+4+2+8+1);
+		put8bit(&buff,5);
+		put16bit(&buff,VERSMAJ);
+		put8bit(&buff,VERSMID);
+		put8bit(&buff,VERSMIN);
+		put16bit(&buff,Timeout);
+		put64bit(&buff,lastlogversion);
+#ifdef HAVE_ZLIB_H
+		put8bit(&buff,MLFLAG_BATCH|MLFLAG_ZLIB);
+#else
+		put8bit(&buff,MLFLAG_BATCH);
+#endif
+		eptr->registering=1;
+	} else if (LogBatch && eptr->oldregister==1) {	// masters with binary change logs but without batching
+		buff = masterconn_createpacket(eptr,MLTOMA_REGISTER,1+4+2+8);
+		put8bit(&buff,3);
+		put16bit(&buff,VERSMAJ);
+		put8bit(&buff,VERSMID);
+		put8bit(&buff,VERSMIN);
+		put16bit(&buff,Timeout);
+		put64bit(&buff,lastlogversion);
+		eptr->registering=1;
+	} else if (lastlogversion>0) {	// understood by all masters
 		buff = masterconn_createpacket(eptr,MLTOMA_REGISTER,1+4+2+8);
 		put8bit(&buff,2);
 		put16bit(&buff,VERSMAJ);
@@ -226,44 +282,56 @@ void masterconn_sendregister(masterconn *eptr) {
 	}
 }
 
-void masterconn_metachanges_log(masterconn *eptr,const uint8_t *data,uint32_t length) {
+void masterconn_logrotate(masterconn *eptr) {
 	char logname1[100],logname2[100];
 	uint32_t i;
-	uint64_t version;
-	if (length==1 && data[0]==0x55) {
-		if (eptr->logfd!=NULL) {
-			fclose(eptr->logfd);
-			eptr->logfd=NULL;
-		}
-		if (BackLogsNumber>0) {
-			for (i=BackLogsNumber ; i>0 ; i--) {
-				snprintf(logname1,100,"changelog_ml.%"PRIu32".mfs",i);
-				snprintf(logname2,100,"changelog_ml.%"PRIu32".mfs",i-1);
-				rename(logname2,logname1);
-			}
-		} else {
-			unlink("changelog_ml.0.mfs");
-		}
-		return;
+	if (eptr->logfd!=NULL) {
+		fclose(eptr->logfd);
+		eptr->logfd=NULL;
 	}
-	if (length<10) {
-		syslog(LOG_NOTICE,"MATOML_METACHANGES_LOG - wrong size (%"PRIu32"/9+data)",length);
-		eptr->mode = KILL;
-		return;
+	if (BackLogsNumber>0) {
+		for (i=BackLogsNumber ; i>0 ; i--) {
+			snprintf(logname1,100,"changelog_ml.%"PRIu32".mfs",i);
+			snprintf(logname2,100,"changelog_ml.%"PRIu32".mfs",i-1);
+			rename(logname2,logname1);
+		}
+	} else {
+		unlink("changelog_ml.0.mfs");
 	}
-	if (data[0]!=0xFF) {
-		syslog(LOG_NOTICE,"MATOML_METACHANGES_LOG - wrong packet");
-		eptr->mode = KILL;
-		return;
+}
+
+// changelog file can't mix formats - when master changes format in the middle of the file then start a new one
+void masterconn_logopen(masterconn *eptr,uint8_t format) {
+	FILE *fd;
+	if (eptr->logfd!=NULL && eptr->logformat!=format) {
+		masterconn_logrotate(eptr);
 	}
-	if (data[length-1]!='\0') {
-		syslog(LOG_NOTICE,"MATOML_METACHANGES_LOG - invalid string");
-		eptr->mode = KILL;
-		return;
+	if (eptr->logfd==NULL) {
+		eptr->logformat = CHLOGFMT_NONE;
+		fd = fopen("changelog_ml.0.mfs","r");
+		if (fd) {
+			eptr->logformat = changelogbin_fileformat(fd);
+			fclose(fd);
+		}
+		if (eptr->logformat!=CHLOGFMT_NONE && eptr->logformat!=format) {
+			masterconn_logrotate(eptr);
+			eptr->logformat = CHLOGFMT_NONE;
+		}
+		eptr->logfd = fopen("changelog_ml.0.mfs","a");
+		if (eptr->logfd && eptr->logformat==CHLOGFMT_NONE && format==CHLOGFMT_BINARY) {
+			if (fwrite(CHLOGBIN_SIGNATURE,1,CHLOGBIN_SIGNATURE_SIZE,eptr->logfd)!=CHLOGBIN_SIGNATURE_SIZE) {
+				fclose(eptr->logfd);
+				eptr->logfd = NULL;
+			}
+		}
+		eptr->logformat = format;
 	}
+}
 
-	data++;
-	version = get64bit(&data);
+// returns -1 when connection has to be closed
+int masterconn_metachanges_store(masterconn *eptr,uint64_t version,uint8_t format,const uint8_t *data,uint32_t length) {
+	char logname1[100];
+	uint32_t i;
 
 	if (lastlogversion>0 && version!=lastlogversion+1) {
 		syslog(LOG_WARNING, "some changes lost: [%"PRIu64"-%"PRIu64"], download metadata again",lastlogversion,version-1);
@@ -276,20 +344,140 @@ void masterconn_metachanges_log(masterconn *eptr,const uint8_t *data,uint32_t le
 			unlink(logname1);
 		}
 		lastlogversion = 0;
-		eptr->mode = KILL;
-		return;
+		return -1;
 	}
 
-	if (eptr->logfd==NULL) {
-		eptr->logfd = fopen("changelog_ml.0.mfs","a");
-	}
+	masterconn_logopen(eptr,format);
 
 	if (eptr->logfd) {
-		fprintf(eptr->logfd,"%"PRIu64": %s\n",version,data);
+		if (format==CHLOGFMT_BINARY) {
+			if (fwrite(data,1,length,eptr->logfd)!=length) {
+				syslog(LOG_NOTICE,"lost MFS change %"PRIu64,version);
+			}
+		} else {
+			fprintf(eptr->logfd,"%"PRIu64": %s\n",version,data);
+		}
 		lastlogversion = version;
+	} else if (format==CHLOGFMT_BINARY) {
+		syslog(LOG_NOTICE,"lost MFS change %"PRIu64,version);
 	} else {
 		syslog(LOG_NOTICE,"lost MFS change %"PRIu64": %s",version,data);
 	}
+	return 0;
+}
+
+// LOG_BATCH - records are checked one by one exactly as single LOG_RECORD packets
+void masterconn_metachanges_batch(masterconn *eptr,const uint8_t *data,uint32_t length) {
+	static uint8_t *rawbuff = NULL;
+	static uint32_t rawbuffsize = 0;
+	uint32_t records,rawsize,recsize;
+	uint8_t compressed;
+	const uint8_t *rptr,*sptr;
+#ifdef HAVE_ZLIB_H
+	uLongf dsize;
+#endif
+
+	records = get32bit(&data);
+	rawsize = get32bit(&data);
+	compressed = get8bit(&data);
+	length -= 9;
+	if (compressed) {
+#ifdef HAVE_ZLIB_H
+		if (rawsize>rawbuffsize) {
+			if (rawbuff) {
+				free(rawbuff);
+			}
+			rawbuffsize = rawsize;
+			rawbuff = malloc(rawbuffsize);
+			passert(rawbuff);
+		}
+		dsize = rawsize;
+		if (uncompress(rawbuff,&dsize,data,length)!=Z_OK || dsize!=rawsize) {
+			syslog(LOG_NOTICE,"MATOML_METACHANGES_LOG - can't decompress batch");
+			eptr->mode = KILL;
+			return;
+		}
+		rptr = rawbuff;
+#else
+		syslog(LOG_NOTICE,"MATOML_METACHANGES_LOG - got compressed batch, but zlib is not available");
+		eptr->mode = KILL;
+		return;
+#endif
+	} else {
+		if (length!=rawsize) {
+			syslog(LOG_NOTICE,"MATOML_METACHANGES_LOG - wrong batch size (%"PRIu32"/%"PRIu32")",length,rawsize);
+			eptr->mode = KILL;
+			return;
+		}
+		rptr = data;
+	}
+	while (records>0) {
+		if (rawsize<4) {
+			syslog(LOG_NOTICE,"MATOML_METACHANGES_LOG - truncated batch");
+			eptr->mode = KILL;
+			return;
+		}
+		sptr = rptr;
+		recsize = get32bit(&sptr);
+		if (recsize>rawsize || changelogbin_check(rptr,recsize)<0) {
+			syslog(LOG_NOTICE,"MATOML_METACHANGES_LOG - damaged record");
+			eptr->mode = KILL;
+			return;
+		}
+		if (masterconn_metachanges_store(eptr,changelogbin_version(rptr),CHLOGFMT_BINARY,rptr,recsize)<0) {
+			eptr->mode = KILL;
+			return;
+		}
+		rptr += recsize;
+		rawsize -= recsize;
+		records--;
+	}
+}
+
+void masterconn_metachanges_log(masterconn *eptr,const uint8_t *data,uint32_t length) {
+	uint64_t version;
+	uint8_t format;
+	if (length==1 && data[0]==0x55) {
+		masterconn_logrotate(eptr);
+		return;
+	}
+	if (length<10) {
+		syslog(LOG_NOTICE,"MATOML_METACHANGES_LOG - wrong size (%"PRIu32"/9+data)",length);
+		eptr->mode = KILL;
+		return;
+	}
+	if (data[0]==0xFD) {
+		masterconn_metachanges_batch(eptr,data+1,length-1);
+		return;
+	}
+	if (data[0]==0xFE) {
+		if (changelogbin_check(data+1,length-1)<0) {
+			syslog(LOG_NOTICE,"MATOML_METACHANGES_LOG - damaged record");
+			eptr->mode = KILL;
+			return;
+		}
+		data++;
+		length--;
+		version = changelogbin_version(data);
+		format = CHLOGFMT_BINARY;
+	} else if (data[0]==0xFF) {
+		if (data[length-1]!='\0') {
+			syslog(LOG_NOTICE,"MATOML_METACHANGES_LOG - invalid string");
+			eptr->mode = KILL;
+			return;
+		}
+		data++;
+		version = get64bit(&data);
+		format = CHLOGFMT_TEXT;
+	} else {
+		syslog(LOG_NOTICE,"MATOML_METACHANGES_LOG - wrong packet");
+		eptr->mode = KILL;
+		return;
+	}
+
+	if (masterconn_metachanges_store(eptr,version,format,data,length)<0) {
+		eptr->mode = KILL;
+	}
 }
 
 void masterconn_metachanges_flush(void) {
@@ -352,7 +540,7 @@ int masterconn_metadata_check(char *name) {
 	}
 	if (memcmp(chkbuff,MFSSIGNATURE "M 1.5",8)==0) {
 		memset(eofmark,0,16);
-	} else if (memcmp(chkbuff,MFSSIGNATURE "M 1.7",8)==0) {
+	} else if (memcmp(chkbuff,MFSSIGNATURE "M 1.7",8)==0 || memcmp(chkbuff,MFSSIGNATURE "M 2.0",8)==0) {
 		memcpy(eofmark,"[MFS EOF MARKER]",16);
 	} else {
 		syslog(LOG_WARNING,"bad metadata file format");
@@ -549,6 +737,15 @@ void masterconn_beforeclose(masterconn *eptr) {
 		syslog(LOG_WARNING,"old master detected - please upgrade your master server and then restart metalogger");
 		eptr->oldmode=1;
 	}
+	if (eptr->registering) {	// older masters kill connection after unknown registration version
+		if (eptr->oldregister==0) {
+			syslog(LOG_WARNING,"master closed connection right after registration - probably old master, switching to registration without batched change logs");
+		} else {
+			syslog(LOG_WARNING,"master closed connection right after registration - probably old master, switching to old registration (text change logs)");
+		}
+		eptr->oldregister++;
+		eptr->registering=0;
+	}
 	if (eptr->metafd>=0) {
 		close(eptr->metafd);
 		eptr->metafd=-1;
@@ -563,6 +760,7 @@ void masterconn_beforeclose(masterconn *eptr) {
 }
 
 void masterconn_gotpacket(masterconn *eptr,uint32_t type,const uint8_t *data,uint32_t length) {
+	eptr->registering=0;
 	switch (type) {
 		case ANTOAN_NOP:
 			break;
@@ -904,8 +1102,11 @@ void masterconn_reload(void) {
 	if (eptr->mode!=FREE) {
 		eptr->mode = KILL;
 	}
+	eptr->registering = 0;
+	eptr->oldregister = 0;	// master could have been upgraded
 
 	Timeout = cfg_getuint32("MASTER_TIMEOUT",60);
+	LogBatch = cfg_getuint32("MASTER_LOG_BATCH",1);
 	BackLogsNumber = cfg_getuint32("BACK_LOGS",50);
 	BackMetaCopies = cfg_getuint32("BACK_META_KEEP_PREVIOUS",3);
 
@@ -945,6 +1146,7 @@ int masterconn_init(void) {
 	MasterPort = cfg_getstr("MASTER_PORT","9419");
 	BindHost = cfg_getstr("BIND_HOST","*");
 	Timeout = cfg_getuint32("MASTER_TIMEOUT",60);
+	LogBatch = cfg_getuint32("MASTER_LOG_BATCH",1);
 	BackLogsNumber = cfg_getuint32("BACK_LOGS",50);
 	BackMetaCopies = cfg_getuint32("BACK_META_KEEP_PREVIOUS",3);
 	MetaDLFreq = cfg_getuint32("META_DOWNLOAD_FREQ",24);
@@ -973,6 +1175,8 @@ int masterconn_init(void) {
 	eptr->logfd = NULL;
 	eptr->metafd = -1;
 	eptr->oldmode = 0;
+	eptr->oldregister = 0;
+	eptr->registering = 0;
 
 	masterconn_findlastlogversion();
 	if (masterconn_initconnect(eptr)<0) {
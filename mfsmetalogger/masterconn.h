@@ -24,6 +24,7 @@
 
 //void masterconn_stats(uint32_t *bin,uint32_t *bout);
 //void masterconn_replicate_status(uint64_t chunkid,uint32_t version,uint8_t status);
+uint64_t masterconn_lastlogversion(void);
 int masterconn_init(void);
 
 #endif
@@ -0,0 +1,307 @@
+/*
+   Copyright 2005-2010 Jakub Kruszona-Zawadzki, Gemius SA.
+
+   This file is part of MooseFS.
+
+   MooseFS is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, version 3.
+
+   MooseFS is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MooseFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <inttypes.h>
+
+#include "MFSCommunication.h"
+#include "datapack.h"
+#include "metacompact.h"
+#include "masterconn.h"
+#include "cfg.h"
+#include "main.h"
+#include "slogger.h"
+#include "massert.h"
+
+/* metadata compaction:
+   received change logs are replayed (by mfsmetarestore) on last metadata image and the result becomes new
+   metadata_ml.mfs.back, so mfsmetarestore -a never has to apply more than one compaction period of changes.
+   Only rotated logs are used - changelog_ml.0.mfs is still being written. */
+
+static uint32_t CompactFreq;
+static uint64_t CompactChanges;
+static char *MetaRestorePath;
+
+static pid_t compact_pid;
+static int compact_fd = -1;
+static void *compact_hook;
+static uint8_t compact_stored;
+static uint64_t compact_startversion;
+static uint32_t compact_starttime;
+static uint32_t lastcompacttime;
+static time_t lastrotatetime;
+static char compact_line[256];
+static char compact_lastmsg[256];
+static uint32_t compact_linepos;
+
+// returns version stored in metadata file header (0 on error)
+static uint64_t metacompact_getfileversion(const char *fname) {
+	uint8_t hdr[20];
+	const uint8_t *ptr;
+	FILE *fd;
+	fd = fopen(fname,"r");
+	if (fd==NULL) {
+		return 0;
+	}
+	if (fread(hdr,1,20,fd)!=20 || memcmp(hdr,MFSSIGNATURE "M ",5)!=0) {
+		fclose(fd);
+		return 0;
+	}
+	fclose(fd);
+	ptr = hdr+12;
+	return get64bit(&ptr);
+}
+
+static void metacompact_line(void) {
+	if (strcmp(compact_line,"progress: stored")==0) {
+		compact_stored = 1;
+	} else if (compact_line[0] && strncmp(compact_line,"progress: ",10)!=0) {
+		memcpy(compact_lastmsg,compact_line,compact_linepos+1);
+	}
+}
+
+static void metacompact_end(void) {
+	uint64_t newversion,curversion;
+	char metaname1[100],metaname2[100];
+	uint32_t i,copies;
+
+	main_fdunregister(compact_hook);
+	close(compact_fd);
+	compact_fd = -1;
+	compact_hook = NULL;
+	newversion = metacompact_getfileversion("metadata_ml.mfs.tmp");
+	curversion = metacompact_getfileversion("metadata_ml.mfs.back");
+	if (compact_stored==0 || newversion==0) {
+		syslog(LOG_WARNING,"metadata compaction failed (%s)",compact_lastmsg[0]?compact_lastmsg:"no message");
+		unlink("metadata_ml.mfs.tmp");
+		return;
+	}
+	if (newversion<=curversion) {	// nothing new or metadata has been downloaded in the meantime
+		unlink("metadata_ml.mfs.tmp");
+		return;
+	}
+	copies = cfg_getuint32("BACK_META_KEEP_PREVIOUS",3);
+	if (copies>99) {
+		copies = 99;
+	}
+	if (copies>0) {
+		for (i=copies-1 ; i>0 ; i--) {
+			snprintf(metaname1,100,"metadata_ml.mfs.back.%"PRIu32,i+1);
+			snprintf(metaname2,100,"metadata_ml.mfs.back.%"PRIu32,i);
+			rename(metaname2,metaname1);
+		}
+		rename("metadata_ml.mfs.back","metadata_ml.mfs.back.1");
+	}
+	if (rename("metadata_ml.mfs.tmp","metadata_ml.mfs.back")<0) {
+		mfs_errlog(LOG_WARNING,"can't rename compacted metadata");
+		return;
+	}
+	syslog(LOG_NOTICE,"metadata compacted (version: %"PRIu64" -> %"PRIu64", %"PRIu64" changes) in %"PRIu32" seconds",compact_startversion,newversion,newversion-compact_startversion,main_time()-compact_starttime);
+}
+
+static void metacompact_serve(short revents,void *data) {
+	char buff[4096];
+	ssize_t i,r;
+	(void)data;
+	(void)revents;
+	for (;;) {
+		r = read(compact_fd,buff,4096);
+		if (r<0 && (errno==EAGAIN || errno==EINTR)) {
+			return;
+		}
+		if (r<=0) {	// child has finished (or pipe error)
+			metacompact_end();
+			return;
+		}
+		for (i=0 ; i<r ; i++) {
+			if (buff[i]=='\n') {
+				compact_line[compact_linepos]='\0';
+				metacompact_line();
+				compact_linepos = 0;
+			} else if (compact_linepos+1<sizeof(compact_line)) {
+				compact_line[compact_linepos++] = buff[i];
+			}
+		}
+	}
+}
+
+static int metacompact_start(void) {
+	struct stat sb;
+	struct rlimit rls;
+	char **argv;
+	char fname[100];
+	uint32_t files,i,j;
+	int pfd[2],fd,maxfd;
+	pid_t pid;
+
+	compact_startversion = metacompact_getfileversion("metadata_ml.mfs.back");
+	if (compact_startversion==0) {
+		return -1;
+	}
+	for (files=0 ; files<10000 ; files++) {
+		snprintf(fname,100,"changelog_ml.%"PRIu32".mfs",files+1);
+		if (stat(fname,&sb)<0) {
+			break;
+		}
+	}
+	if (files==0) {
+		return -1;
+	}
+	unlink("metadata_ml.mfs.tmp");
+	argv = malloc(sizeof(char*)*(files+10));
+	passert(argv);
+	argv[0] = MetaRestorePath;
+	argv[1] = "-p";
+	argv[2] = "-m";
+	argv[3] = "metadata_ml.mfs.back";
+	argv[4] = "-o";
+	argv[5] = "metadata_ml.mfs.tmp";
+	j = 6;
+	for (i=0 ; i<2 ; i++) {
+		snprintf(fname,100,"changelog_ml_back.%"PRIu32".mfs",i);
+		if (stat(fname,&sb)==0) {
+			argv[j] = strdup(fname);
+			passert(argv[j]);
+			j++;
+		}
+	}
+	for (i=0 ; i<files ; i++) {
+		snprintf(fname,100,"changelog_ml.%"PRIu32".mfs",i+1);
+		argv[j] = strdup(fname);
+		passert(argv[j]);
+		j++;
+	}
+	argv[j] = NULL;
+	if (getrlimit(RLIMIT_NOFILE,&rls)<0 || rls.rlim_cur==RLIM_INFINITY || rls.rlim_cur>1048576) {
+		maxfd = 1048576;
+	} else {
+		maxfd = rls.rlim_cur;
+	}
+	if (pipe(pfd)<0) {
+		pid = -1;
+	} else {
+		pid = vfork();
+		if (pid==0) {
+			dup2(pfd[1],1);
+			dup2(pfd[1],2);
+			for (fd=3 ; fd<maxfd ; fd++) {
+				close(fd);
+			}
+			execv(argv[0],argv);
+			_exit(1);
+		}
+		close(pfd[1]);
+		if (pid<0) {
+			close(pfd[0]);
+		}
+	}
+	for (i=6 ; i<j ; i++) {
+		free(argv[i]);
+	}
+	free(argv);
+	if (pid<0) {
+		mfs_errlog(LOG_WARNING,"can't start metadata compaction");
+		return -1;
+	}
+	fcntl(pfd[0],F_SETFL,fcntl(pfd[0],F_GETFL)|O_NONBLOCK);
+	compact_pid = pid;
+	compact_fd = pfd[0];
+	compact_hook = main_fdregister(compact_fd,POLLIN,metacompact_serve,NULL);
+	compact_stored = 0;
+	compact_starttime = main_time();
+	compact_linepos = 0;
+	compact_lastmsg[0] = '\0';
+	return 0;
+}
+
+// called every minute - starts compaction when it is time for it and some logs have been rotated since the last one
+void metacompact_check(void) {
+	struct stat sb;
+	uint64_t imgversion,lastversion;
+	uint8_t due;
+
+	if (compact_fd>=0 || (CompactFreq==0 && CompactChanges==0)) {
+		return;
+	}
+	if (stat("changelog_ml.1.mfs",&sb)<0 || sb.st_mtime==lastrotatetime) {
+		return;
+	}
+	due = 0;
+	if (CompactFreq>0 && main_time()>=lastcompacttime+CompactFreq*3600) {
+		due = 1;
+	}
+	if (CompactChanges>0) {
+		imgversion = metacompact_getfileversion("metadata_ml.mfs.back");
+		lastversion = masterconn_lastlogversion();
+		if (imgversion>0 && lastversion>=imgversion && lastversion-imgversion>=CompactChanges) {
+			due = 1;
+		}
+	}
+	if (due==0) {
+		return;
+	}
+	lastrotatetime = sb.st_mtime;
+	lastcompacttime = main_time();
+	metacompact_start();
+}
+
+void metacompact_term(void) {
+	if (compact_fd>=0) {
+		kill(compact_pid,SIGTERM);
+		main_fdunregister(compact_hook);
+		close(compact_fd);
+		compact_fd = -1;
+		unlink("metadata_ml.mfs.tmp");
+	}
+	if (MetaRestorePath) {
+		free(MetaRestorePath);
+	}
+}
+
+void metacompact_reload(void) {
+	CompactFreq = cfg_getuint32("META_COMPACT_FREQ",0);
+	CompactChanges = cfg_getuint64("META_COMPACT_CHANGES",0);
+	if (MetaRestorePath) {
+		free(MetaRestorePath);
+	}
+	MetaRestorePath = cfg_getstr("METARESTORE_PATH",SBIN_PATH "/mfsmetarestore");
+}
+
+int metacompact_init(void) {
+	MetaRestorePath = NULL;
+	metacompact_reload();
+	lastcompacttime = main_time();
+	main_reloadregister(metacompact_reload);
+	main_destructregister(metacompact_term);
+	main_timeregister(TIMEMODE_RUN_LATE,60,0,metacompact_check);
+	return 0;
+}
@@ -33,6 +33,8 @@
 #include "merger.h"
 #include "restore.h"
 #include "strerr.h"
+#include "crc.h"
+#include "changelogbin.h"
 
 #define STR_AUX(x) #x
 #define STR(x) STR_AUX(x)
@@ -40,12 +42,33 @@ const char id[]="@(#) version: " STR(VERSMAJ) "." STR(VERSMID) "." STR(VERSMIN)
 
 #define MAXIDHOLE 10000
 
+// returns 1 and fills versions when file is a binary changelog, 0 otherwise
+int binlogversions(const char *fname,uint64_t *firstversion,uint64_t *lastversion,int *garbage) {
+	FILE *fd;
+	uint64_t validsize;
+
+	fd = fopen(fname,"r");
+	if (fd==NULL) {
+		return 0;
+	}
+	if (changelogbin_fileformat(fd)!=CHLOGFMT_BINARY) {
+		fclose(fd);
+		return 0;
+	}
+	*garbage = (changelogbin_scan(fd,firstversion,lastversion,&validsize)<0)?1:0;
+	fclose(fd);
+	return 1;
+}
+
 uint64_t findfirstlogversion(const char *fname) {
 	uint8_t buff[50];
 	int32_t s,p;
-	uint64_t fv;
-	int fd;
+	uint64_t fv,lv;
+	int fd,garbage;
 
+	if (binlogversions(fname,&fv,&lv,&garbage)) {
+		return fv;
+	}
 	fd = open(fname,O_RDONLY);
 	if (fd<0) {
 		return 0;
@@ -73,9 +96,12 @@ uint64_t findlastlogversion(const char *fname) {
 	uint8_t buff[32800];	// 32800 = 32768 + 32
 	uint64_t size;
 	uint32_t buffpos;
-	uint64_t lastnewline,lv;
-	int fd;
+	uint64_t lastnewline,fv,lv;
+	int fd,garbage;
 
+	if (binlogversions(fname,&fv,&lv,&garbage)) {
+		return garbage?0:lv;
+	}
 	fd = open(fname,O_RDONLY);
 	if (fd<0) {
 		return 0;
@@ -173,7 +199,7 @@ int changelog_checkname(const char *fname) {
 }
 
 void usage(const char* appname) {
-	fprintf(stderr,"restore metadata:\n\t%s [-f] [-b] [-i] [-x [-x]] -m <meta data file> -o <restored meta data file> [ <change log file> [ <change log file> [ .... ]]\ndump metadata:\n\t%s [-i] -m <meta data file>\nautorestore:\n\t%s [-f] [-b] [-i] [-x [-x]] -a [-d <data path>]\nprint version:\n\t%s -v\n\n-x - produce more verbose output\n-xx - even more verbose output\n-b - if there is any error in change logs then save the best possible metadata file\n-i - ignore some metadata structure errors (attach orphans to root, ignore names without inode, etc.)\n-f - force loading all changelogs\n",appname,appname,appname,appname);
+	fprintf(stderr,"restore metadata:\n\t%s [-f] [-b] [-i] [-p] [-t threads] [-x [-x]] -m <meta data file> -o <restored meta data file> [ <change log file> [ <change log file> [ .... ]]\ndump metadata:\n\t%s [-i] -m <meta data file>\nautorestore:\n\t%s [-f] [-b] [-i] [-t threads] [-x [-x]] -a [-d <data path>]\nprint version:\n\t%s -v\n\n-x - produce more verbose output\n-xx - even more verbose output\n-b - if there is any error in change logs then save the best possible metadata file\n-i - ignore some metadata structure errors (attach orphans to root, ignore names without inode, etc.)\n-f - force loading all changelogs\n-p - print progress lines (used by master during background metadata save)\n-t - number of threads used to parse change logs (default: number of cpus, but not more than 16)\n",appname,appname,appname,appname);
 }
 
 int main(int argc,char **argv) {
@@ -184,6 +210,8 @@ int main(int argc,char **argv) {
 	int savebest = 0;
 	int ignoreflag = 0;
 	int forcealllogs = 0;
+	int progress = 0;
+	int storeerror = 0;
 	int status;
 	int skip;
 	char *metaout = NULL;
@@ -195,8 +223,10 @@ int main(int argc,char **argv) {
 	uint64_t firstlv,lastlv;
 
 	strerr_init();
+	mycrc32_init();
+	merger_setthreads(0);
 
-	while ((ch = getopt(argc, argv, "fvm:o:d:abxih:?")) != -1) {
+	while ((ch = getopt(argc, argv, "fvm:o:d:t:abxiph:?")) != -1) {
 		switch (ch) {
 			case 'v':
 				printf("version: %u.%u.%u\n",VERSMAJ,VERSMID,VERSMIN);
@@ -235,6 +265,12 @@ int main(int argc,char **argv) {
 			case 'f':
 				forcealllogs=1;
 				break;
+			case 'p':
+				progress=1;
+				break;
+			case 't':
+				merger_setthreads(strtoul(optarg,NULL,10));
+				break;
 			case '?':
 			default:
 				usage(argv[0]);
@@ -259,6 +295,7 @@ int main(int argc,char **argv) {
 	}
 
 	restore_setverblevel(vl);
+	restore_setprogress(progress);
 
 	if (autorestore) {
 		struct stat metast;
@@ -311,6 +348,11 @@ int main(int argc,char **argv) {
 		return 1;
 	}
 
+	if (progress) {
+		printf("progress: loaded\n");
+		fflush(stdout);
+	}
+
 	if (autorestore) {
 		DIR *dd;
 		struct dirent *dp;
@@ -453,7 +495,16 @@ int main(int argc,char **argv) {
 		chunk_dump();
 	} else {
 		printf("store metadata into file: %s\n",metaout);
-		fs_term(metaout);
+		if (progress) {
+			printf("progress: storing\n");
+			fflush(stdout);
+		}
+		if (fs_term(metaout)<0) {
+			storeerror = 1;
+		} else if (progress) {
+			printf("progress: stored\n");
+			fflush(stdout);
+		}
 	}
 	if (datapath) {
 		free(datapath);
@@ -464,5 +515,5 @@ int main(int argc,char **argv) {
 	if (metaout) {
 		free(metaout);
 	}
-	return 0;
+	return storeerror;
 }
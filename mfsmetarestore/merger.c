@@ -2,30 +2,81 @@
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #include "restore.h"
+#include "changelogbin.h"
+#include "massert.h"
 
-#define BSIZE 200000
+/* change logs are merged in three stages:
+   reader (one thread per file) - reads file in big chunks and splits it into entries (lines or binary records) grouped in blocks
+   parser (pool of threads) - converts binary records to text and splits entries into parts (restore_parse)
+   apply (main thread) - merges entries from all files in version order and applies them (restore_apply) */
 
-typedef struct _hentry {
+#define READBUFFSIZE 0x100000
+#define BLOCKENTRIES 2048
+#define BLOCKDATA 0x40000
+#define MAXFILEBLOCKS 4
+
+typedef struct _mblock {
+	restore_rec *recs;
+	uint32_t *offsets;	// entries in data (text) or in text (binary, after parsing)
+	uint32_t *lengs;	// binary records only
+	uint32_t entries;
+	char *data;
+	uint32_t dataleng,datasize;
+	char *text;
+	uint32_t textsize;
+	uint8_t binary;
+	uint8_t parsed;
+	struct _mblock *next;	// next block of the same file
+	struct _mblock *qnext;	// parse queue
+} mblock;
+
+typedef struct _mfile {
 	FILE *fd;
 	char *filename;
-	char *buff;
-	char *ptr;
+	uint8_t binary;
+	pthread_t thid;
+	// shared - guarded by lock
+	mblock *head,**tail;
+	uint32_t blocks;
+	uint8_t finished;
+	uint8_t garbage;
+	// main thread only
+	mblock *cblock;
+	uint32_t cpos;
+	restore_rec *crec;
 	uint64_t nextid;
-} hentry;
+} mfile;
 
-static hentry *heap;
+static mfile **heap;
 static uint32_t heapsize;
 static uint64_t maxidhole;
 
+static mfile **files;
+static uint32_t filescnt;
+static pthread_t *parsers;
+static uint32_t parserscnt;
+static uint32_t parsethreads = 1;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workcond = PTHREAD_COND_INITIALIZER;	// parsers - new block in queue
+static pthread_cond_t donecond = PTHREAD_COND_INITIALIZER;	// main thread - block parsed or reader finished
+static pthread_cond_t spacecond = PTHREAD_COND_INITIALIZER;	// readers - block consumed
+static mblock *queuehead,**queuetail;
+static uint8_t stop;
+
 #define PARENT(x) (((x)-1)/2)
 #define CHILD(x) (((x)*2)+1)
 
 void merger_heap_sort_down(void) {
 	uint32_t l,r,m;
 	uint32_t pos=0;
-	hentry x;
+	mfile *x;
 	while (pos<heapsize) {
 		l = CHILD(pos);
 		r = l+1;
@@ -33,10 +84,10 @@ void merger_heap_sort_down(void) {
 			return;
 		}
 		m = l;
-		if (r<heapsize && heap[r].nextid < heap[l].nextid) {
+		if (r<heapsize && heap[r]->nextid < heap[l]->nextid) {
 			m = r;
 		}
-		if (heap[pos].nextid <= heap[m].nextid) {
+		if (heap[pos]->nextid <= heap[m]->nextid) {
 			return;
 		}
 		x = heap[pos];
@@ -49,10 +100,10 @@ void merger_heap_sort_down(void) {
 void merger_heap_sort_up(void) {
 	uint32_t pos=heapsize-1;
 	uint32_t p;
-	hentry x;
+	mfile *x;
 	while (pos>0) {
 		p = PARENT(pos);
-		if (heap[pos].nextid >= heap[p].nextid) {
+		if (heap[pos]->nextid >= heap[p]->nextid) {
 			return;
 		}
 		x = heap[pos];
@@ -62,96 +113,481 @@ void merger_heap_sort_up(void) {
 	}
 }
 
+static mblock* merger_block_new(uint8_t binary) {
+	mblock *b;
+	b = malloc(sizeof(mblock));
+	passert(b);
+	b->recs = malloc(sizeof(restore_rec)*BLOCKENTRIES);
+	passert(b->recs);
+	b->offsets = malloc(sizeof(uint32_t)*BLOCKENTRIES);
+	passert(b->offsets);
+	if (binary) {
+		b->lengs = malloc(sizeof(uint32_t)*BLOCKENTRIES);
+		passert(b->lengs);
+	} else {
+		b->lengs = NULL;
+	}
+	b->entries = 0;
+	b->datasize = BLOCKDATA+BLOCKDATA/4;
+	b->data = malloc(b->datasize);
+	passert(b->data);
+	b->dataleng = 0;
+	b->text = NULL;
+	b->textsize = 0;
+	b->binary = binary;
+	b->parsed = 0;
+	b->next = NULL;
+	b->qnext = NULL;
+	return b;
+}
+
+static void merger_block_free(mblock *b) {
+	free(b->recs);
+	free(b->offsets);
+	if (b->lengs) {
+		free(b->lengs);
+	}
+	free(b->data);
+	if (b->text) {
+		free(b->text);
+	}
+	free(b);
+}
 
-void merger_nextentry(uint32_t pos) {
-	if (fgets(heap[pos].buff,BSIZE,heap[pos].fd)) {
-		uint64_t nextid = strtoull(heap[pos].buff,&(heap[pos].ptr),10);
-		if (heap[pos].nextid==0 || (nextid>heap[pos].nextid && nextid<heap[pos].nextid+maxidhole)) {
-			heap[pos].nextid = nextid;
-		} else {
-			printf("found garbage at the end of file: %s (last correct id: %"PRIu64")\n",heap[pos].filename,heap[pos].nextid);
-			heap[pos].nextid = 0;
+// appends entry to block, returns 1 when block is full
+static int merger_block_add(mblock *b,const char *data,uint32_t leng) {
+	uint32_t need = b->dataleng+leng+1;
+	if (need>b->datasize) {
+		b->datasize = need+need/2;
+		b->data = realloc(b->data,b->datasize);
+		passert(b->data);
+	}
+	b->offsets[b->entries] = b->dataleng;
+	if (b->lengs) {
+		b->lengs[b->entries] = leng;
+	}
+	memcpy(b->data+b->dataleng,data,leng);
+	b->data[b->dataleng+leng] = '\0';
+	b->dataleng = need;
+	b->entries++;
+	return (b->entries>=BLOCKENTRIES || b->dataleng>=BLOCKDATA)?1:0;
+}
+
+// passes block to parsers and to main thread, returns -1 when merging has been stopped
+static int merger_block_push(mfile *f,mblock *b) {
+	zassert(pthread_mutex_lock(&lock));
+	while (f->blocks>=MAXFILEBLOCKS && stop==0) {
+		zassert(pthread_cond_wait(&spacecond,&lock));
+	}
+	if (stop) {
+		zassert(pthread_mutex_unlock(&lock));
+		merger_block_free(b);
+		return -1;
+	}
+	*(f->tail) = b;
+	f->tail = &(b->next);
+	f->blocks++;
+	*queuetail = b;
+	queuetail = &(b->qnext);
+	zassert(pthread_cond_signal(&workcond));
+	zassert(pthread_cond_broadcast(&donecond));	// main thread may parse it by itself
+	zassert(pthread_mutex_unlock(&lock));
+	return 0;
+}
+
+static void merger_block_parse(mblock *b,char **tbuff,uint32_t *tbuffsize) {
+	uint32_t i,tleng,textleng;
+	const uint8_t *rec;
+	char *ptr;
+
+	if (b->binary) {
+		textleng = 0;
+		for (i=0 ; i<b->entries ; i++) {
+			rec = (const uint8_t*)(b->data+b->offsets[i]);
+			b->recs[i].lv = changelogbin_version(rec);
+			tleng = changelogbin_totext(rec,b->lengs[i],tbuff,tbuffsize);
+			if (tleng==(uint32_t)-1) {
+				b->recs[i].lv = 0;
+				continue;
+			}
+			// the same form as text entries (": ts|OP(...)\n")
+			if (textleng+tleng+4>b->textsize) {
+				b->textsize = (textleng+tleng+4)*2;
+				b->text = realloc(b->text,b->textsize);
+				passert(b->text);
+			}
+			ptr = b->text+textleng;
+			ptr[0] = ':';
+			ptr[1] = ' ';
+			memcpy(ptr+2,*tbuff,tleng);
+			ptr[tleng+2] = '\n';
+			ptr[tleng+3] = '\0';
+			b->offsets[i] = textleng;
+			textleng += tleng+4;
+		}
+		for (i=0 ; i<b->entries ; i++) {
+			if (b->recs[i].lv>0) {
+				b->recs[i].line = b->text+b->offsets[i];
+				restore_parse(b->recs+i);
+			}
 		}
 	} else {
-		heap[pos].nextid = 0;
+		for (i=0 ; i<b->entries ; i++) {
+			b->recs[i].lv = strtoull(b->data+b->offsets[i],&ptr,10);
+			b->recs[i].line = ptr;
+			restore_parse(b->recs+i);
+		}
 	}
 }
 
-void merger_delete_entry(void) {
-	if (heap[heapsize].fd) {
-		fclose(heap[heapsize].fd);
+// takes one block from parse queue and parses it (lock has to be held), returns 0 when queue is empty
+static int merger_parse_next(char **tbuff,uint32_t *tbuffsize) {
+	mblock *b;
+	if (queuehead==NULL) {
+		return 0;
 	}
-	if (heap[heapsize].filename) {
-		free(heap[heapsize].filename);
+	b = queuehead;
+	queuehead = b->qnext;
+	if (queuehead==NULL) {
+		queuetail = &queuehead;
 	}
-	if (heap[heapsize].buff) {
-		free(heap[heapsize].buff);
+	zassert(pthread_mutex_unlock(&lock));
+	merger_block_parse(b,tbuff,tbuffsize);
+	zassert(pthread_mutex_lock(&lock));
+	b->parsed = 1;
+	zassert(pthread_cond_broadcast(&donecond));
+	return 1;
+}
+
+static void* merger_parser(void *arg) {
+	char *tbuff = NULL;
+	uint32_t tbuffsize = 0;
+	(void)arg;
+	zassert(pthread_mutex_lock(&lock));
+	while (stop==0) {
+		if (merger_parse_next(&tbuff,&tbuffsize)==0) {
+			zassert(pthread_cond_wait(&workcond,&lock));
+		}
 	}
+	zassert(pthread_mutex_unlock(&lock));
+	if (tbuff) {
+		free(tbuff);
+	}
+	return NULL;
 }
 
-void merger_new_entry(const char *filename) {
-	// printf("add file: %s\n",filename);
-	if ((heap[heapsize].fd = fopen(filename,"r"))!=NULL) {
-		heap[heapsize].filename = strdup(filename);
-		heap[heapsize].buff = malloc(BSIZE);
-		heap[heapsize].ptr = NULL;
-		heap[heapsize].nextid = 0;
-		merger_nextentry(heapsize);
+static void merger_read_text(mfile *f) {
+	char *rbuff,*nl;
+	uint32_t rbuffsize,leng,start;
+	size_t s;
+	mblock *b;
+
+	rbuffsize = READBUFFSIZE;
+	rbuff = malloc(rbuffsize);
+	passert(rbuff);
+	leng = 0;
+	b = merger_block_new(0);
+	for (;;) {
+		if (leng==rbuffsize) {	// very long line
+			rbuffsize *= 2;
+			rbuff = realloc(rbuff,rbuffsize);
+			passert(rbuff);
+		}
+		s = fread(rbuff+leng,1,rbuffsize-leng,f->fd);
+		if (s==0) {
+			if (leng>0) {	// last line without new line
+				merger_block_add(b,rbuff,leng);
+			}
+			break;
+		}
+		leng += s;
+		start = 0;
+		while ((nl=memchr(rbuff+start,'\n',leng-start))!=NULL) {
+			s = (nl-(rbuff+start))+1;
+			if (merger_block_add(b,rbuff+start,s)) {
+				if (merger_block_push(f,b)<0) {
+					free(rbuff);
+					return;
+				}
+				b = merger_block_new(0);
+			}
+			start += s;
+		}
+		memmove(rbuff,rbuff+start,leng-start);
+		leng -= start;
+	}
+	free(rbuff);
+	if (b->entries>0) {
+		merger_block_push(f,b);
 	} else {
-		printf("can't open changelog file: %s\n",filename);
-		heap[heapsize].filename = NULL;
-		heap[heapsize].buff = NULL;
-		heap[heapsize].ptr = NULL;
-		heap[heapsize].nextid = 0;
+		merger_block_free(b);
 	}
 }
 
-int merger_start(uint32_t files,char **filenames,uint64_t maxhole) {
+static void merger_read_binary(mfile *f) {
+	uint8_t *rbuff;
+	uint32_t rbuffsize,leng;
+	int status;
+	mblock *b;
+
+	rbuff = NULL;
+	rbuffsize = 0;
+	b = merger_block_new(1);
+	while ((status=changelogbin_read(f->fd,&rbuff,&rbuffsize,&leng))>0) {
+		if (merger_block_add(b,(const char*)rbuff,leng)) {
+			if (merger_block_push(f,b)<0) {
+				free(rbuff);
+				return;
+			}
+			b = merger_block_new(1);
+		}
+	}
+	if (rbuff) {
+		free(rbuff);
+	}
+	if (status<0) {
+		f->garbage = 1;	// reported by main thread after last correct entry
+	}
+	if (b->entries>0) {
+		merger_block_push(f,b);
+	} else {
+		merger_block_free(b);
+	}
+}
+
+static void* merger_reader(void *arg) {
+	mfile *f = (mfile*)arg;
+	if (f->binary) {
+		merger_read_binary(f);
+	} else {
+		merger_read_text(f);
+	}
+	zassert(pthread_mutex_lock(&lock));
+	f->finished = 1;
+	zassert(pthread_cond_broadcast(&donecond));
+	zassert(pthread_mutex_unlock(&lock));
+	return NULL;
+}
+
+// returns next parsed entry of given file or NULL at the end of file
+static restore_rec* merger_getrec(mfile *f) {
+	char *tbuff = NULL;
+	uint32_t tbuffsize = 0;
+	restore_rec *r = NULL;
+	mblock *b;
+
+	if (f->cblock && f->cpos<f->cblock->entries) {	// fast path - current block is already parsed
+		return f->cblock->recs + (f->cpos++);
+	}
+	zassert(pthread_mutex_lock(&lock));
+	if (f->cblock) {
+		b = f->cblock;
+		f->head = b->next;
+		if (f->head==NULL) {
+			f->tail = &(f->head);
+		}
+		f->blocks--;
+		f->cblock = NULL;
+		merger_block_free(b);
+		zassert(pthread_cond_broadcast(&spacecond));
+	}
+	for (;;) {
+		if (f->head && f->head->parsed) {
+			f->cblock = f->head;
+			f->cpos = 1;
+			r = f->cblock->recs;
+			break;
+		}
+		if (f->head==NULL && f->finished) {
+			break;
+		}
+		if (merger_parse_next(&tbuff,&tbuffsize)==0) {	// help parsers instead of waiting
+			zassert(pthread_cond_wait(&donecond,&lock));
+		}
+	}
+	zassert(pthread_mutex_unlock(&lock));
+	if (tbuff) {
+		free(tbuff);
+	}
+	return r;
+}
+
+void merger_nextentry(mfile *f) {
+	restore_rec *r;
+	r = merger_getrec(f);
+	if (r==NULL) {
+		if (f->garbage) {
+			printf("found garbage at the end of file: %s (last correct id: %"PRIu64")\n",f->filename,f->nextid);
+		}
+		f->nextid = 0;
+		return;
+	}
+	if (f->binary && r->lv==0) {
+		printf("unknown record in file: %s (last correct id: %"PRIu64")\n",f->filename,f->nextid);
+		f->nextid = 0;
+		return;
+	}
+	if (f->nextid==0 || (r->lv>f->nextid && r->lv<f->nextid+maxidhole)) {
+		f->nextid = r->lv;
+		f->crec = r;
+	} else {
+		printf("found garbage at the end of file: %s (last correct id: %"PRIu64")\n",f->filename,f->nextid);
+		f->nextid = 0;
+	}
+}
+
+// stops all threads and frees everything
+static void merger_cleanup(void) {
 	uint32_t i;
+	mblock *b;
+	mfile *f;
+
+	zassert(pthread_mutex_lock(&lock));
+	stop = 1;
+	zassert(pthread_cond_broadcast(&workcond));
+	zassert(pthread_cond_broadcast(&spacecond));
+	zassert(pthread_mutex_unlock(&lock));
+	for (i=0 ; i<parserscnt ; i++) {
+		zassert(pthread_join(parsers[i],NULL));
+	}
+	for (i=0 ; i<filescnt ; i++) {
+		f = files[i];
+		zassert(pthread_join(f->thid,NULL));
+		while ((b=f->head)!=NULL) {
+			f->head = b->next;
+			merger_block_free(b);
+		}
+		fclose(f->fd);
+		free(f->filename);
+		free(f);
+	}
+	if (parsers) {
+		free(parsers);
+	}
+	if (files) {
+		free(files);
+	}
+	if (heap) {
+		free(heap);
+	}
+	parsers = NULL;
+	files = NULL;
+	heap = NULL;
+	parserscnt = 0;
+	filescnt = 0;
+	heapsize = 0;
+}
+
+// 0 - number of online cpus (but not more than 16)
+void merger_setthreads(uint32_t threads) {
+	if (threads==0) {
+#ifdef _SC_NPROCESSORS_ONLN
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = (cpus>0)?cpus:1;
+#else
+		threads = 1;
+#endif
+		if (threads>16) {
+			threads = 16;
+		}
+	}
+	if (threads>256) {
+		threads = 256;
+	}
+	parsethreads = threads;
+}
+
+int merger_start(uint32_t filecount,char **filenames,uint64_t maxhole) {
+	uint32_t i;
+	FILE *fd;
+	mfile *f;
+
+	maxidhole = maxhole;
 	heapsize = 0;
-	heap = (hentry*)malloc(sizeof(hentry)*files);
-	if (heap==NULL) {
+	filescnt = 0;
+	parserscnt = 0;
+	stop = 0;
+	queuehead = NULL;
+	queuetail = &queuehead;
+	heap = (mfile**)malloc(sizeof(mfile*)*(filecount+1));
+	files = (mfile**)malloc(sizeof(mfile*)*(filecount+1));
+	parsers = (pthread_t*)malloc(sizeof(pthread_t)*parsethreads);
+	if (heap==NULL || files==NULL || parsers==NULL) {
+		merger_cleanup();
 		return -1;
 	}
-	for (i=0 ; i<files ; i++) {
-		merger_new_entry(filenames[i]);
-//		printf("file: %s / firstid: %"PRIu64"\n",filenames[i],heap[heapsize].nextid);
-		if (heap[heapsize].nextid==0) {
-			merger_delete_entry();
-		} else {
-			heapsize++;
+	for (i=0 ; i<filecount ; i++) {
+		if ((fd=fopen(filenames[i],"r"))==NULL) {
+			printf("can't open changelog file: %s\n",filenames[i]);
+			continue;
+		}
+		setvbuf(fd,NULL,_IOFBF,READBUFFSIZE);
+		f = malloc(sizeof(mfile));
+		passert(f);
+		f->fd = fd;
+		f->filename = strdup(filenames[i]);
+		passert(f->filename);
+		f->binary = (changelogbin_fileformat(fd)==CHLOGFMT_BINARY)?1:0;
+		f->head = NULL;
+		f->tail = &(f->head);
+		f->blocks = 0;
+		f->finished = 0;
+		f->garbage = 0;
+		f->cblock = NULL;
+		f->cpos = 0;
+		f->crec = NULL;
+		f->nextid = 0;
+		zassert(pthread_create(&(f->thid),NULL,merger_reader,f));
+		files[filescnt++] = f;
+	}
+	// if no parser can be started then main thread parses everything by itself
+	for (i=0 ; i<parsethreads ; i++) {
+		if (pthread_create(parsers+parserscnt,NULL,merger_parser,NULL)==0) {
+			parserscnt++;
+		}
+	}
+	for (i=0 ; i<filescnt ; i++) {
+		f = files[i];
+		merger_nextentry(f);
+//		printf("file: %s / firstid: %"PRIu64"\n",f->filename,f->nextid);
+		if (f->nextid!=0) {
+			heap[heapsize++] = f;
 			merger_heap_sort_up();
 		}
 	}
-	maxidhole = maxhole;
-//	for (i=0 ; i<heapsize ; i++) {
-//		printf("heap: %u / firstid: %"PRIu64"\n",i,heap[i].nextid);
-//	}
 	return 0;
 }
 
 int merger_loop(void) {
 	int status;
-	hentry h;
+	mfile *f;
+	uint64_t entries;
+	struct timeval tv;
+	double start,seconds;
 
+	gettimeofday(&tv,NULL);
+	start = tv.tv_sec+tv.tv_usec/1000000.0;
+	entries = 0;
 	while (heapsize) {
-//		printf("current id: %"PRIu64" / %s\n",heap[0].nextid,heap[0].ptr);
-		if ((status=restore(heap[0].filename,heap[0].nextid,heap[0].ptr))<0) {
-			while (heapsize) {
-				heapsize--;
-				merger_delete_entry();
-			}
+		f = heap[0];
+//		printf("current id: %"PRIu64" / %s\n",f->nextid,f->crec->line);
+		if ((status=restore_apply(f->filename,f->crec))<0) {
+			merger_cleanup();
 			return status;
 		}
-		merger_nextentry(0);
-		if (heap[0].nextid==0) {
+		entries++;
+		merger_nextentry(f);
+		if (f->nextid==0) {
 			heapsize--;
-			h = heap[0];
 			heap[0] = heap[heapsize];
-			heap[heapsize] = h;
-			merger_delete_entry();
 		}
 		merger_heap_sort_down();
 	}
+	merger_cleanup();
+	if (entries>0) {
+		gettimeofday(&tv,NULL);
+		seconds = tv.tv_sec+tv.tv_usec/1000000.0-start;
+		printf("%"PRIu64" changelog entries merged in %.3f seconds (%.0f entries/s, %"PRIu32" parser threads)\n",entries,seconds,(seconds>0.0)?entries/seconds:0.0,parsethreads);
+	}
 	return 0;
 }
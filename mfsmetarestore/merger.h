@@ -3,6 +3,7 @@
 
 #include <inttypes.h>
 
+void merger_setthreads(uint32_t threads);
 int merger_start(uint32_t files,char **filenames,uint64_t maxhole);
 int merger_loop(void);
 
@@ -25,6 +25,7 @@
 
 #include "MFSCommunication.h"
 #include "filesystem.h"
+#include "restore.h"
 
 #define EAT(clptr,fn,vno,c) { \
 	if (*(clptr)!=(c)) { \
@@ -327,6 +328,21 @@ int do_link(const char *filename,uint64_t lv,uint32_t ts,char *ptr) {
 	return fs_link(ts,inode,parent,strlen((char*)name),name);
 }
 
+int do_lazysnapshot(const char *filename,uint64_t lv,uint32_t ts,char *ptr) {
+	uint32_t inode,parent,canoverwrite;
+	uint8_t name[256];
+	EAT(ptr,filename,lv,'(');
+	GETU32(inode,ptr);
+	EAT(ptr,filename,lv,',');
+	GETU32(parent,ptr);
+	EAT(ptr,filename,lv,',');
+	GETNAME(name,ptr,filename,lv,',');
+	EAT(ptr,filename,lv,',');
+	GETU32(canoverwrite,ptr);
+	EAT(ptr,filename,lv,')');
+	return fs_snapshot(ts,inode,parent,strlen((char*)name),name,canoverwrite,1);
+}
+
 int do_length(const char *filename,uint64_t lv,uint32_t ts,char *ptr) {
 	uint32_t inode;
 	uint64_t length;
@@ -338,6 +354,17 @@ int do_length(const char *filename,uint64_t lv,uint32_t ts,char *ptr) {
 	return fs_length(ts,inode,length);
 }
 
+int do_materialize(const char *filename,uint64_t lv,uint32_t ts,char *ptr) {
+	uint32_t inode,count;
+	(void)ts;
+	EAT(ptr,filename,lv,'(');
+	GETU32(inode,ptr);
+	EAT(ptr,filename,lv,')');
+	EAT(ptr,filename,lv,':');
+	GETU32(count,ptr);
+	return fs_materialize(inode,count);
+}
+
 int do_move(const char *filename,uint64_t lv,uint32_t ts,char *ptr) {
 	uint32_t inode,parent_src,parent_dst;
 	uint8_t name_src[256],name_dst[256];
@@ -463,6 +490,31 @@ int do_seteattr(const char *filename,uint64_t lv,uint32_t ts,char *ptr) {
 	return fs_seteattr(ts,inode,uid,eattr,smode,ci,nci,npi);
 }
 
+int do_seteattrpart(const char *filename,uint64_t lv,uint32_t ts,char *ptr) {
+	uint32_t inode,uid,hfrom,hto,ci,nci,npi;
+	uint8_t eattr,smode;
+	EAT(ptr,filename,lv,'(');
+	GETU32(inode,ptr);
+	EAT(ptr,filename,lv,',');
+	GETU32(uid,ptr);
+	EAT(ptr,filename,lv,',');
+	GETU32(eattr,ptr);
+	EAT(ptr,filename,lv,',');
+	GETU32(smode,ptr);
+	EAT(ptr,filename,lv,',');
+	GETU32(hfrom,ptr);
+	EAT(ptr,filename,lv,',');
+	GETU32(hto,ptr);
+	EAT(ptr,filename,lv,')');
+	EAT(ptr,filename,lv,':');
+	GETU32(ci,ptr);
+	EAT(ptr,filename,lv,',');
+	GETU32(nci,ptr);
+	EAT(ptr,filename,lv,',');
+	GETU32(npi,ptr);
+	return fs_seteattrpart(ts,inode,uid,eattr,smode,hfrom,hto,ci,nci,npi);
+}
+
 int do_setgoal(const char *filename,uint64_t lv,uint32_t ts,char *ptr) {
 #if VERSHEX>=0x010700
 	uint32_t inode,uid,ci,nci,npi,qei;
@@ -498,6 +550,33 @@ int do_setgoal(const char *filename,uint64_t lv,uint32_t ts,char *ptr) {
 #endif
 }
 
+int do_setgoalpart(const char *filename,uint64_t lv,uint32_t ts,char *ptr) {
+	uint32_t inode,uid,hfrom,hto,ci,nci,npi,qei;
+	uint8_t goal,smode;
+	EAT(ptr,filename,lv,'(');
+	GETU32(inode,ptr);
+	EAT(ptr,filename,lv,',');
+	GETU32(uid,ptr);
+	EAT(ptr,filename,lv,',');
+	GETU32(goal,ptr);
+	EAT(ptr,filename,lv,',');
+	GETU32(smode,ptr);
+	EAT(ptr,filename,lv,',');
+	GETU32(hfrom,ptr);
+	EAT(ptr,filename,lv,',');
+	GETU32(hto,ptr);
+	EAT(ptr,filename,lv,')');
+	EAT(ptr,filename,lv,':');
+	GETU32(ci,ptr);
+	EAT(ptr,filename,lv,',');
+	GETU32(nci,ptr);
+	EAT(ptr,filename,lv,',');
+	GETU32(npi,ptr);
+	EAT(ptr,filename,lv,',');
+	GETU32(qei,ptr);
+	return fs_setgoalpart(ts,inode,uid,goal,smode,hfrom,hto,ci,nci,npi,qei);
+}
+
 int do_setpath(const char *filename,uint64_t lv,uint32_t ts,char *ptr) {
 	uint32_t inode;
 	static uint8_t *path = NULL;
@@ -533,6 +612,32 @@ int do_settrashtime(const char *filename,uint64_t lv,uint32_t ts,char *ptr) {
 	return fs_settrashtime(ts,inode,uid,trashtime,smode,ci,nci,npi);
 }
 
+int do_settrashtimepart(const char *filename,uint64_t lv,uint32_t ts,char *ptr) {
+	uint32_t inode,uid,hfrom,hto,ci,nci,npi;
+	uint32_t trashtime;
+	uint8_t smode;
+	EAT(ptr,filename,lv,'(');
+	GETU32(inode,ptr);
+	EAT(ptr,filename,lv,',');
+	GETU32(uid,ptr);
+	EAT(ptr,filename,lv,',');
+	GETU32(trashtime,ptr);
+	EAT(ptr,filename,lv,',');
+	GETU32(smode,ptr);
+	EAT(ptr,filename,lv,',');
+	GETU32(hfrom,ptr);
+	EAT(ptr,filename,lv,',');
+	GETU32(hto,ptr);
+	EAT(ptr,filename,lv,')');
+	EAT(ptr,filename,lv,':');
+	GETU32(ci,ptr);
+	EAT(ptr,filename,lv,',');
+	GETU32(nci,ptr);
+	EAT(ptr,filename,lv,',');
+	GETU32(npi,ptr);
+	return fs_settrashtimepart(ts,inode,uid,trashtime,smode,hfrom,hto,ci,nci,npi);
+}
+
 int do_setxattr(const char *filename,uint64_t lv,uint32_t ts,char *ptr) {
 	uint32_t inode,valueleng,mode;
 	uint8_t name[256];
@@ -562,7 +667,7 @@ int do_snapshot(const char *filename,uint64_t lv,uint32_t ts,char *ptr) {
 	EAT(ptr,filename,lv,',');
 	GETU32(canoverwrite,ptr);
 	EAT(ptr,filename,lv,')');
-	return fs_snapshot(ts,inode,parent,strlen((char*)name),name,canoverwrite);
+	return fs_snapshot(ts,inode,parent,strlen((char*)name),name,canoverwrite,0);
 }
 
 int do_symlink(const char *filename,uint64_t lv,uint32_t ts,char *ptr) {
@@ -649,164 +754,129 @@ int do_write(const char *filename,uint64_t lv,uint32_t ts,char *ptr) {
 }
 
 
+typedef struct _restore_op {
+	const char *name;
+	uint32_t leng;
+	int (*fn)(const char *filename,uint64_t lv,uint32_t ts,char *ptr);
+} restore_op;
+
+// op numbers stored in restore_rec are indexes in this table (0 - unknown entry)
+static const restore_op restore_ops[] = {
+	{"",0,NULL},
+	{"ACCESS",6,do_access},
+	{"ATTR",4,do_attr},
+	{"APPEND",6,do_append},
+	{"ACQUIRE",7,do_acquire},
+	{"AQUIRE",6,do_acquire},
+	{"CREATE",6,do_create},
+	{"CUSTOMER",8,do_session},	// deprecated
+	{"EMPTYTRASH",10,do_emptytrash},
+	{"EMPTYRESERVED",13,do_emptyreserved},
+	{"FREEINODES",10,do_freeinodes},
+	{"INCVERSION",10,do_incversion},
+	{"LAZYSNAPSHOT",12,do_lazysnapshot},
+	{"LENGTH",6,do_length},
+	{"LINK",4,do_link},
+	{"MATERIALIZE",11,do_materialize},
+	{"MOVE",4,do_move},
+	{"PURGE",5,do_purge},
+	{"QUOTA",5,do_quota},
+	{"RELEASE",7,do_release},
+	{"REPAIR",6,do_repair},
+	{"SETEATTRPART",12,do_seteattrpart},
+	{"SETEATTR",8,do_seteattr},
+	{"SETGOALPART",11,do_setgoalpart},
+	{"SETGOAL",7,do_setgoal},
+	{"SETPATH",7,do_setpath},
+	{"SETTRASHTIMEPART",16,do_settrashtimepart},
+	{"SETTRASHTIME",12,do_settrashtime},
+	{"SETXATTR",8,do_setxattr},
+	{"SNAPSHOT",8,do_snapshot},
+	{"SYMLINK",7,do_symlink},
+	{"SESSION",7,do_session},
+	{"TRUNC",5,do_trunc},
+	{"UNLINK",6,do_unlink},
+	{"UNDEL",5,do_undel},
+	{"UNLOCK",6,do_unlock},
+	{"WRITE",5,do_write}
+};
+
+#define RESTORE_OPS (sizeof(restore_ops)/sizeof(restore_op))
+
+// finds operation name at ptr (name ends at first character that is not an upper case letter)
+static uint8_t restore_findop(const char *ptr) {
+	uint32_t i,leng;
+	leng = 0;
+	while (ptr[leng]>='A' && ptr[leng]<='Z') {
+		leng++;
+	}
+	for (i=1 ; i<RESTORE_OPS ; i++) {
+		if (restore_ops[i].leng==leng && memcmp(ptr,restore_ops[i].name,leng)==0) {
+			return i;
+		}
+	}
+	return 0;
+}
+
+static int restore_exec(const char *filename,uint64_t lv,uint32_t ts,uint8_t op,char *ptr) {
+	int status;
+	char* errormsgs[]={ ERROR_STRINGS };
+
+	if (op==0) {
+		printf("%s:%"PRIu64": unknown entry '%s'\n",filename,lv,ptr);
+		return ERROR_MISMATCH;
+	}
+	status = restore_ops[op].fn(filename,lv,ts,ptr+restore_ops[op].leng);
+	if (status>STATUS_OK) {
+		printf("%s:%"PRIu64": error: %d (%s)\n",filename,lv,status,errormsgs[status]);
+	}
+	return status;
+}
+
 int restore_line(const char *filename,uint64_t lv,char *line) {
 	char *ptr;
 	uint32_t ts;
-	int status;
-	char* errormsgs[]={ ERROR_STRINGS };
 
-	status = ERROR_MISMATCH;
 	ptr = line;
 
 	EAT(ptr,filename,lv,':');
 	EAT(ptr,filename,lv,' ');
 	GETU32(ts,ptr);
 	EAT(ptr,filename,lv,'|');
-	switch (*ptr) {
-		case 'A':
-			if (strncmp(ptr,"ACCESS",6)==0) {
-				status = do_access(filename,lv,ts,ptr+6);
-			} else if (strncmp(ptr,"ATTR",4)==0) {
-				status = do_attr(filename,lv,ts,ptr+4);
-			} else if (strncmp(ptr,"APPEND",6)==0) {
-				status = do_append(filename,lv,ts,ptr+6);
-			} else if (strncmp(ptr,"ACQUIRE",7)==0) {
-				status = do_acquire(filename,lv,ts,ptr+7);
-			} else if (strncmp(ptr,"AQUIRE",6)==0) {
-				status = do_acquire(filename,lv,ts,ptr+6);
-			} else {
-				printf("%s:%"PRIu64": unknown entry '%s'\n",filename,lv,ptr);
-			}
-			break;
-		case 'C':
-			if (strncmp(ptr,"CREATE",6)==0) {
-				status = do_create(filename,lv,ts,ptr+6);
-			} else if (strncmp(ptr,"CUSTOMER",8)==0) {	// deprecated
-				status = do_session(filename,lv,ts,ptr+8);
-			} else {
-				printf("%s:%"PRIu64": unknown entry '%s'\n",filename,lv,ptr);
-			}
-			break;
-		case 'E':
-			if (strncmp(ptr,"EMPTYTRASH",10)==0) {
-				status = do_emptytrash(filename,lv,ts,ptr+10);
-			} else if (strncmp(ptr,"EMPTYRESERVED",13)==0) {
-				status = do_emptyreserved(filename,lv,ts,ptr+13);
-			} else {
-				printf("%s:%"PRIu64": unknown entry '%s'\n",filename,lv,ptr);
-			}
-			break;
-		case 'F':
-			if (strncmp(ptr,"FREEINODES",10)==0) {
-				status = do_freeinodes(filename,lv,ts,ptr+10);
-			} else {
-				printf("%s:%"PRIu64": unknown entry '%s'\n",filename,lv,ptr);
-			}
-			break;
-		case 'I':
-			if (strncmp(ptr,"INCVERSION",10)==0) {
-				status = do_incversion(filename,lv,ts,ptr+10);
-			} else {
-				printf("%s:%"PRIu64": unknown entry '%s'\n",filename,lv,ptr);
-			}
-			break;
-		case 'L':
-			if (strncmp(ptr,"LENGTH",6)==0) {
-				status = do_length(filename,lv,ts,ptr+6);
-			} else if (strncmp(ptr,"LINK",4)==0) {
-				status = do_link(filename,lv,ts,ptr+4);
-			} else {
-				printf("%s:%"PRIu64": unknown entry '%s'\n",filename,lv,ptr);
-			}
-			break;
-		case 'M':
-			if (strncmp(ptr,"MOVE",4)==0) {
-				status = do_move(filename,lv,ts,ptr+4);
-			} else {
-				printf("%s:%"PRIu64": unknown entry '%s'\n",filename,lv,ptr);
-			}
-			break;
-		case 'P':
-			if (strncmp(ptr,"PURGE",5)==0) {
-				status = do_purge(filename,lv,ts,ptr+5);
-			} else {
-				printf("%s:%"PRIu64": unknown entry '%s'\n",filename,lv,ptr);
-			}
-			break;
-		case 'Q':
-			if (strncmp(ptr,"QUOTA",5)==0) {
-				status = do_quota(filename,lv,ts,ptr+5);
-			}
-			break;
-		case 'R':
-			if (strncmp(ptr,"RELEASE",7)==0) {
-				status = do_release(filename,lv,ts,ptr+7);
-			} else if (strncmp(ptr,"REPAIR",6)==0) {
-				status = do_repair(filename,lv,ts,ptr+6);
-			} else {
-				printf("%s:%"PRIu64": unknown entry '%s'\n",filename,lv,ptr);
-			}
-			break;
-		case 'S':
-			if (strncmp(ptr,"SETEATTR",8)==0) {
-				status = do_seteattr(filename,lv,ts,ptr+8);
-			} else if (strncmp(ptr,"SETGOAL",7)==0) {
-				status = do_setgoal(filename,lv,ts,ptr+7);
-			} else if (strncmp(ptr,"SETPATH",7)==0) {
-				status = do_setpath(filename,lv,ts,ptr+7);
-			} else if (strncmp(ptr,"SETTRASHTIME",12)==0) {
-				status = do_settrashtime(filename,lv,ts,ptr+12);
-			} else if (strncmp(ptr,"SETXATTR",8)==0) {
-				status = do_setxattr(filename,lv,ts,ptr+8);
-			} else if (strncmp(ptr,"SNAPSHOT",8)==0) {
-				status = do_snapshot(filename,lv,ts,ptr+8);
-			} else if (strncmp(ptr,"SYMLINK",7)==0) {
-				status = do_symlink(filename,lv,ts,ptr+7);
-			} else if (strncmp(ptr,"SESSION",7)==0) {
-				status = do_session(filename,lv,ts,ptr+7);
-			} else {
-				printf("%s:%"PRIu64": unknown entry '%s'\n",filename,lv,ptr);
-			}
-			break;
-		case 'T':
-			if (strncmp(ptr,"TRUNC",5)==0) {
-				status = do_trunc(filename,lv,ts,ptr+5);
-			} else {
-				printf("%s:%"PRIu64": unknown entry '%s'\n",filename,lv,ptr);
-			}
-			break;
-		case 'U':
-			if (strncmp(ptr,"UNLINK",6)==0) {
-				status = do_unlink(filename,lv,ts,ptr+6);
-			} else if (strncmp(ptr,"UNDEL",5)==0) {
-				status = do_undel(filename,lv,ts,ptr+5);
-			} else if (strncmp(ptr,"UNLOCK",6)==0) {
-				status = do_unlock(filename,lv,ts,ptr+6);
-			} else {
-				printf("%s:%"PRIu64": unknown entry '%s'\n",filename,lv,ptr);
-			}
-			break;
-		case 'W':
-			if (strncmp(ptr,"WRITE",5)==0) {
-				status = do_write(filename,lv,ts,ptr+5);
-			} else {
-				printf("%s:%"PRIu64": unknown entry '%s'\n",filename,lv,ptr);
-			}
-			break;
-		default:
-			printf("%s:%"PRIu64": unknown entry '%s'\n",filename,lv,ptr);
+	return restore_exec(filename,lv,ts,restore_findop(ptr),ptr);
+}
+
+// only text of the record is examined here, so it can be called from many threads at once
+void restore_parse(restore_rec *rec) {
+	char *ptr;
+
+	rec->op = 0;
+	rec->args = NULL;
+	ptr = rec->line;
+	if (ptr[0]!=':' || ptr[1]!=' ' || ptr[2]<'0' || ptr[2]>'9') {
+		return;
 	}
-	if (status>STATUS_OK) {
-		printf("%s:%"PRIu64": error: %d (%s)\n",filename,lv,status,errormsgs[status]);
+	ptr+=2;
+	GETU32(rec->ts,ptr);
+	if (*ptr!='|') {
+		return;
+	}
+	ptr++;
+	rec->op = restore_findop(ptr);
+	if (rec->op) {
+		rec->args = ptr;
 	}
-	return status;
 }
 
 static uint64_t v=0,lastv=0;
 static const char *lastfn;
 static uint8_t vlevel;
+static uint8_t progress;
+static uint32_t applied;
 
-int restore(const char *filename,uint64_t lv,char *ptr) {
+int restore_apply(const char *filename,restore_rec *rec) {
+	uint64_t lv = rec->lv;
+	char *ptr = rec->line;
 	int status;
 	if (lastv==0 || v==0) {
 		v = fs_getversion();
@@ -831,7 +901,11 @@ int restore(const char *filename,uint64_t lv,char *ptr) {
 			if (vlevel>0) {
 				printf("%s: change%s",filename,ptr);
 			}
-			status = restore_line(filename,lv,ptr);
+			if (rec->op) {
+				status = restore_exec(filename,lv,rec->ts,rec->op,rec->args);
+			} else {	// not parsed - parse it again to get exactly the same diagnostics
+				status = restore_line(filename,lv,ptr);
+			}
 			if (status<0) { // parse error - just ignore this line
 				return 0;
 			}
@@ -843,6 +917,10 @@ int restore(const char *filename,uint64_t lv,char *ptr) {
 				printf("%s:%"PRIu64": version mismatch\n",filename,lv);
 				return -1;
 			}
+			if (progress && ((++applied)&0x3FFF)==0) {
+				printf("progress: version %"PRIu64"\n",lv);
+				fflush(stdout);
+			}
 		}
 	}
 	lastv = lv;
@@ -850,6 +928,24 @@ int restore(const char *filename,uint64_t lv,char *ptr) {
 	return 0;
 }
 
+int restore(const char *filename,uint64_t lv,char *ptr) {
+	restore_rec rec;
+	rec.lv = lv;
+	rec.line = ptr;
+	restore_parse(&rec);
+	return restore_apply(filename,&rec);
+}
+
+// next entry is treated as the first one (used when the same files are merged again on top of current metadata)
+void restore_reset(void) {
+	v = 0;
+	lastv = 0;
+}
+
 void restore_setverblevel(uint8_t _vlevel) {
 	vlevel = _vlevel;
 }
+
+void restore_setprogress(uint8_t _progress) {
+	progress = _progress;
+}
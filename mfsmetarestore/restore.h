@@ -21,7 +21,20 @@
 
 #include <inttypes.h>
 
+// change log entry split into parts by restore_parse (op==0 - entry not recognized, it is parsed again by restore_apply)
+typedef struct _restore_rec {
+	uint64_t lv;
+	char *line;	// entry without version (": ts|OP(...)...")
+	char *args;
+	uint32_t ts;
+	uint8_t op;
+} restore_rec;
+
 int restore(const char *filename,uint64_t lv,char *ptr);
+void restore_parse(restore_rec *rec);
+int restore_apply(const char *filename,restore_rec *rec);
+void restore_reset(void);
 void restore_setverblevel(uint8_t _vlevel);
+void restore_setprogress(uint8_t _progress);
 
 #endif
@@ -128,6 +128,8 @@ struct mfsopts {
 	char *masterport;
 	char *bindhost;
 	char *subfolder;
+	char *shadowhost;
+	char *shadowport;
 	char *password;
 	char *md5pass;
 	unsigned nofile;
@@ -185,6 +187,8 @@ static struct fuse_opt mfs_opts_stage2[] = {
 	MFS_OPT("mfsport=%s", masterport, 0),
 	MFS_OPT("mfsbind=%s", bindhost, 0),
 	MFS_OPT("mfssubfolder=%s", subfolder, 0),
+	MFS_OPT("mfsshadowhost=%s", shadowhost, 0),
+	MFS_OPT("mfsshadowport=%s", shadowport, 0),
 	MFS_OPT("mfspassword=%s", password, 0),
 	MFS_OPT("mfsmd5pass=%s", md5pass, 0),
 	MFS_OPT("mfsrlimitnofile=%u", nofile, 0),
@@ -278,6 +282,8 @@ static void usage(const char *progname) {
 "    -o mfsport=PORT             define mfsmaster port number (default: 9421)\n"
 "    -o mfsbind=IP               define source ip address for connections (default: NOT DEFINED - choosen automatically by OS)\n"
 "    -o mfssubfolder=PATH        define subfolder to mount as root (default: /)\n"
+"    -o mfsshadowhost=HOST       send read-only metadata requests to shadow master (mfsshadow) on given host (default: NOT DEFINED)\n"
+"    -o mfsshadowport=PORT       define shadow master port number (default: 9423)\n"
 "    -o mfspassword=PASSWORD     authenticate to mfsmaster with password\n"
 "    -o mfsmd5pass=MD5           authenticate to mfsmaster using directly given md5 (only if mfspassword is not defined)\n"
 "    -o mfsdonotrememberpassword do not remember password in memory - more secure, but when session is lost then new session is created without password\n"
@@ -515,6 +521,12 @@ int mainloop(struct fuse_args *args,const char* mp,int mt,int fg) {
 	}
 	memset(md5pass,0,16);
 
+	if (mfsopts.shadowhost!=NULL && mfsopts.meta==0) {
+		if (fs_init_shadow_connection(mfsopts.shadowhost,mfsopts.shadowport?mfsopts.shadowport:"9423")<0) {
+			return 1;
+		}
+	}
+
 	if (fg==0) {
 		openlog(STR(APPNAME), LOG_PID | LOG_NDELAY , LOG_DAEMON);
 	} else {
@@ -853,6 +865,8 @@ int main(int argc, char *argv[]) {
 	mfsopts.masterport = NULL;
 	mfsopts.bindhost = NULL;
 	mfsopts.subfolder = NULL;
+	mfsopts.shadowhost = NULL;
+	mfsopts.shadowport = NULL;
 	mfsopts.password = NULL;
 	mfsopts.md5pass = NULL;
 	mfsopts.nofile = 0;
@@ -1018,6 +1032,12 @@ int main(int argc, char *argv[]) {
 		free(mfsopts.bindhost);
 	}
 	free(mfsopts.subfolder);
+	if (mfsopts.shadowhost) {
+		free(mfsopts.shadowhost);
+	}
+	if (mfsopts.shadowport) {
+		free(mfsopts.shadowport);
+	}
 	if (defaultmountpoint) {
 		free(defaultmountpoint);
 	}
@@ -123,6 +123,20 @@ static uint32_t srcip=0;
 
 static uint8_t fterm;
 
+// read-only requests can be sent to shadow master (mfsshadow) - used only when nothing has been changed by this mount recently
+#define SHADOW_RETRY_DELAY 5
+#define SHADOW_MODIFY_DELAY 2
+
+static int shfd=-1;
+static uint8_t shenabled=0;
+static uint32_t shadowip=0;
+static uint16_t shadowport=0;
+static time_t shretrytime=0;
+static time_t lastmodify=0;
+static pthread_mutex_t shlock;
+static uint8_t shhavepassword=0;	// password is kept for shadow master only when it is also remembered for master
+static uint8_t shpassworddigest[16];
+
 void fs_getmasterlocation(uint8_t loc[14]) {
 	put32bit(&loc,masterip);
 	put16bit(&loc,masterport);
@@ -579,6 +593,25 @@ uint8_t* fs_createpacket(threc *rec,uint32_t cmd,uint32_t size) {
 	return ptr;
 }
 
+// requests which don't change metadata (other requests make reads go to master for a while)
+static inline int fs_readonly_cmd(const uint8_t *packet) {
+	uint32_t cmd = get32bit(&packet);
+	switch (cmd) {
+		case CLTOMA_FUSE_STATFS:
+		case CLTOMA_FUSE_ACCESS:
+		case CLTOMA_FUSE_LOOKUP:
+		case CLTOMA_FUSE_GETATTR:
+		case CLTOMA_FUSE_READLINK:
+		case CLTOMA_FUSE_GETDIR:
+		case CLTOMA_FUSE_OPEN:
+		case CLTOMA_FUSE_READ_CHUNK:
+		case CLTOMA_FUSE_CHECK:
+		case CLTOMA_FUSE_GETXATTR:
+			return 1;
+	}
+	return 0;
+}
+
 const uint8_t* fs_sendandreceive(threc *rec,uint32_t expected_cmd,uint32_t *answer_leng) {
 	uint32_t cnt;
 	static uint8_t notsup = ERROR_ENOTSUP;
@@ -611,6 +644,9 @@ const uint8_t* fs_sendandreceive(threc *rec,uint32_t expected_cmd,uint32_t *answ
 		master_stats_add(MASTER_BYTESSENT,rec->odataleng);
 		master_stats_inc(MASTER_PACKETSSENT);
 		lastwrite = time(NULL);
+		if (fs_readonly_cmd(rec->obuff)==0) {
+			lastmodify = lastwrite;
+		}
 		pthread_mutex_unlock(&fdlock);
 		// syslog(LOG_NOTICE,"master: lock: %"PRIu32,rec->packetid);
 		pthread_mutex_lock(&(rec->mutex));
@@ -702,6 +738,151 @@ const uint8_t* fs_sendandreceive_any(threc *rec,uint32_t *received_cmd,uint32_t
 	return NULL;
 }
 
+// has to be called with shlock - shadow master checks exports by itself, so the same subfolder and password as for master are used
+static void fs_shadow_connect(void) {
+	uint8_t *regbuff,*wptr;
+	const uint8_t *rptr;
+	uint32_t pleng,cmd,leng;
+	uint8_t havepassword;
+	uint8_t digest[16];
+	md5ctx ctx;
+
+	havepassword = shhavepassword;
+	shretrytime = time(NULL)+SHADOW_RETRY_DELAY;
+	pleng = strlen(connect_args.subfolder)+1;
+	regbuff = malloc(8+13+pleng+32);
+	if (regbuff==NULL) {
+		return;
+	}
+	shfd = tcpsocket();
+	if (shfd<0) {
+		free(regbuff);
+		return;
+	}
+	tcpnodelay(shfd);
+	if ((srcip>0 && tcpnumbind(shfd,srcip,0)<0) || tcpnumtoconnect(shfd,shadowip,shadowport,1000)<0) {
+		tcpclose(shfd);
+		shfd = -1;
+		free(regbuff);
+		return;
+	}
+	if (havepassword) {
+		wptr = regbuff;
+		put32bit(&wptr,CLTOSH_REGISTER);
+		put32bit(&wptr,5);
+		put32bit(&wptr,0);
+		put8bit(&wptr,REGISTER_GETRANDOM);
+		if (tcptowrite(shfd,regbuff,8+5,1000)!=8+5 || tcptoread(shfd,regbuff,8+36,1000)!=8+36) {
+			tcpclose(shfd);
+			shfd = -1;
+			free(regbuff);
+			return;
+		}
+		rptr = regbuff;
+		cmd = get32bit(&rptr);
+		leng = get32bit(&rptr);
+		rptr += 4;
+		if (cmd!=SHTOCL_REGISTER || leng!=36) {
+			tcpclose(shfd);
+			shfd = -1;
+			free(regbuff);
+			return;
+		}
+		md5_init(&ctx);
+		md5_update(&ctx,rptr,16);
+		md5_update(&ctx,shpassworddigest,16);
+		md5_update(&ctx,rptr+16,16);
+		md5_final(digest,&ctx);
+	}
+	wptr = regbuff;
+	put32bit(&wptr,CLTOSH_REGISTER);
+	put32bit(&wptr,13+pleng+(havepassword?16:0));
+	put32bit(&wptr,0);
+	put8bit(&wptr,REGISTER_NEWSESSION);
+	put16bit(&wptr,VERSMAJ);
+	put8bit(&wptr,VERSMID);
+	put8bit(&wptr,VERSMIN);
+	put32bit(&wptr,pleng);
+	memcpy(wptr,connect_args.subfolder,pleng);
+	if (havepassword) {
+		memcpy(wptr+pleng,digest,16);
+	}
+	if (tcptowrite(shfd,regbuff,8+13+pleng+(havepassword?16:0),1000)!=(int32_t)(8+13+pleng+(havepassword?16:0)) || tcptoread(shfd,regbuff,13,1000)!=13) {
+		tcpclose(shfd);
+		shfd = -1;
+		free(regbuff);
+		return;
+	}
+	rptr = regbuff;
+	cmd = get32bit(&rptr);
+	leng = get32bit(&rptr);
+	rptr += 4;
+	if (cmd!=SHTOCL_REGISTER || leng!=5 || rptr[0]!=STATUS_OK) {	// e.g. shadow master without metadata or access denied by its exports - try again later
+		tcpclose(shfd);
+		shfd = -1;
+		free(regbuff);
+		return;
+	}
+	free(regbuff);
+	syslog(LOG_NOTICE,"connected to shadow master");
+}
+
+// sends request to shadow master - when it is not available or not up to date then request is sent to master
+const uint8_t* fs_sendandreceive_ro(threc *rec,uint32_t expected_cmd,uint32_t *answer_leng) {
+	uint8_t hdr[12];
+	const uint8_t *rptr;
+	uint32_t cmd,size,msgid;
+	uint8_t ok;
+	time_t now;
+
+	if (shenabled==0) {
+		return fs_sendandreceive(rec,expected_cmd,answer_leng);
+	}
+	now = time(NULL);
+	pthread_mutex_lock(&fdlock);
+	if (now<lastmodify+SHADOW_MODIFY_DELAY) {	// read own changes from master
+		pthread_mutex_unlock(&fdlock);
+		return fs_sendandreceive(rec,expected_cmd,answer_leng);
+	}
+	pthread_mutex_unlock(&fdlock);
+	pthread_mutex_lock(&shlock);
+	if (shfd<0 && now>=shretrytime) {
+		fs_shadow_connect();
+	}
+	if (shfd<0) {
+		pthread_mutex_unlock(&shlock);
+		return fs_sendandreceive(rec,expected_cmd,answer_leng);
+	}
+	ok = 0;
+	if (tcptowrite(shfd,rec->obuff,rec->odataleng,1000)==(int32_t)(rec->odataleng) && tcptoread(shfd,hdr,12,RECEIVE_TIMEOUT*1000)==12) {
+		rptr = hdr;
+		cmd = get32bit(&rptr);
+		size = get32bit(&rptr);
+		msgid = get32bit(&rptr);
+		if (cmd==expected_cmd && size>=4 && msgid==rec->packetid) {
+			size -= 4;
+			fs_input_buffer_init(rec,size);
+			if (rec->ibuff!=NULL && tcptoread(shfd,rec->ibuff,size,RECEIVE_TIMEOUT*1000)==(int32_t)size) {
+				ok = 1;
+			}
+		}
+	}
+	if (ok==0) {
+		syslog(LOG_WARNING,"shadow master communication error - using master");
+		tcpclose(shfd);
+		shfd = -1;
+		shretrytime = now+SHADOW_RETRY_DELAY;
+		pthread_mutex_unlock(&shlock);
+		return fs_sendandreceive(rec,expected_cmd,answer_leng);
+	}
+	pthread_mutex_unlock(&shlock);
+	if (size==1 && rec->ibuff[0]==ERROR_NOTFRESH) {
+		return fs_sendandreceive(rec,expected_cmd,answer_leng);
+	}
+	*answer_leng = size;
+	return rec->ibuff;
+}
+
 //static inline const uint8_t* fs_sendandreceive(threc *rec,uint32_t expected_cmd,uint32_t *answer_leng) {
 //	uint32_t *rcmd;
 //	const uint8_t *rptr;
@@ -1581,6 +1762,10 @@ int fs_init_master_connection(const char *bindhostname,const char *masterhostnam
 	} else {
 		connect_args.passworddigest = malloc(16);
 		memcpy(connect_args.passworddigest,passworddigest,16);
+		if (donotrememberpassword==0) {
+			memcpy(shpassworddigest,passworddigest,16);
+			shhavepassword = 1;
+		}
 	}
 
 	if (bgregister) {
@@ -1589,6 +1774,16 @@ int fs_init_master_connection(const char *bindhostname,const char *masterhostnam
 	return fs_connect(1,&connect_args);
 }
 
+// called before fork (only for standard sessions)
+int fs_init_shadow_connection(const char *shadowhostname,const char *shadowportname) {
+	if (tcpresolve(shadowhostname,shadowportname,&shadowip,&shadowport,0)<0) {
+		fprintf(stderr,"can't resolve shadow master hostname and/or portname (%s:%s)\n",shadowhostname,shadowportname);
+		return -1;
+	}
+	shenabled = 1;
+	return 0;
+}
+
 // called after fork
 void fs_init_threads(uint32_t retries) {
 	pthread_attr_t thattr;
@@ -1597,6 +1792,7 @@ void fs_init_threads(uint32_t retries) {
 	pthread_mutex_init(&reclock,NULL);
 	pthread_mutex_init(&fdlock,NULL);
 	pthread_mutex_init(&aflock,NULL);
+	pthread_mutex_init(&shlock,NULL);
 	pthread_attr_init(&thattr);
 	pthread_attr_setstacksize(&thattr,0x100000);
 	pthread_create(&rpthid,&thattr,fs_receive_thread,NULL);
@@ -1613,6 +1809,7 @@ void fs_term(void) {
 	pthread_mutex_unlock(&fdlock);
 	pthread_join(npthid,NULL);
 	pthread_join(rpthid,NULL);
+	pthread_mutex_destroy(&shlock);
 	pthread_mutex_destroy(&aflock);
 	pthread_mutex_destroy(&fdlock);
 	pthread_mutex_destroy(&reclock);
@@ -1643,6 +1840,9 @@ void fs_term(void) {
 	if (fd>=0) {
 		tcpclose(fd);
 	}
+	if (shfd>=0) {
+		tcpclose(shfd);
+	}
 	if (connect_args.bindhostname) {
 		free(connect_args.bindhostname);
 	}
@@ -1669,7 +1869,7 @@ void fs_statfs(uint64_t *totalspace,uint64_t *availspace,uint64_t *trashspace,ui
 		*inodes = 0;
 		return;
 	}
-	rptr = fs_sendandreceive(rec,MATOCL_FUSE_STATFS,&i);
+	rptr = fs_sendandreceive_ro(rec,MATOCL_FUSE_STATFS,&i);
 	if (rptr==NULL || i!=36) {
 		*totalspace = 0;
 		*availspace = 0;
@@ -1725,7 +1925,7 @@ uint8_t fs_lookup(uint32_t parent,uint8_t nleng,const uint8_t *name,uint32_t uid
 	wptr+=nleng;
 	put32bit(&wptr,uid);
 	put32bit(&wptr,gid);
-	rptr = fs_sendandreceive(rec,MATOCL_FUSE_LOOKUP,&i);
+	rptr = fs_sendandreceive_ro(rec,MATOCL_FUSE_LOOKUP,&i);
 	if (rptr==NULL) {
 		ret = ERROR_IO;
 	} else if (i==1) {
@@ -1757,7 +1957,7 @@ uint8_t fs_getattr(uint32_t inode,uint32_t uid,uint32_t gid,uint8_t attr[35]) {
 	put32bit(&wptr,inode);
 	put32bit(&wptr,uid);
 	put32bit(&wptr,gid);
-	rptr = fs_sendandreceive(rec,MATOCL_FUSE_GETATTR,&i);
+	rptr = fs_sendandreceive_ro(rec,MATOCL_FUSE_GETATTR,&i);
 	if (rptr==NULL) {
 		ret = ERROR_IO;
 	} else if (i==1) {
@@ -1861,7 +2061,7 @@ uint8_t fs_readlink(uint32_t inode,const uint8_t **path) {
 		return ERROR_IO;
 	}
 	put32bit(&wptr,inode);
-	rptr = fs_sendandreceive(rec,MATOCL_FUSE_READLINK,&i);
+	rptr = fs_sendandreceive_ro(rec,MATOCL_FUSE_READLINK,&i);
 	if (rptr==NULL) {
 		ret = ERROR_IO;
 	} else if (i==1) {
@@ -2163,7 +2363,7 @@ uint8_t fs_getdir(uint32_t inode,uint32_t uid,uint32_t gid,const uint8_t **dbuff
 	put32bit(&wptr,inode);
 	put32bit(&wptr,uid);
 	put32bit(&wptr,gid);
-	rptr = fs_sendandreceive(rec,MATOCL_FUSE_GETDIR,&i);
+	rptr = fs_sendandreceive_ro(rec,MATOCL_FUSE_GETDIR,&i);
 	if (rptr==NULL) {
 		ret = ERROR_IO;
 	} else if (i==1) {
@@ -2195,7 +2395,7 @@ uint8_t fs_getdir_plus(uint32_t inode,uint32_t uid,uint32_t gid,uint8_t addtocac
 		flags |= GETDIR_FLAG_ADDTOCACHE;
 	}
 	put8bit(&wptr,flags);
-	rptr = fs_sendandreceive(rec,MATOCL_FUSE_GETDIR,&i);
+	rptr = fs_sendandreceive_ro(rec,MATOCL_FUSE_GETDIR,&i);
 	if (rptr==NULL) {
 		ret = ERROR_IO;
 	} else if (i==1) {
@@ -2208,6 +2408,56 @@ uint8_t fs_getdir_plus(uint32_t inode,uint32_t uid,uint32_t gid,uint8_t addtocac
 	return ret;
 }
 
+// cursor==0 - first page ; *nextcursor==0 - last page (masters without paged reading always send whole directory)
+uint8_t fs_getdir_page(uint32_t inode,uint32_t uid,uint32_t gid,uint8_t withattr,uint64_t cursor,uint64_t *nextcursor,const uint8_t **dbuff,uint32_t *dbuffsize) {
+	uint8_t *wptr;
+	const uint8_t *rptr;
+	uint32_t i;
+	uint8_t ret;
+	uint8_t flags;
+	threc *rec = fs_get_my_threc();
+	wptr = fs_createpacket(rec,CLTOMA_FUSE_GETDIR,(cursor>0)?21:13);
+	if (wptr==NULL) {
+		return ERROR_IO;
+	}
+	put32bit(&wptr,inode);
+	put32bit(&wptr,uid);
+	put32bit(&wptr,gid);
+	flags = GETDIR_FLAG_PAGED;
+	if (withattr) {
+		flags |= GETDIR_FLAG_WITHATTR;
+	}
+	put8bit(&wptr,flags);
+	if (cursor>0) {
+		put64bit(&wptr,cursor);
+	}
+	rptr = fs_sendandreceive_ro(rec,MATOCL_FUSE_GETDIR,&i);
+	if (rptr==NULL) {
+		ret = ERROR_IO;
+	} else if (i==1) {
+		ret = rptr[0];
+	} else if (rptr[0]==0) {
+		if (i<9) {
+			pthread_mutex_lock(&fdlock);
+			disconnect = 1;
+			pthread_mutex_unlock(&fdlock);
+			ret = ERROR_IO;
+		} else {
+			rptr++;
+			*nextcursor = get64bit(&rptr);
+			*dbuff = rptr;
+			*dbuffsize = i-9;
+			ret = STATUS_OK;
+		}
+	} else {
+		*nextcursor = 0;
+		*dbuff = rptr;
+		*dbuffsize = i;
+		ret = STATUS_OK;
+	}
+	return ret;
+}
+
 /*
 uint8_t fs_check(uint32_t inode,uint8_t dbuff[22]) {
 	uint8_t *wptr;
@@ -2656,7 +2906,7 @@ uint8_t fs_getxattr(uint32_t inode,uint8_t opened,uint32_t uid,uint32_t gid,uint
 	memcpy(wptr,name,nleng);
 	wptr+=nleng;
 	put8bit(&wptr,mode);
-	rptr = fs_sendandreceive(rec,MATOCL_FUSE_GETXATTR,&i);
+	rptr = fs_sendandreceive_ro(rec,MATOCL_FUSE_GETXATTR,&i);
 	if (rptr==NULL) {
 		ret = ERROR_IO;
 	} else if (i==1) {
@@ -2700,7 +2950,7 @@ uint8_t fs_listxattr(uint32_t inode,uint8_t opened,uint32_t uid,uint32_t gid,uin
 	put32bit(&wptr,gid);
 	put8bit(&wptr,0);
 	put8bit(&wptr,mode);
-	rptr = fs_sendandreceive(rec,MATOCL_FUSE_GETXATTR,&i);
+	rptr = fs_sendandreceive_ro(rec,MATOCL_FUSE_GETXATTR,&i);
 	if (rptr==NULL) {
 		ret = ERROR_IO;
 	} else if (i==1) {
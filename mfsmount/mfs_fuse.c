@@ -111,6 +111,8 @@ typedef struct _dirbuf {
 	gid_t gid;
 	const uint8_t *p;
 	size_t size;
+	uint64_t pageoff;	// readdir offset of the beginning of current page
+	uint64_t nextcursor;	// 0 - current page is the last one
 	void *dcache;
 	pthread_mutex_t lock;
 } dirbuf;
@@ -1533,6 +1535,8 @@ void mfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
 		pthread_mutex_lock(&(dirinfo->lock));	// make valgrind happy
 		dirinfo->p = NULL;
 		dirinfo->size = 0;
+		dirinfo->pageoff = 0;
+		dirinfo->nextcursor = 0;
 		dirinfo->dcache = NULL;
 		dirinfo->wasread = 0;
 		pthread_mutex_unlock(&(dirinfo->lock));	// make valgrind happy
@@ -1546,6 +1550,78 @@ void mfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
 	}
 }
 
+// reads one page of directory (cursor==0 - first page) - returns errno
+static int mfs_readdir_getpage(const struct fuse_ctx *ctx,fuse_ino_t ino,dirbuf *dirinfo,uint64_t cursor) {
+	int status;
+	const uint8_t *dbuff;
+	uint32_t dsize;
+	uint8_t needscopy;
+	uint64_t nextcursor;
+/*
+	if (newdircache) {
+		status = dir_cache_getdirdata(ino,&dsize,&dbuff);
+		if (status==1) {	// got dir from new cache
+			mfs_stats_inc(OP_GETDIR_CACHED);
+			needscopy = 0;
+			dirinfo->dataformat = 0;
+			status = 0;
+		} else {
+			status = fs_getdir_plus(ino,ctx->uid,ctx->gid,1,&dbuff,&dsize);
+			if (status==0) {
+				mfs_stats_inc(OP_GETDIR_FULL);
+				dir_cache_newdirdata(ino,dsize,dbuff);
+			}
+			needscopy = 1;
+			dirinfo->dataformat = 1;
+		}
+	} else 
+*/
+	if (usedircache) {
+		status = fs_getdir_page(ino,ctx->uid,ctx->gid,1,cursor,&nextcursor,&dbuff,&dsize);
+		if (status==0) {
+			mfs_stats_inc(OP_GETDIR_FULL);
+		}
+		needscopy = 1;
+		dirinfo->dataformat = 1;
+	} else {
+		status = fs_getdir_page(ino,ctx->uid,ctx->gid,0,cursor,&nextcursor,&dbuff,&dsize);
+		if (status==0) {
+			mfs_stats_inc(OP_GETDIR_SMALL);
+		}
+		needscopy = 1;
+		dirinfo->dataformat = 0;
+	}
+	status = mfs_errorconv(status);
+	if (status!=0) {
+		return status;
+	}
+	if (dirinfo->dcache) {
+		dcache_release(dirinfo->dcache);
+		dirinfo->dcache = NULL;
+	}
+	if (dirinfo->p) {
+		free((uint8_t*)(dirinfo->p));
+		dirinfo->p = NULL;
+	}
+	dirinfo->size = 0;
+	dirinfo->nextcursor = 0;
+	if (needscopy) {
+		dirinfo->p = malloc(dsize);
+		if (dirinfo->p == NULL) {
+			return EINVAL;
+		}
+		memcpy((uint8_t*)(dirinfo->p),dbuff,dsize);
+	} else {
+		dirinfo->p = dbuff;
+	}
+	dirinfo->size = dsize;
+	dirinfo->nextcursor = nextcursor;
+	if (usedircache && dirinfo->dataformat==1) {
+		dirinfo->dcache = dcache_new(ctx,ino,dirinfo->p,dirinfo->size);
+	}
+	return 0;
+}
+
 void mfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
 	int status;
         dirbuf *dirinfo = (dirbuf *)((unsigned long)(fi->fh));
@@ -1572,86 +1648,33 @@ void mfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct
 		return;
 	}
 	pthread_mutex_lock(&(dirinfo->lock));
-	if (dirinfo->wasread==0 || (dirinfo->wasread==1 && off==0)) {
-		const uint8_t *dbuff;
-		uint32_t dsize;
-		uint8_t needscopy;
-/*
-		if (newdircache) {
-			status = dir_cache_getdirdata(ino,&dsize,&dbuff);
-			if (status==1) {	// got dir from new cache
-				mfs_stats_inc(OP_GETDIR_CACHED);
-				needscopy = 0;
-				dirinfo->dataformat = 0;
-				status = 0;
-			} else {
-				status = fs_getdir_plus(ino,ctx->uid,ctx->gid,1,&dbuff,&dsize);
-				if (status==0) {
-					mfs_stats_inc(OP_GETDIR_FULL);
-					dir_cache_newdirdata(ino,dsize,dbuff);
-				}
-				needscopy = 1;
-				dirinfo->dataformat = 1;
-			}
-		} else 
-*/
-		if (usedircache) {
-			status = fs_getdir_plus(ino,ctx->uid,ctx->gid,0,&dbuff,&dsize);
-			if (status==0) {
-				mfs_stats_inc(OP_GETDIR_FULL);
-			}
-			needscopy = 1;
-			dirinfo->dataformat = 1;
-		} else {
-			status = fs_getdir(ino,ctx->uid,ctx->gid,&dbuff,&dsize);
-			if (status==0) {
-				mfs_stats_inc(OP_GETDIR_SMALL);
-			}
-			needscopy = 1;
-			dirinfo->dataformat = 0;
-		}
-		status = mfs_errorconv(status);
-		if (status!=0) {
-			fuse_reply_err(req, status);
-			pthread_mutex_unlock(&(dirinfo->lock));
-			oplog_printf(ctx,"readdir (%lu,%llu,%llu): %s",(unsigned long int)ino,(unsigned long long int)size,(unsigned long long int)off,strerr(status));
-			return;
-		}
-		if (dirinfo->dcache) {
-			dcache_release(dirinfo->dcache);
-			dirinfo->dcache = NULL;
-		}
-		if (dirinfo->p) {
-			free((uint8_t*)(dirinfo->p));
-			dirinfo->p = NULL;
-		}
-		if (needscopy) {
-			dirinfo->p = malloc(dsize);
-			if (dirinfo->p == NULL) {
-				fuse_reply_err(req,EINVAL);
-				pthread_mutex_unlock(&(dirinfo->lock));
-				oplog_printf(ctx,"readdir (%lu,%llu,%llu): %s",(unsigned long int)ino,(unsigned long long int)size,(unsigned long long int)off,strerr(EINVAL));
-				return;
-			}
-			memcpy((uint8_t*)(dirinfo->p),dbuff,dsize);
-		} else {
-			dirinfo->p = dbuff;
-		}
-		dirinfo->size = dsize;
-		if (usedircache && dirinfo->dataformat==1) {
-			dirinfo->dcache = dcache_new(ctx,ino,dirinfo->p,dirinfo->size);
-		}
+	status = 0;
+	if (dirinfo->wasread==0 || (dirinfo->wasread==1 && off==0) || (uint64_t)off<dirinfo->pageoff) {
+		dirinfo->pageoff = 0;
+		status = mfs_readdir_getpage(ctx,ino,dirinfo,0);
+	}
+	// big directories are sent by master in pages - get next ones only when they are needed
+	while (status==0 && dirinfo->nextcursor!=0 && (uint64_t)off>=dirinfo->pageoff+dirinfo->size) {
+		dirinfo->pageoff += dirinfo->size;
+		status = mfs_readdir_getpage(ctx,ino,dirinfo,dirinfo->nextcursor);
+	}
+	if (status!=0) {
+		dirinfo->wasread = 0;
+		fuse_reply_err(req, status);
+		pthread_mutex_unlock(&(dirinfo->lock));
+		oplog_printf(ctx,"readdir (%lu,%llu,%llu): %s",(unsigned long int)ino,(unsigned long long int)size,(unsigned long long int)off,strerr(status));
+		return;
 	}
 	dirinfo->wasread=1;
 
-	if (off>=(off_t)(dirinfo->size)) {
+	if ((uint64_t)off>=dirinfo->pageoff+dirinfo->size) {
 		fuse_reply_buf(req, NULL, 0);
 		oplog_printf(ctx,"readdir (%lu,%llu,%llu): OK (no data)",(unsigned long int)ino,(unsigned long long int)size,(unsigned long long int)off);
 	} else {
 		if (size>READDIR_BUFFSIZE) {
 			size=READDIR_BUFFSIZE;
 		}
-		ptr = dirinfo->p+off;
+		ptr = dirinfo->p+(off-dirinfo->pageoff);
 		eptr = dirinfo->p+dirinfo->size;
 		opos = 0;
 		end = 0;
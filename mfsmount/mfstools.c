@@ -1234,6 +1234,115 @@ int get_eattr(const char *fname,uint8_t mode) {
 	return 0;
 }
 
+// sends set* query and reads answer (without header) - in recursive modes SMODE_BACKGROUND is added to smode (last byte of query), so for big trees
+// master answers at once with id of background job, which is then polled (CLTOMA_FSJOBS_INFO) - result is returned in the same format as direct answer
+uint8_t* master_set_query(int fd,const char *fname,uint8_t *reqbuff,uint32_t reqleng,uint32_t anscmd,uint8_t withquota,uint32_t *aleng) {
+	uint8_t hdr[8],*buff,*wptr;
+	const uint8_t *rptr;
+	uint32_t cmd,leng,jobid,i;
+	uint32_t cnt[4];
+	uint32_t delay;
+
+	if (reqbuff[reqleng-1]&SMODE_RMASK) {
+		reqbuff[reqleng-1] |= SMODE_BACKGROUND;
+	}
+	for (;;) {
+		if (tcpwrite(fd,reqbuff,reqleng)!=(int32_t)reqleng) {
+			printf("%s: master query: send error\n",fname);
+			close_master_conn(1);
+			return NULL;
+		}
+		if (tcpread(fd,hdr,8)!=8) {
+			printf("%s: master query: receive error\n",fname);
+			close_master_conn(1);
+			return NULL;
+		}
+		rptr = hdr;
+		cmd = get32bit(&rptr);
+		leng = get32bit(&rptr);
+		if (cmd!=anscmd) {
+			printf("%s: master query: wrong answer (type)\n",fname);
+			close_master_conn(1);
+			return NULL;
+		}
+		buff = malloc(leng);
+		if (tcpread(fd,buff,leng)!=(int32_t)leng) {
+			printf("%s: master query: receive error\n",fname);
+			free(buff);
+			close_master_conn(1);
+			return NULL;
+		}
+		if (leng==5 && buff[4]==ERROR_EINVAL && (reqbuff[reqleng-1]&SMODE_BACKGROUND)) {	// master without background jobs - ask again the old way
+			reqbuff[reqleng-1] &= ~SMODE_BACKGROUND;
+			free(buff);
+			continue;
+		}
+		break;
+	}
+	if (leng!=9 || buff[4]!=ERROR_DELAYED) {
+		close_master_conn(0);
+		*aleng = leng;
+		return buff;
+	}
+	rptr = buff+5;
+	jobid = get32bit(&rptr);
+	free(buff);
+	buff = malloc(8+33);
+	delay = 10;
+	for (;;) {
+		poll(NULL,0,delay);
+		if (delay<1000) {
+			delay = (delay*2<1000)?delay*2:1000;
+		}
+		wptr = buff;
+		put32bit(&wptr,CLTOMA_FSJOBS_INFO);
+		put32bit(&wptr,4);
+		put32bit(&wptr,jobid);
+		if (tcpwrite(fd,buff,12)!=12) {
+			printf("%s: master query: send error\n",fname);
+			free(buff);
+			close_master_conn(1);
+			return NULL;
+		}
+		if (tcpread(fd,buff,8+33)!=8+33) {
+			printf("%s: master query: receive error\n",fname);
+			free(buff);
+			close_master_conn(1);
+			return NULL;
+		}
+		rptr = buff;
+		cmd = get32bit(&rptr);
+		leng = get32bit(&rptr);
+		if (cmd!=MATOCL_FSJOBS_INFO || leng!=33 || get32bit(&rptr)!=jobid) {
+			printf("%s: master query: wrong answer (job info)\n",fname);
+			free(buff);
+			close_master_conn(1);
+			return NULL;
+		}
+		cmd = get8bit(&rptr);	// status
+		if (cmd!=ERROR_DELAYED) {
+			break;
+		}
+	}
+	close_master_conn(0);
+	if (cmd!=STATUS_OK) {
+		buff[4] = cmd;
+		*aleng = 5;
+		return buff;
+	}
+	rptr += 12;	// visited , queueddirs
+	for (i=0 ; i<4 ; i++) {
+		cnt[i] = get32bit(&rptr);
+	}
+	wptr = buff;
+	put32bit(&wptr,0);	// queryid
+	for (i=0 ; i<(withquota?4U:3U) ; i++) {
+		put32bit(&wptr,cnt[i]);
+	}
+	*aleng = withquota?20:16;
+	return buff;
+}
+
 int set_goal(const char *fname,uint8_t goal,uint8_t mode) {
 	uint8_t reqbuff[22],*wptr,*buff;
 	const uint8_t *rptr;
@@ -1253,32 +1362,10 @@ int set_goal(const char *fname,uint8_t goal,uint8_t mode) {
 	put32bit(&wptr,uid);
 	put8bit(&wptr,goal);
 	put8bit(&wptr,mode);
-	if (tcpwrite(fd,reqbuff,22)!=22) {
-		printf("%s: master query: send error\n",fname);
-		close_master_conn(1);
-		return -1;
-	}
-	if (tcpread(fd,reqbuff,8)!=8) {
-		printf("%s: master query: receive error\n",fname);
-		close_master_conn(1);
-		return -1;
-	}
-	rptr = reqbuff;
-	cmd = get32bit(&rptr);
-	leng = get32bit(&rptr);
-	if (cmd!=MATOCL_FUSE_SETGOAL) {
-		printf("%s: master query: wrong answer (type)\n",fname);
-		close_master_conn(1);
-		return -1;
-	}
-	buff = malloc(leng);
-	if (tcpread(fd,buff,leng)!=(int32_t)leng) {
-		printf("%s: master query: receive error\n",fname);
-		free(buff);
-		close_master_conn(1);
+	buff = master_set_query(fd,fname,reqbuff,22,MATOCL_FUSE_SETGOAL,(VERSHEX>=0x010700)?1:0,&leng);
+	if (buff==NULL) {
 		return -1;
 	}
-	close_master_conn(0);
 	rptr = buff;
 	cmd = get32bit(&rptr);	// queryid
 	if (cmd!=0) {
@@ -1342,32 +1429,10 @@ int set_trashtime(const char *fname,uint32_t trashtime,uint8_t mode) {
 	put32bit(&wptr,uid);
 	put32bit(&wptr,trashtime);
 	put8bit(&wptr,mode);
-	if (tcpwrite(fd,reqbuff,25)!=25) {
-		printf("%s: master query: send error\n",fname);
-		close_master_conn(1);
-		return -1;
-	}
-	if (tcpread(fd,reqbuff,8)!=8) {
-		printf("%s: master query: receive error\n",fname);
-		close_master_conn(1);
-		return -1;
-	}
-	rptr = reqbuff;
-	cmd = get32bit(&rptr);
-	leng = get32bit(&rptr);
-	if (cmd!=MATOCL_FUSE_SETTRASHTIME) {
-		printf("%s: master query: wrong answer (type)\n",fname);
-		close_master_conn(1);
-		return -1;
-	}
-	buff = malloc(leng);
-	if (tcpread(fd,buff,leng)!=(int32_t)leng) {
-		printf("%s: master query: receive error\n",fname);
-		free(buff);
-		close_master_conn(1);
+	buff = master_set_query(fd,fname,reqbuff,25,MATOCL_FUSE_SETTRASHTIME,0,&leng);
+	if (buff==NULL) {
 		return -1;
 	}
-	close_master_conn(0);
 	rptr = buff;
 	cmd = get32bit(&rptr);	// queryid
 	if (cmd!=0) {
@@ -1423,32 +1488,10 @@ int set_eattr(const char *fname,uint8_t eattr,uint8_t mode) {
 	put32bit(&wptr,uid);
 	put8bit(&wptr,eattr);
 	put8bit(&wptr,mode);
-	if (tcpwrite(fd,reqbuff,22)!=22) {
-		printf("%s: master query: send error\n",fname);
-		close_master_conn(1);
+	buff = master_set_query(fd,fname,reqbuff,22,MATOCL_FUSE_SETEATTR,0,&leng);
+	if (buff==NULL) {
 		return -1;
 	}
-	if (tcpread(fd,reqbuff,8)!=8) {
-		printf("%s: master query: receive error\n",fname);
-		close_master_conn(1);
-		return -1;
-	}
-	rptr = reqbuff;
-	cmd = get32bit(&rptr);
-	leng = get32bit(&rptr);
-	if (cmd!=MATOCL_FUSE_SETEATTR) {
-		printf("%s: master query: wrong answer (type)\n",fname);
-		close_master_conn(1);
-		return -1;
-	}
-	buff = malloc(leng);
-	if (tcpread(fd,buff,leng)!=(int32_t)leng) {
-		printf("%s: master query: receive error\n",fname);
-		free(buff);
-		close_master_conn(1);
-		return -1;
-	}
-	close_master_conn(0);
 	rptr = buff;
 	cmd = get32bit(&rptr);	// queryid
 	if (cmd!=0) {
@@ -0,0 +1,45 @@
+/*
+   Copyright 2005-2010 Jakub Kruszona-Zawadzki, Gemius SA.
+
+   This file is part of MooseFS.
+
+   MooseFS is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, version 3.
+
+   MooseFS is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MooseFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+
+#include "random.h"
+#include "exports.h"
+#include "shadowconn.h"
+#include "shadowserv.h"
+
+#define STR_AUX(x) #x
+#define STR(x) STR_AUX(x)
+const char id[]="@(#) version: " STR(VERSMAJ) "." STR(VERSMID) "." STR(VERSMIN) ", written by Jakub Kruszona-Zawadzki";
+
+/* Run Tab */
+typedef int (*runfn)(void);
+struct {
+	runfn fn;
+	char *name;
+} RunTab[]={
+	{rnd_init,"random generator"},
+	{exports_init,"exports manager"},
+	{shadowconn_init,"connection with master"},
+	{shadowserv_init,"shadow master server module"},
+	{(runfn)0,"****"}
+},LateRunTab[]={
+	{(runfn)0,"****"}
+};
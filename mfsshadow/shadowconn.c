@@ -0,0 +1,937 @@
+/*
+   Copyright 2005-2010 Jakub Kruszona-Zawadzki, Gemius SA.
+
+   This file is part of MooseFS.
+
+   MooseFS is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, version 3.
+
+   MooseFS is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MooseFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+
+#include "MFSCommunication.h"
+#include "datapack.h"
+#include "shadowconn.h"
+#include "filesystem.h"
+#include "restore.h"
+#include "merger.h"
+#include "crc.h"
+#include "changelogbin.h"
+#include "cfg.h"
+#include "main.h"
+#include "slogger.h"
+#include "massert.h"
+#include "sockets.h"
+
+#define MaxPacketSize 1500000
+
+#define META_DL_BLOCK 1000000
+
+#define MAXIDHOLE 10000
+
+// mode
+enum {FREE,CONNECTING,HEADER,DATA,KILL};
+
+// metadata state
+enum {SHADOW_EMPTY,SHADOW_SYNC,SHADOW_LIVE,SHADOW_LOST};
+
+typedef struct packetstruct {
+	struct packetstruct *next;
+	uint8_t *startptr;
+	uint32_t bytesleft;
+	uint8_t *packet;
+} packetstruct;
+
+typedef struct masterconn {
+	int mode;
+	int sock;
+	int32_t pdescpos;
+	uint32_t lastread,lastwrite;
+	uint8_t hdrbuff[8];
+	packetstruct inputpacket;
+	packetstruct *outputhead,**outputtail;
+	uint32_t bindip;
+	uint32_t masterip;
+	uint16_t masterport;
+	uint8_t masteraddrvalid;
+
+	uint8_t downloadretrycnt;
+	uint8_t downloading;
+	FILE *livefd;	// changes received during synchronization ("version: change" lines - merged after download)
+	int metafd;
+	uint64_t filesize;
+	uint64_t dloffset;
+	uint64_t dlstartuts;
+} masterconn;
+
+static masterconn *masterconnsingleton=NULL;
+
+static uint8_t shadowstate=SHADOW_EMPTY;
+static uint8_t metaloaded=0;		// fs_init can be called only once - later synchronizations only apply changelogs
+static uint64_t lastcurrent=0;		// main_utime() of last MATOML_CURRENT_VERSION which confirmed that all changes are here
+static uint64_t mastertotalspace=0;
+static uint64_t masteravailspace=0;
+static char *recbuff=NULL;		// binary record converted to text
+static uint32_t recbuffsize=0;
+static char *textbuff=NULL;		// change in form expected by restore
+static uint32_t textbuffsize=0;
+
+// from config
+static char *MasterHost;
+static char *MasterPort;
+static char *BindHost;
+static uint32_t Timeout;
+static uint32_t MaxLag;
+static void* reconnect_hook;
+
+int shadowconn_isloaded(void) {
+	return (shadowstate==SHADOW_LIVE || shadowstate==SHADOW_SYNC || shadowstate==SHADOW_LOST)?1:0;
+}
+
+int shadowconn_isfresh(void) {
+	masterconn *eptr = masterconnsingleton;
+	if (shadowstate!=SHADOW_LIVE || (eptr->mode!=HEADER && eptr->mode!=DATA)) {
+		return 0;
+	}
+	return (main_utime()<=lastcurrent+(uint64_t)MaxLag*1000)?1:0;
+}
+
+void shadowconn_getspace(uint64_t *totalspace,uint64_t *availspace) {
+	*totalspace = mastertotalspace;
+	*availspace = masteravailspace;
+}
+
+uint8_t* shadowconn_createpacket(masterconn *eptr,uint32_t type,uint32_t size) {
+	packetstruct *outpacket;
+	uint8_t *ptr;
+	uint32_t psize;
+
+	outpacket=(packetstruct*)malloc(sizeof(packetstruct));
+	passert(outpacket);
+	psize = size+8;
+	outpacket->packet=malloc(psize);
+	passert(outpacket->packet);
+	outpacket->bytesleft = psize;
+	ptr = outpacket->packet;
+	put32bit(&ptr,type);
+	put32bit(&ptr,size);
+	outpacket->startptr = (uint8_t*)(outpacket->packet);
+	outpacket->next = NULL;
+	*(eptr->outputtail) = outpacket;
+	eptr->outputtail = &(outpacket->next);
+	return ptr;
+}
+
+void shadowconn_sendregister(masterconn *eptr) {
+	uint8_t *buff;
+
+	eptr->downloading=0;
+	eptr->metafd=-1;
+
+	buff = shadowconn_createpacket(eptr,MLTOMA_REGISTER,1+4+2+8);
+	put8bit(&buff,4);
+	put16bit(&buff,VERSMAJ);
+	put8bit(&buff,VERSMID);
+	put8bit(&buff,VERSMIN);
+	put16bit(&buff,Timeout);
+	put64bit(&buff,(shadowstate==SHADOW_LIVE)?fs_getversion()-1:0);
+}
+
+void shadowconn_download_init(masterconn *eptr,uint8_t filenum) {
+	uint8_t *ptr;
+	if ((eptr->mode==HEADER || eptr->mode==DATA) && eptr->downloading==0) {
+		ptr = shadowconn_createpacket(eptr,MLTOMA_DOWNLOAD_START,1);
+		put8bit(&ptr,filenum);
+		eptr->downloading=filenum;
+	}
+}
+
+// downloads metadata and changelogs again - changes received in the meantime are stored in live file
+void shadowconn_sync(masterconn *eptr) {
+	if (shadowstate==SHADOW_SYNC || shadowstate==SHADOW_LOST) {
+		return;
+	}
+	eptr->livefd = fopen("changelog_sh.live.mfs","w");
+	if (eptr->livefd==NULL) {
+		mfs_errlog(LOG_WARNING,"can't create changelog_sh.live.mfs");
+		return;
+	}
+	shadowstate = SHADOW_SYNC;
+	shadowconn_download_init(eptr,1);
+}
+
+void shadowconn_sync_abort(masterconn *eptr) {
+	if (eptr->livefd!=NULL) {
+		fclose(eptr->livefd);
+		eptr->livefd = NULL;
+	}
+	if (shadowstate==SHADOW_SYNC) {
+		shadowstate = metaloaded?SHADOW_LIVE:SHADOW_EMPTY;
+	}
+}
+
+// applies downloaded changelogs and live file on top of current metadata (loads downloaded metadata if there is nothing loaded yet)
+void shadowconn_sync_finish(masterconn *eptr) {
+	char *files[3];
+
+	if (eptr->livefd!=NULL) {
+		fclose(eptr->livefd);
+		eptr->livefd = NULL;
+	}
+	if (metaloaded==0) {
+		if (fs_init("metadata_sh.mfs",0)<0) {
+			syslog(LOG_ERR,"can't load downloaded metadata - shadow master has to be restarted");
+			shadowstate = SHADOW_LOST;
+			return;
+		}
+		metaloaded = 1;
+	}
+	files[0] = "changelog_sh.1.mfs";
+	files[1] = "changelog_sh.0.mfs";
+	files[2] = "changelog_sh.live.mfs";
+	restore_reset();
+	if (merger_start(3,files,MAXIDHOLE)<0 || merger_loop()<0) {
+		syslog(LOG_ERR,"can't apply changes to metadata (version: %"PRIu64") - shadow master has to be restarted",fs_getversion());
+		shadowstate = SHADOW_LOST;
+		return;
+	}
+	unlink("changelog_sh.live.mfs");
+	shadowstate = SHADOW_LIVE;
+	syslog(LOG_NOTICE,"metadata synchronized with master (version: %"PRIu64")",fs_getversion());
+}
+
+// restore expects the same form as merger gives ("version: change") - without version
+void shadowconn_apply(masterconn *eptr,uint64_t version,const char *change) {
+	uint32_t leng;
+
+	if (version<fs_getversion()) {
+		return;
+	}
+	if (version>fs_getversion()) {
+		syslog(LOG_WARNING,"some changes lost: [%"PRIu64"-%"PRIu64"], synchronize metadata again",fs_getversion(),version-1);
+		shadowconn_sync(eptr);
+		if (eptr->livefd) {
+			fprintf(eptr->livefd,"%"PRIu64": %s\n",version,change);
+		}
+		return;
+	}
+	leng = strlen(change);
+	if (leng+4>textbuffsize) {
+		textbuffsize = leng+4;
+		textbuff = realloc(textbuff,textbuffsize);
+		passert(textbuff);
+	}
+	textbuff[0]=':';
+	textbuff[1]=' ';
+	memcpy(textbuff+2,change,leng);
+	textbuff[leng+2]='\n';
+	textbuff[leng+3]='\0';
+	if (restore("(master)",version,textbuff)<0 || fs_getversion()!=version+1) {
+		syslog(LOG_ERR,"can't apply change %"PRIu64" - shadow master has to be restarted",version);
+		shadowstate = SHADOW_LOST;
+	}
+}
+
+void shadowconn_metachanges_log(masterconn *eptr,const uint8_t *data,uint32_t length) {
+	uint64_t version;
+	const char *change;
+
+	if (length==1 && data[0]==0x55) {	// log rotate - nothing to do
+		return;
+	}
+	if (length<10) {
+		syslog(LOG_NOTICE,"MATOML_METACHANGES_LOG - wrong size (%"PRIu32"/9+data)",length);
+		eptr->mode = KILL;
+		return;
+	}
+	if (data[0]==0xFE) {
+		if (changelogbin_check(data+1,length-1)<0) {
+			syslog(LOG_NOTICE,"MATOML_METACHANGES_LOG - damaged record");
+			eptr->mode = KILL;
+			return;
+		}
+		version = changelogbin_version(data+1);
+		if (changelogbin_totext(data+1,length-1,&recbuff,&recbuffsize)==(uint32_t)-1) {
+			syslog(LOG_NOTICE,"MATOML_METACHANGES_LOG - unknown record");
+			eptr->mode = KILL;
+			return;
+		}
+		change = recbuff;
+	} else if (data[0]==0xFF) {
+		if (data[length-1]!='\0') {
+			syslog(LOG_NOTICE,"MATOML_METACHANGES_LOG - invalid string");
+			eptr->mode = KILL;
+			return;
+		}
+		data++;
+		version = get64bit(&data);
+		change = (const char*)data;
+	} else {
+		syslog(LOG_NOTICE,"MATOML_METACHANGES_LOG - wrong packet");
+		eptr->mode = KILL;
+		return;
+	}
+	if (shadowstate==SHADOW_SYNC) {
+		if (eptr->livefd) {
+			fprintf(eptr->livefd,"%"PRIu64": %s\n",version,change);
+		}
+	} else if (shadowstate==SHADOW_LIVE) {
+		shadowconn_apply(eptr,version,change);
+	}
+}
+
+void shadowconn_current_version(masterconn *eptr,const uint8_t *data,uint32_t length) {
+	uint64_t version;
+	if (length!=24) {
+		syslog(LOG_NOTICE,"MATOML_CURRENT_VERSION - wrong size (%"PRIu32"/24)",length);
+		eptr->mode = KILL;
+		return;
+	}
+	version = get64bit(&data);
+	mastertotalspace = get64bit(&data);
+	masteravailspace = get64bit(&data);
+	if (shadowstate==SHADOW_LIVE) {
+		if (fs_getversion()>=version) {
+			lastcurrent = main_utime();
+		} else {	// all changes before this version should be already here
+			syslog(LOG_WARNING,"some changes lost: [%"PRIu64"-%"PRIu64"], synchronize metadata again",fs_getversion(),version-1);
+			shadowconn_sync(eptr);
+		}
+	}
+}
+
+int shadowconn_download_end(masterconn *eptr) {
+	eptr->downloading=0;
+	shadowconn_createpacket(eptr,MLTOMA_DOWNLOAD_END,0);
+	if (eptr->metafd>=0) {
+		if (close(eptr->metafd)<0) {
+			mfs_errlog_silent(LOG_NOTICE,"error closing metafile");
+			eptr->metafd=-1;
+			return -1;
+		}
+		eptr->metafd=-1;
+	}
+	return 0;
+}
+
+int shadowconn_metadata_check(char *name) {
+	int fd;
+	char chkbuff[16];
+	char eofmark[16];
+	fd = open(name,O_RDONLY);
+	if (fd<0) {
+		syslog(LOG_WARNING,"can't open downloaded metadata");
+		return -1;
+	}
+	if (read(fd,chkbuff,8)!=8) {
+		syslog(LOG_WARNING,"can't read downloaded metadata");
+		close(fd);
+		return -1;
+	}
+	if (memcmp(chkbuff,"MFSM NEW",8)==0) { // silently ignore "new file"
+		close(fd);
+		return -1;
+	}
+	if (memcmp(chkbuff,MFSSIGNATURE "M 1.5",8)==0) {
+		memset(eofmark,0,16);
+	} else if (memcmp(chkbuff,MFSSIGNATURE "M 1.7",8)==0 || memcmp(chkbuff,MFSSIGNATURE "M 2.0",8)==0) {
+		memcpy(eofmark,"[MFS EOF MARKER]",16);
+	} else {
+		syslog(LOG_WARNING,"bad metadata file format");
+		close(fd);
+		return -1;
+	}
+	lseek(fd,-16,SEEK_END);
+	if (read(fd,chkbuff,16)!=16) {
+		syslog(LOG_WARNING,"can't read downloaded metadata");
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	if (memcmp(chkbuff,eofmark,16)!=0) {
+		syslog(LOG_WARNING,"truncated metadata file !!!");
+		return -1;
+	}
+	return 0;
+}
+
+// metadata (1) -> changelog.0 (11) -> changelog.1 (12) -> merge
+void shadowconn_download_next(masterconn *eptr) {
+	uint8_t *ptr;
+	uint8_t filenum;
+	int64_t dltime;
+	if (eptr->dloffset>=eptr->filesize) {	// end of file
+		filenum = eptr->downloading;
+		if (shadowconn_download_end(eptr)<0) {
+			return;
+		}
+		dltime = main_utime()-eptr->dlstartuts;
+		if (dltime<=0) {
+			dltime=1;
+		}
+		syslog(LOG_NOTICE,"%s downloaded %"PRIu64"B/%"PRIu64".%06"PRIu32"s (%.3lf MB/s)",(filenum==1)?"metadata":(filenum==11)?"changelog_0":(filenum==12)?"changelog_1":"???",eptr->filesize,dltime/1000000,(uint32_t)(dltime%1000000),(double)(eptr->filesize)/(double)(dltime));
+		if (filenum==1) {
+			if (shadowconn_metadata_check("metadata_sh.tmp")<0 || rename("metadata_sh.tmp","metadata_sh.mfs")<0) {
+				syslog(LOG_NOTICE,"can't use downloaded metadata");
+				shadowconn_sync_abort(eptr);
+				eptr->mode = KILL;
+				return;
+			}
+			shadowconn_download_init(eptr,11);
+		} else if (filenum==11) {
+			if (rename("changelog_sh.tmp","changelog_sh.0.mfs")<0) {
+				syslog(LOG_NOTICE,"can't rename downloaded changelog");
+			}
+			shadowconn_download_init(eptr,12);
+		} else if (filenum==12) {
+			if (rename("changelog_sh.tmp","changelog_sh.1.mfs")<0) {
+				syslog(LOG_NOTICE,"can't rename downloaded changelog");
+			}
+			shadowconn_sync_finish(eptr);
+		}
+	} else {	// send request for next data packet
+		ptr = shadowconn_createpacket(eptr,MLTOMA_DOWNLOAD_DATA,12);
+		put64bit(&ptr,eptr->dloffset);
+		if (eptr->filesize-eptr->dloffset>META_DL_BLOCK) {
+			put32bit(&ptr,META_DL_BLOCK);
+		} else {
+			put32bit(&ptr,eptr->filesize-eptr->dloffset);
+		}
+	}
+}
+
+void shadowconn_download_start(masterconn *eptr,const uint8_t *data,uint32_t length) {
+	if (length!=1 && length!=8) {
+		syslog(LOG_NOTICE,"MATOML_DOWNLOAD_START - wrong size (%"PRIu32"/1|8)",length);
+		eptr->mode = KILL;
+		return;
+	}
+	passert(data);
+	if (length==1) {	// missing changelog is not an error (e.g. master has been just started)
+		if (eptr->downloading==11) {
+			eptr->downloading=0;
+			unlink("changelog_sh.0.mfs");
+			shadowconn_download_init(eptr,12);
+		} else if (eptr->downloading==12) {
+			eptr->downloading=0;
+			unlink("changelog_sh.1.mfs");
+			shadowconn_sync_finish(eptr);
+		} else {
+			syslog(LOG_NOTICE,"download start error");
+			eptr->mode = KILL;
+		}
+		return;
+	}
+	eptr->filesize = get64bit(&data);
+	eptr->dloffset = 0;
+	eptr->downloadretrycnt = 0;
+	eptr->dlstartuts = main_utime();
+	if (eptr->downloading==1) {
+		eptr->metafd = open("metadata_sh.tmp",O_WRONLY | O_TRUNC | O_CREAT,0666);
+	} else if (eptr->downloading==11 || eptr->downloading==12) {
+		eptr->metafd = open("changelog_sh.tmp",O_WRONLY | O_TRUNC | O_CREAT,0666);
+	} else {
+		syslog(LOG_NOTICE,"unexpected MATOML_DOWNLOAD_START packet");
+		eptr->mode = KILL;
+		return;
+	}
+	if (eptr->metafd<0) {
+		mfs_errlog_silent(LOG_NOTICE,"error opening metafile");
+		shadowconn_download_end(eptr);
+		eptr->mode = KILL;
+		return;
+	}
+	shadowconn_download_next(eptr);
+}
+
+void shadowconn_download_data(masterconn *eptr,const uint8_t *data,uint32_t length) {
+	uint64_t offset;
+	uint32_t leng;
+	uint32_t crc;
+	ssize_t ret;
+	if (eptr->metafd<0) {
+		syslog(LOG_NOTICE,"MATOML_DOWNLOAD_DATA - file not opened");
+		eptr->mode = KILL;
+		return;
+	}
+	if (length<16) {
+		syslog(LOG_NOTICE,"MATOML_DOWNLOAD_DATA - wrong size (%"PRIu32"/16+data)",length);
+		eptr->mode = KILL;
+		return;
+	}
+	passert(data);
+	offset = get64bit(&data);
+	leng = get32bit(&data);
+	crc = get32bit(&data);
+	if (leng+16!=length) {
+		syslog(LOG_NOTICE,"MATOML_DOWNLOAD_DATA - wrong size (%"PRIu32"/16+%"PRIu32")",length,leng);
+		eptr->mode = KILL;
+		return;
+	}
+	if (offset!=eptr->dloffset) {
+		syslog(LOG_NOTICE,"MATOML_DOWNLOAD_DATA - unexpected file offset (%"PRIu64"/%"PRIu64")",offset,eptr->dloffset);
+		eptr->mode = KILL;
+		return;
+	}
+	if (offset+leng>eptr->filesize) {
+		syslog(LOG_NOTICE,"MATOML_DOWNLOAD_DATA - unexpected file size (%"PRIu64"/%"PRIu64")",offset+leng,eptr->filesize);
+		eptr->mode = KILL;
+		return;
+	}
+#ifdef HAVE_PWRITE
+	ret = pwrite(eptr->metafd,data,leng,offset);
+#else /* HAVE_PWRITE */
+	lseek(eptr->metafd,offset,SEEK_SET);
+	ret = write(eptr->metafd,data,leng);
+#endif /* HAVE_PWRITE */
+	if (ret!=(ssize_t)leng || crc!=mycrc32(0,data,leng)) {
+		if (ret!=(ssize_t)leng) {
+			mfs_errlog_silent(LOG_NOTICE,"error writing metafile");
+		} else {
+			syslog(LOG_NOTICE,"metafile data crc error");
+		}
+		if (eptr->downloadretrycnt>=5) {
+			eptr->mode = KILL;
+		} else {
+			eptr->downloadretrycnt++;
+			shadowconn_download_next(eptr);
+		}
+		return;
+	}
+	eptr->dloffset+=leng;
+	eptr->downloadretrycnt=0;
+	shadowconn_download_next(eptr);
+}
+
+void shadowconn_beforeclose(masterconn *eptr) {
+	if (eptr->metafd>=0) {
+		close(eptr->metafd);
+		eptr->metafd=-1;
+		unlink("metadata_sh.tmp");
+		unlink("changelog_sh.tmp");
+	}
+	eptr->downloading=0;
+	shadowconn_sync_abort(eptr);
+}
+
+void shadowconn_gotpacket(masterconn *eptr,uint32_t type,const uint8_t *data,uint32_t length) {
+	switch (type) {
+		case ANTOAN_NOP:
+			break;
+		case ANTOAN_UNKNOWN_COMMAND: // for future use
+			break;
+		case ANTOAN_BAD_COMMAND_SIZE: // for future use
+			break;
+		case MATOML_METACHANGES_LOG:
+			shadowconn_metachanges_log(eptr,data,length);
+			break;
+		case MATOML_CURRENT_VERSION:
+			shadowconn_current_version(eptr,data,length);
+			break;
+		case MATOML_DOWNLOAD_START:
+			shadowconn_download_start(eptr,data,length);
+			break;
+		case MATOML_DOWNLOAD_DATA:
+			shadowconn_download_data(eptr,data,length);
+			break;
+		default:
+			syslog(LOG_NOTICE,"got unknown message (type:%"PRIu32")",type);
+			eptr->mode = KILL;
+	}
+}
+
+void shadowconn_term(void) {
+	packetstruct *pptr,*paptr;
+	masterconn *eptr = masterconnsingleton;
+
+	if (eptr->mode!=FREE) {
+		tcpclose(eptr->sock);
+		if (eptr->mode!=CONNECTING) {
+			if (eptr->inputpacket.packet) {
+				free(eptr->inputpacket.packet);
+			}
+			pptr = eptr->outputhead;
+			while (pptr) {
+				if (pptr->packet) {
+					free(pptr->packet);
+				}
+				paptr = pptr;
+				pptr = pptr->next;
+				free(paptr);
+			}
+		}
+		shadowconn_beforeclose(eptr);
+	}
+
+	free(eptr);
+	free(MasterHost);
+	free(MasterPort);
+	free(BindHost);
+	if (recbuff) {
+		free(recbuff);
+	}
+	if (textbuff) {
+		free(textbuff);
+	}
+	masterconnsingleton = NULL;
+}
+
+void shadowconn_connected(masterconn *eptr) {
+	tcpnodelay(eptr->sock);
+	eptr->mode=HEADER;
+	eptr->inputpacket.next = NULL;
+	eptr->inputpacket.bytesleft = 8;
+	eptr->inputpacket.startptr = eptr->hdrbuff;
+	eptr->inputpacket.packet = NULL;
+	eptr->outputhead = NULL;
+	eptr->outputtail = &(eptr->outputhead);
+
+	shadowconn_sendregister(eptr);
+	if (shadowstate==SHADOW_EMPTY) {
+		shadowconn_sync(eptr);
+	}
+	eptr->lastread = eptr->lastwrite = main_time();
+}
+
+int shadowconn_initconnect(masterconn *eptr) {
+	int status;
+	if (eptr->masteraddrvalid==0) {
+		uint32_t mip,bip;
+		uint16_t mport;
+		if (tcpresolve(BindHost,NULL,&bip,NULL,1)>=0) {
+			eptr->bindip = bip;
+		} else {
+			eptr->bindip = 0;
+		}
+		if (tcpresolve(MasterHost,MasterPort,&mip,&mport,0)>=0) {
+			eptr->masterip = mip;
+			eptr->masterport = mport;
+			eptr->masteraddrvalid = 1;
+		} else {
+			mfs_arg_syslog(LOG_WARNING,"can't resolve master host/port (%s:%s)",MasterHost,MasterPort);
+			return -1;
+		}
+	}
+	eptr->sock=tcpsocket();
+	if (eptr->sock<0) {
+		mfs_errlog(LOG_WARNING,"create socket, error");
+		return -1;
+	}
+	if (tcpnonblock(eptr->sock)<0) {
+		mfs_errlog(LOG_WARNING,"set nonblock, error");
+		tcpclose(eptr->sock);
+		eptr->sock = -1;
+		return -1;
+	}
+	if (eptr->bindip>0) {
+		if (tcpnumbind(eptr->sock,eptr->bindip,0)<0) {
+			mfs_errlog(LOG_WARNING,"can't bind socket to given ip");
+			tcpclose(eptr->sock);
+			eptr->sock = -1;
+			return -1;
+		}
+	}
+	status = tcpnumconnect(eptr->sock,eptr->masterip,eptr->masterport);
+	if (status<0) {
+		mfs_errlog(LOG_WARNING,"connect failed, error");
+		tcpclose(eptr->sock);
+		eptr->sock = -1;
+		eptr->masteraddrvalid = 0;
+		return -1;
+	}
+	if (status==0) {
+		syslog(LOG_NOTICE,"connected to Master immediately");
+		shadowconn_connected(eptr);
+	} else {
+		eptr->mode = CONNECTING;
+		syslog(LOG_NOTICE,"connecting ...");
+	}
+	return 0;
+}
+
+void shadowconn_connecttest(masterconn *eptr) {
+	int status;
+
+	status = tcpgetstatus(eptr->sock);
+	if (status) {
+		mfs_errlog_silent(LOG_WARNING,"connection failed, error");
+		tcpclose(eptr->sock);
+		eptr->sock = -1;
+		eptr->mode = FREE;
+		eptr->masteraddrvalid = 0;
+	} else {
+		syslog(LOG_NOTICE,"connected to Master");
+		shadowconn_connected(eptr);
+	}
+}
+
+void shadowconn_read(masterconn *eptr) {
+	int32_t i;
+	uint32_t type,size;
+	const uint8_t *ptr;
+	for (;;) {
+		i=read(eptr->sock,eptr->inputpacket.startptr,eptr->inputpacket.bytesleft);
+		if (i==0) {
+			syslog(LOG_NOTICE,"connection was reset by Master");
+			eptr->mode = KILL;
+			return;
+		}
+		if (i<0) {
+			if (errno!=EAGAIN) {
+				mfs_errlog_silent(LOG_NOTICE,"read from Master error");
+				eptr->mode = KILL;
+			}
+			return;
+		}
+		eptr->inputpacket.startptr+=i;
+		eptr->inputpacket.bytesleft-=i;
+
+		if (eptr->inputpacket.bytesleft>0) {
+			return;
+		}
+
+		if (eptr->mode==HEADER) {
+			ptr = eptr->hdrbuff+4;
+			size = get32bit(&ptr);
+
+			if (size>0) {
+				if (size>MaxPacketSize) {
+					syslog(LOG_WARNING,"Master packet too long (%"PRIu32"/%u)",size,MaxPacketSize);
+					eptr->mode = KILL;
+					return;
+				}
+				eptr->inputpacket.packet = malloc(size);
+				passert(eptr->inputpacket.packet);
+				eptr->inputpacket.bytesleft = size;
+				eptr->inputpacket.startptr = eptr->inputpacket.packet;
+				eptr->mode = DATA;
+				continue;
+			}
+			eptr->mode = DATA;
+		}
+
+		if (eptr->mode==DATA) {
+			ptr = eptr->hdrbuff;
+			type = get32bit(&ptr);
+			size = get32bit(&ptr);
+
+			eptr->mode=HEADER;
+			eptr->inputpacket.bytesleft = 8;
+			eptr->inputpacket.startptr = eptr->hdrbuff;
+
+			shadowconn_gotpacket(eptr,type,eptr->inputpacket.packet,size);
+
+			if (eptr->inputpacket.packet) {
+				free(eptr->inputpacket.packet);
+			}
+			eptr->inputpacket.packet=NULL;
+
+			if (eptr->mode==KILL) {
+				return;
+			}
+		}
+	}
+}
+
+void shadowconn_write(masterconn *eptr) {
+	packetstruct *pack;
+	int32_t i;
+	for (;;) {
+		pack = eptr->outputhead;
+		if (pack==NULL) {
+			return;
+		}
+		i=write(eptr->sock,pack->startptr,pack->bytesleft);
+		if (i<0) {
+			if (errno!=EAGAIN) {
+				mfs_errlog_silent(LOG_NOTICE,"write to Master error");
+				eptr->mode = KILL;
+			}
+			return;
+		}
+		pack->startptr+=i;
+		pack->bytesleft-=i;
+		if (pack->bytesleft>0) {
+			return;
+		}
+		free(pack->packet);
+		eptr->outputhead = pack->next;
+		if (eptr->outputhead==NULL) {
+			eptr->outputtail = &(eptr->outputhead);
+		}
+		free(pack);
+	}
+}
+
+void shadowconn_desc(struct pollfd *pdesc,uint32_t *ndesc) {
+	uint32_t pos = *ndesc;
+	masterconn *eptr = masterconnsingleton;
+
+	eptr->pdescpos = -1;
+	if (eptr->mode==FREE || eptr->sock<0) {
+		return;
+	}
+	if (eptr->mode==HEADER || eptr->mode==DATA) {
+		pdesc[pos].fd = eptr->sock;
+		pdesc[pos].events = POLLIN;
+		eptr->pdescpos = pos;
+		pos++;
+	}
+	if (((eptr->mode==HEADER || eptr->mode==DATA) && eptr->outputhead!=NULL) || eptr->mode==CONNECTING) {
+		if (eptr->pdescpos>=0) {
+			pdesc[eptr->pdescpos].events |= POLLOUT;
+		} else {
+			pdesc[pos].fd = eptr->sock;
+			pdesc[pos].events = POLLOUT;
+			eptr->pdescpos = pos;
+			pos++;
+		}
+	}
+	*ndesc = pos;
+}
+
+void shadowconn_serve(struct pollfd *pdesc) {
+	uint32_t now=main_time();
+	packetstruct *pptr,*paptr;
+	masterconn *eptr = masterconnsingleton;
+
+	if (eptr->pdescpos>=0 && (pdesc[eptr->pdescpos].revents & (POLLHUP | POLLERR))) {
+		if (eptr->mode==CONNECTING) {
+			shadowconn_connecttest(eptr);
+		} else {
+			eptr->mode = KILL;
+		}
+	}
+	if (eptr->mode==CONNECTING) {
+		if (eptr->sock>=0 && eptr->pdescpos>=0 && (pdesc[eptr->pdescpos].revents & POLLOUT)) {
+			shadowconn_connecttest(eptr);
+		}
+	} else {
+		if (eptr->pdescpos>=0) {
+			if ((eptr->mode==HEADER || eptr->mode==DATA) && (pdesc[eptr->pdescpos].revents & POLLIN)) {
+				eptr->lastread = now;
+				shadowconn_read(eptr);
+			}
+			if ((eptr->mode==HEADER || eptr->mode==DATA) && (pdesc[eptr->pdescpos].revents & POLLOUT)) {
+				eptr->lastwrite = now;
+				shadowconn_write(eptr);
+			}
+			if ((eptr->mode==HEADER || eptr->mode==DATA) && eptr->lastread+Timeout<now) {
+				eptr->mode = KILL;
+			}
+			if ((eptr->mode==HEADER || eptr->mode==DATA) && eptr->lastwrite+(Timeout/3)<now && eptr->outputhead==NULL) {
+				shadowconn_createpacket(eptr,ANTOAN_NOP,0);
+			}
+		}
+	}
+	if (eptr->mode == KILL) {
+		shadowconn_beforeclose(eptr);
+		tcpclose(eptr->sock);
+		if (eptr->inputpacket.packet) {
+			free(eptr->inputpacket.packet);
+		}
+		pptr = eptr->outputhead;
+		while (pptr) {
+			if (pptr->packet) {
+				free(pptr->packet);
+			}
+			paptr = pptr;
+			pptr = pptr->next;
+			free(paptr);
+		}
+		eptr->mode = FREE;
+	}
+}
+
+void shadowconn_reconnect(void) {
+	masterconn *eptr = masterconnsingleton;
+	if (eptr->mode==FREE) {
+		shadowconn_initconnect(eptr);
+	}
+}
+
+static void shadowconn_loadconfig(void) {
+	MasterHost = cfg_getstr("MASTER_HOST","mfsmaster");
+	MasterPort = cfg_getstr("MASTER_PORT","9419");
+	BindHost = cfg_getstr("BIND_HOST","*");
+	Timeout = cfg_getuint32("MASTER_TIMEOUT",60);
+	MaxLag = cfg_getuint32("MAX_LAG_MSEC",1500);
+
+	if (Timeout>65536) {
+		Timeout=65535;
+	}
+	if (Timeout<10) {
+		Timeout=10;
+	}
+	if (MaxLag<600) {	// master confirms version every 500ms
+		MaxLag=600;
+	}
+}
+
+void shadowconn_reload(void) {
+	masterconn *eptr = masterconnsingleton;
+	uint32_t ReconnectionDelay;
+
+	free(MasterHost);
+	free(MasterPort);
+	free(BindHost);
+
+	shadowconn_loadconfig();
+
+	eptr->masteraddrvalid = 0;
+	if (eptr->mode!=FREE) {
+		eptr->mode = KILL;
+	}
+
+	ReconnectionDelay = cfg_getuint32("MASTER_RECONNECTION_DELAY",5);
+	main_timechange(reconnect_hook,TIMEMODE_RUN_LATE,ReconnectionDelay,0);
+}
+
+int shadowconn_init(void) {
+	uint32_t ReconnectionDelay;
+	masterconn *eptr;
+
+	ReconnectionDelay = cfg_getuint32("MASTER_RECONNECTION_DELAY",5);
+	shadowconn_loadconfig();
+
+	eptr = masterconnsingleton = malloc(sizeof(masterconn));
+	passert(eptr);
+
+	eptr->masteraddrvalid = 0;
+	eptr->mode = FREE;
+	eptr->pdescpos = -1;
+	eptr->livefd = NULL;
+	eptr->metafd = -1;
+	eptr->downloading = 0;
+
+	if (shadowconn_initconnect(eptr)<0) {
+		return -1;
+	}
+	reconnect_hook = main_timeregister(TIMEMODE_RUN_LATE,ReconnectionDelay,0,shadowconn_reconnect);
+	main_destructregister(shadowconn_term);
+	main_pollregister(shadowconn_desc,shadowconn_serve);
+	main_reloadregister(shadowconn_reload);
+	return 0;
+}
@@ -0,0 +1,31 @@
+/*
+   Copyright 2005-2010 Jakub Kruszona-Zawadzki, Gemius SA.
+
+   This file is part of MooseFS.
+
+   MooseFS is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, version 3.
+
+   MooseFS is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MooseFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SHADOWCONN_H_
+#define _SHADOWCONN_H_
+
+#include <inttypes.h>
+
+// metadata is loaded, changes are applied as they come and master confirmed recently that nothing is missing
+int shadowconn_isfresh(void);
+// metadata is loaded (it can be used for registration, but not for answers)
+int shadowconn_isloaded(void);
+void shadowconn_getspace(uint64_t *totalspace,uint64_t *availspace);
+int shadowconn_init(void);
+
+#endif
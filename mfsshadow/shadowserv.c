@@ -0,0 +1,852 @@
+/*
+   Copyright 2005-2010 Jakub Kruszona-Zawadzki, Gemius SA.
+
+   This file is part of MooseFS.
+
+   MooseFS is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, version 3.
+
+   MooseFS is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MooseFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+
+#include "MFSCommunication.h"
+
+#include "datapack.h"
+#include "shadowserv.h"
+#include "shadowconn.h"
+#include "filesystem.h"
+#include "exports.h"
+#include "random.h"
+#include "cfg.h"
+#include "main.h"
+#include "sockets.h"
+#include "slogger.h"
+#include "massert.h"
+
+#define MaxPacketSize 1000000
+
+#define IDLE_TIMEOUT 300
+
+// shadowservserventry.mode
+enum {KILL,HEADER,DATA};
+
+typedef struct packetstruct {
+	struct packetstruct *next;
+	uint8_t *startptr;
+	uint32_t bytesleft;
+	uint8_t *packet;
+} packetstruct;
+
+typedef struct shadowservserventry {
+	uint8_t registered;
+	uint8_t mode;
+	int sock;
+	void *pollhook;
+	uint8_t pending;			//1 - already in 'pending' list
+	uint32_t lastread,lastwrite;
+	uint32_t peerip;
+	uint8_t hdrbuff[8];
+	packetstruct inputpacket;
+	packetstruct *outputhead,**outputtail;
+
+	uint8_t passwordrnd[32];
+
+	// session data (from exports)
+	uint8_t sesflags;
+	uint32_t rootinode;
+	uint32_t rootuid;
+	uint32_t rootgid;
+	uint32_t mapalluid;
+	uint32_t mapallgid;
+
+	struct shadowservserventry *next,**prev;
+	struct shadowservserventry *nextpending;
+} shadowservserventry;
+
+static shadowservserventry *shadowservhead=NULL;
+static shadowservserventry *shadowservpending=NULL;
+static int lsock;
+static void *lsockhook;
+
+// from config
+static char *ListenHost;
+static char *ListenPort;
+
+static inline void shadowserv_mark_pending(shadowservserventry *eptr) {
+	if (eptr->pending==0) {
+		eptr->pending = 1;
+		eptr->nextpending = shadowservpending;
+		shadowservpending = eptr;
+	}
+}
+
+uint8_t* shadowserv_createpacket(shadowservserventry *eptr,uint32_t type,uint32_t size) {
+	packetstruct *outpacket;
+	uint8_t *ptr;
+	uint32_t psize;
+
+	outpacket=(packetstruct*)malloc(sizeof(packetstruct));
+	passert(outpacket);
+	psize = size+8;
+	outpacket->packet=malloc(psize);
+	passert(outpacket->packet);
+	outpacket->bytesleft = psize;
+	ptr = outpacket->packet;
+	put32bit(&ptr,type);
+	put32bit(&ptr,size);
+	outpacket->startptr = (uint8_t*)(outpacket->packet);
+	outpacket->next = NULL;
+	*(eptr->outputtail) = outpacket;
+	eptr->outputtail = &(outpacket->next);
+	shadowserv_mark_pending(eptr);
+	return ptr;
+}
+
+// answers with ERROR_NOTFRESH when metadata can't be trusted - returns 0 in such case
+static inline int shadowserv_fresh_check(shadowservserventry *eptr,uint32_t type,uint32_t msgid) {
+	uint8_t *ptr;
+	if (shadowconn_isfresh()) {
+		return 1;
+	}
+	ptr = shadowserv_createpacket(eptr,type,5);
+	put32bit(&ptr,msgid);
+	put8bit(&ptr,ERROR_NOTFRESH);
+	return 0;
+}
+
+static inline void shadowserv_ugid_remap(shadowservserventry *eptr,uint32_t *auid,uint32_t *agid) {
+	if (*auid==0) {
+		*auid = eptr->rootuid;
+		if (agid) {
+			*agid = eptr->rootgid;
+		}
+	} else if (eptr->sesflags&SESFLAG_MAPALL) {
+		*auid = eptr->mapalluid;
+		if (agid) {
+			*agid = eptr->mapallgid;
+		}
+	}
+}
+
+// session parameters are taken from exports (the same file as on master) - nothing given by client is trusted
+void shadowserv_register(shadowservserventry *eptr,const uint8_t *data,uint32_t length) {
+	uint32_t msgid,version,pleng,i;
+	const uint8_t *path;
+	uint8_t *ptr;
+	uint8_t rcode,status;
+	uint8_t mingoal,maxgoal;
+	uint32_t mintrashtime,maxtrashtime;
+
+	if (length<5) {
+		syslog(LOG_NOTICE,"CLTOSH_REGISTER - wrong size (%"PRIu32"/>=5)",length);
+		eptr->mode = KILL;
+		return;
+	}
+	msgid = get32bit(&data);
+	rcode = get8bit(&data);
+	switch (rcode) {
+	case REGISTER_GETRANDOM:
+		if (length!=5) {
+			syslog(LOG_NOTICE,"CLTOSH_REGISTER.1 - wrong size (%"PRIu32"/5)",length);
+			eptr->mode = KILL;
+			return;
+		}
+		ptr = shadowserv_createpacket(eptr,SHTOCL_REGISTER,36);
+		put32bit(&ptr,msgid);
+		for (i=0 ; i<32 ; i++) {
+			eptr->passwordrnd[i]=rndu8();
+		}
+		memcpy(ptr,eptr->passwordrnd,32);
+		return;
+	case REGISTER_NEWSESSION:
+		if (length<13) {
+			syslog(LOG_NOTICE,"CLTOSH_REGISTER.2 - wrong size (%"PRIu32"/>=13)",length);
+			eptr->mode = KILL;
+			return;
+		}
+		version = get32bit(&data);
+		pleng = get32bit(&data);
+		if (length!=13+pleng && length!=13+16+pleng) {
+			syslog(LOG_NOTICE,"CLTOSH_REGISTER.2 - wrong size (%"PRIu32"/13+pleng(%"PRIu32")[+16])",length,pleng);
+			eptr->mode = KILL;
+			return;
+		}
+		path = data;
+		data += pleng;
+		if (pleng>0 && data[-1]!=0) {
+			syslog(LOG_NOTICE,"CLTOSH_REGISTER.2 - received path without ending zero");
+			eptr->mode = KILL;
+			return;
+		}
+		if (pleng==0) {
+			path = (const uint8_t*)"";
+		}
+		if (length==13+16+pleng) {
+			status = exports_check(eptr->peerip,version,0,path,eptr->passwordrnd,data,&(eptr->sesflags),&(eptr->rootuid),&(eptr->rootgid),&(eptr->mapalluid),&(eptr->mapallgid),&mingoal,&maxgoal,&mintrashtime,&maxtrashtime);
+		} else {
+			status = exports_check(eptr->peerip,version,0,path,NULL,NULL,&(eptr->sesflags),&(eptr->rootuid),&(eptr->rootgid),&(eptr->mapalluid),&(eptr->mapallgid),&mingoal,&maxgoal,&mintrashtime,&maxtrashtime);
+		}
+		if (status==STATUS_OK) {
+			if (shadowconn_isloaded()==0) {
+				status = ERROR_NOTFRESH;
+			} else {
+				status = fs_getrootinode(&(eptr->rootinode),path);
+			}
+		}
+		if (status==STATUS_OK) {
+			eptr->registered = 1;
+		}
+		ptr = shadowserv_createpacket(eptr,SHTOCL_REGISTER,5);
+		put32bit(&ptr,msgid);
+		put8bit(&ptr,status);
+		return;
+	default:
+		syslog(LOG_NOTICE,"CLTOSH_REGISTER - wrong rcode (%"PRIu8")",rcode);
+		eptr->mode = KILL;
+	}
+}
+
+void shadowserv_fuse_statfs(shadowservserventry *eptr,const uint8_t *data,uint32_t length) {
+	uint64_t totalspace,availspace,trashspace,reservedspace;
+	uint32_t msgid,inodes;
+	uint8_t *ptr;
+	uint8_t status;
+	if (length!=4) {
+		syslog(LOG_NOTICE,"CLTOMA_FUSE_STATFS - wrong size (%"PRIu32"/4)",length);
+		eptr->mode = KILL;
+		return;
+	}
+	msgid = get32bit(&data);
+	if (shadowserv_fresh_check(eptr,MATOCL_FUSE_STATFS,msgid)==0) {
+		return;
+	}
+	status = fs_statfs(eptr->rootinode,eptr->sesflags,&trashspace,&reservedspace,&inodes);
+	if (status!=STATUS_OK) {
+		ptr = shadowserv_createpacket(eptr,MATOCL_FUSE_STATFS,5);
+		put32bit(&ptr,msgid);
+		put8bit(&ptr,status);
+		return;
+	}
+	shadowconn_getspace(&totalspace,&availspace);
+	ptr = shadowserv_createpacket(eptr,MATOCL_FUSE_STATFS,40);
+	put32bit(&ptr,msgid);
+	put64bit(&ptr,totalspace);
+	put64bit(&ptr,availspace);
+	put64bit(&ptr,trashspace);
+	put64bit(&ptr,reservedspace);
+	put32bit(&ptr,inodes);
+}
+
+void shadowserv_fuse_lookup(shadowservserventry *eptr,const uint8_t *data,uint32_t length) {
+	uint32_t inode,uid,gid,auid,agid;
+	uint8_t nleng;
+	const uint8_t *name;
+	uint32_t newinode;
+	uint8_t attr[35];
+	uint32_t msgid;
+	uint8_t *ptr;
+	uint8_t status;
+	if (length<17) {
+		syslog(LOG_NOTICE,"CLTOMA_FUSE_LOOKUP - wrong size (%"PRIu32")",length);
+		eptr->mode = KILL;
+		return;
+	}
+	msgid = get32bit(&data);
+	inode = get32bit(&data);
+	nleng = get8bit(&data);
+	if (length!=17U+nleng) {
+		syslog(LOG_NOTICE,"CLTOMA_FUSE_LOOKUP - wrong size (%"PRIu32":nleng=%"PRIu8")",length,nleng);
+		eptr->mode = KILL;
+		return;
+	}
+	if (shadowserv_fresh_check(eptr,MATOCL_FUSE_LOOKUP,msgid)==0) {
+		return;
+	}
+	name = data;
+	data += nleng;
+	auid = uid = get32bit(&data);
+	agid = gid = get32bit(&data);
+	shadowserv_ugid_remap(eptr,&uid,&gid);
+	status = fs_lookup(eptr->rootinode,eptr->sesflags,inode,nleng,name,uid,gid,auid,agid,&newinode,attr);
+	ptr = shadowserv_createpacket(eptr,MATOCL_FUSE_LOOKUP,(status!=STATUS_OK)?5:43);
+	put32bit(&ptr,msgid);
+	if (status!=STATUS_OK) {
+		put8bit(&ptr,status);
+	} else {
+		put32bit(&ptr,newinode);
+		memcpy(ptr,attr,35);
+	}
+}
+
+void shadowserv_fuse_getattr(shadowservserventry *eptr,const uint8_t *data,uint32_t length) {
+	uint32_t inode,uid,gid,auid,agid;
+	uint8_t attr[35];
+	uint32_t msgid;
+	uint8_t *ptr;
+	uint8_t status;
+	if (length!=8 && length!=16) {
+		syslog(LOG_NOTICE,"CLTOMA_FUSE_GETATTR - wrong size (%"PRIu32"/8,16)",length);
+		eptr->mode = KILL;
+		return;
+	}
+	msgid = get32bit(&data);
+	if (shadowserv_fresh_check(eptr,MATOCL_FUSE_GETATTR,msgid)==0) {
+		return;
+	}
+	inode = get32bit(&data);
+	if (length==16) {
+		auid = uid = get32bit(&data);
+		agid = gid = get32bit(&data);
+		shadowserv_ugid_remap(eptr,&uid,&gid);
+	} else {
+		auid = uid = 12345;
+		agid = gid = 12345;
+	}
+	status = fs_getattr(eptr->rootinode,eptr->sesflags,inode,uid,gid,auid,agid,attr);
+	ptr = shadowserv_createpacket(eptr,MATOCL_FUSE_GETATTR,(status!=STATUS_OK)?5:39);
+	put32bit(&ptr,msgid);
+	if (status!=STATUS_OK) {
+		put8bit(&ptr,status);
+	} else {
+		memcpy(ptr,attr,35);
+	}
+}
+
+void shadowserv_fuse_readlink(shadowservserventry *eptr,const uint8_t *data,uint32_t length) {
+	uint32_t inode;
+	uint32_t pleng;
+	uint8_t *path;
+	uint32_t msgid;
+	uint8_t *ptr;
+	uint8_t status;
+	if (length!=8) {
+		syslog(LOG_NOTICE,"CLTOMA_FUSE_READLINK - wrong size (%"PRIu32"/8)",length);
+		eptr->mode = KILL;
+		return;
+	}
+	msgid = get32bit(&data);
+	if (shadowserv_fresh_check(eptr,MATOCL_FUSE_READLINK,msgid)==0) {
+		return;
+	}
+	inode = get32bit(&data);
+	status = fs_readlink(eptr->rootinode,eptr->sesflags,inode,&pleng,&path);
+	ptr = shadowserv_createpacket(eptr,MATOCL_FUSE_READLINK,(status!=STATUS_OK)?5:8+pleng+1);
+	put32bit(&ptr,msgid);
+	if (status!=STATUS_OK) {
+		put8bit(&ptr,status);
+	} else {
+		put32bit(&ptr,pleng+1);
+		if (pleng>0) {
+			memcpy(ptr,path,pleng);
+		}
+		ptr[pleng]=0;
+	}
+}
+
+void shadowserv_fuse_getdir(shadowservserventry *eptr,const uint8_t *data,uint32_t length) {
+	uint32_t inode,uid,gid,auid,agid;
+	uint8_t flags;
+	uint64_t cursor;
+	uint32_t msgid;
+	uint8_t *ptr;
+	uint8_t status;
+	uint32_t dleng;
+	void *custom;
+	if (length!=16 && length!=17 && length!=25) {
+		syslog(LOG_NOTICE,"CLTOMA_FUSE_GETDIR - wrong size (%"PRIu32"/16|17|25)",length);
+		eptr->mode = KILL;
+		return;
+	}
+	msgid = get32bit(&data);
+	if (shadowserv_fresh_check(eptr,MATOCL_FUSE_GETDIR,msgid)==0) {
+		return;
+	}
+	inode = get32bit(&data);
+	auid = uid = get32bit(&data);
+	agid = gid = get32bit(&data);
+	shadowserv_ugid_remap(eptr,&uid,&gid);
+	if (length>=17) {
+		flags = get8bit(&data);
+	} else {
+		flags = 0;
+	}
+	if (length==25) {
+		cursor = get64bit(&data);
+		if ((flags&GETDIR_FLAG_PAGED)==0) {
+			syslog(LOG_NOTICE,"CLTOMA_FUSE_GETDIR - cursor without paged flag");
+			eptr->mode = KILL;
+			return;
+		}
+	} else {
+		cursor = 0;
+	}
+	status = fs_readdir_size(eptr->rootinode,eptr->sesflags,inode,uid,gid,flags,cursor,&custom,&dleng);
+	ptr = shadowserv_createpacket(eptr,MATOCL_FUSE_GETDIR,(status!=STATUS_OK)?5:4+dleng);
+	put32bit(&ptr,msgid);
+	if (status!=STATUS_OK) {
+		put8bit(&ptr,status);
+	} else {
+		fs_readdir_data(eptr->rootinode,eptr->sesflags,uid,gid,auid,agid,flags,custom,ptr);
+	}
+}
+
+void shadowserv_fuse_getxattr(shadowservserventry *eptr,const uint8_t *data,uint32_t length) {
+	uint32_t inode,uid,gid;
+	uint32_t msgid;
+	uint8_t opened;
+	uint8_t mode;
+	uint8_t *ptr;
+	uint8_t status;
+	uint8_t anleng;
+	const uint8_t *attrname;
+	if (length<19) {
+		syslog(LOG_NOTICE,"CLTOMA_FUSE_GETXATTR - wrong size (%"PRIu32")",length);
+		eptr->mode = KILL;
+		return;
+	}
+	msgid = get32bit(&data);
+	inode = get32bit(&data);
+	opened = get8bit(&data);
+	uid = get32bit(&data);
+	gid = get32bit(&data);
+	shadowserv_ugid_remap(eptr,&uid,&gid);
+	anleng = get8bit(&data);
+	attrname = data;
+	data+=anleng;
+	if (length!=19U+anleng) {
+		syslog(LOG_NOTICE,"CLTOMA_FUSE_GETXATTR - wrong size (%"PRIu32":anleng=%"PRIu8")",length,anleng);
+		eptr->mode = KILL;
+		return;
+	}
+	if (shadowserv_fresh_check(eptr,MATOCL_FUSE_GETXATTR,msgid)==0) {
+		return;
+	}
+	mode = get8bit(&data);
+	if (mode!=MFS_XATTR_GETA_DATA && mode!=MFS_XATTR_LENGTH_ONLY) {
+		ptr = shadowserv_createpacket(eptr,MATOCL_FUSE_GETXATTR,5);
+		put32bit(&ptr,msgid);
+		put8bit(&ptr,ERROR_EINVAL);
+	} else if (anleng==0) {
+		void *xanode;
+		uint32_t xasize;
+		status = fs_listxattr_leng(eptr->rootinode,eptr->sesflags,inode,opened,uid,gid,&xanode,&xasize);
+		ptr = shadowserv_createpacket(eptr,MATOCL_FUSE_GETXATTR,(status!=STATUS_OK)?5:8+((mode==MFS_XATTR_GETA_DATA)?xasize:0));
+		put32bit(&ptr,msgid);
+		if (status!=STATUS_OK) {
+			put8bit(&ptr,status);
+		} else {
+			put32bit(&ptr,xasize);
+			if (mode==MFS_XATTR_GETA_DATA && xasize>0) {
+				fs_listxattr_data(xanode,ptr);
+			}
+		}
+	} else {
+		uint8_t *attrvalue;
+		uint32_t avleng;
+		status = fs_getxattr(eptr->rootinode,eptr->sesflags,inode,opened,uid,gid,anleng,attrname,&avleng,&attrvalue);
+		ptr = shadowserv_createpacket(eptr,MATOCL_FUSE_GETXATTR,(status!=STATUS_OK)?5:8+((mode==MFS_XATTR_GETA_DATA)?avleng:0));
+		put32bit(&ptr,msgid);
+		if (status!=STATUS_OK) {
+			put8bit(&ptr,status);
+		} else {
+			put32bit(&ptr,avleng);
+			if (mode==MFS_XATTR_GETA_DATA && avleng>0) {
+				memcpy(ptr,attrvalue,avleng);
+			}
+		}
+	}
+}
+
+void shadowserv_gotpacket(shadowservserventry *eptr,uint32_t type,const uint8_t *data,uint32_t length) {
+	if (type==ANTOAN_NOP) {
+		return;
+	}
+	if (type==ANTOAN_UNKNOWN_COMMAND) { // for future use
+		return;
+	}
+	if (type==ANTOAN_BAD_COMMAND_SIZE) { // for future use
+		return;
+	}
+	if (eptr->registered==0) {
+		if (type==CLTOSH_REGISTER) {
+			shadowserv_register(eptr,data,length);
+		} else {
+			syslog(LOG_NOTICE,"shadow master server module: got unknown message from unregistered client (type:%"PRIu32")",type);
+			eptr->mode = KILL;
+		}
+		return;
+	}
+	switch (type) {
+		case CLTOMA_FUSE_STATFS:
+			shadowserv_fuse_statfs(eptr,data,length);
+			break;
+		case CLTOMA_FUSE_LOOKUP:
+			shadowserv_fuse_lookup(eptr,data,length);
+			break;
+		case CLTOMA_FUSE_GETATTR:
+			shadowserv_fuse_getattr(eptr,data,length);
+			break;
+		case CLTOMA_FUSE_READLINK:
+			shadowserv_fuse_readlink(eptr,data,length);
+			break;
+		case CLTOMA_FUSE_GETDIR:
+			shadowserv_fuse_getdir(eptr,data,length);
+			break;
+		case CLTOMA_FUSE_GETXATTR:
+			shadowserv_fuse_getxattr(eptr,data,length);
+			break;
+		default:
+			syslog(LOG_NOTICE,"shadow master server module: got unknown message (type:%"PRIu32")",type);
+			eptr->mode = KILL;
+	}
+}
+
+void shadowserv_term(void) {
+	shadowservserventry *eptr,*eptrn;
+	packetstruct *pptr,*pptrn;
+
+	syslog(LOG_NOTICE,"shadow master server module: closing %s:%s",ListenHost,ListenPort);
+	tcpclose(lsock);
+
+	for (eptr = shadowservhead ; eptr ; eptr = eptrn) {
+		eptrn = eptr->next;
+		tcpclose(eptr->sock);
+		if (eptr->inputpacket.packet) {
+			free(eptr->inputpacket.packet);
+		}
+		for (pptr = eptr->outputhead ; pptr ; pptr = pptrn) {
+			pptrn = pptr->next;
+			if (pptr->packet) {
+				free(pptr->packet);
+			}
+			free(pptr);
+		}
+		free(eptr);
+	}
+
+	free(ListenHost);
+	free(ListenPort);
+}
+
+void shadowserv_read(shadowservserventry *eptr) {
+	int32_t i;
+	uint32_t type,size;
+	const uint8_t *ptr;
+	for (;;) {
+		i=read(eptr->sock,eptr->inputpacket.startptr,eptr->inputpacket.bytesleft);
+		if (i==0) {
+			eptr->mode = KILL;
+			return;
+		}
+		if (i<0) {
+			if (errno!=EAGAIN) {
+#ifdef ECONNRESET
+				if (errno!=ECONNRESET) {
+#endif
+					mfs_arg_errlog_silent(LOG_NOTICE,"shadow master server module: (ip:%u.%u.%u.%u) read error",(eptr->peerip>>24)&0xFF,(eptr->peerip>>16)&0xFF,(eptr->peerip>>8)&0xFF,eptr->peerip&0xFF);
+#ifdef ECONNRESET
+				}
+#endif
+				eptr->mode = KILL;
+			}
+			return;
+		}
+		eptr->inputpacket.startptr+=i;
+		eptr->inputpacket.bytesleft-=i;
+
+		if (eptr->inputpacket.bytesleft>0) {
+			return;
+		}
+
+		if (eptr->mode==HEADER) {
+			ptr = eptr->hdrbuff+4;
+			size = get32bit(&ptr);
+
+			if (size>0) {
+				if (size>MaxPacketSize) {
+					syslog(LOG_WARNING,"shadow master server module: packet too long (%"PRIu32"/%u)",size,MaxPacketSize);
+					eptr->mode = KILL;
+					return;
+				}
+				eptr->inputpacket.packet = malloc(size);
+				passert(eptr->inputpacket.packet);
+				eptr->inputpacket.bytesleft = size;
+				eptr->inputpacket.startptr = eptr->inputpacket.packet;
+				eptr->mode = DATA;
+				continue;
+			}
+			eptr->mode = DATA;
+		}
+
+		if (eptr->mode==DATA) {
+			ptr = eptr->hdrbuff;
+			type = get32bit(&ptr);
+			size = get32bit(&ptr);
+
+			eptr->mode=HEADER;
+			eptr->inputpacket.bytesleft = 8;
+			eptr->inputpacket.startptr = eptr->hdrbuff;
+
+			shadowserv_gotpacket(eptr,type,eptr->inputpacket.packet,size);
+
+			if (eptr->inputpacket.packet) {
+				free(eptr->inputpacket.packet);
+			}
+			eptr->inputpacket.packet=NULL;
+
+			if (eptr->mode==KILL) {
+				return;
+			}
+		}
+	}
+}
+
+void shadowserv_write(shadowservserventry *eptr) {
+	packetstruct *pack;
+	int32_t i;
+	for (;;) {
+		pack = eptr->outputhead;
+		if (pack==NULL) {
+			return;
+		}
+		i=write(eptr->sock,pack->startptr,pack->bytesleft);
+		if (i<0) {
+			if (errno!=EAGAIN) {
+				mfs_arg_errlog_silent(LOG_NOTICE,"shadow master server module: (ip:%u.%u.%u.%u) write error",(eptr->peerip>>24)&0xFF,(eptr->peerip>>16)&0xFF,(eptr->peerip>>8)&0xFF,eptr->peerip&0xFF);
+				eptr->mode = KILL;
+			}
+			return;
+		}
+		pack->startptr+=i;
+		pack->bytesleft-=i;
+		if (pack->bytesleft>0) {
+			return;
+		}
+		free(pack->packet);
+		eptr->outputhead = pack->next;
+		if (eptr->outputhead==NULL) {
+			eptr->outputtail = &(eptr->outputhead);
+		}
+		free(pack);
+	}
+}
+
+void shadowserv_close(shadowservserventry *eptr) {
+	packetstruct *pptr,*paptr;
+
+	main_fdunregister(eptr->pollhook);
+	tcpclose(eptr->sock);
+	if (eptr->inputpacket.packet) {
+		free(eptr->inputpacket.packet);
+	}
+	pptr = eptr->outputhead;
+	while (pptr) {
+		if (pptr->packet) {
+			free(pptr->packet);
+		}
+		paptr = pptr;
+		pptr = pptr->next;
+		free(paptr);
+	}
+	*(eptr->prev) = eptr->next;
+	if (eptr->next) {
+		eptr->next->prev = eptr->prev;
+	}
+	free(eptr);
+}
+
+// called once per loop - sends queued packets and closes killed connections
+void shadowserv_flush(void) {
+	uint32_t now=main_time();
+	shadowservserventry *eptr;
+
+	while ((eptr=shadowservpending)) {
+		shadowservpending = eptr->nextpending;
+		eptr->pending = 0;
+		if (eptr->mode!=KILL && eptr->outputhead) {
+			eptr->lastwrite = now;
+			shadowserv_write(eptr);
+		}
+		if (eptr->mode==KILL) {
+			shadowserv_close(eptr);
+		} else {
+			main_fdchange(eptr->pollhook,POLLIN|(eptr->outputhead?POLLOUT:0));
+		}
+	}
+}
+
+void shadowserv_serve_connection(short revents,void *data) {
+	shadowservserventry *eptr = (shadowservserventry*)data;
+	uint32_t now=main_time();
+
+	if (revents & (POLLERR|POLLHUP)) {
+		eptr->mode = KILL;
+	}
+	if ((revents & POLLIN) && eptr->mode!=KILL) {
+		eptr->lastread = now;
+		shadowserv_read(eptr);
+	}
+	if ((revents & POLLOUT) && eptr->mode!=KILL) {
+		eptr->lastwrite = now;
+		shadowserv_write(eptr);
+	}
+	// update mask at once - otherwise ready (level-triggered) descriptor would be returned again before flush
+	main_fdchange(eptr->pollhook,(eptr->mode==KILL)?0:(POLLIN|(eptr->outputhead?POLLOUT:0)));
+	shadowserv_mark_pending(eptr);
+}
+
+void shadowserv_serve_listen(short revents,void *data) {
+	uint32_t now=main_time();
+	shadowservserventry *eptr;
+	int ns;
+
+	(void)data;
+	if ((revents & POLLIN)==0) {
+		return;
+	}
+	ns=tcpaccept(lsock);
+	if (ns<0) {
+		mfs_errlog_silent(LOG_NOTICE,"shadow master server module: accept error");
+	} else {
+		tcpnonblock(ns);
+		tcpnodelay(ns);
+		eptr = malloc(sizeof(shadowservserventry));
+		passert(eptr);
+		eptr->next = shadowservhead;
+		if (eptr->next) {
+			eptr->next->prev = &(eptr->next);
+		}
+		eptr->prev = &shadowservhead;
+		shadowservhead = eptr;
+		eptr->sock = ns;
+		eptr->pending = 0;
+		eptr->nextpending = NULL;
+		tcpgetpeer(ns,&(eptr->peerip),NULL);
+		eptr->registered = 0;
+		eptr->mode = HEADER;
+		eptr->lastread = now;
+		eptr->lastwrite = now;
+		eptr->inputpacket.next = NULL;
+		eptr->inputpacket.bytesleft = 8;
+		eptr->inputpacket.startptr = eptr->hdrbuff;
+		eptr->inputpacket.packet = NULL;
+		eptr->outputhead = NULL;
+		eptr->outputtail = &(eptr->outputhead);
+		eptr->sesflags = 0;
+		eptr->rootinode = MFS_ROOT_ID;
+		eptr->rootuid = 0;
+		eptr->rootgid = 0;
+		eptr->mapalluid = 0;
+		eptr->mapallgid = 0;
+		memset(eptr->passwordrnd,0,32);
+		eptr->pollhook = main_fdregister(ns,POLLIN,shadowserv_serve_connection,eptr);
+	}
+}
+
+// clients don't send keep-alive packets to shadow master, so only really idle connections are closed
+void shadowserv_check_connections(void) {
+	uint32_t now=main_time();
+	shadowservserventry *eptr;
+
+	for (eptr=shadowservhead ; eptr ; eptr=eptr->next) {
+		if (eptr->mode!=KILL && eptr->lastread+IDLE_TIMEOUT<now) {
+			eptr->mode = KILL;
+			shadowserv_mark_pending(eptr);
+		}
+	}
+	shadowserv_flush();
+}
+
+void shadowserv_reload(void) {
+	char *oldListenHost,*oldListenPort;
+	int newlsock;
+
+	oldListenHost = ListenHost;
+	oldListenPort = ListenPort;
+	ListenHost = cfg_getstr("SHTOCL_LISTEN_HOST","*");
+	ListenPort = cfg_getstr("SHTOCL_LISTEN_PORT","9423");
+	if (strcmp(oldListenHost,ListenHost)==0 && strcmp(oldListenPort,ListenPort)==0) {
+		free(oldListenHost);
+		free(oldListenPort);
+		mfs_arg_syslog(LOG_NOTICE,"shadow master server module: socket address hasn't changed (%s:%s)",ListenHost,ListenPort);
+		return;
+	}
+
+	newlsock = tcpsocket();
+	if (newlsock<0) {
+		mfs_errlog(LOG_WARNING,"shadow master server module: socket address has changed, but can't create new socket");
+		free(ListenHost);
+		free(ListenPort);
+		ListenHost = oldListenHost;
+		ListenPort = oldListenPort;
+		return;
+	}
+	tcpnonblock(newlsock);
+	tcpnodelay(newlsock);
+	tcpreuseaddr(newlsock);
+	if (tcpstrlisten(newlsock,ListenHost,ListenPort,100)<0) {
+		mfs_arg_errlog(LOG_ERR,"shadow master server module: socket address has changed, but can't listen on socket (%s:%s)",ListenHost,ListenPort);
+		free(ListenHost);
+		free(ListenPort);
+		ListenHost = oldListenHost;
+		ListenPort = oldListenPort;
+		tcpclose(newlsock);
+		return;
+	}
+	mfs_arg_syslog(LOG_NOTICE,"shadow master server module: socket address has changed, now listen on %s:%s",ListenHost,ListenPort);
+	free(oldListenHost);
+	free(oldListenPort);
+	main_fdunregister(lsockhook);
+	tcpclose(lsock);
+	lsock = newlsock;
+	lsockhook = main_fdregister(lsock,POLLIN,shadowserv_serve_listen,NULL);
+}
+
+int shadowserv_init(void) {
+	ListenHost = cfg_getstr("SHTOCL_LISTEN_HOST","*");
+	ListenPort = cfg_getstr("SHTOCL_LISTEN_PORT","9423");
+
+	lsock = tcpsocket();
+	if (lsock<0) {
+		mfs_errlog(LOG_ERR,"shadow master server module: can't create socket");
+		return -1;
+	}
+	tcpnonblock(lsock);
+	tcpnodelay(lsock);
+	tcpreuseaddr(lsock);
+	if (tcpstrlisten(lsock,ListenHost,ListenPort,100)<0) {
+		mfs_arg_errlog(LOG_ERR,"shadow master server module: can't listen on %s:%s",ListenHost,ListenPort);
+		return -1;
+	}
+	mfs_arg_syslog(LOG_NOTICE,"shadow master server module: listen on %s:%s",ListenHost,ListenPort);
+
+	shadowservhead = NULL;
+	shadowservpending = NULL;
+
+	main_timeregister(TIMEMODE_RUN_LATE,1,0,shadowserv_check_connections);
+	main_reloadregister(shadowserv_reload);
+	main_destructregister(shadowserv_term);
+	lsockhook = main_fdregister(lsock,POLLIN,shadowserv_serve_listen,NULL);
+	main_eachloopregister(shadowserv_flush);
+	return 0;
+}
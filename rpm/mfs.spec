@@ -99,6 +99,7 @@ rm -rf $RPM_BUILD_ROOT
 %attr(755,root,root) %{_sbindir}/mfsmaster
 %attr(755,root,root) %{_sbindir}/mfsmetadump
 %attr(755,root,root) %{_sbindir}/mfsmetarestore
+%attr(755,root,root) %{_sbindir}/mfsshadow
 %{_mandir}/man5/mfsexports.cfg.5*
 %{_mandir}/man5/mfstopology.cfg.5*
 %{_mandir}/man5/mfsmaster.cfg.5*
@@ -106,9 +107,11 @@ rm -rf $RPM_BUILD_ROOT
 %{_mandir}/man7/moosefs.7*
 %{_mandir}/man8/mfsmaster.8*
 %{_mandir}/man8/mfsmetarestore.8*
+%{_mandir}/man8/mfsshadow.8*
 %{mfsconfdir}/mfsexports.cfg.dist
 %{mfsconfdir}/mfstopology.cfg.dist
 %{mfsconfdir}/mfsmaster.cfg.dist
+%{mfsconfdir}/mfsshadow.cfg.dist
 %dir %{_localstatedir}/mfs
 %{_localstatedir}/mfs/metadata.mfs.empty
 %if "%{distro}" == "rh"